@@ -0,0 +1,287 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "AV1Parser"
+
+#include <v4l2_codec2/common/AV1Parser.h>
+
+#include <media/stagefright/foundation/ABitReader.h>
+#include <utils/Log.h>
+
+namespace android {
+
+namespace {
+
+constexpr uint32_t kObuSequenceHeader = 1;
+
+// The AV1CodecConfigurationRecord starts with marker (1) + version (7), which are always 0x81.
+constexpr uint8_t kAV1CodecConfigurationRecordMarker = 0x81;
+constexpr size_t kAV1CodecConfigurationRecordHeaderSize = 4;
+
+constexpr uint32_t kPrimariesBT709 = 1;
+constexpr uint32_t kTransferSRGB = 13;
+constexpr uint32_t kMatrixIdentity = 0;
+
+// Read an unsigned integer encoded with leb128() (AV1 specification section 4.10.5).
+bool readLeb128(const uint8_t** data, const uint8_t* end, uint64_t* value) {
+    *value = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        if (*data >= end) return false;
+        const uint8_t byte = *(*data)++;
+        *value |= static_cast<uint64_t>(byte & 0x7f) << (i * 7);
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Read an unsigned integer encoded with uvlc() (AV1 specification section 4.10.3).
+bool readUvlc(ABitReader* br, uint32_t* value) {
+    uint32_t leadingZeros = 0;
+    uint32_t bit;
+    if (!br->getBitsGraceful(1, &bit)) return false;
+    while (bit == 0) {
+        if (++leadingZeros >= 32) {
+            *value = UINT32_MAX;
+            return true;
+        }
+        if (!br->getBitsGraceful(1, &bit)) return false;
+    }
+    if (!br->getBitsGraceful(leadingZeros, value)) return false;
+    *value += (1u << leadingZeros) - 1;
+    return true;
+}
+
+// Parse the color_config() syntax (AV1 specification section 5.5.2).
+bool parseColorConfig(ABitReader* br, AV1SequenceHeader* header) {
+    uint32_t highBitdepth;
+    if (!br->getBitsGraceful(1, &highBitdepth)) return false;  // high_bitdepth
+    header->bitDepth = highBitdepth ? 10 : 8;
+    if (header->seqProfile == 2 && highBitdepth) {
+        uint32_t twelveBit;
+        if (!br->getBitsGraceful(1, &twelveBit)) return false;  // twelve_bit
+        header->bitDepth = twelveBit ? 12 : 10;
+    }
+
+    uint32_t monoChrome = 0;
+    if (header->seqProfile != 1) {
+        if (!br->getBitsGraceful(1, &monoChrome)) return false;  // mono_chrome
+    }
+    header->monoChrome = monoChrome;
+
+    uint32_t colorDescriptionPresentFlag;
+    if (!br->getBitsGraceful(1, &colorDescriptionPresentFlag))
+        return false;  // color_description_present_flag
+    header->colorDescriptionPresentFlag = colorDescriptionPresentFlag;
+    if (colorDescriptionPresentFlag) {
+        if (!br->getBitsGraceful(8, &header->colorPrimaries)) return false;  // color_primaries
+        if (!br->getBitsGraceful(8, &header->transferCharacteristics))
+            return false;  // transfer_characteristics
+        if (!br->getBitsGraceful(8, &header->matrixCoefficients))
+            return false;  // matrix_coefficients
+    }
+
+    uint32_t colorRange = 0;
+    if (monoChrome) {
+        if (!br->getBitsGraceful(1, &colorRange)) return false;  // color_range
+        header->colorRange = colorRange;
+        // separate_uv_delta_q is not present for monochrome streams.
+        return true;
+    }
+
+    if (header->colorPrimaries == kPrimariesBT709 &&
+        header->transferCharacteristics == kTransferSRGB &&
+        header->matrixCoefficients == kMatrixIdentity) {
+        colorRange = 1;
+    } else {
+        if (!br->getBitsGraceful(1, &colorRange)) return false;  // color_range
+        uint32_t subsamplingX = 1;
+        uint32_t subsamplingY = 1;
+        if (header->seqProfile == 1) {
+            subsamplingX = 0;
+            subsamplingY = 0;
+        } else if (header->seqProfile == 2) {
+            subsamplingY = 0;
+            if (header->bitDepth == 12) {
+                if (!br->getBitsGraceful(1, &subsamplingX)) return false;  // subsampling_x
+                if (subsamplingX && !br->getBitsGraceful(1, &subsamplingY))
+                    return false;  // subsampling_y
+            } else {
+                subsamplingX = 1;
+            }
+        }
+        if (subsamplingX && subsamplingY) {
+            br->skipBits(2);  // chroma_sample_position
+        }
+    }
+    header->colorRange = colorRange;
+    br->skipBits(1);  // separate_uv_delta_q
+    return true;
+}
+
+// Parse the sequence_header_obu() syntax in |data| (AV1 specification section 5.5.1).
+bool parseSequenceHeaderObu(const uint8_t* data, size_t length, AV1SequenceHeader* header) {
+    ABitReader br(data, length);
+    uint32_t unused;
+
+    if (!br.getBitsGraceful(3, &header->seqProfile)) return false;  // seq_profile
+    br.skipBits(1);                                                  // still_picture
+    uint32_t reducedStillPictureHeader;
+    if (!br.getBitsGraceful(1, &reducedStillPictureHeader))
+        return false;  // reduced_still_picture_header
+
+    if (reducedStillPictureHeader) {
+        br.skipBits(5);  // seq_level_idx[0]
+    } else {
+        uint32_t timingInfoPresentFlag;
+        uint32_t decoderModelInfoPresentFlag = 0;
+        uint32_t bufferDelayLengthMinus1 = 0;
+        if (!br.getBitsGraceful(1, &timingInfoPresentFlag))
+            return false;  // timing_info_present_flag
+        if (timingInfoPresentFlag) {
+            br.skipBits(64);  // num_units_in_display_tick + time_scale
+            uint32_t equalPictureInterval;
+            if (!br.getBitsGraceful(1, &equalPictureInterval))
+                return false;  // equal_picture_interval
+            if (equalPictureInterval && !readUvlc(&br, &unused))
+                return false;  // num_ticks_per_picture_minus_1
+            if (!br.getBitsGraceful(1, &decoderModelInfoPresentFlag))
+                return false;  // decoder_model_info_present_flag
+            if (decoderModelInfoPresentFlag) {
+                if (!br.getBitsGraceful(5, &bufferDelayLengthMinus1))
+                    return false;  // buffer_delay_length_minus_1
+                // num_units_in_decoding_tick + buffer_removal_time_length_minus_1 +
+                // frame_presentation_time_length_minus_1
+                br.skipBits(42);
+            }
+        }
+
+        uint32_t initialDisplayDelayPresentFlag;
+        if (!br.getBitsGraceful(1, &initialDisplayDelayPresentFlag))
+            return false;  // initial_display_delay_present_flag
+        uint32_t operatingPointsCntMinus1;
+        if (!br.getBitsGraceful(5, &operatingPointsCntMinus1))
+            return false;  // operating_points_cnt_minus_1
+        for (uint32_t i = 0; i <= operatingPointsCntMinus1; ++i) {
+            br.skipBits(12);  // operating_point_idc[i]
+            uint32_t seqLevelIdx;
+            if (!br.getBitsGraceful(5, &seqLevelIdx)) return false;  // seq_level_idx[i]
+            if (seqLevelIdx > 7) {
+                br.skipBits(1);  // seq_tier[i]
+            }
+            if (decoderModelInfoPresentFlag) {
+                uint32_t decoderModelPresentForThisOp;
+                if (!br.getBitsGraceful(1, &decoderModelPresentForThisOp))
+                    return false;  // decoder_model_present_for_this_op[i]
+                if (decoderModelPresentForThisOp) {
+                    // decoder_buffer_delay[i] + encoder_buffer_delay[i] + low_delay_mode_flag[i]
+                    br.skipBits(2 * (bufferDelayLengthMinus1 + 1) + 1);
+                }
+            }
+            if (initialDisplayDelayPresentFlag) {
+                uint32_t initialDisplayDelayPresentForThisOp;
+                if (!br.getBitsGraceful(1, &initialDisplayDelayPresentForThisOp))
+                    return false;  // initial_display_delay_present_for_this_op[i]
+                if (initialDisplayDelayPresentForThisOp) {
+                    br.skipBits(4);  // initial_display_delay_minus_1[i]
+                }
+            }
+        }
+    }
+
+    uint32_t frameWidthBitsMinus1;
+    uint32_t frameHeightBitsMinus1;
+    if (!br.getBitsGraceful(4, &frameWidthBitsMinus1)) return false;  // frame_width_bits_minus_1
+    if (!br.getBitsGraceful(4, &frameHeightBitsMinus1)) return false;  // frame_height_bits_minus_1
+    br.skipBits(frameWidthBitsMinus1 + 1);   // max_frame_width_minus_1
+    br.skipBits(frameHeightBitsMinus1 + 1);  // max_frame_height_minus_1
+
+    uint32_t frameIdNumbersPresentFlag = 0;
+    if (!reducedStillPictureHeader && !br.getBitsGraceful(1, &frameIdNumbersPresentFlag))
+        return false;  // frame_id_numbers_present_flag
+    if (frameIdNumbersPresentFlag) {
+        // delta_frame_id_length_minus_2 + additional_frame_id_length_minus_1
+        br.skipBits(7);
+    }
+
+    br.skipBits(3);  // use_128x128_superblock + enable_filter_intra + enable_intra_edge_filter
+    if (!reducedStillPictureHeader) {
+        // enable_interintra_compound + enable_masked_compound + enable_warped_motion +
+        // enable_dual_filter
+        br.skipBits(4);
+        uint32_t enableOrderHint;
+        if (!br.getBitsGraceful(1, &enableOrderHint)) return false;  // enable_order_hint
+        if (enableOrderHint) {
+            br.skipBits(2);  // enable_jnt_comp + enable_ref_frame_mvs
+        }
+        uint32_t seqChooseScreenContentTools;
+        if (!br.getBitsGraceful(1, &seqChooseScreenContentTools))
+            return false;  // seq_choose_screen_content_tools
+        uint32_t seqForceScreenContentTools = 2;  // SELECT_SCREEN_CONTENT_TOOLS
+        if (!seqChooseScreenContentTools && !br.getBitsGraceful(1, &seqForceScreenContentTools))
+            return false;  // seq_force_screen_content_tools
+        if (seqForceScreenContentTools > 0) {
+            uint32_t seqChooseIntegerMv;
+            if (!br.getBitsGraceful(1, &seqChooseIntegerMv))
+                return false;  // seq_choose_integer_mv
+            if (!seqChooseIntegerMv) {
+                br.skipBits(1);  // seq_force_integer_mv
+            }
+        }
+        if (enableOrderHint) {
+            br.skipBits(3);  // order_hint_bits_minus_1
+        }
+    }
+    br.skipBits(3);  // enable_superres + enable_cdef + enable_restoration
+
+    if (!parseColorConfig(&br, header)) return false;
+
+    uint32_t filmGrainParamsPresent;
+    if (!br.getBitsGraceful(1, &filmGrainParamsPresent))
+        return false;  // film_grain_params_present
+    header->filmGrainParamsPresent = filmGrainParamsPresent;
+    return true;
+}
+
+}  // namespace
+
+bool parseAV1SequenceHeader(const uint8_t* data, size_t length, AV1SequenceHeader* header) {
+    ALOG_ASSERT(header);
+
+    // The OBUs of an AV1CodecConfigurationRecord follow its fixed-size header.
+    if (length > kAV1CodecConfigurationRecordHeaderSize &&
+        data[0] == kAV1CodecConfigurationRecordMarker) {
+        data += kAV1CodecConfigurationRecordHeaderSize;
+        length -= kAV1CodecConfigurationRecordHeaderSize;
+    }
+
+    const uint8_t* pos = data;
+    const uint8_t* end = data + length;
+    while (pos < end) {
+        // obu_header(): forbidden_bit (1) + obu_type (4) + obu_extension_flag (1) +
+        // obu_has_size_field (1) + obu_reserved_1bit (1)
+        const uint8_t obuHeader = *pos++;
+        const uint32_t obuType = (obuHeader >> 3) & 0xf;
+        const bool obuExtensionFlag = obuHeader & 0x4;
+        const bool obuHasSizeField = obuHeader & 0x2;
+        if (obuExtensionFlag) ++pos;  // temporal_id (3) + spatial_id (2) + reserved (3)
+        if (pos > end) return false;
+
+        uint64_t obuSize = end - pos;
+        if (obuHasSizeField && !readLeb128(&pos, end, &obuSize)) return false;
+        if (obuSize > static_cast<uint64_t>(end - pos)) {
+            ALOGV("OBU size exceeds the data size");
+            return false;
+        }
+
+        if (obuType == kObuSequenceHeader) {
+            return parseSequenceHeaderObu(pos, obuSize, header);
+        }
+        pos += obuSize;
+    }
+
+    return false;
+}
+
+}  // namespace android
@@ -14,6 +14,7 @@
 #include <ui/GraphicBuffer.h>
 #include <utils/Log.h>
 
+#include <v4l2_codec2/common/HEVCNalParser.h>
 #include <v4l2_codec2/common/NalParser.h>
 
 namespace android {
@@ -44,6 +45,18 @@ bool copyNALUPrependingStartCode(const uint8_t* src, size_t srcSize, uint8_t** d
 
 }  // namespace
 
+bool isTenBitProfile(C2Config::profile_t profile) {
+    switch (profile) {
+    case C2Config::PROFILE_VP9_2:
+    case C2Config::PROFILE_HEVC_MAIN_10:
+    case C2Config::PROFILE_HEVC_MAIN_10_HDR10:
+    case C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS:
+        return true;
+    default:
+        return false;
+    }
+}
+
 uint8_t c2LevelToV4L2Level(C2Config::level_t level) {
     switch (level) {
     case C2Config::LEVEL_AVC_1:
@@ -78,6 +91,26 @@ uint8_t c2LevelToV4L2Level(C2Config::level_t level) {
         return V4L2_MPEG_VIDEO_H264_LEVEL_5_0;
     case C2Config::LEVEL_AVC_5_1:
         return V4L2_MPEG_VIDEO_H264_LEVEL_5_1;
+    case C2Config::LEVEL_HEVC_MAIN_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_1;
+    case C2Config::LEVEL_HEVC_MAIN_2:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_2;
+    case C2Config::LEVEL_HEVC_MAIN_2_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_2_1;
+    case C2Config::LEVEL_HEVC_MAIN_3:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_3;
+    case C2Config::LEVEL_HEVC_MAIN_3_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_3_1;
+    case C2Config::LEVEL_HEVC_MAIN_4:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_4;
+    case C2Config::LEVEL_HEVC_MAIN_4_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_4_1;
+    case C2Config::LEVEL_HEVC_MAIN_5:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_5;
+    case C2Config::LEVEL_HEVC_MAIN_5_1:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_5_1;
+    case C2Config::LEVEL_HEVC_MAIN_5_2:
+        return V4L2_MPEG_VIDEO_HEVC_LEVEL_5_2;
     default:
         ALOGE("Unrecognizable C2 level (value = 0x%x)...", level);
         return 0;
@@ -127,15 +160,69 @@ bool extractSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* sps
             memcpy(pps->data(), parser.data(), parser.length());
             foundPPS = true;
             break;
+        case NalParser::kNonIDRType:
+        case NalParser::kIDRType:
+            // The parameter sets are emitted in front of the slices, so the remainder of the frame
+            // doesn't need to be scanned.
+            return false;
         }
     }
     return foundSPS && foundPPS;
 }
 
-bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, const uint8_t* data,
-                    size_t length) {
+bool extractVPSSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* vps,
+                      std::vector<uint8_t>* sps, std::vector<uint8_t>* pps) {
+    bool foundVPS = false;
+    bool foundSPS = false;
+    bool foundPPS = false;
+    HEVCNalParser parser(data, length);
+    while (!(foundVPS && foundSPS && foundPPS) && parser.locateNextNal()) {
+        if (parser.length() == 0) continue;
+        switch (parser.type()) {
+        case HEVCNalParser::kVPSType:
+            vps->assign(parser.data(), parser.data() + parser.length());
+            foundVPS = true;
+            break;
+        case HEVCNalParser::kSPSType:
+            sps->assign(parser.data(), parser.data() + parser.length());
+            foundSPS = true;
+            break;
+        case HEVCNalParser::kPPSType:
+            pps->assign(parser.data(), parser.data() + parser.length());
+            foundPPS = true;
+            break;
+        default:
+            // The parameter sets are emitted in front of the slices (NAL unit types 0-31), so the
+            // remainder of the frame doesn't need to be scanned.
+            if (parser.type() < HEVCNalParser::kVPSType) return false;
+            break;
+        }
+    }
+    return foundVPS && foundSPS && foundPPS;
+}
+
+bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, VideoCodec codec,
+                    const uint8_t* data, size_t length) {
     csd->reset();
 
+    if (codec == VideoCodec::HEVC) {
+        std::vector<uint8_t> vps;
+        std::vector<uint8_t> sps;
+        std::vector<uint8_t> pps;
+        if (!extractVPSSPSPPS(data, length, &vps, &sps, &pps)) {
+            return false;
+        }
+
+        size_t configDataLength = vps.size() + sps.size() + pps.size() + (3u * kH264StartCodeSize);
+        ALOGV("Extracted codec config data: length=%zu", configDataLength);
+
+        *csd = C2StreamInitDataInfo::output::AllocUnique(configDataLength, 0u);
+        uint8_t* csdBuffer = (*csd)->m.value;
+        return copyNALUPrependingStartCode(vps.data(), vps.size(), &csdBuffer, &configDataLength) &&
+               copyNALUPrependingStartCode(sps.data(), sps.size(), &csdBuffer, &configDataLength) &&
+               copyNALUPrependingStartCode(pps.data(), pps.size(), &csdBuffer, &configDataLength);
+    }
+
     std::vector<uint8_t> sps;
     std::vector<uint8_t> pps;
     if (!extractSPSPPS(data, length, &sps, &pps)) {
@@ -207,4 +294,65 @@ size_t prependSPSPPSToIDR(const uint8_t* src, size_t srcSize, uint8_t* dst, size
     return dstSize - remainingDstSize;
 }
 
+std::optional<size_t> injectSPSPPSBeforeIDR(uint8_t* data, size_t size, size_t headroom,
+                                            std::vector<uint8_t>* sps, std::vector<uint8_t>* pps) {
+    bool foundStreamParams = false;
+    size_t numNalUnits = 0;
+    NalParser parser(data, size);
+    while (parser.locateNextNal()) {
+        switch (parser.type()) {
+        case NalParser::kSPSType:
+            ALOGV("Found SPS (length %zu)", parser.length());
+            sps->resize(parser.length());
+            memcpy(sps->data(), parser.data(), parser.length());
+            foundStreamParams = true;
+            break;
+        case NalParser::kPPSType:
+            ALOGV("Found PPS (length %zu)", parser.length());
+            pps->resize(parser.length());
+            memcpy(pps->data(), parser.data(), parser.length());
+            foundStreamParams = true;
+            break;
+        case NalParser::kIDRType: {
+            ALOGV("Found IDR (length %zu)", parser.length());
+            if (foundStreamParams) {
+                ALOGV("Not injecting SPS and PPS before IDR, already present");
+                return 0;
+            }
+
+            // The stream header is written in front of the stream, which is only correct if the
+            // IDR is the first NAL unit in the stream.
+            if (numNalUnits > 0) {
+                ALOGV("IDR is not the first NAL unit, can't inject SPS and PPS in place");
+                return std::nullopt;
+            }
+            if (sps->empty() || pps->empty()) {
+                ALOGE("No cached SPS or PPS NAL unit available to inject before IDR");
+                return std::nullopt;
+            }
+
+            size_t headerSize = sps->size() + pps->size() + (2u * kH264StartCodeSize);
+            if (headerSize > headroom) {
+                ALOGV("Not enough headroom to inject SPS and PPS in place (%zu < %zu)", headroom,
+                      headerSize);
+                return std::nullopt;
+            }
+
+            uint8_t* dst = data - headerSize;
+            size_t remainingSize = headerSize;
+            if (!copyNALUPrependingStartCode(sps->data(), sps->size(), &dst, &remainingSize) ||
+                !copyNALUPrependingStartCode(pps->data(), pps->size(), &dst, &remainingSize)) {
+                return std::nullopt;
+            }
+
+            ALOGV("Stream header injected in place before IDR");
+            return headerSize;
+        }
+        }
+        ++numNalUnits;
+    }
+
+    return 0;
+}
+
 }  // namespace android
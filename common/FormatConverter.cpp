@@ -9,17 +9,22 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 
 #include <C2AllocatorGralloc.h>
 #include <C2PlatformSupport.h>
 #include <android/hardware/graphics/common/1.0/types.h>
+#include <base/bind.h>
+#include <cutils/properties.h>
 #include <inttypes.h>
 #include <libyuv.h>
 #include <ui/GraphicBuffer.h>
 #include <utils/Log.h>
 
+#include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/V4L2ImageProcessor.h>
 #include <v4l2_codec2/common/VideoTypes.h>  // for HalPixelFormat
 
 using android::hardware::graphics::common::V1_0::BufferUsage;
@@ -50,6 +55,64 @@ void copyPlaneByPixel(const uint8_t* src, int srcStride, int srcColInc, uint8_t*
     }
 }
 
+// Get the fourcc of the specified HAL pixel |format| as used by the V4L2 image processor, or
+// nullopt if the format can't be converted by the image processor. The number of bytes per pixel
+// of the first plane is stored in |bytesPerPixel|. YUV formats are only accepted if |allowYUV| is
+// set, as the CPU only needs to copy them when they aren't scaled. IMPLEMENTATION_DEFINED frames
+// are only accepted if |implDefinedIsRGB| is set, i.e. they are known to be backed by RGBX.
+std::optional<Fourcc> halPixelFormatToImageProcessorFourcc(uint32_t format, bool implDefinedIsRGB,
+                                                           bool allowYUV, uint32_t* bytesPerPixel) {
+    *bytesPerPixel = 4;
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+        return Fourcc(Fourcc::AB24);
+    case HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED:
+        // Only RGB-backed IMPLEMENTATION_DEFINED frames are converted, which are backed by RGBX
+        // similar to ImplDefinedToRGBXMap. YUV-backed frames (e.g. from a camera or surface) are
+        // zero-copied or converted by the CPU.
+        if (!implDefinedIsRGB) return std::nullopt;
+        return Fourcc(Fourcc::XB24);
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+        return Fourcc(Fourcc::XB24);
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+        return Fourcc(Fourcc::AR24);
+    default:
+        break;
+    }
+
+    if (!allowYUV) return std::nullopt;
+    *bytesPerPixel = 1;
+    switch (format) {
+    case HAL_PIXEL_FORMAT_YV12:
+        return Fourcc(Fourcc::YV12);
+    case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        return Fourcc(Fourcc::NV21);
+    // Flexible YUV frames are allocated as NV12 by minigbm.
+    case HAL_PIXEL_FORMAT_YCBCR_420_888:
+        return Fourcc(Fourcc::NV12);
+    default:
+        return std::nullopt;
+    }
+}
+
+// Whether the gralloc format of |block| is IMPLEMENTATION_DEFINED.
+bool isImplDefined(const C2ConstGraphicBlock& block) {
+    uint32_t width, height, format, stride, igbpSlot, generation;
+    uint64_t usage, igbpId;
+    android::_UnwrapNativeCodec2GrallocMetadata(block.handle(), &width, &height, &format, &usage,
+                                                &stride, &generation, &igbpId, &igbpSlot);
+    return format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED;
+}
+
+// Get the file descriptors backing the specified graphic block |handle|.
+std::vector<int> getBlockFds(const C2Handle* handle) {
+    std::vector<int> fds;
+    for (int i = 0; i < handle->numFds; i++) {
+        fds.push_back(handle->data[i]);
+    }
+    return fds;
+}
+
 }  // namespace
 
 ImplDefinedToRGBXMap::ImplDefinedToRGBXMap(sp<GraphicBuffer> buf, uint8_t* addr, int rowInc)
@@ -93,27 +156,31 @@ std::unique_ptr<ImplDefinedToRGBXMap> ImplDefinedToRGBXMap::Create(
 
 // static
 std::unique_ptr<FormatConverter> FormatConverter::Create(VideoPixelFormat outFormat,
+                                                         const ui::Size& inputSize,
                                                          const ui::Size& visibleSize,
                                                          uint32_t inputCount,
                                                          const ui::Size& codedSize) {
-    if (outFormat != VideoPixelFormat::I420 && outFormat != VideoPixelFormat::NV12) {
+    if (outFormat != VideoPixelFormat::I420 && outFormat != VideoPixelFormat::NV12 &&
+        outFormat != VideoPixelFormat::P016LE) {
         ALOGE("Unsupported output format: %d", static_cast<int32_t>(outFormat));
         return nullptr;
     }
 
     std::unique_ptr<FormatConverter> converter(new FormatConverter);
-    if (converter->initialize(outFormat, visibleSize, inputCount, codedSize) != C2_OK) {
+    if (converter->initialize(outFormat, inputSize, visibleSize, inputCount, codedSize) != C2_OK) {
         ALOGE("Failed to initialize FormatConverter");
         return nullptr;
     }
     return converter;
 }
 
-c2_status_t FormatConverter::initialize(VideoPixelFormat outFormat, const ui::Size& visibleSize,
-                                        uint32_t inputCount, const ui::Size& codedSize) {
-    ALOGV("initialize(out_format=%s, visible_size=%dx%d, input_count=%u, coded_size=%dx%d)",
-          videoPixelFormatToString(outFormat).c_str(), visibleSize.width, visibleSize.height,
-          inputCount, codedSize.width, codedSize.height);
+c2_status_t FormatConverter::initialize(VideoPixelFormat outFormat, const ui::Size& inputSize,
+                                        const ui::Size& visibleSize, uint32_t inputCount,
+                                        const ui::Size& codedSize) {
+    ALOGV("initialize(out_format=%s, input_size=%dx%d, visible_size=%dx%d, input_count=%u, "
+          "coded_size=%dx%d)",
+          videoPixelFormatToString(outFormat).c_str(), inputSize.width, inputSize.height,
+          visibleSize.width, visibleSize.height, inputCount, codedSize.width, codedSize.height);
 
     std::shared_ptr<C2BlockPool> pool;
     c2_status_t status = GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool);
@@ -127,66 +194,353 @@ c2_status_t FormatConverter::initialize(VideoPixelFormat outFormat, const ui::Si
         // Android HAL format doesn't have I420, we use YV12 instead and swap U and V data while
         // conversion to perform I420.
         halFormat = HalPixelFormat::YV12;
+    } else if (outFormat == VideoPixelFormat::P016LE) {
+        halFormat = HalPixelFormat::YCBCR_P010;
     } else {
         halFormat = HalPixelFormat::YCBCR_420_888;  // will allocate NV12 by minigbm.
     }
 
-    uint32_t bufferCount = std::max(inputCount, kMinInputBufferCount);
-    for (uint32_t i = 0; i < bufferCount; i++) {
-        std::shared_ptr<C2GraphicBlock> block;
-        status = pool->fetchGraphicBlock(codedSize.width, codedSize.height,
-                                         static_cast<uint32_t>(halFormat),
-                                         {(C2MemoryUsage::CPU_READ | C2MemoryUsage::CPU_WRITE),
-                                          static_cast<uint64_t>(BufferUsage::VIDEO_ENCODER)},
-                                         &block);
-        if (status != C2_OK) {
-            ALOGE("Failed to fetch graphic block (err=%d)", status);
-            return status;
-        }
-        mGraphicBlocks.emplace_back(new BlockEntry(std::move(block)));
-        mAvailableQueue.push(mGraphicBlocks.back().get());
-    }
+    // Blocks are only allocated once a frame needs to be converted, so zero-copy sessions don't
+    // allocate any. At most one block per frame in flight is needed.
+    mBlockPool = std::move(pool);
+    mHalFormat = halFormat;
+    mMaxNumConvertBlocks = std::max(inputCount, kMinInputBufferCount);
 
     mOutFormat = outFormat;
+    mInputSize = inputSize;
     mVisibleSize = visibleSize;
+    mCodedSize = codedSize;
 
-    mTempPlaneU =
-            std::unique_ptr<uint8_t[]>(new uint8_t[mVisibleSize.width * mVisibleSize.height / 4]);
-    mTempPlaneV =
-            std::unique_ptr<uint8_t[]>(new uint8_t[mVisibleSize.width * mVisibleSize.height / 4]);
+    // Small frames are always converted on the calling thread, so there is no need for workers.
+    size_t numBands = 1;
+    if (mVisibleSize.width * mVisibleSize.height >= kMinParallelConvertArea) {
+        int32_t numThreads = property_get_int32("ro.vendor.v4l2_codec2.convert_threads", 2);
+        numBands = static_cast<size_t>(std::max(numThreads, 1));
+    }
+    for (size_t i = 1; i < numBands; i++) {
+        auto thread = std::make_unique<::base::Thread>("FormatConverterWorker" + std::to_string(i));
+        if (!thread->Start()) {
+            ALOGW("Failed to start format converter worker thread %zu", i);
+            break;
+        }
+        mWorkerThreads.push_back(std::move(thread));
+    }
 
     return C2_OK;
 }
 
+FormatConverter::~FormatConverter() {
+    if (mMemoryTracker) {
+        mMemoryTracker->add("convertBlocks", -static_cast<int64_t>(mTrackedMemoryUsage));
+    }
+}
+
+void FormatConverter::setMemoryTracker(std::shared_ptr<MemoryTracker> tracker) {
+    ALOG_ASSERT(mTrackedMemoryUsage == 0u);
+    mMemoryTracker = std::move(tracker);
+}
+
+bool FormatConverter::isReady() const {
+    return !mAvailableQueue.empty() || mNumConvertBlocks < mMaxNumConvertBlocks;
+}
+
+FormatConverter::BlockEntry* FormatConverter::getAvailableBlock() {
+    mNumZeroCopiedFrames = 0;
+    if (!mAvailableQueue.empty()) return mAvailableQueue.front();
+    if (mNumConvertBlocks >= mMaxNumConvertBlocks) return nullptr;
+
+    std::shared_ptr<C2GraphicBlock> block;
+    c2_status_t status = mBlockPool->fetchGraphicBlock(
+            mCodedSize.width, mCodedSize.height, static_cast<uint32_t>(mHalFormat),
+            {(C2MemoryUsage::CPU_READ | C2MemoryUsage::CPU_WRITE),
+             static_cast<uint64_t>(BufferUsage::VIDEO_ENCODER)},
+            &block);
+    if (status != C2_OK) {
+        ALOGE("Failed to fetch graphic block (err=%d)", status);
+        return nullptr;
+    }
+    const size_t size = mMemoryTracker ? MemoryTracker::getBufferSize(block->handle()) : 0;
+    mGraphicBlocks.emplace_back(new BlockEntry(std::move(block)));
+    mGraphicBlocks.back()->mMemorySize = size;
+    mAvailableQueue.push(mGraphicBlocks.back().get());
+    mNumConvertBlocks++;
+    if (mMemoryTracker) {
+        mTrackedMemoryUsage += size;
+        mMemoryTracker->add("convertBlocks", static_cast<int64_t>(size));
+    }
+    ALOGV("Allocated conversion block %zu/%u", mNumConvertBlocks, mMaxNumConvertBlocks);
+    return mAvailableQueue.front();
+}
+
+void FormatConverter::releaseAvailableBlocks() {
+    ALOGV("Releasing %zu unused conversion blocks", mAvailableQueue.size());
+    while (!mAvailableQueue.empty()) {
+        BlockEntry* entry = mAvailableQueue.front();
+        mAvailableQueue.pop();
+        if (mMemoryTracker) {
+            mTrackedMemoryUsage -= entry->mMemorySize;
+            mMemoryTracker->add("convertBlocks", -static_cast<int64_t>(entry->mMemorySize));
+        }
+        mGraphicBlocks.erase(std::find_if(mGraphicBlocks.begin(), mGraphicBlocks.end(),
+                                          [entry](const std::unique_ptr<BlockEntry>& be) {
+                                              return be.get() == entry;
+                                          }));
+        mNumConvertBlocks--;
+    }
+    mTempPlaneU.reset();
+    mTempPlaneV.reset();
+}
+
+bool FormatConverter::supportsImageProcessorInput(const C2ConstGraphicBlock& inputBlock) const {
+    // Only NV12 output is supported, I420 output is emulated using YV12 blocks.
+    if (mImageProcessorFailed || mOutFormat != VideoPixelFormat::NV12) return false;
+
+    uint32_t width, height, format, stride, igbpSlot, generation;
+    uint64_t usage, igbpId;
+    android::_UnwrapNativeCodec2GrallocMetadata(inputBlock.handle(), &width, &height, &format,
+                                                &usage, &stride, &generation, &igbpId, &igbpSlot);
+    uint32_t bytesPerPixel;
+    return halPixelFormatToImageProcessorFourcc(format, mImplDefinedIsRGB.value_or(false),
+                                                isScaling(), &bytesPerPixel)
+            .has_value();
+}
+
+bool FormatConverter::convertWithImageProcessor(const C2ConstGraphicBlock& inputBlock,
+                                                const C2GraphicBlock& outputBlock) {
+    // Only NV12 output is supported, I420 output is emulated using YV12 blocks.
+    if (mImageProcessorFailed || mOutFormat != VideoPixelFormat::NV12) return false;
+
+    uint32_t width, height, format, stride, igbpSlot, generation;
+    uint64_t usage, igbpId;
+    android::_UnwrapNativeCodec2GrallocMetadata(inputBlock.handle(), &width, &height, &format,
+                                                &usage, &stride, &generation, &igbpId, &igbpSlot);
+    uint32_t bytesPerPixel;
+    std::optional<Fourcc> inputFourcc = halPixelFormatToImageProcessorFourcc(
+            format, mImplDefinedIsRGB.value_or(false), isScaling(), &bytesPerPixel);
+    if (!inputFourcc) return false;
+    const uint32_t inputStride = stride * bytesPerPixel;
+
+    // (Re-)create the image processor if the input format changed.
+    if (!mImageProcessor || mImageProcessor->inputFourcc() != *inputFourcc ||
+        mImageProcessor->inputStride() != inputStride) {
+        android::_UnwrapNativeCodec2GrallocMetadata(outputBlock.handle(), &width, &height,
+                                                    &format, &usage, &stride, &generation,
+                                                    &igbpId, &igbpSlot);
+        mImageProcessor.reset();
+        // The blocks are allocated with the coded size, but only the visible rectangle is
+        // written.
+        mImageProcessor =
+                V4L2ImageProcessor::create(*inputFourcc, inputStride, mInputSize,
+                                           Fourcc(Fourcc::NV12), stride, mCodedSize, mVisibleSize);
+        if (!mImageProcessor) {
+            ALOGV("Image processor not available, converting frames on the CPU");
+            mImageProcessorFailed = true;
+            return false;
+        }
+    }
+
+    if (!mImageProcessor->process(getBlockFds(inputBlock.handle()),
+                                  getBlockFds(outputBlock.handle()))) {
+        ALOGE("Image processor failed to convert frame, converting frames on the CPU");
+        mImageProcessor.reset();
+        mImageProcessorFailed = true;
+        return false;
+    }
+    return true;
+}
+
+void FormatConverter::convertInBands(const ConvertRowsCB& convertRows) {
+    const int height = mVisibleSize.height;
+    const int numBands = static_cast<int>(mWorkerThreads.size()) + 1;
+    if (numBands == 1) {
+        convertRows(0, 0, height);
+        return;
+    }
+
+    // Each band should contain an even number of rows, as chroma is subsampled vertically.
+    int bandRows = (height + numBands - 1) / numBands;
+    bandRows = (bandRows + 1) & ~1;
+
+    std::vector<std::unique_ptr<::base::WaitableEvent>> doneEvents;
+    for (int band = 1; band < numBands; band++) {
+        const int row = band * bandRows;
+        if (row >= height) break;
+
+        doneEvents.push_back(std::make_unique<::base::WaitableEvent>(
+                ::base::WaitableEvent::ResetPolicy::MANUAL,
+                ::base::WaitableEvent::InitialState::NOT_SIGNALED));
+        mWorkerThreads[band - 1]->task_runner()->PostTask(
+                FROM_HERE, ::base::BindOnce(&FormatConverter::convertRowsTask,
+                                            ::base::Unretained(&convertRows),
+                                            static_cast<size_t>(band), row,
+                                            std::min(bandRows, height - row),
+                                            ::base::Unretained(doneEvents.back().get())));
+    }
+
+    convertRows(0, 0, std::min(bandRows, height));
+    for (auto& done : doneEvents) {
+        done->Wait();
+    }
+}
+
+// static
+void FormatConverter::convertRowsTask(const ConvertRowsCB* convertRows, size_t band, int row,
+                                      int rowCount, ::base::WaitableEvent* done) {
+    (*convertRows)(band, row, rowCount);
+    done->Signal();
+}
+
+void FormatConverter::allocateTempPlanes() {
+    const size_t numBands = mWorkerThreads.size() + 1;
+    mTempPlaneStride = (mVisibleSize.width + 1) / 2;
+    mTempPlaneBandSize = mTempPlaneStride * (kABGRToNV12ChunkRows / 2);
+    mTempPlaneU = std::unique_ptr<uint8_t[]>(new uint8_t[mTempPlaneBandSize * numBands]);
+    mTempPlaneV = std::unique_ptr<uint8_t[]>(new uint8_t[mTempPlaneBandSize * numBands]);
+}
+
+void FormatConverter::convertABGRToNV12Rows(size_t band, int row, int rowCount,
+                                            const uint8_t* srcRGB, int srcStrideRGB, uint8_t* dstY,
+                                            int dstStrideY, uint8_t* dstUV, int dstStrideUV) {
+    // There is no libyuv function to convert ABGR to NV12. Therefore, we convert a small chunk of
+    // rows into I420 on the dst-Y plane and temporary U/V planes, and copy the U and V pixels from
+    // the temporary planes to dst-UV interleavedly while they are still in the CPU cache. This
+    // avoids a second pass over full-frame temporary planes.
+    uint8_t* tempU = mTempPlaneU.get() + band * mTempPlaneBandSize;
+    uint8_t* tempV = mTempPlaneV.get() + band * mTempPlaneBandSize;
+    const int endRow = row + rowCount;
+    for (; row < endRow; row += kABGRToNV12ChunkRows) {
+        const int chunkRows = std::min(kABGRToNV12ChunkRows, endRow - row);
+        libyuv::ABGRToI420(srcRGB + row * srcStrideRGB, srcStrideRGB, dstY + row * dstStrideY,
+                           dstStrideY, tempU, mTempPlaneStride, tempV, mTempPlaneStride,
+                           mVisibleSize.width, chunkRows);
+        libyuv::MergeUVPlane(tempU, mTempPlaneStride, tempV, mTempPlaneStride,
+                             dstUV + (row / 2) * dstStrideUV, dstStrideUV, mTempPlaneStride,
+                             (chunkRows + 1) / 2);
+    }
+}
+
+bool FormatConverter::scaleYUV(VideoPixelFormat inputFormat, const C2GraphicView& inputView,
+                               C2GraphicView* outputView) {
+    const C2PlanarLayout& inputLayout = inputView.layout();
+    const C2PlanarLayout& outputLayout = outputView->layout();
+    const uint8_t* srcY = inputView.data()[C2PlanarLayout::PLANE_Y];
+    const uint8_t* srcU = inputView.data()[C2PlanarLayout::PLANE_U];
+    const uint8_t* srcV = inputView.data()[C2PlanarLayout::PLANE_V];
+    const int srcStrideY = inputLayout.planes[C2PlanarLayout::PLANE_Y].rowInc;
+    const int srcStrideU = inputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;
+    const int srcStrideV = inputLayout.planes[C2PlanarLayout::PLANE_V].rowInc;
+    uint8_t* dstY = outputView->data()[C2PlanarLayout::PLANE_Y];
+    uint8_t* dstU = outputView->data()[C2PlanarLayout::PLANE_V];   // only for I420
+    uint8_t* dstV = outputView->data()[C2PlanarLayout::PLANE_U];   // only for I420
+    uint8_t* dstUV = outputView->data()[C2PlanarLayout::PLANE_U];  // only for NV12
+    const int dstStrideY = outputLayout.planes[C2PlanarLayout::PLANE_Y].rowInc;
+    const int dstStrideU = outputLayout.planes[C2PlanarLayout::PLANE_V].rowInc;   // only for I420
+    const int dstStrideV = outputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;   // only for I420
+    const int dstStrideUV = outputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;  // only for NV12
+
+    const int srcWidth = mInputSize.width;
+    const int srcHeight = mInputSize.height;
+    const int dstWidth = mVisibleSize.width;
+    const int dstHeight = mVisibleSize.height;
+    switch (convertMap(inputFormat, mOutFormat)) {
+    case convertMap(VideoPixelFormat::YV12, VideoPixelFormat::I420):
+        libyuv::I420Scale(srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV, srcWidth,
+                          srcHeight, dstY, dstStrideY, dstU, dstStrideU, dstV, dstStrideV,
+                          dstWidth, dstHeight, libyuv::kFilterBox);
+        return true;
+    case convertMap(VideoPixelFormat::NV12, VideoPixelFormat::NV12):
+        libyuv::ScalePlane(srcY, srcStrideY, srcWidth, srcHeight, dstY, dstStrideY, dstWidth,
+                           dstHeight, libyuv::kFilterBox);
+        libyuv::UVScale(srcU, srcStrideU, (srcWidth + 1) / 2, (srcHeight + 1) / 2, dstUV,
+                        dstStrideUV, (dstWidth + 1) / 2, (dstHeight + 1) / 2, libyuv::kFilterBox);
+        return true;
+    default:
+        ALOGE("Scaling %s to %s requires an image processor",
+              videoPixelFormatToString(inputFormat).c_str(),
+              videoPixelFormatToString(mOutFormat).c_str());
+        return false;
+    }
+}
+
 C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
                                                   const C2ConstGraphicBlock& inputBlock,
                                                   c2_status_t* status) {
-    if (!isReady()) {
-        ALOGV("There is no available block for conversion");
-        *status = C2_NO_MEMORY;
-        return inputBlock;  // This is actually redundant and should not be used.
+    // Try to convert the frame using the image processor first. Whether it supports the frame is
+    // determined from the gralloc metadata, so these frames are never mapped by the CPU.
+    if (supportsImageProcessorInput(inputBlock)) {
+        BlockEntry* entry = getAvailableBlock();
+        if (!entry) {
+            ALOGV("There is no available block for conversion");
+            *status = C2_NO_MEMORY;
+            return inputBlock;  // This is actually redundant and should not be used.
+        }
+        if (convertWithImageProcessor(inputBlock, *entry->mBlock)) {
+            ALOGV("convertBlock(frame_index=%" PRIu64 ") using image processor", frameIndex);
+            *status = C2_OK;
+            entry->mAssociatedFrameIndex = frameIndex;
+            mAvailableQueue.pop();
+            return entry->mBlock->share(C2Rect(mVisibleSize.width, mVisibleSize.height),
+                                        C2Fence());
+        }
     }
 
-    BlockEntry* entry = mAvailableQueue.front();
-    std::shared_ptr<C2GraphicBlock> outputBlock = entry->mBlock;
-
     const C2GraphicView& inputView = inputBlock.map().get();
     C2PlanarLayout inputLayout = inputView.layout();
 
     // The above layout() cannot fill layout information and memset 0 instead if the input format is
-    // IMPLEMENTATION_DEFINED and its backed format is RGB. We fill the layout by using
-    // ImplDefinedToRGBXMap in the case.
+    // IMPLEMENTATION_DEFINED and its backed format is RGB.
+    const bool isImplDefinedRGB = static_cast<uint32_t>(inputLayout.type) == 0u;
+    if (isImplDefinedRGB) inputLayout.type = C2PlanarLayout::TYPE_RGB;
+    if (!mImplDefinedIsRGB && isImplDefined(inputBlock)) mImplDefinedIsRGB = isImplDefinedRGB;
+
+    VideoPixelFormat inputFormat = VideoPixelFormat::UNKNOWN;
+    if (inputLayout.type == C2PlanarLayout::TYPE_YUV) {
+        if (inputLayout.rootPlanes == 3) {
+            inputFormat = VideoPixelFormat::YV12;
+        } else if (inputLayout.rootPlanes == 2 &&
+                   inputLayout.planes[C2PlanarLayout::PLANE_Y].allocatedDepth > 8) {
+            // 10-bit P010 frames, stored as MSB-aligned 16-bit samples.
+            inputFormat = VideoPixelFormat::P016LE;
+        } else if (inputLayout.rootPlanes == 2) {
+            inputFormat = (inputView.data()[C2PlanarLayout::PLANE_V] >
+                           inputView.data()[C2PlanarLayout::PLANE_U])
+                                  ? VideoPixelFormat::NV12
+                                  : VideoPixelFormat::NV21;
+        }
+
+        if (inputFormat == mOutFormat && !isScaling()) {
+            ALOGV("Zero-Copy is applied");
+            mGraphicBlocks.emplace_back(new BlockEntry(frameIndex));
+            // Free the conversion blocks once the input doesn't need to be converted anymore,
+            // including the ones that are only returned after that.
+            if (++mNumZeroCopiedFrames >= kZeroCopiedFramesBeforeRelease) {
+                releaseAvailableBlocks();
+            }
+            return inputBlock;
+        }
+    }
+
+    BlockEntry* entry = getAvailableBlock();
+    if (!entry) {
+        ALOGV("There is no available block for conversion");
+        *status = C2_NO_MEMORY;
+        return inputBlock;  // This is actually redundant and should not be used.
+    }
+
+    // We fill the layout of RGB-backed IMPLEMENTATION_DEFINED frames by using
+    // ImplDefinedToRGBXMap.
     std::unique_ptr<ImplDefinedToRGBXMap> idMap;
-    if (static_cast<uint32_t>(inputLayout.type) == 0u) {
+    if (isImplDefinedRGB) {
         idMap = ImplDefinedToRGBXMap::Create(inputBlock);
         if (idMap == nullptr) {
             ALOGE("Unable to parse RGBX_8888 from IMPLEMENTATION_DEFINED");
             *status = C2_CORRUPTED;
             return inputBlock;  // This is actually redundant and should not be used.
         }
-        inputLayout.type = C2PlanarLayout::TYPE_RGB;
     }
 
+    std::shared_ptr<C2GraphicBlock> outputBlock = entry->mBlock;
+
     C2GraphicView outputView = outputBlock->map().get();
     C2PlanarLayout outputLayout = outputView.layout();
     uint8_t* dstY = outputView.data()[C2PlanarLayout::PLANE_Y];
@@ -198,7 +552,6 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
     const int dstStrideV = outputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;   // only for I420
     const int dstStrideUV = outputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;  // only for NV12
 
-    VideoPixelFormat inputFormat = VideoPixelFormat::UNKNOWN;
     *status = C2_OK;
     if (inputLayout.type == C2PlanarLayout::TYPE_YUV) {
         const uint8_t* srcY = inputView.data()[C2PlanarLayout::PLANE_Y];
@@ -207,47 +560,88 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
         const int srcStrideY = inputLayout.planes[C2PlanarLayout::PLANE_Y].rowInc;
         const int srcStrideU = inputLayout.planes[C2PlanarLayout::PLANE_U].rowInc;
         const int srcStrideV = inputLayout.planes[C2PlanarLayout::PLANE_V].rowInc;
-        if (inputLayout.rootPlanes == 3) {
-            inputFormat = VideoPixelFormat::YV12;
-        } else if (inputLayout.rootPlanes == 2) {
-            inputFormat = (srcV > srcU) ? VideoPixelFormat::NV12 : VideoPixelFormat::NV21;
-        }
 
-        if (inputFormat == mOutFormat) {
-            ALOGV("Zero-Copy is applied");
-            mGraphicBlocks.emplace_back(new BlockEntry(frameIndex));
-            return inputBlock;
+        if (isScaling()) {
+            if (!scaleYUV(inputFormat, inputView, &outputView)) {
+                *status = C2_CORRUPTED;
+                return inputBlock;  // This is actually redundant and should not be used.
+            }
+            ALOGV("convertBlock(frame_index=%" PRIu64 ", format=%s) scaled to %dx%d", frameIndex,
+                  videoPixelFormatToString(inputFormat).c_str(), mVisibleSize.width,
+                  mVisibleSize.height);
+            entry->mAssociatedFrameIndex = frameIndex;
+            mAvailableQueue.pop();
+            return outputBlock->share(C2Rect(mVisibleSize.width, mVisibleSize.height), C2Fence());
         }
 
+        // All conversions below operate on bands of rows. |row| and |rowCount| are in luma rows,
+        // |row| is always even so the chroma planes start at row |row| / 2.
+        const int width = mVisibleSize.width;
         switch (convertMap(inputFormat, mOutFormat)) {
         case convertMap(VideoPixelFormat::YV12, VideoPixelFormat::I420):
-            libyuv::I420Copy(srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV, dstY, dstStrideY,
-                             dstU, dstStrideU, dstV, dstStrideV, mVisibleSize.width,
-                             mVisibleSize.height);
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                libyuv::I420Copy(srcY + row * srcStrideY, srcStrideY, srcU + c * srcStrideU,
+                                 srcStrideU, srcV + c * srcStrideV, srcStrideV,
+                                 dstY + row * dstStrideY, dstStrideY, dstU + c * dstStrideU,
+                                 dstStrideU, dstV + c * dstStrideV, dstStrideV, width, rowCount);
+            });
             break;
         case convertMap(VideoPixelFormat::YV12, VideoPixelFormat::NV12):
-            libyuv::I420ToNV12(srcY, srcStrideY, srcU, srcStrideU, srcV, srcStrideV, dstY,
-                               dstStrideY, dstUV, dstStrideUV, mVisibleSize.width,
-                               mVisibleSize.height);
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                libyuv::I420ToNV12(srcY + row * srcStrideY, srcStrideY, srcU + c * srcStrideU,
+                                   srcStrideU, srcV + c * srcStrideV, srcStrideV,
+                                   dstY + row * dstStrideY, dstStrideY, dstUV + c * dstStrideUV,
+                                   dstStrideUV, width, rowCount);
+            });
             break;
         case convertMap(VideoPixelFormat::NV12, VideoPixelFormat::I420):
-            libyuv::NV12ToI420(srcY, srcStrideY, srcU, srcStrideU, dstY, dstStrideY, dstU,
-                               dstStrideU, dstV, dstStrideV, mVisibleSize.width,
-                               mVisibleSize.height);
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                libyuv::NV12ToI420(srcY + row * srcStrideY, srcStrideY, srcU + c * srcStrideU,
+                                   srcStrideU, dstY + row * dstStrideY, dstStrideY,
+                                   dstU + c * dstStrideU, dstStrideU, dstV + c * dstStrideV,
+                                   dstStrideV, width, rowCount);
+            });
             break;
         case convertMap(VideoPixelFormat::NV21, VideoPixelFormat::I420):
-            libyuv::NV21ToI420(srcY, srcStrideY, srcV, srcStrideV, dstY, dstStrideY, dstU,
-                               dstStrideU, dstV, dstStrideV, mVisibleSize.width,
-                               mVisibleSize.height);
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                libyuv::NV21ToI420(srcY + row * srcStrideY, srcStrideY, srcV + c * srcStrideV,
+                                   srcStrideV, dstY + row * dstStrideY, dstStrideY,
+                                   dstU + c * dstStrideU, dstStrideU, dstV + c * dstStrideV,
+                                   dstStrideV, width, rowCount);
+            });
             break;
         case convertMap(VideoPixelFormat::NV21, VideoPixelFormat::NV12):
             ALOGV("%s(): Converting PIXEL_FORMAT_NV21 -> PIXEL_FORMAT_NV12", __func__);
-            libyuv::CopyPlane(srcY, srcStrideY, dstY, dstStrideY, mVisibleSize.width,
-                              mVisibleSize.height);
-            copyPlaneByPixel(srcU, srcStrideU, 2, dstUV, dstStrideUV, 2, mVisibleSize.width / 2,
-                             mVisibleSize.height / 2);
-            copyPlaneByPixel(srcV, srcStrideV, 2, dstUV + 1, dstStrideUV, 2, mVisibleSize.width / 2,
-                             mVisibleSize.height / 2);
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                const int chromaRows = (row + rowCount) / 2 - c;
+                libyuv::CopyPlane(srcY + row * srcStrideY, srcStrideY, dstY + row * dstStrideY,
+                                  dstStrideY, width, rowCount);
+                copyPlaneByPixel(srcU + c * srcStrideU, srcStrideU, 2, dstUV + c * dstStrideUV,
+                                 dstStrideUV, 2, width / 2, chromaRows);
+                copyPlaneByPixel(srcV + c * srcStrideV, srcStrideV, 2, dstUV + 1 + c * dstStrideUV,
+                                 dstStrideUV, 2, width / 2, chromaRows);
+            });
+            break;
+        case convertMap(VideoPixelFormat::P016LE, VideoPixelFormat::NV12):
+            // Drop the 2 least significant bits of the 10-bit samples, used when 10-bit frames
+            // are encoded using an 8-bit profile. The strides of the source are in bytes, while
+            // libyuv expects them in 16-bit samples. A scale of 256 keeps the 8 most significant
+            // bits of each MSB-aligned sample.
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                const int chromaRows = (row + rowCount + 1) / 2 - c;
+                libyuv::Convert16To8Plane(
+                        reinterpret_cast<const uint16_t*>(srcY + row * srcStrideY), srcStrideY / 2,
+                        dstY + row * dstStrideY, dstStrideY, 256, width, rowCount);
+                libyuv::Convert16To8Plane(
+                        reinterpret_cast<const uint16_t*>(srcU + c * srcStrideU), srcStrideU / 2,
+                        dstUV + c * dstStrideUV, dstStrideUV, 256, (width + 1) & ~1, chromaRows);
+            });
             break;
         default:
             ALOGE("Unsupported pixel format conversion from %s to %s",
@@ -261,28 +655,33 @@ C2ConstGraphicBlock FormatConverter::convertBlock(uint64_t frameIndex,
         // BGRA_8888 is not used now?
         inputFormat = VideoPixelFormat::ABGR;
 
+        if (isScaling()) {
+            ALOGE("Scaling RGB frames requires an image processor");
+            *status = C2_CORRUPTED;
+            return inputBlock;  // This is actually redundant and should not be used.
+        }
+
         const uint8_t* srcRGB = (idMap) ? idMap->addr() : inputView.data()[C2PlanarLayout::PLANE_R];
         const int srcStrideRGB =
                 (idMap) ? idMap->rowInc() : inputLayout.planes[C2PlanarLayout::PLANE_R].rowInc;
 
         switch (convertMap(inputFormat, mOutFormat)) {
         case convertMap(VideoPixelFormat::ABGR, VideoPixelFormat::I420):
-            libyuv::ABGRToI420(srcRGB, srcStrideRGB, dstY, dstStrideY, dstU, dstStrideU, dstV,
-                               dstStrideV, mVisibleSize.width, mVisibleSize.height);
+            convertInBands([&](size_t /*band*/, int row, int rowCount) {
+                const int c = row / 2;
+                libyuv::ABGRToI420(srcRGB + row * srcStrideRGB, srcStrideRGB,
+                                   dstY + row * dstStrideY, dstStrideY, dstU + c * dstStrideU,
+                                   dstStrideU, dstV + c * dstStrideV, dstStrideV,
+                                   mVisibleSize.width, rowCount);
+            });
             break;
-        case convertMap(VideoPixelFormat::ABGR, VideoPixelFormat::NV12): {
-            // There is no libyuv function to convert ABGR to NV12. Therefore, we first convert to
-            // I420 on dst-Y plane and temporary U/V plane. Then we copy U and V pixels from
-            // temporary planes to dst-UV interleavedly.
-            const int tempStride = mVisibleSize.width / 2;
-            libyuv::ABGRToI420(srcRGB, srcStrideRGB, dstY, dstStrideY, mTempPlaneU.get(),
-                               tempStride, mTempPlaneV.get(), tempStride, mVisibleSize.width,
-                               mVisibleSize.height);
-            libyuv::MergeUVPlane(mTempPlaneU.get(), tempStride, mTempPlaneV.get(), tempStride,
-                                 dstUV, dstStrideUV, mVisibleSize.width / 2,
-                                 mVisibleSize.height / 2);
+        case convertMap(VideoPixelFormat::ABGR, VideoPixelFormat::NV12):
+            if (!mTempPlaneU) allocateTempPlanes();
+            convertInBands([&](size_t band, int row, int rowCount) {
+                convertABGRToNV12Rows(band, row, rowCount, srcRGB, srcStrideRGB, dstY, dstStrideY,
+                                      dstUV, dstStrideUV);
+            });
             break;
-        }
         default:
             ALOGE("Unsupported pixel format conversion from %s to %s",
                   videoPixelFormatToString(inputFormat).c_str(),
@@ -13,33 +13,82 @@
 
 namespace android {
 
+namespace {
+
+// The static description of a Fourcc value.
+struct FourccInfo {
+    Fourcc::Value mValue;
+    // The VideoPixelFormat counterpart of the value.
+    VideoPixelFormat mFormat;
+    bool mMultiPlanar;
+    // The single-planar counterpart of the value, 0 if there is none.
+    uint32_t mSinglePlanar;
+};
+
+// The descriptions of all Fourcc values. A VideoPixelFormat is converted to the first single-planar
+// or multi-planar value with that format.
+constexpr FourccInfo kFourccInfos[] = {
+        {Fourcc::AR24, VideoPixelFormat::ARGB, false, Fourcc::AR24},
+        {Fourcc::AB24, VideoPixelFormat::ABGR, false, Fourcc::AB24},
+        {Fourcc::XR24, VideoPixelFormat::XRGB, false, Fourcc::XR24},
+        {Fourcc::XB24, VideoPixelFormat::XBGR, false, Fourcc::XB24},
+        {Fourcc::RGB4, VideoPixelFormat::BGRA, false, Fourcc::RGB4},
+        {Fourcc::BGR4, VideoPixelFormat::RGBA, false, Fourcc::BGR4},
+        {Fourcc::YU12, VideoPixelFormat::I420, false, Fourcc::YU12},
+        {Fourcc::YV12, VideoPixelFormat::YV12, false, Fourcc::YV12},
+        {Fourcc::YUYV, VideoPixelFormat::YUY2, false, Fourcc::YUYV},
+        {Fourcc::NV12, VideoPixelFormat::NV12, false, Fourcc::NV12},
+        {Fourcc::NV21, VideoPixelFormat::NV21, false, Fourcc::NV21},
+        {Fourcc::P010, VideoPixelFormat::P016LE, false, Fourcc::P010},
+        {Fourcc::YM12, VideoPixelFormat::I420, true, Fourcc::YU12},
+        {Fourcc::YM21, VideoPixelFormat::YV12, true, Fourcc::YV12},
+        {Fourcc::NM12, VideoPixelFormat::NV12, true, Fourcc::NV12},
+        {Fourcc::NM21, VideoPixelFormat::NV21, true, Fourcc::NV21},
+        {Fourcc::YM16, VideoPixelFormat::I422, true, 0},
+        // V4L2_PIX_FMT_MT21C is only used for MT8173 hardware video decoder output and should be
+        // converted by MT8173 image processor for compositor to render. Since it is an
+        // intermediate format for video decoder, VideoPixelFormat shall not have its mapping.
+        // However, we need to create a VideoFrameLayout for the format to process the
+        // intermediate frame. Hence we map V4L2_PIX_FMT_MT21C to PIXEL_FORMAT_NV12 as their
+        // layout are the same.
+        {Fourcc::MT21, VideoPixelFormat::NV12, true, 0},
+        // V4L2_PIX_FMT_MM21 is used for MT8183 hardware video decoder. It is similar to
+        // V4L2_PIX_FMT_MT21C but is not compressed ; thus it can also be mapped to
+        // PIXEL_FORMAT_NV12.
+        {Fourcc::MM21, VideoPixelFormat::NV12, true, 0},
+};
+
+constexpr const FourccInfo* findFourccInfo(uint32_t value) {
+    for (const FourccInfo& info : kFourccInfos) {
+        if (info.mValue == value) return &info;
+    }
+    return nullptr;
+}
+
+// Check whether the single-planar counterparts of all values are single-planar values themselves.
+constexpr bool areSinglePlanarCounterpartsValid() {
+    for (const FourccInfo& info : kFourccInfos) {
+        if (info.mSinglePlanar == 0) continue;
+        const FourccInfo* singlePlanar = findFourccInfo(info.mSinglePlanar);
+        if (!singlePlanar || singlePlanar->mMultiPlanar || singlePlanar->mFormat != info.mFormat) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(areSinglePlanarCounterpartsValid(), "Invalid single-planar Fourcc");
+
+}  // namespace
+
 Fourcc::Fourcc(Fourcc::Value fourcc) : mValue(fourcc) {}
 Fourcc::~Fourcc() = default;
 Fourcc& Fourcc::operator=(const Fourcc& other) = default;
 
 // static
 std::optional<Fourcc> Fourcc::fromUint32(uint32_t fourcc) {
-    switch (fourcc) {
-    case AR24:
-    case AB24:
-    case XR24:
-    case XB24:
-    case RGB4:
-    case BGR4:
-    case YU12:
-    case YV12:
-    case YM12:
-    case YM21:
-    case YUYV:
-    case NV12:
-    case NV21:
-    case NM12:
-    case NM21:
-    case YM16:
-    case MT21:
-    case MM21:
-        return Fourcc(static_cast<Value>(fourcc));
-    }
+    if (findFourccInfo(fourcc)) return Fourcc(static_cast<Value>(fourcc));
+
     ALOGV("Unmapped fourcc: %s", fourccToString(fourcc).c_str());
     return std::nullopt;
 }
@@ -47,140 +96,20 @@ std::optional<Fourcc> Fourcc::fromUint32(uint32_t fourcc) {
 // static
 std::optional<Fourcc> Fourcc::fromVideoPixelFormat(VideoPixelFormat pixelFormat,
                                                    bool singlePlanar) {
-    if (singlePlanar) {
-        switch (pixelFormat) {
-        case VideoPixelFormat::ARGB:
-            return Fourcc(AR24);
-        case VideoPixelFormat::ABGR:
-            return Fourcc(AB24);
-        case VideoPixelFormat::XRGB:
-            return Fourcc(XR24);
-        case VideoPixelFormat::XBGR:
-            return Fourcc(XB24);
-        case VideoPixelFormat::BGRA:
-            return Fourcc(RGB4);
-        case VideoPixelFormat::RGBA:
-            return Fourcc(BGR4);
-        case VideoPixelFormat::I420:
-            return Fourcc(YU12);
-        case VideoPixelFormat::YV12:
-            return Fourcc(YV12);
-        case VideoPixelFormat::YUY2:
-            return Fourcc(YUYV);
-        case VideoPixelFormat::NV12:
-            return Fourcc(NV12);
-        case VideoPixelFormat::NV21:
-            return Fourcc(NV21);
-        case VideoPixelFormat::I422:
-        case VideoPixelFormat::I420A:
-        case VideoPixelFormat::I444:
-        case VideoPixelFormat::RGB24:
-        case VideoPixelFormat::MJPEG:
-        case VideoPixelFormat::YUV420P9:
-        case VideoPixelFormat::YUV420P10:
-        case VideoPixelFormat::YUV422P9:
-        case VideoPixelFormat::YUV422P10:
-        case VideoPixelFormat::YUV444P9:
-        case VideoPixelFormat::YUV444P10:
-        case VideoPixelFormat::YUV420P12:
-        case VideoPixelFormat::YUV422P12:
-        case VideoPixelFormat::YUV444P12:
-        case VideoPixelFormat::Y16:
-        case VideoPixelFormat::P016LE:
-        case VideoPixelFormat::XR30:
-        case VideoPixelFormat::XB30:
-        case VideoPixelFormat::UNKNOWN:
-            break;
-        }
-    } else {
-        switch (pixelFormat) {
-        case VideoPixelFormat::I420:
-            return Fourcc(YM12);
-        case VideoPixelFormat::YV12:
-            return Fourcc(YM21);
-        case VideoPixelFormat::NV12:
-            return Fourcc(NM12);
-        case VideoPixelFormat::I422:
-            return Fourcc(YM16);
-        case VideoPixelFormat::NV21:
-            return Fourcc(NM21);
-        case VideoPixelFormat::I420A:
-        case VideoPixelFormat::I444:
-        case VideoPixelFormat::YUY2:
-        case VideoPixelFormat::ARGB:
-        case VideoPixelFormat::XRGB:
-        case VideoPixelFormat::RGB24:
-        case VideoPixelFormat::MJPEG:
-        case VideoPixelFormat::YUV420P9:
-        case VideoPixelFormat::YUV420P10:
-        case VideoPixelFormat::YUV422P9:
-        case VideoPixelFormat::YUV422P10:
-        case VideoPixelFormat::YUV444P9:
-        case VideoPixelFormat::YUV444P10:
-        case VideoPixelFormat::YUV420P12:
-        case VideoPixelFormat::YUV422P12:
-        case VideoPixelFormat::YUV444P12:
-        case VideoPixelFormat::Y16:
-        case VideoPixelFormat::ABGR:
-        case VideoPixelFormat::XBGR:
-        case VideoPixelFormat::P016LE:
-        case VideoPixelFormat::XR30:
-        case VideoPixelFormat::XB30:
-        case VideoPixelFormat::BGRA:
-        case VideoPixelFormat::RGBA:
-        case VideoPixelFormat::UNKNOWN:
-            break;
+    for (const FourccInfo& info : kFourccInfos) {
+        if (info.mFormat == pixelFormat && info.mMultiPlanar != singlePlanar) {
+            return Fourcc(info.mValue);
         }
     }
+
     ALOGE("Unmapped %s for %s", videoPixelFormatToString(pixelFormat).c_str(),
           singlePlanar ? "single-planar" : "multi-planar");
     return std::nullopt;
 }
 
 VideoPixelFormat Fourcc::toVideoPixelFormat() const {
-    switch (mValue) {
-    case AR24:
-        return VideoPixelFormat::ARGB;
-    case AB24:
-        return VideoPixelFormat::ABGR;
-    case XR24:
-        return VideoPixelFormat::XRGB;
-    case XB24:
-        return VideoPixelFormat::XBGR;
-    case RGB4:
-        return VideoPixelFormat::BGRA;
-    case BGR4:
-        return VideoPixelFormat::RGBA;
-    case YU12:
-    case YM12:
-        return VideoPixelFormat::I420;
-    case YV12:
-    case YM21:
-        return VideoPixelFormat::YV12;
-    case YUYV:
-        return VideoPixelFormat::YUY2;
-    case NV12:
-    case NM12:
-        return VideoPixelFormat::NV12;
-    case NV21:
-    case NM21:
-        return VideoPixelFormat::NV21;
-    case YM16:
-        return VideoPixelFormat::I422;
-    // V4L2_PIX_FMT_MT21C is only used for MT8173 hardware video decoder output
-    // and should be converted by MT8173 image processor for compositor to
-    // render. Since it is an intermediate format for video decoder,
-    // VideoPixelFormat shall not have its mapping. However, we need to create a
-    // VideoFrameLayout for the format to process the intermediate frame. Hence
-    // we map V4L2_PIX_FMT_MT21C to PIXEL_FORMAT_NV12 as their layout are the
-    // same.
-    case MT21:
-    // V4L2_PIX_FMT_MM21 is used for MT8183 hardware video decoder. It is
-    // similar to V4L2_PIX_FMT_MT21C but is not compressed ; thus it can also
-    // be mapped to PIXEL_FORMAT_NV12.
-    case MM21:
-        return VideoPixelFormat::NV12;
-    }
+    const FourccInfo* info = findFourccInfo(mValue);
+    if (info) return info->mFormat;
 
     ALOGE("Unmapped Fourcc: %s", toString().c_str());
     return VideoPixelFormat::UNKNOWN;
@@ -200,32 +129,9 @@ uint32_t Fourcc::toV4L2PixFmt() const {
 }
 
 std::optional<Fourcc> Fourcc::toSinglePlanar() const {
-    switch (mValue) {
-    case AR24:
-    case AB24:
-    case XR24:
-    case XB24:
-    case RGB4:
-    case BGR4:
-    case YU12:
-    case YV12:
-    case YUYV:
-    case NV12:
-    case NV21:
-        return Fourcc(mValue);
-    case YM12:
-        return Fourcc(YU12);
-    case YM21:
-        return Fourcc(YV12);
-    case NM12:
-        return Fourcc(NV12);
-    case NM21:
-        return Fourcc(NV21);
-    case YM16:
-    case MT21:
-    case MM21:
-        return std::nullopt;
-    }
+    const FourccInfo* info = findFourccInfo(mValue);
+    if (!info || info->mSinglePlanar == 0) return std::nullopt;
+    return Fourcc(static_cast<Value>(info->mSinglePlanar));
 }
 
 bool operator!=(const Fourcc& lhs, const Fourcc& rhs) {
@@ -233,28 +139,8 @@ bool operator!=(const Fourcc& lhs, const Fourcc& rhs) {
 }
 
 bool Fourcc::isMultiPlanar() const {
-    switch (mValue) {
-    case AR24:
-    case AB24:
-    case XR24:
-    case XB24:
-    case RGB4:
-    case BGR4:
-    case YU12:
-    case YV12:
-    case YUYV:
-    case NV12:
-    case NV21:
-        return false;
-    case YM12:
-    case YM21:
-    case NM12:
-    case NM21:
-    case YM16:
-    case MT21:
-    case MM21:
-        return true;
-    }
+    const FourccInfo* info = findFourccInfo(mValue);
+    return info && info->mMultiPlanar;
 }
 
 std::string Fourcc::toString() const {
@@ -282,6 +168,10 @@ static_assert(Fourcc::NV12 == V4L2_PIX_FMT_NV12, "Mismatch Fourcc");
 static_assert(Fourcc::NV21 == V4L2_PIX_FMT_NV21, "Mismatch Fourcc");
 static_assert(Fourcc::NM12 == V4L2_PIX_FMT_NV12M, "Mismatch Fourcc");
 static_assert(Fourcc::NM21 == V4L2_PIX_FMT_NV21M, "Mismatch Fourcc");
+#ifdef V4L2_PIX_FMT_P010
+// V4L2_PIX_FMT_P010 is not defined in older kernel headers.
+static_assert(Fourcc::P010 == V4L2_PIX_FMT_P010, "Mismatch Fourcc");
+#endif  // V4L2_PIX_FMT_P010
 static_assert(Fourcc::YM16 == V4L2_PIX_FMT_YUV422M, "Mismatch Fourcc");
 static_assert(Fourcc::MT21 == V4L2_PIX_FMT_MT21C, "Mismatch Fourcc");
 #ifdef V4L2_PIX_FMT_MM21
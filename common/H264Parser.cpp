@@ -0,0 +1,786 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "H264Parser"
+
+#include <v4l2_codec2/common/H264Parser.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <log/log.h>
+
+#include <v4l2_codec2/common/NalParser.h>
+
+namespace android {
+namespace {
+
+// The maximum number of reference picture list modifications and memory management operations we
+// accept in a single slice header, to bound the parsing of corrupted streams.
+constexpr size_t kMaxNumRefPicListModifications = 33;
+constexpr size_t kMaxNumMemoryManagementOperations = 66;
+
+// The default scaling lists, in zigzag scan order (ITU-T H.264 table 7-3 and 7-4).
+constexpr uint8_t kDefault4x4Intra[16] = {6,  13, 13, 20, 20, 20, 28, 28,
+                                          28, 28, 32, 32, 32, 37, 37, 42};
+constexpr uint8_t kDefault4x4Inter[16] = {10, 14, 14, 20, 20, 20, 24, 24,
+                                          24, 24, 27, 27, 27, 30, 30, 34};
+constexpr uint8_t kDefault8x8Intra[64] = {
+        6,  10, 10, 13, 11, 13, 16, 16, 16, 16, 18, 18, 18, 18, 18, 23, 23, 23, 23, 23, 23, 25,
+        25, 25, 25, 25, 25, 25, 27, 27, 27, 27, 27, 27, 27, 27, 29, 29, 29, 29, 29, 29, 29, 31,
+        31, 31, 31, 31, 31, 33, 33, 33, 33, 33, 36, 36, 36, 36, 38, 38, 38, 40, 40, 42};
+constexpr uint8_t kDefault8x8Inter[64] = {
+        9,  13, 13, 15, 13, 15, 17, 17, 17, 17, 19, 19, 19, 19, 19, 21, 21, 21, 21, 21, 21, 22,
+        22, 22, 22, 22, 22, 22, 24, 24, 24, 24, 24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 27,
+        27, 27, 27, 27, 27, 28, 28, 28, 28, 28, 30, 30, 30, 30, 32, 32, 32, 33, 33, 35};
+
+// The raster scan position of each coefficient in zigzag scan order.
+constexpr uint8_t kZigzag4x4[16] = {0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15};
+constexpr uint8_t kZigzag8x8[64] = {
+        0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+        41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+        30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// Reads the bits of a NAL unit's raw byte sequence payload (RBSP), skipping the emulation
+// prevention bytes. Reading past the end of the data marks the reader as failed, so callers can
+// parse a whole syntax structure and only check failed() once.
+class RbspBitReader {
+public:
+    RbspBitReader(const uint8_t* data, size_t size) : mData(data), mSize(size) {}
+
+    // Read |numBits| bits, at most 32.
+    uint32_t readBits(size_t numBits) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < numBits; ++i) {
+            if (mBitsLeft == 0 && !loadNextByte()) {
+                mFailed = true;
+                return 0;
+            }
+            --mBitsLeft;
+            value = (value << 1) | ((mCurrByte >> mBitsLeft) & 1);
+        }
+        return value;
+    }
+
+    bool readFlag() { return readBits(1) != 0; }
+
+    // Read an unsigned integer encoded with exponential-golomb.
+    uint32_t readUE() {
+        size_t numZeroes = 0;
+        while (!readFlag()) {
+            if (mFailed || ++numZeroes > 31) {
+                mFailed = true;
+                return 0;
+            }
+        }
+        return (1u << numZeroes) - 1 + readBits(numZeroes);
+    }
+
+    // Read a signed integer encoded with exponential-golomb.
+    int32_t readSE() {
+        const uint32_t codeNum = readUE();
+        return (codeNum & 1) ? static_cast<int32_t>((codeNum + 1) >> 1)
+                             : -static_cast<int32_t>(codeNum >> 1);
+    }
+
+    // Check whether there is more data before the RBSP trailing bits, i.e. more_rbsp_data().
+    bool hasMoreRbspData() {
+        if (mBitsLeft == 0 && !loadNextByte()) return false;
+        // If there is no more data, the next bit is the stop bit followed by zero bits.
+        if ((mCurrByte & ((1u << (mBitsLeft - 1)) - 1)) != 0) return true;
+        return std::any_of(mData + mPos, mData + mSize, [](uint8_t byte) { return byte != 0; });
+    }
+
+    // The number of bits read so far, including the emulation prevention bytes.
+    size_t bitsRead() const { return mPos * 8 - mBitsLeft; }
+
+    bool failed() const { return mFailed; }
+
+private:
+    bool loadNextByte() {
+        if (mPos >= mSize) return false;
+        // Skip the emulation prevention byte in 0x000003.
+        if (mNumZeroBytes >= 2 && mData[mPos] == 0x03) {
+            mNumZeroBytes = 0;
+            if (++mPos >= mSize) return false;
+        }
+        mCurrByte = mData[mPos++];
+        mNumZeroBytes = (mCurrByte == 0) ? mNumZeroBytes + 1 : 0;
+        mBitsLeft = 8;
+        return true;
+    }
+
+    const uint8_t* const mData;
+    const size_t mSize;
+    size_t mPos = 0;
+    uint8_t mCurrByte = 0;
+    size_t mBitsLeft = 0;
+    size_t mNumZeroBytes = 0;
+    bool mFailed = false;
+};
+
+// Get the smallest |n| for which (1 << n) >= |value|.
+uint32_t ceilLog2(uint32_t value) {
+    uint32_t n = 0;
+    while (n < 32 && (1ull << n) < value) ++n;
+    return n;
+}
+
+// Whether the SPS of |profileIdc| contains the chroma format and scaling matrix information.
+bool hasChromaFormatInfo(uint8_t profileIdc) {
+    switch (profileIdc) {
+    case 44:   // CAVLC 4:4:4 Intra
+    case 83:   // Scalable Baseline
+    case 86:   // Scalable High
+    case 100:  // High
+    case 110:  // High 10
+    case 118:  // Multiview High
+    case 122:  // High 4:2:2
+    case 128:  // Stereo High
+    case 134:  // MFC High
+    case 135:  // MFC Depth High
+    case 138:  // Multiview Depth High
+    case 139:  // Enhanced Multiview Depth High
+    case 244:  // High 4:4:4 Predictive
+        return true;
+    default:
+        return false;
+    }
+}
+
+void zigzagToRaster(const uint8_t* zigzag, size_t size, uint8_t* raster) {
+    const uint8_t* scan = (size == 16) ? kZigzag4x4 : kZigzag8x8;
+    for (size_t i = 0; i < size; ++i) raster[scan[i]] = zigzag[i];
+}
+
+// Parse a scaling_list() of |size| coefficients into |list|, in raster scan order. |defaultList|
+// is used if the syntax signals the default scaling list should be used.
+void parseScalingList(RbspBitReader* br, size_t size, const uint8_t* defaultList, uint8_t* list) {
+    uint8_t zigzag[64];
+    int32_t lastScale = 8;
+    int32_t nextScale = 8;
+    for (size_t j = 0; j < size; ++j) {
+        if (nextScale != 0) {
+            const int32_t deltaScale = std::clamp(br->readSE(), -128, 127);
+            nextScale = (lastScale + deltaScale + 256) % 256;
+            if (j == 0 && nextScale == 0) {
+                // useDefaultScalingMatrixFlag
+                zigzagToRaster(defaultList, size, list);
+                return;
+            }
+        }
+        zigzag[j] = (nextScale == 0) ? lastScale : nextScale;
+        lastScale = zigzag[j];
+    }
+    zigzagToRaster(zigzag, size, list);
+}
+
+// Parse the scaling lists of a SPS or PPS. The first |numLists| lists are present in the
+// bitstream, depending on their present flag. The lists that are not present are derived using
+// fall-back rule A if |fallback4x4| and |fallback8x8| are null, or fall-back rule B using these
+// lists otherwise (ITU-T H.264 table 7-2).
+void parseScalingMatrix(RbspBitReader* br, size_t numLists, const uint8_t (*fallback4x4)[16],
+                        const uint8_t (*fallback8x8)[64], uint8_t scalingList4x4[6][16],
+                        uint8_t scalingList8x8[6][64]) {
+    for (size_t i = 0; i < 6; ++i) {
+        const uint8_t* defaultList = (i < 3) ? kDefault4x4Intra : kDefault4x4Inter;
+        if (i < numLists && br->readFlag()) {
+            parseScalingList(br, 16, defaultList, scalingList4x4[i]);
+        } else if (i != 0 && i != 3) {
+            memcpy(scalingList4x4[i], scalingList4x4[i - 1], 16);
+        } else if (fallback4x4) {
+            memcpy(scalingList4x4[i], fallback4x4[i], 16);
+        } else {
+            zigzagToRaster(defaultList, 16, scalingList4x4[i]);
+        }
+    }
+    for (size_t i = 0; i < 6; ++i) {
+        const uint8_t* defaultList = (i % 2 == 0) ? kDefault8x8Intra : kDefault8x8Inter;
+        if (i + 6 < numLists && br->readFlag()) {
+            parseScalingList(br, 64, defaultList, scalingList8x8[i]);
+        } else if (i >= 2) {
+            memcpy(scalingList8x8[i], scalingList8x8[i - 2], 64);
+        } else if (fallback8x8) {
+            memcpy(scalingList8x8[i], fallback8x8[i], 64);
+        } else {
+            zigzagToRaster(defaultList, 64, scalingList8x8[i]);
+        }
+    }
+}
+
+// Skip the hrd_parameters() syntax.
+void skipHrdParameters(RbspBitReader* br) {
+    const uint32_t cpbCntMinus1 = br->readUE();
+    if (cpbCntMinus1 > 31) {
+        ALOGW("Invalid cpb_cnt_minus1: %u", cpbCntMinus1);
+        br->readBits(33);  // Force the reader to fail.
+        return;
+    }
+    br->readBits(8);  // bit_rate_scale + cpb_size_scale
+    for (uint32_t i = 0; i <= cpbCntMinus1; ++i) {
+        br->readUE();    // bit_rate_value_minus1
+        br->readUE();    // cpb_size_value_minus1
+        br->readFlag();  // cbr_flag
+    }
+    // initial_cpb_removal_delay_length_minus1 + cpb_removal_delay_length_minus1 +
+    // dpb_output_delay_length_minus1 + time_offset_length
+    br->readBits(20);
+}
+
+// Parse the vui_parameters() syntax, only the bitstream restrictions are stored.
+void parseVuiParameters(RbspBitReader* br, H264SPS* sps) {
+    if (br->readFlag()) {              // aspect_ratio_info_present_flag
+        if (br->readBits(8) == 255) {  // aspect_ratio_idc == Extended_SAR
+            br->readBits(32);          // sar_width + sar_height
+        }
+    }
+    if (br->readFlag()) {  // overscan_info_present_flag
+        br->readFlag();    // overscan_appropriate_flag
+    }
+    if (br->readFlag()) {      // video_signal_type_present_flag
+        br->readBits(4);       // video_format + video_full_range_flag
+        if (br->readFlag()) {  // colour_description_present_flag
+            br->readBits(24);  // colour_primaries + transfer_characteristics + matrix_coefficients
+        }
+    }
+    if (br->readFlag()) {  // chroma_loc_info_present_flag
+        br->readUE();      // chroma_sample_loc_type_top_field
+        br->readUE();      // chroma_sample_loc_type_bottom_field
+    }
+    if (br->readFlag()) {  // timing_info_present_flag
+        br->readBits(32);  // num_units_in_tick
+        br->readBits(32);  // time_scale
+        br->readFlag();    // fixed_frame_rate_flag
+    }
+    const bool nalHrdParametersPresentFlag = br->readFlag();
+    if (nalHrdParametersPresentFlag) skipHrdParameters(br);
+    const bool vclHrdParametersPresentFlag = br->readFlag();
+    if (vclHrdParametersPresentFlag) skipHrdParameters(br);
+    if (nalHrdParametersPresentFlag || vclHrdParametersPresentFlag) {
+        br->readFlag();  // low_delay_hrd_flag
+    }
+    br->readFlag();  // pic_struct_present_flag
+
+    sps->bitstreamRestrictionFlag = br->readFlag();
+    if (sps->bitstreamRestrictionFlag) {
+        br->readFlag();  // motion_vectors_over_pic_boundaries_flag
+        br->readUE();    // max_bytes_per_pic_denom
+        br->readUE();    // max_bits_per_mb_denom
+        br->readUE();    // log2_max_mv_length_horizontal
+        br->readUE();    // log2_max_mv_length_vertical
+        sps->maxNumReorderFrames = br->readUE();
+        sps->maxDecFrameBuffering = br->readUE();
+    }
+}
+
+// Skip the ref_pic_list_modification() syntax of a single reference list.
+bool skipRefPicListModification(RbspBitReader* br) {
+    if (!br->readFlag()) return true;  // ref_pic_list_modification_flag_lX
+
+    for (size_t i = 0; i < kMaxNumRefPicListModifications; ++i) {
+        const uint32_t modificationOfPicNumsIdc = br->readUE();
+        if (modificationOfPicNumsIdc == 3) return true;
+        if (modificationOfPicNumsIdc > 2 || br->failed()) return false;
+        br->readUE();  // abs_diff_pic_num_minus1 or long_term_pic_num
+    }
+    return false;
+}
+
+// Skip the pred_weight_table() syntax.
+void skipPredWeightTable(RbspBitReader* br, uint32_t chromaArrayType,
+                         const H264SliceHeader& header) {
+    br->readUE();                            // luma_log2_weight_denom
+    if (chromaArrayType != 0) br->readUE();  // chroma_log2_weight_denom
+
+    const size_t numLists = header.isBSlice() ? 2 : 1;
+    for (size_t list = 0; list < numLists; ++list) {
+        const uint32_t numRefIdxActiveMinus1 =
+                (list == 0) ? header.numRefIdxL0ActiveMinus1 : header.numRefIdxL1ActiveMinus1;
+        for (uint32_t i = 0; i <= numRefIdxActiveMinus1; ++i) {
+            if (br->readFlag()) {  // luma_weight_lX_flag
+                br->readSE();      // luma_weight_lX
+                br->readSE();      // luma_offset_lX
+            }
+            if (chromaArrayType != 0 && br->readFlag()) {  // chroma_weight_lX_flag
+                for (size_t j = 0; j < 2; ++j) {
+                    br->readSE();  // chroma_weight_lX
+                    br->readSE();  // chroma_offset_lX
+                }
+            }
+        }
+    }
+}
+
+// Parse the dec_ref_pic_marking() syntax into |header|.
+bool parseDecRefPicMarking(RbspBitReader* br, H264SliceHeader* header) {
+    if (header->idrPicFlag) {
+        header->noOutputOfPriorPicsFlag = br->readFlag();
+        header->longTermReferenceFlag = br->readFlag();
+        return true;
+    }
+
+    header->adaptiveRefPicMarkingModeFlag = br->readFlag();
+    if (!header->adaptiveRefPicMarkingModeFlag) return true;
+
+    for (size_t i = 0; i < kMaxNumMemoryManagementOperations; ++i) {
+        H264SliceHeader::MemoryManagementOperation operation;
+        operation.type = br->readUE();
+        if (operation.type == 0) return true;
+        if (operation.type > 6 || br->failed()) return false;
+
+        if (operation.type == 1 || operation.type == 3) {
+            operation.differenceOfPicNumsMinus1 = br->readUE();
+        }
+        if (operation.type == 2) operation.longTermPicNum = br->readUE();
+        if (operation.type == 3 || operation.type == 6) operation.longTermFrameIdx = br->readUE();
+        if (operation.type == 4) operation.maxLongTermFrameIdxPlus1 = br->readUE();
+        header->memoryManagementOperations.push_back(operation);
+    }
+    return false;
+}
+
+}  // namespace
+
+ui::Size H264SPS::codedSize() const {
+    return ui::Size((picWidthInMbsMinus1 + 1) * 16,
+                    (picHeightInMapUnitsMinus1 + 1) * (frameMbsOnlyFlag ? 1 : 2) * 16);
+}
+
+Rect H264SPS::visibleRect() const {
+    const ui::Size size = codedSize();
+    if (!frameCroppingFlag) return Rect(size.width, size.height);
+
+    // See the derivation of CropUnitX and CropUnitY in ITU-T H.264 section 7.4.2.1.1.
+    const uint32_t chromaArrayType = separateColourPlaneFlag ? 0 : chromaFormatIdc;
+    const uint32_t cropUnitX = (chromaArrayType == 1 || chromaArrayType == 2) ? 2 : 1;
+    const uint32_t cropUnitY = ((chromaArrayType == 1) ? 2 : 1) * (frameMbsOnlyFlag ? 1 : 2);
+
+    const int64_t left = static_cast<int64_t>(cropUnitX) * frameCropLeftOffset;
+    const int64_t right = size.width - static_cast<int64_t>(cropUnitX) * frameCropRightOffset;
+    const int64_t top = static_cast<int64_t>(cropUnitY) * frameCropTopOffset;
+    const int64_t bottom = size.height - static_cast<int64_t>(cropUnitY) * frameCropBottomOffset;
+    if (left >= right || top >= bottom) {
+        ALOGW("Invalid frame cropping offsets, ignoring them");
+        return Rect(size.width, size.height);
+    }
+    return Rect(left, top, right, bottom);
+}
+
+size_t H264SPS::dpbSize() const {
+    constexpr size_t kMaxDpbFrames = 16;
+
+    // Get MaxDpbMbs of the stream's level (ITU-T H.264 table A-1).
+    size_t maxDpbMbs = 0;
+    switch (levelIdc) {
+    case 9:  // Level 1b
+    case 10:
+        maxDpbMbs = 396;
+        break;
+    case 11:
+        // Level 1b in the Baseline, Main and Extended profiles is signaled using
+        // constraint_set3_flag.
+        maxDpbMbs = ((profileIdc == 66 || profileIdc == 77 || profileIdc == 88) &&
+                     (constraintSetFlags & (1 << 3)))
+                            ? 396
+                            : 900;
+        break;
+    case 12:
+    case 13:
+    case 20:
+        maxDpbMbs = 2376;
+        break;
+    case 21:
+        maxDpbMbs = 4752;
+        break;
+    case 22:
+    case 30:
+        maxDpbMbs = 8100;
+        break;
+    case 31:
+        maxDpbMbs = 18000;
+        break;
+    case 32:
+        maxDpbMbs = 20480;
+        break;
+    case 40:
+    case 41:
+        maxDpbMbs = 32768;
+        break;
+    case 42:
+        maxDpbMbs = 34816;
+        break;
+    case 50:
+        maxDpbMbs = 110400;
+        break;
+    case 51:
+    case 52:
+        maxDpbMbs = 184320;
+        break;
+    case 60:
+    case 61:
+    case 62:
+        maxDpbMbs = 696320;
+        break;
+    default:
+        ALOGW("Unknown level %u, assuming the largest DPB size", levelIdc);
+        break;
+    }
+
+    const ui::Size size = codedSize();
+    const size_t frameSizeInMbs = static_cast<size_t>(size.width / 16) * (size.height / 16);
+    size_t numFrames = maxDpbMbs > 0 ? maxDpbMbs / frameSizeInMbs : kMaxDpbFrames;
+    if (bitstreamRestrictionFlag) numFrames = maxDecFrameBuffering;
+    numFrames = std::max<size_t>(numFrames, maxNumRefFrames);
+    return std::clamp<size_t>(numFrames, 1, kMaxDpbFrames);
+}
+
+const H264SPS* H264Parser::parseSPS(const uint8_t* data, size_t length) {
+    ALOGV("%s(length=%zu)", __func__, length);
+
+    if (length < 1) return nullptr;
+    // Skip the NAL unit header.
+    RbspBitReader br(data + 1, length - 1);
+
+    H264SPS sps;
+    sps.profileIdc = br.readBits(8);
+    // constraint_set0_flag to constraint_set5_flag, followed by reserved_zero_2bits.
+    const uint32_t constraintFlags = br.readBits(8);
+    for (size_t i = 0; i < 6; ++i) {
+        if (constraintFlags & (0x80 >> i)) sps.constraintSetFlags |= (1 << i);
+    }
+    sps.levelIdc = br.readBits(8);
+    sps.seqParameterSetId = br.readUE();
+    if (sps.seqParameterSetId > 31) {
+        ALOGE("Invalid seq_parameter_set_id: %u", sps.seqParameterSetId);
+        return nullptr;
+    }
+
+    if (hasChromaFormatInfo(sps.profileIdc)) {
+        sps.chromaFormatIdc = br.readUE();
+        if (sps.chromaFormatIdc > 3) {
+            ALOGE("Invalid chroma_format_idc: %u", sps.chromaFormatIdc);
+            return nullptr;
+        }
+        if (sps.chromaFormatIdc == 3) sps.separateColourPlaneFlag = br.readFlag();
+        sps.bitDepthLumaMinus8 = br.readUE();
+        sps.bitDepthChromaMinus8 = br.readUE();
+        sps.qpprimeYZeroTransformBypassFlag = br.readFlag();
+        sps.seqScalingMatrixPresentFlag = br.readFlag();
+    }
+    if (sps.seqScalingMatrixPresentFlag) {
+        const size_t numLists = (sps.chromaFormatIdc != 3) ? 8 : 12;
+        parseScalingMatrix(&br, numLists, nullptr, nullptr, sps.scalingList4x4,
+                           sps.scalingList8x8);
+    } else {
+        // Flat_4x4_16 and Flat_8x8_16.
+        memset(sps.scalingList4x4, 16, sizeof(sps.scalingList4x4));
+        memset(sps.scalingList8x8, 16, sizeof(sps.scalingList8x8));
+    }
+
+    sps.log2MaxFrameNumMinus4 = br.readUE();
+    sps.picOrderCntType = br.readUE();
+    if (sps.log2MaxFrameNumMinus4 > 12 || sps.picOrderCntType > 2) {
+        ALOGE("Invalid log2_max_frame_num_minus4 (%u) or pic_order_cnt_type (%u)",
+              sps.log2MaxFrameNumMinus4, sps.picOrderCntType);
+        return nullptr;
+    }
+    if (sps.picOrderCntType == 0) {
+        sps.log2MaxPicOrderCntLsbMinus4 = br.readUE();
+        if (sps.log2MaxPicOrderCntLsbMinus4 > 12) {
+            ALOGE("Invalid log2_max_pic_order_cnt_lsb_minus4: %u",
+                  sps.log2MaxPicOrderCntLsbMinus4);
+            return nullptr;
+        }
+    } else if (sps.picOrderCntType == 1) {
+        sps.deltaPicOrderAlwaysZeroFlag = br.readFlag();
+        sps.offsetForNonRefPic = br.readSE();
+        sps.offsetForTopToBottomField = br.readSE();
+        sps.numRefFramesInPicOrderCntCycle = br.readUE();
+        if (sps.numRefFramesInPicOrderCntCycle > 255) {
+            ALOGE("Invalid num_ref_frames_in_pic_order_cnt_cycle: %u",
+                  sps.numRefFramesInPicOrderCntCycle);
+            return nullptr;
+        }
+        for (uint32_t i = 0; i < sps.numRefFramesInPicOrderCntCycle; ++i) {
+            sps.offsetForRefFrame[i] = br.readSE();
+            sps.expectedDeltaPerPicOrderCntCycle += sps.offsetForRefFrame[i];
+        }
+    }
+
+    sps.maxNumRefFrames = br.readUE();
+    sps.gapsInFrameNumValueAllowedFlag = br.readFlag();
+    sps.picWidthInMbsMinus1 = br.readUE();
+    sps.picHeightInMapUnitsMinus1 = br.readUE();
+    sps.frameMbsOnlyFlag = br.readFlag();
+    if (!sps.frameMbsOnlyFlag) sps.mbAdaptiveFrameFieldFlag = br.readFlag();
+    sps.direct8x8InferenceFlag = br.readFlag();
+    sps.frameCroppingFlag = br.readFlag();
+    if (sps.frameCroppingFlag) {
+        sps.frameCropLeftOffset = br.readUE();
+        sps.frameCropRightOffset = br.readUE();
+        sps.frameCropTopOffset = br.readUE();
+        sps.frameCropBottomOffset = br.readUE();
+    }
+    if (br.readFlag()) parseVuiParameters(&br, &sps);  // vui_parameters_present_flag
+
+    if (br.failed()) {
+        ALOGE("Failed to parse SPS");
+        return nullptr;
+    }
+    // Reject sizes that would overflow the derived values, no decoder supports these anyway.
+    if (sps.picWidthInMbsMinus1 >= 1024 || sps.picHeightInMapUnitsMinus1 >= 1024 ||
+        sps.maxNumRefFrames > 16) {
+        ALOGE("Unsupported SPS: %ux%u MBs, %u reference frames", sps.picWidthInMbsMinus1 + 1,
+              sps.picHeightInMapUnitsMinus1 + 1, sps.maxNumRefFrames);
+        return nullptr;
+    }
+
+    const uint32_t id = sps.seqParameterSetId;
+    mSPSs[id] = sps;
+    return &mSPSs[id];
+}
+
+const H264PPS* H264Parser::parsePPS(const uint8_t* data, size_t length) {
+    ALOGV("%s(length=%zu)", __func__, length);
+
+    if (length < 1) return nullptr;
+    // Skip the NAL unit header.
+    RbspBitReader br(data + 1, length - 1);
+
+    H264PPS pps;
+    pps.picParameterSetId = br.readUE();
+    pps.seqParameterSetId = br.readUE();
+    if (pps.picParameterSetId > 255 || br.failed()) {
+        ALOGE("Invalid pic_parameter_set_id: %u", pps.picParameterSetId);
+        return nullptr;
+    }
+    const H264SPS* sps = getSPS(pps.seqParameterSetId);
+    if (!sps) {
+        ALOGE("PPS %u refers to unknown SPS %u", pps.picParameterSetId, pps.seqParameterSetId);
+        return nullptr;
+    }
+
+    pps.entropyCodingModeFlag = br.readFlag();
+    pps.bottomFieldPicOrderInFramePresentFlag = br.readFlag();
+    pps.numSliceGroupsMinus1 = br.readUE();
+    if (pps.numSliceGroupsMinus1 > 7) {
+        ALOGE("Invalid num_slice_groups_minus1: %u", pps.numSliceGroupsMinus1);
+        return nullptr;
+    }
+    if (pps.numSliceGroupsMinus1 > 0) {
+        pps.sliceGroupMapType = br.readUE();
+        switch (pps.sliceGroupMapType) {
+        case 0:
+            for (uint32_t i = 0; i <= pps.numSliceGroupsMinus1; ++i) {
+                br.readUE();  // run_length_minus1
+            }
+            break;
+        case 2:
+            for (uint32_t i = 0; i < pps.numSliceGroupsMinus1; ++i) {
+                br.readUE();  // top_left
+                br.readUE();  // bottom_right
+            }
+            break;
+        case 3:
+        case 4:
+        case 5:
+            br.readFlag();  // slice_group_change_direction_flag
+            pps.sliceGroupChangeRateMinus1 = br.readUE();
+            break;
+        case 6: {
+            const uint32_t picSizeInMapUnitsMinus1 = br.readUE();
+            if (picSizeInMapUnitsMinus1 >= 1024 * 1024) {
+                ALOGE("Invalid pic_size_in_map_units_minus1: %u", picSizeInMapUnitsMinus1);
+                return nullptr;
+            }
+            const uint32_t numBits = ceilLog2(pps.numSliceGroupsMinus1 + 1);
+            for (uint32_t i = 0; i <= picSizeInMapUnitsMinus1; ++i) {
+                br.readBits(numBits);  // slice_group_id
+            }
+            break;
+        }
+        default:
+            if (pps.sliceGroupMapType > 6) {
+                ALOGE("Invalid slice_group_map_type: %u", pps.sliceGroupMapType);
+                return nullptr;
+            }
+            break;
+        }
+    }
+
+    pps.numRefIdxL0DefaultActiveMinus1 = br.readUE();
+    pps.numRefIdxL1DefaultActiveMinus1 = br.readUE();
+    pps.weightedPredFlag = br.readFlag();
+    pps.weightedBipredIdc = br.readBits(2);
+    pps.picInitQpMinus26 = br.readSE();
+    pps.picInitQsMinus26 = br.readSE();
+    pps.chromaQpIndexOffset = br.readSE();
+    pps.deblockingFilterControlPresentFlag = br.readFlag();
+    pps.constrainedIntraPredFlag = br.readFlag();
+    pps.redundantPicCntPresentFlag = br.readFlag();
+    if (pps.numRefIdxL0DefaultActiveMinus1 > 31 || pps.numRefIdxL1DefaultActiveMinus1 > 31) {
+        ALOGE("Invalid default number of active references");
+        return nullptr;
+    }
+
+    if (br.hasMoreRbspData()) {
+        pps.transform8x8ModeFlag = br.readFlag();
+        pps.picScalingMatrixPresentFlag = br.readFlag();
+        if (pps.picScalingMatrixPresentFlag) {
+            const size_t numLists =
+                    6 + (pps.transform8x8ModeFlag ? (sps->chromaFormatIdc != 3 ? 2 : 6) : 0);
+            parseScalingMatrix(&br, numLists, sps->scalingList4x4, sps->scalingList8x8,
+                               pps.scalingList4x4, pps.scalingList8x8);
+        }
+        pps.secondChromaQpIndexOffset = br.readSE();
+    } else {
+        pps.secondChromaQpIndexOffset = pps.chromaQpIndexOffset;
+    }
+    if (!pps.picScalingMatrixPresentFlag) {
+        memcpy(pps.scalingList4x4, sps->scalingList4x4, sizeof(pps.scalingList4x4));
+        memcpy(pps.scalingList8x8, sps->scalingList8x8, sizeof(pps.scalingList8x8));
+    }
+
+    if (br.failed()) {
+        ALOGE("Failed to parse PPS");
+        return nullptr;
+    }
+
+    const uint32_t id = pps.picParameterSetId;
+    mPPSs[id] = pps;
+    return &mPPSs[id];
+}
+
+bool H264Parser::parseSliceHeader(const uint8_t* data, size_t length,
+                                  H264SliceHeader* header) const {
+    ALOGV("%s(length=%zu)", __func__, length);
+    ALOG_ASSERT(header);
+
+    if (length < 1) return false;
+    *header = H264SliceHeader();
+    // First byte is forbidden_zero_bit (1) + nal_ref_idc (2) + nal_unit_type (5)
+    header->nalRefIdc = (data[0] >> 5) & 0x3;
+    header->idrPicFlag = (data[0] & 0x1f) == NalParser::kIDRType;
+    RbspBitReader br(data + 1, length - 1);
+
+    header->firstMbInSlice = br.readUE();
+    const uint32_t sliceType = br.readUE();
+    header->picParameterSetId = br.readUE();
+    if (sliceType > 9 || br.failed()) {
+        ALOGE("Invalid slice_type: %u", sliceType);
+        return false;
+    }
+    header->sliceType = sliceType % 5;
+
+    const H264PPS* pps = getPPS(header->picParameterSetId);
+    const H264SPS* sps = pps ? getSPS(pps->seqParameterSetId) : nullptr;
+    if (!sps) {
+        ALOGE("Slice refers to unknown PPS %u", header->picParameterSetId);
+        return false;
+    }
+
+    if (sps->separateColourPlaneFlag) br.readBits(2);  // colour_plane_id
+    header->frameNum = br.readBits(sps->log2MaxFrameNumMinus4 + 4);
+    if (!sps->frameMbsOnlyFlag) {
+        header->fieldPicFlag = br.readFlag();
+        if (header->fieldPicFlag) header->bottomFieldFlag = br.readFlag();
+    }
+    if (header->idrPicFlag) header->idrPicId = br.readUE();
+
+    const size_t picOrderCntStart = br.bitsRead();
+    if (sps->picOrderCntType == 0) {
+        header->picOrderCntLsb = br.readBits(sps->log2MaxPicOrderCntLsbMinus4 + 4);
+        if (pps->bottomFieldPicOrderInFramePresentFlag && !header->fieldPicFlag) {
+            header->deltaPicOrderCntBottom = br.readSE();
+        }
+    }
+    if (sps->picOrderCntType == 1 && !sps->deltaPicOrderAlwaysZeroFlag) {
+        header->deltaPicOrderCnt[0] = br.readSE();
+        if (pps->bottomFieldPicOrderInFramePresentFlag && !header->fieldPicFlag) {
+            header->deltaPicOrderCnt[1] = br.readSE();
+        }
+    }
+    header->picOrderCntBitSize = br.bitsRead() - picOrderCntStart;
+
+    if (pps->redundantPicCntPresentFlag) header->redundantPicCnt = br.readUE();
+    if (header->isBSlice()) br.readFlag();  // direct_spatial_mv_pred_flag
+
+    header->numRefIdxL0ActiveMinus1 = pps->numRefIdxL0DefaultActiveMinus1;
+    header->numRefIdxL1ActiveMinus1 = pps->numRefIdxL1DefaultActiveMinus1;
+    if (header->isPSlice() || header->isBSlice()) {
+        if (br.readFlag()) {  // num_ref_idx_active_override_flag
+            header->numRefIdxL0ActiveMinus1 = br.readUE();
+            if (header->isBSlice()) header->numRefIdxL1ActiveMinus1 = br.readUE();
+        }
+    }
+    if (header->numRefIdxL0ActiveMinus1 > 31 || header->numRefIdxL1ActiveMinus1 > 31) {
+        ALOGE("Invalid number of active references");
+        return false;
+    }
+
+    if (!header->isISlice()) {
+        if (!skipRefPicListModification(&br) ||
+            (header->isBSlice() && !skipRefPicListModification(&br))) {
+            ALOGE("Invalid ref_pic_list_modification()");
+            return false;
+        }
+    }
+
+    if ((pps->weightedPredFlag && header->isPSlice()) ||
+        (pps->weightedBipredIdc == 1 && header->isBSlice())) {
+        const uint32_t chromaArrayType = sps->separateColourPlaneFlag ? 0 : sps->chromaFormatIdc;
+        skipPredWeightTable(&br, chromaArrayType, *header);
+    }
+
+    if (header->nalRefIdc != 0) {
+        const size_t decRefPicMarkingStart = br.bitsRead();
+        if (!parseDecRefPicMarking(&br, header)) {
+            ALOGE("Invalid dec_ref_pic_marking()");
+            return false;
+        }
+        header->decRefPicMarkingBitSize = br.bitsRead() - decRefPicMarkingStart;
+    }
+
+    if (pps->entropyCodingModeFlag && !header->isISlice()) br.readUE();  // cabac_init_idc
+    br.readSE();                                                          // slice_qp_delta
+    if (header->sliceType == H264SliceHeader::kSP || header->sliceType == H264SliceHeader::kSI) {
+        if (header->sliceType == H264SliceHeader::kSP) br.readFlag();  // sp_for_switch_flag
+        br.readSE();                                                    // slice_qs_delta
+    }
+    if (pps->deblockingFilterControlPresentFlag) {
+        if (br.readUE() != 1) {  // disable_deblocking_filter_idc
+            br.readSE();         // slice_alpha_c0_offset_div2
+            br.readSE();         // slice_beta_offset_div2
+        }
+    }
+    if (pps->numSliceGroupsMinus1 > 0 && pps->sliceGroupMapType >= 3 &&
+        pps->sliceGroupMapType <= 5) {
+        const uint32_t picSizeInMapUnits =
+                (sps->picWidthInMbsMinus1 + 1) * (sps->picHeightInMapUnitsMinus1 + 1);
+        const uint32_t sliceGroupChangeRate = pps->sliceGroupChangeRateMinus1 + 1;
+        const uint32_t maxSliceGroupChangeCycle =
+                (picSizeInMapUnits + sliceGroupChangeRate - 1) / sliceGroupChangeRate;
+        header->sliceGroupChangeCycle = br.readBits(ceilLog2(maxSliceGroupChangeCycle + 1));
+    }
+
+    if (br.failed()) {
+        ALOGE("Failed to parse slice header");
+        return false;
+    }
+    return true;
+}
+
+const H264SPS* H264Parser::getSPS(uint32_t id) const {
+    auto it = mSPSs.find(id);
+    return (it != mSPSs.end()) ? &it->second : nullptr;
+}
+
+const H264PPS* H264Parser::getPPS(uint32_t id) const {
+    auto it = mPPSs.find(id);
+    return (it != mPPSs.end()) ? &it->second : nullptr;
+}
+
+}  // namespace android
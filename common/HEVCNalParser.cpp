@@ -0,0 +1,335 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "HEVCNalParser"
+
+#include <v4l2_codec2/common/HEVCNalParser.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <media/stagefright/foundation/ABitReader.h>
+#include <utils/Log.h>
+
+namespace android {
+
+namespace {
+
+constexpr uint32_t kYUV444Idc = 3;
+// The maximum number of short-term reference picture sets in a SPS.
+constexpr uint32_t kMaxNumShortTermRefPicSets = 64;
+// The maximum number of pictures in a short-term reference picture set.
+constexpr uint32_t kMaxNumDeltaPocs = 16;
+
+// Read unsigned int encoded with exponential-golomb.
+bool parseUE(ABitReader* br, uint32_t* val) {
+    uint32_t numZeroes = 0;
+    uint32_t bit;
+    if (!br->getBitsGraceful(1, &bit)) return false;
+    while (bit == 0) {
+        ++numZeroes;
+        if (!br->getBitsGraceful(1, &bit)) return false;
+    }
+    if (!br->getBitsGraceful(numZeroes, val)) return false;
+    *val += (1u << numZeroes) - 1;
+    return true;
+}
+
+// Read signed int encoded with exponential-golomb.
+bool parseSE(ABitReader* br, int32_t* val) {
+    uint32_t codeNum;
+    if (!parseUE(br, &codeNum)) return false;
+    *val = (codeNum & 1) ? (codeNum + 1) >> 1 : -static_cast<int32_t>(codeNum >> 1);
+    return true;
+}
+
+// Copy the NAL unit |data| into |rbsp|, removing the emulation prevention bytes. Unlike H.264 SPSs,
+// HEVC SPSs nearly always contain emulation prevention bytes, as the profile_tier_level() syntax
+// has a long run of reserved zero bits.
+void removeEmulationPreventionBytes(const uint8_t* data, size_t length,
+                                    std::vector<uint8_t>* rbsp) {
+    rbsp->clear();
+    rbsp->reserve(length);
+    size_t numZeroBytes = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (numZeroBytes >= 2 && data[i] == 0x03) {
+            numZeroBytes = 0;
+            continue;
+        }
+        numZeroBytes = (data[i] == 0x00) ? numZeroBytes + 1 : 0;
+        rbsp->push_back(data[i]);
+    }
+}
+
+// Skip the profile_tier_level() syntax in the specified bitstream (ITU-T H.265 section 7.3.3).
+bool skipProfileTierLevel(ABitReader* br, uint32_t maxNumSubLayersMinus1) {
+    // general_profile_space + general_tier_flag + general_profile_idc (8),
+    // general_profile_compatibility_flag[32] (32), general constraint flags (48),
+    // general_level_idc (8).
+    if (!br->skipBits(96)) return false;
+
+    uint32_t subLayerProfilePresentFlags[8] = {};
+    uint32_t subLayerLevelPresentFlags[8] = {};
+    for (uint32_t i = 0; i < maxNumSubLayersMinus1; ++i) {
+        if (!br->getBitsGraceful(1, &subLayerProfilePresentFlags[i])) return false;
+        if (!br->getBitsGraceful(1, &subLayerLevelPresentFlags[i])) return false;
+    }
+    if (maxNumSubLayersMinus1 > 0) {
+        // reserved_zero_2bits
+        if (!br->skipBits(2 * (8 - maxNumSubLayersMinus1))) return false;
+    }
+    for (uint32_t i = 0; i < maxNumSubLayersMinus1; ++i) {
+        if (subLayerProfilePresentFlags[i] && !br->skipBits(88)) return false;
+        if (subLayerLevelPresentFlags[i] && !br->skipBits(8)) return false;  // sub_layer_level_idc
+    }
+    return true;
+}
+
+// Skip the scaling_list_data() syntax in the specified bitstream (ITU-T H.265 section 7.3.4).
+bool skipScalingListData(ABitReader* br) {
+    uint32_t unused;
+    int32_t unused_i;
+    for (uint32_t sizeId = 0; sizeId < 4; ++sizeId) {
+        for (uint32_t matrixId = 0; matrixId < 6; matrixId += (sizeId == 3) ? 3 : 1) {
+            uint32_t scalingListPredModeFlag;
+            if (!br->getBitsGraceful(1, &scalingListPredModeFlag)) return false;
+            if (!scalingListPredModeFlag) {
+                // scaling_list_pred_matrix_id_delta
+                if (!parseUE(br, &unused)) return false;
+                continue;
+            }
+            const uint32_t coefNum = std::min(64u, 1u << (4 + (sizeId << 1)));
+            if (sizeId > 1) {
+                if (!parseSE(br, &unused_i)) return false;  // scaling_list_dc_coef_minus8
+            }
+            for (uint32_t i = 0; i < coefNum; ++i) {
+                if (!parseSE(br, &unused_i)) return false;  // scaling_list_delta_coef
+            }
+        }
+    }
+    return true;
+}
+
+// Skip the st_ref_pic_set(|stRpsIdx|) syntax in the specified bitstream (ITU-T H.265 section
+// 7.3.7). The number of pictures in each parsed set is stored in |numDeltaPocs|, as sets can be
+// predicted from the previous one.
+bool skipShortTermRefPicSet(ABitReader* br, uint32_t stRpsIdx, uint32_t* numDeltaPocs) {
+    uint32_t unused;
+    uint32_t interRefPicSetPredictionFlag = 0;
+    if (stRpsIdx != 0) {
+        if (!br->getBitsGraceful(1, &interRefPicSetPredictionFlag)) return false;
+    }
+
+    if (interRefPicSetPredictionFlag) {
+        // delta_idx_minus1 is only present in slice headers, the reference set is always the
+        // previous one in the SPS.
+        if (!br->skipBits(1)) return false;       // delta_rps_sign
+        if (!parseUE(br, &unused)) return false;  // abs_delta_rps_minus1
+        uint32_t count = 0;
+        for (uint32_t j = 0; j <= numDeltaPocs[stRpsIdx - 1]; ++j) {
+            uint32_t usedByCurrPicFlag;
+            uint32_t useDeltaFlag = 1;
+            if (!br->getBitsGraceful(1, &usedByCurrPicFlag)) return false;
+            if (!usedByCurrPicFlag) {
+                if (!br->getBitsGraceful(1, &useDeltaFlag)) return false;
+            }
+            if (usedByCurrPicFlag || useDeltaFlag) ++count;
+        }
+        numDeltaPocs[stRpsIdx] = count;
+    } else {
+        uint32_t numNegativePics;
+        uint32_t numPositivePics;
+        if (!parseUE(br, &numNegativePics) || !parseUE(br, &numPositivePics)) return false;
+        if (numNegativePics > kMaxNumDeltaPocs || numPositivePics > kMaxNumDeltaPocs) {
+            ALOGW("Invalid number of pictures in short-term reference picture set");
+            return false;
+        }
+        for (uint32_t i = 0; i < numNegativePics + numPositivePics; ++i) {
+            if (!parseUE(br, &unused)) return false;  // delta_poc_s0/s1_minus1
+            if (!br->skipBits(1)) return false;       // used_by_curr_pic_s0/s1_flag
+        }
+        numDeltaPocs[stRpsIdx] = numNegativePics + numPositivePics;
+    }
+
+    if (numDeltaPocs[stRpsIdx] > kMaxNumDeltaPocs) {
+        ALOGW("Invalid number of pictures in short-term reference picture set");
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+HEVCNalParser::HEVCNalParser(const uint8_t* data, size_t length) : NalParser(data, length) {}
+
+bool HEVCNalParser::locateSPS() {
+    while (locateNextNal()) {
+        if (length() < 2) continue;
+        if (type() != kSPSType) continue;
+        return true;
+    }
+
+    return false;
+}
+
+uint8_t HEVCNalParser::type() const {
+    // First byte is forbidden_zero_bit (1) + nal_unit_type (6) + nuh_layer_id high bit (1)
+    constexpr uint8_t kNALTypeMask = 0x3f;
+    return (*data() >> 1) & kNALTypeMask;
+}
+
+bool HEVCNalParser::findCodedColorAspects(ColorAspects* colorAspects) {
+    ALOG_ASSERT(colorAspects);
+    ALOG_ASSERT(type() == kSPSType);
+
+    // As for H.264, we need to parse the entire SPS header up until the Video Usability Information
+    // (VUI) parameters that contain the color aspects.
+    std::vector<uint8_t> rbsp;
+    removeEmulationPreventionBytes(data(), length(), &rbsp);
+    if (rbsp.size() < 2) return false;
+
+    // Skip the two-byte NAL unit header.
+    ABitReader br(rbsp.data() + 2, rbsp.size() - 2);
+
+    uint32_t unused;
+    br.skipBits(4);  // sps_video_parameter_set_id
+    uint32_t maxSubLayersMinus1;
+    if (!br.getBitsGraceful(3, &maxSubLayersMinus1)) return false;  // sps_max_sub_layers_minus1
+    br.skipBits(1);  // sps_temporal_id_nesting_flag
+    if (!skipProfileTierLevel(&br, maxSubLayersMinus1)) return false;
+    parseUE(&br, &unused);  // sps_seq_parameter_set_id
+
+    uint32_t chromaFormatIdc;
+    if (!parseUE(&br, &chromaFormatIdc)) return false;  // chroma_format_idc
+    if (chromaFormatIdc == kYUV444Idc) {
+        br.skipBits(1);  // separate_colour_plane_flag
+    }
+    parseUE(&br, &unused);  // pic_width_in_luma_samples
+    parseUE(&br, &unused);  // pic_height_in_luma_samples
+
+    uint32_t conformanceWindowFlag;
+    if (!br.getBitsGraceful(1, &conformanceWindowFlag)) return false;  // conformance_window_flag
+    if (conformanceWindowFlag) {
+        parseUE(&br, &unused);  // conf_win_left_offset
+        parseUE(&br, &unused);  // conf_win_right_offset
+        parseUE(&br, &unused);  // conf_win_top_offset
+        parseUE(&br, &unused);  // conf_win_bottom_offset
+    }
+
+    parseUE(&br, &unused);  // bit_depth_luma_minus8
+    parseUE(&br, &unused);  // bit_depth_chroma_minus8
+    uint32_t log2MaxPicOrderCntLsbMinus4;
+    if (!parseUE(&br, &log2MaxPicOrderCntLsbMinus4))
+        return false;  // log2_max_pic_order_cnt_lsb_minus4
+
+    uint32_t subLayerOrderingInfoPresentFlag;
+    if (!br.getBitsGraceful(1, &subLayerOrderingInfoPresentFlag))
+        return false;  // sps_sub_layer_ordering_info_present_flag
+    for (uint32_t i = subLayerOrderingInfoPresentFlag ? 0 : maxSubLayersMinus1;
+         i <= maxSubLayersMinus1; ++i) {
+        parseUE(&br, &unused);  // sps_max_dec_pic_buffering_minus1
+        parseUE(&br, &unused);  // sps_max_num_reorder_pics
+        parseUE(&br, &unused);  // sps_max_latency_increase_plus1
+    }
+
+    parseUE(&br, &unused);  // log2_min_luma_coding_block_size_minus3
+    parseUE(&br, &unused);  // log2_diff_max_min_luma_coding_block_size
+    parseUE(&br, &unused);  // log2_min_luma_transform_block_size_minus2
+    parseUE(&br, &unused);  // log2_diff_max_min_luma_transform_block_size
+    parseUE(&br, &unused);  // max_transform_hierarchy_depth_inter
+    parseUE(&br, &unused);  // max_transform_hierarchy_depth_intra
+
+    uint32_t scalingListEnabledFlag;
+    if (!br.getBitsGraceful(1, &scalingListEnabledFlag)) return false;  // scaling_list_enabled_flag
+    if (scalingListEnabledFlag) {
+        uint32_t scalingListDataPresentFlag;
+        if (!br.getBitsGraceful(1, &scalingListDataPresentFlag))
+            return false;  // sps_scaling_list_data_present_flag
+        if (scalingListDataPresentFlag && !skipScalingListData(&br)) return false;
+    }
+
+    br.skipBits(1);  // amp_enabled_flag
+    br.skipBits(1);  // sample_adaptive_offset_enabled_flag
+    uint32_t pcmEnabledFlag;
+    if (!br.getBitsGraceful(1, &pcmEnabledFlag)) return false;  // pcm_enabled_flag
+    if (pcmEnabledFlag) {
+        br.skipBits(8);         // pcm_sample_bit_depth_luma_minus1 + ..._chroma_minus1
+        parseUE(&br, &unused);  // log2_min_pcm_luma_coding_block_size_minus3
+        parseUE(&br, &unused);  // log2_diff_max_min_pcm_luma_coding_block_size
+        br.skipBits(1);         // pcm_loop_filter_disabled_flag
+    }
+
+    uint32_t numShortTermRefPicSets;
+    if (!parseUE(&br, &numShortTermRefPicSets)) return false;  // num_short_term_ref_pic_sets
+    if (numShortTermRefPicSets > kMaxNumShortTermRefPicSets) return false;
+    uint32_t numDeltaPocs[kMaxNumShortTermRefPicSets] = {};
+    for (uint32_t i = 0; i < numShortTermRefPicSets; ++i) {
+        if (!skipShortTermRefPicSet(&br, i, numDeltaPocs)) return false;
+    }
+
+    uint32_t longTermRefPicsPresentFlag;
+    if (!br.getBitsGraceful(1, &longTermRefPicsPresentFlag))
+        return false;  // long_term_ref_pics_present_flag
+    if (longTermRefPicsPresentFlag) {
+        uint32_t numLongTermRefPicsSps;
+        if (!parseUE(&br, &numLongTermRefPicsSps)) return false;  // num_long_term_ref_pics_sps
+        for (uint32_t i = 0; i < numLongTermRefPicsSps; ++i) {
+            br.skipBits(log2MaxPicOrderCntLsbMinus4 + 4);  // lt_ref_pic_poc_lsb_sps
+            br.skipBits(1);                                // used_by_curr_pic_lt_sps_flag
+        }
+    }
+
+    br.skipBits(1);  // sps_temporal_mvp_enabled_flag
+    br.skipBits(1);  // strong_intra_smoothing_enabled_flag
+
+    uint32_t vuiParametersPresentFlag;
+    if (!br.getBitsGraceful(1, &vuiParametersPresentFlag))
+        return false;  // vui_parameters_present_flag
+    if (vuiParametersPresentFlag) {
+        uint32_t aspectRatioInfoPresentFlag;
+        if (!br.getBitsGraceful(1, &aspectRatioInfoPresentFlag))
+            return false;  // VUI aspect_ratio_info_present_flag
+        if (aspectRatioInfoPresentFlag) {
+            uint32_t aspectRatioIdc;
+            if (!br.getBitsGraceful(8, &aspectRatioIdc)) return false;  // VUI aspect_ratio_idc
+            if (aspectRatioIdc == 255) {  // VUI aspect_ratio_idc == extended sample aspect ratio
+                br.skipBits(32);          // VUI sar_width + sar_height
+            }
+        }
+
+        uint32_t overscanInfoPresentFlag;
+        if (!br.getBitsGraceful(1, &overscanInfoPresentFlag))
+            return false;  // VUI overscan_info_present_flag
+        if (overscanInfoPresentFlag) {
+            br.skipBits(1);  // VUI overscan_appropriate_flag
+        }
+        uint32_t videoSignalTypePresentFlag;
+        if (!br.getBitsGraceful(1, &videoSignalTypePresentFlag))
+            return false;  // VUI video_signal_type_present_flag
+        if (videoSignalTypePresentFlag) {
+            br.skipBits(3);  // VUI video_format
+            uint32_t videoFullRangeFlag;
+            if (!br.getBitsGraceful(1, &videoFullRangeFlag))
+                return false;  // VUI video_full_range_flag
+            colorAspects->fullRange = videoFullRangeFlag;
+            uint32_t colourDescriptionPresentFlag;
+            if (!br.getBitsGraceful(1, &colourDescriptionPresentFlag))
+                return false;  // VUI colour_description_present_flag
+            if (colourDescriptionPresentFlag) {
+                if (!br.getBitsGraceful(8, &colorAspects->primaries))
+                    return false;  // VUI colour_primaries
+                if (!br.getBitsGraceful(8, &colorAspects->transfer))
+                    return false;  // VUI transfer_characteristics
+                if (!br.getBitsGraceful(8, &colorAspects->coeffs))
+                    return false;  // VUI matrix_coeffs
+                return true;
+            }
+        }
+    }
+
+    return false;  // The NAL unit doesn't contain color aspects info.
+}
+
+}  // namespace android
@@ -0,0 +1,150 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "LatencyTracker"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
+
+#include <v4l2_codec2/common/LatencyTracker.h>
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <set>
+#include <utility>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/trace.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The registry of all trackers alive in the process, used by LatencyTracker::dumpAll().
+struct Registry {
+    std::mutex mLock;
+    std::set<LatencyTracker*> mTrackers;
+};
+
+Registry* getRegistry() {
+    // The registry is intentionally leaked, as trackers might still be destroyed while static
+    // objects are destroyed on process exit.
+    static Registry* sRegistry = new Registry();
+    return sRegistry;
+}
+
+// Get the sample at the specified |percentile| of |samples|, reorders |samples|.
+int64_t getPercentile(std::vector<int64_t>* samples, size_t percentile) {
+    const size_t index = std::min(samples->size() * percentile / 100, samples->size() - 1);
+    std::nth_element(samples->begin(), samples->begin() + index, samples->end());
+    return (*samples)[index];
+}
+
+}  // namespace
+
+LatencyTracker::LatencyTracker(std::string name) : mName(std::move(name)) {
+    ALOGV("%s(%s)", __func__, mName.c_str());
+
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+    registry->mTrackers.insert(this);
+}
+
+LatencyTracker::~LatencyTracker() {
+    ALOGV("%s(%s)", __func__, mName.c_str());
+
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+    registry->mTrackers.erase(this);
+}
+
+void LatencyTracker::mark(uint64_t id, const char* stage) {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mLastMarks.find(id);
+    if (it == mLastMarks.end()) {
+        if (mLastMarks.size() >= kMaxPendingItems) {
+            ALOGW("%s: too many items tracked, dropping %zu items", mName.c_str(),
+                  mLastMarks.size());
+            mLastMarks.clear();
+        }
+        mLastMarks.emplace(id, now);
+        return;
+    }
+
+    recordLocked(stage,
+                 std::chrono::duration_cast<std::chrono::microseconds>(now - it->second).count());
+    it->second = now;
+}
+
+void LatencyTracker::finish(uint64_t id, const char* stage) {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mLastMarks.find(id);
+    if (it == mLastMarks.end()) return;
+
+    recordLocked(stage,
+                 std::chrono::duration_cast<std::chrono::microseconds>(now - it->second).count());
+    mLastMarks.erase(it);
+}
+
+void LatencyTracker::recordDuration(const char* stage, std::chrono::microseconds duration) {
+    std::lock_guard<std::mutex> lock(mLock);
+    recordLocked(stage, duration.count());
+}
+
+void LatencyTracker::clear() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mLastMarks.clear();
+}
+
+void LatencyTracker::recordLocked(const char* stage, int64_t durationUs) {
+    auto it = mStageIndices.find(stage);
+    if (it == mStageIndices.end()) {
+        it = mStageIndices.emplace(stage, mStages.size()).first;
+        mStages.emplace_back();
+        mStages.back().mName = stage;
+        mStages.back().mCounterName = mName + "." + stage;
+    }
+
+    Stage& s = mStages[it->second];
+    s.mSamplesUs[s.mNextSample] = durationUs;
+    s.mNextSample = (s.mNextSample + 1) % kNumSamples;
+    s.mNumSamples = std::min(s.mNumSamples + 1, kNumSamples);
+
+    if (ATRACE_ENABLED()) ATRACE_INT(s.mCounterName.c_str(), static_cast<int32_t>(durationUs));
+}
+
+std::string LatencyTracker::dump() const {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    std::string result = base::StringPrintf("%s: %zu items in flight\n", mName.c_str(),
+                                            mLastMarks.size());
+    for (const Stage& s : mStages) {
+        std::vector<int64_t> samples(s.mSamplesUs.begin(), s.mSamplesUs.begin() + s.mNumSamples);
+        if (samples.empty()) continue;
+
+        const int64_t p50 = getPercentile(&samples, 50);
+        const int64_t p99 = getPercentile(&samples, 99);
+        result += base::StringPrintf("  %-16s p50=%" PRId64 "us p99=%" PRId64 "us (%zu samples)\n",
+                                     s.mName.c_str(), p50, p99, samples.size());
+    }
+    return result;
+}
+
+// static
+std::string LatencyTracker::dumpAll() {
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+
+    std::string result;
+    for (const LatencyTracker* tracker : registry->mTrackers) {
+        result += tracker->dump();
+    }
+    return result;
+}
+
+}  // namespace android
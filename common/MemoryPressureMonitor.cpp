@@ -0,0 +1,170 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "MemoryPressureMonitor"
+
+#include <v4l2_codec2/common/MemoryPressureMonitor.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <base/bind.h>
+#include <base/posix/eintr_wrapper.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+constexpr char kPsiMemoryPath[] = "/proc/pressure/memory";
+// The default memory stall time per window above which the system is considered under pressure.
+constexpr int32_t kDefaultPsiStallMs = 100;
+// The window over which the PSI stall time is measured.
+constexpr int64_t kPsiWindowUs = 1000000;
+// The time without pressure after which the pressure is considered relieved.
+constexpr int64_t kReliefDelayMs = 10000;
+
+}  // namespace
+
+// static
+MemoryPressureMonitor* MemoryPressureMonitor::getInstance() {
+    // The monitor is intentionally leaked, as observers might still be removed while static objects
+    // are destroyed on process exit.
+    static MemoryPressureMonitor* sInstance = new MemoryPressureMonitor();
+    return sInstance;
+}
+
+MemoryPressureMonitor::MemoryPressureMonitor() {
+    ALOGV("%s()", __func__);
+
+    if (!mThread.Start()) {
+        ALOGE("Failed to start the monitor thread, memory pressure is only reported manually.");
+        return;
+    }
+
+    const int32_t stallMs =
+            property_get_int32("ro.vendor.v4l2_codec2.psi_stall_ms", kDefaultPsiStallMs);
+    if (stallMs > 0) {
+        mThread.task_runner()->PostTask(
+                FROM_HERE, base::BindOnce(&MemoryPressureMonitor::startPsiMonitoringTask,
+                                          base::Unretained(this), stallMs));
+    }
+}
+
+void MemoryPressureMonitor::startPsiMonitoringTask(int32_t stallMs) {
+    ALOGV("%s(%dms)", __func__, stallMs);
+    ALOG_ASSERT(mThread.task_runner()->RunsTasksInCurrentSequence());
+
+    base::ScopedFD fd(HANDLE_EINTR(open(kPsiMemoryPath, O_RDWR | O_NONBLOCK | O_CLOEXEC)));
+    if (!fd.is_valid()) {
+        ALOGW("Failed to open %s: %s", kPsiMemoryPath, strerror(errno));
+        return;
+    }
+
+    // The trigger fires (as POLLPRI) when some tasks were stalled on memory for |stallMs| within
+    // the window.
+    const std::string trigger = "some " + std::to_string(static_cast<int64_t>(stallMs) * 1000) +
+                                " " + std::to_string(kPsiWindowUs);
+    if (HANDLE_EINTR(write(fd.get(), trigger.c_str(), trigger.size() + 1)) < 0) {
+        ALOGW("Failed to register PSI trigger \"%s\": %s", trigger.c_str(), strerror(errno));
+        return;
+    }
+
+    mPsiWatchId = V4L2PollerService::getInstance()->addWatch(
+            fd.get(), mThread.task_runner(),
+            base::BindRepeating(&MemoryPressureMonitor::onPsiEvent, base::Unretained(this)),
+            base::BindRepeating(&MemoryPressureMonitor::onPsiError, base::Unretained(this)));
+    if (!mPsiWatchId) {
+        ALOGW("Failed to watch the PSI trigger");
+        return;
+    }
+    mPsiFd = std::move(fd);
+    ALOGI("Monitoring memory pressure, stall threshold %dms", stallMs);
+}
+
+void MemoryPressureMonitor::onPsiEvent(bool event) {
+    ALOG_ASSERT(mThread.task_runner()->RunsTasksInCurrentSequence());
+
+    if (event) reportMemoryPressure();
+    V4L2PollerService::getInstance()->armWatch(*mPsiWatchId);
+}
+
+void MemoryPressureMonitor::onPsiError() {
+    ALOG_ASSERT(mThread.task_runner()->RunsTasksInCurrentSequence());
+
+    ALOGE("Polling the PSI trigger failed, stop monitoring memory pressure.");
+    if (mPsiWatchId) V4L2PollerService::getInstance()->removeWatch(*mPsiWatchId);
+    mPsiWatchId.reset();
+    mPsiFd.reset();
+}
+
+void MemoryPressureMonitor::reportMemoryPressure() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mLastPressureTime = base::TimeTicks::Now();
+    if (mUnderPressure.load()) return;
+
+    ALOGI("Entering memory pressure state");
+    mUnderPressure.store(true);
+    notifyObserversLocked(true);
+    scheduleReliefLocked(base::TimeDelta::FromMilliseconds(kReliefDelayMs));
+}
+
+MemoryPressureMonitor::ObserverId MemoryPressureMonitor::addObserver(
+        scoped_refptr<base::SequencedTaskRunner> taskRunner, Observer observer) {
+    std::lock_guard<std::mutex> lock(mLock);
+    const ObserverId id = mNextObserverId++;
+    mObservers.emplace(id, ObserverEntry{std::move(taskRunner), std::move(observer)});
+    return id;
+}
+
+void MemoryPressureMonitor::removeObserver(ObserverId id) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mObservers.erase(id);
+}
+
+void MemoryPressureMonitor::scheduleReliefLocked(base::TimeDelta delay) {
+    if (mReliefScheduled || !mThread.IsRunning()) return;
+
+    mThread.task_runner()->PostDelayedTask(
+            FROM_HERE,
+            base::BindOnce(&MemoryPressureMonitor::reliefTask, base::Unretained(this)), delay);
+    mReliefScheduled = true;
+}
+
+void MemoryPressureMonitor::reliefTask() {
+    ALOG_ASSERT(mThread.task_runner()->RunsTasksInCurrentSequence());
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mReliefScheduled = false;
+
+    const base::TimeDelta reliefDelay = base::TimeDelta::FromMilliseconds(kReliefDelayMs);
+    const base::TimeDelta elapsed = base::TimeTicks::Now() - mLastPressureTime;
+    if (elapsed < reliefDelay) {
+        scheduleReliefLocked(reliefDelay - elapsed);
+        return;
+    }
+
+    ALOGI("Leaving memory pressure state");
+    mUnderPressure.store(false);
+    notifyObserversLocked(false);
+}
+
+void MemoryPressureMonitor::notifyObserversLocked(bool underPressure) {
+    for (const auto& it : mObservers) {
+        const ObserverEntry& entry = it.second;
+        if (entry.mTaskRunner) {
+            entry.mTaskRunner->PostTask(FROM_HERE, base::BindOnce(entry.mObserver, underPressure));
+        } else if (mThread.IsRunning()) {
+            mThread.task_runner()->PostTask(FROM_HERE,
+                                            base::BindOnce(entry.mObserver, underPressure));
+        }
+    }
+}
+
+}  // namespace android
@@ -0,0 +1,127 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "MemoryTracker"
+#define ATRACE_TAG ATRACE_TAG_VIDEO
+
+#include <v4l2_codec2/common/MemoryTracker.h>
+
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <set>
+#include <utility>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/trace.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The registry of all trackers alive in the process, used by MemoryTracker::dumpAll().
+struct Registry {
+    std::mutex mLock;
+    std::set<MemoryTracker*> mTrackers;
+};
+
+Registry* getRegistry() {
+    // The registry is intentionally leaked, as trackers might still be destroyed while static
+    // objects are destroyed on process exit.
+    static Registry* sRegistry = new Registry();
+    return sRegistry;
+}
+
+double toKiB(int64_t bytes) {
+    return static_cast<double>(bytes) / 1024;
+}
+
+}  // namespace
+
+MemoryTracker::MemoryTracker(std::string name) : mName(std::move(name)) {
+    ALOGV("%s(%s)", __func__, mName.c_str());
+
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+    registry->mTrackers.insert(this);
+}
+
+MemoryTracker::~MemoryTracker() {
+    ALOGV("%s(%s)", __func__, mName.c_str());
+
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+    registry->mTrackers.erase(this);
+}
+
+void MemoryTracker::add(const char* category, int64_t bytes) {
+    if (bytes == 0) return;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mUsages.find(category);
+    if (it == mUsages.end()) {
+        it = mUsages.emplace(category, Usage()).first;
+        it->second.mCounterName = mName + "." + category;
+    }
+
+    Usage& usage = it->second;
+    usage.mBytes += bytes;
+    ALOGW_IF(usage.mBytes < 0, "%s: usage of %s is negative (%" PRId64 ")", mName.c_str(),
+             category, usage.mBytes);
+    usage.mPeakBytes = std::max(usage.mPeakBytes, usage.mBytes);
+
+    if (ATRACE_ENABLED()) ATRACE_INT64(usage.mCounterName.c_str(), usage.mBytes);
+}
+
+int64_t MemoryTracker::getTotalUsage() const {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    int64_t total = 0;
+    for (const auto& it : mUsages) total += it.second.mBytes;
+    return total;
+}
+
+std::string MemoryTracker::dump() const {
+    const int64_t total = getTotalUsage();
+
+    std::lock_guard<std::mutex> lock(mLock);
+    std::string result = base::StringPrintf("%s: %.1fKiB\n", mName.c_str(), toKiB(total));
+    for (const auto& it : mUsages) {
+        result += base::StringPrintf("  %-16s %.1fKiB (peak %.1fKiB)\n", it.first.c_str(),
+                                     toKiB(it.second.mBytes), toKiB(it.second.mPeakBytes));
+    }
+    return result;
+}
+
+// static
+std::string MemoryTracker::dumpAll() {
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+
+    std::string result;
+    int64_t total = 0;
+    for (const MemoryTracker* tracker : registry->mTrackers) {
+        result += tracker->dump();
+        total += tracker->getTotalUsage();
+    }
+    result += base::StringPrintf("total: %.1fKiB\n", toKiB(total));
+    return result;
+}
+
+// static
+size_t MemoryTracker::getBufferSize(const C2Handle* handle) {
+    if (!handle) return 0;
+
+    std::set<ino_t> dmabufs;
+    size_t size = 0;
+    for (int i = 0; i < handle->numFds; i++) {
+        struct stat sb {};
+        if (fstat(handle->data[i], &sb) != 0 || sb.st_size <= 0) continue;
+        if (dmabufs.insert(sb.st_ino).second) size += static_cast<size_t>(sb.st_size);
+    }
+    return size;
+}
+
+}  // namespace android
@@ -7,7 +7,13 @@
 
 #include <v4l2_codec2/common/NalParser.h>
 
-#include <algorithm>
+#include <stddef.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <media/stagefright/foundation/ABitReader.h>
 #include <utils/Log.h>
@@ -30,6 +36,44 @@ enum H264ProfileIDC {
 
 constexpr uint32_t kYUV444Idc = 3;
 
+// Find the first 0x000001 start code in [|begin|, |end|), returns |end| if there is none. Blocks of
+// 16 candidate positions are checked at once if SIMD instructions are available, by comparing the
+// block and the blocks shifted by one and two bytes against the start code.
+const uint8_t* findStartCode(const uint8_t* begin, const uint8_t* end) {
+    constexpr ptrdiff_t kBlockSize = 16;
+    const uint8_t* pos = begin;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; end - pos >= kBlockSize + 2; pos += kBlockSize) {
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + 1));
+        const __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + 2));
+        const __m128i match = _mm_and_si128(
+                _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                _mm_cmpeq_epi8(b2, one));
+        const int mask = _mm_movemask_epi8(match);
+        if (mask != 0) return pos + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    for (; end - pos >= kBlockSize + 2; pos += kBlockSize) {
+        const uint8x16_t match =
+                vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(pos), zero), vceqq_u8(vld1q_u8(pos + 1), zero)),
+                         vceqq_u8(vld1q_u8(pos + 2), one));
+        // Narrow the 0x00/0xff bytes to a 64-bit mask with 4 bits per position.
+        const uint64_t mask =
+                vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+        if (mask != 0) return pos + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for (; end - pos >= 3; ++pos) {
+        if (pos[2] == 0x01 && pos[1] == 0x00 && pos[0] == 0x00) return pos;
+    }
+    return end;
+}
+
 // Read unsigned int encoded with exponential-golomb.
 bool parseUE(ABitReader* br, uint32_t* val) {
     uint32_t numZeroes = 0;
@@ -133,8 +177,7 @@ uint8_t NalParser::type() const {
 }
 
 const uint8_t* NalParser::findNextStartCodePos() const {
-    return std::search(mCurrNalDataPos, mDataEnd, kNalStartCode,
-                       kNalStartCode + kNalStartCodeLength);
+    return findStartCode(mCurrNalDataPos, mDataEnd);
 }
 
 bool NalParser::findCodedColorAspects(ColorAspects* colorAspects) {
@@ -0,0 +1,54 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SessionPriority"
+
+#include <v4l2_codec2/common/SessionPriority.h>
+
+#include <log/log.h>
+#include <system/thread_defs.h>
+#include <utils/AndroidThreads.h>
+
+namespace android {
+namespace {
+
+// Get the nice value of the threads of a session with specified |priority|. Background threads
+// are also moved to the background cgroup by androidSetThreadPriority().
+int getNiceValue(SessionPriority priority) {
+    switch (priority) {
+    case SessionPriority::REALTIME:
+        return ANDROID_PRIORITY_VIDEO;
+    case SessionPriority::THUMBNAIL:
+        return ANDROID_PRIORITY_NORMAL;
+    case SessionPriority::BACKGROUND:
+        return ANDROID_PRIORITY_BACKGROUND;
+    }
+}
+
+}  // namespace
+
+const char* SessionPriorityToString(SessionPriority priority) {
+    switch (priority) {
+    case SessionPriority::REALTIME:
+        return "REALTIME";
+    case SessionPriority::THUMBNAIL:
+        return "THUMBNAIL";
+    case SessionPriority::BACKGROUND:
+        return "BACKGROUND";
+    }
+}
+
+bool setCurrentThreadPriority(SessionPriority priority) {
+    ALOGV("%s(%s)", __func__, SessionPriorityToString(priority));
+
+    const int result = androidSetThreadPriority(0, getNiceValue(priority));
+    if (result != 0) {
+        ALOGW("Failed to set thread priority to %s: %d", SessionPriorityToString(priority), result);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace android
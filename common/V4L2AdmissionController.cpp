@@ -0,0 +1,261 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2AdmissionController"
+
+#include <v4l2_codec2/common/V4L2AdmissionController.h>
+
+#include <inttypes.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The size of a macroblock in pixels, in each dimension.
+constexpr int32_t kMacroblockSize = 16;
+
+// Decoders don't report their maximum framerate, assume the maximum resolution can be decoded at
+// this framerate.
+constexpr uint64_t kDefaultDecoderMaxFramerate = 60;
+
+// The number of macroblocks in a frame of specified |size|.
+uint64_t getMacroblocks(const ui::Size& size) {
+    const uint64_t widthInMbs = (std::max(size.width, 0) + kMacroblockSize - 1) / kMacroblockSize;
+    const uint64_t heightInMbs = (std::max(size.height, 0) + kMacroblockSize - 1) / kMacroblockSize;
+    return widthInMbs * heightInMbs;
+}
+
+const char* deviceTypeToString(V4L2Device::Type type) {
+    switch (type) {
+    case V4L2Device::Type::kDecoder:
+        return "decoder";
+    case V4L2Device::Type::kEncoder:
+        return "encoder";
+    case V4L2Device::Type::kImageProcessor:
+        return "image processor";
+    }
+}
+
+// The fourcc pixel formats used to process |codec| on the device of specified |type|.
+std::vector<uint32_t> getPixelFormats(V4L2Device::Type type, VideoCodec codec) {
+    switch (codec) {
+    case VideoCodec::H264:
+        // Stateless H.264 decoders are supported as well.
+        if (type == V4L2Device::Type::kDecoder) return {V4L2_PIX_FMT_H264, V4L2_PIX_FMT_H264_SLICE};
+        return {V4L2_PIX_FMT_H264};
+    case VideoCodec::VP8:
+        return {V4L2_PIX_FMT_VP8};
+    case VideoCodec::VP9:
+        return {V4L2_PIX_FMT_VP9};
+    case VideoCodec::HEVC:
+        return {V4L2_PIX_FMT_HEVC};
+    case VideoCodec::AV1:
+        return {V4L2_PIX_FMT_AV1};
+    }
+}
+
+}  // namespace
+
+V4L2AdmissionController::Session::Session(V4L2AdmissionController* controller,
+                                          V4L2Device::Type type, VideoCodec codec)
+      : mController(controller), mType(type), mCodec(codec) {}
+
+V4L2AdmissionController::Session::~Session() {
+    mController->removeSession(this);
+}
+
+bool V4L2AdmissionController::Session::setLoad(uint64_t macroblocksPerSecond) {
+    return mController->setSessionLoad(this, macroblocksPerSecond);
+}
+
+// static
+V4L2AdmissionController* V4L2AdmissionController::getInstance() {
+    // The controller is intentionally leaked, as sessions might still be destroyed while static
+    // objects are destroyed on process exit.
+    static V4L2AdmissionController* sInstance = new V4L2AdmissionController();
+    return sInstance;
+}
+
+// static
+uint64_t V4L2AdmissionController::getLoad(const ui::Size& size, float framerate) {
+    return getMacroblocks(size) * static_cast<uint64_t>(ceilf(std::max(framerate, 1.0f)));
+}
+
+std::unique_ptr<V4L2AdmissionController::Session> V4L2AdmissionController::createSession(
+        V4L2Device::Type type, VideoCodec codec) {
+    const uint64_t capacity = getCapacity(type, codec);
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    Usage& usage = getUsage(type);
+    if (usage.mMaxSessions >= 0 && usage.mNumSessions >= static_cast<size_t>(usage.mMaxSessions)) {
+        ALOGW("Cannot admit %s session, maximum number of sessions reached: %d",
+              deviceTypeToString(type), usage.mMaxSessions);
+        return nullptr;
+    }
+    if (capacity > 0 && getUsedLoad(usage, codec) >= capacity) {
+        ALOGW("Cannot admit %s %s session, all capacity is used (%" PRIu64 " MB/s)",
+              VideoCodecToString(codec), deviceTypeToString(type), capacity);
+        return nullptr;
+    }
+
+    usage.mNumSessions++;
+    ALOGV("Admitted %s %s session (sessions: %zu)", VideoCodecToString(codec),
+          deviceTypeToString(type), usage.mNumSessions);
+    return std::unique_ptr<Session>(new Session(this, type, codec));
+}
+
+V4L2AdmissionController::Usage& V4L2AdmissionController::getUsage(V4L2Device::Type type) {
+    auto it = mUsages.find(type);
+    if (it != mUsages.end()) return it->second;
+
+    Usage usage;
+    switch (type) {
+    case V4L2Device::Type::kDecoder:
+        usage.mMaxSessions =
+                property_get_int32("ro.vendor.v4l2_codec2.decode_concurrent_instances", -1);
+        usage.mCapacityOverride = property_get_int64(
+                "ro.vendor.v4l2_codec2.decode_max_macroblocks_per_second", 0);
+        break;
+    case V4L2Device::Type::kEncoder:
+        usage.mMaxSessions =
+                property_get_int32("ro.vendor.v4l2_codec2.encode_concurrent_instances", -1);
+        usage.mCapacityOverride = property_get_int64(
+                "ro.vendor.v4l2_codec2.encode_max_macroblocks_per_second", 0);
+        break;
+    case V4L2Device::Type::kImageProcessor:
+        break;
+    }
+    ALOGI("Capacity override of %s device: %" PRIu64 " MB/s, maximum sessions: %d",
+          deviceTypeToString(type), usage.mCapacityOverride, usage.mMaxSessions);
+
+    return mUsages.emplace(type, usage).first->second;
+}
+
+// static
+uint64_t V4L2AdmissionController::getUsedLoad(const Usage& usage, VideoCodec codec) {
+    // The capacity override applies to the whole device, so it's shared by all codecs.
+    if (usage.mCapacityOverride > 0) return usage.mLoad;
+
+    auto it = usage.mCodecLoads.find(codec);
+    return it != usage.mCodecLoads.end() ? it->second : 0;
+}
+
+uint64_t V4L2AdmissionController::getCapacity(V4L2Device::Type type, VideoCodec codec) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        Usage& usage = getUsage(type);
+        if (usage.mCapacityOverride > 0) return usage.mCapacityOverride;
+
+        auto it = usage.mCapacities.find(codec);
+        if (it != usage.mCapacities.end()) return it->second;
+    }
+
+    // Querying the capacity might open the devices, which shouldn't block the other sessions. If
+    // the capacity is queried concurrently, the first result is kept.
+    const uint64_t capacity = queryCapacity(type, codec);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    const auto [it, inserted] = getUsage(type).mCapacities.emplace(codec, capacity);
+    if (inserted) {
+        ALOGI("Capacity of %s %s device: %" PRIu64 " MB/s", VideoCodecToString(codec),
+              deviceTypeToString(type), capacity);
+    }
+    return it->second;
+}
+
+// static
+uint64_t V4L2AdmissionController::queryCapacity(V4L2Device::Type type, VideoCodec codec) {
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device) return 0;
+
+    // The capacity of a device is the highest throughput reported for any profile of |codec|. The
+    // supported profiles are stored in the capabilities cache, so the devices are only opened if
+    // not queried before. Sessions are spread across all devices supporting |codec|, so their
+    // capacity is combined.
+    const std::vector<uint32_t> pixelFormats = getPixelFormats(type, codec);
+    uint64_t capacity = 0;
+    switch (type) {
+    case V4L2Device::Type::kDecoder: {
+        const V4L2Device::SupportedDecodeProfiles profiles =
+                device->getSupportedDecodeProfiles(pixelFormats.size(), pixelFormats.data());
+        for (const auto& profile : profiles) {
+            capacity = std::max(capacity, getMacroblocks(profile.max_resolution) *
+                                                  kDefaultDecoderMaxFramerate);
+        }
+        break;
+    }
+    case V4L2Device::Type::kEncoder: {
+        const V4L2Device::SupportedEncodeProfiles profiles = device->getSupportedEncodeProfiles();
+        for (const auto& profile : profiles) {
+            if (profile.max_framerate_denominator == 0) continue;
+            const uint32_t pixelFormat = V4L2Device::C2ProfileToV4L2PixFmt(profile.profile, false);
+            if (std::find(pixelFormats.begin(), pixelFormats.end(), pixelFormat) ==
+                pixelFormats.end()) {
+                continue;
+            }
+            const uint64_t framerate =
+                    profile.max_framerate_numerator / profile.max_framerate_denominator;
+            capacity = std::max(capacity, getMacroblocks(profile.max_resolution) * framerate);
+        }
+        break;
+    }
+    case V4L2Device::Type::kImageProcessor:
+        break;
+    }
+    capacity *= device->getNumDevicesFor(type, pixelFormats.size(), pixelFormats.data());
+
+    if (capacity == 0) {
+        ALOGW("Failed to determine the capacity of the %s %s device, sessions won't be limited",
+              VideoCodecToString(codec), deviceTypeToString(type));
+    }
+    return capacity;
+}
+
+bool V4L2AdmissionController::setSessionLoad(Session* session, uint64_t macroblocksPerSecond) {
+    const uint64_t capacity = getCapacity(session->mType, session->mCodec);
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    Usage& usage = getUsage(session->mType);
+    const uint64_t otherLoad = getUsedLoad(usage, session->mCodec) - session->mLoad;
+    // The capacity is only an estimate, so a session is always allowed to use the device if it's
+    // the only one doing so. Rejecting it wouldn't benefit any other session.
+    if (capacity > 0 && otherLoad > 0 && otherLoad + macroblocksPerSecond > capacity) {
+        ALOGW("Not enough %s %s capacity for %" PRIu64 " MB/s (used: %" PRIu64
+              ", capacity: %" PRIu64 ")",
+              VideoCodecToString(session->mCodec), deviceTypeToString(session->mType),
+              macroblocksPerSecond, otherLoad, capacity);
+        return false;
+    }
+
+    usage.mLoad = usage.mLoad - session->mLoad + macroblocksPerSecond;
+    uint64_t& codecLoad = usage.mCodecLoads[session->mCodec];
+    codecLoad = codecLoad - session->mLoad + macroblocksPerSecond;
+    session->mLoad = macroblocksPerSecond;
+    ALOGV("Reserved %" PRIu64 " MB/s for %s %s session (used: %" PRIu64 ")", macroblocksPerSecond,
+          VideoCodecToString(session->mCodec), deviceTypeToString(session->mType),
+          getUsedLoad(usage, session->mCodec));
+    return true;
+}
+
+void V4L2AdmissionController::removeSession(Session* session) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    Usage& usage = getUsage(session->mType);
+    ALOG_ASSERT(usage.mNumSessions > 0);
+    usage.mLoad -= session->mLoad;
+    usage.mCodecLoads[session->mCodec] -= session->mLoad;
+    usage.mNumSessions--;
+}
+
+}  // namespace android
@@ -10,6 +10,7 @@
 
 #include <v4l2_codec2/common/V4L2Device.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <linux/media.h>
@@ -19,17 +20,21 @@
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
-#include <set>
+#include <new>
 #include <sstream>
 
 #include <base/bind.h>
 #include <base/numerics/safe_conversions.h>
 #include <base/posix/eintr_wrapper.h>
 #include <base/strings/stringprintf.h>
-#include <base/thread_annotations.h>
 #include <utils/Log.h>
 
 #include <v4l2_codec2/common/Fourcc.h>
@@ -50,6 +55,11 @@
 #define V4L2_PIX_FMT_H264_SLICE v4l2_fourcc('S', '2', '6', '4')
 #endif
 
+// HEVC parsed slices
+#ifndef V4L2_PIX_FMT_HEVC_SLICE
+#define V4L2_PIX_FMT_HEVC_SLICE v4l2_fourcc('S', '2', '6', '5')
+#endif
+
 namespace android {
 
 struct v4l2_format buildV4L2Format(const enum v4l2_buf_type type, uint32_t fourcc,
@@ -79,6 +89,11 @@ V4L2ExtCtrl::V4L2ExtCtrl(uint32_t id, int32_t val) : V4L2ExtCtrl(id) {
     ctrl.value = val;
 }
 
+V4L2ExtCtrl::V4L2ExtCtrl(uint32_t id, void* ptr, uint32_t size) : V4L2ExtCtrl(id) {
+    ctrl.ptr = ptr;
+    ctrl.size = size;
+}
+
 // Class used to store the state of a buffer that should persist between reference creations. This
 // includes:
 // * Result of initial VIDIOC_QUERYBUF ioctl,
@@ -209,9 +224,12 @@ size_t V4L2Buffer::getMemoryUsage() const {
 // A thread-safe pool of buffer indexes, allowing buffers to be obtained and returned from different
 // threads. All the methods of this class are thread-safe. Users should keep a scoped_refptr to
 // instances of this class in order to ensure the list remains alive as long as they need it.
+// The buffers are tracked by a lock-free bitmap sized at creation, since the number of buffers of
+// a queue is fixed once they are allocated.
 class V4L2BuffersList : public base::RefCountedThreadSafe<V4L2BuffersList> {
 public:
-    V4L2BuffersList() = default;
+    // Create an empty list for buffer indexes in the range of [0, |capacity|).
+    explicit V4L2BuffersList(size_t capacity);
 
     V4L2BuffersList(const V4L2BuffersList&) = delete;
     V4L2BuffersList& operator=(const V4L2BuffersList&) = delete;
@@ -226,57 +244,87 @@ public:
     // Number of buffers currently in this list.
     size_t size() const;
 
+    // Storage of the V4L2BufferRefBase and V4L2ReadableBuffer of buffer |bufferId|. A buffer has
+    // at most one of each alive at a time, so they are constructed in place instead of being
+    // allocated for every reference. The storage is owned by the list, which is kept alive by the
+    // references.
+    void* refBaseStorage(size_t bufferId);
+    void* readableBufferStorage(size_t bufferId);
+
 private:
     friend class base::RefCountedThreadSafe<V4L2BuffersList>;
-    ~V4L2BuffersList() = default;
+    ~V4L2BuffersList();
+
+    struct RefStorage;
+
+    static constexpr size_t kBitsPerWord = 64;
 
-    mutable std::mutex mLock;
-    std::set<size_t> mFreeBuffers GUARDED_BY(mLock);
+    const size_t mCapacity;
+    const size_t mNumWords;
+    // Bit |i % kBitsPerWord| of word |i / kBitsPerWord| is set if buffer |i| is free.
+    std::unique_ptr<std::atomic<uint64_t>[]> mFreeBuffers;
+    std::unique_ptr<RefStorage[]> mRefStorage;
 };
 
 void V4L2BuffersList::returnBuffer(size_t bufferId) {
-    std::lock_guard<std::mutex> lock(mLock);
+    if (bufferId >= mCapacity) {
+        ALOGE("Returning buffer failed, invalid buffer id %zu", bufferId);
+        return;
+    }
 
-    auto inserted = mFreeBuffers.emplace(bufferId);
-    if (!inserted.second) {
+    const uint64_t bit = uint64_t{1} << (bufferId % kBitsPerWord);
+    const uint64_t previous =
+            mFreeBuffers[bufferId / kBitsPerWord].fetch_or(bit, std::memory_order_acq_rel);
+    if (previous & bit) {
         ALOGE("Returning buffer failed");
     }
 }
 
 std::optional<size_t> V4L2BuffersList::getFreeBuffer() {
-    std::lock_guard<std::mutex> lock(mLock);
-
-    auto iter = mFreeBuffers.begin();
-    if (iter == mFreeBuffers.end()) {
-        ALOGV("No free buffer available!");
-        return std::nullopt;
+    for (size_t i = 0; i < mNumWords; ++i) {
+        uint64_t word = mFreeBuffers[i].load(std::memory_order_acquire);
+        while (word != 0) {
+            const size_t bitIndex = __builtin_ctzll(word);
+            // On failure |word| is updated with the current value, so retry with the remaining
+            // free buffers of this word.
+            if (mFreeBuffers[i].compare_exchange_weak(word, word & ~(uint64_t{1} << bitIndex),
+                                                      std::memory_order_acq_rel)) {
+                return i * kBitsPerWord + bitIndex;
+            }
+        }
     }
 
-    size_t bufferId = *iter;
-    mFreeBuffers.erase(iter);
-
-    return bufferId;
+    ALOGV("No free buffer available!");
+    return std::nullopt;
 }
 
 std::optional<size_t> V4L2BuffersList::getFreeBuffer(size_t requestedBufferId) {
-    std::lock_guard<std::mutex> lock(mLock);
+    if (requestedBufferId >= mCapacity) return std::nullopt;
 
-    return (mFreeBuffers.erase(requestedBufferId) > 0) ? std::make_optional(requestedBufferId)
-                                                       : std::nullopt;
+    const uint64_t bit = uint64_t{1} << (requestedBufferId % kBitsPerWord);
+    const uint64_t previous = mFreeBuffers[requestedBufferId / kBitsPerWord].fetch_and(
+            ~bit, std::memory_order_acq_rel);
+    return (previous & bit) ? std::make_optional(requestedBufferId) : std::nullopt;
 }
 
 size_t V4L2BuffersList::size() const {
-    std::lock_guard<std::mutex> lock(mLock);
-
-    return mFreeBuffers.size();
+    size_t count = 0;
+    for (size_t i = 0; i < mNumWords; ++i) {
+        count += __builtin_popcountll(mFreeBuffers[i].load(std::memory_order_relaxed));
+    }
+    return count;
 }
 
 // Module-private class that let users query/write V4L2 buffer information. It also makes some
 // private V4L2Queue methods available to this module only.
 class V4L2BufferRefBase {
 public:
-    V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer, base::WeakPtr<V4L2Queue> queue);
-    ~V4L2BufferRefBase();
+    // Construct a reference to |v4l2Buffer| in the storage of the free buffers list of |queue|.
+    static V4L2BufferRefBase* create(const struct v4l2_buffer& v4l2Buffer,
+                                     base::WeakPtr<V4L2Queue> queue);
+    // Destroy |refBase|, and return the buffer to the free buffers list if it wasn't queued. This
+    // method is thread-safe.
+    static void release(V4L2BufferRefBase* refBase);
 
     V4L2BufferRefBase(const V4L2BufferRefBase&) = delete;
     V4L2BufferRefBase& operator=(const V4L2BufferRefBase&) = delete;
@@ -296,6 +344,9 @@ public:
     struct v4l2_plane mV4l2Planes[VIDEO_MAX_PLANES];
 
 private:
+    V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer, base::WeakPtr<V4L2Queue> queue);
+    ~V4L2BufferRefBase() = default;
+
     size_t bufferId() const { return mV4l2Buffer.index; }
 
     friend class V4L2WritableBufferRef;
@@ -323,11 +374,59 @@ V4L2BufferRefBase::V4L2BufferRefBase(const struct v4l2_buffer& v4l2Buffer,
     mV4l2Buffer.m.planes = mV4l2Planes;
 }
 
-V4L2BufferRefBase::~V4L2BufferRefBase() {
+// static
+V4L2BufferRefBase* V4L2BufferRefBase::create(const struct v4l2_buffer& v4l2Buffer,
+                                             base::WeakPtr<V4L2Queue> queue) {
+    ALOG_ASSERT(queue && queue->mFreeBuffers);
+
+    void* storage = queue->mFreeBuffers->refBaseStorage(v4l2Buffer.index);
+    return new (storage) V4L2BufferRefBase(v4l2Buffer, std::move(queue));
+}
+
+// static
+void V4L2BufferRefBase::release(V4L2BufferRefBase* refBase) {
     // We are the last reference and are only accessing the thread-safe mReturnTo, so we are safe
     // to call from any sequence. If we have been queued, then the queue is our owner so we don't
-    // need to return to the free buffers list.
-    if (!queued) mReturnTo->returnBuffer(bufferId());
+    // need to return to the free buffers list. The buffer is only returned once the reference is
+    // destroyed, as its storage is reused when the buffer is obtained again. The list owning the
+    // storage is kept alive until then.
+    scoped_refptr<V4L2BuffersList> returnTo = std::move(refBase->mReturnTo);
+    const size_t bufferId = refBase->bufferId();
+    const bool queued = refBase->queued;
+    refBase->~V4L2BufferRefBase();
+
+    if (!queued) returnTo->returnBuffer(bufferId);
+}
+
+void V4L2BufferRefBaseDeleter::operator()(V4L2BufferRefBase* refBase) const {
+    V4L2BufferRefBase::release(refBase);
+}
+
+struct V4L2BuffersList::RefStorage {
+    alignas(V4L2BufferRefBase) unsigned char refBase[sizeof(V4L2BufferRefBase)];
+    alignas(V4L2ReadableBuffer) unsigned char readableBuffer[sizeof(V4L2ReadableBuffer)];
+};
+
+V4L2BuffersList::V4L2BuffersList(size_t capacity)
+      : mCapacity(capacity),
+        mNumWords((capacity + kBitsPerWord - 1) / kBitsPerWord),
+        mFreeBuffers(new std::atomic<uint64_t>[mNumWords]),
+        mRefStorage(new RefStorage[capacity]) {
+    for (size_t i = 0; i < mNumWords; ++i) {
+        mFreeBuffers[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+V4L2BuffersList::~V4L2BuffersList() = default;
+
+void* V4L2BuffersList::refBaseStorage(size_t bufferId) {
+    ALOG_ASSERT(bufferId < mCapacity);
+    return mRefStorage[bufferId].refBase;
+}
+
+void* V4L2BuffersList::readableBufferStorage(size_t bufferId) {
+    ALOG_ASSERT(bufferId < mCapacity);
+    return mRefStorage[bufferId].readableBuffer;
 }
 
 bool V4L2BufferRefBase::queueBuffer() {
@@ -382,7 +481,7 @@ bool V4L2BufferRefBase::checkNumFDsForFormat(const size_t numFds) const {
 
 V4L2WritableBufferRef::V4L2WritableBufferRef(const struct v4l2_buffer& v4l2Buffer,
                                              base::WeakPtr<V4L2Queue> queue)
-      : mBufferData(std::make_unique<V4L2BufferRefBase>(v4l2Buffer, std::move(queue))) {
+      : mBufferData(V4L2BufferRefBase::create(v4l2Buffer, std::move(queue))) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 }
 
@@ -590,6 +689,14 @@ void V4L2WritableBufferRef::setPlaneDataOffset(const size_t plane, const size_t
     mBufferData->mV4l2Buffer.m.planes[plane].data_offset = dataOffset;
 }
 
+void V4L2WritableBufferRef::setRequestFd(int requestFd) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+    ALOG_ASSERT(mBufferData);
+
+    mBufferData->mV4l2Buffer.flags |= V4L2_BUF_FLAG_REQUEST_FD;
+    mBufferData->mV4l2Buffer.request_fd = requestFd;
+}
+
 size_t V4L2WritableBufferRef::bufferId() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
@@ -599,15 +706,23 @@ size_t V4L2WritableBufferRef::bufferId() const {
 
 V4L2ReadableBuffer::V4L2ReadableBuffer(const struct v4l2_buffer& v4l2Buffer,
                                        base::WeakPtr<V4L2Queue> queue)
-      : mBufferData(std::make_unique<V4L2BufferRefBase>(v4l2Buffer, std::move(queue))) {
+      : mBufferData(V4L2BufferRefBase::create(v4l2Buffer, std::move(queue))) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 }
 
-V4L2ReadableBuffer::~V4L2ReadableBuffer() {
-    // This method is thread-safe. Since we are the destructor, we are guaranteed to be called from
-    // the only remaining reference to us. Also, we are just calling the destructor of buffer_data_,
-    // which is also thread-safe.
-    ALOG_ASSERT(mBufferData);
+V4L2ReadableBuffer::~V4L2ReadableBuffer() = default;
+
+// static
+void V4L2ReadableBufferTraits::Destruct(const V4L2ReadableBuffer* buffer) {
+    // This method is thread-safe. Since we are destructing the buffer, we are guaranteed to be
+    // called from the only remaining reference to it. The buffer data is released after the buffer
+    // is destroyed, as the storage of the buffer is reused once the V4L2 buffer is returned.
+    V4L2ReadableBuffer* readableBuffer = const_cast<V4L2ReadableBuffer*>(buffer);
+    ALOG_ASSERT(readableBuffer->mBufferData);
+
+    std::unique_ptr<V4L2BufferRefBase, V4L2BufferRefBaseDeleter> bufferData =
+            std::move(readableBuffer->mBufferData);
+    readableBuffer->~V4L2ReadableBuffer();
 }
 
 bool V4L2ReadableBuffer::isLast() const {
@@ -624,6 +739,13 @@ bool V4L2ReadableBuffer::isKeyframe() const {
     return mBufferData->mV4l2Buffer.flags & V4L2_BUF_FLAG_KEYFRAME;
 }
 
+bool V4L2ReadableBuffer::isError() const {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+    ALOG_ASSERT(mBufferData);
+
+    return mBufferData->mV4l2Buffer.flags & V4L2_BUF_FLAG_ERROR;
+}
+
 struct timeval V4L2ReadableBuffer::getTimeStamp() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(mBufferData);
@@ -687,7 +809,10 @@ public:
 
     static V4L2ReadableBufferRef CreateReadableRef(const struct v4l2_buffer& v4l2Buffer,
                                                    base::WeakPtr<V4L2Queue> queue) {
-        return new V4L2ReadableBuffer(v4l2Buffer, std::move(queue));
+        ALOG_ASSERT(queue && queue->mFreeBuffers);
+
+        void* storage = queue->mFreeBuffers->readableBufferStorage(v4l2Buffer.index);
+        return new (storage) V4L2ReadableBuffer(v4l2Buffer, std::move(queue));
     }
 };
 
@@ -709,7 +834,7 @@ V4L2Queue::~V4L2Queue() {
         streamoff();
     }
 
-    ALOG_ASSERT(mQueuedBuffers.empty());
+    ALOG_ASSERT(mNumQueuedBuffers == 0u);
     ALOG_ASSERT(!mFreeBuffers);
 
     if (!mBuffers.empty()) {
@@ -758,7 +883,7 @@ std::pair<std::optional<struct v4l2_format>, int> V4L2Queue::getFormat() {
 size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
     ALOG_ASSERT(!mFreeBuffers);
-    ALOG_ASSERT(mQueuedBuffers.size() == 0u);
+    ALOG_ASSERT(mNumQueuedBuffers == 0u);
 
     if (isStreaming()) {
         ALOGEQ("Cannot allocate buffers while streaming.");
@@ -803,7 +928,8 @@ size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory) {
 
     mMemory = memory;
 
-    mFreeBuffers = new V4L2BuffersList();
+    mFreeBuffers = new V4L2BuffersList(reqbufs.count);
+    mQueuedBuffers.assign(reqbufs.count, false);
 
     // Now query all buffer information.
     for (size_t i = 0; i < reqbufs.count; i++) {
@@ -821,7 +947,12 @@ size_t V4L2Queue::allocateBuffers(size_t count, enum v4l2_memory memory) {
 
     ALOG_ASSERT(mFreeBuffers);
     ALOG_ASSERT(mFreeBuffers->size() == mBuffers.size());
-    ALOG_ASSERT(mQueuedBuffers.size() == 0u);
+    ALOG_ASSERT(mNumQueuedBuffers == 0u);
+
+    if (mMemoryTracker && mMemory == V4L2_MEMORY_MMAP) {
+        mTrackedMemoryUsage = getMemoryUsage();
+        mMemoryTracker->add(memoryCategory(), static_cast<int64_t>(mTrackedMemoryUsage));
+    }
 
     return mBuffers.size();
 }
@@ -839,6 +970,13 @@ bool V4L2Queue::deallocateBuffers() {
     mWeakThisFactory.InvalidateWeakPtrs();
     mBuffers.clear();
     mFreeBuffers = nullptr;
+    mQueuedBuffers.clear();
+    mDmabufBufferIds.clear();
+
+    if (mTrackedMemoryUsage > 0) {
+        mMemoryTracker->add(memoryCategory(), -static_cast<int64_t>(mTrackedMemoryUsage));
+        mTrackedMemoryUsage = 0;
+    }
 
     // Free all buffers.
     struct v4l2_requestbuffers reqbufs;
@@ -854,7 +992,7 @@ bool V4L2Queue::deallocateBuffers() {
     }
 
     ALOG_ASSERT(!mFreeBuffers);
-    ALOG_ASSERT(mQueuedBuffers.size() == 0u);
+    ALOG_ASSERT(mNumQueuedBuffers == 0u);
 
     return true;
 }
@@ -872,6 +1010,17 @@ v4l2_memory V4L2Queue::getMemoryType() const {
     return mMemory;
 }
 
+void V4L2Queue::setMemoryTracker(std::shared_ptr<MemoryTracker> tracker) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+    ALOG_ASSERT(mTrackedMemoryUsage == 0u);
+
+    mMemoryTracker = std::move(tracker);
+}
+
+const char* V4L2Queue::memoryCategory() const {
+    return V4L2_TYPE_IS_OUTPUT(mType) ? "v4l2OutputQueue" : "v4l2CaptureQueue";
+}
+
 std::optional<V4L2WritableBufferRef> V4L2Queue::getFreeBuffer() {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 
@@ -898,6 +1047,33 @@ std::optional<V4L2WritableBufferRef> V4L2Queue::getFreeBuffer(size_t requestedBu
                                                    mWeakThisFactory.GetWeakPtr());
 }
 
+std::optional<V4L2WritableBufferRef> V4L2Queue::getFreeBufferForDmabuf(
+        std::optional<uint32_t> dmabufId) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+
+    if (dmabufId) {
+        auto it = mDmabufBufferIds.find(*dmabufId);
+        if (it != mDmabufBufferIds.end()) {
+            std::optional<V4L2WritableBufferRef> buffer = getFreeBuffer(it->second);
+            if (buffer) return buffer;
+        }
+    }
+
+    std::optional<V4L2WritableBufferRef> buffer = getFreeBuffer();
+    if (!buffer) return std::nullopt;
+
+    // The buffer is now bound to a different dmabuf, drop its previous association.
+    for (auto it = mDmabufBufferIds.begin(); it != mDmabufBufferIds.end();) {
+        if (it->second == buffer->bufferId()) {
+            it = mDmabufBufferIds.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (dmabufId) mDmabufBufferIds[*dmabufId] = buffer->bufferId();
+    return buffer;
+}
+
 bool V4L2Queue::queueBuffer(struct v4l2_buffer* v4l2Buffer) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 
@@ -907,11 +1083,12 @@ bool V4L2Queue::queueBuffer(struct v4l2_buffer* v4l2Buffer) {
         return false;
     }
 
-    auto inserted = mQueuedBuffers.emplace(v4l2Buffer->index);
-    if (!inserted.second) {
+    if (mQueuedBuffers[v4l2Buffer->index]) {
         ALOGE("Queuing buffer failed");
         return false;
     }
+    mQueuedBuffers[v4l2Buffer->index] = true;
+    mNumQueuedBuffers++;
 
     mDevice->schedulePoll();
 
@@ -921,6 +1098,32 @@ bool V4L2Queue::queueBuffer(struct v4l2_buffer* v4l2Buffer) {
 std::pair<bool, V4L2ReadableBufferRef> V4L2Queue::dequeueBuffer() {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 
+    auto result = dequeueBufferInternal();
+    if (result.first && isStreaming() && queuedBuffersCount() > 0) mDevice->schedulePoll();
+    return result;
+}
+
+bool V4L2Queue::dequeueBuffers(std::vector<V4L2ReadableBufferRef>* buffers) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+    ALOG_ASSERT(buffers != nullptr);
+
+    buffers->clear();
+    bool success = true;
+    while (queuedBuffersCount() > 0) {
+        V4L2ReadableBufferRef buffer;
+        std::tie(success, buffer) = dequeueBufferInternal();
+        if (!success || !buffer) break;
+
+        buffers->push_back(std::move(buffer));
+    }
+
+    if (success && isStreaming() && queuedBuffersCount() > 0) mDevice->schedulePoll();
+    return success;
+}
+
+std::pair<bool, V4L2ReadableBufferRef> V4L2Queue::dequeueBufferInternal() {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
+
     // No need to dequeue if no buffers queued.
     if (queuedBuffersCount() == 0) return std::make_pair(true, nullptr);
 
@@ -948,7 +1151,6 @@ std::pair<bool, V4L2ReadableBufferRef> V4L2Queue::dequeueBuffer() {
         case EAGAIN:
         case EPIPE:
             // This is not an error so we'll need to continue polling but won't provide a buffer.
-            mDevice->schedulePoll();
             return std::make_pair(true, nullptr);
         default:
             ALOGEQ("VIDIOC_DQBUF failed");
@@ -956,11 +1158,9 @@ std::pair<bool, V4L2ReadableBufferRef> V4L2Queue::dequeueBuffer() {
         }
     }
 
-    auto it = mQueuedBuffers.find(v4l2Buffer.index);
-    ALOG_ASSERT(it != mQueuedBuffers.end());
-    mQueuedBuffers.erase(*it);
-
-    if (queuedBuffersCount() > 0) mDevice->schedulePoll();
+    ALOG_ASSERT(v4l2Buffer.index < mQueuedBuffers.size() && mQueuedBuffers[v4l2Buffer.index]);
+    mQueuedBuffers[v4l2Buffer.index] = false;
+    mNumQueuedBuffers--;
 
     ALOG_ASSERT(mFreeBuffers);
     return std::make_pair(true, V4L2BufferRefFactory::CreateReadableRef(
@@ -1004,12 +1204,15 @@ bool V4L2Queue::streamoff() {
         return false;
     }
 
-    for (const auto& bufferId : mQueuedBuffers) {
+    for (size_t bufferId = 0; bufferId < mQueuedBuffers.size(); ++bufferId) {
+        if (!mQueuedBuffers[bufferId]) continue;
+
         ALOG_ASSERT(mFreeBuffers);
         mFreeBuffers->returnBuffer(bufferId);
+        mQueuedBuffers[bufferId] = false;
     }
 
-    mQueuedBuffers.clear();
+    mNumQueuedBuffers = 0;
 
     mIsStreaming = false;
 
@@ -1031,7 +1234,7 @@ size_t V4L2Queue::freeBuffersCount() const {
 size_t V4L2Queue::queuedBuffersCount() const {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mSequenceChecker);
 
-    return mQueuedBuffers.size();
+    return mNumQueuedBuffers;
 }
 
 #undef ALOGEQ
@@ -1048,6 +1251,17 @@ public:
     }
 };
 
+// static
+std::mutex V4L2Device::sCapabilitiesLock;
+// static
+std::map<V4L2Device::Type, V4L2Device::Devices> V4L2Device::sDevicesByType;
+// static
+std::optional<V4L2Device::SupportedEncodeProfiles> V4L2Device::sEncodeProfiles;
+// static
+std::map<std::vector<uint32_t>, V4L2Device::SupportedDecodeProfiles> V4L2Device::sDecodeProfiles;
+// static
+std::map<std::string, size_t> V4L2Device::sSessionsByDevicePath;
+
 V4L2Device::V4L2Device() {
     DETACH_FROM_SEQUENCE(mClientSequenceChecker);
 }
@@ -1095,10 +1309,22 @@ scoped_refptr<V4L2Device> V4L2Device::create() {
     return scoped_refptr<V4L2Device>(new V4L2Device());
 }
 
+// static
+void V4L2Device::populateCapabilitiesCache() {
+    ALOGV("%s()", __func__);
+
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    device->getDevicesForType(Type::kDecoder);
+    device->getDevicesForType(Type::kEncoder);
+    device->getDevicesForType(Type::kImageProcessor);
+    const SupportedEncodeProfiles encodeProfiles = device->getSupportedEncodeProfiles();
+    ALOGI("Cached capabilities of all V4L2 devices (%zu encoder profiles)", encodeProfiles.size());
+}
+
 bool V4L2Device::open(Type type, uint32_t v4l2PixFmt) {
     ALOGV("%s()", __func__);
 
-    std::string path = getDevicePathFor(type, v4l2PixFmt);
+    std::string path = acquireDevicePathFor(type, v4l2PixFmt);
 
     if (path.empty()) {
         ALOGE("No devices supporting %s for type: %u", fourccToString(v4l2PixFmt).c_str(),
@@ -1106,8 +1332,10 @@ bool V4L2Device::open(Type type, uint32_t v4l2PixFmt) {
         return false;
     }
 
+    mSessionDevicePath = path;
     if (!openDevicePath(path, type)) {
         ALOGE("Failed opening %s", path.c_str());
+        closeDevice();
         return false;
     }
 
@@ -1117,15 +1345,32 @@ bool V4L2Device::open(Type type, uint32_t v4l2PixFmt) {
         return false;
     }
 
+    // The ioctls of enumeration devices aren't recorded, only those of sessions.
+    static std::atomic<uint32_t> sNextSessionId{0};
+    mIoctlStats = V4L2IoctlStats::Create(
+            base::StringPrintf("%s#%u", path.c_str(), sNextSessionId.fetch_add(1)));
+
     return true;
 }
 
 int V4L2Device::ioctl(int request, void* arg) {
     ALOG_ASSERT(mDeviceFd.is_valid());
-    return HANDLE_EINTR(::ioctl(mDeviceFd.get(), request, arg));
+    if (!mIoctlStats) return HANDLE_EINTR(::ioctl(mDeviceFd.get(), request, arg));
+
+    const auto start = std::chrono::steady_clock::now();
+    const int ret = HANDLE_EINTR(::ioctl(mDeviceFd.get(), request, arg));
+    // Callers inspect errno on failure, so it's preserved while recording.
+    const int savedErrno = errno;
+    mIoctlStats->record(request,
+                        std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start)
+                                .count(),
+                        ret != 0);
+    errno = savedErrno;
+    return ret;
 }
 
-bool V4L2Device::poll(bool pollDevice, bool* eventPending) {
+bool V4L2Device::poll(bool pollDevice, bool* eventPending, int timeoutMs) {
     struct pollfd pollfds[2];
     nfds_t nfds;
     int pollfd = -1;
@@ -1142,10 +1387,23 @@ bool V4L2Device::poll(bool pollDevice, bool* eventPending) {
         nfds++;
     }
 
-    if (HANDLE_EINTR(::poll(pollfds, nfds, -1)) == -1) {
+    const auto start = std::chrono::steady_clock::now();
+    const int ret = HANDLE_EINTR(::poll(pollfds, nfds, timeoutMs));
+    if (mIoctlStats) {
+        mIoctlStats->record(V4L2IoctlStats::kPollRequest,
+                            std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count(),
+                            ret <= 0);
+    }
+    if (ret == -1) {
         ALOGE("poll() failed");
         return false;
     }
+    if (ret == 0) {
+        ALOGE("poll() timed out after %d ms", timeoutMs);
+        return false;
+    }
     *eventPending = (pollfd != -1 && pollfds[pollfd].revents & POLLPRI);
     return true;
 }
@@ -1237,6 +1495,19 @@ uint32_t V4L2Device::C2ProfileToV4L2PixFmt(C2Config::profile_t profile, bool sli
         } else {
             return V4L2_PIX_FMT_VP9;
         }
+    } else if (profile >= C2Config::PROFILE_HEVC_MAIN &&
+               profile <= C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS) {
+        if (sliceBased) {
+            return V4L2_PIX_FMT_HEVC_SLICE;
+        } else {
+            return V4L2_PIX_FMT_HEVC;
+        }
+    } else if (profile >= C2Config::PROFILE_AV1_0 && profile <= C2Config::PROFILE_AV1_2) {
+        if (sliceBased) {
+            return V4L2_PIX_FMT_AV1_FRAME;
+        } else {
+            return V4L2_PIX_FMT_AV1;
+        }
     } else {
         ALOGE("Unknown profile: %s", profileToString(profile));
         return 0;
@@ -1283,6 +1554,26 @@ C2Config::profile_t V4L2Device::v4L2ProfileToC2Profile(VideoCodec codec, uint32_
             return C2Config::PROFILE_VP9_3;
         }
         break;
+    case VideoCodec::HEVC:
+        switch (profile) {
+        case V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN:
+            return C2Config::PROFILE_HEVC_MAIN;
+        case V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN_STILL_PICTURE:
+            return C2Config::PROFILE_HEVC_MAIN_STILL;
+        case V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN_10:
+            return C2Config::PROFILE_HEVC_MAIN_10;
+        }
+        break;
+    case VideoCodec::AV1:
+        switch (profile) {
+        case V4L2_MPEG_VIDEO_AV1_PROFILE_MAIN:
+            return C2Config::PROFILE_AV1_0;
+        case V4L2_MPEG_VIDEO_AV1_PROFILE_HIGH:
+            return C2Config::PROFILE_AV1_1;
+        case V4L2_MPEG_VIDEO_AV1_PROFILE_PROFESSIONAL:
+            return C2Config::PROFILE_AV1_2;
+        }
+        break;
     default:
         ALOGE("Unknown codec: %u", codec);
     }
@@ -1305,6 +1596,12 @@ std::vector<C2Config::profile_t> V4L2Device::v4L2PixFmtToC2Profiles(uint32_t pix
         case VideoCodec::VP9:
             queryId = V4L2_CID_MPEG_VIDEO_VP9_PROFILE;
             break;
+        case VideoCodec::HEVC:
+            queryId = V4L2_CID_MPEG_VIDEO_HEVC_PROFILE;
+            break;
+        case VideoCodec::AV1:
+            queryId = V4L2_CID_MPEG_VIDEO_AV1_PROFILE;
+            break;
         default:
             return false;
         }
@@ -1355,6 +1652,20 @@ std::vector<C2Config::profile_t> V4L2Device::v4L2PixFmtToC2Profiles(uint32_t pix
             profiles = {C2Config::PROFILE_VP9_0};
         }
         break;
+    case V4L2_PIX_FMT_HEVC:
+    case V4L2_PIX_FMT_HEVC_SLICE:
+        if (!getSupportedProfiles(VideoCodec::HEVC, &profiles)) {
+            ALOGW("Driver doesn't support QUERY HEVC profiles, use default values, Main");
+            profiles = {C2Config::PROFILE_HEVC_MAIN};
+        }
+        break;
+    case V4L2_PIX_FMT_AV1:
+    case V4L2_PIX_FMT_AV1_FRAME:
+        if (!getSupportedProfiles(VideoCodec::AV1, &profiles)) {
+            ALOGW("Driver doesn't support QUERY AV1 profiles, use default values, Main");
+            profiles = {C2Config::PROFILE_AV1_0};
+        }
+        break;
     default:
         ALOGE("Unhandled pixelformat %s", fourccToString(pixFmt).c_str());
         return {};
@@ -1397,6 +1708,21 @@ int32_t V4L2Device::c2ProfileToV4L2H264Profile(C2Config::profile_t profile) {
     }
 }
 
+// static
+int32_t V4L2Device::c2ProfileToV4L2HEVCProfile(C2Config::profile_t profile) {
+    switch (profile) {
+    case C2Config::PROFILE_HEVC_MAIN:
+        return V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN;
+    case C2Config::PROFILE_HEVC_MAIN_STILL:
+        return V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN_STILL_PICTURE;
+    case C2Config::PROFILE_HEVC_MAIN_10:
+        return V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN_10;
+    default:
+        ALOGE("Add more cases as needed");
+        return -1;
+    }
+}
+
 // static
 int32_t V4L2Device::h264LevelIdcToV4L2H264Level(uint8_t levelIdc) {
     switch (levelIdc) {
@@ -1452,6 +1778,11 @@ v4l2_mpeg_video_bitrate_mode V4L2Device::C2BitrateModeToV4L2BitrateMode(
         FALLTHROUGH;
     case C2Config::bitrate_mode_t::BITRATE_VARIABLE:
         return V4L2_MPEG_VIDEO_BITRATE_MODE_VBR;
+#ifdef V4L2_CID_MPEG_VIDEO_CONSTANT_QUALITY
+    // The bitrate is ignored in constant quality mode.
+    case C2Config::bitrate_mode_t::BITRATE_IGNORE:
+        return V4L2_MPEG_VIDEO_BITRATE_MODE_CQ;
+#endif
     default:
         ALOGW("Unsupported bitrate mode %u, defaulting to BITRATE_VARIABLE",
               static_cast<uint32_t>(bitrateMode));
@@ -1668,7 +1999,7 @@ std::optional<VideoFrameLayout> V4L2Device::v4L2FormatToVideoFrameLayout(
         planes.push_back(VideoFramePlane{planeFormat.bytesperline, 0u, planeFormat.sizeimage});
     }
     // For the case that #color planes > #buffers, it fills stride of color plane which does not map
-    // to buffer. Right now only some pixel formats are supported: NV12, YUV420, YVU420.
+    // to buffer. Right now only some pixel formats are supported: NV12, P010, YUV420, YVU420.
     if (numColorPlanes > numBuffers) {
         const uint32_t yStride = planes[0].mStride;
         // Note that y_stride is from v4l2 bytesperline and its type is uint32_t. It is safe to cast
@@ -1676,7 +2007,8 @@ std::optional<VideoFrameLayout> V4L2Device::v4L2FormatToVideoFrameLayout(
         const size_t yStrideAbs = static_cast<size_t>(yStride);
         switch (pixFmt) {
         case V4L2_PIX_FMT_NV12:
-            // The stride of UV is the same as Y in NV12. The height is half of Y plane.
+        case Fourcc::P010:
+            // The stride of UV is the same as Y in NV12 and P010. The height is half of Y plane.
             planes.push_back(VideoFramePlane{yStride, yStrideAbs * pixMp.height,
                                              yStrideAbs * pixMp.height / 2});
             ALOG_ASSERT(2u == planes.size());
@@ -1775,6 +2107,13 @@ std::vector<uint32_t> V4L2Device::enumerateSupportedPixelformats(v4l2_buf_type b
 
 V4L2Device::SupportedDecodeProfiles V4L2Device::getSupportedDecodeProfiles(
         const size_t numFormats, const uint32_t pixelFormats[]) {
+    const std::vector<uint32_t> key(pixelFormats, pixelFormats + numFormats);
+    {
+        std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+        auto it = sDecodeProfiles.find(key);
+        if (it != sDecodeProfiles.end()) return it->second;
+    }
+
     SupportedDecodeProfiles supportedProfiles;
 
     Type type = Type::kDecoder;
@@ -1790,10 +2129,17 @@ V4L2Device::SupportedDecodeProfiles V4L2Device::getSupportedDecodeProfiles(
         closeDevice();
     }
 
+    std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+    sDecodeProfiles.emplace(key, supportedProfiles);
     return supportedProfiles;
 }
 
 V4L2Device::SupportedEncodeProfiles V4L2Device::getSupportedEncodeProfiles() {
+    {
+        std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+        if (sEncodeProfiles) return *sEncodeProfiles;
+    }
+
     SupportedEncodeProfiles supportedProfiles;
 
     Type type = Type::kEncoder;
@@ -1809,9 +2155,20 @@ V4L2Device::SupportedEncodeProfiles V4L2Device::getSupportedEncodeProfiles() {
         closeDevice();
     }
 
+    std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+    sEncodeProfiles = supportedProfiles;
     return supportedProfiles;
 }
 
+size_t V4L2Device::getNumDevicesFor(Type type, const size_t numFormats,
+                                    const uint32_t pixelFormats[]) {
+    const Devices& devices = getDevicesForType(type);
+    return std::count_if(devices.begin(), devices.end(), [&](const auto& device) {
+        return std::find_first_of(device.second.begin(), device.second.end(), pixelFormats,
+                                  pixelFormats + numFormats) != device.second.end();
+    });
+}
+
 V4L2Device::SupportedDecodeProfiles V4L2Device::enumerateSupportedDecodeProfiles(
         const size_t numFormats, const uint32_t pixelFormats[]) {
     SupportedDecodeProfiles profiles;
@@ -1874,7 +2231,7 @@ bool V4L2Device::startPolling(android::V4L2DevicePoller::EventCallback eventCall
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
     if (!mDevicePoller) {
-        mDevicePoller = std::make_unique<android::V4L2DevicePoller>(this, "V4L2DeviceThreadPoller");
+        mDevicePoller = std::make_unique<android::V4L2DevicePoller>(this);
     }
 
     bool ret = mDevicePoller->startPolling(std::move(eventCallback), std::move(errorCallback));
@@ -1893,11 +2250,33 @@ bool V4L2Device::stopPolling() {
 void V4L2Device::schedulePoll() {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
+    if (mPollBatchDepth > 0) {
+        mPollBatchPending = true;
+        return;
+    }
+
     if (!mDevicePoller || !mDevicePoller->isPolling()) return;
 
     mDevicePoller->schedulePoll();
 }
 
+V4L2Device::ScopedPollBatch::ScopedPollBatch(scoped_refptr<V4L2Device> device)
+      : mDevice(std::move(device)) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mDevice->mClientSequenceChecker);
+
+    mDevice->mPollBatchDepth++;
+}
+
+V4L2Device::ScopedPollBatch::~ScopedPollBatch() {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mDevice->mClientSequenceChecker);
+    ALOG_ASSERT(mDevice->mPollBatchDepth > 0);
+
+    if (--mDevice->mPollBatchDepth > 0 || !mDevice->mPollBatchPending) return;
+
+    mDevice->mPollBatchPending = false;
+    mDevice->schedulePoll();
+}
+
 bool V4L2Device::isCtrlExposed(uint32_t ctrlId) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
@@ -1921,6 +2300,94 @@ bool V4L2Device::setExtCtrls(uint32_t ctrlClass, std::vector<V4L2ExtCtrl> ctrls)
     return ioctl(VIDIOC_S_EXT_CTRLS, &extCtrls) == 0;
 }
 
+bool V4L2Device::setExtCtrlsForRequest(int requestFd, std::vector<V4L2ExtCtrl> ctrls) {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
+
+    if (ctrls.empty()) return true;
+
+    struct v4l2_ext_controls extCtrls;
+    memset(&extCtrls, 0, sizeof(extCtrls));
+    extCtrls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+    extCtrls.request_fd = requestFd;
+    extCtrls.count = ctrls.size();
+    extCtrls.controls = &ctrls[0].ctrl;
+    if (ioctl(VIDIOC_S_EXT_CTRLS, &extCtrls) != 0) {
+        ALOGE("Failed to set controls for request (error_idx=%u)", extCtrls.error_idx);
+        return false;
+    }
+    return true;
+}
+
+base::ScopedFD V4L2Device::allocateMediaRequest() {
+    DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
+
+    if (!openMediaDevice()) return base::ScopedFD();
+
+    int requestFd = -1;
+    if (HANDLE_EINTR(::ioctl(mMediaFd.get(), MEDIA_IOC_REQUEST_ALLOC, &requestFd)) != 0) {
+        ALOGE("ioctl() failed: MEDIA_IOC_REQUEST_ALLOC");
+        return base::ScopedFD();
+    }
+    return base::ScopedFD(requestFd);
+}
+
+// static
+bool V4L2Device::queueMediaRequest(int requestFd) {
+    if (HANDLE_EINTR(::ioctl(requestFd, MEDIA_REQUEST_IOC_QUEUE)) != 0) {
+        ALOGE("ioctl() failed: MEDIA_REQUEST_IOC_QUEUE");
+        return false;
+    }
+    return true;
+}
+
+// static
+bool V4L2Device::reinitMediaRequest(int requestFd) {
+    if (HANDLE_EINTR(::ioctl(requestFd, MEDIA_REQUEST_IOC_REINIT)) != 0) {
+        ALOGE("ioctl() failed: MEDIA_REQUEST_IOC_REINIT");
+        return false;
+    }
+    return true;
+}
+
+bool V4L2Device::openMediaDevice() {
+    if (mMediaFd.is_valid()) return true;
+
+    struct stat deviceStat;
+    if (fstat(mDeviceFd.get(), &deviceStat) != 0) {
+        ALOGE("Failed to stat the video device");
+        return false;
+    }
+
+    // Media devices are registered as /dev/mediaX. Find the one exposing an interface for our
+    // video device node, by comparing the device numbers.
+    for (int i = 0; i < 16; ++i) {
+        const std::string path = base::StringPrintf("/dev/media%d", i);
+        base::ScopedFD mediaFd(HANDLE_EINTR(::open(path.c_str(), O_RDWR | O_CLOEXEC)));
+        if (!mediaFd.is_valid()) continue;
+
+        struct media_v2_topology topology;
+        memset(&topology, 0, sizeof(topology));
+        if (HANDLE_EINTR(::ioctl(mediaFd.get(), MEDIA_IOC_G_TOPOLOGY, &topology)) != 0) continue;
+
+        std::vector<struct media_v2_interface> interfaces(topology.num_interfaces);
+        topology.ptr_interfaces = reinterpret_cast<uintptr_t>(interfaces.data());
+        if (HANDLE_EINTR(::ioctl(mediaFd.get(), MEDIA_IOC_G_TOPOLOGY, &topology)) != 0) continue;
+
+        for (const auto& interface : interfaces) {
+            if (interface.intf_type != MEDIA_INTF_T_V4L_VIDEO) continue;
+            if (interface.devnode.major == major(deviceStat.st_rdev) &&
+                interface.devnode.minor == minor(deviceStat.st_rdev)) {
+                ALOGV("Found media device %s", path.c_str());
+                mMediaFd = std::move(mediaFd);
+                return true;
+            }
+        }
+    }
+
+    ALOGE("Failed to find the media device of the video device");
+    return false;
+}
+
 bool V4L2Device::isCommandSupported(uint32_t commandId) {
     DCHECK_CALLED_ON_VALID_SEQUENCE(mClientSequenceChecker);
 
@@ -1956,10 +2423,20 @@ bool V4L2Device::openDevicePath(const std::string& path, Type /*type*/) {
 void V4L2Device::closeDevice() {
     ALOGV("%s()", __func__);
 
+    mMediaFd.reset();
     mDeviceFd.reset();
+    mIoctlStats.reset();
+
+    if (!mSessionDevicePath.empty()) {
+        std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+        auto it = sSessionsByDevicePath.find(mSessionDevicePath);
+        ALOG_ASSERT(it != sSessionsByDevicePath.end() && it->second > 0);
+        it->second--;
+        mSessionDevicePath.clear();
+    }
 }
 
-void V4L2Device::enumerateDevicesForType(Type type) {
+V4L2Device::Devices V4L2Device::enumerateDevicesForType(Type type) {
     // video input/output devices are registered as /dev/videoX in V4L2.
     static const std::string kVideoDevicePattern = "/dev/video";
 
@@ -1974,9 +2451,13 @@ void V4L2Device::enumerateDevicesForType(Type type) {
         devicePattern = kVideoDevicePattern;
         bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
         break;
+    case Type::kImageProcessor:
+        devicePattern = kVideoDevicePattern;
+        bufType = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        break;
     default:
-        ALOGE("Only decoder and encoder types are supported!!");
-        return;
+        ALOGE("Only decoder, encoder and image processor types are supported!!");
+        return {};
     }
 
     std::vector<std::string> candidatePaths;
@@ -1997,6 +2478,18 @@ void V4L2Device::enumerateDevicesForType(Type type) {
             continue;
         }
 
+        // Decoders and encoders are mem2mem devices too, only consider devices producing raw
+        // frames on both queues to be image processors.
+        if (type == Type::kImageProcessor) {
+            const auto& capturePixelformats =
+                    enumerateSupportedPixelformats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+            if (std::find(capturePixelformats.begin(), capturePixelformats.end(),
+                          V4L2_PIX_FMT_NV12) == capturePixelformats.end()) {
+                closeDevice();
+                continue;
+            }
+        }
+
         const auto& supportedPixelformats = enumerateSupportedPixelformats(bufType);
         if (!supportedPixelformats.empty()) {
             ALOGV("Found device: %s", path.c_str());
@@ -2006,26 +2499,46 @@ void V4L2Device::enumerateDevicesForType(Type type) {
         closeDevice();
     }
 
-    ALOG_ASSERT(mDevicesByType.count(type) == 0u);
-    mDevicesByType[type] = devices;
+    return devices;
 }
 
 const V4L2Device::Devices& V4L2Device::getDevicesForType(Type type) {
-    if (mDevicesByType.count(type) == 0) enumerateDevicesForType(type);
+    {
+        std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+        auto it = sDevicesByType.find(type);
+        if (it != sDevicesByType.end()) return it->second;
+    }
 
-    ALOG_ASSERT(mDevicesByType.count(type) != 0u);
-    return mDevicesByType[type];
+    // Enumerate without holding the lock, as this requires opening all device nodes. Entries are
+    // never removed from |sDevicesByType|, so the returned reference remains valid.
+    Devices devices = enumerateDevicesForType(type);
+    std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+    return sDevicesByType.emplace(type, std::move(devices)).first->second;
 }
 
-std::string V4L2Device::getDevicePathFor(Type type, uint32_t pixFmt) {
+std::string V4L2Device::acquireDevicePathFor(Type type, uint32_t pixFmt) {
     const Devices& devices = getDevicesForType(type);
 
+    // Select the least loaded device supporting |pixFmt|, so sessions are spread across all
+    // hardware instances when the SoC has multiple identical codec cores.
+    std::lock_guard<std::mutex> lock(sCapabilitiesLock);
+    const std::string* selectedPath = nullptr;
+    size_t selectedSessions = 0;
     for (const auto& device : devices) {
-        if (std::find(device.second.begin(), device.second.end(), pixFmt) != device.second.end())
-            return device.first;
+        if (std::find(device.second.begin(), device.second.end(), pixFmt) == device.second.end())
+            continue;
+
+        const size_t sessions = sSessionsByDevicePath[device.first];
+        if (!selectedPath || sessions < selectedSessions) {
+            selectedPath = &device.first;
+            selectedSessions = sessions;
+        }
     }
+    if (!selectedPath) return std::string();
 
-    return std::string();
+    ALOGV("Selected %s (sessions: %zu)", selectedPath->c_str(), selectedSessions);
+    sSessionsByDevicePath[*selectedPath]++;
+    return *selectedPath;
 }
 
 }  // namespace android
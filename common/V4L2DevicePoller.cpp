@@ -5,26 +5,18 @@
 
 #include <v4l2_codec2/common/V4L2DevicePoller.h>
 
-#include <string>
-
 #include <base/bind.h>
 #include <base/threading/sequenced_task_runner_handle.h>
-#include <base/threading/thread_checker.h>
 #include <log/log.h>
 
 #include <v4l2_codec2/common/V4L2Device.h>
 
 namespace android {
 
-V4L2DevicePoller::V4L2DevicePoller(V4L2Device* const device, const std::string& threadName)
-      : mDevice(device),
-        mPollThread(std::move(threadName)),
-        mTriggerPoll(base::WaitableEvent::ResetPolicy::AUTOMATIC,
-                     base::WaitableEvent::InitialState::NOT_SIGNALED),
-        mStopPolling(false) {}
+V4L2DevicePoller::V4L2DevicePoller(V4L2Device* const device) : mDevice(device) {}
 
 V4L2DevicePoller::~V4L2DevicePoller() {
-    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(!mClientTaskRunner || mClientTaskRunner->RunsTasksInCurrentSequence());
 
     stopPolling();
 }
@@ -35,95 +27,50 @@ bool V4L2DevicePoller::startPolling(EventCallback eventCallback,
 
     ALOGV("Starting polling");
 
-    mClientTaskTunner = base::SequencedTaskRunnerHandle::Get();
+    mClientTaskRunner = base::SequencedTaskRunnerHandle::Get();
     mErrorCallback = errorCallback;
 
-    if (!mPollThread.Start()) {
-        ALOGE("Failed to start device poll thread");
+    // The watch is armed upon registration, so a first poll is implicitly scheduled.
+    mWatchId = V4L2PollerService::getInstance()->addWatch(
+            mDevice->mDeviceFd.get(), mClientTaskRunner, std::move(eventCallback), mErrorCallback);
+    if (!mWatchId) {
+        ALOGE("Failed to register device with poller service");
         return false;
     }
 
-    mEventCallback = std::move(eventCallback);
-
-    mStopPolling.store(false);
-    mPollThread.task_runner()->PostTask(
-            FROM_HERE, base::BindOnce(&V4L2DevicePoller::devicePollTask, base::Unretained(this)));
-
-    ALOGV("Polling thread started");
-
-    schedulePoll();
+    ALOGV("Polling started");
 
     return true;
 }
 
 bool V4L2DevicePoller::stopPolling() {
-    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
-
     if (!isPolling()) return true;
 
+    ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
     ALOGV("Stopping polling");
 
-    mStopPolling.store(true);
+    V4L2PollerService::getInstance()->removeWatch(*mWatchId);
+    mWatchId = std::nullopt;
 
-    mTriggerPoll.Signal();
-
-    if (!mDevice->setDevicePollInterrupt()) {
-        ALOGE("Failed to interrupt device poll.");
-        return false;
-    }
-
-    ALOGV("Stop device poll thread");
-    mPollThread.Stop();
-
-    if (!mDevice->clearDevicePollInterrupt()) {
-        ALOGE("Failed to clear interrupting device poll.");
-        return false;
-    }
-
-    ALOGV("Polling thread stopped");
+    ALOGV("Polling stopped");
 
     return true;
 }
 
 bool V4L2DevicePoller::isPolling() const {
-    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
-
-    return mPollThread.IsRunning();
+    return mWatchId.has_value();
 }
 
 void V4L2DevicePoller::schedulePoll() {
-    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
-
-    // A call to DevicePollTask() will be posted when we actually start polling.
+    // The watch will be armed when we actually start polling.
     if (!isPolling()) return;
 
+    ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
     ALOGV("Scheduling poll");
 
-    mTriggerPoll.Signal();
-}
-
-void V4L2DevicePoller::devicePollTask() {
-    ALOG_ASSERT(mClientTaskTunner->RunsTasksInCurrentSequence());
-
-    while (true) {
-        ALOGV("Waiting for poll to be scheduled.");
-        mTriggerPoll.Wait();
-
-        if (mStopPolling) {
-            ALOGV("Poll stopped, exiting.");
-            break;
-        }
-
-        bool event_pending = false;
-        ALOGV("Polling device.");
-        if (!mDevice->poll(true, &event_pending)) {
-            ALOGE("An error occurred while polling, calling error callback");
-            mClientTaskTunner->PostTask(FROM_HERE, mErrorCallback);
-            return;
-        }
-
-        ALOGV("Poll returned, calling event callback.");
-        mClientTaskTunner->PostTask(FROM_HERE, base::Bind(mEventCallback, event_pending));
+    if (!V4L2PollerService::getInstance()->armWatch(*mWatchId)) {
+        ALOGE("Failed to schedule poll, calling error callback");
+        mClientTaskRunner->PostTask(FROM_HERE, mErrorCallback);
     }
 }
 
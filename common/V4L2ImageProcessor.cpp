@@ -0,0 +1,228 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2ImageProcessor"
+
+#include <v4l2_codec2/common/V4L2ImageProcessor.h>
+
+#include <linux/videodev2.h>
+#include <string.h>
+
+#include <tuple>
+#include <utility>
+
+#include <log/log.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+
+namespace android {
+
+namespace {
+
+// The number of buffers allocated on each queue. As frames are processed synchronously, a single
+// buffer per queue would be enough, but some drivers require at least two buffers.
+constexpr size_t kNumBuffers = 2;
+
+// Configure the specified |queue| and allocate DMABUF buffers on it. The plane sizes of the
+// configured format are stored in |planeSizes|.
+bool configureQueue(V4L2Queue* queue, Fourcc fourcc, const ui::Size& size, uint32_t stride,
+                    std::vector<size_t>* planeSizes) {
+    std::optional<struct v4l2_format> format =
+            queue->setFormat(fourcc.toV4L2PixFmt(), size, 0, stride);
+    if (!format) {
+        ALOGE("Failed to set format %s (%dx%d)", fourcc.toString().c_str(), size.width,
+              size.height);
+        return false;
+    }
+    if (format->fmt.pix_mp.plane_fmt[0].bytesperline != stride) {
+        ALOGE("Device doesn't support stride %u for format %s (got: %u)", stride,
+              fourcc.toString().c_str(), format->fmt.pix_mp.plane_fmt[0].bytesperline);
+        return false;
+    }
+
+    if (queue->allocateBuffers(kNumBuffers, V4L2_MEMORY_DMABUF) == 0) {
+        ALOGE("Failed to allocate buffers");
+        return false;
+    }
+
+    planeSizes->clear();
+    for (size_t i = 0; i < format->fmt.pix_mp.num_planes; ++i) {
+        planeSizes->push_back(format->fmt.pix_mp.plane_fmt[i].sizeimage);
+    }
+    return true;
+}
+
+// Queue a buffer backed by the specified |fds| with the given |planeSizes| to |queue|.
+bool queueBuffer(V4L2Queue* queue, const std::vector<int>& fds,
+                 const std::vector<size_t>& planeSizes, bool setBytesUsed) {
+    std::optional<V4L2WritableBufferRef> buffer = queue->getFreeBuffer();
+    if (!buffer) {
+        ALOGE("No free buffer available");
+        return false;
+    }
+
+    for (size_t i = 0; i < buffer->planesCount() && i < planeSizes.size(); ++i) {
+        buffer->setPlaneSize(i, planeSizes[i]);
+        if (setBytesUsed) buffer->setPlaneBytesUsed(i, planeSizes[i]);
+    }
+    return std::move(*buffer).queueDMABuf(fds);
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<V4L2ImageProcessor> V4L2ImageProcessor::create(Fourcc inputFourcc,
+                                                               uint32_t inputStride,
+                                                               const ui::Size& inputSize,
+                                                               Fourcc outputFourcc,
+                                                               uint32_t outputStride,
+                                                               const ui::Size& outputSize,
+                                                               const ui::Size& outputVisibleSize) {
+    std::unique_ptr<V4L2ImageProcessor> processor(
+            new V4L2ImageProcessor(inputFourcc, inputStride));
+    if (!processor->initialize(inputSize, outputFourcc, outputStride, outputSize,
+                               outputVisibleSize)) {
+        return nullptr;
+    }
+    return processor;
+}
+
+V4L2ImageProcessor::V4L2ImageProcessor(Fourcc inputFourcc, uint32_t inputStride)
+      : mInputFourcc(inputFourcc), mInputStride(inputStride) {}
+
+V4L2ImageProcessor::~V4L2ImageProcessor() {
+    ALOGV("%s()", __func__);
+
+    if (mInputQueue) {
+        mInputQueue->streamoff();
+        mInputQueue->deallocateBuffers();
+    }
+    if (mOutputQueue) {
+        mOutputQueue->streamoff();
+        mOutputQueue->deallocateBuffers();
+    }
+}
+
+bool V4L2ImageProcessor::initialize(const ui::Size& inputSize, Fourcc outputFourcc,
+                                    uint32_t outputStride, const ui::Size& outputSize,
+                                    const ui::Size& outputVisibleSize) {
+    ALOGV("%s(input: %s %dx%d, output: %s %dx%d, visible: %dx%d)", __func__,
+          mInputFourcc.toString().c_str(), inputSize.width, inputSize.height,
+          outputFourcc.toString().c_str(), outputSize.width, outputSize.height,
+          outputVisibleSize.width, outputVisibleSize.height);
+
+    mDevice = V4L2Device::create();
+    if (!mDevice) {
+        ALOGE("Failed to create V4L2 device");
+        return false;
+    }
+
+    if (!mDevice->open(V4L2Device::Type::kImageProcessor, mInputFourcc.toV4L2PixFmt())) {
+        ALOGV("No image processor supporting %s found", mInputFourcc.toString().c_str());
+        return false;
+    }
+
+    if (!mDevice->hasCapabilities(V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING)) {
+        ALOGE("Device doesn't have the required capabilities");
+        return false;
+    }
+
+    mInputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    mOutputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    if (!mInputQueue || !mOutputQueue) {
+        ALOGE("Failed to get V4L2 device queues");
+        return false;
+    }
+
+    if (!configureQueue(mInputQueue.get(), mInputFourcc, inputSize, mInputStride,
+                        &mInputPlaneSizes) ||
+        !configureQueue(mOutputQueue.get(), outputFourcc, outputSize, outputStride,
+                        &mOutputPlaneSizes)) {
+        return false;
+    }
+
+    // Without a compose rectangle the device would scale the input to the whole output buffer,
+    // which is aligned to the coded size.
+    if (outputVisibleSize != outputSize && !setOutputComposeRect(outputVisibleSize)) {
+        return false;
+    }
+
+    if (!mInputQueue->streamon() || !mOutputQueue->streamon()) {
+        ALOGE("Failed to start streaming");
+        return false;
+    }
+
+    return true;
+}
+
+bool V4L2ImageProcessor::setOutputComposeRect(const ui::Size& visibleSize) {
+    struct v4l2_selection selection_arg;
+    memset(&selection_arg, 0, sizeof(selection_arg));
+    selection_arg.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection_arg.target = V4L2_SEL_TGT_COMPOSE;
+    selection_arg.r.width = visibleSize.width;
+    selection_arg.r.height = visibleSize.height;
+    if (mDevice->ioctl(VIDIOC_S_SELECTION, &selection_arg) != 0 ||
+        mDevice->ioctl(VIDIOC_G_SELECTION, &selection_arg) != 0) {
+        ALOGE("Failed to set the output compose rectangle to %dx%d", visibleSize.width,
+              visibleSize.height);
+        return false;
+    }
+    // The device might adjust the rectangle to its capabilities, which would distort the frames.
+    if (selection_arg.r.left != 0 || selection_arg.r.top != 0 ||
+        selection_arg.r.width != static_cast<uint32_t>(visibleSize.width) ||
+        selection_arg.r.height != static_cast<uint32_t>(visibleSize.height)) {
+        ALOGE("Device adjusted the output compose rectangle to (%d,%d) %ux%u, expected %dx%d",
+              selection_arg.r.left, selection_arg.r.top, selection_arg.r.width,
+              selection_arg.r.height, visibleSize.width, visibleSize.height);
+        return false;
+    }
+    return true;
+}
+
+bool V4L2ImageProcessor::process(const std::vector<int>& inputFds,
+                                 const std::vector<int>& outputFds) {
+    ALOGV("%s()", __func__);
+
+    if (!queueBuffer(mOutputQueue.get(), outputFds, mOutputPlaneSizes, false) ||
+        !queueBuffer(mInputQueue.get(), inputFds, mInputPlaneSizes, true)) {
+        ALOGE("Failed to queue buffers");
+        return false;
+    }
+
+    // Wait until the device has returned both buffers.
+    bool inputDone = false;
+    bool outputDone = false;
+    while (!inputDone || !outputDone) {
+        bool eventPending = false;
+        if (!mDevice->poll(true, &eventPending, kProcessTimeoutMs)) {
+            ALOGE("Failed waiting for the device to process the frame");
+            return false;
+        }
+
+        bool success;
+        V4L2ReadableBufferRef buffer;
+        if (!inputDone) {
+            std::tie(success, buffer) = mInputQueue->dequeueBuffer();
+            if (!success) {
+                ALOGE("Failed to dequeue buffer from input queue");
+                return false;
+            }
+            inputDone = (buffer != nullptr);
+        }
+        if (!outputDone) {
+            std::tie(success, buffer) = mOutputQueue->dequeueBuffer();
+            if (!success) {
+                ALOGE("Failed to dequeue buffer from output queue");
+                return false;
+            }
+            outputDone = (buffer != nullptr);
+        }
+    }
+
+    return true;
+}
+
+}  // namespace android
@@ -0,0 +1,186 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2IoctlStats"
+
+#include <v4l2_codec2/common/V4L2IoctlStats.h>
+
+#include <inttypes.h>
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <set>
+#include <utility>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The registry of all stats alive in the process, used by V4L2IoctlStats::dumpAll().
+struct Registry {
+    std::mutex mLock;
+    std::set<V4L2IoctlStats*> mStats;
+};
+
+Registry* getRegistry() {
+    // The registry is intentionally leaked, as stats might still be destroyed while static objects
+    // are destroyed on process exit.
+    static Registry* sRegistry = new Registry();
+    return sRegistry;
+}
+
+std::string requestToString(int request) {
+    switch (request) {
+    case V4L2IoctlStats::kPollRequest:
+        return "poll";
+#define REQUEST_CASE(r)       \
+    case static_cast<int>(r): \
+        return #r
+        REQUEST_CASE(VIDIOC_QUERYCAP);
+        REQUEST_CASE(VIDIOC_ENUM_FMT);
+        REQUEST_CASE(VIDIOC_ENUM_FRAMESIZES);
+        REQUEST_CASE(VIDIOC_G_FMT);
+        REQUEST_CASE(VIDIOC_S_FMT);
+        REQUEST_CASE(VIDIOC_TRY_FMT);
+        REQUEST_CASE(VIDIOC_REQBUFS);
+        REQUEST_CASE(VIDIOC_QUERYBUF);
+        REQUEST_CASE(VIDIOC_EXPBUF);
+        REQUEST_CASE(VIDIOC_QBUF);
+        REQUEST_CASE(VIDIOC_DQBUF);
+        REQUEST_CASE(VIDIOC_STREAMON);
+        REQUEST_CASE(VIDIOC_STREAMOFF);
+        REQUEST_CASE(VIDIOC_S_PARM);
+        REQUEST_CASE(VIDIOC_G_CTRL);
+        REQUEST_CASE(VIDIOC_QUERYCTRL);
+        REQUEST_CASE(VIDIOC_QUERYMENU);
+        REQUEST_CASE(VIDIOC_G_EXT_CTRLS);
+        REQUEST_CASE(VIDIOC_S_EXT_CTRLS);
+        REQUEST_CASE(VIDIOC_G_CROP);
+        REQUEST_CASE(VIDIOC_S_CROP);
+        REQUEST_CASE(VIDIOC_G_SELECTION);
+        REQUEST_CASE(VIDIOC_S_SELECTION);
+        REQUEST_CASE(VIDIOC_DQEVENT);
+        REQUEST_CASE(VIDIOC_SUBSCRIBE_EVENT);
+        REQUEST_CASE(VIDIOC_UNSUBSCRIBE_EVENT);
+        REQUEST_CASE(VIDIOC_ENCODER_CMD);
+        REQUEST_CASE(VIDIOC_TRY_ENCODER_CMD);
+        REQUEST_CASE(VIDIOC_DECODER_CMD);
+        REQUEST_CASE(VIDIOC_TRY_DECODER_CMD);
+#undef REQUEST_CASE
+    default:
+        return base::StringPrintf("ioctl 0x%x", static_cast<unsigned int>(request));
+    }
+}
+
+size_t getBucketIndex(int64_t durationUs, size_t numBuckets) {
+    if (durationUs <= 0) return 0;
+    const size_t bitLength = 64 - __builtin_clzll(static_cast<uint64_t>(durationUs));
+    return std::min(bitLength, numBuckets - 1);
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<V4L2IoctlStats> V4L2IoctlStats::Create(std::string name) {
+    static const bool sRecordStats = property_get_bool("ro.vendor.v4l2_codec2.ioctl_stats", false);
+    static const int32_t sSlowThresholdMs =
+            property_get_int32("ro.vendor.v4l2_codec2.slow_ioctl_ms", 0);
+    if (!sRecordStats && sSlowThresholdMs <= 0) return nullptr;
+
+    const int64_t slowThresholdUs =
+            sSlowThresholdMs > 0 ? static_cast<int64_t>(sSlowThresholdMs) * 1000 : 0;
+    return std::unique_ptr<V4L2IoctlStats>(
+            new V4L2IoctlStats(std::move(name), sRecordStats, slowThresholdUs));
+}
+
+V4L2IoctlStats::V4L2IoctlStats(std::string name, bool recordStats, int64_t slowThresholdUs)
+      : mName(std::move(name)), mRecordStats(recordStats), mSlowThresholdUs(slowThresholdUs) {
+    ALOGV("%s(%s)", __func__, mName.c_str());
+    if (!mRecordStats) return;
+
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+    registry->mStats.insert(this);
+}
+
+V4L2IoctlStats::~V4L2IoctlStats() {
+    ALOGV("%s(%s)", __func__, mName.c_str());
+    if (!mRecordStats) return;
+
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+    registry->mStats.erase(this);
+}
+
+void V4L2IoctlStats::record(int request, int64_t durationUs, bool failed) {
+    // Polling blocks until the device has work for us, so it's never considered slow.
+    if (mSlowThresholdUs > 0 && request != kPollRequest && durationUs >= mSlowThresholdUs) {
+        ALOGW("%s: %s took %" PRId64 "us%s", mName.c_str(), requestToString(request).c_str(),
+              durationUs, failed ? " and failed" : "");
+    }
+    if (!mRecordStats) return;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    Request& r = mRequests[request];
+    r.mNumCalls++;
+    if (failed) r.mNumFailures++;
+    r.mTotalUs += durationUs;
+    r.mMaxUs = std::max(r.mMaxUs, durationUs);
+    r.mBuckets[getBucketIndex(durationUs, kNumBuckets)]++;
+}
+
+// static
+int64_t V4L2IoctlStats::getPercentileBoundUs(const Request& request, int percentile) {
+    const uint64_t target = (request.mNumCalls * percentile + 99) / 100;
+    uint64_t numCalls = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+        numCalls += request.mBuckets[i];
+        if (numCalls >= target) return std::min(int64_t{1} << i, request.mMaxUs);
+    }
+    return request.mMaxUs;
+}
+
+std::string V4L2IoctlStats::dump() const {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    std::string result = base::StringPrintf("%s:\n", mName.c_str());
+    for (const auto& it : mRequests) {
+        const Request& r = it.second;
+        result += base::StringPrintf(
+                "  %-24s calls=%" PRIu64 " failed=%" PRIu64 " avg=%" PRId64 "us max=%" PRId64
+                "us p50<=%" PRId64 "us p99<=%" PRId64 "us\n",
+                requestToString(it.first).c_str(), r.mNumCalls, r.mNumFailures,
+                r.mTotalUs / static_cast<int64_t>(r.mNumCalls), r.mMaxUs,
+                getPercentileBoundUs(r, 50), getPercentileBoundUs(r, 99));
+
+        // Only the non-empty buckets of the histogram are listed.
+        std::string histogram;
+        for (size_t i = 0; i < kNumBuckets; ++i) {
+            if (r.mBuckets[i] == 0) continue;
+            histogram += base::StringPrintf(
+                    " %s%" PRId64 "us:%" PRIu64, i + 1 < kNumBuckets ? "<" : ">=",
+                    int64_t{1} << (i + 1 < kNumBuckets ? i : i - 1), r.mBuckets[i]);
+        }
+        result += "   " + histogram + "\n";
+    }
+    return result;
+}
+
+// static
+std::string V4L2IoctlStats::dumpAll() {
+    Registry* registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry->mLock);
+
+    std::string result;
+    for (const V4L2IoctlStats* stats : registry->mStats) {
+        result += stats->dump();
+    }
+    return result;
+}
+
+}  // namespace android
@@ -0,0 +1,166 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2PollerService"
+
+#include <v4l2_codec2/common/V4L2PollerService.h>
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include <algorithm>
+#include <string>
+
+#include <base/bind.h>
+#include <base/posix/eintr_wrapper.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/SessionPriority.h>
+
+namespace android {
+namespace {
+
+// The maximum number of events handled per epoll_wait() call.
+constexpr int kMaxEventsPerWait = 16;
+// The events we are interested in, these match the events previously used with poll().
+constexpr uint32_t kWatchEvents = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLPRI | EPOLLONESHOT;
+
+}  // namespace
+
+// static
+V4L2PollerService* V4L2PollerService::getInstance() {
+    // The poller service is intentionally leaked, as poll threads might still be used while static
+    // objects are destroyed on process exit.
+    static V4L2PollerService* sInstance = []() {
+        int32_t numThreads = property_get_int32("ro.vendor.v4l2_codec2.poll_threads", 1);
+        return new V4L2PollerService(static_cast<size_t>(std::max(numThreads, 1)));
+    }();
+    return sInstance;
+}
+
+V4L2PollerService::V4L2PollerService(size_t numThreads) {
+    ALOGV("%s(%zu)", __func__, numThreads);
+
+    for (size_t i = 0; i < numThreads; ++i) {
+        base::ScopedFD epollFd(epoll_create1(EPOLL_CLOEXEC));
+        if (!epollFd.is_valid()) {
+            ALOGE("Failed to create epoll instance: %s", strerror(errno));
+            break;
+        }
+
+        auto thread = std::make_unique<base::Thread>("V4L2PollerThread" + std::to_string(i));
+        if (!thread->Start()) {
+            ALOGE("Failed to start poll thread %zu", i);
+            break;
+        }
+        thread->task_runner()->PostTask(FROM_HERE,
+                                        base::BindOnce(&V4L2PollerService::pollTask,
+                                                       base::Unretained(this), epollFd.get()));
+
+        mEpollFds.push_back(std::move(epollFd));
+        mPollThreads.push_back(std::move(thread));
+    }
+}
+
+std::optional<V4L2PollerService::WatchId> V4L2PollerService::addWatch(
+        int fd, scoped_refptr<base::SequencedTaskRunner> taskRunner, EventCallback eventCallback,
+        base::RepeatingClosure errorCallback) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mEpollFds.empty()) {
+        ALOGE("No poll threads available");
+        return std::nullopt;
+    }
+
+    const WatchId id = mNextWatchId++;
+    const int epollFd = mEpollFds[mNextEpollIndex].get();
+    mNextEpollIndex = (mNextEpollIndex + 1) % mEpollFds.size();
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = kWatchEvents;
+    event.data.u64 = id;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        ALOGE("Failed to add fd %d to epoll instance: %s", fd, strerror(errno));
+        return std::nullopt;
+    }
+
+    mWatches.emplace(id, Watch{fd, epollFd, std::move(taskRunner), std::move(eventCallback),
+                               std::move(errorCallback)});
+    ALOGV("Added watch %" PRIu64 " for fd %d", id, fd);
+    return id;
+}
+
+bool V4L2PollerService::armWatch(WatchId id) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mWatches.find(id);
+    if (it == mWatches.end()) {
+        ALOGE("Trying to arm unknown watch %" PRIu64, id);
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = kWatchEvents;
+    event.data.u64 = id;
+    if (epoll_ctl(it->second.mEpollFd, EPOLL_CTL_MOD, it->second.mFd, &event) != 0) {
+        ALOGE("Failed to arm watch %" PRIu64 ": %s", id, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void V4L2PollerService::removeWatch(WatchId id) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mWatches.find(id);
+    if (it == mWatches.end()) return;
+
+    if (epoll_ctl(it->second.mEpollFd, EPOLL_CTL_DEL, it->second.mFd, nullptr) != 0) {
+        ALOGW("Failed to remove fd %d from epoll instance: %s", it->second.mFd, strerror(errno));
+    }
+    mWatches.erase(it);
+    ALOGV("Removed watch %" PRIu64, id);
+}
+
+void V4L2PollerService::pollTask(int epollFd) {
+    // The poll threads are shared by all sessions and only post callbacks, so they always run at
+    // the priority of real-time sessions to not delay their frames.
+    setCurrentThreadPriority(SessionPriority::REALTIME);
+
+    struct epoll_event events[kMaxEventsPerWait];
+
+    while (true) {
+        int numEvents = HANDLE_EINTR(epoll_wait(epollFd, events, kMaxEventsPerWait, -1));
+
+        // Callbacks are posted while holding the lock, so a watch can't be removed in between
+        // looking it up and posting its callback.
+        std::lock_guard<std::mutex> lock(mLock);
+        if (numEvents < 0) {
+            ALOGE("epoll_wait() failed: %s", strerror(errno));
+            for (const auto& it : mWatches) {
+                if (it.second.mEpollFd == epollFd) {
+                    it.second.mTaskRunner->PostTask(FROM_HERE, it.second.mErrorCallback);
+                }
+            }
+            return;
+        }
+
+        for (int i = 0; i < numEvents; ++i) {
+            auto it = mWatches.find(events[i].data.u64);
+            // The watch might have been removed while we were waiting for the lock.
+            if (it == mWatches.end()) continue;
+
+            const bool eventPending = events[i].events & EPOLLPRI;
+            it->second.mTaskRunner->PostTask(
+                    FROM_HERE, base::BindOnce(it->second.mEventCallback, eventPending));
+        }
+    }
+}
+
+}  // namespace android
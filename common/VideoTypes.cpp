@@ -19,6 +19,10 @@ const char* VideoCodecToString(VideoCodec codec) {
         return "VP8";
     case VideoCodec::VP9:
         return "VP9";
+    case VideoCodec::HEVC:
+        return "HEVC";
+    case VideoCodec::AV1:
+        return "AV1";
     }
 }
 
@@ -91,6 +95,10 @@ const char* HalPixelFormatToString(HalPixelFormat format) {
         return "YV12";
     case HalPixelFormat::NV12:
         return "NV12";
+    case HalPixelFormat::YCBCR_P010:
+        return "YCBCR_P010";
+    case HalPixelFormat::YCBCR_420_SP_VENUS_UBWC:
+        return "YCBCR_420_SP_VENUS_UBWC";
     }
 }
 
@@ -0,0 +1,40 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_AV1_PARSER_H
+#define ANDROID_V4L2_CODEC2_COMMON_AV1_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+
+// The fields of an AV1 sequence header OBU (AV1 specification section 5.5) relevant to the
+// decode component.
+struct AV1SequenceHeader {
+    uint32_t seqProfile = 0;
+    uint32_t bitDepth = 8;
+    bool monoChrome = false;
+
+    // The color config, using the ISO/IEC 23091-4 code points. Only valid if
+    // |colorDescriptionPresentFlag| is set, apart from |colorRange|.
+    bool colorDescriptionPresentFlag = false;
+    uint32_t colorPrimaries = 2;
+    uint32_t transferCharacteristics = 2;
+    uint32_t matrixCoefficients = 2;
+    bool colorRange = false;
+
+    // Whether film grain parameters can be present in the frame headers, in which case film grain
+    // needs to be synthesized on top of the decoded frames before they are displayed.
+    bool filmGrainParamsPresent = false;
+};
+
+// Locate and parse the first sequence header OBU in |data|, which can either be a low-overhead
+// bitstream (AV1 specification section 5.2) or an AV1CodecConfigurationRecord (e.g. the CSD
+// extracted from MP4 and WebM containers). Returns whether a sequence header was parsed.
+bool parseAV1SequenceHeader(const uint8_t* data, size_t length, AV1SequenceHeader* header);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_AV1_PARSER_H
@@ -5,11 +5,15 @@
 #ifndef ANDROID_V4L2_CODEC2_COMMON_HELPERS_H
 #define ANDROID_V4L2_CODEC2_COMMON_HELPERS_H
 
+#include <optional>
+#include <vector>
+
 #include <C2Config.h>
 #include <system/graphics.h>
 #include <ui/Size.h>
 
 #include <v4l2_codec2/common/VideoPixelFormat.h>
+#include <v4l2_codec2/common/VideoTypes.h>
 
 namespace android {
 
@@ -36,7 +40,10 @@ struct VideoEncoderAcceleratorConfig {
     VideoFrameStorageType mStorageType;
 };
 
-// Convert the specified C2Config level to a V4L2 level.
+// Whether the specified |profile| uses 10-bit 4:2:0 samples, stored as P010 frames.
+bool isTenBitProfile(C2Config::profile_t profile);
+
+// Convert the specified C2Config H.264 or HEVC level to a V4L2 level.
 uint8_t c2LevelToV4L2Level(C2Config::level_t level);
 
 // Get the specified graphics block in YCbCr format.
@@ -48,11 +55,18 @@ android_ycbcr getGraphicBlockInfo(const C2ConstGraphicBlock& block);
 bool extractSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* sps,
                    std::vector<uint8_t>* pps);
 
-// When encoding a video the codec-specific data (CSD; e.g. SPS and PPS for H264 encoding) will be
-// concatenated to the first encoded slice. This function extracts the CSD out of the bitstream and
-// stores it into |csd|. Returns whether extracting CSD info was successful.
-bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, const uint8_t* data,
-                    size_t length);
+// Try to extract VPS, SPS and PPS NAL units from the specified HEVC |data| stream. If found the
+// data will be copied into the provided |vps|, |sps| and |pps| buffers. Returns whether extraction
+// was successful.
+bool extractVPSSPSPPS(const uint8_t* data, size_t length, std::vector<uint8_t>* vps,
+                      std::vector<uint8_t>* sps, std::vector<uint8_t>* pps);
+
+// When encoding a video the codec-specific data (CSD; e.g. SPS and PPS for H264 encoding, or VPS,
+// SPS and PPS for HEVC encoding) will be concatenated to the first encoded slice. This function
+// extracts the CSD of the specified |codec| out of the bitstream and stores it into |csd|. Returns
+// whether extracting CSD info was successful.
+bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, VideoCodec codec,
+                    const uint8_t* data, size_t length);
 
 // Prepend the specified |sps| and |pps| NAL units (without start codes) to the H.264 |data| stream.
 // The result is copied into |dst|. The provided |sps| and |pps| data will be updated if an SPS or
@@ -60,6 +74,14 @@ bool extractCSDInfo(std::unique_ptr<C2StreamInitDataInfo::output>* const csd, co
 size_t prependSPSPPSToIDR(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize,
                           std::vector<uint8_t>* sps, std::vector<uint8_t>* pps);
 
+// Inject the specified |sps| and |pps| NAL units (without start codes) in front of the H.264 |data|
+// stream, writing them into the |headroom| bytes directly preceding |data| so the stream doesn't
+// need to be copied. The provided |sps| and |pps| data will be updated if an SPS or PPS NAL unit is
+// encountered, in which case nothing is injected. Returns the number of bytes written in front of
+// |data|, or std::nullopt if the stream can't be updated in place (e.g. not enough headroom).
+std::optional<size_t> injectSPSPPSBeforeIDR(uint8_t* data, size_t size, size_t headroom,
+                                            std::vector<uint8_t>* sps, std::vector<uint8_t>* pps);
+
 }  // namespace android
 
 #endif  // ANDROID_V4L2_CODEC2_COMMON_HELPERS_H
@@ -5,19 +5,26 @@
 #ifndef ANDROID_V4L2_CODEC2_COMMON_FORMAT_CONVERTER_H
 #define ANDROID_V4L2_CODEC2_COMMON_FORMAT_CONVERTER_H
 
+#include <functional>
 #include <limits>
+#include <memory>
 #include <queue>
 #include <vector>
 
 #include <C2Buffer.h>
+#include <base/synchronization/waitable_event.h>
+#include <base/threading/thread.h>
 #include <ui/Size.h>
 #include <utils/StrongPointer.h>
 
+#include <v4l2_codec2/common/MemoryTracker.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
+#include <v4l2_codec2/common/VideoTypes.h>
 
 namespace android {
 
 class GraphicBuffer;
+class V4L2ImageProcessor;
 
 // ImplDefinedToRGBXMap can provide the layout for RGB-backed IMPLEMENTATION_DEFINED format case,
 // which will be failed to map by C2AllocationGralloc::map(). When the instance is created, it will
@@ -42,16 +49,29 @@ private:
     const int mRowInc;
 };
 
+// The FormatConverter converts input frames into the pixel format required by the encoder. Frames
+// are split into horizontal bands of rows, which are converted in parallel on a small pool of
+// worker threads. The number of bands converted in parallel can be configured using the
+// "ro.vendor.v4l2_codec2.convert_threads" property (default: 2).
+//
+// If a V4L2 image processor device is available, RGB input frames are converted by the device
+// instead, without mapping the input frames for CPU access.
+//
+// Input frames can also be scaled to a different visible size, so the encoder doesn't need frames
+// at the encoded resolution. Scaling is done by the image processor if available. Without image
+// processor, only YUV frames whose chroma layout matches the output format can be scaled.
 class FormatConverter {
 public:
-    ~FormatConverter() = default;
+    ~FormatConverter();
 
     FormatConverter(const FormatConverter&) = delete;
     FormatConverter& operator=(const FormatConverter&) = delete;
 
     // Create FormatConverter instance and initialize it, nullptr will be returned on
-    // initialization error.
+    // initialization error. Input frames of |inputSize| are scaled to |visibleSize| if the sizes
+    // differ.
     static std::unique_ptr<FormatConverter> Create(VideoPixelFormat outFormat,
+                                                   const ui::Size& inputSize,
                                                    const ui::Size& visibleSize, uint32_t inputCount,
                                                    const ui::Size& codedSize);
 
@@ -61,20 +81,37 @@ public:
                                      c2_status_t* status /* non-null */);
     // Return the block ownership when VEA no longer needs it, or erase the zero-copy BlockEntry.
     c2_status_t returnBlock(uint64_t frameIndex);
-    // Check if there is available block for conversion.
-    bool isReady() const { return !mAvailableQueue.empty(); }
+    // Check if there is available block for conversion, or another block can be allocated.
+    bool isReady() const;
+    // Set the |tracker| accounting the memory of the conversion blocks. This should be called
+    // before the first conversion.
+    void setMemoryTracker(std::shared_ptr<MemoryTracker> tracker);
 
 private:
-    // The minimal number requirement of allocated buffers for conversion. This value is the same as
+    // The minimal number of buffers that can be allocated for conversion. This value is the same as
     // kMinInputBufferArraySize from CCodecBufferChannel.
     static constexpr uint32_t kMinInputBufferCount = 8;
+    // The number of consecutive zero-copied frames after which the unused conversion blocks are
+    // released, e.g. when the client switched to frames of the encoder's input format.
+    static constexpr size_t kZeroCopiedFramesBeforeRelease = 30;
     // The constant used by BlockEntry to indicate no frame is associated with the BlockEntry.
     static constexpr uint64_t kNoFrameAssociated = ~static_cast<uint64_t>(0);
+    // The number of rows converted at once when converting ABGR to NV12. The temporary U/V planes
+    // only need to hold the chroma of this many rows, so they stay in the CPU cache.
+    static constexpr int kABGRToNV12ChunkRows = 16;
+    // Frames smaller than this are always converted on the calling thread, as the overhead of
+    // distributing the work would outweigh the gain.
+    static constexpr int kMinParallelConvertArea = 1280 * 720;
+
+    // Callback converting |rowCount| rows starting at |row|. |band| is the index of the band being
+    // converted, it can be used to select the temporary memory to use.
+    using ConvertRowsCB = std::function<void(size_t band, int row, int rowCount)>;
 
     // There are 2 types of BlockEntry:
     // 1. If |mBlock| is an allocated graphic block (not nullptr). This BlockEntry is for
     //    conversion, and |mAssociatedFrameIndex| records the frame index of the input frame which
-    //    is currently converted from. This is created on initialize() and released while
+    //    is currently converted from. This is allocated when a frame needs to be converted and no
+    //    block is available, and released after zero-copy was used for a while or while
     //    FormatConverter is destroyed.
     // 2. If |mBlock| is nullptr. This BlockEntry is only used to record zero-copied frame index to
     //    |mAssociatedFrameIndex|. This is created on zero-copy is applied during convertBlock(),
@@ -87,27 +124,96 @@ private:
 
         std::shared_ptr<C2GraphicBlock> mBlock;
         uint64_t mAssociatedFrameIndex = kNoFrameAssociated;
+        // The size of |mBlock| accounted to |mMemoryTracker|.
+        size_t mMemorySize = 0;
     };
 
     FormatConverter() = default;
 
-    // Initialize foramt converter. It will pre-allocate a set of graphic blocks as |codedSize| and
-    // |outFormat|. This function should be called prior to other functions.
-    c2_status_t initialize(VideoPixelFormat outFormat, const ui::Size& visibleSize,
-                           uint32_t inputCount, const ui::Size& codedSize);
+    // Initialize foramt converter. Graphic blocks of |codedSize| and |outFormat| are allocated on
+    // demand, up to |inputCount| (at least kMinInputBufferCount) blocks. This function should be
+    // called prior to other functions.
+    c2_status_t initialize(VideoPixelFormat outFormat, const ui::Size& inputSize,
+                           const ui::Size& visibleSize, uint32_t inputCount,
+                           const ui::Size& codedSize);
+
+    // Whether input frames are scaled to a different size.
+    bool isScaling() const { return mInputSize != mVisibleSize; }
+
+    // Get the next available block for conversion, allocating a new block if none is available.
+    // Returns nullptr if the maximum number of blocks is in use or allocation failed.
+    BlockEntry* getAvailableBlock();
+    // Release the conversion blocks not currently in use, and the temporary U/V planes.
+    void releaseAvailableBlocks();
+    // Allocate the temporary U/V planes used when converting ABGR to NV12.
+    void allocateTempPlanes();
+
+    // Split the visible frame into bands and call |convertRows| for each band. The first band is
+    // converted on the calling thread, the others on the worker threads. Returns once all bands
+    // have been converted.
+    void convertInBands(const ConvertRowsCB& convertRows);
+    // Convert ABGR rows starting at |row| to NV12 in a single pass over the source, using the
+    // temporary U/V planes of the specified |band|.
+    void convertABGRToNV12Rows(size_t band, int row, int rowCount, const uint8_t* srcRGB,
+                               int srcStrideRGB, uint8_t* dstY, int dstStrideY, uint8_t* dstUV,
+                               int dstStrideUV);
+    // Scale the YUV frame in |inputView| of |inputFormat| into |outputView| on the CPU. Returns
+    // false if scaling between the input and output formats isn't supported.
+    bool scaleYUV(VideoPixelFormat inputFormat, const C2GraphicView& inputView,
+                  C2GraphicView* outputView);
+    // Whether the format of |inputBlock| might be converted by the V4L2 image processor. This is
+    // determined from the gralloc metadata, without mapping the block.
+    bool supportsImageProcessorInput(const C2ConstGraphicBlock& inputBlock) const;
+    // Try to convert |inputBlock| into |outputBlock| using the V4L2 image processor. Returns false
+    // if the input format is not supported by the image processor or conversion failed, in which
+    // case the frame should be converted by the CPU instead.
+    bool convertWithImageProcessor(const C2ConstGraphicBlock& inputBlock,
+                                   const C2GraphicBlock& outputBlock);
+    // Task run on a worker thread to convert |rowCount| rows starting at |row|.
+    static void convertRowsTask(const ConvertRowsCB* convertRows, size_t band, int row,
+                                int rowCount, ::base::WaitableEvent* done);
 
     // The array of block entries.
     std::vector<std::unique_ptr<BlockEntry>> mGraphicBlocks;
     // The queue of recording the raw pointers of available graphic blocks. The consumed block will
     // be popped on convertBlock(), and returned block will be pushed on returnBlock().
     std::queue<BlockEntry*> mAvailableQueue;
-    // The temporary U/V plane memory allocation for ABGR to NV12 conversion. They should be
-    // allocated on initialize().
+    // The pool the conversion blocks are allocated from, and their format.
+    std::shared_ptr<C2BlockPool> mBlockPool;
+    HalPixelFormat mHalFormat = HalPixelFormat::UNKNOWN;
+    // The number of conversion blocks currently allocated, and the maximum.
+    size_t mNumConvertBlocks = 0;
+    uint32_t mMaxNumConvertBlocks = 0;
+    // The number of frames zero-copied since a frame was last converted.
+    size_t mNumZeroCopiedFrames = 0;
+    // The tracker accounting the conversion blocks, might be null, and the bytes accounted to it.
+    std::shared_ptr<MemoryTracker> mMemoryTracker;
+    size_t mTrackedMemoryUsage = 0;
+    // The temporary U/V plane memory for ABGR to NV12 conversion, one chunk of
+    // |kABGRToNV12ChunkRows| rows for each band. They are allocated on the first conversion.
     std::unique_ptr<uint8_t[]> mTempPlaneU;
     std::unique_ptr<uint8_t[]> mTempPlaneV;
+    // The stride and size (per band) of the temporary U/V planes.
+    int mTempPlaneStride = 0;
+    size_t mTempPlaneBandSize = 0;
+
+    // The worker threads used to convert all bands but the first one in parallel.
+    std::vector<std::unique_ptr<::base::Thread>> mWorkerThreads;
+
+    // The V4L2 image processor used to convert RGB input frames, created on first use. After the
+    // image processor failed it will not be used again.
+    std::unique_ptr<V4L2ImageProcessor> mImageProcessor;
+    bool mImageProcessorFailed = false;
+    // Whether IMPLEMENTATION_DEFINED input frames are backed by RGBX. This can only be determined
+    // by mapping a frame, so the first frame is converted by the CPU. The frames of a stream share
+    // the same backing format, later frames can then be converted by the image processor without
+    // being mapped.
+    std::optional<bool> mImplDefinedIsRGB;
 
     VideoPixelFormat mOutFormat = VideoPixelFormat::UNKNOWN;
+    ui::Size mInputSize;
     ui::Size mVisibleSize;
+    ui::Size mCodedSize;
 };
 
 }  // namespace android
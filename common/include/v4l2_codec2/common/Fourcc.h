@@ -94,6 +94,12 @@ public:
         // Maps to PIXEL_FORMAT_NV21, V4L2_PIX_FMT_NV21M.
         NM21 = composeFourcc('N', 'M', '2', '1'),
 
+        // P010 single-planar format.
+        // https://linuxtv.org/downloads/v4l-dvb-apis/uapi/v4l/pixfmt-yuv-planar.html
+        // Maps to PIXEL_FORMAT_P016LE, V4L2_PIX_FMT_P010, VA_FOURCC_P010.
+        // 24bpp NV12 with 10 bits per channel, stored in the upper bits of 16-bit samples.
+        P010 = composeFourcc('P', '0', '1', '0'),
+
         // YUV422 multi-planar format.
         // https://linuxtv.org/downloads/v4l-dvb-apis/uapi/v4l/pixfmt-yuv422m.html
         // Maps to PIXEL_FORMAT_I422, V4L2_PIX_FMT_YUV422M
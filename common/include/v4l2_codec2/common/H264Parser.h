@@ -0,0 +1,190 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_H264_PARSER_H
+#define ANDROID_V4L2_CODEC2_COMMON_H264_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include <ui/Rect.h>
+#include <ui/Size.h>
+
+namespace android {
+
+// A H.264 sequence parameter set (SPS), see ITU-T H.264 section 7.3.2.1.1. Only the fields needed
+// by stateless decoders are stored.
+struct H264SPS {
+    uint8_t profileIdc = 0;
+    // constraint_set0_flag is stored in bit 0, up to constraint_set5_flag in bit 5.
+    uint8_t constraintSetFlags = 0;
+    uint8_t levelIdc = 0;
+    uint32_t seqParameterSetId = 0;
+
+    uint32_t chromaFormatIdc = 1;
+    bool separateColourPlaneFlag = false;
+    uint32_t bitDepthLumaMinus8 = 0;
+    uint32_t bitDepthChromaMinus8 = 0;
+    bool qpprimeYZeroTransformBypassFlag = false;
+    bool seqScalingMatrixPresentFlag = false;
+    // The scaling lists after applying the fall-back rules, in raster scan order.
+    uint8_t scalingList4x4[6][16];
+    uint8_t scalingList8x8[6][64];
+
+    uint32_t log2MaxFrameNumMinus4 = 0;
+    uint32_t picOrderCntType = 0;
+    uint32_t log2MaxPicOrderCntLsbMinus4 = 0;
+    bool deltaPicOrderAlwaysZeroFlag = false;
+    int32_t offsetForNonRefPic = 0;
+    int32_t offsetForTopToBottomField = 0;
+    uint32_t numRefFramesInPicOrderCntCycle = 0;
+    int32_t offsetForRefFrame[255];
+    // The sum of |offsetForRefFrame|, i.e. ExpectedDeltaPerPicOrderCntCycle.
+    int32_t expectedDeltaPerPicOrderCntCycle = 0;
+
+    uint32_t maxNumRefFrames = 0;
+    bool gapsInFrameNumValueAllowedFlag = false;
+    uint32_t picWidthInMbsMinus1 = 0;
+    uint32_t picHeightInMapUnitsMinus1 = 0;
+    bool frameMbsOnlyFlag = false;
+    bool mbAdaptiveFrameFieldFlag = false;
+    bool direct8x8InferenceFlag = false;
+
+    bool frameCroppingFlag = false;
+    uint32_t frameCropLeftOffset = 0;
+    uint32_t frameCropRightOffset = 0;
+    uint32_t frameCropTopOffset = 0;
+    uint32_t frameCropBottomOffset = 0;
+
+    // The VUI bitstream restrictions, only valid if |bitstreamRestrictionFlag| is set.
+    bool bitstreamRestrictionFlag = false;
+    uint32_t maxNumReorderFrames = 0;
+    uint32_t maxDecFrameBuffering = 0;
+
+    // Get the size of the coded frames, in pixels.
+    ui::Size codedSize() const;
+    // Get the visible rectangle of the coded frames, after applying the cropping offsets.
+    Rect visibleRect() const;
+    // Get the number of frames that need to be stored in the decoded picture buffer (DPB).
+    size_t dpbSize() const;
+    uint32_t maxFrameNum() const { return 1u << (log2MaxFrameNumMinus4 + 4); }
+};
+
+// A H.264 picture parameter set (PPS), see ITU-T H.264 section 7.3.2.2.
+struct H264PPS {
+    uint32_t picParameterSetId = 0;
+    uint32_t seqParameterSetId = 0;
+    bool entropyCodingModeFlag = false;
+    bool bottomFieldPicOrderInFramePresentFlag = false;
+    uint32_t numSliceGroupsMinus1 = 0;
+    uint32_t sliceGroupMapType = 0;
+    uint32_t sliceGroupChangeRateMinus1 = 0;
+    uint32_t numRefIdxL0DefaultActiveMinus1 = 0;
+    uint32_t numRefIdxL1DefaultActiveMinus1 = 0;
+    bool weightedPredFlag = false;
+    uint32_t weightedBipredIdc = 0;
+    int32_t picInitQpMinus26 = 0;
+    int32_t picInitQsMinus26 = 0;
+    int32_t chromaQpIndexOffset = 0;
+    bool deblockingFilterControlPresentFlag = false;
+    bool constrainedIntraPredFlag = false;
+    bool redundantPicCntPresentFlag = false;
+    bool transform8x8ModeFlag = false;
+    bool picScalingMatrixPresentFlag = false;
+    // The scaling lists after applying the fall-back rules, in raster scan order.
+    uint8_t scalingList4x4[6][16];
+    uint8_t scalingList8x8[6][64];
+    int32_t secondChromaQpIndexOffset = 0;
+};
+
+// A H.264 slice header, see ITU-T H.264 section 7.3.3.
+struct H264SliceHeader {
+    enum Type : uint32_t {
+        kP = 0,
+        kB = 1,
+        kI = 2,
+        kSP = 3,
+        kSI = 4,
+    };
+
+    // One operation of the dec_ref_pic_marking() syntax.
+    struct MemoryManagementOperation {
+        uint32_t type = 0;
+        uint32_t differenceOfPicNumsMinus1 = 0;
+        uint32_t longTermPicNum = 0;
+        uint32_t longTermFrameIdx = 0;
+        uint32_t maxLongTermFrameIdxPlus1 = 0;
+    };
+
+    uint8_t nalRefIdc = 0;
+    bool idrPicFlag = false;
+
+    uint32_t firstMbInSlice = 0;
+    // The slice type, modulo 5.
+    uint32_t sliceType = 0;
+    uint32_t picParameterSetId = 0;
+    uint32_t frameNum = 0;
+    bool fieldPicFlag = false;
+    bool bottomFieldFlag = false;
+    uint32_t idrPicId = 0;
+    uint32_t picOrderCntLsb = 0;
+    int32_t deltaPicOrderCntBottom = 0;
+    int32_t deltaPicOrderCnt[2] = {0, 0};
+    uint32_t redundantPicCnt = 0;
+    uint32_t numRefIdxL0ActiveMinus1 = 0;
+    uint32_t numRefIdxL1ActiveMinus1 = 0;
+
+    bool noOutputOfPriorPicsFlag = false;
+    bool longTermReferenceFlag = false;
+    bool adaptiveRefPicMarkingModeFlag = false;
+    std::vector<MemoryManagementOperation> memoryManagementOperations;
+
+    uint32_t sliceGroupChangeCycle = 0;
+
+    // The size in bits of the dec_ref_pic_marking() syntax, and of the picture order count related
+    // syntax elements, as required by stateless decoder APIs. Emulation prevention bytes are
+    // included in the sizes.
+    size_t decRefPicMarkingBitSize = 0;
+    size_t picOrderCntBitSize = 0;
+
+    bool isPSlice() const { return sliceType == kP || sliceType == kSP; }
+    bool isBSlice() const { return sliceType == kB; }
+    bool isISlice() const { return sliceType == kI || sliceType == kSI; }
+};
+
+// The H264Parser parses the H.264 parameter sets and slice headers needed to drive stateless
+// decoders. NAL units are located using the NalParser, the data passed to the parse methods should
+// start with the NAL unit header (i.e. without the start code). The parameter sets are stored, so
+// the slice headers referring to them can be parsed later.
+class H264Parser {
+public:
+    H264Parser() = default;
+    H264Parser(const H264Parser&) = delete;
+    H264Parser& operator=(const H264Parser&) = delete;
+
+    // Parse the SPS NAL unit in |data|, replacing any stored SPS with the same id. Returns the
+    // parsed SPS, or nullptr on failure.
+    const H264SPS* parseSPS(const uint8_t* data, size_t length);
+    // Parse the PPS NAL unit in |data|, replacing any stored PPS with the same id. The SPS referred
+    // to should already be parsed. Returns the parsed PPS, or nullptr on failure.
+    const H264PPS* parsePPS(const uint8_t* data, size_t length);
+    // Parse the header of the slice NAL unit in |data| into |header|. The SPS and PPS referred to
+    // should already be parsed.
+    bool parseSliceHeader(const uint8_t* data, size_t length, H264SliceHeader* header) const;
+
+    // Get the stored SPS or PPS with specified |id|, or nullptr if none was parsed.
+    const H264SPS* getSPS(uint32_t id) const;
+    const H264PPS* getPPS(uint32_t id) const;
+
+private:
+    std::map<uint32_t, H264SPS> mSPSs;
+    std::map<uint32_t, H264PPS> mPPSs;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_H264_PARSER_H
@@ -0,0 +1,45 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_HEVC_NAL_PARSER_H
+#define ANDROID_V4L2_CODEC2_COMMON_HEVC_NAL_PARSER_H
+
+#include <stdint.h>
+
+#include <v4l2_codec2/common/NalParser.h>
+
+namespace android {
+
+// Helper class to parse HEVC NAL units from data. HEVC uses the same Annex B byte stream format as
+// H.264, but has a two-byte NAL unit header and different NAL unit types.
+class HEVCNalParser : public NalParser {
+public:
+    // Type of an IDR picture NAL unit that may have associated leading pictures.
+    static constexpr uint8_t kIDRWRADLType = 19;
+    // Type of an IDR picture NAL unit without leading pictures.
+    static constexpr uint8_t kIDRNLPType = 20;
+    // Type of a clean random access (CRA) picture NAL unit.
+    static constexpr uint8_t kCRAType = 21;
+    // Type of a VPS NAL unit.
+    static constexpr uint8_t kVPSType = 32;
+    // Type of a SPS NAL unit.
+    static constexpr uint8_t kSPSType = 33;
+    // Type of a PPS NAL unit.
+    static constexpr uint8_t kPPSType = 34;
+
+    HEVCNalParser(const uint8_t* data, size_t length);
+
+    // Locate the sequence parameter set (SPS).
+    bool locateSPS() override;
+
+    // Get the type of the current NAL unit.
+    uint8_t type() const override;
+
+    // Find the HEVC video's color aspects in the current SPS NAL.
+    bool findCodedColorAspects(ColorAspects* colorAspects) override;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_HEVC_NAL_PARSER_H
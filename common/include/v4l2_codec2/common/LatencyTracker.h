@@ -0,0 +1,87 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_LATENCY_TRACKER_H
+#define ANDROID_V4L2_CODEC2_COMMON_LATENCY_TRACKER_H
+
+#include <stdint.h>
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <base/thread_annotations.h>
+
+namespace android {
+
+// The LatencyTracker measures the time items (e.g. frames) spend in each stage of a codec
+// pipeline. Every time an item passes a stage, mark() is called with the item's id and the name of
+// the stage. The time elapsed since the item's previous mark is attributed to that stage. The
+// most recent samples of each stage are kept in a fixed-size ring buffer, so the p50/p99
+// latencies of each stage can be dumped at any time (e.g. using "lshal debug" or dumpsys).
+//
+// If tracing is enabled, the latest sample of each stage is also published as an ATRACE counter
+// named "<tracker name>.<stage>", in microseconds.
+//
+// All trackers alive in the process are registered, so they can be dumped together using
+// dumpAll(). All methods are thread-safe.
+class LatencyTracker {
+public:
+    explicit LatencyTracker(std::string name);
+    ~LatencyTracker();
+
+    LatencyTracker(const LatencyTracker&) = delete;
+    LatencyTracker& operator=(const LatencyTracker&) = delete;
+
+    // Mark the item with specified |id| as having passed |stage|. The first mark of an item only
+    // starts tracking it. |stage| should be a string literal.
+    void mark(uint64_t id, const char* stage);
+    // Mark the item with specified |id| as having passed its final |stage| and stop tracking it.
+    void finish(uint64_t id, const char* stage);
+    // Record a |duration| for the specified |stage| that is not associated with a tracked item.
+    void recordDuration(const char* stage, std::chrono::microseconds duration);
+    // Stop tracking all items, e.g. on flush. The recorded samples are kept.
+    void clear();
+
+    // Get a human-readable summary of the p50/p99 latencies of all stages.
+    std::string dump() const;
+    // Get the summaries of all trackers alive in the process.
+    static std::string dumpAll();
+
+private:
+    // The number of samples kept for each stage.
+    static constexpr size_t kNumSamples = 256;
+    // The maximum number of items tracked simultaneously. Items that are never finished (e.g.
+    // dropped frames) are forgotten once this limit is exceeded.
+    static constexpr size_t kMaxPendingItems = 1024;
+
+    struct Stage {
+        std::string mName;
+        std::string mCounterName;
+        std::array<int64_t, kNumSamples> mSamplesUs;
+        size_t mNextSample = 0;
+        size_t mNumSamples = 0;
+    };
+
+    // Add a sample to the specified |stage|, |mLock| should be held.
+    void recordLocked(const char* stage, int64_t durationUs);
+
+    const std::string mName;
+
+    mutable std::mutex mLock;
+    // The time each tracked item passed its previous stage, keyed by item id.
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> mLastMarks
+            GUARDED_BY(mLock);
+    // The stages in the order they were first seen, and their index in |mStages| by name.
+    std::vector<Stage> mStages GUARDED_BY(mLock);
+    std::map<std::string, size_t> mStageIndices GUARDED_BY(mLock);
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_LATENCY_TRACKER_H
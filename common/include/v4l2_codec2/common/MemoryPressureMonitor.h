@@ -0,0 +1,100 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_MEMORY_PRESSURE_MONITOR_H
+#define ANDROID_V4L2_CODEC2_COMMON_MEMORY_PRESSURE_MONITOR_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/sequenced_task_runner.h>
+#include <base/thread_annotations.h>
+#include <base/threading/thread.h>
+#include <base/time/time.h>
+
+#include <v4l2_codec2/common/V4L2PollerService.h>
+
+namespace android {
+
+// Process-wide monitor of the system's memory pressure, shared by all components. While the system
+// is under pressure the components allocate fewer buffers and release the buffers they don't need,
+// e.g. those of paused sessions, so the memory pinned by the codecs doesn't get apps killed.
+//
+// Pressure is reported by calling reportMemoryPressure(), e.g. when the component store is asked to
+// trim its memory. The kernel's pressure stall information (PSI) is monitored too, and pressure is
+// reported whenever tasks were stalled on memory for "ro.vendor.v4l2_codec2.psi_stall_ms"
+// (default: 100ms, 0 disables monitoring) within a second. The pressure is relieved once it wasn't
+// reported for a while, buffers allocated afterwards are sized normally again.
+//
+// All methods are thread-safe.
+class MemoryPressureMonitor {
+public:
+    // Callback notified when the system enters or leaves the memory pressure state.
+    using Observer = base::RepeatingCallback<void(bool underPressure)>;
+    using ObserverId = uint64_t;
+
+    // Get the process-wide monitor, creating it on first use.
+    static MemoryPressureMonitor* getInstance();
+
+    // Whether the system is currently under memory pressure.
+    bool isUnderPressure() const { return mUnderPressure.load(); }
+
+    // Report memory pressure, e.g. a trim request from the framework.
+    void reportMemoryPressure();
+
+    // Start notifying |observer| of pressure changes. The observer is posted on |taskRunner|, or
+    // called on the monitor's thread if |taskRunner| is null.
+    ObserverId addObserver(scoped_refptr<base::SequencedTaskRunner> taskRunner, Observer observer);
+    // Stop notifying the observer with specified |id|.
+    void removeObserver(ObserverId id);
+
+private:
+    struct ObserverEntry {
+        scoped_refptr<base::SequencedTaskRunner> mTaskRunner;
+        Observer mObserver;
+    };
+
+    MemoryPressureMonitor();
+    ~MemoryPressureMonitor() = delete;
+
+    MemoryPressureMonitor(const MemoryPressureMonitor&) = delete;
+    MemoryPressureMonitor& operator=(const MemoryPressureMonitor&) = delete;
+
+    // Register a PSI trigger firing when tasks were stalled on memory for |stallMs| per second.
+    void startPsiMonitoringTask(int32_t stallMs);
+    void onPsiEvent(bool event);
+    void onPsiError();
+
+    // Leave the pressure state if no pressure was reported for |kReliefDelayMs|, the task is
+    // rescheduled otherwise.
+    void reliefTask();
+    void scheduleReliefLocked(base::TimeDelta delay) REQUIRES(mLock);
+    void notifyObserversLocked(bool underPressure) REQUIRES(mLock);
+
+    // The thread handling PSI events and relieving the pressure.
+    base::Thread mThread{"MemoryPressureMonitorThread"};
+
+    // The PSI trigger and its watch, only accessed on |mThread|.
+    base::ScopedFD mPsiFd;
+    std::optional<V4L2PollerService::WatchId> mPsiWatchId;
+
+    std::atomic<bool> mUnderPressure{false};
+
+    std::mutex mLock;
+    // The time pressure was last reported.
+    base::TimeTicks mLastPressureTime GUARDED_BY(mLock);
+    bool mReliefScheduled GUARDED_BY(mLock) = false;
+    std::map<ObserverId, ObserverEntry> mObservers GUARDED_BY(mLock);
+    ObserverId mNextObserverId GUARDED_BY(mLock) = 0;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_MEMORY_PRESSURE_MONITOR_H
@@ -0,0 +1,72 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_MEMORY_TRACKER_H
+#define ANDROID_V4L2_CODEC2_COMMON_MEMORY_TRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <C2Buffer.h>
+#include <base/thread_annotations.h>
+
+namespace android {
+
+// The MemoryTracker accounts the buffer memory (dmabufs and gralloc buffers) pinned by a codec
+// session, split into categories such as the frames allocated for the decoder's output or the
+// blocks used for format conversion. The current and peak usage of each category can be dumped at
+// any time (e.g. using "lshal debug").
+//
+// If tracing is enabled, the usage of each category is also published as an ATRACE counter named
+// "<tracker name>.<category>", in bytes.
+//
+// All trackers alive in the process are registered, so they can be dumped together using
+// dumpAll(). All methods are thread-safe.
+class MemoryTracker {
+public:
+    explicit MemoryTracker(std::string name);
+    ~MemoryTracker();
+
+    MemoryTracker(const MemoryTracker&) = delete;
+    MemoryTracker& operator=(const MemoryTracker&) = delete;
+
+    // Add |bytes| to the usage of |category|, negative to account released memory. |category|
+    // should be a string literal.
+    void add(const char* category, int64_t bytes);
+
+    // Get the current usage of all categories, in bytes.
+    int64_t getTotalUsage() const;
+
+    // Get a human-readable summary of the current and peak usage of all categories.
+    std::string dump() const;
+    // Get the summaries of all trackers alive in the process.
+    static std::string dumpAll();
+
+    // Get the size in bytes of the buffer with specified |handle|. The sizes of distinct dmabufs
+    // are summed, as the planes of a gralloc buffer might be backed by separate dmabufs. Returns 0
+    // if the size can't be determined. This requires a syscall per fd, so it should only be called
+    // once per allocation.
+    static size_t getBufferSize(const C2Handle* handle);
+
+private:
+    struct Usage {
+        int64_t mBytes = 0;
+        int64_t mPeakBytes = 0;
+        std::string mCounterName;
+    };
+
+    const std::string mName;
+
+    mutable std::mutex mLock;
+    // The usage of each category, keyed by category name.
+    std::map<std::string, Usage> mUsages GUARDED_BY(mLock);
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_MEMORY_TRACKER_H
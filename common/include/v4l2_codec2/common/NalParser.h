@@ -12,6 +12,8 @@ namespace android {
 // Helper class to parse H264 NAL units from data.
 class NalParser {
 public:
+    // Type of a non-IDR Slice NAL unit.
+    static constexpr uint8_t kNonIDRType = 1;
     // Type of a IDR Slice NAL unit.
     static constexpr uint8_t kIDRType = 5;
     // Type of a SPS NAL unit.
@@ -28,6 +30,7 @@ public:
     };
 
     NalParser(const uint8_t* data, size_t length);
+    virtual ~NalParser() = default;
 
     // Locates the next NAL after |mNextNalStartCodePos|. If there is one, updates |mCurrNalDataPos|
     // to the first byte of the NAL data (start code is not included), and |mNextNalStartCodePos| to
@@ -38,7 +41,7 @@ public:
     bool locateNextNal();
 
     // Locate the sequence parameter set (SPS).
-    bool locateSPS();
+    virtual bool locateSPS();
 
     // Gets current NAL data (start code is not included).
     const uint8_t* data() const;
@@ -47,17 +50,15 @@ public:
     size_t length() const;
 
     // Get the type of the current NAL unit.
-    uint8_t type() const;
+    virtual uint8_t type() const;
 
     // Find the H.264 video's color aspects in the current SPS NAL.
-    bool findCodedColorAspects(ColorAspects* colorAspects);
+    virtual bool findCodedColorAspects(ColorAspects* colorAspects);
 
 private:
     const uint8_t* findNextStartCodePos() const;
 
-    // The byte pattern for the start of a H264 NAL unit.
-    const uint8_t kNalStartCode[3] = {0x00, 0x00, 0x01};
-    // The length in bytes of the NAL-unit start pattern.
+    // The length in bytes of the NAL-unit start pattern (0x000001).
     const size_t kNalStartCodeLength = 3;
 
     const uint8_t* mCurrNalDataPos;
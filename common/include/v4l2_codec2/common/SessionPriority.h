@@ -0,0 +1,29 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_SESSION_PRIORITY_H
+#define ANDROID_V4L2_CODEC2_COMMON_SESSION_PRIORITY_H
+
+namespace android {
+
+// The priority class of a codec session, which determines the scheduling priority and cgroup of
+// the threads running the session.
+enum class SessionPriority {
+    // Playback, recording and calls, frames have to be produced before their display deadline.
+    REALTIME,
+    // Thumbnail extraction and scrubbing, user-visible but without per-frame deadlines.
+    THUMBNAIL,
+    // Transcoding and other best-effort work, which shouldn't compete with the foreground app.
+    BACKGROUND,
+};
+
+const char* SessionPriorityToString(SessionPriority priority);
+
+// Move the calling thread to the scheduling priority and cgroup of |priority|. Returns false if
+// the process isn't allowed to change its priority, in which case the thread is left untouched.
+bool setCurrentThreadPriority(SessionPriority priority);
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_SESSION_PRIORITY_H
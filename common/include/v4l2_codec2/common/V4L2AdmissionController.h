@@ -0,0 +1,122 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_ADMISSION_CONTROLLER_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_ADMISSION_CONTROLLER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <base/thread_annotations.h>
+#include <ui/Size.h>
+
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/VideoTypes.h>
+
+namespace android {
+
+// Process-wide admission controller for hardware codec sessions, shared by all decode and encode
+// components. Rather than limiting the number of concurrent instances, the load of each session is
+// tracked in macroblocks per second, and new sessions are only rejected when the capacity of the
+// device would be exceeded.
+//
+// The capacity available to a codec is derived from the maximum resolution (and framerate) of its
+// supported profiles, multiplied by the number of devices supporting it as sessions are spread
+// across all of them. A new session is checked against the load of the sessions of the same codec,
+// so codecs served by separate devices don't block each other. The capacity of the whole device
+// can be overridden using the "ro.vendor.v4l2_codec2.decode_max_macroblocks_per_second" and
+// "ro.vendor.v4l2_codec2.encode_max_macroblocks_per_second" properties, which is then shared by the
+// sessions of all codecs. The
+// "ro.vendor.v4l2_codec2.decode_concurrent_instances" and
+// "ro.vendor.v4l2_codec2.encode_concurrent_instances" properties still limit the number of
+// sessions if set.
+//
+// All methods are thread-safe.
+class V4L2AdmissionController {
+public:
+    // A session admitted by the controller. The session initially doesn't use any capacity, the
+    // load reserved using setLoad() is released when the session is destroyed.
+    class Session {
+    public:
+        ~Session();
+
+        // Change the load reserved by the session to |macroblocksPerSecond|. Returns false and
+        // keeps the previously reserved load if there isn't enough capacity left.
+        bool setLoad(uint64_t macroblocksPerSecond);
+
+    private:
+        friend class V4L2AdmissionController;
+
+        Session(V4L2AdmissionController* controller, V4L2Device::Type type, VideoCodec codec);
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        V4L2AdmissionController* const mController;
+        const V4L2Device::Type mType;
+        const VideoCodec mCodec;
+        // The load currently reserved by the session, guarded by the controller's lock.
+        uint64_t mLoad = 0;
+    };
+
+    // Get the process-wide admission controller, creating it on first use.
+    static V4L2AdmissionController* getInstance();
+
+    // Get the load in macroblocks per second of a stream with specified |size| and |framerate|.
+    static uint64_t getLoad(const ui::Size& size, float framerate);
+
+    // Admit a new session for |codec| on the device of specified |type|. Returns null if the
+    // maximum number of sessions has been reached, or if the capacity available to |codec| is
+    // already fully used.
+    std::unique_ptr<Session> createSession(V4L2Device::Type type, VideoCodec codec);
+
+private:
+    // The capacity and current usage of a device.
+    struct Usage {
+        // The maximum number of sessions, negative if unlimited.
+        int32_t mMaxSessions = -1;
+        // The capacity override in macroblocks per second, zero if not set.
+        uint64_t mCapacityOverride = 0;
+        // The capacity available to each codec in macroblocks per second, zero if unknown.
+        std::map<VideoCodec, uint64_t> mCapacities;
+        // The number of sessions currently admitted.
+        size_t mNumSessions = 0;
+        // The sum of the load reserved by all admitted sessions, and by the sessions of each codec.
+        uint64_t mLoad = 0;
+        std::map<VideoCodec, uint64_t> mCodecLoads;
+    };
+
+    V4L2AdmissionController() = default;
+    ~V4L2AdmissionController() = delete;
+
+    V4L2AdmissionController(const V4L2AdmissionController&) = delete;
+    V4L2AdmissionController& operator=(const V4L2AdmissionController&) = delete;
+
+    // Get the usage of the device of specified |type|. Must be called with |mLock| held.
+    Usage& getUsage(V4L2Device::Type type);
+    // Get the load reserved by the sessions sharing the capacity available to |codec|. Must be
+    // called with |mLock| held.
+    static uint64_t getUsedLoad(const Usage& usage, VideoCodec codec);
+    // Get the capacity available to |codec| on the device of specified |type|, querying it on first
+    // use. Must be called without |mLock| held, the devices are queried outside the lock.
+    uint64_t getCapacity(V4L2Device::Type type, VideoCodec codec);
+    // Query the capacity available to |codec| on the device of specified |type| in macroblocks per
+    // second.
+    static uint64_t queryCapacity(V4L2Device::Type type, VideoCodec codec);
+
+    // Called by |session| to change the load it reserved, or when it's destroyed.
+    bool setSessionLoad(Session* session, uint64_t macroblocksPerSecond);
+    void removeSession(Session* session);
+
+    std::mutex mLock;
+    // The usage of each device type.
+    std::map<V4L2Device::Type, Usage> mUsages GUARDED_BY(mLock);
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_ADMISSION_CONTROLLER_H
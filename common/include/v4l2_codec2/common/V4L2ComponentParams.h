@@ -0,0 +1,127 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_COMPONENT_PARAMS_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_COMPONENT_PARAMS_H
+
+#include <C2Config.h>
+#include <C2Param.h>
+#include <C2ParamDef.h>
+
+namespace android {
+
+// Vendor parameters of the V4L2 components. The parameter names are exposed to MediaCodec clients
+// as "vendor.v4l2-codec2.<name>.<field>" keys.
+enum V4L2ParamIndexKind : C2Param::type_index_t {
+    kParamIndexV4L2ScaledOutputSize = C2Param::TYPE_INDEX_VENDOR_START,
+    kParamIndexV4L2KeyFrameOnly,
+    kParamIndexV4L2TemporalLayerId,
+    kParamIndexV4L2LongTermReferenceCount,
+    kParamIndexV4L2MarkLongTermReference,
+    kParamIndexV4L2UseLongTermReferences,
+    kParamIndexV4L2RoiRect,
+    kParamIndexV4L2RoiRects,
+    kParamIndexV4L2EncodeStats,
+};
+
+// The size decoded frames are scaled to on the decoder's output, e.g. to generate thumbnails
+// without allocating buffers of the full stream resolution. Zero width or height disables scaling.
+// Frames are never upscaled, and the size is ignored if the device can't scale its output.
+//
+// On the encoder this is the size input frames are scaled to before they are encoded, so the
+// client doesn't need to downscale them first. Frames are never upscaled either.
+typedef C2StreamParam<C2Tuning, C2PictureSizeStruct, kParamIndexV4L2ScaledOutputSize>
+        C2StreamV4L2ScaledOutputSizeTuning;
+constexpr char C2_PARAMKEY_V4L2_SCALED_OUTPUT_SIZE[] = "vendor.v4l2-codec2.scaled-output-size";
+
+// Whether the decoder only decodes key frames, e.g. for thumbnail extraction and scrubbing. Other
+// frames are dropped before they are sent to the device, and their works are completed without an
+// output buffer.
+typedef C2StreamParam<C2Tuning, C2EasyBoolValue, kParamIndexV4L2KeyFrameOnly>
+        C2StreamV4L2KeyFrameOnlyTuning;
+constexpr char C2_PARAMKEY_V4L2_KEY_FRAME_ONLY[] = "vendor.v4l2-codec2.key-frame-only";
+
+// The temporal layer an encoded frame belongs to when temporal layering is enabled, attached to the
+// output buffers of the encoder. The base layer is zero.
+typedef C2StreamParam<C2Info, C2Uint32Value, kParamIndexV4L2TemporalLayerId>
+        C2StreamV4L2TemporalLayerIdInfo;
+constexpr char C2_PARAMKEY_V4L2_TEMPORAL_LAYER_ID[] = "vendor.v4l2-codec2.temporal-layer-id";
+
+// The number of long-term reference slots used by the encoder, zero disables long-term references.
+// Long-term references allow recovering from packet loss without requesting a key frame.
+typedef C2StreamParam<C2Tuning, C2Uint32Value, kParamIndexV4L2LongTermReferenceCount>
+        C2StreamV4L2LongTermReferenceCountTuning;
+constexpr char C2_PARAMKEY_V4L2_LTR_COUNT[] = "vendor.v4l2-codec2.ltr-count";
+
+// Mark the next frame encoded as long-term reference, stored in the specified slot. Like a key
+// frame request, this is reset to -1 once the encoder gets the request.
+typedef C2StreamParam<C2Tuning, C2Int32Value, kParamIndexV4L2MarkLongTermReference>
+        C2StreamV4L2MarkLongTermReferenceTuning;
+constexpr char C2_PARAMKEY_V4L2_LTR_MARK[] = "vendor.v4l2-codec2.ltr-mark";
+
+// Bitmask of the long-term reference slots the next frame encoded is predicted from. Recent
+// short-term references are invalidated, e.g. to predict from the last frame acknowledged by the
+// receiver after packet loss. This is reset to 0 once the encoder gets the request.
+typedef C2StreamParam<C2Tuning, C2Uint32Value, kParamIndexV4L2UseLongTermReferences>
+        C2StreamV4L2UseLongTermReferencesTuning;
+constexpr char C2_PARAMKEY_V4L2_LTR_USE[] = "vendor.v4l2-codec2.ltr-use";
+
+// A region of interest of an input frame, and the QP offset applied to the macroblocks it covers.
+// Negative offsets increase the quality of the region.
+struct C2V4L2RoiRectStruct : C2Rect {
+    C2V4L2RoiRectStruct() = default;
+    C2V4L2RoiRectStruct(const C2Rect& rect, int32_t offset) : C2Rect(rect), qpOffset(offset) {}
+
+    bool operator==(const C2V4L2RoiRectStruct&) = delete;
+    bool operator!=(const C2V4L2RoiRectStruct&) = delete;
+
+    int32_t qpOffset;
+
+    DEFINE_AND_DESCRIBE_C2STRUCT(V4L2RoiRect)
+    C2FIELD(width, "width")
+    C2FIELD(height, "height")
+    C2FIELD(left, "left")
+    C2FIELD(top, "top")
+    C2FIELD(qpOffset, "qp-offset")
+};
+
+// The regions of interest of the encoder's input frames. Regions attached to a work item's input
+// config updates only apply to that frame, otherwise the regions configured on the component are
+// used. Later regions take precedence where regions overlap.
+typedef C2StreamParam<C2Info, C2SimpleArrayStruct<C2V4L2RoiRectStruct>, kParamIndexV4L2RoiRects>
+        C2StreamV4L2RoiRectsInfo;
+constexpr char C2_PARAMKEY_V4L2_ROI_RECTS[] = "vendor.v4l2-codec2.roi-rects";
+
+// Statistics of an encoded frame, attached to the output buffers of the encoder.
+struct C2V4L2EncodeStatsStruct {
+    C2V4L2EncodeStatsStruct() = default;
+    C2V4L2EncodeStatsStruct(int32_t averageQp, uint32_t pictureType, uint32_t encodedSize,
+                            int64_t encodeTimeUs)
+          : averageQp(averageQp),
+            pictureType(pictureType),
+            encodedSize(encodedSize),
+            encodeTimeUs(encodeTimeUs) {}
+
+    // The average QP of the frame, -1 if the device doesn't report it.
+    int32_t averageQp;
+    // The C2Config::picture_type_t of the frame.
+    uint32_t pictureType;
+    // The size of the encoded data in bytes.
+    uint32_t encodedSize;
+    // The time between queueing the input frame on the device and dequeueing the encoded data.
+    int64_t encodeTimeUs;
+
+    DEFINE_AND_DESCRIBE_C2STRUCT(V4L2EncodeStats)
+    C2FIELD(averageQp, "average-qp")
+    C2FIELD(pictureType, "picture-type")
+    C2FIELD(encodedSize, "encoded-size")
+    C2FIELD(encodeTimeUs, "encode-time-us")
+};
+typedef C2StreamParam<C2Info, C2V4L2EncodeStatsStruct, kParamIndexV4L2EncodeStats>
+        C2StreamV4L2EncodeStatsInfo;
+constexpr char C2_PARAMKEY_V4L2_ENCODE_STATS[] = "vendor.v4l2-codec2.encode-stats";
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_COMPONENT_PARAMS_H
@@ -13,6 +13,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <vector>
 
@@ -20,23 +23,55 @@
 #include <base/containers/flat_map.h>
 #include <base/files/scoped_file.h>
 #include <base/memory/ref_counted.h>
+#include <base/thread_annotations.h>
 
 #include <ui/Size.h>
 #include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/MemoryTracker.h>
 #include <v4l2_codec2/common/V4L2DevicePoller.h>
+#include <v4l2_codec2/common/V4L2IoctlStats.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 
+// AV1 definitions that are only defined in newer kernel versions.
+#ifndef V4L2_PIX_FMT_AV1
+#define V4L2_PIX_FMT_AV1 v4l2_fourcc('A', 'V', '0', '1')
+#endif
+#ifndef V4L2_PIX_FMT_AV1_FRAME
+#define V4L2_PIX_FMT_AV1_FRAME v4l2_fourcc('A', 'V', '1', 'F')
+#endif
+#ifndef V4L2_CID_MPEG_VIDEO_AV1_PROFILE
+#define V4L2_CID_MPEG_VIDEO_AV1_PROFILE (V4L2_CID_MPEG_BASE + 655)
+#define V4L2_MPEG_VIDEO_AV1_PROFILE_MAIN 0
+#define V4L2_MPEG_VIDEO_AV1_PROFILE_HIGH 1
+#define V4L2_MPEG_VIDEO_AV1_PROFILE_PROFESSIONAL 2
+#endif
+
 namespace android {
 
 class V4L2Queue;
 class V4L2BufferRefBase;
 class V4L2BuffersList;
 class V4L2DecodeSurface;
+class V4L2ReadableBuffer;
+
+// Releases a V4L2BufferRefBase, whose storage is owned by the free buffers list of its queue.
+struct V4L2BufferRefBaseDeleter {
+    void operator()(V4L2BufferRefBase* refBase) const;
+};
+
+// Destroys a V4L2ReadableBuffer in place once its last reference is dropped, as its storage is
+// owned by the free buffers list of its queue.
+struct V4L2ReadableBufferTraits {
+    static void Destruct(const V4L2ReadableBuffer* buffer);
+};
 
 // Wrapper for the 'v4l2_ext_control' structure.
 struct V4L2ExtCtrl {
     V4L2ExtCtrl(uint32_t id);
     V4L2ExtCtrl(uint32_t id, int32_t val);
+    // Create a compound control of |size| bytes, whose payload is stored at |ptr|. The payload
+    // should remain valid until the control is set.
+    V4L2ExtCtrl(uint32_t id, void* ptr, uint32_t size);
     struct v4l2_ext_control ctrl;
 };
 
@@ -93,6 +128,9 @@ public:
     size_t getPlaneBytesUsed(const size_t plane) const;
     // Set the data offset for |plane|, in bytes.
     void setPlaneDataOffset(const size_t plane, const size_t dataOffset);
+    // Associate the buffer with the media request |requestFd|. The buffer will only be processed
+    // when the request is queued.
+    void setRequestFd(int requestFd);
 
     // Return the V4L2 buffer ID of the underlying buffer.
     size_t bufferId() const;
@@ -110,7 +148,7 @@ private:
     V4L2WritableBufferRef(const V4L2WritableBufferRef&) = delete;
     V4L2WritableBufferRef& operator=(const V4L2WritableBufferRef&) = delete;
 
-    std::unique_ptr<V4L2BufferRefBase> mBufferData;
+    std::unique_ptr<V4L2BufferRefBase, V4L2BufferRefBaseDeleter> mBufferData;
 
     SEQUENCE_CHECKER(mSequenceChecker);
 };
@@ -124,12 +162,15 @@ private:
 // buffers they originate from. This flexibility is required because V4L2ReadableBufferRefs can be
 // embedded into VideoFrames, which are then passed to other threads and not necessarily destroyed
 // before the V4L2Queue buffers are freed.
-class V4L2ReadableBuffer : public base::RefCountedThreadSafe<V4L2ReadableBuffer> {
+class V4L2ReadableBuffer
+      : public base::RefCountedThreadSafe<V4L2ReadableBuffer, V4L2ReadableBufferTraits> {
 public:
     // Returns whether the V4L2_BUF_FLAG_LAST flag is set for this buffer.
     bool isLast() const;
     // Returns whether the V4L2_BUF_FLAG_KEYFRAME flag is set for this buffer.
     bool isKeyframe() const;
+    // Returns whether the V4L2_BUF_FLAG_ERROR flag is set for this buffer.
+    bool isError() const;
     // Return the timestamp set by the driver on this buffer.
     struct timeval getTimeStamp() const;
     // Returns the number of planes in this buffer.
@@ -148,7 +189,8 @@ public:
 
 private:
     friend class V4L2BufferRefFactory;
-    friend class base::RefCountedThreadSafe<V4L2ReadableBuffer>;
+    friend class base::RefCountedThreadSafe<V4L2ReadableBuffer, V4L2ReadableBufferTraits>;
+    friend struct V4L2ReadableBufferTraits;
 
     ~V4L2ReadableBuffer();
 
@@ -157,7 +199,7 @@ private:
     V4L2ReadableBuffer(const V4L2ReadableBuffer&) = delete;
     V4L2ReadableBuffer& operator=(const V4L2ReadableBuffer&) = delete;
 
-    std::unique_ptr<V4L2BufferRefBase> mBufferData;
+    std::unique_ptr<V4L2BufferRefBase, V4L2BufferRefBaseDeleter> mBufferData;
 
     SEQUENCE_CHECKER(mSequenceChecker);
 };
@@ -240,6 +282,10 @@ public:
     // Returns |mMemory|, memory type of last buffers allocated by this V4L2Queue.
     v4l2_memory getMemoryType() const;
 
+    // Set the |tracker| accounting the buffers allocated by this queue. Only MMAP buffers are
+    // accounted, DMABUF buffers are owned (and accounted) by the client.
+    void setMemoryTracker(std::shared_ptr<MemoryTracker> tracker);
+
     // Return a reference to a free buffer for the caller to prepare and submit, or nullopt if no
     // buffer is currently free.
     //
@@ -247,6 +293,10 @@ public:
     // clients again.
     std::optional<V4L2WritableBufferRef> getFreeBuffer();
     std::optional<V4L2WritableBufferRef> getFreeBuffer(size_t requestedBufferId);
+    // Return a free buffer to queue the dmabuf identified by |dmabufId| in. Clients usually recycle
+    // a small set of dmabufs, so the buffer the dmabuf was queued in the previous time is returned
+    // if free. The driver then doesn't have to import and map the dmabuf again.
+    std::optional<V4L2WritableBufferRef> getFreeBufferForDmabuf(std::optional<uint32_t> dmabufId);
 
     // Attempt to dequeue a buffer, and return a reference to it if one was available.
     //
@@ -256,6 +306,11 @@ public:
     // nullptr otherwise. Dequeued buffers will not be reused by the driver until all references to
     // them are dropped.
     std::pair<bool, V4L2ReadableBufferRef> dequeueBuffer();
+    // Dequeue all the buffers currently ready into |buffers|, in the order they were returned by
+    // the driver. Unlike calling |dequeueBuffer()| repeatedly, polling is only scheduled once.
+    // Returns false if an error occurred, in which case |buffers| contains the buffers dequeued
+    // before the error.
+    bool dequeueBuffers(std::vector<V4L2ReadableBufferRef>* buffers);
 
     // Returns true if this queue is currently streaming.
     bool isStreaming() const;
@@ -286,6 +341,10 @@ private:
 
     // Called when clients request a buffer to be queued.
     bool queueBuffer(struct v4l2_buffer* v4l2Buffer);
+    // Dequeue a buffer without scheduling polling.
+    std::pair<bool, V4L2ReadableBufferRef> dequeueBufferInternal();
+    // The category the buffers of this queue are accounted under in |mMemoryTracker|.
+    const char* memoryCategory() const;
 
     const enum v4l2_buf_type mType;
     enum v4l2_memory mMemory = V4L2_MEMORY_MMAP;
@@ -299,16 +358,26 @@ private:
     // Buffers that are available for client to get and submit. Buffers in this list are not
     // referenced by anyone else than ourselves.
     scoped_refptr<V4L2BuffersList> mFreeBuffers;
-    // Buffers that have been queued by the client, and not dequeued yet.
-    std::set<size_t> mQueuedBuffers;
+    // Whether each buffer has been queued by the client, and not dequeued yet.
+    std::vector<bool> mQueuedBuffers;
+    // The number of buffers set in |mQueuedBuffers|.
+    size_t mNumQueuedBuffers = 0;
+    // The buffer each dmabuf was last returned for by getFreeBufferForDmabuf().
+    std::map<uint32_t, size_t> mDmabufBufferIds;
 
     scoped_refptr<V4L2Device> mDevice;
     // Callback to call in this queue's destructor.
     base::OnceClosure mDestroyCb;
 
+    // The tracker accounting the allocated MMAP buffers, might be null.
+    std::shared_ptr<MemoryTracker> mMemoryTracker;
+    // The number of bytes currently accounted to |mMemoryTracker|.
+    size_t mTrackedMemoryUsage = 0;
+
     V4L2Queue(scoped_refptr<V4L2Device> dev, enum v4l2_buf_type type, base::OnceClosure destroyCb);
     friend class V4L2QueueFactory;
     friend class V4L2BufferRefBase;
+    friend class V4L2BufferRefFactory;
     friend class base::RefCountedThreadSafe<V4L2Queue>;
 
     SEQUENCE_CHECKER(mSequenceChecker);
@@ -349,6 +418,8 @@ public:
     // Convert required H264 profile and level to V4L2 enums.
     static int32_t c2ProfileToV4L2H264Profile(C2Config::profile_t profile);
     static int32_t h264LevelIdcToV4L2H264Level(uint8_t levelIdc);
+    // Convert required HEVC profile to V4L2 enum.
+    static int32_t c2ProfileToV4L2HEVCProfile(C2Config::profile_t profile);
     static v4l2_mpeg_video_bitrate_mode C2BitrateModeToV4L2BitrateMode(
             C2Config::bitrate_mode_t bitrateMode);
 
@@ -371,12 +442,17 @@ public:
     // Returns number of planes of |pixFmt|.
     static size_t getNumPlanesOfV4L2PixFmt(uint32_t pixFmt);
 
-    enum class Type { kDecoder, kEncoder };
+    enum class Type { kDecoder, kEncoder, kImageProcessor };
 
     // Create and initialize an appropriate V4L2Device instance for the current platform, or return
     // nullptr if not available.
     static scoped_refptr<V4L2Device> create();
 
+    // Enumerate all V4L2 devices and their supported encoder profiles, and store the results in the
+    // process-wide capabilities cache. This is intended to be called once at service start-up, so
+    // later interface and component creation don't need to query the devices again.
+    static void populateCapabilitiesCache();
+
     // Open a V4L2 device of |type| for use with |v4l2PixFmt|. Return true on success. The device
     // will be closed in the destructor.
     bool open(Type type, uint32_t v4l2PixFmt);
@@ -385,16 +461,19 @@ public:
     // queue type is not supported.
     scoped_refptr<V4L2Queue> getQueue(enum v4l2_buf_type type);
 
-    // Parameters and return value are the same as for the standard ioctl() system call.
+    // Parameters and return value are the same as for the standard ioctl() system call. The calls
+    // are recorded in the session's ioctl stats if enabled, see V4L2IoctlStats.
     int ioctl(int request, void* arg);
 
     // This method sleeps until either:
     // - SetDevicePollInterrupt() is called (on another thread),
     // - |pollDevice| is true, and there is new data to be read from the device,
     //   or an event from the device has arrived; in the latter case
-    //   |*eventPending| will be set to true.
-    // Returns false on error, true otherwise. This method should be called from a separate thread.
-    bool poll(bool pollDevice, bool* eventPending);
+    //   |*eventPending| will be set to true,
+    // - |timeoutMs| is not negative and the specified number of milliseconds has passed.
+    // Returns false on error or timeout, true otherwise. This method should be called from a
+    // separate thread, unless a timeout is specified.
+    bool poll(bool pollDevice, bool* eventPending, int timeoutMs = -1);
 
     // These methods are used to interrupt the thread sleeping on poll() and force it to return
     // regardless of device state, which is usually when the client is no longer interested in what
@@ -428,13 +507,17 @@ public:
     std::vector<uint32_t> enumerateSupportedPixelformats(v4l2_buf_type bufType);
 
     // Return supported profiles for decoder, including only profiles for given fourcc
-    // |pixelFormats|.
+    // |pixelFormats|. The profiles are queried on first use and cached for the process' lifetime.
     SupportedDecodeProfiles getSupportedDecodeProfiles(const size_t numFormats,
                                                        const uint32_t pixelFormats[]);
 
-    // Return supported profiles for encoder.
+    // Return supported profiles for encoder. The profiles are queried on first use and cached for
+    // the process' lifetime.
     SupportedEncodeProfiles getSupportedEncodeProfiles();
 
+    // Return the number of devices of |type| supporting any of the given fourcc |pixelFormats|.
+    size_t getNumDevicesFor(Type type, const size_t numFormats, const uint32_t pixelFormats[]);
+
     // Start polling on this V4L2Device. |eventCallback| will be posted to the caller's sequence if
     // a buffer is ready to be dequeued and/or a V4L2 event has been posted. |errorCallback| will
     // be posted to the client's
@@ -448,11 +531,37 @@ public:
     // V4L2Queue, clients should not need to call it directly.
     void schedulePoll();
 
+    // Defers scheduling polling until the instance is destroyed, so servicing the device re-arms
+    // the poller only once however many buffers are dequeued and queued. Instances can be nested,
+    // and must be used on the client sequence.
+    class ScopedPollBatch {
+    public:
+        explicit ScopedPollBatch(scoped_refptr<V4L2Device> device);
+        ~ScopedPollBatch();
+
+        ScopedPollBatch(const ScopedPollBatch&) = delete;
+        ScopedPollBatch& operator=(const ScopedPollBatch&) = delete;
+
+    private:
+        scoped_refptr<V4L2Device> mDevice;
+    };
+
     // Check whether the V4L2 control with specified |ctrlId| is supported.
     bool isCtrlExposed(uint32_t ctrlId);
     // Set the specified list of |ctrls| for the specified |ctrlClass|, returns whether the
     // operation succeeded.
     bool setExtCtrls(uint32_t ctrlClass, std::vector<V4L2ExtCtrl> ctrls);
+    // Set the specified list of |ctrls| on the media request |requestFd|. The controls are applied
+    // when the request is queued. Returns whether the operation succeeded.
+    bool setExtCtrlsForRequest(int requestFd, std::vector<V4L2ExtCtrl> ctrls);
+
+    // Allocate a media request for use with the stateless codec API, using the media device the
+    // currently open device belongs to. Returns an invalid fd on failure.
+    base::ScopedFD allocateMediaRequest();
+    // Queue the media request |requestFd|, returns whether the operation succeeded.
+    static bool queueMediaRequest(int requestFd);
+    // Reinitialize the completed media request |requestFd| so it can be reused.
+    static bool reinitMediaRequest(int requestFd);
 
     // Check whether the V4L2 command with specified |commandId| is supported.
     bool isCommandSupported(uint32_t commandId);
@@ -464,6 +573,8 @@ private:
     using Devices = std::vector<std::pair<std::string, std::vector<uint32_t>>>;
 
     friend class base::RefCountedThreadSafe<V4L2Device>;
+    // The poller needs access to |mDeviceFd| to register it with the shared poller service.
+    friend class V4L2DevicePoller;
     V4L2Device();
     ~V4L2Device();
 
@@ -481,26 +592,46 @@ private:
     // Close the currently open device.
     void closeDevice();
 
-    // Enumerate all V4L2 devices on the system for |type| and store the results under
-    // mDevicesByType[type].
-    void enumerateDevicesForType(V4L2Device::Type type);
+    // Open the media device the currently open device belongs to, if not opened yet.
+    bool openMediaDevice();
+
+    // Enumerate all V4L2 devices on the system for |type| and return the results.
+    Devices enumerateDevicesForType(V4L2Device::Type type);
 
     // Return device information for all devices of |type| available in the system. Enumerates and
-    // queries devices on first run and caches the results for subsequent calls.
+    // queries devices on first run and caches the results process-wide for subsequent calls.
     const Devices& getDevicesForType(V4L2Device::Type type);
 
     // Return device node path for device of |type| supporting |pixFmt|, or an empty string if the
-    // given combination is not supported by the system.
-    std::string getDevicePathFor(V4L2Device::Type type, uint32_t pixFmt);
+    // given combination is not supported by the system. If multiple devices match, the device with
+    // the fewest sessions is returned and a session is accounted to it until closeDevice().
+    std::string acquireDevicePathFor(V4L2Device::Type type, uint32_t pixFmt);
 
     // Callback that is called upon a queue's destruction, to cleanup its pointer in mQueues.
     void onQueueDestroyed(v4l2_buf_type buf_type);
 
+    // Process-wide cache of the devices available on the system and their capabilities. Device
+    // nodes and their capabilities don't change while the process is running, so these are only
+    // queried once.
+    static std::mutex sCapabilitiesLock;
     // Stores information for all devices available on the system for each device Type.
-    std::map<V4L2Device::Type, Devices> mDevicesByType;
+    static std::map<V4L2Device::Type, Devices> sDevicesByType GUARDED_BY(sCapabilitiesLock);
+    // Supported encoder profiles, set after the first query.
+    static std::optional<SupportedEncodeProfiles> sEncodeProfiles GUARDED_BY(sCapabilitiesLock);
+    // Supported decoder profiles, keyed by the list of requested pixel formats.
+    static std::map<std::vector<uint32_t>, SupportedDecodeProfiles> sDecodeProfiles
+            GUARDED_BY(sCapabilitiesLock);
+    // The number of sessions using each device node, used to spread sessions across devices.
+    static std::map<std::string, size_t> sSessionsByDevicePath GUARDED_BY(sCapabilitiesLock);
 
     // The actual device fd.
     base::ScopedFD mDeviceFd;
+    // The path of the device node opened by open(), accounted in |sSessionsByDevicePath|.
+    std::string mSessionDevicePath;
+    // The fd of the media device |mDeviceFd| belongs to, only opened when media requests are used.
+    base::ScopedFD mMediaFd;
+    // The stats of the ioctls issued on |mDeviceFd|, null unless enabled. Created by open().
+    std::unique_ptr<V4L2IoctlStats> mIoctlStats;
 
     // eventfd fd to signal device poll thread when its poll() should be interrupted.
     base::ScopedFD mDevicePollInterruptFd;
@@ -511,6 +642,10 @@ private:
     // Used if EnablePolling() is called to signal the user that an event happened or a buffer is
     // ready to be dequeued.
     std::unique_ptr<android::V4L2DevicePoller> mDevicePoller;
+    // The number of ScopedPollBatch instances alive, and whether polling was scheduled while any
+    // was alive.
+    size_t mPollBatchDepth = 0;
+    bool mPollBatchPending = false;
 
     SEQUENCE_CHECKER(mClientSequenceChecker);
 };
@@ -6,21 +6,22 @@
 #ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_DEVICE_POLLER_H
 #define ANDROID_V4L2_CODEC2_COMMON_V4L2_DEVICE_POLLER_H
 
-#include <atomic>
+#include <optional>
 
 #include <base/callback_forward.h>
 #include <base/sequence_checker.h>
 #include <base/sequenced_task_runner.h>
-#include <base/synchronization/waitable_event.h>
-#include <base/threading/thread.h>
+
+#include <v4l2_codec2/common/V4L2PollerService.h>
 
 namespace android {
 
 class V4L2Device;
 
 // Allows a client to poll() on a given V4L2Device and be signaled when a buffer is ready to be
-// dequeued or a V4L2 event has been received. Polling is done on a dedicated thread, and
-// notifications are delivered in the form of a callback to the listener's sequence.
+// dequeued or a V4L2 event has been received. Polling is done on the threads of the process-wide
+// V4L2PollerService, and notifications are delivered in the form of a callback to the listener's
+// sequence.
 //
 // All the methods of this class (with the exception of the constructor) must be called from the
 // same sequence.
@@ -34,9 +35,8 @@ public:
     // set if a V4L2 event has been detected.
     using EventCallback = base::RepeatingCallback<void(bool event)>;
 
-    // Create a poller for |device|, using a thread named |threadName|. Notification won't start
-    // until |startPolling()| is called.
-    V4L2DevicePoller(V4L2Device* const device, const std::string& threadName);
+    // Create a poller for |device|. Notification won't start until |startPolling()| is called.
+    explicit V4L2DevicePoller(V4L2Device* const device);
     ~V4L2DevicePoller();
 
     // Starts polling. |mEventCallback| will be posted on the caller's sequence every time an event
@@ -46,41 +46,29 @@ public:
     //
     // If an error occurs during polling, |mErrorCallback| will be posted on the caller's sequence.
     bool startPolling(EventCallback eventCallback, base::RepeatingClosure errorCallback);
-    // Stop polling and stop the thread. The poller won't post any new event to the caller's
-    // sequence after this method has returned.
+    // Stop polling. The poller won't post any new event to the caller's sequence after this method
+    // has returned.
     bool stopPolling();
     // Returns true if currently polling, false otherwise.
     bool isPolling() const;
     // Attempts polling the V4L2 device. This method should be called whenever doing something that
     // may trigger an event of interest (buffer dequeue or V4L2 event), for instance queueing a
-    // buffer. In the absence of a pending event, poll() will return immediately and the service
-    // callback will be posted to the caller's sequence. The client is then responsible for calling
+    // buffer. In the absence of a pending event, the service callback will be posted to the
+    // caller's sequence as soon as the device is ready. The client is then responsible for calling
     // this method again when it is interested in receiving events.
     void schedulePoll();
 
 private:
-    // Perform a poll() on |mDevice| and post either |mEventCallback| or |mErrorCallback| on the
-    // client's sequence when poll() returns.
-    void devicePollTask();
-
     // V4L2 device we are polling.
     V4L2Device* const mDevice;
-    // Thread on which polling is done.
-    base::Thread mPollThread;
-    // Callback to post to the client's sequence when an event occurs.
-    EventCallback mEventCallback;
     // Closure to post to the client's sequence when an error occurs.
     base::RepeatingClosure mErrorCallback;
     // Client sequence's task runner, where closures are posted.
-    scoped_refptr<base::SequencedTaskRunner> mClientTaskTunner;
+    scoped_refptr<base::SequencedTaskRunner> mClientTaskRunner;
 
-    // Since poll() returns immediately if no buffers have been queued, we cannot rely on it to
-    // pause the polling thread until an event occurs. Instead,
-    // the polling thread will wait on this WaitableEvent (signaled by |schedulePoll| before calling
-    // poll(), so we only call it when we are actually waiting for an event.
-    base::WaitableEvent mTriggerPoll;
-    // Set to true when we wish to stop polling, instructing the poller thread to break its loop.
-    std::atomic_bool mStopPolling;
+    // The id of the device's watch on the shared poller service, set while polling. As the watch
+    // is one-shot, no new events are reported until |schedulePoll()| re-arms it.
+    std::optional<V4L2PollerService::WatchId> mWatchId;
 };
 
 }  // namespace android
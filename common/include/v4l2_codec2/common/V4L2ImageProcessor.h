@@ -0,0 +1,80 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_IMAGE_PROCESSOR_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_IMAGE_PROCESSOR_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <base/memory/scoped_refptr.h>
+#include <ui/Size.h>
+
+#include <v4l2_codec2/common/Fourcc.h>
+
+namespace android {
+
+class V4L2Device;
+class V4L2Queue;
+
+// The V4L2ImageProcessor converts frames between pixel formats using a V4L2 mem2mem image
+// processor device (e.g. a hardware scaler or colorspace converter). Both the input and output
+// frames are imported as dmabufs, so the frame data is never accessed by the CPU.
+//
+// Conversion is synchronous: process() queues a single frame and waits for the device to return
+// it. All methods should be called on the same sequence.
+class V4L2ImageProcessor {
+public:
+    // Create an image processor converting frames of |inputSize| in |inputFourcc| format with a
+    // row stride of |inputStride| bytes to frames of |outputSize| in |outputFourcc| format with a
+    // row stride of |outputStride| bytes. The input is scaled to the top-left |outputVisibleSize|
+    // rectangle of the output frames. Returns nullptr if no suitable device is available.
+    static std::unique_ptr<V4L2ImageProcessor> create(Fourcc inputFourcc, uint32_t inputStride,
+                                                      const ui::Size& inputSize,
+                                                      Fourcc outputFourcc, uint32_t outputStride,
+                                                      const ui::Size& outputSize,
+                                                      const ui::Size& outputVisibleSize);
+    ~V4L2ImageProcessor();
+
+    V4L2ImageProcessor(const V4L2ImageProcessor&) = delete;
+    V4L2ImageProcessor& operator=(const V4L2ImageProcessor&) = delete;
+
+    // Convert the frame backed by |inputFds| into the frame backed by |outputFds|. The file
+    // descriptors should remain valid until this function returns.
+    bool process(const std::vector<int>& inputFds, const std::vector<int>& outputFds);
+
+    Fourcc inputFourcc() const { return mInputFourcc; }
+    uint32_t inputStride() const { return mInputStride; }
+
+private:
+    // The time we'll wait for the device to process a single frame.
+    static constexpr int kProcessTimeoutMs = 100;
+
+    V4L2ImageProcessor(Fourcc inputFourcc, uint32_t inputStride);
+
+    // Configure the device queues, allocate buffers and start streaming.
+    bool initialize(const ui::Size& inputSize, Fourcc outputFourcc, uint32_t outputStride,
+                    const ui::Size& outputSize, const ui::Size& outputVisibleSize);
+    // Restrict the frames written by the device to the top-left |visibleSize| rectangle of the
+    // output frames. Fails if the device can't compose to exactly that rectangle.
+    bool setOutputComposeRect(const ui::Size& visibleSize);
+
+    const Fourcc mInputFourcc;
+    const uint32_t mInputStride;
+
+    // The V4L2 image processor device and its queues. The input queue is the device's OUTPUT queue,
+    // the output queue the device's CAPTURE queue.
+    scoped_refptr<V4L2Device> mDevice;
+    scoped_refptr<V4L2Queue> mInputQueue;
+    scoped_refptr<V4L2Queue> mOutputQueue;
+    // The plane sizes of the formats configured on the input and output queues.
+    std::vector<size_t> mInputPlaneSizes;
+    std::vector<size_t> mOutputPlaneSizes;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_IMAGE_PROCESSOR_H
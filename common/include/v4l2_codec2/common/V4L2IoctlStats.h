@@ -0,0 +1,82 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_STATS_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_STATS_H
+
+#include <stdint.h>
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <base/thread_annotations.h>
+
+namespace android {
+
+// The V4L2IoctlStats record the ioctls issued on a V4L2 device session. For each ioctl request
+// (and for polling the device) the number of calls, the number of failed calls and a histogram of
+// the call durations are kept, so driver-side stalls can be located (e.g. using "lshal debug").
+//
+// The stats are only recorded if enabled using the "ro.vendor.v4l2_codec2.ioctl_stats" property.
+// Independently, ioctls taking longer than "ro.vendor.v4l2_codec2.slow_ioctl_ms" are logged.
+//
+// All stats alive in the process are registered, so they can be dumped together using dumpAll().
+// All methods are thread-safe.
+class V4L2IoctlStats {
+public:
+    // The pseudo request used to record the time spent polling the device.
+    static constexpr int kPollRequest = 0;
+
+    // Create the stats of the device session named |name|. Returns nullptr if neither the stats
+    // nor the slow ioctl logging are enabled, in which case ioctls shouldn't be timed at all.
+    static std::unique_ptr<V4L2IoctlStats> Create(std::string name);
+    ~V4L2IoctlStats();
+
+    V4L2IoctlStats(const V4L2IoctlStats&) = delete;
+    V4L2IoctlStats& operator=(const V4L2IoctlStats&) = delete;
+
+    // Record a call of |request| that took |durationUs| and failed if |failed| is set.
+    void record(int request, int64_t durationUs, bool failed);
+
+    // Get a human-readable summary of the recorded calls of each request.
+    std::string dump() const;
+    // Get the summaries of all stats alive in the process.
+    static std::string dumpAll();
+
+private:
+    // The number of histogram buckets. Bucket i counts the calls that took less than 2^i us, and at
+    // least 2^(i-1) us. The last bucket counts all longer calls.
+    static constexpr size_t kNumBuckets = 20;
+
+    struct Request {
+        uint64_t mNumCalls = 0;
+        uint64_t mNumFailures = 0;
+        int64_t mTotalUs = 0;
+        int64_t mMaxUs = 0;
+        std::array<uint64_t, kNumBuckets> mBuckets{};
+    };
+
+    V4L2IoctlStats(std::string name, bool recordStats, int64_t slowThresholdUs);
+
+    // Get an upper bound of the duration of the |percentile| of |request|'s calls, derived from the
+    // histogram.
+    static int64_t getPercentileBoundUs(const Request& request, int percentile);
+
+    const std::string mName;
+    // Whether the stats are recorded, and the duration above which calls are logged (disabled if
+    // zero).
+    const bool mRecordStats;
+    const int64_t mSlowThresholdUs;
+
+    mutable std::mutex mLock;
+    // The stats of each request, keyed by ioctl request code.
+    std::map<int, Request> mRequests GUARDED_BY(mLock);
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_IOCTL_STATS_H
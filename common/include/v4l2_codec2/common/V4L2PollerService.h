@@ -0,0 +1,89 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMMON_V4L2_POLLER_SERVICE_H
+#define ANDROID_V4L2_CODEC2_COMMON_V4L2_POLLER_SERVICE_H
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/sequenced_task_runner.h>
+#include <base/thread_annotations.h>
+#include <base/threading/thread.h>
+
+namespace android {
+
+// Process-wide epoll() based poller, shared by all V4L2 devices. Instead of dedicating a thread to
+// each device, the file descriptors of all devices being polled are multiplexed onto a small set
+// of poll threads. The number of poll threads can be configured using the
+// "ro.vendor.v4l2_codec2.poll_threads" property (default: 1).
+//
+// Each registered file descriptor is watched in one-shot mode: once an event has been reported the
+// watch is disarmed until |armWatch()| is called again. Events are posted directly to the task
+// runner provided when registering the file descriptor.
+//
+// All methods are thread-safe.
+class V4L2PollerService {
+public:
+    // Callback posted when the watched fd is ready. |event| is set if a V4L2 event is pending.
+    using EventCallback = base::RepeatingCallback<void(bool event)>;
+    using WatchId = uint64_t;
+
+    // Get the process-wide poller service instance, creating it on first use.
+    static V4L2PollerService* getInstance();
+
+    // Start watching |fd|. |eventCallback| is posted on |taskRunner| every time the (armed) fd
+    // becomes ready, |errorCallback| is posted if polling failed. The watch is initially armed.
+    // Returns std::nullopt on failure.
+    std::optional<WatchId> addWatch(int fd, scoped_refptr<base::SequencedTaskRunner> taskRunner,
+                                    EventCallback eventCallback,
+                                    base::RepeatingClosure errorCallback);
+    // Re-arm the watch with specified |id| after an event was reported.
+    bool armWatch(WatchId id);
+    // Stop watching the fd associated with |id|. No new callbacks will be posted after this method
+    // has returned.
+    void removeWatch(WatchId id);
+
+private:
+    struct Watch {
+        int mFd;
+        int mEpollFd;
+        scoped_refptr<base::SequencedTaskRunner> mTaskRunner;
+        EventCallback mEventCallback;
+        base::RepeatingClosure mErrorCallback;
+    };
+
+    explicit V4L2PollerService(size_t numThreads);
+    ~V4L2PollerService() = delete;
+
+    V4L2PollerService(const V4L2PollerService&) = delete;
+    V4L2PollerService& operator=(const V4L2PollerService&) = delete;
+
+    // Loop executed on each poll thread, waiting for events on |epollFd|.
+    void pollTask(int epollFd);
+
+    // The epoll instances, one per poll thread.
+    std::vector<base::ScopedFD> mEpollFds;
+    // The threads on which polling is done.
+    std::vector<std::unique_ptr<base::Thread>> mPollThreads;
+
+    std::mutex mLock;
+    // All currently registered watches.
+    std::map<WatchId, Watch> mWatches GUARDED_BY(mLock);
+    // The id that will be assigned to the next watch.
+    WatchId mNextWatchId GUARDED_BY(mLock) = 0;
+    // Index of the epoll instance the next watch will be assigned to, used for load balancing.
+    size_t mNextEpollIndex GUARDED_BY(mLock) = 0;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMMON_V4L2_POLLER_SERVICE_H
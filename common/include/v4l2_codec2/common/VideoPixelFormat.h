@@ -7,7 +7,11 @@
 #ifndef ANDROID_V4L2_CODEC2_COMMON_VIDEO_PIXEL_FORMAT_H
 #define ANDROID_V4L2_CODEC2_COMMON_VIDEO_PIXEL_FORMAT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 
 #include "ui/Size.h"
 
@@ -50,6 +54,67 @@ enum class VideoPixelFormat {
     UNKNOWN,  // Unknown or unspecified format value.
 };
 
+// The maximum number of planes of a VideoPixelFormat.
+constexpr size_t kMaxVideoFramePlanes = 4;
+
+// The static description of a VideoPixelFormat, see getVideoPixelFormatInfo().
+struct VideoPixelFormatInfo {
+    VideoPixelFormat mFormat;
+    const char* mName;
+    // The number of significant bits per channel.
+    uint8_t mBitDepth;
+    uint8_t mNumPlanes;
+    // Whether frames are allocated aligned to multiple-of-two size overall. This ensures that
+    // non-subsampled planes can be addressed by pixel with the same scaling as the subsampled
+    // planes.
+    bool mRequiresEvenSize;
+    // The number of bytes per element of each plane.
+    uint8_t mBytesPerElement[kMaxVideoFramePlanes];
+    // The pixel size of each subsample of each plane, e.g. 2x2 for the U-plane in I420.
+    uint8_t mSampleWidth[kMaxVideoFramePlanes];
+    uint8_t mSampleHeight[kMaxVideoFramePlanes];
+};
+
+// The descriptions of all VideoPixelFormats, indexed by format.
+inline constexpr VideoPixelFormatInfo kVideoPixelFormatInfos[] = {
+        {VideoPixelFormat::I420, "I420", 8, 3, true, {1, 1, 1}, {1, 2, 2}, {1, 2, 2}},
+        {VideoPixelFormat::YV12, "YV12", 8, 3, true, {1, 1, 1}, {1, 2, 2}, {1, 2, 2}},
+        {VideoPixelFormat::I422, "I422", 8, 3, true, {1, 1, 1}, {1, 2, 2}, {1, 1, 1}},
+        {VideoPixelFormat::I420A, "I420A", 8, 4, true, {1, 1, 1, 1}, {1, 2, 2, 1}, {1, 2, 2, 1}},
+        {VideoPixelFormat::I444, "I444", 8, 3, true, {1, 1, 1}, {1, 1, 1}, {1, 1, 1}},
+        {VideoPixelFormat::NV12, "NV12", 8, 2, true, {1, 2}, {1, 2}, {1, 2}},
+        {VideoPixelFormat::NV21, "NV21", 8, 2, true, {1, 2}, {1, 2}, {1, 2}},
+        {VideoPixelFormat::YUY2, "YUY2", 8, 1, true, {2}, {1}, {1}},
+        {VideoPixelFormat::ARGB, "ARGB", 8, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::XRGB, "XRGB", 8, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::RGB24, "RGB24", 8, 1, false, {3}, {1}, {1}},
+        {VideoPixelFormat::MJPEG, "MJPEG", 8, 1, true, {0}, {1}, {1}},
+        {VideoPixelFormat::Y16, "Y16", 16, 1, false, {2}, {1}, {1}},
+        {VideoPixelFormat::ABGR, "ABGR", 8, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::XBGR, "XBGR", 8, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::P016LE, "P016LE", 16, 2, true, {2, 4}, {1, 2}, {1, 2}},
+        {VideoPixelFormat::XR30, "XR30", 10, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::XB30, "XB30", 10, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::BGRA, "BGRA", 8, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::RGBA, "RGBA", 8, 1, false, {4}, {1}, {1}},
+        {VideoPixelFormat::YUV420P9, "YUV420P9", 9, 3, true, {2, 2, 2}, {1, 2, 2}, {1, 2, 2}},
+        {VideoPixelFormat::YUV420P10, "YUV420P10", 10, 3, true, {2, 2, 2}, {1, 2, 2}, {1, 2, 2}},
+        {VideoPixelFormat::YUV422P9, "YUV422P9", 9, 3, true, {2, 2, 2}, {1, 2, 2}, {1, 1, 1}},
+        {VideoPixelFormat::YUV422P10, "YUV422P10", 10, 3, true, {2, 2, 2}, {1, 2, 2}, {1, 1, 1}},
+        {VideoPixelFormat::YUV444P9, "YUV444P9", 9, 3, true, {2, 2, 2}, {1, 1, 1}, {1, 1, 1}},
+        {VideoPixelFormat::YUV444P10, "YUV444P10", 10, 3, true, {2, 2, 2}, {1, 1, 1}, {1, 1, 1}},
+        {VideoPixelFormat::YUV420P12, "YUV420P12", 12, 3, true, {2, 2, 2}, {1, 2, 2}, {1, 2, 2}},
+        {VideoPixelFormat::YUV422P12, "YUV422P12", 12, 3, true, {2, 2, 2}, {1, 2, 2}, {1, 1, 1}},
+        {VideoPixelFormat::YUV444P12, "YUV444P12", 12, 3, true, {2, 2, 2}, {1, 1, 1}, {1, 1, 1}},
+        // Note: VideoPixelFormat::UNKNOWN is used for end-of-stream frame.
+        {VideoPixelFormat::UNKNOWN, "UNKNOWN", 0, 0, false, {}, {}, {}},
+};
+
+// Returns the static description of |format|.
+constexpr const VideoPixelFormatInfo& getVideoPixelFormatInfo(VideoPixelFormat format) {
+    return kVideoPixelFormatInfos[static_cast<size_t>(format)];
+}
+
 // Returns the name of a Format as a string.
 std::string videoPixelFormatToString(VideoPixelFormat format);
 
@@ -86,6 +151,20 @@ bool isValidPlane(VideoPixelFormat format, size_t plane);
 // E.g. 2x2 for the U-plane in I420.
 android::ui::Size SampleSize(VideoPixelFormat format, size_t plane);
 
+// The sizes of the planes of frames of a fixed format and coded size. Computing them once per
+// session avoids looking up the format's description for each plane of each frame.
+struct VideoFramePlaneSizes {
+    VideoFramePlaneSizes() = default;
+    VideoFramePlaneSizes(VideoPixelFormat format, const android::ui::Size& codedSize);
+
+    VideoPixelFormat mFormat = VideoPixelFormat::UNKNOWN;
+    android::ui::Size mCodedSize;
+    // The size in bytes of each plane, see planeSize().
+    std::vector<size_t> mPlaneSizes;
+    // The size in bytes of a tightly packed frame, see allocationSize().
+    size_t mAllocationSize = 0;
+};
+
 }  // namespace android
 
 #endif  // ANDROID_V4L2_CODEC2_COMMON_VIDEO_PIXEL_FORMAT_H
@@ -18,10 +18,13 @@ enum class VideoCodec {
     H264,
     VP8,
     VP9,
+    HEVC,
+    AV1,
 };
 
 constexpr std::initializer_list<VideoCodec> kAllCodecs = {VideoCodec::H264, VideoCodec::VP8,
-                                                          VideoCodec::VP9};
+                                                          VideoCodec::VP9, VideoCodec::HEVC,
+                                                          VideoCodec::AV1};
 
 const char* VideoCodecToString(VideoCodec codec);
 const char* profileToString(C2Config::profile_t profile);
@@ -35,6 +38,10 @@ enum class HalPixelFormat : int32_t {
     YV12 = static_cast<int32_t>(HPixelFormat::YV12),
     // NV12 is not defined at PixelFormat, follow the convention to use fourcc value.
     NV12 = 0x3231564e,
+    // YCBCR_P010 is only defined at PixelFormat 1.1, 10-bit samples in the upper bits of 16 bits.
+    YCBCR_P010 = 0x36,
+    // Qualcomm's vendor format for UBWC compressed NV12, can only be accessed by the hardware.
+    YCBCR_420_SP_VENUS_UBWC = 0x7fa30c06,
 };
 const char* HalPixelFormatToString(HalPixelFormat format);
 
@@ -7,7 +7,9 @@
 
 #include <v4l2_codec2/components/V4L2ComponentFactory.h>
 
+#include <base/bind.h>
 #include <codec2/hidl/1.0/InputBufferManager.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include <v4l2_codec2/common/V4L2ComponentCommon.h>
@@ -38,7 +40,10 @@ std::unique_ptr<V4L2ComponentFactory> V4L2ComponentFactory::create(
 
 V4L2ComponentFactory::V4L2ComponentFactory(const std::string& componentName, bool isEncoder,
                                            std::shared_ptr<C2ReflectorHelper> reflector)
-      : mComponentName(componentName), mIsEncoder(isEncoder), mReflector(std::move(reflector)) {
+      : mComponentName(componentName),
+        mIsEncoder(isEncoder),
+        mReflector(std::move(reflector)),
+        mWarmPoolSize(getWarmPoolSize()) {
     using namespace ::android::hardware::media::c2::V1_0;
     // To minimize IPC, we generally want the codec2 framework to release and
     // recycle input buffers when the corresponding work item is done. However,
@@ -55,6 +60,32 @@ V4L2ComponentFactory::V4L2ComponentFactory(const std::string& componentName, boo
         delayCount = std::max(delayCount, V4L2DecodeInterface::getOutputDelay(c));
     }
     utils::InputBufferManager::setNotificationInterval(delayCount * kMinFrameIntervalNs / 2);
+
+    if (mWarmPoolSize > 0 && mReflector != nullptr) {
+        if (mWarmUpThread.Start()) {
+            mWarmUpThread.task_runner()->PostTask(
+                    FROM_HERE, ::base::BindOnce(&V4L2ComponentFactory::fillWarmPoolTask,
+                                                ::base::Unretained(this)));
+        } else {
+            ALOGW("Failed to start warm-up thread, warm pool disabled");
+        }
+    }
+}
+
+V4L2ComponentFactory::~V4L2ComponentFactory() {
+    ALOGV("%s(%s)", __func__, mComponentName.c_str());
+
+    mWarmUpThread.Stop();
+
+    std::lock_guard<std::mutex> lock(mWarmPoolLock);
+    mWarmPool.clear();
+}
+
+// static
+size_t V4L2ComponentFactory::getWarmPoolSize() {
+    static const int32_t kWarmPoolSize =
+            property_get_int32("ro.vendor.v4l2_codec2.warm_pool_size", 0);
+    return static_cast<size_t>(std::max(kWarmPoolSize, 0));
 }
 
 c2_status_t V4L2ComponentFactory::createComponent(c2_node_id_t id,
@@ -68,11 +99,26 @@ c2_status_t V4L2ComponentFactory::createComponent(c2_node_id_t id,
         return C2_CORRUPTED;
     }
 
-    if (mIsEncoder) {
-        *component = V4L2EncodeComponent::create(mComponentName, id, mReflector, deleter);
-    } else {
-        *component = V4L2DecodeComponent::create(mComponentName, id, mReflector, deleter);
+    // Hand out a pre-created component if available, and refill the pool in the background.
+    // Components in the pool are created with id 0, so other ids are always created on demand.
+    if (id == 0 && mWarmUpThread.IsRunning()) {
+        std::lock_guard<std::mutex> lock(mWarmPoolLock);
+        if (!mWarmPool.empty()) {
+            // If capacity is exhausted creating a new component would be rejected too, keep the
+            // pooled component for a later request.
+            if (!admitComponent(mWarmPool.front())) return C2_NO_MEMORY;
+
+            ALOGV("Using pre-created component from warm pool");
+            *component = std::move(mWarmPool.front());
+            mWarmPool.pop_front();
+            mWarmUpThread.task_runner()->PostTask(
+                    FROM_HERE, ::base::BindOnce(&V4L2ComponentFactory::fillWarmPoolTask,
+                                                ::base::Unretained(this)));
+            return C2_OK;
+        }
     }
+
+    *component = createComponentInstance(id, deleter, false);
     return *component ? C2_OK : C2_NO_MEMORY;
 }
 
@@ -103,4 +149,46 @@ c2_status_t V4L2ComponentFactory::createInterface(
     }
 }
 
+std::shared_ptr<C2Component> V4L2ComponentFactory::createComponentInstance(
+        c2_node_id_t id, ComponentDeleter deleter, bool pooled) {
+    if (mIsEncoder) {
+        return V4L2EncodeComponent::create(mComponentName, id, mReflector, deleter, pooled);
+    } else {
+        return V4L2DecodeComponent::create(mComponentName, id, mReflector, deleter, pooled);
+    }
+}
+
+bool V4L2ComponentFactory::admitComponent(const std::shared_ptr<C2Component>& component) {
+    if (mIsEncoder) {
+        return std::static_pointer_cast<V4L2EncodeComponent>(component)->admit();
+    } else {
+        return std::static_pointer_cast<V4L2DecodeComponent>(component)->admit();
+    }
+}
+
+void V4L2ComponentFactory::fillWarmPoolTask() {
+    ALOG_ASSERT(mWarmUpThread.task_runner()->RunsTasksInCurrentSequence());
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mWarmPoolLock);
+            if (mWarmPool.size() >= mWarmPoolSize) return;
+        }
+
+        // Pooled components don't hold any admission capacity, but already open their device so
+        // starting them is cheap. If creation fails we'll retry when the next component is handed
+        // out.
+        std::shared_ptr<C2Component> component =
+                createComponentInstance(0, std::default_delete<C2Component>(), true);
+        if (!component) {
+            ALOGW("Failed to pre-create %s component", mComponentName.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mWarmPoolLock);
+        mWarmPool.push_back(std::move(component));
+        ALOGV("Warm pool of %s: %zu/%zu", mComponentName.c_str(), mWarmPool.size(), mWarmPoolSize);
+    }
+}
+
 }  // namespace android
@@ -16,11 +16,13 @@
 
 #include <C2.h>
 #include <C2Config.h>
+#include <base/bind.h>
 #include <log/log.h>
 #include <media/stagefright/foundation/MediaDefs.h>
 
 #include <v4l2_codec2/common/V4L2ComponentCommon.h>
 #include <v4l2_codec2/components/V4L2ComponentFactory.h>
+#include <v4l2_codec2/plugin_store/C2CachingGraphicAllocator.h>
 
 namespace android {
 namespace {
@@ -40,9 +42,23 @@ std::string getMediaTypeFromComponentName(const std::string& name) {
         name == V4L2ComponentName::kVP9Encoder) {
         return MEDIA_MIMETYPE_VIDEO_VP9;
     }
+    if (name == V4L2ComponentName::kHEVCDecoder || name == V4L2ComponentName::kHEVCSecureDecoder ||
+        name == V4L2ComponentName::kHEVCEncoder) {
+        return MEDIA_MIMETYPE_VIDEO_HEVC;
+    }
+    if (name == V4L2ComponentName::kAV1Decoder) {
+        return MEDIA_MIMETYPE_VIDEO_AV1;
+    }
     return "";
 }
 
+void onMemoryPressure(bool underPressure) {
+    // Free the allocations kept for the next decoders, they would only be recycled by chance. The
+    // allocations released by decoders while under pressure, e.g. idle decoders, are freed too.
+    C2CachingGraphicAllocator::SetEnabled(!underPressure);
+    if (underPressure) C2CachingGraphicAllocator::Trim();
+}
+
 }  // namespace
 
 // static
@@ -61,17 +77,45 @@ std::shared_ptr<C2ComponentStore> V4L2ComponentStore::Create() {
     return store;
 }
 
-V4L2ComponentStore::V4L2ComponentStore() : mReflector(std::make_shared<C2ReflectorHelper>()) {
+V4L2ComponentStore::V4L2ComponentStore()
+      : mReflector(std::make_shared<C2ReflectorHelper>()),
+        mMemoryPressureObserverId(MemoryPressureMonitor::getInstance()->addObserver(
+                nullptr, ::base::BindRepeating(&onMemoryPressure))) {
     ALOGV("%s()", __func__);
+
+    // If the warm pool is enabled, create the factories upfront so they can start pre-creating
+    // components before the first request arrives. Secure decoders are only created on demand.
+    if (V4L2ComponentFactory::getWarmPoolSize() > 0) {
+        for (const auto& name :
+             {V4L2ComponentName::kH264Encoder, V4L2ComponentName::kH264Decoder,
+              V4L2ComponentName::kVP8Encoder, V4L2ComponentName::kVP8Decoder,
+              V4L2ComponentName::kVP9Encoder, V4L2ComponentName::kVP9Decoder,
+              V4L2ComponentName::kHEVCEncoder, V4L2ComponentName::kHEVCDecoder,
+              V4L2ComponentName::kAV1Decoder}) {
+            GetFactory(name);
+        }
+    }
 }
 
 V4L2ComponentStore::~V4L2ComponentStore() {
     ALOGV("%s()", __func__);
 
+    MemoryPressureMonitor::getInstance()->removeObserver(mMemoryPressureObserverId);
+
     std::lock_guard<std::mutex> lock(mCachedFactoriesLock);
     mCachedFactories.clear();
 }
 
+// static
+void V4L2ComponentStore::trimMemory() {
+    ALOGV("%s()", __func__);
+
+    MemoryPressureMonitor::getInstance()->reportMemoryPressure();
+    // Trim the cache even if the monitor was already under pressure, as the allocations released
+    // since then are still cached.
+    C2CachingGraphicAllocator::Trim();
+}
+
 C2String V4L2ComponentStore::getName() const {
     return "android.componentStore.v4l2";
 }
@@ -121,6 +165,10 @@ std::vector<std::shared_ptr<const C2Component::Traits>> V4L2ComponentStore::list
     ret.push_back(GetTraits(V4L2ComponentName::kVP9Encoder));
     ret.push_back(GetTraits(V4L2ComponentName::kVP9Decoder));
     ret.push_back(GetTraits(V4L2ComponentName::kVP9SecureDecoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kHEVCEncoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kHEVCDecoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kHEVCSecureDecoder));
+    ret.push_back(GetTraits(V4L2ComponentName::kAV1Decoder));
     return ret;
 }
 
@@ -10,13 +10,18 @@
 #include <inttypes.h>
 #include <linux/videodev2.h>
 #include <stdint.h>
+#include <string.h>
 
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <C2.h>
 #include <C2PlatformSupport.h>
 #include <Codec2Mapper.h>
 #include <SimpleC2Interface.h>
+#include <android/hardware/graphics/common/1.0/types.h>
 #include <base/bind.h>
 #include <base/callback_helpers.h>
 #include <base/time/time.h>
@@ -24,23 +29,46 @@
 #include <log/log.h>
 #include <media/stagefright/foundation/ColorUtils.h>
 
+#include <v4l2_codec2/common/AV1Parser.h>
 #include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/HEVCNalParser.h>
+#include <v4l2_codec2/common/MemoryPressureMonitor.h>
 #include <v4l2_codec2/common/NalParser.h>
+#include <v4l2_codec2/common/SessionPriority.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 #include <v4l2_codec2/components/BitstreamBuffer.h>
 #include <v4l2_codec2/components/V4L2Decoder.h>
+#include <v4l2_codec2/components/V4L2StatelessDecoder.h>
 #include <v4l2_codec2/components/VideoFramePool.h>
+#include <v4l2_codec2/components/WorkRecorder.h>
 #include <v4l2_codec2/plugin_store/C2VdaBqBlockPool.h>
+#include <v4l2_codec2/plugin_store/C2VdaPooledBlockPool.h>
+#include <v4l2_codec2/plugin_store/V4L2AllocatorId.h>
+
+using android::hardware::graphics::common::V1_0::BufferUsage;
 
 namespace android {
 namespace {
 
+// The maximum number of finished works reported to the listener in a single call.
+constexpr size_t kMaxBatchedWorks = 8;
+
+// The maximum size of the bitstream kept to re-prime the decoder after it was released while idle.
+// Streams with larger GOPs aren't released.
+constexpr size_t kMaxReprimeBitstreamSize = 16 * 1024 * 1024;
+
+// The time without input after which decoders are released under memory pressure, e.g. paused
+// sessions. Shorter than the idle release delay, as long as it's longer than a frame interval.
+constexpr int64_t kMinIdleTimeUnderPressureMs = 1000;
+
 // CCBC pauses sending input buffers to the component when all the output slots are filled by
 // pending decoded buffers. If the available output buffers are exhausted before CCBC pauses sending
 // input buffers, CCodec may timeout due to waiting for a available output buffer.
 // This function returns the minimum number of output buffers to prevent the buffers from being
-// exhausted before CCBC pauses sending input buffers.
-size_t getMinNumOutputBuffers(VideoCodec codec) {
+// exhausted before CCBC pauses sending input buffers. In |lowLatency| mode frames are not reordered,
+// so no buffers need to be reserved for the output delay. Buffers are only held by the display
+// when decoding to a |surface|, in byte buffer mode the client's output slots are the last stage.
+size_t getMinNumOutputBuffers(VideoCodec codec, bool lowLatency, bool surface) {
     // The constant values copied from CCodecBufferChannel.cpp.
     // (b/184020290): Check the value still sync when seeing error message from CCodec:
     // "previous call to queue exceeded timeout".
@@ -51,10 +79,11 @@ size_t getMinNumOutputBuffers(VideoCodec codec) {
 
     // The total needed number of output buffers at pipeline are:
     // - MediaCodec output slots: output delay + kSmoothnessFactor
-    // - Surface: kRenderingDepth
+    // - Surface: kRenderingDepth, only when decoding to a surface
     // - Component: kExtraNumOutputBuffersForDecoder
-    return V4L2DecodeInterface::getOutputDelay(codec) + kSmoothnessFactor + kRenderingDepth +
-           kExtraNumOutputBuffersForDecoder;
+    const size_t outputDelay = lowLatency ? 0 : V4L2DecodeInterface::getOutputDelay(codec);
+    const size_t renderingDepth = surface ? kRenderingDepth : 0;
+    return outputDelay + kSmoothnessFactor + renderingDepth + kExtraNumOutputBuffersForDecoder;
 }
 
 // Mask against 30 bits to avoid (undefined) wraparound on signed integer.
@@ -62,21 +91,55 @@ int32_t frameIndexToBitstreamId(c2_cntr64_t frameIndex) {
     return static_cast<int32_t>(frameIndex.peeku() & 0x3FFFFFFF);
 }
 
-bool parseCodedColorAspects(const C2ConstLinearBlock& input,
-                            C2StreamColorAspectsInfo::input* codedAspects) {
-    C2ReadView view = input.map().get();
-    NalParser parser(view.data(), view.capacity());
+// Find the color aspects in the SPS (H.264 and HEVC) or sequence header (AV1) in |data|.
+bool findCodedColorAspects(const uint8_t* data, size_t size, VideoCodec codec,
+                           NalParser::ColorAspects* aspects) {
+    if (codec == VideoCodec::AV1) {
+        AV1SequenceHeader header;
+        if (!parseAV1SequenceHeader(data, size, &header)) {
+            ALOGV("Couldn't find sequence header");
+            return false;
+        }
+        // Film grain is synthesized by the device as part of producing the displayed frames, the
+        // decoded frames used for reference are never output.
+        ALOGI_IF(header.filmGrainParamsPresent, "AV1 stream signals film grain parameters");
+        if (!header.colorDescriptionPresentFlag) {
+            ALOGV("Couldn't find color description in sequence header");
+            return false;
+        }
+        aspects->primaries = header.colorPrimaries;
+        aspects->transfer = header.transferCharacteristics;
+        aspects->coeffs = header.matrixCoefficients;
+        aspects->fullRange = header.colorRange;
+        return true;
+    }
+
+    std::unique_ptr<NalParser> parser;
+    if (codec == VideoCodec::HEVC) {
+        parser = std::make_unique<HEVCNalParser>(data, size);
+    } else {
+        parser = std::make_unique<NalParser>(data, size);
+    }
 
-    if (!parser.locateSPS()) {
+    if (!parser->locateSPS()) {
         ALOGV("Couldn't find SPS");
         return false;
     }
 
-    NalParser::ColorAspects aspects;
-    if (!parser.findCodedColorAspects(&aspects)) {
+    if (!parser->findCodedColorAspects(aspects)) {
         ALOGV("Couldn't find color description in SPS");
         return false;
     }
+    return true;
+}
+
+bool parseCodedColorAspects(const C2ConstLinearBlock& input, VideoCodec codec,
+                            C2StreamColorAspectsInfo::input* codedAspects) {
+    C2ReadView view = input.map().get();
+    NalParser::ColorAspects aspects;
+    if (!findCodedColorAspects(view.data(), view.capacity(), codec, &aspects)) {
+        return false;
+    }
 
     // Convert ISO color aspects to ColorUtils::ColorAspects.
     ColorAspects colorAspects;
@@ -102,6 +165,51 @@ bool parseCodedColorAspects(const C2ConstLinearBlock& input,
     return true;
 }
 
+// Check whether |data| contains a key frame, which can be decoded without reference frames.
+// Returns true if the frame type can't be determined, so the frame is decoded.
+bool isKeyFrame(const uint8_t* data, size_t size, VideoCodec codec) {
+    switch (codec) {
+    case VideoCodec::H264: {
+        NalParser parser(data, size);
+        while (parser.locateNextNal()) {
+            if (parser.length() > 0 && parser.type() == NalParser::kIDRType) return true;
+        }
+        return false;
+    }
+    case VideoCodec::HEVC: {
+        // Intra random access point (IRAP) pictures use NAL unit types 16 to 23.
+        constexpr uint8_t kFirstIRAPType = 16;
+        constexpr uint8_t kLastIRAPType = 23;
+        HEVCNalParser parser(data, size);
+        while (parser.locateNextNal()) {
+            if (parser.length() == 0) continue;
+            const uint8_t type = parser.type();
+            if (type >= kFirstIRAPType && type <= kLastIRAPType) return true;
+        }
+        return false;
+    }
+    case VideoCodec::VP8:
+        // The frame type is the first bit of the frame tag, zero for key frames (RFC 6386 9.1).
+        return size == 0 || (data[0] & 0x01) == 0;
+    case VideoCodec::VP9: {
+        // Parse the start of the uncompressed header (VP9 specification section 6.2). Superframes
+        // start with the frame that is decoded first.
+        if (size == 0) return true;
+        const uint8_t header = data[0];
+        if ((header >> 6) != 0x2) return true;  // Invalid frame marker.
+        const uint8_t profile = ((header >> 5) & 0x1) | (((header >> 4) & 0x1) << 1);
+        int bit = profile == 3 ? 2 : 3;  // Skip the reserved bit for profile 3.
+        const bool showExistingFrame = (header >> bit) & 0x1;
+        if (showExistingFrame) return false;
+        bit--;
+        return ((header >> bit) & 0x1) == 0;
+    }
+    case VideoCodec::AV1:
+        // Detecting AV1 key frames requires parsing the frame header using the sequence header.
+        return true;
+    }
+}
+
 bool isWorkDone(const C2Work& work) {
     const int32_t bitstreamId = frameIndexToBitstreamId(work.input.ordinal.frameIndex);
 
@@ -138,42 +246,52 @@ bool isNoShowFrameWork(const C2Work& work, const C2WorkOrdinalStruct& currOrdina
 
 }  // namespace
 
-// static
-std::atomic<int32_t> V4L2DecodeComponent::sConcurrentInstances = 0;
-
 // static
 std::shared_ptr<C2Component> V4L2DecodeComponent::create(
         const std::string& name, c2_node_id_t id, const std::shared_ptr<C2ReflectorHelper>& helper,
-        C2ComponentFactory::ComponentDeleter deleter) {
-    static const int32_t kMaxConcurrentInstances =
-            property_get_int32("ro.vendor.v4l2_codec2.decode_concurrent_instances", -1);
-    static std::mutex mutex;
-
-    std::lock_guard<std::mutex> lock(mutex);
-
-    if (kMaxConcurrentInstances >= 0 && sConcurrentInstances.load() >= kMaxConcurrentInstances) {
-        ALOGW("Reject to Initialize() due to too many instances: %d", sConcurrentInstances.load());
-        return nullptr;
-    }
-
+        C2ComponentFactory::ComponentDeleter deleter, bool pooled) {
     auto intfImpl = std::make_shared<V4L2DecodeInterface>(name, helper);
     if (intfImpl->status() != C2_OK) {
         ALOGE("Failed to initialize V4L2DecodeInterface.");
         return nullptr;
     }
 
-    return std::shared_ptr<C2Component>(new V4L2DecodeComponent(name, id, helper, intfImpl),
-                                        deleter);
+    // Pooled components don't reserve any capacity, so idle instances can't cause real sessions to
+    // be rejected.
+    std::unique_ptr<V4L2AdmissionController::Session> admissionSession;
+    if (!pooled) {
+        admissionSession = V4L2AdmissionController::getInstance()->createSession(
+                V4L2Device::Type::kDecoder, *intfImpl->getVideoCodec());
+        if (!admissionSession) {
+            ALOGW("Reject to Initialize() due to insufficient hardware capacity");
+            return nullptr;
+        }
+    }
+
+    auto component = std::shared_ptr<V4L2DecodeComponent>(
+            new V4L2DecodeComponent(name, id, helper, intfImpl, std::move(admissionSession)),
+            deleter);
+    if (pooled) {
+        // Opening the device is the most expensive part of starting the decoder, as it probes the
+        // device nodes. If this fails the decoder will simply try again when started.
+        const std::optional<VideoCodec> codec = intfImpl->getVideoCodec();
+        if (codec) component->mPrewarmedDevice = V4L2Decoder::OpenDevice(*codec);
+    }
+    return component;
 }
 
-V4L2DecodeComponent::V4L2DecodeComponent(const std::string& name, c2_node_id_t id,
-                                         const std::shared_ptr<C2ReflectorHelper>& helper,
-                                         const std::shared_ptr<V4L2DecodeInterface>& intfImpl)
-      : mIntfImpl(intfImpl),
-        mIntf(std::make_shared<SimpleInterface<V4L2DecodeInterface>>(name.c_str(), id, mIntfImpl)) {
+V4L2DecodeComponent::V4L2DecodeComponent(
+        const std::string& name, c2_node_id_t id, const std::shared_ptr<C2ReflectorHelper>& helper,
+        const std::shared_ptr<V4L2DecodeInterface>& intfImpl,
+        std::unique_ptr<V4L2AdmissionController::Session> admissionSession)
+      : mAdmissionSession(std::move(admissionSession)),
+        mIntfImpl(intfImpl),
+        mIntf(std::make_shared<SimpleInterface<V4L2DecodeInterface>>(name.c_str(), id, mIntfImpl)),
+        mLatencyTracker(std::make_shared<LatencyTracker>(name + ":" + std::to_string(id))),
+        mMemoryTracker(std::make_shared<MemoryTracker>(name + ":" + std::to_string(id))),
+        mRecorder(WorkRecorder::Create(name, id)) {
     ALOGV("%s(%s)", __func__, name.c_str());
 
-    sConcurrentInstances.fetch_add(1, std::memory_order_relaxed);
     mIsSecure = name.find(".secure") != std::string::npos;
 }
 
@@ -182,10 +300,22 @@ V4L2DecodeComponent::~V4L2DecodeComponent() {
 
     release();
 
-    sConcurrentInstances.fetch_sub(1, std::memory_order_relaxed);
     ALOGV("%s() done", __func__);
 }
 
+bool V4L2DecodeComponent::admit() {
+    ALOGV("%s()", __func__);
+
+    if (mAdmissionSession) return true;
+    mAdmissionSession = V4L2AdmissionController::getInstance()->createSession(
+            V4L2Device::Type::kDecoder, *mIntfImpl->getVideoCodec());
+    if (!mAdmissionSession) {
+        ALOGW("Reject to admit pooled component due to insufficient hardware capacity");
+        return false;
+    }
+    return true;
+}
+
 c2_status_t V4L2DecodeComponent::start() {
     ALOGV("%s()", __func__);
     std::lock_guard<std::mutex> lock(mStartStopLock);
@@ -196,13 +326,24 @@ c2_status_t V4L2DecodeComponent::start() {
         return C2_BAD_STATE;
     }
 
+    // Reserve the hardware capacity needed to decode the video at the requested framerate.
+    const ui::Size videoSize = mIntfImpl->getVideoSize();
+    if (!mAdmissionSession->setLoad(
+                V4L2AdmissionController::getLoad(videoSize, mIntfImpl->getFramerate()))) {
+        ALOGE("Insufficient hardware capacity to decode %dx%d", videoSize.width, videoSize.height);
+        return C2_NO_MEMORY;
+    }
+
     if (!mDecoderThread.Start()) {
         ALOGE("Decoder thread failed to start.");
+        mAdmissionSession->setLoad(0);
         return C2_CORRUPTED;
     }
     mDecoderTaskRunner = mDecoderThread.task_runner();
     mWeakThis = mWeakThisFactory.GetWeakPtr();
+    if (mRecorder) mRecorder->recordStart(*mIntf);
 
+    mAsyncStart = property_get_bool("ro.vendor.v4l2_codec2.async_start", false);
     c2_status_t status = C2_CORRUPTED;
     ::base::WaitableEvent done;
     mDecoderTaskRunner->PostTask(
@@ -210,7 +351,19 @@ c2_status_t V4L2DecodeComponent::start() {
                                         ::base::Unretained(&status), ::base::Unretained(&done)));
     done.Wait();
 
-    if (status == C2_OK) mComponentState.store(ComponentState::RUNNING);
+    if (status == C2_OK) {
+        mComponentState.store(ComponentState::RUNNING);
+        // When starting asynchronously the decoder is created in a separate task, so the device is
+        // opened while the client finishes its own setup. Work queued in the meantime is handled
+        // once the decoder is created.
+        if (mAsyncStart) {
+            mDecoderTaskRunner->PostTask(FROM_HERE,
+                                         ::base::BindOnce(&V4L2DecodeComponent::createDecoderTask,
+                                                          mWeakThis));
+        }
+    } else {
+        mAdmissionSession->setLoad(0);
+    }
     return status;
 }
 
@@ -227,36 +380,111 @@ void V4L2DecodeComponent::startTask(c2_status_t* status, ::base::WaitableEvent*
         ALOGE("Failed to get video codec.");
         return;
     }
-    const size_t inputBufferSize = mIntfImpl->getInputBufferSize();
-    const size_t minNumOutputBuffers = getMinNumOutputBuffers(*codec);
-
-    // ::base::Unretained(this) is safe here because |mDecoder| is always destroyed before
-    // |mDecoderThread| is stopped, so |*this| is always valid during |mDecoder|'s lifetime.
-    mDecoder = V4L2Decoder::Create(*codec, inputBufferSize, minNumOutputBuffers,
-                                   ::base::BindRepeating(&V4L2DecodeComponent::getVideoFramePool,
-                                                         ::base::Unretained(this)),
-                                   ::base::BindRepeating(&V4L2DecodeComponent::onOutputFrameReady,
-                                                         ::base::Unretained(this)),
-                                   ::base::BindRepeating(&V4L2DecodeComponent::reportError,
-                                                         ::base::Unretained(this), C2_CORRUPTED),
-                                   mDecoderTaskRunner);
-    if (!mDecoder) {
-        ALOGE("Failed to create V4L2Decoder for %s", VideoCodecToString(*codec));
-        return;
+    mLowLatencyMode = mIntfImpl->isLowLatencyMode();
+
+    // The decoder and the device poller callbacks all run on the decoder thread, so its priority
+    // determines how well the session keeps up under CPU contention.
+    SessionPriority priority = SessionPriority::REALTIME;
+    if (!mIntfImpl->isRealTimePriority()) {
+        priority = SessionPriority::BACKGROUND;
+    } else if (mIntfImpl->isKeyFrameOnlyMode()) {
+        priority = SessionPriority::THUMBNAIL;
+    }
+    setCurrentThreadPriority(priority);
+
+    // Releasing idle decoders requires re-priming the decoder from the last key frame, which isn't
+    // possible for secure buffers and AV1, whose key frames can't be detected.
+    mIdleReleaseDelay = ::base::TimeDelta();
+    if (!mIsSecure && *codec != VideoCodec::AV1) {
+        mIdleReleaseDelay = ::base::TimeDelta::FromMilliseconds(
+                std::max(property_get_int32("ro.vendor.v4l2_codec2.idle_release_ms", 0), 0));
     }
+    mIdleReleaseScheduled = false;
+    clearReprimeBitstream();
+    mDecodeErrorResilience =
+            property_get_bool("ro.vendor.v4l2_codec2.decode_error_resilience", false);
+    mResyncScheduled = false;
+    mWaitingForKeyFrame = false;
+    // Under memory pressure idle decoders are released without waiting for the idle release delay.
+    if (!mIdleReleaseDelay.is_zero() && !mMemoryPressureObserverId) {
+        mMemoryPressureObserverId = MemoryPressureMonitor::getInstance()->addObserver(
+                mDecoderTaskRunner,
+                ::base::BindRepeating(&V4L2DecodeComponent::onMemoryPressure, mWeakThis));
+    }
+
+    // When starting asynchronously the decoder is created once start() returned.
+    if (!mAsyncStart && !createDecoder()) return;
 
     // Get default color aspects on start.
-    if (!mIsSecure && *codec == VideoCodec::H264) {
+    if (!mIsSecure && (*codec == VideoCodec::H264 || *codec == VideoCodec::HEVC ||
+                       *codec == VideoCodec::AV1)) {
         if (mIntfImpl->queryColorAspects(&mCurrentColorAspects) != C2_OK) return;
         mPendingColorAspectsChange = false;
     }
+    // Get the HDR static metadata configured by the client, which is attached to all outputs.
+    if (mIntfImpl->queryHdrStaticInfo(&mHdrStaticInfo) != C2_OK) return;
 
     *status = C2_OK;
 }
 
+void V4L2DecodeComponent::createDecoderTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The decoder might already have been created by the first work queued.
+    if (mDecoder || mComponentState.load() != ComponentState::RUNNING) return;
+    if (!createDecoder()) {
+        ALOGE("Failed to create the decoder");
+        reportError(C2_CORRUPTED);
+    }
+}
+
+bool V4L2DecodeComponent::createDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(!mDecoder);
+
+    const VideoCodec codec = *mIntfImpl->getVideoCodec();
+    const size_t inputBufferSize = mIntfImpl->getInputBufferSize();
+
+    // ::base::Unretained(this) is safe here because |mDecoder| is always destroyed before
+    // |mDecoderThread| is stopped, so |*this| is always valid during |mDecoder|'s lifetime.
+    const auto getPoolCb = ::base::BindRepeating(&V4L2DecodeComponent::getVideoFramePool,
+                                                 ::base::Unretained(this));
+    const auto isCompressedOutputAllowedCb = ::base::BindRepeating(
+            &V4L2DecodeComponent::isCompressedOutputAllowed, ::base::Unretained(this));
+    const auto outputCb = ::base::BindRepeating(&V4L2DecodeComponent::onOutputFrameReady,
+                                                ::base::Unretained(this));
+    const auto errorCb = ::base::BindRepeating(&V4L2DecodeComponent::reportError,
+                                               ::base::Unretained(this), C2_CORRUPTED);
+    mDecoder = V4L2Decoder::Create(codec, inputBufferSize, mLowLatencyMode,
+                                   mIntfImpl->getScaledOutputSize(), getPoolCb,
+                                   isCompressedOutputAllowedCb, outputCb, errorCb,
+                                   mDecoderTaskRunner, std::move(mPrewarmedDevice));
+    // Devices only implementing the stateless API need the bitstream to be parsed in userspace,
+    // which isn't possible for secure buffers.
+    if (!mDecoder && !mIsSecure && codec == VideoCodec::H264) {
+        ALOGI("No stateful decoder for %s, trying the stateless decoder",
+              VideoCodecToString(codec));
+        mDecoder = V4L2StatelessDecoder::Create(codec, inputBufferSize, mLowLatencyMode,
+                                                getPoolCb, outputCb, errorCb, mDecoderTaskRunner);
+    }
+    if (!mDecoder) {
+        ALOGE("Failed to create V4L2Decoder for %s", VideoCodecToString(codec));
+        return false;
+    }
+    mDecoder->setLatencyTracker(mLatencyTracker);
+    mDecoder->setMemoryTracker(mMemoryTracker);
+    if (mDecodeErrorResilience) {
+        mDecoder->setCorruptionCallback(::base::BindRepeating(
+                &V4L2DecodeComponent::onDecoderCorrupted, ::base::Unretained(this)));
+    }
+    return true;
+}
+
 std::unique_ptr<VideoFramePool> V4L2DecodeComponent::getVideoFramePool(const ui::Size& size,
                                                                        HalPixelFormat pixelFormat,
-                                                                       size_t numBuffers) {
+                                                                       size_t* numBuffers) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
@@ -275,6 +503,14 @@ std::unique_ptr<VideoFramePool> V4L2DecodeComponent::getVideoFramePool(const ui:
         return nullptr;
     }
 
+    // The pool is requested whenever the decoder detects a (new) resolution, update the reserved
+    // hardware capacity accordingly. The session keeps running if the capacity is exceeded, as the
+    // stream resolution isn't under our control.
+    if (!mAdmissionSession->setLoad(
+                V4L2AdmissionController::getLoad(size, mIntfImpl->getFramerate()))) {
+        ALOGW("Insufficient hardware capacity to decode %dx%d", size.width, size.height);
+    }
+
     // Get block pool ID configured from the client.
     auto poolId = mIntfImpl->getBlockPoolId();
     ALOGI("Using C2BlockPool ID = %" PRIu64 " for allocating output buffers", poolId);
@@ -286,8 +522,63 @@ std::unique_ptr<VideoFramePool> V4L2DecodeComponent::getVideoFramePool(const ui:
         return nullptr;
     }
 
-    return VideoFramePool::Create(std::move(blockPool), numBuffers, size, pixelFormat, mIsSecure,
-                                  mDecoderTaskRunner);
+    // The pooled block pool is used in byte buffer mode, any other pool outputs to a surface.
+    const bool surface = blockPool->getAllocatorId() != V4L2AllocatorId::V4L2_BUFFERPOOL;
+    if (!surface) {
+        mPooledBlockPool = std::static_pointer_cast<C2VdaPooledBlockPool>(blockPool);
+    } else {
+        mPooledBlockPool.reset();
+    }
+
+    const size_t minNumBuffers =
+            getMinNumOutputBuffers(*mIntfImpl->getVideoCodec(), mLowLatencyMode, surface);
+    *numBuffers = std::max(*numBuffers, minNumBuffers);
+    ALOGI("Using %zu output buffers (%s mode)", *numBuffers, surface ? "surface" : "byte buffer");
+
+    // Notify the client when the output switches between 8-bit and 10-bit frames. Compressed
+    // formats are opaque to the client, which only needs to know the bit depth.
+    const uint32_t outputPixelFormat = pixelFormat == HalPixelFormat::YCBCR_P010
+                                               ? HAL_PIXEL_FORMAT_YCBCR_P010
+                                               : HAL_PIXEL_FORMAT_YCBCR_420_888;
+    if (outputPixelFormat != mIntfImpl->getPixelFormat()) {
+        auto pixelFormatInfo =
+                std::make_unique<C2StreamPixelFormatInfo::output>(0u, outputPixelFormat);
+        std::vector<std::unique_ptr<C2SettingResult>> failures;
+        status = mIntfImpl->config({pixelFormatInfo.get()}, C2_MAY_BLOCK, &failures);
+        if (status != C2_OK) {
+            ALOGE("Failed to config pixel format to interface: %d", status);
+            reportError(status);
+            return nullptr;
+        }
+        mPendingPixelFormatUpdate = std::move(pixelFormatInfo);
+    }
+
+    return VideoFramePool::Create(std::move(blockPool), *numBuffers, size, pixelFormat, mIsSecure,
+                                  mDecoderTaskRunner, mMemoryTracker);
+}
+
+bool V4L2DecodeComponent::isCompressedOutputAllowed() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    auto sharedThis = weak_from_this().lock();
+    if (sharedThis == nullptr) return false;
+
+    std::shared_ptr<C2BlockPool> blockPool;
+    const auto poolId = mIntfImpl->getBlockPoolId();
+    auto status = GetCodec2BlockPool(poolId, std::move(sharedThis), &blockPool);
+    if (status != C2_OK || blockPool->getAllocatorId() != C2PlatformAllocatorStore::BUFFERQUEUE) {
+        return false;
+    }
+
+    const std::optional<uint64_t> consumerUsage =
+            static_cast<C2VdaBqBlockPool*>(blockPool.get())->getConsumerUsage();
+    if (!consumerUsage) return false;
+
+    constexpr uint64_t kCpuUsageMask = static_cast<uint64_t>(BufferUsage::CPU_READ_MASK) |
+                                       static_cast<uint64_t>(BufferUsage::CPU_WRITE_MASK);
+    ALOGV("Consumer usage: 0x%" PRIx64, *consumerUsage);
+    return (*consumerUsage & kCpuUsageMask) == 0;
 }
 
 c2_status_t V4L2DecodeComponent::stop() {
@@ -307,6 +598,8 @@ c2_status_t V4L2DecodeComponent::stop() {
         mDecoderTaskRunner = nullptr;
     }
 
+    mAdmissionSession->setLoad(0);
+    if (mRecorder) mRecorder->recordStop();
     mComponentState.store(ComponentState::STOPPED);
     return C2_OK;
 }
@@ -318,6 +611,9 @@ void V4L2DecodeComponent::stopTask() {
     reportAbandonedWorks();
     mIsDraining = false;
 
+    ALOGI("Decode latency: %s", mLatencyTracker->dump().c_str());
+    mLatencyTracker->clear();
+
     releaseTask();
 }
 
@@ -338,6 +634,7 @@ c2_status_t V4L2DecodeComponent::release() {
         mDecoderTaskRunner = nullptr;
     }
 
+    mAdmissionSession->setLoad(0);
     mComponentState.store(ComponentState::RELEASED);
     return C2_OK;
 }
@@ -348,6 +645,10 @@ void V4L2DecodeComponent::releaseTask() {
 
     mWeakThisFactory.InvalidateWeakPtrs();
     mDecoder = nullptr;
+    if (mMemoryPressureObserverId) {
+        MemoryPressureMonitor::getInstance()->removeObserver(*mMemoryPressureObserverId);
+        mMemoryPressureObserverId.reset();
+    }
 }
 
 c2_status_t V4L2DecodeComponent::setListener_vb(
@@ -384,6 +685,7 @@ void V4L2DecodeComponent::setListenerTask(const std::shared_ptr<Listener>& liste
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
+    flushFinishedWorks();
     mListener = listener;
     done->Signal();
 }
@@ -397,6 +699,10 @@ c2_status_t V4L2DecodeComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* co
         return C2_BAD_STATE;
     }
 
+    if (mRecorder) {
+        for (const std::unique_ptr<C2Work>& work : *items) mRecorder->recordWork(*work);
+    }
+
     while (!items->empty()) {
         mDecoderTaskRunner->PostTask(FROM_HERE,
                                      ::base::BindOnce(&V4L2DecodeComponent::queueTask, mWeakThis,
@@ -419,6 +725,8 @@ void V4L2DecodeComponent::queueTask(std::unique_ptr<C2Work> work) {
         return;
     }
 
+    mLatencyTracker->mark(frameIndexToBitstreamId(work->input.ordinal.frameIndex), "queue");
+
     work->worklets.front()->output.flags = static_cast<C2FrameData::flags_t>(0);
     work->worklets.front()->output.buffers.clear();
     work->worklets.front()->output.ordinal = work->input.ordinal;
@@ -438,9 +746,176 @@ void V4L2DecodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     }
 
     mPendingWorks.push(std::move(work));
+    mLastInputTime = ::base::TimeTicks::Now();
+    scheduleIdleRelease(mIdleReleaseDelay);
     pumpPendingWorks();
 }
 
+void V4L2DecodeComponent::scheduleIdleRelease(::base::TimeDelta delay) {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mIdleReleaseDelay.is_zero() || mIdleReleaseScheduled) return;
+
+    mDecoderTaskRunner->PostDelayedTask(
+            FROM_HERE, ::base::BindOnce(&V4L2DecodeComponent::idleReleaseTask, mWeakThis), delay);
+    mIdleReleaseScheduled = true;
+}
+
+void V4L2DecodeComponent::idleReleaseTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mIdleReleaseScheduled = false;
+    if (!mDecoder || mComponentState.load() != ComponentState::RUNNING) return;
+
+    // Input was queued since the task was scheduled, wait until the session was idle long enough.
+    const ::base::TimeDelta idleTime = ::base::TimeTicks::Now() - mLastInputTime;
+    if (idleTime < mIdleReleaseDelay) {
+        scheduleIdleRelease(mIdleReleaseDelay - idleTime);
+        return;
+    }
+
+    if (releaseIdleDecoder()) {
+        ALOGI("Released the decoder after %" PRId64 "ms without input", idleTime.InMilliseconds());
+    }
+}
+
+void V4L2DecodeComponent::onMemoryPressure(bool underPressure) {
+    ALOGV("%s(%d)", __func__, underPressure);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!underPressure || !mDecoder || mComponentState.load() != ComponentState::RUNNING) return;
+
+    // Sessions still decoding only go without input between two frames, don't release them.
+    const ::base::TimeDelta idleTime = ::base::TimeTicks::Now() - mLastInputTime;
+    if (idleTime < ::base::TimeDelta::FromMilliseconds(kMinIdleTimeUnderPressureMs)) return;
+
+    if (releaseIdleDecoder()) {
+        ALOGI("Released the decoder under memory pressure after %" PRId64 "ms without input",
+              idleTime.InMilliseconds());
+    }
+}
+
+bool V4L2DecodeComponent::releaseIdleDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // Works still held by the decoder (e.g. frames waiting to be reordered) would be lost, the
+    // release is reconsidered once input is queued again.
+    if (!mPendingWorks.empty() || !mWorksAtDecoder.empty() || mIsDraining) return false;
+    if (!mReprimeFromKeyFrame) {
+        ALOGV("%s(): can't re-prime the decoder, keeping it.", __func__);
+        return false;
+    }
+
+    mDecoder = nullptr;
+    mAdmissionSession->setLoad(0);
+    return true;
+}
+
+bool V4L2DecodeComponent::resumeIdleDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    const ui::Size videoSize = mIntfImpl->getVideoSize();
+    if (!mAdmissionSession->setLoad(
+                V4L2AdmissionController::getLoad(videoSize, mIntfImpl->getFramerate()))) {
+        ALOGE("Insufficient hardware capacity to resume decoding %dx%d", videoSize.width,
+              videoSize.height);
+        return false;
+    }
+    if (!createDecoder()) return false;
+
+    auto sharedThis = weak_from_this().lock();
+    std::shared_ptr<C2BlockPool> blockPool;
+    if (!sharedThis ||
+        GetCodec2BlockPool(C2BlockPool::BASIC_LINEAR, std::move(sharedThis), &blockPool) != C2_OK) {
+        ALOGE("Failed to get the linear block pool.");
+        return false;
+    }
+
+    // Decode the codec config and the frames since the last key frame again, so the decoder has
+    // the same reference frames as before it was released. Their output frames are dropped.
+    ALOGI("Re-priming the decoder with %zu buffers", mReprimeBitstream.size());
+    const C2MemoryUsage usage = {C2MemoryUsage::CPU_READ, C2MemoryUsage::CPU_WRITE};
+    for (const std::vector<uint8_t>& data : mReprimeBitstream) {
+        std::shared_ptr<C2LinearBlock> block;
+        if (blockPool->fetchLinearBlock(data.size(), usage, &block) != C2_OK) {
+            ALOGE("Failed to fetch a linear block.");
+            return false;
+        }
+        C2WriteView view = block->map().get();
+        if (view.error() != C2_OK) {
+            ALOGE("Failed to map the linear block.");
+            return false;
+        }
+        memcpy(view.data(), data.data(), data.size());
+
+        const int32_t bitstreamId = mNextReprimeBitstreamId;
+        mNextReprimeBitstreamId = (mNextReprimeBitstreamId == INT32_MAX)
+                                          ? kFirstReprimeBitstreamId
+                                          : mNextReprimeBitstreamId + 1;
+        C2ConstLinearBlock constBlock = block->share(0, data.size(), C2Fence());
+        mDecoder->decode(std::make_unique<ConstBitstreamBuffer>(bitstreamId, constBlock, 0,
+                                                                data.size()),
+                         ::base::BindOnce(&V4L2DecodeComponent::onReprimeDecodeDone, mWeakThis));
+    }
+    return true;
+}
+
+void V4L2DecodeComponent::onReprimeDecodeDone(VideoDecoder::DecodeStatus status) {
+    ALOGV("%s(status=%s)", __func__, VideoDecoder::DecodeStatusToString(status));
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (status == VideoDecoder::DecodeStatus::kError) reportError(C2_CORRUPTED);
+}
+
+void V4L2DecodeComponent::recordReprimeBitstream(const C2ConstLinearBlock& block, bool isCSD) {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    C2ReadView view = block.map().get();
+    if (view.error() != C2_OK) {
+        ALOGW("Failed to map input buffer, the decoder can't be released until the next key frame");
+        clearReprimeBitstream();
+        return;
+    }
+
+    if (isCSD) {
+        // The codec config is only replaced when it's sent again after frames were decoded.
+        if (mNumReprimeCodecConfigs < mReprimeBitstream.size()) clearReprimeBitstream();
+        mReprimeBitstream.emplace_back(view.data(), view.data() + view.capacity());
+        mReprimeBitstreamSize += view.capacity();
+        mNumReprimeCodecConfigs++;
+        return;
+    }
+
+    if (isKeyFrame(view.data(), view.capacity(), *mIntfImpl->getVideoCodec())) {
+        dropReprimeFrames();
+        mReprimeFromKeyFrame = true;
+    }
+    if (!mReprimeFromKeyFrame) return;
+
+    if (mReprimeBitstreamSize + view.capacity() > kMaxReprimeBitstreamSize) {
+        ALOGV("%s(): GOP is too large to re-prime the decoder.", __func__);
+        dropReprimeFrames();
+        return;
+    }
+    mReprimeBitstream.emplace_back(view.data(), view.data() + view.capacity());
+    mReprimeBitstreamSize += view.capacity();
+}
+
+void V4L2DecodeComponent::dropReprimeFrames() {
+    mReprimeBitstream.resize(mNumReprimeCodecConfigs);
+    mReprimeBitstreamSize = 0;
+    for (const auto& config : mReprimeBitstream) mReprimeBitstreamSize += config.size();
+    mReprimeFromKeyFrame = false;
+}
+
+void V4L2DecodeComponent::clearReprimeBitstream() {
+    mNumReprimeCodecConfigs = 0;
+    dropReprimeFrames();
+}
+
 void V4L2DecodeComponent::pumpPendingWorks() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
@@ -451,6 +926,23 @@ void V4L2DecodeComponent::pumpPendingWorks() {
         return;
     }
 
+    // The decoder was released while idle, re-create it before sending new input.
+    if (!mDecoder && !mPendingWorks.empty() && !resumeIdleDecoder()) {
+        reportError(C2_CORRUPTED);
+        return;
+    }
+
+    // Regular input buffers are collected and sent to the decoder as a single batch. The batch is
+    // submitted before CSD and EOS works, so the decoder receives all buffers in order.
+    std::vector<std::unique_ptr<ConstBitstreamBuffer>> batch;
+    auto submitBatch = [this, &batch]() {
+        if (batch.empty()) return;
+        mDecoder->decodeBuffers(
+                std::move(batch),
+                ::base::BindRepeating(&V4L2DecodeComponent::onDecodeDone, mWeakThis));
+        batch.clear();
+    };
+
     while (!mPendingWorks.empty() && !mIsDraining) {
         std::unique_ptr<C2Work> pendingWork(std::move(mPendingWorks.front()));
         mPendingWorks.pop();
@@ -463,8 +955,35 @@ void V4L2DecodeComponent::pumpPendingWorks() {
         ALOGV("Process C2Work bitstreamId=%d isCSDWork=%d, isEmptyWork=%d", bitstreamId, isCSDWork,
               isEmptyWork);
 
+        // Drop non-key frames in key frame only mode or while resyncing the decoder without
+        // sending them to the decoder. The work is completed without an output buffer. Secure
+        // input buffers can't be parsed.
+        if (!isCSDWork && !isEmptyWork && !isEOSWork && !mIsSecure &&
+            (mIntfImpl->isKeyFrameOnlyMode() || mWaitingForKeyFrame)) {
+            const C2ConstLinearBlock& block =
+                    work->input.buffers.front()->data().linearBlocks().front();
+            C2ReadView view = block.map().get();
+            if (!isKeyFrame(view.data(), view.capacity(), *mIntfImpl->getVideoCodec())) {
+                ALOGV("Dropping non-key frame work bitstreamId=%d", bitstreamId);
+                pendingWork->input.buffers.front().reset();
+                pendingWork->result = C2_OK;
+                pendingWork->workletsProcessed =
+                        static_cast<uint32_t>(pendingWork->worklets.size());
+                reportWork(std::move(pendingWork));
+                continue;
+            }
+            if (mWaitingForKeyFrame) {
+                ALOGI("Resumed decoding at key frame work bitstreamId=%d", bitstreamId);
+                mWaitingForKeyFrame = false;
+            }
+        }
+
         auto res = mWorksAtDecoder.insert(std::make_pair(bitstreamId, std::move(pendingWork)));
         ALOGW_IF(!res.second, "We already inserted bitstreamId %d to decoder?", bitstreamId);
+        if (!isCSDWork && !isEOSWork && mayHaveNoShowFrames()) {
+            mNoShowFrameCandidates.emplace(work->input.ordinal.timestamp.peeku(),
+                                           work->input.ordinal.frameIndex.peeku(), bitstreamId);
+        }
 
         if (!isEmptyWork) {
             // If input.buffers is not empty, the buffer should have meaningful content inside.
@@ -472,10 +991,14 @@ void V4L2DecodeComponent::pumpPendingWorks() {
                     work->input.buffers.front()->data().linearBlocks().front();
             ALOG_ASSERT(linearBlock.size() > 0u, "Input buffer of work(%d) is empty.", bitstreamId);
 
-            // Try to parse color aspects from bitstream for CSD work of non-secure H264 codec.
-            if (isCSDWork && !mIsSecure && (mIntfImpl->getVideoCodec() == VideoCodec::H264)) {
+            // Try to parse color aspects from bitstream for CSD work of non-secure H264, HEVC and
+            // AV1 codecs.
+            const std::optional<VideoCodec> codec = mIntfImpl->getVideoCodec();
+            if (isCSDWork && !mIsSecure &&
+                (codec == VideoCodec::H264 || codec == VideoCodec::HEVC ||
+                 codec == VideoCodec::AV1)) {
                 C2StreamColorAspectsInfo::input codedAspects = {0u};
-                if (parseCodedColorAspects(linearBlock, &codedAspects)) {
+                if (parseCodedColorAspects(linearBlock, *codec, &codedAspects)) {
                     std::vector<std::unique_ptr<C2SettingResult>> failures;
                     c2_status_t status =
                             mIntfImpl->config({&codedAspects}, C2_MAY_BLOCK, &failures);
@@ -492,17 +1015,26 @@ void V4L2DecodeComponent::pumpPendingWorks() {
                 }
             }
 
+            if (!mIdleReleaseDelay.is_zero()) recordReprimeBitstream(linearBlock, isCSDWork);
+
             std::unique_ptr<ConstBitstreamBuffer> buffer = std::make_unique<ConstBitstreamBuffer>(
                     bitstreamId, linearBlock, linearBlock.offset(), linearBlock.size());
             if (!buffer) {
                 reportError(C2_CORRUPTED);
                 return;
             }
-            mDecoder->decode(std::move(buffer), ::base::BindOnce(&V4L2DecodeComponent::onDecodeDone,
-                                                                 mWeakThis, bitstreamId));
+            if (isCSDWork) {
+                submitBatch();
+                mDecoder->decode(std::move(buffer),
+                                 ::base::BindOnce(&V4L2DecodeComponent::onDecodeDone, mWeakThis,
+                                                  bitstreamId));
+            } else {
+                batch.push_back(std::move(buffer));
+            }
         }
 
         if (isEOSWork) {
+            submitBatch();
             mDecoder->drain(::base::BindOnce(&V4L2DecodeComponent::onDrainDone, mWeakThis));
             mIsDraining = true;
         }
@@ -510,6 +1042,8 @@ void V4L2DecodeComponent::pumpPendingWorks() {
         // Directly report the empty CSD work as finished.
         if (isCSDWork && isEmptyWork) reportWorkIfFinished(bitstreamId);
     }
+
+    submitBatch();
 }
 
 void V4L2DecodeComponent::onDecodeDone(int32_t bitstreamId, VideoDecoder::DecodeStatus status) {
@@ -549,11 +1083,18 @@ void V4L2DecodeComponent::onDecodeDone(int32_t bitstreamId, VideoDecoder::Decode
     }
 }
 
+// Frames are only returned to the client once they have been dequeued from the device. V4L2 can't
+// export a completion fence for a queued CAPTURE buffer, and which work's frame a CAPTURE buffer
+// will contain is only known when it's dequeued, as the decoder may reorder frames.
 void V4L2DecodeComponent::onOutputFrameReady(std::unique_ptr<VideoFrame> frame) {
     ALOGV("%s(bitstreamId=%d)", __func__, frame->getBitstreamId());
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
     const int32_t bitstreamId = frame->getBitstreamId();
+    if (bitstreamId >= kFirstReprimeBitstreamId) {
+        ALOGV("Dropping the frame decoded to re-prime the decoder.");
+        return;
+    }
     auto it = mWorksAtDecoder.find(bitstreamId);
     if (it == mWorksAtDecoder.end()) {
         ALOGE("Work with bitstreamId=%d not found, already abandoned?", bitstreamId);
@@ -561,9 +1102,13 @@ void V4L2DecodeComponent::onOutputFrameReady(std::unique_ptr<VideoFrame> frame)
         return;
     }
     C2Work* work = it->second.get();
+    mLatencyTracker->mark(bitstreamId, "output");
 
     C2ConstGraphicBlock constBlock = std::move(frame)->getGraphicBlock();
     std::shared_ptr<C2Buffer> buffer = C2Buffer::CreateGraphicBuffer(std::move(constBlock));
+    if (std::shared_ptr<C2VdaPooledBlockPool> pooledBlockPool = mPooledBlockPool.lock()) {
+        C2VdaPooledBlockPool::notifyBlockAvailableOnDestroy(pooledBlockPool, buffer.get());
+    }
     if (mPendingColorAspectsChange &&
         work->input.ordinal.frameIndex.peeku() >= mPendingColorAspectsChangeFrameIndex) {
         mIntfImpl->queryColorAspects(&mCurrentColorAspects);
@@ -572,46 +1117,64 @@ void V4L2DecodeComponent::onOutputFrameReady(std::unique_ptr<VideoFrame> frame)
     if (mCurrentColorAspects) {
         buffer->setInfo(mCurrentColorAspects);
     }
+    if (mHdrStaticInfo) {
+        buffer->setInfo(mHdrStaticInfo);
+    }
     work->worklets.front()->output.buffers.emplace_back(std::move(buffer));
-
-    // Check no-show frame by timestamps for VP8/VP9 cases before reporting the current work.
-    if (mIntfImpl->getVideoCodec() == VideoCodec::VP8 ||
-        mIntfImpl->getVideoCodec() == VideoCodec::VP9) {
-        detectNoShowFrameWorksAndReportIfFinished(work->input.ordinal);
+    if (mPendingPixelFormatUpdate) {
+        work->worklets.front()->output.configUpdate.push_back(std::move(mPendingPixelFormatUpdate));
     }
 
+    // Check no-show frame by timestamps for VP8/VP9/AV1 cases before reporting the current work.
+    if (mayHaveNoShowFrames()) detectNoShowFrameWorksAndReportIfFinished(work->input.ordinal);
+
+    // In low-latency mode frames are output in decoding order, so the work can be reported
+    // immediately instead of waiting for the works in front of it to be reported.
+    if (mLowLatencyMode && reportWorkIfFinished(bitstreamId)) return;
+
     mOutputBitstreamIds.push(bitstreamId);
     pumpReportWork();
 }
 
+bool V4L2DecodeComponent::mayHaveNoShowFrames() const {
+    const std::optional<VideoCodec> codec = mIntfImpl->getVideoCodec();
+    return codec == VideoCodec::VP8 || codec == VideoCodec::VP9 || codec == VideoCodec::AV1;
+}
+
 void V4L2DecodeComponent::detectNoShowFrameWorksAndReportIfFinished(
         const C2WorkOrdinalStruct& currOrdinal) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
-    std::vector<int32_t> noShowFrameBitstreamIds;
-    for (auto& kv : mWorksAtDecoder) {
-        const int32_t bitstreamId = kv.first;
-        const C2Work* work = kv.second.get();
-
-        // A work in mWorksAtDecoder would be considered to have no-show frame if there is no
-        // corresponding output buffer returned while the one of the work with latter timestamp is
-        // already returned. (VD is outputted in display order.)
-        if (isNoShowFrameWork(*work, currOrdinal)) {
-            work->worklets.front()->output.flags = C2FrameData::FLAG_DROP_FRAME;
-
-            // We need to call reportWorkIfFinished() for all detected no-show frame works. However,
-            // we should do it after the detection loop since reportWorkIfFinished() may erase
-            // entries in |mWorksAtDecoder|.
-            noShowFrameBitstreamIds.push_back(bitstreamId);
-            ALOGV("Detected no-show frame work index=%llu timestamp=%llu",
-                  work->input.ordinal.frameIndex.peekull(),
-                  work->input.ordinal.timestamp.peekull());
+    // A work in mWorksAtDecoder would be considered to have no-show frame if there is no
+    // corresponding output buffer returned while the one of the work with latter timestamp is
+    // already returned. (VD is outputted in display order.) So only the candidates with an earlier
+    // timestamp than the current output need to be checked.
+    auto it = mNoShowFrameCandidates.begin();
+    while (it != mNoShowFrameCandidates.end() &&
+           std::get<0>(*it) < currOrdinal.timestamp.peeku()) {
+        const auto [timestamp, frameIndex, bitstreamId] = *it;
+        // Works decoded after the current output are kept, their output may still be returned.
+        if (frameIndex >= currOrdinal.frameIndex.peeku()) {
+            ++it;
+            continue;
+        }
+        it = mNoShowFrameCandidates.erase(it);
+
+        auto workIt = mWorksAtDecoder.find(bitstreamId);
+        if (workIt == mWorksAtDecoder.end()) continue;
+        C2Work* work = workIt->second.get();
+        if (work->input.ordinal.frameIndex.peeku() != frameIndex ||
+            !isNoShowFrameWork(*work, currOrdinal)) {
+            continue;
         }
-    }
 
-    // Try to report works with no-show frame.
-    for (const int32_t bitstreamId : noShowFrameBitstreamIds) reportWorkIfFinished(bitstreamId);
+        work->worklets.front()->output.flags = C2FrameData::FLAG_DROP_FRAME;
+        ALOGV("Detected no-show frame work index=%" PRIu64 " timestamp=%" PRIu64, frameIndex,
+              timestamp);
+        // Erasing from |mWorksAtDecoder| doesn't invalidate |it|.
+        reportWorkIfFinished(bitstreamId);
+    }
 }
 
 void V4L2DecodeComponent::pumpReportWork() {
@@ -673,6 +1236,8 @@ bool V4L2DecodeComponent::reportEOSWork() {
 
     std::unique_ptr<C2Work> eosWork(std::move(it->second));
     mWorksAtDecoder.erase(it);
+    // The timestamps might restart after the end of stream.
+    mNoShowFrameCandidates.clear();
 
     eosWork->result = C2_OK;
     eosWork->workletsProcessed = static_cast<uint32_t>(eosWork->worklets.size());
@@ -701,10 +1266,43 @@ bool V4L2DecodeComponent::reportWork(std::unique_ptr<C2Work> work) {
         return false;
     }
 
+    mLatencyTracker->finish(frameIndexToBitstreamId(work->input.ordinal.frameIndex), "report");
+    mFinishedWorks.emplace_back(std::move(work));
+
+    // In low-latency mode works are reported right away, otherwise the number of works held back
+    // is capped so the client's output doesn't stall on bursts of finished works.
+    if (mLowLatencyMode || mFinishedWorks.size() >= kMaxBatchedWorks) {
+        flushFinishedWorks();
+    } else if (!mFlushFinishedWorksScheduled) {
+        mDecoderTaskRunner->PostTask(
+                FROM_HERE,
+                ::base::BindOnce(&V4L2DecodeComponent::flushFinishedWorksTask, mWeakThis));
+        mFlushFinishedWorksScheduled = true;
+    }
+    return true;
+}
+
+void V4L2DecodeComponent::flushFinishedWorks() {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mFinishedWorks.empty()) return;
+    if (!mListener) {
+        ALOGE("mListener is nullptr, setListener_vb() not called?");
+        mFinishedWorks.clear();
+        return;
+    }
+
+    ALOGV("%s(): reporting %zu works", __func__, mFinishedWorks.size());
     std::list<std::unique_ptr<C2Work>> finishedWorks;
-    finishedWorks.emplace_back(std::move(work));
+    finishedWorks.swap(mFinishedWorks);
     mListener->onWorkDone_nb(weak_from_this(), std::move(finishedWorks));
-    return true;
+}
+
+void V4L2DecodeComponent::flushFinishedWorksTask() {
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mFlushFinishedWorksScheduled = false;
+    flushFinishedWorks();
 }
 
 c2_status_t V4L2DecodeComponent::flush_sm(
@@ -720,6 +1318,7 @@ c2_status_t V4L2DecodeComponent::flush_sm(
         return C2_OMITTED;  // Tunneling is not supported by now
     }
 
+    if (mRecorder) mRecorder->recordFlush();
     mDecoderTaskRunner->PostTask(FROM_HERE,
                                  ::base::BindOnce(&V4L2DecodeComponent::flushTask, mWeakThis));
     return C2_OK;
@@ -729,17 +1328,25 @@ void V4L2DecodeComponent::flushTask() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
-    mDecoder->flush();
+    if (mDecoder) mDecoder->flush();
     reportAbandonedWorks();
+    mLatencyTracker->clear();
+
+    // Decoding restarts from a new position, which doesn't reference the frames before the flush.
+    dropReprimeFrames();
 
     // Pending EOS work will be abandoned here due to component flush if any.
     mIsDraining = false;
+    mWaitingForKeyFrame = false;
 }
 
 void V4L2DecodeComponent::reportAbandonedWorks() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
 
+    // Report the finished works first, the client expects works to be reported in order.
+    flushFinishedWorks();
+
     std::list<std::unique_ptr<C2Work>> abandonedWorks;
     while (!mPendingWorks.empty()) {
         abandonedWorks.emplace_back(std::move(mPendingWorks.front()));
@@ -749,6 +1356,7 @@ void V4L2DecodeComponent::reportAbandonedWorks() {
         abandonedWorks.emplace_back(std::move(kv.second));
     }
     mWorksAtDecoder.clear();
+    mNoShowFrameCandidates.clear();
 
     for (auto& work : abandonedWorks) {
         // TODO: correlate the definition of flushed work result to framework.
@@ -784,6 +1392,7 @@ c2_status_t V4L2DecodeComponent::drain_nb(drain_mode_t mode) {
         return C2_OK;  // Do nothing special.
 
     case DRAIN_COMPONENT_WITH_EOS:
+        if (mRecorder) mRecorder->recordDrain();
         mDecoderTaskRunner->PostTask(FROM_HERE,
                                      ::base::BindOnce(&V4L2DecodeComponent::drainTask, mWeakThis));
         return C2_OK;
@@ -833,6 +1442,65 @@ void V4L2DecodeComponent::onDrainDone(VideoDecoder::DecodeStatus status) {
     }
 }
 
+void V4L2DecodeComponent::onDecoderCorrupted(int32_t bitstreamId) {
+    ALOGW("%s(bitstreamId=%d)", __func__, bitstreamId);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The decoder runs the callback while servicing the device, so it can't be flushed right away.
+    // Corruption is usually reported for several frames in a row, which are handled together.
+    if (mResyncScheduled) return;
+    mResyncScheduled = true;
+    mDecoderTaskRunner->PostTask(FROM_HERE,
+                                 ::base::BindOnce(&V4L2DecodeComponent::resyncDecoder, mWeakThis));
+}
+
+void V4L2DecodeComponent::resyncDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mResyncScheduled = false;
+    if (mComponentState.load() != ComponentState::RUNNING || !mDecoder) return;
+
+    // Flushing keeps the device and its buffers, the frames decoded from the flushed input are
+    // recycled by the decoder.
+    mDecoder->flush();
+
+    // The drain is aborted by the flush, so the EOS work is reported once the other works are.
+    const bool wasDraining = mIsDraining;
+    mIsDraining = false;
+    std::queue<int32_t>().swap(mOutputBitstreamIds);
+    mNoShowFrameCandidates.clear();
+
+    // The works whose frame wasn't returned yet are reported without an output buffer, in decoding
+    // order.
+    std::vector<int32_t> bitstreamIds;
+    for (auto& [bitstreamId, work] : mWorksAtDecoder) {
+        if (work->input.flags & C2FrameData::FLAG_END_OF_STREAM) continue;
+        if (!work->input.buffers.empty()) work->input.buffers.front().reset();
+        C2FrameData& output = work->worklets.front()->output;
+        if (output.buffers.empty()) output.flags = C2FrameData::FLAG_DROP_FRAME;
+        bitstreamIds.push_back(bitstreamId);
+    }
+    ALOGW("Resyncing the decoder, dropped %zu works", bitstreamIds.size());
+    for (const int32_t bitstreamId : bitstreamIds) reportWorkIfFinished(bitstreamId);
+
+    const bool hasEOSWork =
+            std::any_of(mWorksAtDecoder.begin(), mWorksAtDecoder.end(), [](const auto& kv) {
+                return kv.second->input.flags & C2FrameData::FLAG_END_OF_STREAM;
+            });
+    if (wasDraining && hasEOSWork && !reportEOSWork()) {
+        reportError(C2_CORRUPTED);
+        return;
+    }
+
+    // The frames following the corruption might reference the corrupted frames, decoding resumes
+    // at the next key frame. Secure input buffers can't be parsed, those are all decoded.
+    mWaitingForKeyFrame = !mIsSecure;
+    dropReprimeFrames();
+    mDecoderTaskRunner->PostTask(
+            FROM_HERE, ::base::BindOnce(&V4L2DecodeComponent::pumpPendingWorks, mWeakThis));
+}
+
 void V4L2DecodeComponent::reportError(c2_status_t error) {
     ALOGE("%s(error=%u)", __func__, static_cast<uint32_t>(error));
     ALOG_ASSERT(mDecoderTaskRunner->RunsTasksInCurrentSequence());
@@ -840,6 +1508,7 @@ void V4L2DecodeComponent::reportError(c2_status_t error) {
     if (mComponentState.load() == ComponentState::ERROR) return;
     mComponentState.store(ComponentState::ERROR);
 
+    flushFinishedWorks();
     if (!mListener) {
         ALOGE("mListener is nullptr, setListener_vb() not called?");
         return;
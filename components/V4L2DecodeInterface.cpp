@@ -7,6 +7,8 @@
 
 #include <v4l2_codec2/components/V4L2DecodeInterface.h>
 
+#include <algorithm>
+
 #include <C2PlatformSupport.h>
 #include <SimpleC2Interface.h>
 #include <android/hardware/graphics/common/1.0/types.h>
@@ -26,6 +28,10 @@ constexpr size_t k4KArea = 3840 * 2160;
 constexpr size_t kInputBufferSizeFor1080p = 1024 * 1024;  // 1MB
 // Input bitstream buffer size for up to 4k streams.
 constexpr size_t kInputBufferSizeFor4K = 4 * kInputBufferSizeFor1080p;
+// The output delay of codecs that might reorder output frames.
+constexpr uint32_t kReorderingOutputDelay = 16;
+// The framerate assumed if the client doesn't specify the framerate of the video.
+constexpr float kDefaultFrameRate = 30.0;
 
 std::optional<VideoCodec> getCodecFromComponentName(const std::string& name) {
     if (name == V4L2ComponentName::kH264Decoder || name == V4L2ComponentName::kH264SecureDecoder)
@@ -34,6 +40,9 @@ std::optional<VideoCodec> getCodecFromComponentName(const std::string& name) {
         return VideoCodec::VP8;
     if (name == V4L2ComponentName::kVP9Decoder || name == V4L2ComponentName::kVP9SecureDecoder)
         return VideoCodec::VP9;
+    if (name == V4L2ComponentName::kHEVCDecoder || name == V4L2ComponentName::kHEVCSecureDecoder)
+        return VideoCodec::HEVC;
+    if (name == V4L2ComponentName::kAV1Decoder) return VideoCodec::AV1;
 
     ALOGE("Unknown name: %s", name.c_str());
     return std::nullopt;
@@ -100,6 +109,31 @@ C2R V4L2DecodeInterface::MergedColorAspectsSetter(
     return C2R::Ok();
 }
 
+// static
+C2R V4L2DecodeInterface::HdrStaticInfoSetter(bool /* mayBlock */,
+                                             C2P<C2StreamHdrStaticInfo::output>& me) {
+    // Clamp the values to the ranges of the CTA-861.3 static metadata descriptor.
+    auto clampChromaticity = [](float value) { return std::clamp(value, 0.0f, 1.0f); };
+    for (C2ColorXyStruct* primary : {&me.set().mastering.red, &me.set().mastering.green,
+                                     &me.set().mastering.blue, &me.set().mastering.white}) {
+        primary->x = clampChromaticity(primary->x);
+        primary->y = clampChromaticity(primary->y);
+    }
+    me.set().mastering.maxLuminance = std::clamp(me.v.mastering.maxLuminance, 0.0f, 65535.0f);
+    me.set().mastering.minLuminance = std::clamp(me.v.mastering.minLuminance, 0.0f, 6.5535f);
+    me.set().maxCll = std::clamp(me.v.maxCll, 0.0f, 65535.0f);
+    me.set().maxFall = std::clamp(me.v.maxFall, 0.0f, 65535.0f);
+    return C2R::Ok();
+}
+
+// static
+C2R V4L2DecodeInterface::ReorderingOutputDelaySetter(
+        bool /* mayBlock */, C2P<C2PortDelayTuning::output>& me,
+        const C2P<C2GlobalLowLatencyModeTuning>& lowLatencyMode) {
+    me.set().value = lowLatencyMode.v.value ? 0 : kReorderingOutputDelay;
+    return C2R::Ok();
+}
+
 // static
 C2R V4L2DecodeInterface::MaxInputBufferSizeCalculator(
         bool /* mayBlock */, C2P<C2StreamMaxBufferSizeInfo::input>& me,
@@ -169,7 +203,9 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                 DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
                         .withDefault(new C2StreamProfileLevelInfo::input(
                                 0u, C2Config::PROFILE_VP9_0, C2Config::LEVEL_VP9_5))
-                        .withFields({C2F(mProfileLevel, profile).oneOf({C2Config::PROFILE_VP9_0}),
+                        .withFields({C2F(mProfileLevel, profile)
+                                             .oneOf({C2Config::PROFILE_VP9_0,
+                                                     C2Config::PROFILE_VP9_2}),
                                      C2F(mProfileLevel, level)
                                              .oneOf({C2Config::LEVEL_VP9_1, C2Config::LEVEL_VP9_1_1,
                                                      C2Config::LEVEL_VP9_2, C2Config::LEVEL_VP9_2_1,
@@ -179,6 +215,62 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                         .withSetter(ProfileLevelSetter)
                         .build());
         break;
+
+    case VideoCodec::HEVC:
+        inputMime = MEDIA_MIMETYPE_VIDEO_HEVC;
+        addParameter(
+                DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
+                        .withDefault(new C2StreamProfileLevelInfo::input(
+                                0u, C2Config::PROFILE_HEVC_MAIN, C2Config::LEVEL_HEVC_MAIN_5_1))
+                        .withFields({C2F(mProfileLevel, profile)
+                                             .oneOf({C2Config::PROFILE_HEVC_MAIN,
+                                                     C2Config::PROFILE_HEVC_MAIN_STILL,
+                                                     C2Config::PROFILE_HEVC_MAIN_10}),
+                                     C2F(mProfileLevel, level)
+                                             .oneOf({C2Config::LEVEL_HEVC_MAIN_1,
+                                                     C2Config::LEVEL_HEVC_MAIN_2,
+                                                     C2Config::LEVEL_HEVC_MAIN_2_1,
+                                                     C2Config::LEVEL_HEVC_MAIN_3,
+                                                     C2Config::LEVEL_HEVC_MAIN_3_1,
+                                                     C2Config::LEVEL_HEVC_MAIN_4,
+                                                     C2Config::LEVEL_HEVC_MAIN_4_1,
+                                                     C2Config::LEVEL_HEVC_MAIN_5,
+                                                     C2Config::LEVEL_HEVC_MAIN_5_1,
+                                                     C2Config::LEVEL_HEVC_HIGH_4,
+                                                     C2Config::LEVEL_HEVC_HIGH_4_1,
+                                                     C2Config::LEVEL_HEVC_HIGH_5,
+                                                     C2Config::LEVEL_HEVC_HIGH_5_1})})
+                        .withSetter(ProfileLevelSetter)
+                        .build());
+        break;
+
+    case VideoCodec::AV1:
+        inputMime = MEDIA_MIMETYPE_VIDEO_AV1;
+        addParameter(
+                DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
+                        .withDefault(new C2StreamProfileLevelInfo::input(
+                                0u, C2Config::PROFILE_AV1_0, C2Config::LEVEL_AV1_5_1))
+                        .withFields({C2F(mProfileLevel, profile).oneOf({C2Config::PROFILE_AV1_0}),
+                                     C2F(mProfileLevel, level)
+                                             .oneOf({C2Config::LEVEL_AV1_2,
+                                                     C2Config::LEVEL_AV1_2_1,
+                                                     C2Config::LEVEL_AV1_2_2,
+                                                     C2Config::LEVEL_AV1_2_3,
+                                                     C2Config::LEVEL_AV1_3,
+                                                     C2Config::LEVEL_AV1_3_1,
+                                                     C2Config::LEVEL_AV1_3_2,
+                                                     C2Config::LEVEL_AV1_3_3,
+                                                     C2Config::LEVEL_AV1_4,
+                                                     C2Config::LEVEL_AV1_4_1,
+                                                     C2Config::LEVEL_AV1_4_2,
+                                                     C2Config::LEVEL_AV1_4_3,
+                                                     C2Config::LEVEL_AV1_5,
+                                                     C2Config::LEVEL_AV1_5_1,
+                                                     C2Config::LEVEL_AV1_5_2,
+                                                     C2Config::LEVEL_AV1_5_3})})
+                        .withSetter(ProfileLevelSetter)
+                        .build());
+        break;
     }
 
     addParameter(
@@ -196,10 +288,44 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                          .withConstValue(
                                  new C2StreamBufferTypeSetting::output(0u, C2BufferData::GRAPHIC))
                          .build());
-    addParameter(
-            DefineParam(mOutputDelay, C2_PARAMKEY_OUTPUT_DELAY)
-                    .withConstValue(new C2PortDelayTuning::output(getOutputDelay(*mVideoCodec)))
-                    .build());
+    addParameter(DefineParam(mLowLatencyMode, C2_PARAMKEY_LOW_LATENCY_MODE)
+                         .withDefault(new C2GlobalLowLatencyModeTuning(false))
+                         .withFields({C2F(mLowLatencyMode, value).any()})
+                         .withSetter(Setter<decltype(*mLowLatencyMode)>::NonStrictValueWithNoDeps)
+                         .build());
+
+    addParameter(DefineParam(mRealTimePriority, C2_PARAMKEY_PRIORITY)
+                         .withDefault(new C2RealTimePriorityTuning(0))
+                         .withFields({C2F(mRealTimePriority, value).any()})
+                         .withSetter(Setter<decltype(*mRealTimePriority)>::StrictValueWithNoDeps)
+                         .build());
+
+    if (getOutputDelay(*mVideoCodec) > 0) {
+        addParameter(
+                DefineParam(mOutputDelay, C2_PARAMKEY_OUTPUT_DELAY)
+                        .withDefault(new C2PortDelayTuning::output(kReorderingOutputDelay))
+                        .withFields({C2F(mOutputDelay, value).inRange(0, kReorderingOutputDelay)})
+                        .withSetter(ReorderingOutputDelaySetter, mLowLatencyMode)
+                        .build());
+    } else {
+        addParameter(DefineParam(mOutputDelay, C2_PARAMKEY_OUTPUT_DELAY)
+                             .withConstValue(new C2PortDelayTuning::output(0))
+                             .build());
+    }
+
+    // VP9 profile 2, HEVC Main 10 and AV1 Main streams might be 10-bit, in which case the frames
+    // are output as P010. The pixel format is updated by the component when the output format changes.
+    std::vector<uint32_t> pixelFormats = {HAL_PIXEL_FORMAT_YCBCR_420_888};
+    if (*mVideoCodec == VideoCodec::VP9 || *mVideoCodec == VideoCodec::HEVC ||
+        *mVideoCodec == VideoCodec::AV1) {
+        pixelFormats.push_back(HAL_PIXEL_FORMAT_YCBCR_P010);
+    }
+    addParameter(DefineParam(mPixelFormat, C2_PARAMKEY_PIXEL_FORMAT)
+                         .withDefault(new C2StreamPixelFormatInfo::output(
+                                 0u, HAL_PIXEL_FORMAT_YCBCR_420_888))
+                         .withFields({C2F(mPixelFormat, value).oneOf(pixelFormats)})
+                         .withSetter(Setter<decltype(*mPixelFormat)>::StrictValueWithNoDeps)
+                         .build());
 
     addParameter(DefineParam(mInputMediaType, C2_PARAMKEY_INPUT_MEDIA_TYPE)
                          .withConstValue(AllocSharedString<C2PortMediaTypeSetting::input>(
@@ -223,6 +349,29 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                          .withSetter(SizeSetter)
                          .build());
 
+    addParameter(DefineParam(mScaledOutputSize, C2_PARAMKEY_V4L2_SCALED_OUTPUT_SIZE)
+                         .withDefault(new C2StreamV4L2ScaledOutputSizeTuning::output(0u, 0, 0))
+                         .withFields({
+                                 C2F(mScaledOutputSize, width).inRange(0, 4096, 2),
+                                 C2F(mScaledOutputSize, height).inRange(0, 4096, 2),
+                         })
+                         .withSetter(
+                                 Setter<decltype(*mScaledOutputSize)>::StrictValueWithNoDeps)
+                         .build());
+
+    addParameter(DefineParam(mKeyFrameOnly, C2_PARAMKEY_V4L2_KEY_FRAME_ONLY)
+                         .withDefault(new C2StreamV4L2KeyFrameOnlyTuning::input(0u, C2_FALSE))
+                         .withFields({C2F(mKeyFrameOnly, value).oneOf({C2_FALSE, C2_TRUE})})
+                         .withSetter(
+                                 Setter<decltype(*mKeyFrameOnly)>::StrictValueWithNoDeps)
+                         .build());
+
+    addParameter(DefineParam(mFrameRate, C2_PARAMKEY_FRAME_RATE)
+                         .withDefault(new C2StreamFrameRateInfo::input(0u, kDefaultFrameRate))
+                         .withFields({C2F(mFrameRate, value).greaterThan(0.)})
+                         .withSetter(Setter<decltype(*mFrameRate)>::StrictValueWithNoDeps)
+                         .build());
+
     addParameter(
             DefineParam(mMaxInputSize, C2_PARAMKEY_INPUT_MAX_BUFFER_SIZE)
                     .withDefault(new C2StreamMaxBufferSizeInfo::input(0u, kInputBufferSizeFor1080p))
@@ -319,6 +468,38 @@ V4L2DecodeInterface::V4L2DecodeInterface(const std::string& name,
                                      .inRange(C2Color::MATRIX_UNSPECIFIED, C2Color::MATRIX_OTHER)})
                     .withSetter(MergedColorAspectsSetter, mDefaultColorAspects, mCodedColorAspects)
                     .build());
+
+    // The HDR static metadata is normally provided by the client from the container, and attached
+    // to the output buffers. Zero luminance values mean the metadata is unknown.
+    auto hdrStaticInfo = std::make_shared<C2StreamHdrStaticInfo::output>();
+    hdrStaticInfo->mastering = {
+            .red = {.x = 0.708, .y = 0.292},
+            .green = {.x = 0.170, .y = 0.797},
+            .blue = {.x = 0.131, .y = 0.046},
+            .white = {.x = 0.3127, .y = 0.3290},
+            .maxLuminance = 0,
+            .minLuminance = 0,
+    };
+    hdrStaticInfo->maxCll = 0;
+    hdrStaticInfo->maxFall = 0;
+    addParameter(DefineParam(mHdrStaticInfo, C2_PARAMKEY_HDR_STATIC_INFO)
+                         .withDefault(hdrStaticInfo)
+                         .withFields({
+                                 C2F(mHdrStaticInfo, mastering.red.x).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.red.y).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.green.x).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.green.y).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.blue.x).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.blue.y).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.white.x).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.white.y).inRange(0, 1),
+                                 C2F(mHdrStaticInfo, mastering.maxLuminance).inRange(0, 65535),
+                                 C2F(mHdrStaticInfo, mastering.minLuminance).inRange(0, 6.5535),
+                                 C2F(mHdrStaticInfo, maxCll).inRange(0, 65535),
+                                 C2F(mHdrStaticInfo, maxFall).inRange(0, 65535),
+                         })
+                         .withSetter(HdrStaticInfoSetter)
+                         .build());
 }
 
 size_t V4L2DecodeInterface::getInputBufferSize() const {
@@ -338,6 +519,21 @@ c2_status_t V4L2DecodeInterface::queryColorAspects(
     return status;
 }
 
+c2_status_t V4L2DecodeInterface::queryHdrStaticInfo(
+        std::shared_ptr<C2StreamHdrStaticInfo::output>* targetHdrStaticInfo) {
+    auto hdrStaticInfo = std::make_shared<C2StreamHdrStaticInfo::output>();
+    c2_status_t status = query({hdrStaticInfo.get()}, {}, C2_DONT_BLOCK, nullptr);
+    if (status != C2_OK) return status;
+
+    // Only attach the metadata to the output buffers if it's known.
+    if (hdrStaticInfo->mastering.maxLuminance > 0 || hdrStaticInfo->maxCll > 0) {
+        *targetHdrStaticInfo = std::move(hdrStaticInfo);
+    } else {
+        targetHdrStaticInfo->reset();
+    }
+    return C2_OK;
+}
+
 uint32_t V4L2DecodeInterface::getOutputDelay(VideoCodec codec) {
     switch (codec) {
     case VideoCodec::H264:
@@ -345,11 +541,19 @@ uint32_t V4L2DecodeInterface::getOutputDelay(VideoCodec codec) {
         // queued before being able to output the associated decoded buffers. We need to tell the
         // codec2 framework that it should not stop queuing new work items until the maximum number
         // of frame reordering is reached, to avoid stalling the decoder.
-        return 16;
+        return kReorderingOutputDelay;
     case VideoCodec::VP8:
         return 0;
     case VideoCodec::VP9:
         return 0;
+    case VideoCodec::HEVC:
+        // HEVC streams might reorder output frames too, see the H264 case above.
+        return kReorderingOutputDelay;
+    case VideoCodec::AV1:
+        // Frames might be decoded ahead as hidden frames and shown later, but each temporal unit
+        // contains exactly one shown frame, so the decoder never needs additional input to output
+        // the frame associated with a work item.
+        return 0;
     }
 }
 
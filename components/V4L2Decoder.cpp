@@ -15,10 +15,17 @@
 #include <base/bind.h>
 #include <base/files/scoped_file.h>
 #include <base/memory/ptr_util.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include <v4l2_codec2/common/Common.h>
 #include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/MemoryPressureMonitor.h>
+
+// Qualcomm's UBWC compressed NV12 format, which was added to the V4L2 API later on.
+#ifndef V4L2_PIX_FMT_QC08C
+#define V4L2_PIX_FMT_QC08C v4l2_fourcc('Q', '0', '8', 'C')
+#endif
 
 namespace android {
 namespace {
@@ -26,11 +33,28 @@ namespace {
 constexpr size_t kNumInputBuffers = 4;
 // Extra buffers for transmitting in the whole video pipeline.
 constexpr size_t kNumExtraOutputBuffers = 4;
+// Extra buffers used while the system is under memory pressure, the pipeline runs with less slack
+// instead. The component still applies the minimum required to render to a surface.
+constexpr size_t kNumExtraOutputBuffersUnderPressure = 1;
+
+// A V4L2 output format, mapped to the gralloc format of the matching graphic buffers.
+struct OutputFormat {
+    uint32_t fourcc;
+    HalPixelFormat halPixelFormat;
+};
+
+// The supported linear output formats. 8-bit streams are decoded to the flexible pixel 420 format
+// YCBCR_420_888 in Android, 10-bit streams to P010.
+constexpr OutputFormat kSupportedOutputFormats[] = {
+        {Fourcc::NV12, HalPixelFormat::YCBCR_420_888},
+        {Fourcc::P010, HalPixelFormat::YCBCR_P010},
+};
 
-// Currently we only support flexible pixel 420 format YCBCR_420_888 in Android.
-// Here is the list of flexible 420 format.
-constexpr std::initializer_list<uint32_t> kSupportedOutputFourccs = {
-        Fourcc::NV12,
+// Vendor compressed formats, which are preferred over the linear formats above when the consumer
+// allows them as they significantly reduce the memory bandwidth used for playback. Only 8-bit
+// compressed formats are supported.
+constexpr OutputFormat kCompressedOutputFormats[] = {
+        {V4L2_PIX_FMT_QC08C, HalPixelFormat::YCBCR_420_SP_VENUS_UBWC},
 };
 
 uint32_t VideoCodecToV4L2PixFmt(VideoCodec codec) {
@@ -41,6 +65,10 @@ uint32_t VideoCodecToV4L2PixFmt(VideoCodec codec) {
         return V4L2_PIX_FMT_VP8;
     case VideoCodec::VP9:
         return V4L2_PIX_FMT_VP9;
+    case VideoCodec::HEVC:
+        return V4L2_PIX_FMT_HEVC;
+    case VideoCodec::AV1:
+        return V4L2_PIX_FMT_AV1;
     }
 }
 
@@ -48,18 +76,31 @@ uint32_t VideoCodecToV4L2PixFmt(VideoCodec codec) {
 
 // static
 std::unique_ptr<VideoDecoder> V4L2Decoder::Create(
-        const VideoCodec& codec, const size_t inputBufferSize, const size_t minNumOutputBuffers,
-        GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb,
-        scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
+        const VideoCodec& codec, const size_t inputBufferSize, bool lowLatency,
+        const ui::Size& scaledOutputSize, GetPoolCB getPoolCb,
+        IsCompressedOutputAllowedCB isCompressedOutputAllowedCb, OutputCB outputCb,
+        ErrorCB errorCb, scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+        scoped_refptr<V4L2Device> device) {
     std::unique_ptr<V4L2Decoder> decoder =
             ::base::WrapUnique<V4L2Decoder>(new V4L2Decoder(taskRunner));
-    if (!decoder->start(codec, inputBufferSize, minNumOutputBuffers, std::move(getPoolCb),
-                        std::move(outputCb), std::move(errorCb))) {
+    if (!decoder->start(codec, inputBufferSize, lowLatency, scaledOutputSize, std::move(getPoolCb),
+                        std::move(isCompressedOutputAllowedCb), std::move(outputCb),
+                        std::move(errorCb), std::move(device))) {
         return nullptr;
     }
     return decoder;
 }
 
+// static
+scoped_refptr<V4L2Device> V4L2Decoder::OpenDevice(const VideoCodec& codec) {
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!device->open(V4L2Device::Type::kDecoder, VideoCodecToV4L2PixFmt(codec))) {
+        ALOGE("Failed to open device for %s", VideoCodecToString(codec));
+        return nullptr;
+    }
+    return device;
+}
+
 V4L2Decoder::V4L2Decoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner)
       : mTaskRunner(std::move(taskRunner)) {
     ALOGV("%s()", __func__);
@@ -90,15 +131,20 @@ V4L2Decoder::~V4L2Decoder() {
     }
 }
 
-bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
-                        const size_t minNumOutputBuffers, GetPoolCB getPoolCb, OutputCB outputCb,
-                        ErrorCB errorCb) {
-    ALOGE("%s(codec=%s, inputBufferSize=%zu, minNumOutputBuffers=%zu)", __func__,
-          VideoCodecToString(codec), inputBufferSize, minNumOutputBuffers);
+bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize, bool lowLatency,
+                        const ui::Size& scaledOutputSize, GetPoolCB getPoolCb,
+                        IsCompressedOutputAllowedCB isCompressedOutputAllowedCb,
+                        OutputCB outputCb, ErrorCB errorCb,
+                        scoped_refptr<V4L2Device> device) {
+    ALOGE("%s(codec=%s, inputBufferSize=%zu, lowLatency=%d)", __func__, VideoCodecToString(codec),
+          inputBufferSize, lowLatency);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
-    mMinNumOutputBuffers = minNumOutputBuffers;
+    mScaledOutputSize = scaledOutputSize;
+    mKeepCaptureOnFlush =
+            property_get_bool("ro.vendor.v4l2_codec2.decode_keep_capture_on_flush", true);
     mGetPoolCb = std::move(getPoolCb);
+    mIsCompressedOutputAllowedCb = std::move(isCompressedOutputAllowedCb);
     mOutputCb = std::move(outputCb);
     mErrorCb = std::move(errorCb);
 
@@ -107,12 +153,16 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
         return false;
     }
 
-    mDevice = V4L2Device::create();
-
+    // Use the device opened in advance if provided, this avoids probing the device nodes again.
     const uint32_t inputPixelFormat = VideoCodecToV4L2PixFmt(codec);
-    if (!mDevice->open(V4L2Device::Type::kDecoder, inputPixelFormat)) {
-        ALOGE("Failed to open device for %s", VideoCodecToString(codec));
-        return false;
+    if (device) {
+        mDevice = std::move(device);
+    } else {
+        mDevice = V4L2Device::create();
+        if (!mDevice->open(V4L2Device::Type::kDecoder, inputPixelFormat)) {
+            ALOGE("Failed to open device for %s", VideoCodecToString(codec));
+            return false;
+        }
     }
 
     if (!mDevice->hasCapabilities(V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING)) {
@@ -149,6 +199,8 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
         return false;
     }
 
+    if (lowLatency) setupLowLatencyMode();
+
     if (!mDevice->startPolling(::base::BindRepeating(&V4L2Decoder::serviceDeviceTask, mWeakThis),
                                ::base::BindRepeating(&V4L2Decoder::onError, mWeakThis))) {
         ALOGE("Failed to start polling V4L2 device.");
@@ -159,6 +211,25 @@ bool V4L2Decoder::start(const VideoCodec& codec, const size_t inputBufferSize,
     return true;
 }
 
+void V4L2Decoder::setupLowLatencyMode() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Ask the driver to return decoded frames immediately instead of holding them back for display
+    // reordering. Drivers without these controls are expected to output frames in decoding order
+    // already, so failing to set them is not an error.
+    if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE) ||
+        !mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY)) {
+        ALOGV("Device doesn't support configuring the display delay");
+        return;
+    }
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE, 1),
+                               V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY, 0)})) {
+        ALOGW("Failed to disable the display delay");
+    }
+}
+
 bool V4L2Decoder::setupInputFormat(const uint32_t inputPixelFormat, const size_t inputBufferSize) {
     ALOGV("%s(inputPixelFormat=%u, inputBufferSize=%zu)", __func__, inputPixelFormat,
           inputBufferSize);
@@ -210,6 +281,36 @@ void V4L2Decoder::decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB
     pumpDecodeRequest();
 }
 
+void V4L2Decoder::decodeBuffers(std::vector<std::unique_ptr<ConstBitstreamBuffer>> buffers,
+                                BufferDecodeCB bufferCb) {
+    ALOGV("%s(size=%zu)", __func__, buffers.size());
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    std::vector<int32_t> bitstreamIds;
+    for (const auto& buffer : buffers) bitstreamIds.push_back(buffer->id);
+    std::vector<DecodeCB> decodeCbs = bindBufferDecodeCBs(bitstreamIds, bufferCb);
+
+    if (mState == State::Error) {
+        ALOGE("Ignore due to error state.");
+        for (auto& decodeCb : decodeCbs) {
+            mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(decodeCb),
+                                                              VideoDecoder::DecodeStatus::kError));
+        }
+        return;
+    }
+
+    if (!buffers.empty() && mState == State::Idle) {
+        setState(State::Decoding);
+    }
+
+    // Queue all requests first, so as many buffers as there are free input buffers are queued to
+    // the device in a single pass.
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        mDecodeRequests.push(DecodeRequest(std::move(buffers[i]), std::move(decodeCbs[i])));
+    }
+    pumpDecodeRequest();
+}
+
 void V4L2Decoder::drain(DecodeCB drainCb) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -273,8 +374,12 @@ void V4L2Decoder::pumpDecodeRequest() {
             return;
         }
 
-        // Pause if no free input buffer. We resume decoding after dequeueing input buffers.
-        auto inputBuffer = mInputQueue->getFreeBuffer();
+        // Pause if no free input buffer. We resume decoding after dequeueing input buffers. The
+        // linear blocks are recycled by the client, so a dmabuf we have seen before is queued in
+        // the same V4L2 buffer as the previous time if possible.
+        const int fd = mDecodeRequests.front().buffer->dmabuf.handle()->data[0];
+        std::optional<V4L2WritableBufferRef> inputBuffer =
+                mInputQueue->getFreeBufferForDmabuf(getDmabufId(fd));
         if (!inputBuffer) {
             ALOGV("There is no free input buffer.");
             return;
@@ -299,12 +404,14 @@ void V4L2Decoder::pumpDecodeRequest() {
         inputBuffer->setPlaneDataOffset(0, request.buffer->offset);
         inputBuffer->setPlaneBytesUsed(0, request.buffer->offset + request.buffer->size);
         std::vector<int> fds;
-        fds.push_back(std::move(request.buffer->dmabuf.handle()->data[0]));
+        fds.push_back(fd);
         if (!std::move(*inputBuffer).queueDMABuf(fds)) {
             ALOGE("%s(): Failed to QBUF to input queue, bitstreamId=%d", __func__, bitstreamId);
             onError();
             return;
         }
+        if (mLatencyTracker) mLatencyTracker->mark(bitstreamId, "enqueue");
+        mLastQueuedBitstreamId = bitstreamId;
 
         mPendingDecodeCbs.insert(std::make_pair(bitstreamId, std::move(request.decodeCb)));
     }
@@ -323,25 +430,38 @@ void V4L2Decoder::flush() {
         return;
     }
 
-    // Call all pending callbacks.
+    // Call all pending callbacks, including the ones of requests not queued to the device yet.
     for (auto& item : mPendingDecodeCbs) {
         std::move(item.second).Run(VideoDecoder::DecodeStatus::kAborted);
     }
     mPendingDecodeCbs.clear();
+    while (!mDecodeRequests.empty()) {
+        std::move(mDecodeRequests.front().decodeCb).Run(VideoDecoder::DecodeStatus::kAborted);
+        mDecodeRequests.pop();
+    }
     if (mDrainCb) {
         std::move(mDrainCb).Run(VideoDecoder::DecodeStatus::kAborted);
     }
 
-    // Streamoff both V4L2 queues to drop input and output buffers.
+    // Seeking only requires restarting the OUTPUT queue, so the CAPTURE buffers stay queued at the
+    // device and don't need to be fetched from the frame pool again. Frames decoded from the
+    // flushed input might still be returned, those are recycled in serviceDeviceTask(). If a drain
+    // was in progress the device might already have returned the last buffer, which requires
+    // restarting the CAPTURE queue.
     const bool isOutputStreaming = mOutputQueue->isStreaming();
+    const bool keepCaptureStreaming =
+            isOutputStreaming && mKeepCaptureOnFlush && mState != State::Draining;
     mDevice->stopPolling();
-    mOutputQueue->streamoff();
-    mFrameAtDevice.clear();
+    if (!keepCaptureStreaming) {
+        mOutputQueue->streamoff();
+        mFrameAtDevice.clear();
+    }
     mInputQueue->streamoff();
+    mLastFlushedBitstreamId = keepCaptureStreaming ? mLastQueuedBitstreamId : std::nullopt;
 
-    // Streamon both V4L2 queues.
+    // Streamon the stopped V4L2 queues.
     mInputQueue->streamon();
-    if (isOutputStreaming) {
+    if (isOutputStreaming && !keepCaptureStreaming) {
         mOutputQueue->streamon();
     }
 
@@ -374,24 +494,22 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
 
     if (mState == State::Error) return;
 
-    // Dequeue output and input queue.
-    bool inputDequeued = false;
-    while (mInputQueue->queuedBuffersCount() > 0) {
-        bool success;
-        V4L2ReadableBufferRef dequeuedBuffer;
-        std::tie(success, dequeuedBuffer) = mInputQueue->dequeueBuffer();
-        if (!success) {
-            ALOGE("Failed to dequeue buffer from input queue.");
-            onError();
-            return;
-        }
-        if (!dequeuedBuffer) break;
-
-        inputDequeued = true;
+    // Drain all the ready input and output buffers and events before polling is scheduled again.
+    V4L2Device::ScopedPollBatch pollBatch(mDevice);
 
+    // Dequeue output and input queue.
+    std::vector<V4L2ReadableBufferRef> dequeuedBuffers;
+    if (!mInputQueue->dequeueBuffers(&dequeuedBuffers)) {
+        ALOGE("Failed to dequeue buffer from input queue.");
+        onError();
+        return;
+    }
+    const bool inputDequeued = !dequeuedBuffers.empty();
+    for (const V4L2ReadableBufferRef& dequeuedBuffer : dequeuedBuffers) {
         // Run the corresponding decode callback.
         int32_t id = dequeuedBuffer->getTimeStamp().tv_sec;
         ALOGV("DQBUF from input queue, bitstreamId=%d", id);
+        if (mLatencyTracker) mLatencyTracker->mark(id, "dequeueInput");
         auto it = mPendingDecodeCbs.find(id);
         if (it == mPendingDecodeCbs.end()) {
             ALOGW("Callback is already abandoned.");
@@ -399,22 +517,19 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
         }
         std::move(it->second).Run(VideoDecoder::DecodeStatus::kOk);
         mPendingDecodeCbs.erase(it);
-    }
-
-    bool outputDequeued = false;
-    while (mOutputQueue->queuedBuffersCount() > 0) {
-        bool success;
-        V4L2ReadableBufferRef dequeuedBuffer;
-        std::tie(success, dequeuedBuffer) = mOutputQueue->dequeueBuffer();
-        if (!success) {
-            ALOGE("Failed to dequeue buffer from output queue.");
-            onError();
-            return;
+        if (mCorruptionCb && dequeuedBuffer->isError()) {
+            ALOGW("Failed to decode input buffer, bitstreamId=%d", id);
+            mCorruptionCb.Run(id);
         }
-        if (!dequeuedBuffer) break;
-
-        outputDequeued = true;
+    }
 
+    if (!mOutputQueue->dequeueBuffers(&dequeuedBuffers)) {
+        ALOGE("Failed to dequeue buffer from output queue.");
+        onError();
+        return;
+    }
+    const bool outputDequeued = !dequeuedBuffers.empty();
+    for (V4L2ReadableBufferRef& dequeuedBuffer : dequeuedBuffers) {
         const size_t bufferId = dequeuedBuffer->bufferId();
         const int32_t bitstreamId = static_cast<int32_t>(dequeuedBuffer->getTimeStamp().tv_sec);
         const size_t bytesUsed = dequeuedBuffer->getPlaneBytesUsed(0);
@@ -429,15 +544,31 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
         auto frame = std::move(it->second);
         mFrameAtDevice.erase(it);
 
-        if (bytesUsed > 0) {
+        // Bitstream ids increase monotonically, so frames with an id up to the last one queued
+        // before a flush were decoded from flushed input. Frames are returned in order, so no
+        // more flushed frames will follow once a newer frame is returned.
+        bool isFlushedFrame = false;
+        if (mLastFlushedBitstreamId) {
+            isFlushedFrame = bitstreamId <= *mLastFlushedBitstreamId;
+            if (!isFlushedFrame && bytesUsed > 0) mLastFlushedBitstreamId.reset();
+        }
+
+        // Corrupted frames are dropped if the client handles them, see setCorruptionCallback().
+        const bool isCorruptedFrame = mCorruptionCb && !isFlushedFrame && dequeuedBuffer->isError();
+
+        if (bytesUsed > 0 && !isFlushedFrame && !isCorruptedFrame) {
             ALOGV("Send output frame(bitstreamId=%d) to client", bitstreamId);
+            if (mLatencyTracker) mLatencyTracker->mark(bitstreamId, "dequeueOutput");
             frame->setBitstreamId(bitstreamId);
             frame->setVisibleRect(mVisibleRect);
             mOutputCb.Run(std::move(frame));
         } else {
             // Workaround(b/168750131): If the buffer is not enqueued before the next drain is done,
             // then the driver will fail to notify EOS. So we recycle the buffer immediately.
-            ALOGV("Recycle empty buffer %zu back to V4L2 output queue.", bufferId);
+            // Flushed and corrupted frames are dropped the same way.
+            ALOGV("Recycle %s buffer %zu back to V4L2 output queue.",
+                  isFlushedFrame ? "flushed" : (isCorruptedFrame ? "corrupted" : "empty"),
+                  bufferId);
             dequeuedBuffer.reset();
             auto outputBuffer = mOutputQueue->getFreeBuffer(bufferId);
             ALOG_ASSERT(outputBuffer, "V4L2 output queue slot %zu is not freed.", bufferId);
@@ -449,6 +580,10 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
             }
             mFrameAtDevice.insert(std::make_pair(bufferId, std::move(frame)));
         }
+        if (isCorruptedFrame) {
+            ALOGW("Dropped corrupted frame, bitstreamId=%d", bitstreamId);
+            mCorruptionCb.Run(bitstreamId);
+        }
 
         if (mDrainCb && isLast) {
             ALOGV("All buffers are drained.");
@@ -458,6 +593,10 @@ void V4L2Decoder::serviceDeviceTask(bool event) {
         }
     }
 
+    // Release the dequeued buffers before handling events, as changing resolution might
+    // reallocate the buffers.
+    dequeuedBuffers.clear();
+
     // Handle resolution change event.
     if (event && dequeueResolutionChangeEvent()) {
         if (!changeResolution()) {
@@ -502,10 +641,33 @@ bool V4L2Decoder::changeResolution() {
     if (!format || !numOutputBuffers) {
         return false;
     }
-    *numOutputBuffers = std::max(*numOutputBuffers, mMinNumOutputBuffers);
 
     const ui::Size codedSize(format->fmt.pix_mp.width, format->fmt.pix_mp.height);
-    if (!setupOutputFormat(codedSize)) {
+
+    // Keep the current output buffers if they can hold frames of the new resolution. This avoids
+    // reallocating all graphic buffers, which stalls playback when the resolution changes often
+    // (e.g. when using adaptive streaming).
+    if (canReuseOutputBuffers(codedSize, *numOutputBuffers)) {
+        mVisibleRect = getVisibleRect(mCodedSize);
+        ALOGI("Reusing %zu output buffers. stream coded size: %s, visible rect: %s",
+              mOutputQueue->allocatedBuffersCount(), toString(codedSize).c_str(),
+              toString(mVisibleRect).c_str());
+
+        // Restart streaming to resume decoding, all frames at the device will be returned to the
+        // frame pool and fetched again.
+        mOutputQueue->streamoff();
+        mFrameAtDevice.clear();
+        if (!mOutputQueue->streamon()) {
+            ALOGE("Failed to streamon output queue.");
+            return false;
+        }
+
+        tryFetchVideoFrame();
+        return true;
+    }
+
+    if (!setupOutputFormat(codedSize, format->fmt.pix_mp.pixelformat,
+                           mIsCompressedOutputAllowedCb.Run())) {
         return false;
     }
 
@@ -516,7 +678,7 @@ bool V4L2Decoder::changeResolution() {
     mCodedSize.set(adjustedFormat->fmt.pix_mp.width, adjustedFormat->fmt.pix_mp.height);
     mVisibleRect = getVisibleRect(mCodedSize);
 
-    ALOGI("Need %zu output buffers. coded size: %s, visible rect: %s", *numOutputBuffers,
+    ALOGI("Decoder needs %zu output buffers. coded size: %s, visible rect: %s", *numOutputBuffers,
           toString(mCodedSize).c_str(), toString(mVisibleRect).c_str());
     if (isEmpty(mCodedSize)) {
         ALOGE("Failed to get resolution from V4L2 driver.");
@@ -525,13 +687,25 @@ bool V4L2Decoder::changeResolution() {
 
     mOutputQueue->streamoff();
     mOutputQueue->deallocateBuffers();
+    mOutputFormat.reset();
     mFrameAtDevice.clear();
     mBlockIdToV4L2Id.clear();
 
+    // Release the previous VideoFramePool before getting a new one to guarantee only one pool
+    // exists at the same time. The pool determines how many buffers are used in total, so it's
+    // requested before allocating the V4L2 buffers.
+    mVideoFramePool.reset();
+    mVideoFramePool = mGetPoolCb.Run(mCodedSize, mOutputPixelFormat, &*numOutputBuffers);
+    if (!mVideoFramePool) {
+        ALOGE("Failed to get block pool with size: %s", toString(mCodedSize).c_str());
+        return false;
+    }
+
     const size_t adjustedNumOutputBuffers =
             mOutputQueue->allocateBuffers(*numOutputBuffers, V4L2_MEMORY_DMABUF);
-    if (adjustedNumOutputBuffers == 0) {
-        ALOGE("Failed to allocate output buffer.");
+    if (adjustedNumOutputBuffers < *numOutputBuffers) {
+        ALOGE("Failed to allocate %zu output buffers (allocated: %zu).", *numOutputBuffers,
+              adjustedNumOutputBuffers);
         return false;
     }
     ALOGV("Allocated %zu output buffers.", adjustedNumOutputBuffers);
@@ -539,39 +713,74 @@ bool V4L2Decoder::changeResolution() {
         ALOGE("Failed to streamon output queue.");
         return false;
     }
+    mOutputFormat = adjustedFormat;
 
-    // Release the previous VideoFramePool before getting a new one to guarantee only one pool
-    // exists at the same time.
-    mVideoFramePool.reset();
-    // Always use flexible pixel 420 format YCBCR_420_888 in Android.
-    mVideoFramePool =
-            mGetPoolCb.Run(mCodedSize, HalPixelFormat::YCBCR_420_888, adjustedNumOutputBuffers);
-    if (!mVideoFramePool) {
-        ALOGE("Failed to get block pool with size: %s", toString(mCodedSize).c_str());
+    tryFetchVideoFrame();
+    return true;
+}
+
+bool V4L2Decoder::canReuseOutputBuffers(const ui::Size& codedSize, size_t numOutputBuffers) {
+    ALOGV("%s(codedSize=%s, numOutputBuffers=%zu)", __func__, toString(codedSize).c_str(),
+          numOutputBuffers);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mVideoFramePool || !mOutputFormat) return false;
+    if (codedSize.width > mCodedSize.width || codedSize.height > mCodedSize.height ||
+        numOutputBuffers > mOutputQueue->allocatedBuffersCount()) {
         return false;
     }
 
-    tryFetchVideoFrame();
+    // Ask the device to keep using the current buffer layout. The frames in the VideoFramePool
+    // assume this layout, so we can only reuse the buffers if the device accepts it unchanged.
+    const struct v4l2_pix_format_mplane& current = mOutputFormat->fmt.pix_mp;
+    const std::optional<struct v4l2_format> format = mOutputQueue->setFormat(
+            current.pixelformat, mCodedSize, 0, current.plane_fmt[0].bytesperline);
+    if (!format) return false;
+
+    const struct v4l2_pix_format_mplane& adjusted = format->fmt.pix_mp;
+    if (adjusted.width != current.width || adjusted.height != current.height ||
+        adjusted.num_planes != current.num_planes) {
+        ALOGV("Device changed the buffer size, can't reuse output buffers");
+        return false;
+    }
+    for (size_t i = 0; i < adjusted.num_planes; ++i) {
+        if (adjusted.plane_fmt[i].bytesperline != current.plane_fmt[i].bytesperline ||
+            adjusted.plane_fmt[i].sizeimage > current.plane_fmt[i].sizeimage) {
+            ALOGV("Device changed the layout of plane %zu, can't reuse output buffers", i);
+            return false;
+        }
+    }
     return true;
 }
 
-bool V4L2Decoder::setupOutputFormat(const ui::Size& size) {
-    for (const uint32_t& pixfmt :
-         mDevice->enumerateSupportedPixelformats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)) {
-        if (pixfmt != Fourcc::NV12) continue;
-        if (std::find(kSupportedOutputFourccs.begin(), kSupportedOutputFourccs.end(), pixfmt) ==
-            kSupportedOutputFourccs.end()) {
-            ALOGD("Pixel format %s is not supported, skipping...", fourccToString(pixfmt).c_str());
-            continue;
+bool V4L2Decoder::setupOutputFormat(const ui::Size& size, uint32_t streamFourcc,
+                                    bool allowCompressed) {
+    const std::vector<uint32_t> pixfmts =
+            mDevice->enumerateSupportedPixelformats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    auto trySetFormat = [&](const OutputFormat& format) {
+        if (std::find(pixfmts.begin(), pixfmts.end(), format.fourcc) == pixfmts.end()) {
+            return false;
         }
-
-        if (mOutputQueue->setFormat(pixfmt, size, 0) != std::nullopt) {
-        ALOGV("Set pixel format %s", fourccToString(pixfmt).c_str());
-            return true;
+        if (mOutputQueue->setFormat(format.fourcc, size, 0) == std::nullopt) return false;
+
+        ALOGV("Set pixel format %s", fourccToString(format.fourcc).c_str());
+        mOutputPixelFormat = format.halPixelFormat;
+        setupScaledOutput(format.fourcc, size);
+        return true;
+    };
+
+    // After a resolution change the device selects a format matching the bit depth of the stream.
+    const bool tenBit = streamFourcc == Fourcc::P010;
+    if (allowCompressed && !tenBit) {
+        for (const OutputFormat& format : kCompressedOutputFormats) {
+            if (trySetFormat(format)) return true;
         }
     }
+    for (const OutputFormat& format : kSupportedOutputFormats) {
+        if ((format.fourcc == Fourcc::P010) == tenBit && trySetFormat(format)) return true;
+    }
 
-    ALOGE("Failed to find supported pixel format");
+    ALOGE("Failed to find supported pixel format for %s stream", tenBit ? "10-bit" : "8-bit");
     return false;
 }
 
@@ -593,7 +802,9 @@ void V4L2Decoder::tryFetchVideoFrame() {
     if (!mVideoFramePool->getVideoFrame(
                 ::base::BindOnce(&V4L2Decoder::onVideoFrameReady, mWeakThis))) {
         ALOGV("%s(): Previous callback is running, ignore.", __func__);
+        return;
     }
+    mFetchStartTime = std::chrono::steady_clock::now();
 }
 
 void V4L2Decoder::onVideoFrameReady(
@@ -606,6 +817,11 @@ void V4L2Decoder::onVideoFrameReady(
         onError();
         return;
     }
+    if (mLatencyTracker) {
+        mLatencyTracker->recordDuration(
+                "fetchWait", std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - mFetchStartTime));
+    }
 
     // Unwrap our arguments.
     std::unique_ptr<VideoFrame> frame;
@@ -668,6 +884,10 @@ std::optional<size_t> V4L2Decoder::getNumOutputBuffers() {
     }
     ALOGV("%s() V4L2_CID_MIN_BUFFERS_FOR_CAPTURE returns %u", __func__, ctrl.value);
 
+    if (MemoryPressureMonitor::getInstance()->isUnderPressure()) {
+        ALOGI("Allocating fewer output buffers under memory pressure");
+        return ctrl.value + kNumExtraOutputBuffersUnderPressure;
+    }
     return ctrl.value + kNumExtraOutputBuffers;
 }
 
@@ -686,6 +906,59 @@ std::optional<struct v4l2_format> V4L2Decoder::getFormatInfo() {
     return format;
 }
 
+bool V4L2Decoder::setupScaledOutput(uint32_t fourcc, const ui::Size& size) {
+    ALOGV("%s(size=%s)", __func__, toString(size).c_str());
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Frames are never upscaled.
+    if (isEmpty(mScaledOutputSize)) return false;
+    const ui::Size targetSize(std::min(mScaledOutputSize.width, size.width),
+                              std::min(mScaledOutputSize.height, size.height));
+    if (targetSize == size) return false;
+
+    // By the stateful decoder spec the CAPTURE format follows the coded size, so this only works
+    // on devices with a scaler on the CAPTURE queue, other devices keep the full resolution.
+    // Setting the CAPTURE format resets the compose rectangle, so the format is set first. The
+    // output buffers are sized from the format returned by the device.
+    const std::optional<struct v4l2_format> format =
+            mOutputQueue->setFormat(fourcc, targetSize, 0);
+    if (!format || format->fmt.pix_mp.width >= static_cast<uint32_t>(size.width) ||
+        format->fmt.pix_mp.height >= static_cast<uint32_t>(size.height)) {
+        ALOGV("Device can't scale output frames, using full resolution output");
+        mOutputQueue->setFormat(fourcc, size, 0);
+        return false;
+    }
+
+    // Scaling decoders expose the scaled frame through the compose rectangle of the CAPTURE
+    // queue. The device might adjust the rectangle to its scaling capabilities, so the result is
+    // read back.
+    struct v4l2_selection selection_arg;
+    memset(&selection_arg, 0, sizeof(selection_arg));
+    selection_arg.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection_arg.target = V4L2_SEL_TGT_COMPOSE;
+    selection_arg.r.width = targetSize.width;
+    selection_arg.r.height = targetSize.height;
+    if (mDevice->ioctl(VIDIOC_S_SELECTION, &selection_arg) != 0 ||
+        mDevice->ioctl(VIDIOC_G_SELECTION, &selection_arg) != 0) {
+        ALOGW("Device rejected scaled output size %s, using full resolution output",
+              toString(targetSize).c_str());
+        mOutputQueue->setFormat(fourcc, size, 0);
+        return false;
+    }
+    const ui::Size scaledSize(selection_arg.r.width, selection_arg.r.height);
+    if (isEmpty(scaledSize) || scaledSize.width > static_cast<int>(format->fmt.pix_mp.width) ||
+        scaledSize.height > static_cast<int>(format->fmt.pix_mp.height)) {
+        ALOGW("Device didn't accept scaled output size %s, using full resolution output",
+              toString(targetSize).c_str());
+        mOutputQueue->setFormat(fourcc, size, 0);
+        return false;
+    }
+
+    ALOGI("Scaling output frames from %s to %s", toString(size).c_str(),
+          toString(scaledSize).c_str());
+    return true;
+}
+
 Rect V4L2Decoder::getVisibleRect(const ui::Size& codedSize) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
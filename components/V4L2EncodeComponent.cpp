@@ -8,8 +8,10 @@
 #include <v4l2_codec2/components/V4L2EncodeComponent.h>
 
 #include <inttypes.h>
+#include <string.h>
 
 #include <algorithm>
+#include <string>
 #include <utility>
 
 #include <C2AllocatorGralloc.h>
@@ -18,7 +20,9 @@
 #include <android/hardware/graphics/common/1.0/types.h>
 #include <base/bind.h>
 #include <base/bind_helpers.h>
+#define ATRACE_TAG ATRACE_TAG_VIDEO
 #include <cutils/properties.h>
+#include <cutils/trace.h>
 #include <log/log.h>
 #include <media/stagefright/MediaDefs.h>
 #include <ui/GraphicBuffer.h>
@@ -27,10 +31,16 @@
 #include <v4l2_codec2/common/Common.h>
 #include <v4l2_codec2/common/EncodeHelpers.h>
 #include <v4l2_codec2/common/FormatConverter.h>
+#include <v4l2_codec2/common/LatencyTracker.h>
+#include <v4l2_codec2/common/MemoryTracker.h>
+#include <v4l2_codec2/common/SessionPriority.h>
+#include <v4l2_codec2/common/V4L2ComponentParams.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
 #include <v4l2_codec2/components/BitstreamBuffer.h>
 #include <v4l2_codec2/components/V4L2EncodeInterface.h>
 #include <v4l2_codec2/components/V4L2Encoder.h>
+#include <v4l2_codec2/components/WorkRecorder.h>
+#include <v4l2_codec2/plugin_store/DmabufHelpers.h>
 
 using android::hardware::graphics::common::V1_0::BufferUsage;
 
@@ -43,6 +53,30 @@ const VideoPixelFormat kInputPixelFormat = VideoPixelFormat::NV12;
 // The peak bitrate in function of the target bitrate, used when the bitrate mode is VBR.
 constexpr uint32_t kPeakBitrateMultiplier = 2u;
 
+// The maximum number of cached input buffer layouts. Producers normally cycle through a small set
+// of buffers, the cache is reset if a producer keeps allocating new ones.
+constexpr size_t kMaxCachedInputLayouts = 64;
+
+// The maximum number of finished work items reported to the listener in a single call.
+constexpr size_t kMaxBatchedWorks = 8;
+
+// When adapting the framerate to the input rate, the weight of the latest frame interval in the
+// smoothed interval the input rate is estimated from.
+constexpr double kFrameIntervalSmoothing = 0.25;
+// The range frame intervals are clamped to before smoothing, so a pause on static content doesn't
+// drop the framerate below 1fps, and timestamp jitter doesn't raise it above 120fps.
+constexpr int64_t kMinFrameIntervalUs = 1000000 / 120;
+constexpr int64_t kMaxFrameIntervalUs = 1000000;
+// The relative difference between the estimated and configured framerate required to reconfigure
+// the device, so it's not reconfigured on every frame.
+constexpr double kFramerateHysteresis = 0.2;
+
+// When skipping static frames, only every n-th row of the input frames is hashed to detect changes.
+constexpr uint32_t kStaticFrameHashRowStep = 4;
+// The maximum time between encoded frames when skipping static frames. An unchanged frame is still
+// encoded after this time, so receivers and rate control get regular updates on static content.
+constexpr int64_t kMaxStaticFrameIntervalUs = 1000000;
+
 // Get the video frame layout from the specified |inputBlock|.
 // TODO(dstaessens): Clean up code extracting layout from a C2GraphicBlock.
 std::optional<std::vector<VideoFramePlane>> getVideoFrameLayout(const C2ConstGraphicBlock& block,
@@ -101,6 +135,9 @@ std::optional<std::vector<VideoFramePlane>> getVideoFrameLayout(const C2ConstGra
 
         if (!crcb && !semiplanar) {
             *format = VideoPixelFormat::I420;
+        } else if (!crcb && semiplanar &&
+                   layout.planes[C2PlanarLayout::PLANE_Y].allocatedDepth > 8) {
+            *format = VideoPixelFormat::P016LE;
         } else if (!crcb && semiplanar) {
             *format = VideoPixelFormat::NV12;
         } else if (crcb && !semiplanar) {
@@ -146,8 +183,12 @@ std::optional<uint32_t> getVideoFrameStride(VideoPixelFormat format, ui::Size si
 
     // Android HAL format doesn't have I420, we use YV12 instead and swap the U and V planes when
     // converting to NV12. YCBCR_420_888 will allocate NV12 by minigbm.
-    HalPixelFormat halFormat = (format == VideoPixelFormat::I420) ? HalPixelFormat::YV12
-                                                                  : HalPixelFormat::YCBCR_420_888;
+    HalPixelFormat halFormat = HalPixelFormat::YCBCR_420_888;
+    if (format == VideoPixelFormat::I420) {
+        halFormat = HalPixelFormat::YV12;
+    } else if (format == VideoPixelFormat::P016LE) {
+        halFormat = HalPixelFormat::YCBCR_P010;
+    }
 
     std::shared_ptr<C2GraphicBlock> block;
     status = pool->fetchGraphicBlock(size.width, size.height, static_cast<uint32_t>(halFormat),
@@ -169,53 +210,70 @@ std::optional<uint32_t> getVideoFrameStride(VideoPixelFormat format, ui::Size si
     return planes.value()[0].mStride;
 }
 
-// Create an input frame from the specified graphic block.
-std::unique_ptr<V4L2Encoder::InputFrame> CreateInputFrame(const C2ConstGraphicBlock& block,
-                                                          uint64_t index, int64_t timestamp) {
-    VideoPixelFormat format;
-    std::optional<std::vector<VideoFramePlane>> planes = getVideoFrameLayout(block, &format);
-    if (!planes) {
-        ALOGE("Failed to get input block's layout");
-        return nullptr;
-    }
-
-    std::vector<int> fds;
-    const C2Handle* const handle = block.handle();
-    for (int i = 0; i < handle->numFds; i++) {
-        fds.emplace_back(handle->data[i]);
-    }
-
-    return std::make_unique<V4L2Encoder::InputFrame>(std::move(fds), std::move(planes.value()),
-                                                     format, index, timestamp);
-}
-
 // Check whether the specified |profile| is an H.264 profile.
 bool IsH264Profile(C2Config::profile_t profile) {
     return (profile >= C2Config::PROFILE_AVC_BASELINE &&
             profile <= C2Config::PROFILE_AVC_ENHANCED_MULTIVIEW_DEPTH_HIGH);
 }
 
-}  // namespace
+// Check whether the specified |profile| is an HEVC profile.
+bool IsHEVCProfile(C2Config::profile_t profile) {
+    return (profile >= C2Config::PROFILE_HEVC_MAIN &&
+            profile <= C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS);
+}
 
-// static
-std::atomic<int32_t> V4L2EncodeComponent::sConcurrentInstances = 0;
+// Check whether the specified |profile| allows B-frames. The H.264 baseline profiles don't.
+bool SupportsBFrames(C2Config::profile_t profile) {
+    if (profile == C2Config::PROFILE_AVC_BASELINE ||
+        profile == C2Config::PROFILE_AVC_CONSTRAINED_BASELINE) {
+        return false;
+    }
+    return IsH264Profile(profile) || IsHEVCProfile(profile);
+}
+
+// Compute a hash of every |kStaticFrameHashRowStep|-th row of the planes of |block|, used to detect
+// unchanged input frames. Returns std::nullopt if the block can't be mapped or its layout is
+// unknown.
+std::optional<uint64_t> getSampledFrameHash(const C2ConstGraphicBlock& block) {
+    const C2GraphicView view = block.map().get();
+    if (view.error() != C2_OK) {
+        ALOGE("Failed to map input block (error: %d)", view.error());
+        return std::nullopt;
+    }
+    const C2PlanarLayout& layout = view.layout();
+    if (layout.type == C2PlanarLayout::TYPE_UNKNOWN || layout.rootPlanes == 0) {
+        return std::nullopt;
+    }
+
+    // FNV-1a, applied to 64-bit words rather than bytes where possible.
+    constexpr uint64_t kPrime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < layout.rootPlanes; ++i) {
+        const C2PlaneInfo& plane = layout.planes[i];
+        const uint32_t rowBytes =
+                view.width() / plane.colSampling * plane.colInc - (plane.colInc - 1);
+        const uint32_t numRows = view.height() / plane.rowSampling;
+        for (uint32_t y = 0; y < numRows; y += kStaticFrameHashRowStep) {
+            const uint8_t* row = view.data()[i] + y * plane.rowInc;
+            uint32_t x = 0;
+            for (; x + sizeof(uint64_t) <= rowBytes; x += sizeof(uint64_t)) {
+                uint64_t word;
+                memcpy(&word, row + x, sizeof(word));
+                hash = (hash ^ word) * kPrime;
+            }
+            for (; x < rowBytes; ++x) hash = (hash ^ row[x]) * kPrime;
+        }
+    }
+    return hash;
+}
+
+}  // namespace
 
 // static
 std::shared_ptr<C2Component> V4L2EncodeComponent::create(
         C2String name, c2_node_id_t id, std::shared_ptr<C2ReflectorHelper> helper,
-        C2ComponentFactory::ComponentDeleter deleter) {
-    ALOGV("%s(%s)", __func__, name.c_str());
-
-    static const int32_t kMaxConcurrentInstances =
-            property_get_int32("ro.vendor.v4l2_codec2.encode_concurrent_instances", -1);
-
-    static std::mutex mutex;
-    std::lock_guard<std::mutex> lock(mutex);
-    if (kMaxConcurrentInstances >= 0 && sConcurrentInstances.load() >= kMaxConcurrentInstances) {
-        ALOGW("Cannot create additional encoder, maximum number of instances reached: %d",
-              kMaxConcurrentInstances);
-        return nullptr;
-    }
+        C2ComponentFactory::ComponentDeleter deleter, bool pooled) {
+    ALOGV("%s(%s, pooled=%d)", __func__, name.c_str(), pooled);
 
     auto interface = std::make_shared<V4L2EncodeInterface>(name, std::move(helper));
     if (interface->status() != C2_OK) {
@@ -223,19 +281,57 @@ std::shared_ptr<C2Component> V4L2EncodeComponent::create(
         return nullptr;
     }
 
-    return std::shared_ptr<C2Component>(new V4L2EncodeComponent(name, id, std::move(interface)),
-                                        deleter);
+    // Pooled components don't reserve any capacity, so idle instances can't cause real sessions to
+    // be rejected.
+    std::unique_ptr<V4L2AdmissionController::Session> admissionSession;
+    if (!pooled) {
+        admissionSession = V4L2AdmissionController::getInstance()->createSession(
+                V4L2Device::Type::kEncoder, *interface->getVideoCodec());
+        if (!admissionSession) {
+            ALOGW("Cannot create additional encoder, insufficient hardware capacity");
+            return nullptr;
+        }
+    }
+
+    // Opening the device is the most expensive part of starting the encoder, as it probes the
+    // device nodes. The output profile can still change, but not the codec the device is opened
+    // for. If this fails the encoder will simply try again when started.
+    scoped_refptr<V4L2Device> device;
+    if (pooled) device = V4L2Encoder::openDevice(interface->getOutputProfile());
+
+    auto component = std::shared_ptr<V4L2EncodeComponent>(
+            new V4L2EncodeComponent(name, id, std::move(interface), std::move(admissionSession)),
+            deleter);
+    component->mPrewarmedDevice = std::move(device);
+    return component;
 }
 
-V4L2EncodeComponent::V4L2EncodeComponent(C2String name, c2_node_id_t id,
-                                         std::shared_ptr<V4L2EncodeInterface> interface)
+V4L2EncodeComponent::V4L2EncodeComponent(
+        C2String name, c2_node_id_t id, std::shared_ptr<V4L2EncodeInterface> interface,
+        std::unique_ptr<V4L2AdmissionController::Session> admissionSession)
       : mName(name),
         mId(id),
         mInterface(std::move(interface)),
+        mAdmissionSession(std::move(admissionSession)),
+        mInFlightCounterName(name + ".worksInFlight"),
+        mLatencyTracker(std::make_shared<LatencyTracker>(name + ":" + std::to_string(id))),
+        mMemoryTracker(std::make_shared<MemoryTracker>(name + ":" + std::to_string(id))),
+        mRecorder(WorkRecorder::Create(name, id)),
         mComponentState(ComponentState::LOADED) {
     ALOGV("%s(%s)", __func__, name.c_str());
+}
+
+bool V4L2EncodeComponent::admit() {
+    ALOGV("%s()", __func__);
 
-    sConcurrentInstances.fetch_add(1, std::memory_order_relaxed);
+    if (mAdmissionSession) return true;
+    mAdmissionSession = V4L2AdmissionController::getInstance()->createSession(
+            V4L2Device::Type::kEncoder, *mInterface->getVideoCodec());
+    if (!mAdmissionSession) {
+        ALOGW("Cannot admit pooled encoder, insufficient hardware capacity");
+        return false;
+    }
+    return true;
 }
 
 V4L2EncodeComponent::~V4L2EncodeComponent() {
@@ -252,7 +348,6 @@ V4L2EncodeComponent::~V4L2EncodeComponent() {
         mEncoderThread.Stop();
     }
 
-    sConcurrentInstances.fetch_sub(1, std::memory_order_relaxed);
     ALOGV("%s(): done", __func__);
 }
 
@@ -267,14 +362,34 @@ c2_status_t V4L2EncodeComponent::start() {
         return C2_BAD_STATE;
     }
 
+    // Reserve the hardware capacity needed to encode the video at the requested framerate.
+    const ui::Size encodedSize = getEncodedSize(mInterface->getInputVisibleSize());
+    if (!mAdmissionSession->setLoad(
+                V4L2AdmissionController::getLoad(encodedSize, mInterface->getFramerate()))) {
+        ALOGE("Insufficient hardware capacity to encode %dx%d", encodedSize.width,
+              encodedSize.height);
+        return C2_NO_MEMORY;
+    }
+
     if (!mEncoderThread.Start()) {
         ALOGE("Failed to start encoder thread");
+        mAdmissionSession->setLoad(0);
         return C2_CORRUPTED;
     }
     mEncoderTaskRunner = mEncoderThread.task_runner();
     mWeakThis = mWeakThisFactory.GetWeakPtr();
+    if (mRecorder) mRecorder->recordStart(*intf(), mInterface->getParamsGeneration());
 
-    // Initialize the encoder on the encoder thread.
+    // Initialize the encoder on the encoder thread. When starting asynchronously the device is
+    // opened and configured while the client finishes its own setup, work queued in the meantime
+    // is handled once the encoder is initialized.
+    if (property_get_bool("ro.vendor.v4l2_codec2.async_start", false)) {
+        mEncoderTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2EncodeComponent::startTask, mWeakThis, nullptr,
+                                            nullptr));
+        setComponentState(ComponentState::RUNNING);
+        return C2_OK;
+    }
     ::base::WaitableEvent done;
     bool success = false;
     mEncoderTaskRunner->PostTask(
@@ -283,6 +398,7 @@ c2_status_t V4L2EncodeComponent::start() {
 
     if (!success) {
         ALOGE("Failed to initialize encoder");
+        mAdmissionSession->setLoad(0);
         return C2_CORRUPTED;
     }
 
@@ -311,6 +427,8 @@ c2_status_t V4L2EncodeComponent::stop() {
             FROM_HERE, ::base::BindOnce(&V4L2EncodeComponent::stopTask, mWeakThis, &done));
     done.Wait();
     mEncoderThread.Stop();
+    mAdmissionSession->setLoad(0);
+    if (mRecorder) mRecorder->recordStop();
 
     setComponentState(ComponentState::LOADED);
 
@@ -352,6 +470,13 @@ c2_status_t V4L2EncodeComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* co
         return C2_BAD_STATE;
     }
 
+    if (mRecorder) {
+        // Parameters configured by the client since the last work are recorded first, so they're
+        // applied before the work when replaying.
+        mRecorder->recordConfigChange(*intf(), mInterface->getParamsGeneration());
+        for (const std::unique_ptr<C2Work>& work : *items) mRecorder->recordWork(*work);
+    }
+
     while (!items->empty()) {
         mEncoderTaskRunner->PostTask(FROM_HERE,
                                      ::base::BindOnce(&V4L2EncodeComponent::queueTask, mWeakThis,
@@ -373,6 +498,7 @@ c2_status_t V4L2EncodeComponent::drain_nb(drain_mode_t mode) {
         return C2_BAD_STATE;
     }
 
+    if (mRecorder) mRecorder->recordDrain();
     mEncoderTaskRunner->PostTask(
             FROM_HERE, ::base::BindOnce(&V4L2EncodeComponent::drainTask, mWeakThis, mode));
     return C2_OK;
@@ -394,6 +520,7 @@ c2_status_t V4L2EncodeComponent::flush_sm(flush_mode_t mode,
     // be momentarily blocking but must return within 5ms, which should give us enough time to
     // immediately abandon all non-started work on the encoder thread. We can return all work that
     // can't be immediately discarded using onWorkDone() later.
+    if (mRecorder) mRecorder->recordFlush();
     ::base::WaitableEvent done;
     mEncoderTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&V4L2EncodeComponent::flushTask,
                                                              mWeakThis, &done, flushedWork));
@@ -440,8 +567,19 @@ void V4L2EncodeComponent::startTask(bool* success, ::base::WaitableEvent* done)
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    *success = initializeEncoder();
-    done->Signal();
+    const bool initialized = initializeEncoder();
+    if (done) {
+        *success = initialized;
+        done->Signal();
+        return;
+    }
+
+    // The component was started asynchronously, so the failure can only be reported through the
+    // listener.
+    if (!initialized) {
+        ALOGE("Failed to initialize encoder");
+        reportError(C2_CORRUPTED);
+    }
 }
 
 void V4L2EncodeComponent::stopTask(::base::WaitableEvent* done) {
@@ -451,7 +589,10 @@ void V4L2EncodeComponent::stopTask(::base::WaitableEvent* done) {
     // Flushing the encoder will abort all pending work.
     flush();
 
+    ALOGI("Encode latency: %s", mLatencyTracker->dump().c_str());
+
     mInputFormatConverter.reset();
+    mInputLayouts.clear();
 
     mEncoder.reset();
     mOutputBlockPool.reset();
@@ -465,7 +606,16 @@ void V4L2EncodeComponent::stopTask(::base::WaitableEvent* done) {
 void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
-    ALOG_ASSERT(mEncoder);
+
+    // The encoder might have failed to initialize when starting asynchronously. Report the error
+    // again in case it wasn't reported yet, and keep the work so it's returned to the client when
+    // flushing or stopping the component.
+    if (!mEncoder) {
+        ALOGE("Work queued while the encoder isn't initialized");
+        reportError(C2_CORRUPTED);
+        pushWork(std::move(work));
+        return;
+    }
 
     // Currently only a single worklet per work item is supported. An input buffer should always be
     // supplied unless this is a drain or CSD request.
@@ -481,6 +631,7 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     bool endOfStream = work->input.flags & C2FrameData::FLAG_END_OF_STREAM;
     ALOGV("Queuing next encode (index: %" PRIu64 ", timestamp: %" PRId64 ", EOS: %d)", index,
           timestamp, endOfStream);
+    mLatencyTracker->mark(index, "queue");
 
     // The codec 2.0 framework might queue an empty CSD request, but this is currently not
     // supported. We will return the CSD with the first encoded buffer work.
@@ -496,6 +647,18 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
         return;
     }
 
+    // If the client changed the input size the encoder's resolution needs to be changed first.
+    // Work queued in the meantime waits until the resolution change has completed.
+    if (!work->input.buffers.empty() && !mPendingVisibleSize &&
+        mInterface->getInputVisibleSize() != mVisibleSize) {
+        startResolutionChange();
+    }
+    if (mPendingVisibleSize) {
+        ALOGV("Waiting for resolution change to complete");
+        mInputConverterQueue.push(std::move(work));
+        return;
+    }
+
     // If conversion is required but no free buffers are available we queue the work item.
     if (mInputFormatConverter && !mInputFormatConverter->isReady()) {
         ALOGV("Input format convertor ran out of buffers");
@@ -508,6 +671,16 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
     if (!work->input.buffers.empty()) {
         C2ConstGraphicBlock inputBlock =
                 work->input.buffers.front()->data().graphicBlocks().front();
+        // Unchanged frames are dropped before conversion, their work is completed without output.
+        if (mSkipStaticFrames && !endOfStream && isStaticFrame(inputBlock, timestamp)) {
+            ALOGV("Skipping unchanged input frame (index: %" PRIu64 ")", index);
+            work->input.buffers.clear();
+            pushWork(std::move(work));
+            while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
+                reportWork(popFrontWork());
+            }
+            return;
+        }
         if (mInputFormatConverter) {
             ALOGV("Converting input block (index: %" PRIu64 ")", index);
             c2_status_t status = C2_CORRUPTED;
@@ -517,13 +690,14 @@ void V4L2EncodeComponent::queueTask(std::unique_ptr<C2Work> work) {
                 reportError(status);
                 return;
             }
+            mLatencyTracker->mark(index, "convert");
         }
-        if (!encode(inputBlock, index, timestamp)) {
+        if (!encode(inputBlock, index, timestamp, getQpOffsetRects(*work))) {
             return;
         }
     }
 
-    mWorkQueue.push_back(std::move(work));
+    pushWork(std::move(work));
     if (endOfStream) {
         mEncoder->drain();
     }
@@ -547,8 +721,11 @@ void V4L2EncodeComponent::drainTask(drain_mode_t /*drainMode*/) {
     if (!mWorkQueue.empty()) {
         ALOGV("Starting drain and marking last item in output work queue as EOS");
         C2Work* work = mWorkQueue.back().get();
-        work->input.flags = static_cast<C2FrameData::flags_t>(work->input.flags |
-                                                              C2FrameData::FLAG_END_OF_STREAM);
+        if (!(work->input.flags & C2FrameData::FLAG_END_OF_STREAM)) {
+            work->input.flags = static_cast<C2FrameData::flags_t>(work->input.flags |
+                                                                  C2FrameData::FLAG_END_OF_STREAM);
+            mEOSWorks.push(work);
+        }
         mEncoder->drain();
     }
 }
@@ -556,7 +733,6 @@ void V4L2EncodeComponent::drainTask(drain_mode_t /*drainMode*/) {
 void V4L2EncodeComponent::onDrainDone(bool success) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
-    ALOG_ASSERT(!mWorkQueue.empty());
 
     if (!success) {
         ALOGE("draining the encoder failed");
@@ -564,21 +740,32 @@ void V4L2EncodeComponent::onDrainDone(bool success) {
         return;
     }
 
-    // Find the first work item marked as EOS. This might not be the first item in the queue, as
+    // The encoder was drained to change its resolution. The encoder is still handling the drain,
+    // so the resolution is changed in a separate task.
+    if (mPendingVisibleSize && mEOSWorks.empty()) {
+        mEncoderTaskRunner->PostTask(
+                FROM_HERE,
+                ::base::BindOnce(&V4L2EncodeComponent::completeResolutionChange, mWeakThis));
+        return;
+    }
+    ALOG_ASSERT(!mWorkQueue.empty());
+
+    // Get the first work item marked as EOS. This might not be the first item in the queue, as
     // previous buffers in the queue might still be waiting for their associated input buffers.
-    auto it = std::find_if(
-            mWorkQueue.cbegin(), mWorkQueue.cend(), [](const std::unique_ptr<C2Work>& work) {
-                return ((work->input.flags & C2FrameData::FLAG_END_OF_STREAM) &&
-                        !(work->worklets.back()->output.flags & C2FrameData::FLAG_END_OF_STREAM));
-            });
-    if (it == mWorkQueue.end()) {
+    if (mEOSWorks.empty()) {
         ALOGW("No EOS work item found in queue");
         return;
     }
 
     // Mark the item in the output work queue as EOS done.
-    C2Work* eosWork = it->get();
-    eosWork->worklets.back()->output.flags = C2FrameData::FLAG_END_OF_STREAM;
+    C2Work* eosWork = mEOSWorks.front();
+    mEOSWorks.pop();
+    eosWork->worklets.back()->output.flags = static_cast<C2FrameData::flags_t>(
+            eosWork->worklets.back()->output.flags | C2FrameData::FLAG_END_OF_STREAM);
+
+    // If a resolution change was requested while draining, the drain requested for it might have
+    // been merged with this one. Drain again so frames queued since are also encoded.
+    if (mPendingVisibleSize && mEOSWorks.empty()) mEncoder->drain();
 
     // Draining is done which means all buffers on the device output queue have been returned, but
     // not all buffers on the device input queue might have been returned yet.
@@ -588,8 +775,7 @@ void V4L2EncodeComponent::onDrainDone(bool success) {
     }
 
     ALOGV("Draining done");
-    reportWork(std::move(mWorkQueue.front()));
-    mWorkQueue.pop_front();
+    reportWork(popFrontWork());
 }
 
 void V4L2EncodeComponent::flushTask(::base::WaitableEvent* done,
@@ -616,6 +802,7 @@ void V4L2EncodeComponent::setListenerTask(const std::shared_ptr<Listener>& liste
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
+    if (mListener) flushFinishedWorks();
     mListener = listener;
     done->Signal();
 }
@@ -627,22 +814,32 @@ bool V4L2EncodeComponent::initializeEncoder() {
     ALOG_ASSERT(!mEncoder);
 
     mLastFrameTime = std::nullopt;
+    mFrameIntervalUs.reset();
+    mFramerate = 0;
+    mAdaptiveFramerate =
+            property_get_bool("ro.vendor.v4l2_codec2.encode_adaptive_framerate", false);
+    mLastFrameHash.reset();
+    mLastEncodedFrameTime.reset();
+    mSkipStaticFrames =
+            property_get_bool("ro.vendor.v4l2_codec2.encode_skip_static_frames", false);
 
     // Get the requested profile and level.
     C2Config::profile_t outputProfile = mInterface->getOutputProfile();
 
-    // CSD only needs to be extracted when using an H.264 profile.
-    mExtractCSD = IsH264Profile(outputProfile);
+    // CSD only needs to be extracted when using an H.264 or HEVC profile.
+    mExtractCSD = IsH264Profile(outputProfile) || IsHEVCProfile(outputProfile);
 
-    std::optional<uint8_t> h264Level;
-    if (IsH264Profile(outputProfile)) {
-        h264Level = c2LevelToV4L2Level(mInterface->getOutputLevel());
+    std::optional<uint8_t> level;
+    if (IsH264Profile(outputProfile) || IsHEVCProfile(outputProfile)) {
+        level = c2LevelToV4L2Level(mInterface->getOutputLevel());
     }
 
+    // Input frames are scaled if the client requested a smaller encoded size.
+    const ui::Size encodedSize = getEncodedSize(mInterface->getInputVisibleSize());
+
     // Get the stride used by the C2 framework, as this might be different from the stride used by
     // the V4L2 encoder.
-    std::optional<uint32_t> stride =
-            getVideoFrameStride(kInputPixelFormat, mInterface->getInputVisibleSize());
+    std::optional<uint32_t> stride = getVideoFrameStride(kInputPixelFormat, encodedSize);
 
     stride = 32;
     if (!stride) {
@@ -651,35 +848,74 @@ bool V4L2EncodeComponent::initializeEncoder() {
         return false;
     }
 
+    mVisibleSize = mInterface->getInputVisibleSize();
+    mInputStride = *stride;
+    mPendingVisibleSize.reset();
+
     // Get the requested bitrate mode and bitrate. The C2 framework doesn't offer a parameter to
     // configure the peak bitrate, so we use a multiple of the target bitrate.
     mBitrateMode = mInterface->getBitrateMode();
     mBitrate = mInterface->getBitrate();
+    mNumTemporalLayers = mInterface->getTemporalLayerCount();
+    mNumLongTermRefs = mInterface->getLongTermReferenceCount();
+    mTemporalLayerBitrates.clear();
+    mQuality.reset();
+    mQpRange.reset();
+    mAppliedParamsGeneration.reset();
+    mMaxOutputTimestamp.reset();
+
+    // B-frames delay the output of the frames they reference, so they're not used in low-latency
+    // mode. They're also not combined with layering and long-term references.
+    uint32_t numBFrames = mInterface->getBFrameCount();
+    if (numBFrames > 0 && (mInterface->isLowLatencyMode() || mNumTemporalLayers > 1 ||
+                           mNumLongTermRefs > 0 || !SupportsBFrames(outputProfile))) {
+        ALOGW("Ignoring request for %u B-frames", numBFrames);
+        numBFrames = 0;
+    }
+
+    // Use deeper device queues for higher pixel rates, so the device doesn't sit idle while we're
+    // returning buffers. With B-frames the device holds on to the reference frames until the
+    // B-frames in between have been encoded, so it needs at least two more input buffers.
+    const size_t queueDepth =
+            std::max(V4L2Encoder::getQueueDepth(encodedSize, mInterface->getFramerate()),
+                     static_cast<size_t>(numBFrames) + 2);
+    ALOGV("Using a device queue depth of %zu", queueDepth);
+    mQueueDepth = queueDepth;
+    mLowLatencyMode = mInterface->isLowLatencyMode();
+    setCurrentThreadPriority(mInterface->isRealTimePriority() ? SessionPriority::REALTIME
+                                                               : SessionPriority::BACKGROUND);
 
     mEncoder = V4L2Encoder::create(
-            outputProfile, h264Level, mInterface->getInputVisibleSize(), *stride,
+            outputProfile, level, encodedSize, *stride,
             mInterface->getKeyFramePeriod(), mBitrateMode, mBitrate,
-            mBitrate * kPeakBitrateMultiplier,
+            mBitrate * kPeakBitrateMultiplier, mNumTemporalLayers, mNumLongTermRefs, numBFrames,
+            mInterface->getIntraRefreshPeriod(), queueDepth, mLowLatencyMode,
             ::base::BindRepeating(&V4L2EncodeComponent::fetchOutputBlock, mWeakThis),
             ::base::BindRepeating(&V4L2EncodeComponent::onInputBufferDone, mWeakThis),
             ::base::BindRepeating(&V4L2EncodeComponent::onOutputBufferDone, mWeakThis),
             ::base::BindRepeating(&V4L2EncodeComponent::onDrainDone, mWeakThis),
             ::base::BindRepeating(&V4L2EncodeComponent::reportError, mWeakThis, C2_CORRUPTED),
-            mEncoderTaskRunner);
+            mEncoderTaskRunner, std::move(mPrewarmedDevice));
     if (!mEncoder) {
         ALOGE("Failed to create V4L2Encoder (profile: %s)", profileToString(outputProfile));
         return false;
     }
+    mEncoder->setLatencyTracker(mLatencyTracker);
+    mNumBFrames = mEncoder->numBFrames();
 
     // Add an input format convertor if the device doesn't support the requested input format.
     ALOGV("Creating input format convertor (%s)",
           videoPixelFormatToString(mEncoder->inputFormat()).c_str());
     mInputFormatConverter =
-            FormatConverter::Create(mEncoder->inputFormat(), mEncoder->visibleSize(),
-                                    V4L2Encoder::kInputBufferCount, mEncoder->codedSize());
+            FormatConverter::Create(mEncoder->inputFormat(), mVisibleSize, mEncoder->visibleSize(),
+                                    queueDepth, mEncoder->codedSize());
     if (!mInputFormatConverter) {
         ALOGE("Failed to created input format convertor");
+        // Frames can't be scaled without format convertor.
+        if (mVisibleSize != mEncoder->visibleSize()) return false;
         //return false;
+    } else {
+        mInputFormatConverter->setMemoryTracker(mMemoryTracker);
     }
 
     return true;
@@ -689,6 +925,12 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
+    // The parameters only need to be queried and applied again if the client configured the
+    // interface since they were last applied. The generation is read first, so changes configured
+    // while updating are applied with the next frame.
+    const uint64_t paramsGeneration = mInterface->getParamsGeneration();
+    if (mAppliedParamsGeneration == paramsGeneration) return true;
+
     // Ask device to change bitrate if it's different from the currently configured bitrate. The C2
     // framework doesn't offer a parameter to configure the peak bitrate, so we'll use a multiple of
     // the target bitrate here. The peak bitrate is only used if the bitrate mode is set to VBR.
@@ -710,6 +952,48 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
         }
     //}
 
+    // Update the quality targeted in constant quality mode and the QP range the rate controller is
+    // restricted to. Both are optional, the device's own settings are used on failure.
+    if (mBitrateMode == C2Config::BITRATE_IGNORE) {
+        const uint32_t quality = mInterface->getQuality();
+        if (mQuality != quality) {
+            ALOGV("Setting constant quality to %u", quality);
+            if (!mEncoder->setConstantQuality(quality)) {
+                ALOGW("Failed to set constant quality to %u", quality);
+            }
+            mQuality = quality;
+        }
+    }
+    const std::optional<std::pair<uint32_t, uint32_t>> qpRange = mInterface->getQpRange();
+    if (qpRange && mQpRange != qpRange) {
+        ALOGV("Setting QP range to [%u, %u]", qpRange->first, qpRange->second);
+        mEncoder->setQpRange(qpRange->first, qpRange->second);
+        mQpRange = qpRange;
+    }
+
+    // Distribute the bitrate over the temporal layers. The requested ratios are cumulative, layers
+    // without a requested ratio share the remaining bitrate equally.
+    if (mNumTemporalLayers > 1) {
+        std::vector<float> ratios = mInterface->getTemporalLayerBitrateRatios();
+        const size_t numKnownRatios = ratios.size();
+        const float knownRatio = ratios.empty() ? 0.f : ratios.back();
+        const float remainingShare = (1.f - knownRatio) / (mNumTemporalLayers - numKnownRatios);
+        for (size_t i = numKnownRatios; i < mNumTemporalLayers; ++i) {
+            ratios.push_back(knownRatio + remainingShare * (i - numKnownRatios + 1));
+        }
+        std::vector<uint32_t> layerBitrates;
+        float previousRatio = 0.f;
+        for (float ratio : ratios) {
+            layerBitrates.push_back(static_cast<uint32_t>(bitrate * (ratio - previousRatio)));
+            previousRatio = ratio;
+        }
+        if (layerBitrates != mTemporalLayerBitrates) {
+            ALOGV("Setting temporal layer bitrates");
+            mEncoder->setTemporalLayerBitrates(layerBitrates);
+            mTemporalLayerBitrates = std::move(layerBitrates);
+        }
+    }
+
     // Ask device to change framerate if it's different from the currently configured framerate.
     //uint32_t framerate = static_cast<uint32_t>(std::round(mInterface->getFramerate()));
     // if (mFramerate != framerate) {
@@ -735,8 +1019,7 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
     if (requestKeyFrame.value == C2_TRUE) {
         mEncoder->requestKeyframe();
         requestKeyFrame.value = C2_FALSE;
-        std::vector<std::unique_ptr<C2SettingResult>> failures;
-        status = mInterface->config({&requestKeyFrame}, C2_MAY_BLOCK, &failures);
+        status = mInterface->resetRequests({&requestKeyFrame});
         if (status != C2_OK) {
             ALOGE("Failed to reset key frame request on interface (error code: %d)", status);
             reportError(status);
@@ -744,10 +1027,190 @@ bool V4L2EncodeComponent::updateEncodingParameters() {
         }
     }
 
+    // Check whether the next frame should be marked as long-term reference, or should only be
+    // predicted from long-term references. Both requests are reset once passed to the encoder.
+    if (mNumLongTermRefs > 0) {
+        C2StreamV4L2MarkLongTermReferenceTuning::output markLongTermRef;
+        C2StreamV4L2UseLongTermReferencesTuning::output useLongTermRefs;
+        status = mInterface->query({&markLongTermRef, &useLongTermRefs}, {}, C2_DONT_BLOCK,
+                                   nullptr);
+        if (status != C2_OK) {
+            ALOGE("Failed to query interface for long-term reference requests (error code: %d)",
+                  status);
+            reportError(status);
+            return false;
+        }
+        std::vector<C2Param*> resetParams;
+        if (markLongTermRef.value >= 0) {
+            mEncoder->markLongTermReference(static_cast<uint32_t>(markLongTermRef.value));
+            markLongTermRef.value = -1;
+            resetParams.push_back(&markLongTermRef);
+        }
+        if (useLongTermRefs.value != 0) {
+            mEncoder->useLongTermReferences(useLongTermRefs.value);
+            useLongTermRefs.value = 0;
+            resetParams.push_back(&useLongTermRefs);
+        }
+        if (!resetParams.empty()) {
+            status = mInterface->resetRequests(resetParams);
+            if (status != C2_OK) {
+                ALOGE("Failed to reset long-term reference requests (error code: %d)", status);
+                reportError(status);
+                return false;
+            }
+        }
+    }
+
+    mAppliedParamsGeneration = paramsGeneration;
     return true;
 }
 
-bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int64_t timestamp) {
+void V4L2EncodeComponent::startResolutionChange() {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(!mPendingVisibleSize);
+
+    mPendingVisibleSize = mInterface->getInputVisibleSize();
+    ALOGV("%s(): changing resolution from %s to %s", __func__, toString(mVisibleSize).c_str(),
+          toString(*mPendingVisibleSize).c_str());
+
+    // If no work is being encoded the resolution can be changed right away, otherwise we need to
+    // wait until all frames encoded at the current resolution have been returned.
+    if (mWorkQueue.empty()) {
+        completeResolutionChange();
+        return;
+    }
+    mEncoder->drain();
+}
+
+void V4L2EncodeComponent::completeResolutionChange() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // The resolution change might have been aborted by flushing the encoder.
+    if (!mPendingVisibleSize) return;
+    const ui::Size visibleSize = *mPendingVisibleSize;
+    const ui::Size encodedSize = getEncodedSize(visibleSize);
+
+    // The encoder returns all remaining input buffers, the converted blocks are returned to the
+    // format convertor which can then be recreated for the new coded size. The device is kept open.
+    // The stride of the input blocks depends on the size, so it needs to be queried again.
+    std::optional<uint32_t> stride = getVideoFrameStride(kInputPixelFormat, encodedSize);
+    if (!stride) {
+        ALOGE("Failed to get video frame stride");
+        mPendingVisibleSize.reset();
+        reportError(C2_CORRUPTED);
+        return;
+    }
+    mInputStride = *stride;
+    if (!mEncoder->changeResolution(encodedSize, mInputStride)) {
+        ALOGE("Failed to change resolution to %s", toString(encodedSize).c_str());
+        mPendingVisibleSize.reset();
+        reportError(C2_CORRUPTED);
+        return;
+    }
+    mVisibleSize = visibleSize;
+    mPendingVisibleSize.reset();
+    mInputLayouts.clear();
+    // Apply the dynamic parameters again, as they might depend on the resolution.
+    mAppliedParamsGeneration.reset();
+    if (mInputFormatConverter) {
+        mInputFormatConverter = FormatConverter::Create(mEncoder->inputFormat(), mVisibleSize,
+                                                        mEncoder->visibleSize(), mQueueDepth,
+                                                        mEncoder->codedSize());
+        if (!mInputFormatConverter) {
+            ALOGE("Failed to recreate input format convertor");
+            reportError(C2_CORRUPTED);
+            return;
+        }
+        mInputFormatConverter->setMemoryTracker(mMemoryTracker);
+    }
+
+    // Submit the new parameter sets to the client with the next output buffer.
+    const C2Config::profile_t outputProfile = mInterface->getOutputProfile();
+    mExtractCSD = IsH264Profile(outputProfile) || IsHEVCProfile(outputProfile);
+
+    // Update the reserved hardware capacity. The session keeps running if the capacity is exceeded,
+    // as would happen if the framerate was raised.
+    if (!mAdmissionSession->setLoad(
+                V4L2AdmissionController::getLoad(encodedSize, mInterface->getFramerate()))) {
+        ALOGW("Insufficient hardware capacity to encode %s", toString(encodedSize).c_str());
+    }
+
+    // Queue the work that was waiting for the resolution change, in order. If the client requested
+    // another resolution change in the meantime, start it before queueing more work.
+    while (!mInputConverterQueue.empty() && !mPendingVisibleSize &&
+           (!mInputFormatConverter || mInputFormatConverter->isReady())) {
+        if (mInterface->getInputVisibleSize() != mVisibleSize) {
+            startResolutionChange();
+            break;
+        }
+        std::unique_ptr<C2Work> work = std::move(mInputConverterQueue.front());
+        mInputConverterQueue.pop();
+        queueTask(std::move(work));
+    }
+}
+
+bool V4L2EncodeComponent::isStaticFrame(const C2ConstGraphicBlock& block, int64_t timestamp) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    // A requested key frame is never skipped, the request is handled when the frame is encoded. A
+    // key frame can only have been requested if the parameters changed since they were applied.
+    if (mAppliedParamsGeneration != mInterface->getParamsGeneration()) {
+        C2StreamRequestSyncFrameTuning::output requestKeyFrame;
+        if (mInterface->query({&requestKeyFrame}, {}, C2_DONT_BLOCK, nullptr) != C2_OK ||
+            requestKeyFrame.value == C2_TRUE) {
+            mLastFrameHash.reset();
+            return false;
+        }
+    }
+
+    std::optional<uint64_t> hash = getSampledFrameHash(block);
+    if (hash && hash == mLastFrameHash && mLastEncodedFrameTime &&
+        timestamp >= *mLastEncodedFrameTime &&
+        timestamp - *mLastEncodedFrameTime < kMaxStaticFrameIntervalUs) {
+        return true;
+    }
+
+    mLastFrameHash = hash;
+    mLastEncodedFrameTime = timestamp;
+    return false;
+}
+
+bool V4L2EncodeComponent::adaptFramerate(int64_t timestamp) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mLastFrameTime || timestamp <= *mLastFrameTime) return true;
+
+    const double interval = static_cast<double>(
+            std::clamp(timestamp - *mLastFrameTime, kMinFrameIntervalUs, kMaxFrameIntervalUs));
+    if (mFrameIntervalUs) {
+        *mFrameIntervalUs += kFrameIntervalSmoothing * (interval - *mFrameIntervalUs);
+    } else {
+        mFrameIntervalUs = interval;
+    }
+
+    const uint32_t framerate =
+            std::max(static_cast<uint32_t>(std::round(1000000.0 / *mFrameIntervalUs)), 1u);
+    const double difference = std::abs(static_cast<double>(framerate) - mFramerate);
+    if (mFramerate > 0 && difference <= kFramerateHysteresis * mFramerate) return true;
+
+    // The device derives the per-frame bit budget from the bitrate and framerate, so this keeps the
+    // budget in line with the rate frames are actually produced at.
+    ALOGV("Adapting framerate from %u to %u based on frame timestamps", mFramerate, framerate);
+    if (!mEncoder->setFramerate(framerate)) {
+        ALOGE("Requesting framerate change failed");
+        reportError(C2_CORRUPTED);
+        return false;
+    }
+    mFramerate = framerate;
+    mInterface->setFramerate(framerate);
+    return true;
+}
+
+bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int64_t timestamp,
+                                 std::vector<VideoEncoder::QpOffsetRect> qpOffsetRects) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(mEncoder);
@@ -757,7 +1220,9 @@ bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int6
 
     // Dynamically adjust framerate based on the frame's timestamp if required.
     constexpr int64_t kMaxFramerateDiff = 5;
-    if (mLastFrameTime && (timestamp > *mLastFrameTime)) {
+    if (mAdaptiveFramerate) {
+        if (!adaptFramerate(timestamp)) return false;
+    } else if (mLastFrameTime && (timestamp > *mLastFrameTime)) {
         int64_t newFramerate = std::max(
                 static_cast<int64_t>(std::round(1000000.0 / (timestamp - *mLastFrameTime))), static_cast<int64_t>(1));
         if (abs(mFramerate - newFramerate) > kMaxFramerateDiff) {
@@ -771,7 +1236,7 @@ bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int6
     if (!updateEncodingParameters()) return false;
 
     // Create an input frame from the graphic block.
-    std::unique_ptr<V4L2Encoder::InputFrame> frame = CreateInputFrame(block, index, timestamp);
+    std::unique_ptr<VideoEncoder::InputFrame> frame = createInputFrame(block, index, timestamp);
     if (!frame) {
         ALOGE("Failed to create video frame from input block (index: %" PRIu64
               ", timestamp: %" PRId64 ")",
@@ -779,6 +1244,7 @@ bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int6
         reportError(C2_CORRUPTED);
         return false;
     }
+    frame->setQpOffsetRects(std::move(qpOffsetRects));
 
     if (!mEncoder->encode(std::move(frame))) {
         return false;
@@ -787,11 +1253,112 @@ bool V4L2EncodeComponent::encode(C2ConstGraphicBlock block, uint64_t index, int6
     return true;
 }
 
+std::vector<VideoEncoder::QpOffsetRect> V4L2EncodeComponent::getQpOffsetRects(
+        const C2Work& work) {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    const C2StreamV4L2RoiRectsInfo::output* roiRects = nullptr;
+    for (const std::unique_ptr<C2Param>& param : work.input.configUpdate) {
+        if (param && param->type() == C2StreamV4L2RoiRectsInfo::output::PARAM_TYPE) {
+            roiRects = C2StreamV4L2RoiRectsInfo::output::From(param.get());
+        }
+    }
+
+    std::vector<std::unique_ptr<C2Param>> heapParams;
+    if (!roiRects) {
+        c2_status_t status = mInterface->query(
+                {}, {C2StreamV4L2RoiRectsInfo::output::PARAM_TYPE}, C2_DONT_BLOCK, &heapParams);
+        if (status != C2_OK || heapParams.empty()) return {};
+        roiRects = C2StreamV4L2RoiRectsInfo::output::From(heapParams.front().get());
+    }
+    if (!roiRects) return {};
+
+    // The regions are specified in input frame coordinates, scale them to the encoded frames.
+    const ui::Size& encodedSize = mEncoder->visibleSize();
+    const auto scaleX = [&](uint32_t x) {
+        return static_cast<uint32_t>(static_cast<uint64_t>(x) * encodedSize.width /
+                                     mVisibleSize.width);
+    };
+    const auto scaleY = [&](uint32_t y) {
+        return static_cast<uint32_t>(static_cast<uint64_t>(y) * encodedSize.height /
+                                     mVisibleSize.height);
+    };
+
+    std::vector<VideoEncoder::QpOffsetRect> rects;
+    for (size_t i = 0; i < roiRects->flexCount(); ++i) {
+        const C2V4L2RoiRectStruct& rect = roiRects->m.values[i];
+        if (rect.width == 0 || rect.height == 0) continue;
+        rects.push_back({scaleX(rect.left), scaleY(rect.top), std::max(scaleX(rect.width), 1u),
+                         std::max(scaleY(rect.height), 1u), rect.qpOffset});
+    }
+    return rects;
+}
+
+ui::Size V4L2EncodeComponent::getEncodedSize(const ui::Size& inputSize) const {
+    const ui::Size scaledSize = mInterface->getScaledOutputSize();
+    if (scaledSize.width <= 0 || scaledSize.height <= 0) return inputSize;
+    if (scaledSize.width > inputSize.width || scaledSize.height > inputSize.height) {
+        ALOGW("Ignoring scaled output size %s larger than input size %s",
+              toString(scaledSize).c_str(), toString(inputSize).c_str());
+        return inputSize;
+    }
+    return scaledSize;
+}
+
+std::unique_ptr<VideoEncoder::InputFrame> V4L2EncodeComponent::createInputFrame(
+        const C2ConstGraphicBlock& block, uint64_t index, int64_t timestamp) {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    const C2Handle* const handle = block.handle();
+    std::vector<int> fds;
+    for (int i = 0; i < handle->numFds; i++) {
+        fds.emplace_back(handle->data[i]);
+    }
+
+    // The dmabuf id stays the same when the producer sends the same buffer again, in which case
+    // the layout doesn't need to be derived again. The dimensions are checked as well, in case a
+    // buffer was reallocated.
+    std::optional<unique_id_t> dmabufId;
+    if (!fds.empty()) dmabufId = getDmabufId(fds[0]);
+    if (dmabufId) {
+        auto it = mInputLayouts.find(*dmabufId);
+        if (it != mInputLayouts.end() && it->second.width == block.width() &&
+            it->second.height == block.height()) {
+            std::vector<VideoFramePlane> planes = it->second.planes;
+            return std::make_unique<VideoEncoder::InputFrame>(
+                    std::move(fds), std::move(planes), it->second.format, index, timestamp,
+                    dmabufId);
+        }
+    }
+
+    VideoPixelFormat format;
+    std::optional<std::vector<VideoFramePlane>> planes = getVideoFrameLayout(block, &format);
+    if (!planes) {
+        ALOGE("Failed to get input block's layout");
+        return nullptr;
+    }
+
+    if (dmabufId) {
+        if (mInputLayouts.size() >= kMaxCachedInputLayouts) {
+            ALOGV("Too many different input buffers, resetting layout cache");
+            mInputLayouts.clear();
+        }
+        mInputLayouts[*dmabufId] = {block.width(), block.height(), format, planes.value()};
+    }
+
+    return std::make_unique<VideoEncoder::InputFrame>(std::move(fds), std::move(planes.value()),
+                                                      format, index, timestamp, dmabufId);
+}
+
 void V4L2EncodeComponent::flush() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    mEncoder->flush();
+    if (mEncoder) mEncoder->flush();
+    mLatencyTracker->clear();
+
+    // Report the finished work items first, the client expects them to be reported in order.
+    flushFinishedWorks();
 
     // Report all queued work items as aborted.
     std::list<std::unique_ptr<C2Work>> abortedWorkItems;
@@ -803,7 +1370,7 @@ void V4L2EncodeComponent::flush() {
         mInputConverterQueue.pop();
     }
     while (!mWorkQueue.empty()) {
-        std::unique_ptr<C2Work> work = std::move(mWorkQueue.front());
+        std::unique_ptr<C2Work> work = popFrontWork();
         // Return buffer to the input format convertor if required.
         if (mInputFormatConverter && work->input.buffers.empty()) {
             mInputFormatConverter->returnBlock(work->input.ordinal.frameIndex.peeku());
@@ -811,8 +1378,17 @@ void V4L2EncodeComponent::flush() {
         work->result = C2_NOT_FOUND;
         work->input.buffers.clear();
         abortedWorkItems.push_back(std::move(work));
-        mWorkQueue.pop_front();
     }
+    mEOSWorks = {};
+    mMaxOutputTimestamp.reset();
+    // Timestamps are discontinuous after a flush, the input rate is estimated again from scratch.
+    mLastFrameTime.reset();
+    mFrameIntervalUs.reset();
+    mLastFrameHash.reset();
+    mLastEncodedFrameTime.reset();
+    // A pending resolution change is restarted when the next work is queued, as the encoder isn't
+    // going to finish draining.
+    mPendingVisibleSize.reset();
     if (!abortedWorkItems.empty()) {
         mListener->onWorkDone_nb(weak_from_this(), std::move(abortedWorkItems));
     }
@@ -832,6 +1408,20 @@ void V4L2EncodeComponent::fetchOutputBlock(uint32_t size,
         reportError(status);
     }
 
+    // Account the block until the last reference to it is dropped, by wrapping it in a shared
+    // pointer whose deleter releases the original reference.
+    if (block) {
+        const int64_t capacity = block->capacity();
+        mMemoryTracker->add("outputBitstream", capacity);
+        C2LinearBlock* rawBlock = block.get();
+        block = std::shared_ptr<C2LinearBlock>(
+                rawBlock, [block = std::move(block), tracker = mMemoryTracker,
+                           capacity](C2LinearBlock*) mutable {
+                    block.reset();
+                    tracker->add("outputBitstream", -capacity);
+                });
+    }
+
     *buffer = std::make_unique<BitstreamBuffer>(std::move(block), 0, size);
 }
 
@@ -861,7 +1451,8 @@ void V4L2EncodeComponent::onInputBufferDone(uint64_t index) {
             reportError(status);
             return;
         }
-        while (!mInputConverterQueue.empty() && mInputFormatConverter->isReady()) {
+        while (!mInputConverterQueue.empty() && !mPendingVisibleSize &&
+               mInputFormatConverter->isReady()) {
             std::unique_ptr<C2Work> work = std::move(mInputConverterQueue.front());
             mInputConverterQueue.pop();
             queueTask(std::move(work));
@@ -872,8 +1463,7 @@ void V4L2EncodeComponent::onInputBufferDone(uint64_t index) {
     // to be returned, in which case we can report it as completed now. As input buffers are not
     // necessarily returned in order we might be able to return multiple ready work items now.
     while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
-        reportWork(std::move(mWorkQueue.front()));
-        mWorkQueue.pop_front();
+        reportWork(popFrontWork());
     }
 }
 
@@ -885,26 +1475,31 @@ void V4L2EncodeComponent::onOutputBufferDone(size_t dataSize, int64_t timestamp,
     ALOG_ASSERT(buffer->dmabuf);
 
     C2ConstLinearBlock constBlock =
-            buffer->dmabuf->share(buffer->dmabuf->offset(), dataSize, C2Fence());
+            buffer->dmabuf->share(buffer->dmabuf->offset() + buffer->offset, dataSize, C2Fence());
 
     // If no CSD (content-specific-data, e.g. SPS for H.264) has been submitted yet, we expect this
     // output block to contain CSD. We only submit the CSD once, even if it's attached to each key
     // frame.
-    if (mExtractCSD) {
+    std::unique_ptr<C2StreamInitDataInfo::output> csd;
+    if (mExtractCSD && !buffer->dropped) {
         ALOGV("No CSD submitted yet, extracting CSD");
-        std::unique_ptr<C2StreamInitDataInfo::output> csd;
         C2ReadView view = constBlock.map().get();
-        if (!extractCSDInfo(&csd, view.data(), view.capacity())) {
+        const VideoCodec codec = IsHEVCProfile(mInterface->getOutputProfile()) ? VideoCodec::HEVC
+                                                                                : VideoCodec::H264;
+        if (!extractCSDInfo(&csd, codec, view.data(), view.capacity())) {
             ALOGE("Failed to extract CSD");
             reportError(C2_CORRUPTED);
             return;
         }
-
-        // Attach the CSD to the first item in our output work queue.
-        LOG_ASSERT(!mWorkQueue.empty());
-        C2Work* work = mWorkQueue.front().get();
-        work->worklets.front()->output.configUpdate.push_back(std::move(csd));
         mExtractCSD = false;
+
+        // Attach the CSD to the first item in our output work queue. In slice output mode it's
+        // attached to the first partial work instead, so it's delivered before any slice.
+        if (!mEncoder->sliceOutput()) {
+            LOG_ASSERT(!mWorkQueue.empty());
+            C2Work* work = mWorkQueue.front().get();
+            work->worklets.front()->output.configUpdate.push_back(std::move(csd));
+        }
     }
 
     // Get the work item associated with the timestamp.
@@ -917,6 +1512,37 @@ void V4L2EncodeComponent::onOutputBufferDone(size_t dataSize, int64_t timestamp,
         }
         return;
     }
+    mLatencyTracker->mark(work->input.ordinal.frameIndex.peeku(), "output");
+
+    // With B-frames the frames are output in decode order. Work items are still reported in input
+    // order, so the output buffer is attached to the oldest work item without output and its
+    // output timestamp is set to the frame's presentation timestamp. The custom ordinal of the
+    // work item's output keeps the input order, and can be used as decode timestamp.
+    const bool bFrame = mMaxOutputTimestamp && timestamp < *mMaxOutputTimestamp;
+    mMaxOutputTimestamp = std::max(timestamp, mMaxOutputTimestamp.value_or(timestamp));
+    if (mNumBFrames > 0) {
+        work = getNextWorkWithoutOutput();
+        if (!work) {
+            ALOGE("No work item left for output buffer (timestamp: %" PRId64 ")", timestamp);
+            reportError(C2_CORRUPTED);
+            return;
+        }
+        work->worklets.front()->output.ordinal.timestamp = timestamp;
+    }
+
+    // Truncated frames are dropped, the encoder restarts the stream with a key frame. The work
+    // item is reported without output buffer once all slices of the frame have been returned.
+    if (buffer->dropped) {
+        ALOGW("Dropping truncated output (timestamp: %" PRId64 ")", timestamp);
+        if (buffer->lastSlice) {
+            work->worklets.front()->output.flags = static_cast<C2FrameData::flags_t>(
+                    work->worklets.front()->output.flags | C2FrameData::FLAG_DROP_FRAME);
+        }
+        while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
+            reportWork(popFrontWork());
+        }
+        return;
+    }
 
     std::shared_ptr<C2Buffer> linearBuffer = C2Buffer::CreateLinearBuffer(std::move(constBlock));
     if (!linearBuffer) {
@@ -929,14 +1555,29 @@ void V4L2EncodeComponent::onOutputBufferDone(size_t dataSize, int64_t timestamp,
         linearBuffer->setInfo(
                 std::make_shared<C2StreamPictureTypeMaskInfo::output>(0u, C2Config::SYNC_FRAME));
     }
-    work->worklets.front()->output.buffers.emplace_back(std::move(linearBuffer));
+    if (mNumTemporalLayers > 1) {
+        linearBuffer->setInfo(std::make_shared<C2StreamV4L2TemporalLayerIdInfo::output>(
+                0u, buffer->temporalLayerId));
+    }
+    uint32_t pictureType = bFrame ? C2Config::B_FRAME : C2Config::P_FRAME;
+    if (keyFrame) pictureType = C2Config::SYNC_FRAME | C2Config::I_FRAME;
+    linearBuffer->setInfo(std::make_shared<C2StreamV4L2EncodeStatsInfo::output>(
+            0u, buffer->averageQp, pictureType, static_cast<uint32_t>(dataSize),
+            buffer->encodeTimeUs));
+    if (!buffer->lastSlice) {
+        // Each slice is reported immediately in a separate incomplete work item. The last slice
+        // completes the work item itself.
+        reportPartialWork(*work, std::move(linearBuffer), std::move(csd));
+    } else {
+        if (csd) work->worklets.front()->output.configUpdate.push_back(std::move(csd));
+        work->worklets.front()->output.buffers.emplace_back(std::move(linearBuffer));
+    }
 
     // We can report the work item as completed if its associated input buffer has also been
     // released. As output buffers are not necessarily returned in order we might be able to return
     // multiple ready work items now.
     while (!mWorkQueue.empty() && isWorkDone(*mWorkQueue.front())) {
-        reportWork(std::move(mWorkQueue.front()));
-        mWorkQueue.pop_front();
+        reportWork(popFrontWork());
     }
 }
 
@@ -944,15 +1585,24 @@ C2Work* V4L2EncodeComponent::getWorkByIndex(uint64_t index) {
     ALOGV("%s(): getting work item (index: %" PRIu64 ")", __func__, index);
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    auto it = std::find_if(mWorkQueue.begin(), mWorkQueue.end(),
-                           [index](const std::unique_ptr<C2Work>& w) {
-                               return w->input.ordinal.frameIndex.peeku() == index;
-                           });
-    if (it == mWorkQueue.end()) {
+    auto it = mWorkByIndex.find(index);
+    if (it == mWorkByIndex.end()) {
         ALOGE("Failed to find work (index: %" PRIu64 ")", index);
         return nullptr;
     }
-    return it->get();
+    return it->second;
+}
+
+C2Work* V4L2EncodeComponent::getNextWorkWithoutOutput() {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    for (const std::unique_ptr<C2Work>& work : mWorkQueue) {
+        if (!work->input.buffers.empty() && work->worklets.front()->output.buffers.empty() &&
+            !(work->worklets.front()->output.flags & C2FrameData::FLAG_DROP_FRAME)) {
+            return work.get();
+        }
+    }
+    return nullptr;
 }
 
 C2Work* V4L2EncodeComponent::getWorkByTimestamp(int64_t timestamp) {
@@ -960,19 +1610,63 @@ C2Work* V4L2EncodeComponent::getWorkByTimestamp(int64_t timestamp) {
     ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
     ALOG_ASSERT(timestamp >= 0);
 
-    // Find the work with specified timestamp by looping over the output work queue. This should be
-    // very fast as the output work queue will never be longer then a few items. Ignore empty work
-    // items that are marked as EOS, as their timestamp might clash with other work items.
-    auto it = std::find_if(
-            mWorkQueue.begin(), mWorkQueue.end(), [timestamp](const std::unique_ptr<C2Work>& w) {
-                return !(w->input.flags & C2FrameData::FLAG_END_OF_STREAM) &&
-                       w->input.ordinal.timestamp.peeku() == static_cast<uint64_t>(timestamp);
-            });
-    if (it == mWorkQueue.end()) {
+    // Only work items with an input buffer are indexed by timestamp, as the timestamp of empty
+    // EOS work items might clash with other work items.
+    auto range = mWorkByTimestamp.equal_range(timestamp);
+    if (range.first == range.second) {
         ALOGE("Failed to find work (timestamp: %" PRIu64 ")", timestamp);
         return nullptr;
     }
-    return it->get();
+
+    // Frames are output in order, so the output belongs to the oldest work item that has no output
+    // yet. The multimap doesn't keep the insertion order, which is compared using frame indices.
+    C2Work* work = nullptr;
+    for (auto it = range.first; it != range.second; ++it) {
+        const C2FrameData& output = it->second->worklets.front()->output;
+        if (!output.buffers.empty() || (output.flags & C2FrameData::FLAG_DROP_FRAME)) continue;
+        if (!work || it->second->input.ordinal.frameIndex < work->input.ordinal.frameIndex) {
+            work = it->second;
+        }
+    }
+    return work ? work : range.first->second;
+}
+
+void V4L2EncodeComponent::pushWork(std::unique_ptr<C2Work> work) {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    C2Work* workPtr = work.get();
+    mWorkByIndex.emplace(workPtr->input.ordinal.frameIndex.peeku(), workPtr);
+    if (!workPtr->input.buffers.empty()) {
+        mWorkByTimestamp.emplace(static_cast<int64_t>(workPtr->input.ordinal.timestamp.peeku()),
+                                 workPtr);
+    }
+    if (workPtr->input.flags & C2FrameData::FLAG_END_OF_STREAM) {
+        mEOSWorks.push(workPtr);
+    }
+    mWorkQueue.push_back(std::move(work));
+
+    ATRACE_INT(mInFlightCounterName.c_str(), static_cast<int32_t>(mWorkQueue.size()));
+}
+
+std::unique_ptr<C2Work> V4L2EncodeComponent::popFrontWork() {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(!mWorkQueue.empty());
+
+    std::unique_ptr<C2Work> work = std::move(mWorkQueue.front());
+    mWorkQueue.pop_front();
+
+    mWorkByIndex.erase(work->input.ordinal.frameIndex.peeku());
+    auto range = mWorkByTimestamp.equal_range(
+            static_cast<int64_t>(work->input.ordinal.timestamp.peeku()));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == work.get()) {
+            mWorkByTimestamp.erase(it);
+            break;
+        }
+    }
+
+    ATRACE_INT(mInFlightCounterName.c_str(), static_cast<int32_t>(mWorkQueue.size()));
+    return work;
 }
 
 bool V4L2EncodeComponent::isWorkDone(const C2Work& work) const {
@@ -992,8 +1686,11 @@ bool V4L2EncodeComponent::isWorkDone(const C2Work& work) const {
         return false;
     }
 
-    // If the work item had an input buffer to be encoded, it should have an output buffer set.
-    if (!work.input.buffers.empty() && work.worklets.front()->output.buffers.empty()) {
+    // If the work item had an input buffer to be encoded, it should have an output buffer set,
+    // unless its truncated output was dropped. In slice output mode this is the last slice of the
+    // frame.
+    if (!work.input.buffers.empty() && work.worklets.front()->output.buffers.empty() &&
+        !(work.worklets.front()->output.flags & C2FrameData::FLAG_DROP_FRAME)) {
         ALOGV("Output buffer associated with work item %" PRIu64 " not returned yet",
               work.input.ordinal.frameIndex.peeku());
         return false;
@@ -1010,10 +1707,64 @@ void V4L2EncodeComponent::reportWork(std::unique_ptr<C2Work> work) {
 
     work->result = C2_OK;
     work->workletsProcessed = static_cast<uint32_t>(work->worklets.size());
+    mLatencyTracker->finish(work->input.ordinal.frameIndex.peeku(), "report");
+
+    queueFinishedWork(std::move(work));
+}
+
+void V4L2EncodeComponent::reportPartialWork(const C2Work& work, std::shared_ptr<C2Buffer> buffer,
+                                            std::unique_ptr<C2Param> configUpdate) {
+    ALOGV("%s(): Reporting partial output (index: %llu)", __func__,
+          work.input.ordinal.frameIndex.peekull());
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
 
-    std::list<std::unique_ptr<C2Work>> finishedWorkList;
-    finishedWorkList.emplace_back(std::move(work));
-    mListener->onWorkDone_nb(weak_from_this(), std::move(finishedWorkList));
+    std::unique_ptr<C2Work> partialWork = std::make_unique<C2Work>();
+    partialWork->input.ordinal = work.input.ordinal;
+    partialWork->worklets.emplace_back(std::make_unique<C2Worklet>());
+    C2FrameData& output = partialWork->worklets.front()->output;
+    output.ordinal = work.input.ordinal;
+    output.flags = C2FrameData::FLAG_INCOMPLETE;
+    output.buffers.push_back(std::move(buffer));
+    if (configUpdate) output.configUpdate.push_back(std::move(configUpdate));
+    partialWork->result = C2_OK;
+    partialWork->workletsProcessed = 1u;
+
+    queueFinishedWork(std::move(partialWork));
+}
+
+void V4L2EncodeComponent::queueFinishedWork(std::unique_ptr<C2Work> work) {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mFinishedWorks.emplace_back(std::move(work));
+
+    // In low-latency mode work items are reported right away, otherwise the number of items held
+    // back is capped so the client's input doesn't stall on bursts of finished items.
+    if (mLowLatencyMode || mFinishedWorks.size() >= kMaxBatchedWorks) {
+        flushFinishedWorks();
+    } else if (!mFlushFinishedWorksScheduled) {
+        mEncoderTaskRunner->PostTask(
+                FROM_HERE,
+                ::base::BindOnce(&V4L2EncodeComponent::flushFinishedWorksTask, mWeakThis));
+        mFlushFinishedWorksScheduled = true;
+    }
+}
+
+void V4L2EncodeComponent::flushFinishedWorks() {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mFinishedWorks.empty()) return;
+
+    ALOGV("%s(): reporting %zu work items", __func__, mFinishedWorks.size());
+    std::list<std::unique_ptr<C2Work>> finishedWorks;
+    finishedWorks.swap(mFinishedWorks);
+    mListener->onWorkDone_nb(weak_from_this(), std::move(finishedWorks));
+}
+
+void V4L2EncodeComponent::flushFinishedWorksTask() {
+    ALOG_ASSERT(mEncoderTaskRunner->RunsTasksInCurrentSequence());
+
+    mFlushFinishedWorksScheduled = false;
+    flushFinishedWorks();
 }
 
 bool V4L2EncodeComponent::getBlockPool() {
@@ -1026,10 +1777,20 @@ bool V4L2EncodeComponent::getBlockPool() {
     }
 
     C2BlockPool::local_id_t poolId = mInterface->getBlockPoolId();
+    c2_status_t status;
     if (poolId == C2BlockPool::BASIC_LINEAR) {
-        ALOGW("Using unoptimized linear block pool");
-    }
-    c2_status_t status = GetCodec2BlockPool(poolId, std::move(sharedThis), &mOutputBlockPool);
+        // The basic linear pool allocates a new dmabuf of the worst-case frame size for every
+        // output buffer queued to the device. Use a dedicated bufferpool-backed pool instead, which
+        // recycles the blocks once the client released them.
+        ALOGV("Using recycled linear block pool instead of basic linear block pool");
+        status = CreateCodec2BlockPool(C2PlatformAllocatorStore::ION, sharedThis,
+                                       &mOutputBlockPool);
+        if (status == C2_OK && mOutputBlockPool) return true;
+
+        ALOGW("Failed to create recycled linear block pool (error: %d), using unoptimized pool",
+              status);
+    }
+    status = GetCodec2BlockPool(poolId, std::move(sharedThis), &mOutputBlockPool);
     if (status != C2_OK || !mOutputBlockPool) {
         ALOGE("Failed to get output block pool, error: %d", status);
         return false;
@@ -1045,6 +1806,7 @@ void V4L2EncodeComponent::reportError(c2_status_t error) {
     std::lock_guard<std::mutex> lock(mComponentLock);
     if (mComponentState != ComponentState::ERROR) {
         setComponentState(ComponentState::ERROR);
+        flushFinishedWorks();
         mListener->onError_nb(weak_from_this(), static_cast<uint32_t>(error));
     }
 }
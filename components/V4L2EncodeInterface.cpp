@@ -42,10 +42,20 @@ constexpr uint32_t kDefaultBitrate = 64000;
 // TODO: increase this in the future for supporting higher level/resolution encoding.
 constexpr uint32_t kMaxBitrate = 50000000;
 
+// The maximal number of temporal layers, the limit of the Android temporal layering schemas.
+constexpr uint32_t kMaxTemporalLayers = 4;
+// The maximal number of long-term reference slots.
+constexpr uint32_t kMaxLongTermReferences = 4;
+// The maximal number of consecutive B-frames.
+constexpr uint32_t kMaxBFrames = 3;
+// The default quality level used in constant quality mode, on a scale of 0 to 100.
+constexpr uint32_t kDefaultQuality = 80;
+
 std::optional<VideoCodec> getCodecFromComponentName(const std::string& name) {
     if (name == V4L2ComponentName::kH264Encoder) return VideoCodec::H264;
     if (name == V4L2ComponentName::kVP8Encoder) return VideoCodec::VP8;
     if (name == V4L2ComponentName::kVP9Encoder) return VideoCodec::VP9;
+    if (name == V4L2ComponentName::kHEVCEncoder) return VideoCodec::HEVC;
 
     ALOGE("Unknown name: %s", name.c_str());
     return std::nullopt;
@@ -61,6 +71,9 @@ bool IsValidProfileForCodec(VideoCodec codec, C2Config::profile_t profile) {
         return ((profile >= C2Config::PROFILE_VP8_0) && (profile <= C2Config::PROFILE_VP8_3));
     case VideoCodec::VP9:
         return ((profile >= C2Config::PROFILE_VP9_0) && (profile <= C2Config::PROFILE_VP9_3));
+    case VideoCodec::HEVC:
+        return ((profile >= C2Config::PROFILE_HEVC_MAIN) &&
+                (profile <= C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS));
     default:
         return false;
     }
@@ -208,6 +221,92 @@ C2R V4L2EncodeInterface::VP9ProfileLevelSetter(
     return C2R::Ok();
 }
 
+// static
+C2R V4L2EncodeInterface::HEVCProfileLevelSetter(
+        bool /*mayBlock*/, C2P<C2StreamProfileLevelInfo::output>& info,
+        const C2P<C2StreamPictureSizeInfo::input>& videoSize,
+        const C2P<C2StreamFrameRateInfo::output>& frameRate,
+        const C2P<C2StreamBitrateInfo::output>& bitrate) {
+    static C2Config::level_t lowestConfigLevel = C2Config::LEVEL_UNUSED;
+
+    // Adopt default minimal profile instead if the requested profile is not supported, or lower
+    // than the default minimal one.
+    constexpr C2Config::profile_t minProfile = C2Config::PROFILE_HEVC_MAIN;
+    if (!info.F(info.v.profile).supportsAtAll(info.v.profile) || info.v.profile < minProfile) {
+        if (info.F(info.v.profile).supportsAtAll(minProfile)) {
+            ALOGV("Set profile to default (%u) instead.", minProfile);
+            info.set().profile = minProfile;
+        } else {
+            ALOGE("Unable to set either requested profile (%u) or default profile (%u).",
+                  info.v.profile, minProfile);
+            return C2R(C2SettingResultBuilder::BadValue(info.F(info.v.profile)));
+        }
+    }
+
+    // Tables A.8 and A.9 in spec, only the Main tier is supported.
+    struct LevelLimits {
+        C2Config::level_t level;
+        uint64_t maxLumaSr;  // max luma sample rate in samples per second
+        uint64_t maxLumaPs;  // max luma picture size in samples
+        uint32_t maxBR;      // max video bitrate in bits per second
+    };
+    constexpr LevelLimits kLimits[] = {
+            {C2Config::LEVEL_HEVC_MAIN_1, 552960, 36864, 128000},
+            {C2Config::LEVEL_HEVC_MAIN_2, 3686400, 122880, 1500000},
+            {C2Config::LEVEL_HEVC_MAIN_2_1, 7372800, 245760, 3000000},
+            {C2Config::LEVEL_HEVC_MAIN_3, 16588800, 552960, 6000000},
+            {C2Config::LEVEL_HEVC_MAIN_3_1, 33177600, 983040, 10000000},
+            {C2Config::LEVEL_HEVC_MAIN_4, 66846720, 2228224, 12000000},
+            {C2Config::LEVEL_HEVC_MAIN_4_1, 133693440, 2228224, 20000000},
+            {C2Config::LEVEL_HEVC_MAIN_5, 267386880, 8912896, 25000000},
+            {C2Config::LEVEL_HEVC_MAIN_5_1, 534773760, 8912896, 40000000},
+            {C2Config::LEVEL_HEVC_MAIN_5_2, 1069547520, 8912896, 60000000},
+    };
+
+    uint64_t targetPs = static_cast<uint64_t>(videoSize.v.width) * videoSize.v.height;
+    float targetSr = static_cast<float>(targetPs) * frameRate.v.value;
+
+    // Try the recorded lowest configed level, see H264ProfileLevelSetter().
+    if (lowestConfigLevel != C2Config::LEVEL_UNUSED && lowestConfigLevel < info.v.level) {
+        info.set().level = lowestConfigLevel;
+    }
+
+    // Check if the supplied level meets the requirements. If not, update the level with the lowest
+    // level meeting the requirements.
+    bool found = false;
+    bool needsUpdate = !info.F(info.v.level).supportsAtAll(info.v.level);
+    for (const LevelLimits& limit : kLimits) {
+        if (!info.F(info.v.level).supportsAtAll(limit.level)) {
+            continue;
+        }
+
+        if (targetPs <= limit.maxLumaPs && targetSr <= limit.maxLumaSr &&
+            bitrate.v.value <= limit.maxBR) {
+            if (needsUpdate) {
+                lowestConfigLevel = info.v.level;
+
+                ALOGD("Given level %u does not cover current configuration: "
+                      "adjusting to %u",
+                      info.v.level, limit.level);
+                info.set().level = limit.level;
+            }
+            found = true;
+            break;
+        }
+        if (info.v.level <= limit.level) {
+            // The lowest feasible level doesn't meet the requirement, it needs to be updated.
+            needsUpdate = true;
+        }
+    }
+    if (!found) {
+        ALOGE("Unable to find proper level with current config, requested level (%u).",
+              info.v.level);
+        return C2R(C2SettingResultBuilder::BadValue(info.F(info.v.level)));
+    }
+
+    return C2R::Ok();
+}
+
 // static
 C2R V4L2EncodeInterface::SizeSetter(bool mayBlock, C2P<C2StreamPictureSizeInfo::input>& videoSize) {
     (void)mayBlock;
@@ -231,6 +330,24 @@ C2R V4L2EncodeInterface::IntraRefreshPeriodSetter(bool mayBlock,
     return C2R::Ok();
 }
 
+// static
+C2R V4L2EncodeInterface::TemporalLayeringSetter(
+        bool mayBlock, C2P<C2StreamTemporalLayeringTuning::output>& layering) {
+    (void)mayBlock;
+    if (layering.v.m.layerCount > kMaxTemporalLayers) {
+        layering.set().m.layerCount = kMaxTemporalLayers;
+    }
+    // B-frames are not supported, so all layers are encoded as P-frames.
+    layering.set().m.bLayerCount = 0;
+    // Make sure the cumulative bitrate ratios are monotonic and within [0, 1].
+    for (size_t i = 0; i < layering.v.flexCount(); ++i) {
+        const float lowerBound = (i > 0) ? layering.v.m.bitrateRatios[i - 1] : 0.f;
+        layering.set().m.bitrateRatios[i] =
+                c2_clamp(lowerBound, layering.v.m.bitrateRatios[i], 1.f);
+    }
+    return C2R::Ok();
+}
+
 V4L2EncodeInterface::V4L2EncodeInterface(const C2String& name,
                                          std::shared_ptr<C2ReflectorHelper> helper)
       : C2InterfaceHelper(std::move(helper)) {
@@ -255,6 +372,7 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
         mInitStatus = C2_BAD_VALUE;
         return;
     }
+    mVideoCodec = codec;
 
     V4L2Device::SupportedEncodeProfiles supported_profiles = device->getSupportedEncodeProfiles();
 
@@ -297,6 +415,16 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                          .withSetter(SizeSetter)
                          .build());
 
+    addParameter(DefineParam(mScaledOutputSize, C2_PARAMKEY_V4L2_SCALED_OUTPUT_SIZE)
+                         .withDefault(new C2StreamV4L2ScaledOutputSizeTuning::output(0u, 0, 0))
+                         .withFields({
+                                 C2F(mScaledOutputSize, width).inRange(0, maxSize.width, 2),
+                                 C2F(mScaledOutputSize, height).inRange(0, maxSize.height, 2),
+                         })
+                         .withSetter(
+                                 Setter<decltype(*mScaledOutputSize)>::StrictValueWithNoDeps)
+                         .build());
+
     addParameter(DefineParam(mFrameRate, C2_PARAMKEY_FRAME_RATE)
                          .withDefault(new C2StreamFrameRateInfo::output(0u, kDefaultFrameRate))
                          // TODO: More restriction?
@@ -315,10 +443,39 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                     .withDefault(new C2StreamBitrateModeTuning::output(0u, C2Config::BITRATE_CONST))
                     .withFields(
                             {C2F(mBitrateMode, value)
-                                     .oneOf({C2Config::BITRATE_CONST, C2Config::BITRATE_VARIABLE})})
+                                     .oneOf({C2Config::BITRATE_CONST, C2Config::BITRATE_VARIABLE,
+                                             C2Config::BITRATE_IGNORE})})
                     .withSetter(Setter<decltype(*mBitrateMode)>::StrictValueWithNoDeps)
                     .build());
 
+    addParameter(DefineParam(mQuality, C2_PARAMKEY_QUALITY)
+                         .withDefault(new C2StreamQualityTuning::output(0u, kDefaultQuality))
+                         .withFields({C2F(mQuality, value).inRange(0, 100)})
+                         .withSetter(Setter<decltype(*mQuality)>::StrictValueWithNoDeps)
+                         .build());
+
+    addParameter(DefineParam(mPictureQuantization, C2_PARAMKEY_PICTURE_QUANTIZATION)
+                         .withDefault(C2StreamPictureQuantizationTuning::output::AllocShared(
+                                 0u, 0u))
+                         .withFields({C2F(mPictureQuantization, m.values[0].type_).any(),
+                                      C2F(mPictureQuantization, m.values[0].min).any(),
+                                      C2F(mPictureQuantization, m.values[0].max).any()})
+                         .withSetter(Setter<decltype(
+                                             *mPictureQuantization)>::NonStrictValuesWithNoDeps)
+                         .build());
+
+    addParameter(DefineParam(mLowLatencyMode, C2_PARAMKEY_LOW_LATENCY_MODE)
+                         .withDefault(new C2GlobalLowLatencyModeTuning(false))
+                         .withFields({C2F(mLowLatencyMode, value).any()})
+                         .withSetter(Setter<decltype(*mLowLatencyMode)>::NonStrictValueWithNoDeps)
+                         .build());
+
+    addParameter(DefineParam(mRealTimePriority, C2_PARAMKEY_PRIORITY)
+                         .withDefault(new C2RealTimePriorityTuning(0))
+                         .withFields({C2F(mRealTimePriority, value).any()})
+                         .withSetter(Setter<decltype(*mRealTimePriority)>::StrictValueWithNoDeps)
+                         .build());
+
     std::string outputMime;
     if (getCodecFromComponentName(name) == VideoCodec::H264) {
         outputMime = MEDIA_MIMETYPE_VIDEO_AVC;
@@ -371,6 +528,30 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                                                  C2Config::LEVEL_VP9_6_2})})
                         .withSetter(VP9ProfileLevelSetter, mInputVisibleSize, mFrameRate, mBitrate)
                         .build());
+    } else if (getCodecFromComponentName(name) == VideoCodec::HEVC) {
+        outputMime = MEDIA_MIMETYPE_VIDEO_HEVC;
+        C2Config::profile_t minProfile = static_cast<C2Config::profile_t>(
+                *std::min_element(profiles.begin(), profiles.end()));
+        addParameter(
+                DefineParam(mProfileLevel, C2_PARAMKEY_PROFILE_LEVEL)
+                        .withDefault(new C2StreamProfileLevelInfo::output(
+                                0u, minProfile, C2Config::LEVEL_HEVC_MAIN_4_1))
+                        .withFields(
+                                {C2F(mProfileLevel, profile).oneOf(profiles),
+                                 C2F(mProfileLevel, level)
+                                         .oneOf({C2Config::LEVEL_HEVC_MAIN_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_2,
+                                                 C2Config::LEVEL_HEVC_MAIN_2_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_3,
+                                                 C2Config::LEVEL_HEVC_MAIN_3_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_4,
+                                                 C2Config::LEVEL_HEVC_MAIN_4_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_5,
+                                                 C2Config::LEVEL_HEVC_MAIN_5_1,
+                                                 C2Config::LEVEL_HEVC_MAIN_5_2})})
+                        .withSetter(HEVCProfileLevelSetter, mInputVisibleSize, mFrameRate,
+                                    mBitrate)
+                        .build());
     } else {
         ALOGE("Unsupported component name: %s", name.c_str());
         mInitStatus = C2_BAD_VALUE;
@@ -412,6 +593,64 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
                          .withSetter(IntraRefreshPeriodSetter)
                          .build());
 
+    addParameter(DefineParam(mRoiRects, C2_PARAMKEY_V4L2_ROI_RECTS)
+                         .withDefault(C2StreamV4L2RoiRectsInfo::output::AllocShared(0u, 0u))
+                         .withFields({C2F(mRoiRects, m.values[0].qpOffset).inRange(-51, 51),
+                                      C2F(mRoiRects, m.values[0].left).inRange(0, maxSize.width),
+                                      C2F(mRoiRects, m.values[0].top).inRange(0, maxSize.height),
+                                      C2F(mRoiRects, m.values[0].width).inRange(0, maxSize.width),
+                                      C2F(mRoiRects, m.values[0].height)
+                                              .inRange(0, maxSize.height)})
+                         .withSetter(Setter<decltype(*mRoiRects)>::NonStrictValuesWithNoDeps)
+                         .build());
+
+    if (codec.value() == VideoCodec::H264 || codec.value() == VideoCodec::HEVC) {
+        addParameter(DefineParam(mTemporalLayering, C2_PARAMKEY_TEMPORAL_LAYERING)
+                             .withDefault(C2StreamTemporalLayeringTuning::output::AllocShared(
+                                     0u, 0, 0, 0))
+                             .withFields({C2F(mTemporalLayering, m.layerCount)
+                                                  .inRange(0, kMaxTemporalLayers),
+                                          C2F(mTemporalLayering, m.bLayerCount).inRange(0, 0),
+                                          C2F(mTemporalLayering, m.bitrateRatios)
+                                                  .inRange(0., 1.)})
+                             .withSetter(TemporalLayeringSetter)
+                             .build());
+
+        addParameter(DefineParam(mGop, C2_PARAMKEY_GOP)
+                             .withDefault(C2StreamGopTuning::output::AllocShared(0u, 0u))
+                             .withFields({C2F(mGop, m.values[0].type_).any(),
+                                          C2F(mGop, m.values[0].count).any()})
+                             .withSetter(Setter<decltype(*mGop)>::NonStrictValuesWithNoDeps)
+                             .build());
+
+        addParameter(
+                DefineParam(mLongTermReferenceCount, C2_PARAMKEY_V4L2_LTR_COUNT)
+                        .withDefault(new C2StreamV4L2LongTermReferenceCountTuning::output(0u, 0))
+                        .withFields({C2F(mLongTermReferenceCount, value)
+                                             .inRange(0, kMaxLongTermReferences)})
+                        .withSetter(Setter<decltype(
+                                            *mLongTermReferenceCount)>::StrictValueWithNoDeps)
+                        .build());
+
+        addParameter(
+                DefineParam(mMarkLongTermReference, C2_PARAMKEY_V4L2_LTR_MARK)
+                        .withDefault(new C2StreamV4L2MarkLongTermReferenceTuning::output(0u, -1))
+                        .withFields({C2F(mMarkLongTermReference, value)
+                                             .inRange(-1, kMaxLongTermReferences - 1)})
+                        .withSetter(Setter<decltype(
+                                            *mMarkLongTermReference)>::StrictValueWithNoDeps)
+                        .build());
+
+        addParameter(
+                DefineParam(mUseLongTermReferences, C2_PARAMKEY_V4L2_LTR_USE)
+                        .withDefault(new C2StreamV4L2UseLongTermReferencesTuning::output(0u, 0))
+                        .withFields({C2F(mUseLongTermReferences, value)
+                                             .inRange(0, (1u << kMaxLongTermReferences) - 1)})
+                        .withSetter(Setter<decltype(
+                                            *mUseLongTermReferences)>::StrictValueWithNoDeps)
+                        .build());
+    }
+
     addParameter(DefineParam(mRequestKeyFrame, C2_PARAMKEY_REQUEST_SYNC_FRAME)
                          .withDefault(new C2StreamRequestSyncFrameTuning::output(0u, C2_FALSE))
                          .withFields({C2F(mRequestKeyFrame, value).oneOf({C2_FALSE, C2_TRUE})})
@@ -451,6 +690,24 @@ void V4L2EncodeInterface::Initialize(const C2String& name) {
     mInitStatus = C2_OK;
 }
 
+c2_status_t V4L2EncodeInterface::config(
+        const std::vector<C2Param*>& params, c2_blocking_t mayBlock,
+        std::vector<std::unique_ptr<C2SettingResult>>* const failures, bool updateParams,
+        std::vector<std::shared_ptr<C2Param>>* changes) {
+    const c2_status_t status =
+            C2InterfaceHelper::config(params, mayBlock, failures, updateParams, changes);
+    // Some parameters might have been updated even if configuring others failed.
+    if (updateParams && !params.empty()) {
+        mParamsGeneration.fetch_add(1, std::memory_order_release);
+    }
+    return status;
+}
+
+c2_status_t V4L2EncodeInterface::resetRequests(const std::vector<C2Param*>& params) {
+    std::vector<std::unique_ptr<C2SettingResult>> failures;
+    return C2InterfaceHelper::config(params, C2_MAY_BLOCK, &failures);
+}
+
 uint32_t V4L2EncodeInterface::getKeyFramePeriod() const {
     if (mKeyFramePeriodUs->value < 0 || mKeyFramePeriodUs->value == INT64_MAX) {
         return 0;
@@ -459,4 +716,46 @@ uint32_t V4L2EncodeInterface::getKeyFramePeriod() const {
     return static_cast<uint32_t>(std::max(std::min(std::round(period), double(UINT32_MAX)), 1.));
 }
 
+std::optional<std::pair<uint32_t, uint32_t>> V4L2EncodeInterface::getQpRange() const {
+    // The device only supports a single QP range for all picture types, so the union of the
+    // ranges requested for each picture type is used.
+    std::optional<std::pair<uint32_t, uint32_t>> range;
+    for (size_t i = 0; i < mPictureQuantization->flexCount(); ++i) {
+        const C2PictureQuantizationStruct& layer = mPictureQuantization->m.values[i];
+        if (layer.min < 0 || layer.max < layer.min) continue;
+        const uint32_t minQp = static_cast<uint32_t>(layer.min);
+        const uint32_t maxQp = static_cast<uint32_t>(layer.max);
+        range = range ? std::make_pair(std::min(range->first, minQp),
+                                       std::max(range->second, maxQp))
+                      : std::make_pair(minQp, maxQp);
+    }
+    return range;
+}
+
+uint32_t V4L2EncodeInterface::getIntraRefreshPeriod() const {
+    if (mIntraRefreshPeriod->mode == C2Config::INTRA_REFRESH_DISABLED) return 0;
+    return static_cast<uint32_t>(
+            std::max(std::min(std::round(mIntraRefreshPeriod->period), float(UINT32_MAX)), 1.f));
+}
+
+uint32_t V4L2EncodeInterface::getBFrameCount() const {
+    if (!mGop) return 0;
+    // The GOP layer of B-frames specifies the number of B-frames between each pair of P-frames.
+    constexpr C2Config::picture_type_t kBFrameLayerType =
+            static_cast<C2Config::picture_type_t>(C2Config::P_FRAME | C2Config::B_FRAME);
+    for (size_t i = 0; i < mGop->flexCount(); ++i) {
+        const C2GopLayerStruct& layer = mGop->m.values[i];
+        if (layer.type_ == kBFrameLayerType) return std::min(layer.count, kMaxBFrames);
+    }
+    return 0;
+}
+
+std::vector<float> V4L2EncodeInterface::getTemporalLayerBitrateRatios() const {
+    if (!mTemporalLayering) return {};
+    const size_t count = std::min<size_t>(mTemporalLayering->flexCount(),
+                                          std::max(getTemporalLayerCount(), 1u) - 1);
+    return std::vector<float>(mTemporalLayering->m.bitrateRatios,
+                              mTemporalLayering->m.bitrateRatios + count);
+}
+
 }  // namespace android
@@ -8,12 +8,15 @@
 #include <v4l2_codec2/components/V4L2Encoder.h>
 
 #include <stdint.h>
+#include <algorithm>
+#include <iterator>
 #include <optional>
 #include <vector>
 
 #include <base/bind.h>
 #include <base/files/scoped_file.h>
 #include <base/memory/ptr_util.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <ui/Rect.h>
 
@@ -45,6 +48,41 @@ size_t GetMaxOutputBufferSize(const ui::Size& size) {
     return kMaxBitstreamBufferSizeInBytes;
 }
 
+// The minimum output buffer size used when sizing the buffers for the bitrate.
+constexpr size_t kMinBitstreamBufferSizeInBytes = 256 * 1024;  // 256KB
+// Output buffers are sized to hold this duration of encoded data at the configured bitrate, which
+// comfortably fits a key frame. The size is capped to GetMaxOutputBufferSize().
+constexpr uint64_t kBitstreamBufferDurationMs = 1000;
+
+size_t GetOutputBufferSize(const ui::Size& size, uint32_t bitrate) {
+    const size_t bitrateSize = static_cast<size_t>(bitrate * kBitstreamBufferDurationMs / 8000);
+    return std::clamp(bitrateSize, kMinBitstreamBufferSizeInBytes, GetMaxOutputBufferSize(size));
+}
+
+// The pixel rates (pixels per second) above which deeper V4L2 device queues are used, a queue depth
+// of 2 is sufficient up to 1080p30 while 2160p30 or 1080p120 needs 4 to keep the device busy.
+constexpr float k1080P30PixelRate = 1920.0f * 1080.0f * 30.0f;
+constexpr float k2160P30PixelRate = 3840.0f * 2160.0f * 30.0f;
+// The minimum and maximum number of buffers on each V4L2 device queue.
+constexpr size_t kMinQueueDepth = 2;
+constexpr size_t kMaxQueueDepth = 8;
+
+// The duration of encoded data that fits the rate control buffer in low-latency mode. This allows
+// for some variation in frame sizes at typical framerates, without accumulating multiple frames.
+constexpr uint32_t kLowLatencyRateControlBufferMs = 100;
+
+// The controls used to set the bitrate of each temporal layer, starting at the base layer.
+constexpr uint32_t kH264LayerBitrateCtrls[] = {
+        V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L0_BR, V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L1_BR,
+        V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L2_BR, V4L2_CID_MPEG_VIDEO_H264_HIER_CODING_L3_BR};
+constexpr uint32_t kHEVCLayerBitrateCtrls[] = {
+        V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_L0_BR, V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_L1_BR,
+        V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_L2_BR, V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_L3_BR};
+
+// The headroom reserved at the front of each output buffer if SPS and PPS need to be injected
+// before IDR frames, large enough to hold typical H.264 SPS and PPS NAL units.
+constexpr size_t kStreamHeaderHeadroom = 256;
+
 // Define V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR control code if not present in header files.
 #ifndef V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR
 #define V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR (V4L2_CID_MPEG_BASE + 644)
@@ -52,31 +90,64 @@ size_t GetMaxOutputBufferSize(const ui::Size& size) {
 
 }  // namespace
 
+// static
+size_t V4L2Encoder::getQueueDepth(const ui::Size& visibleSize, float framerate) {
+    static const int32_t kQueueDepthOverride =
+            property_get_int32("ro.vendor.v4l2_codec2.encode_queue_depth", 0);
+    if (kQueueDepthOverride > 0) {
+        return std::clamp(static_cast<size_t>(kQueueDepthOverride), kMinQueueDepth,
+                          kMaxQueueDepth);
+    }
+
+    const float pixelRate = static_cast<float>(getArea(visibleSize).value_or(0)) * framerate;
+    if (pixelRate > k2160P30PixelRate) return 6;
+    if (pixelRate > k1080P30PixelRate) return 4;
+    return kMinQueueDepth;
+}
+
 // static
 std::unique_ptr<VideoEncoder> V4L2Encoder::create(
         C2Config::profile_t outputProfile, std::optional<uint8_t> level,
         const ui::Size& visibleSize, uint32_t stride, uint32_t keyFramePeriod,
         C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate, std::optional<uint32_t> peakBitrate,
-        FetchOutputBufferCB fetchOutputBufferCb, InputBufferDoneCB inputBufferDoneCb,
-        OutputBufferDoneCB outputBufferDoneCb, DrainDoneCB drainDoneCb, ErrorCB errorCb,
-        scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
+        uint32_t numTemporalLayers, uint32_t numLongTermRefs, uint32_t numBFrames,
+        uint32_t intraRefreshPeriod, size_t queueDepth, bool lowLatency,
+        FetchOutputBufferCB fetchOutputBufferCb,
+        InputBufferDoneCB inputBufferDoneCb, OutputBufferDoneCB outputBufferDoneCb,
+        DrainDoneCB drainDoneCb, ErrorCB errorCb,
+        scoped_refptr<::base::SequencedTaskRunner> taskRunner, scoped_refptr<V4L2Device> device) {
     ALOGV("%s()", __func__);
 
     std::unique_ptr<V4L2Encoder> encoder = ::base::WrapUnique<V4L2Encoder>(new V4L2Encoder(
-            std::move(taskRunner), std::move(fetchOutputBufferCb), std::move(inputBufferDoneCb),
-            std::move(outputBufferDoneCb), std::move(drainDoneCb), std::move(errorCb)));
+            std::move(taskRunner), queueDepth, lowLatency, std::move(fetchOutputBufferCb),
+            std::move(inputBufferDoneCb), std::move(outputBufferDoneCb), std::move(drainDoneCb),
+            std::move(errorCb)));
     if (!encoder->initialize(outputProfile, level, visibleSize, stride, keyFramePeriod, bitrateMode,
-                             bitrate, peakBitrate)) {
+                             bitrate, peakBitrate, numTemporalLayers, numLongTermRefs,
+                             numBFrames, intraRefreshPeriod, std::move(device))) {
         return nullptr;
     }
     return encoder;
 }
 
-V4L2Encoder::V4L2Encoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
-                         FetchOutputBufferCB fetchOutputBufferCb,
+// static
+scoped_refptr<V4L2Device> V4L2Encoder::openDevice(C2Config::profile_t profile) {
+    const uint32_t pixelFormat = V4L2Device::C2ProfileToV4L2PixFmt(profile, false);
+    scoped_refptr<V4L2Device> device = V4L2Device::create();
+    if (!pixelFormat || !device->open(V4L2Device::Type::kEncoder, pixelFormat)) {
+        ALOGE("Failed to open device for profile %s", profileToString(profile));
+        return nullptr;
+    }
+    return device;
+}
+
+V4L2Encoder::V4L2Encoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner, size_t queueDepth,
+                         bool lowLatency, FetchOutputBufferCB fetchOutputBufferCb,
                          InputBufferDoneCB inputBufferDoneCb, OutputBufferDoneCB outputBufferDoneCb,
                          DrainDoneCB drainDoneCb, ErrorCB errorCb)
-      : mFetchOutputBufferCb(fetchOutputBufferCb),
+      : mQueueDepth(queueDepth),
+        mLowLatency(lowLatency),
+        mFetchOutputBufferCb(fetchOutputBufferCb),
         mInputBufferDoneCb(inputBufferDoneCb),
         mOutputBufferDoneCb(outputBufferDoneCb),
         mDrainDoneCb(std::move(drainDoneCb)),
@@ -120,9 +191,7 @@ bool V4L2Encoder::encode(std::unique_ptr<InputFrame> frame) {
 
     // If we were waiting for encode requests, start encoding again.
     if (mState == State::WAITING_FOR_INPUT_FRAME) {
-        setState(State::ENCODING);
-        mTaskRunner->PostTask(FROM_HERE,
-                              ::base::BindOnce(&V4L2Encoder::handleEncodeRequest, mWeakThis));
+        resumeEncoding();
     }
 
     return true;
@@ -162,6 +231,14 @@ bool V4L2Encoder::setBitrate(uint32_t bitrate) {
         ALOGE("Setting bitrate to %u failed", bitrate);
         return false;
     }
+    // The bitrate might be signaled in the SPS (e.g. HRD parameters). Note that the same bitrate
+    // might be set again for every frame.
+    if (bitrate != mConfiguredBitrate) {
+        mParamsUpdatePending = true;
+        configureRateControlBuffer(bitrate);
+    }
+    mConfiguredBitrate = bitrate;
+    growOutputBufferSize(GetOutputBufferSize(mVisibleSize, getMaxBitrate()));
     return true;
 }
 
@@ -174,6 +251,87 @@ bool V4L2Encoder::setPeakBitrate(uint32_t peakBitrate) {
         // TODO(b/190336806): Our stack doesn't support dynamic peak bitrate changes yet, ignore
         // errors for now.
         ALOGW("Setting peak bitrate to %u failed", peakBitrate);
+        return true;
+    }
+    mConfiguredPeakBitrate = peakBitrate;
+    growOutputBufferSize(GetOutputBufferSize(mVisibleSize, getMaxBitrate()));
+    return true;
+}
+
+bool V4L2Encoder::setConstantQuality(uint32_t quality) {
+    ALOGV("%s(%u)", __func__, quality);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+#ifdef V4L2_CID_MPEG_VIDEO_CONSTANT_QUALITY
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_CONSTANT_QUALITY, quality)})) {
+        ALOGE("Setting constant quality to %u failed", quality);
+        return false;
+    }
+    return true;
+#else
+    ALOGE("Constant quality mode is not supported");
+    return false;
+#endif
+}
+
+bool V4L2Encoder::setQpRange(uint32_t minQp, uint32_t maxQp) {
+    ALOGV("%s(%u, %u)", __func__, minQp, maxQp);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    uint32_t minQpCtrl, maxQpCtrl;
+    if (mOutputProfile >= C2Config::PROFILE_AVC_BASELINE &&
+        mOutputProfile <= C2Config::PROFILE_AVC_ENHANCED_MULTIVIEW_DEPTH_HIGH) {
+        minQpCtrl = V4L2_CID_MPEG_VIDEO_H264_MIN_QP;
+        maxQpCtrl = V4L2_CID_MPEG_VIDEO_H264_MAX_QP;
+    } else if (mOutputProfile >= C2Config::PROFILE_HEVC_MAIN &&
+               mOutputProfile <= C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS) {
+        minQpCtrl = V4L2_CID_MPEG_VIDEO_HEVC_MIN_QP;
+        maxQpCtrl = V4L2_CID_MPEG_VIDEO_HEVC_MAX_QP;
+#ifdef V4L2_CID_MPEG_VIDEO_VP9_MIN_QP
+    } else if (mOutputProfile >= C2Config::PROFILE_VP9_0 &&
+               mOutputProfile <= C2Config::PROFILE_VP9_3) {
+        minQpCtrl = V4L2_CID_MPEG_VIDEO_VP9_MIN_QP;
+        maxQpCtrl = V4L2_CID_MPEG_VIDEO_VP9_MAX_QP;
+#endif
+    } else {
+        // VP8 uses the VPX controls, as does VP9 if the kernel headers have no VP9 QP controls.
+        minQpCtrl = V4L2_CID_MPEG_VIDEO_VPX_MIN_QP;
+        maxQpCtrl = V4L2_CID_MPEG_VIDEO_VPX_MAX_QP;
+    }
+
+    // The QP bounds are optional, the rate controller keeps using its own bounds on failure.
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(minQpCtrl, minQp), V4L2ExtCtrl(maxQpCtrl, maxQp)})) {
+        ALOGW("Setting QP range to [%u, %u] failed", minQp, maxQp);
+        return false;
+    }
+    return true;
+}
+
+void V4L2Encoder::growOutputBufferSize(size_t size) {
+    // The size is only known once the output format is configured, which uses the bitrate.
+    if (mOutputBufferSize == 0 || size <= mOutputBufferSize) return;
+
+    // The output queue uses DMABUF memory, so larger blocks can be queued without reallocating the
+    // queue's buffers. The new size is used for the blocks fetched from now on.
+    ALOGV("Output buffer size increased from %u to %zu", mOutputBufferSize, size);
+    mOutputBufferSize = static_cast<uint32_t>(size);
+}
+
+bool V4L2Encoder::setTemporalLayerBitrates(const std::vector<uint32_t>& bitrates) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mNumTemporalLayers <= 1 || mTemporalLayerBitrateCtrls.empty()) return true;
+
+    std::vector<V4L2ExtCtrl> ctrls;
+    for (size_t i = 0; i < std::min<size_t>(bitrates.size(), mNumTemporalLayers); ++i) {
+        ctrls.emplace_back(mTemporalLayerBitrateCtrls[i], bitrates[i]);
+    }
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(ctrls))) {
+        // The per-layer bitrates are optional, the device will distribute the bitrate itself.
+        ALOGW("Setting temporal layer bitrates failed");
     }
     return true;
 }
@@ -191,6 +349,9 @@ bool V4L2Encoder::setFramerate(uint32_t framerate) {
         ALOGE("Setting framerate to %u failed", framerate);
         return false;
     }
+    // The framerate might be signaled in the SPS (VUI timing info).
+    if (framerate != mConfiguredFramerate) mParamsUpdatePending = true;
+    mConfiguredFramerate = framerate;
     return true;
 }
 
@@ -201,6 +362,96 @@ void V4L2Encoder::requestKeyframe() {
     mKeyFrameCounter = 0;
 }
 
+void V4L2Encoder::markLongTermReference(uint32_t index) {
+    ALOGV("%s(%u)", __func__, index);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (index >= mNumLongTermRefs) {
+        ALOGW("Ignoring request to mark long-term reference %u (%u slots)", index,
+              mNumLongTermRefs);
+        return;
+    }
+    mPendingLongTermRefMark = index;
+}
+
+void V4L2Encoder::useLongTermReferences(uint32_t mask) {
+    ALOGV("%s(0x%x)", __func__, mask);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    const uint32_t validMask = (1u << mNumLongTermRefs) - 1;
+    if (mask == 0 || (mask & ~validMask) != 0) {
+        ALOGW("Ignoring request to use long-term references 0x%x (%u slots)", mask,
+              mNumLongTermRefs);
+        return;
+    }
+    mPendingLongTermRefUse = mask;
+}
+
+bool V4L2Encoder::changeResolution(const ui::Size& visibleSize, uint32_t stride) {
+    ALOGV("%s(%s)", __func__, toString(visibleSize).c_str());
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::ERROR) return false;
+    if (mState != State::WAITING_FOR_INPUT_FRAME || !mEncodeRequests.empty()) {
+        ALOGE("Resolution can only be changed when the encoder is drained");
+        return false;
+    }
+
+    // Return the input buffers of the frames encoded before draining.
+    while (mInputQueue->queuedBuffersCount() > 0) {
+        if (!dequeueInputBuffer()) break;
+    }
+    if (mState == State::ERROR) return false;
+
+    // The formats can only be changed while the queues are not streaming. The device is kept open
+    // and streaming and polling are resumed when the next frame is queued.
+    if (!stopDevicePoll()) return false;
+    for (auto& queue : {mInputQueue, mOutputQueue}) {
+        if (queue->isStreaming() && !queue->streamoff()) {
+            ALOGE("Failed to stop streaming on the device queue");
+            onError();
+            return false;
+        }
+    }
+    for (auto& buf : mOutputBuffers) {
+        buf = nullptr;
+    }
+    mEnqueueTimes.clear();
+
+    // The input queue always needs to be reallocated. The output buffers can be kept unless
+    // larger bitstream buffers are required for the new resolution.
+    const bool reallocateOutputBuffers = GetOutputBufferSize(visibleSize, getMaxBitrate()) >
+                                         GetOutputBufferSize(mVisibleSize, getMaxBitrate());
+    destroyInputBuffers();
+    if (reallocateOutputBuffers) destroyOutputBuffers();
+
+    const VideoPixelFormat format = inputFormat();
+    mVisibleSize = visibleSize;
+    if ((reallocateOutputBuffers && !configureOutputFormat(mOutputProfile)) ||
+        !configureInputFormat(format, stride) || !createInputBuffers() ||
+        (reallocateOutputBuffers && !createOutputBuffers())) {
+        ALOGE("Failed to reconfigure device for %s", toString(visibleSize).c_str());
+        onError();
+        return false;
+    }
+
+    // Reconfigure the controls that depend on the resolution.
+    configureSliceOutput();
+    configureQpMap();
+    if (mIntraRefreshPeriod > 0 && !configureIntraRefresh()) {
+        ALOGW("Failed to reconfigure intra refresh for %s", toString(visibleSize).c_str());
+    }
+
+    // Start the new resolution with a key frame. The device will generate new parameter sets.
+    mKeyFrameCounter = 0;
+    mParamsUpdatePending = true;
+    mLastOutputTimestamp.reset();
+
+    ALOGV("Resolution changed to %s (coded size: %s)", toString(mVisibleSize).c_str(),
+          toString(mInputCodedSize).c_str());
+    return true;
+}
+
 VideoPixelFormat V4L2Encoder::inputFormat() const {
     return mInputLayout ? mInputLayout.value().mFormat : VideoPixelFormat::UNKNOWN;
 }
@@ -208,14 +459,23 @@ VideoPixelFormat V4L2Encoder::inputFormat() const {
 bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<uint8_t> level,
                              const ui::Size& visibleSize, uint32_t stride, uint32_t keyFramePeriod,
                              C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate,
-                             std::optional<uint32_t> peakBitrate) {
+                             std::optional<uint32_t> peakBitrate, uint32_t numTemporalLayers,
+                             uint32_t numLongTermRefs, uint32_t numBFrames,
+                             uint32_t intraRefreshPeriod, scoped_refptr<V4L2Device> device) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
-    ALOG_ASSERT(keyFramePeriod > 0);
 
+    mOutputProfile = outputProfile;
     mVisibleSize = visibleSize;
     mKeyFramePeriod = keyFramePeriod;
     mKeyFrameCounter = 0;
+    mNumTemporalLayers = std::clamp<uint32_t>(numTemporalLayers, 1u,
+                                              std::size(kH264LayerBitrateCtrls));
+    mNumLongTermRefs = numLongTermRefs;
+    mNumBFrames = numBFrames;
+    mIntraRefreshPeriod = intraRefreshPeriod;
+    mPendingLongTermRefMark.reset();
+    mPendingLongTermRefUse.reset();
 
     // Open the V4L2 device for encoding to the requested output format.
     // TODO(dstaessens): Avoid conversion to VideoCodecProfile and use C2Config::profile_t directly.
@@ -225,16 +485,21 @@ bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<ui
         return false;
     }
 
-    mDevice = V4L2Device::create();
-    if (!mDevice) {
-        ALOGE("Failed to create V4L2 device");
-        return false;
-    }
+    // Use the device opened in advance if provided, this avoids probing the device nodes again.
+    if (device) {
+        mDevice = std::move(device);
+    } else {
+        mDevice = V4L2Device::create();
+        if (!mDevice) {
+            ALOGE("Failed to create V4L2 device");
+            return false;
+        }
 
-    if (!mDevice->open(V4L2Device::Type::kEncoder, outputPixelFormat)) {
-        ALOGE("Failed to open device for profile %s (%s)", profileToString(outputProfile),
-              fourccToString(outputPixelFormat).c_str());
-        return false;
+        if (!mDevice->open(V4L2Device::Type::kEncoder, outputPixelFormat)) {
+            ALOGE("Failed to open device for profile %s (%s)", profileToString(outputProfile),
+                  fourccToString(outputPixelFormat).c_str());
+            return false;
+        }
     }
 
     // Make sure the device has all required capabilities (multi-planar Memory-To-Memory and
@@ -267,8 +532,11 @@ bool V4L2Encoder::initialize(C2Config::profile_t outputProfile, std::optional<ui
     if (!configureOutputFormat(outputProfile)) return false;
 
     // Configure the input format. If the device doesn't support the specified format we'll use one
-    // of the device's preferred formats in combination with an input format convertor.
-    if (!configureInputFormat(kInputPixelFormat, stride)) return false;
+    // of the device's preferred formats in combination with an input format convertor. 10-bit
+    // profiles require P010 input frames.
+    const VideoPixelFormat inputFormat =
+            isTenBitProfile(outputProfile) ? VideoPixelFormat::P016LE : kInputPixelFormat;
+    if (!configureInputFormat(inputFormat, stride)) return false;
 
     // Create input and output buffers.
     if (!createInputBuffers() || !createOutputBuffers()) return false;
@@ -311,7 +579,8 @@ void V4L2Encoder::handleEncodeRequest() {
     }
 
     // Request the next frame to be a key frame each time the counter reaches 0.
-    if (mKeyFrameCounter == 0) {
+    const bool keyFrame = mKeyFrameCounter == 0;
+    if (keyFrame) {
         if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
                                   {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME)})) {
             ALOGE("Failed requesting key frame");
@@ -319,7 +588,8 @@ void V4L2Encoder::handleEncodeRequest() {
             return;
         }
     }
-    mKeyFrameCounter = (mKeyFrameCounter + 1) % mKeyFramePeriod;
+    mKeyFrameCounter = (mKeyFramePeriod > 0) ? (mKeyFrameCounter + 1) % mKeyFramePeriod : 1;
+    applyLongTermReferenceRequests(keyFrame);
 
     // Enqueue the input frame in the V4L2 device.
     uint64_t index = encodeRequest.video_frame->index();
@@ -365,6 +635,18 @@ void V4L2Encoder::handleEncodeRequest() {
                           ::base::BindOnce(&V4L2Encoder::handleEncodeRequest, mWeakThis));
 }
 
+void V4L2Encoder::resumeEncoding() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Always handle the request in a separate task, even in low-latency mode. This is called from
+    // encode() and when dequeuing input buffers, handling the request right away would re-enter
+    // the client through the encoder callbacks.
+    setState(State::ENCODING);
+    mTaskRunner->PostTask(FROM_HERE,
+                          ::base::BindOnce(&V4L2Encoder::handleEncodeRequest, mWeakThis));
+}
+
 void V4L2Encoder::handleFlushRequest() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -391,6 +673,8 @@ void V4L2Encoder::handleFlushRequest() {
     for (auto& buf : mOutputBuffers) {
         buf = nullptr;
     }
+    mEnqueueTimes.clear();
+    mLastOutputTimestamp.reset();
 
     // Streaming and polling on the V4L2 device input and output queues will be resumed once new
     // encode work is queued.
@@ -458,7 +742,7 @@ void V4L2Encoder::onDrainDone(bool done) {
 bool V4L2Encoder::configureInputFormat(VideoPixelFormat inputFormat, uint32_t stride) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
-    ALOG_ASSERT(mState == State::UNINITIALIZED);
+    ALOG_ASSERT(mState == State::UNINITIALIZED || mState == State::WAITING_FOR_INPUT_FRAME);
     ALOG_ASSERT(!mInputQueue->isStreaming());
     ALOG_ASSERT(!isEmpty(mVisibleSize));
 
@@ -471,8 +755,9 @@ bool V4L2Encoder::configureInputFormat(VideoPixelFormat inputFormat, uint32_t st
 
     // If the device doesn't support the requested input format we'll try the device's preferred
     // input pixel formats and use a format convertor. We need to try all formats as some formats
-    // might not be supported for the configured output format.
-    if (!format) {
+    // might not be supported for the configured output format. The convertor can't up-convert
+    // 8-bit formats to P010, so there is no fallback for 10-bit input.
+    if (!format && inputFormat != VideoPixelFormat::P016LE) {
         std::vector<uint32_t> preferredFormats =
                 mDevice->preferredInputFormat(V4L2Device::Type::kEncoder);
         for (uint32_t i = 0; !format && i < preferredFormats.size(); ++i) {
@@ -494,6 +779,7 @@ bool V4L2Encoder::configureInputFormat(VideoPixelFormat inputFormat, uint32_t st
     }
 
     mInputLayout = layout.value();
+    mInputPlaneSizes = VideoFramePlaneSizes(mInputLayout->mFormat, mInputLayout->mCodedSize);
     if (!contains(Rect(mInputLayout->mCodedSize.width, mInputLayout->mCodedSize.height),
                   Rect(mVisibleSize.width, mVisibleSize.height))) {
         ALOGE("Input size %s exceeds encoder capability, encoder can handle %s",
@@ -567,12 +853,15 @@ bool V4L2Encoder::configureInputFormat(VideoPixelFormat inputFormat, uint32_t st
 bool V4L2Encoder::configureOutputFormat(C2Config::profile_t outputProfile) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
-    ALOG_ASSERT(mState == State::UNINITIALIZED);
+    ALOG_ASSERT(mState == State::UNINITIALIZED || mState == State::WAITING_FOR_INPUT_FRAME);
     ALOG_ASSERT(!mOutputQueue->isStreaming());
     ALOG_ASSERT(!isEmpty(mVisibleSize));
 
+    // Request output buffers sized for the bitrate rather than for the worst case, which is
+    // several megabytes per buffer at high resolutions.
     auto format = mOutputQueue->setFormat(V4L2Device::C2ProfileToV4L2PixFmt(outputProfile, false),
-                                          mVisibleSize, GetMaxOutputBufferSize(mVisibleSize));
+                                          mVisibleSize,
+                                          GetOutputBufferSize(mVisibleSize, getMaxBitrate()));
     if (!format) {
         ALOGE("Failed to set output format to %s", profileToString(outputProfile));
         return false;
@@ -587,7 +876,7 @@ bool V4L2Encoder::configureOutputFormat(C2Config::profile_t outputProfile) {
 }
 
 bool V4L2Encoder::configureDevice(C2Config::profile_t outputProfile,
-                                  std::optional<const uint8_t> outputH264Level) {
+                                  std::optional<const uint8_t> outputLevel) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
 
@@ -605,15 +894,86 @@ bool V4L2Encoder::configureDevice(C2Config::profile_t outputProfile,
     mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_MB_RC_ENABLE, 1),
                                                 V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_GOP_SIZE, 0)});
 
-    // All controls below are H.264-specific, so we can return here if the profile is not H.264.
+    // Configure the device to split frames into slices that are returned as soon as they are
+    // encoded, if requested.
+    configureSliceOutput();
+
+    // Configure the control used to encode regions of interest with a QP offset, if available.
+    configureQpMap();
+
+    // Intra refresh spreads the intra-coded macroblocks of a key frame over multiple frames, which
+    // avoids the bitrate spikes of periodic key frames.
+    if (mIntraRefreshPeriod > 0) {
+        if (configureIntraRefresh()) {
+            mKeyFramePeriod = 0;
+        } else {
+            ALOGW("Device doesn't support intra refresh, using periodic key frames");
+            mIntraRefreshPeriod = 0;
+        }
+    }
+
+    // Check whether the device reports the average QP of each encoded frame.
+#ifdef V4L2_CID_MPEG_VIDEO_AVERAGE_QP
+    mAverageQpSupported = mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_AVERAGE_QP);
+#else
+    mAverageQpSupported = false;
+#endif
+
+    // All controls below are H.264 or HEVC-specific, so we can return here for other profiles.
     if (outputProfile >= C2Config::PROFILE_AVC_BASELINE &&
         outputProfile <= C2Config::PROFILE_AVC_ENHANCED_MULTIVIEW_DEPTH_HIGH) {
-        return configureH264(outputProfile, outputH264Level);
+        return configureH264(outputProfile, outputLevel);
+    }
+    if (outputProfile >= C2Config::PROFILE_HEVC_MAIN &&
+        outputProfile <= C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS) {
+        return configureHEVC(outputProfile, outputLevel);
     }
 
     return true;
 }
 
+void V4L2Encoder::configureSliceOutput() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    static const int32_t kNumSlices =
+            property_get_int32("ro.vendor.v4l2_codec2.encode_slices", 0);
+    mSliceOutput = false;
+    if (kNumSlices <= 1) return;
+
+    // The multi-slice controls don't tell whether the device returns each slice in a separate
+    // buffer, so the property should only be set for devices that do. Check at least that the
+    // device can split frames by macroblock count, which is needed to know the number of slices.
+    struct v4l2_querymenu menu;
+    memset(&menu, 0, sizeof(menu));
+    menu.id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE;
+    menu.index = V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB;
+    if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB) ||
+        mDevice->ioctl(VIDIOC_QUERYMENU, &menu) != 0) {
+        ALOGW("Device doesn't support multi-slice encoding, slice output disabled");
+        return;
+    }
+
+    // Split each frame into |kNumSlices| slices of an equal number of macroblocks.
+    const uint32_t numMacroblocks = ((mVisibleSize.width + 15) / 16) *
+                                    ((mVisibleSize.height + 15) / 16);
+    const int32_t macroblocksPerSlice = static_cast<int32_t>(
+            (numMacroblocks + kNumSlices - 1) / static_cast<uint32_t>(kNumSlices));
+    if (!mDevice->setExtCtrls(
+                V4L2_CTRL_CLASS_MPEG,
+                {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE,
+                             V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB),
+                 V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, macroblocksPerSlice)})) {
+        ALOGW("Failed to configure multi-slice encoding, slice output disabled");
+        return;
+    }
+
+    mNumSlicesPerFrame = (numMacroblocks + macroblocksPerSlice - 1) / macroblocksPerSlice;
+    ALOGV("Slice output enabled (%d macroblocks per slice, %u slices per frame)",
+          macroblocksPerSlice, mNumSlicesPerFrame);
+    mSliceOutput = true;
+}
+
 bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
                                 std::optional<const uint8_t> outputH264Level) {
     // When encoding H.264 we want to prepend SPS and PPS to each IDR for resilience. Some
@@ -634,7 +994,7 @@ bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
 
     std::vector<V4L2ExtCtrl> h264Ctrls;
 
-    // No B-frames, for lowest decoding latency.
+    // No B-frames unless requested, for lowest decoding latency.
     h264Ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_B_FRAMES, 0);
     // Quantization parameter maximum value (for variable bitrate control).
     h264Ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_H264_MAX_QP, 51);
@@ -659,6 +1019,55 @@ bool V4L2Encoder::configureH264(C2Config::profile_t outputProfile,
     // Ignore return value as these controls are optional.
     mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(h264Ctrls));
 
+    configureTemporalLayers(outputProfile);
+    configureLongTermReferences();
+    configureBFrames();
+    return true;
+}
+
+bool V4L2Encoder::configureHEVC(C2Config::profile_t outputProfile,
+                                std::optional<const uint8_t> outputHEVCLevel) {
+    // As for H.264 we want to prepend the stream headers (VPS, SPS and PPS) to each IDR. Manually
+    // injecting them is only supported for H.264, so if the device doesn't support prepending them
+    // the headers are only present in front of the first frame and in the CSD.
+    mInjectParamsBeforeIDR = false;
+    if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR) ||
+        !mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR, 1)})) {
+        ALOGW("Device doesn't support prepending VPS, SPS and PPS to each IDR");
+    }
+
+    std::vector<V4L2ExtCtrl> hevcCtrls;
+
+    // No B-frames unless requested, for lowest decoding latency.
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_B_FRAMES, 0);
+    // Quantization parameter maximum value (for variable bitrate control).
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_MAX_QP, 51);
+
+    // Set HEVC profile.
+    int32_t profile = V4L2Device::c2ProfileToV4L2HEVCProfile(outputProfile);
+    if (profile < 0) {
+        ALOGE("Trying to set invalid HEVC profile");
+        return false;
+    }
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_PROFILE, profile);
+
+    // Set HEVC output level and tier. Use Main tier Level 4.1 as fallback default.
+    int32_t hevcLevel =
+            static_cast<int32_t>(outputHEVCLevel.value_or(V4L2_MPEG_VIDEO_HEVC_LEVEL_4_1));
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_LEVEL, hevcLevel);
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_TIER, V4L2_MPEG_VIDEO_HEVC_TIER_MAIN);
+
+    // Ask not to put the stream headers into separate bitstream buffers.
+    hevcCtrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEADER_MODE,
+                           V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME);
+
+    // Ignore return value as these controls are optional.
+    mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(hevcCtrls));
+
+    configureTemporalLayers(outputProfile);
+    configureLongTermReferences();
+    configureBFrames();
     return true;
 }
 
@@ -668,6 +1077,11 @@ bool V4L2Encoder::configureBitrateMode(C2Config::bitrate_mode_t bitrateMode) {
 
     v4l2_mpeg_video_bitrate_mode v4l2BitrateMode {};
             //V4L2Device::C2BitrateModeToV4L2BitrateMode(bitrateMode);
+    // Constant quality mode needs to be requested explicitly, the target quality is set through
+    // setConstantQuality().
+    if (bitrateMode == C2Config::BITRATE_IGNORE) {
+        v4l2BitrateMode = V4L2Device::C2BitrateModeToV4L2BitrateMode(bitrateMode);
+    }
     if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
                               {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_BITRATE_MODE, v4l2BitrateMode)})) {
         // TODO(b/190336806): Our stack doesn't support bitrate mode changes yet. We default to CBR
@@ -677,6 +1091,249 @@ bool V4L2Encoder::configureBitrateMode(C2Config::bitrate_mode_t bitrateMode) {
     return true;
 }
 
+void V4L2Encoder::configureRateControlBuffer(uint32_t bitrate) {
+    ALOGV("%s(%u)", __func__, bitrate);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // In low-latency mode we limit the size of the rate control buffer (VBV for all codecs, CPB
+    // for H.264), so the rate controller can't delay output by accumulating multiple frames worth
+    // of data. The buffer holds a fixed duration, so it's resized whenever the bitrate changes.
+    // These controls are optional, so failures are ignored.
+    if (!mLowLatency) return;
+
+    const int32_t bufferSizeKB = std::max<int32_t>(
+            1, static_cast<int32_t>(static_cast<uint64_t>(bitrate) *
+                                    kLowLatencyRateControlBufferMs / 8 / 1000 / 1000));
+    ALOGV("Limiting rate control buffer size to %d kB", bufferSizeKB);
+    if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_VBV_SIZE)) {
+        mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                             {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_VBV_SIZE, bufferSizeKB)});
+    }
+    if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_H264_CPB_SIZE)) {
+        mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                             {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_H264_CPB_SIZE, bufferSizeKB)});
+    }
+}
+
+void V4L2Encoder::configureTemporalLayers(C2Config::profile_t outputProfile) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    const uint32_t numLayers = mNumTemporalLayers;
+    mNumTemporalLayers = 1;
+    mTemporalLayerBitrateCtrls.clear();
+    if (numLayers <= 1) return;
+
+    const bool isHEVC = outputProfile >= C2Config::PROFILE_HEVC_MAIN &&
+                        outputProfile <= C2Config::PROFILE_HEVC_MAIN_10_HDR10_PLUS;
+    std::vector<V4L2ExtCtrl> ctrls;
+    if (isHEVC) {
+        if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_LAYER)) {
+            ALOGW("Device doesn't support HEVC hierarchical coding, temporal layering disabled");
+            return;
+        }
+        // The HEVC control selects the highest layer rather than the number of layers.
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_TYPE,
+                           V4L2_MPEG_VIDEO_HEVC_HIERARCHICAL_CODING_P);
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_HEVC_HIER_CODING_LAYER, numLayers - 1);
+    } else {
+        if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER)) {
+            ALOGW("Device doesn't support H.264 hierarchical coding, temporal layering disabled");
+            return;
+        }
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING, 1);
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_TYPE,
+                           V4L2_MPEG_VIDEO_H264_HIERARCHICAL_CODING_P);
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER, numLayers);
+    }
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(ctrls))) {
+        ALOGW("Failed to configure %u temporal layers, temporal layering disabled", numLayers);
+        return;
+    }
+
+    const uint32_t* layerBitrateCtrls = isHEVC ? kHEVCLayerBitrateCtrls : kH264LayerBitrateCtrls;
+    if (mDevice->isCtrlExposed(layerBitrateCtrls[0])) {
+        mTemporalLayerBitrateCtrls.assign(layerBitrateCtrls, layerBitrateCtrls + numLayers);
+    }
+    ALOGV("Temporal layering enabled (%u layers)", numLayers);
+    mNumTemporalLayers = numLayers;
+}
+
+uint32_t V4L2Encoder::getTemporalLayerId(uint32_t framesSinceKeyFrame) const {
+    // Hierarchical-P coding uses a dyadic pattern, e.g. for three layers: 0, 2, 1, 2, 0, 2, 1, 2.
+    const uint32_t patternLength = 1u << (mNumTemporalLayers - 1);
+    const uint32_t position = framesSinceKeyFrame % patternLength;
+    if (position == 0) return 0;
+    return mNumTemporalLayers - 1 - static_cast<uint32_t>(__builtin_ctz(position));
+}
+
+void V4L2Encoder::configureQpMap() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // There is no standard V4L2 control for regions of interest. Devices supporting them expose a
+    // driver-specific compound control that takes a signed 8-bit QP offset per 16x16 macroblock.
+    static const uint32_t kQpMapCtrl = static_cast<uint32_t>(
+            property_get_int32("ro.vendor.v4l2_codec2.encode_qp_map_ctrl", 0));
+    mQpMapCtrl = 0;
+    mQpMapActive = false;
+    if (kQpMapCtrl == 0) return;
+
+    if (!mDevice->isCtrlExposed(kQpMapCtrl)) {
+        ALOGW("Device doesn't expose QP map control 0x%x, regions of interest disabled",
+              kQpMapCtrl);
+        return;
+    }
+    const uint32_t numMacroblocks = ((mVisibleSize.width + 15) / 16) *
+                                    ((mVisibleSize.height + 15) / 16);
+    mQpMap.assign(numMacroblocks, 0);
+    mQpMapCtrl = kQpMapCtrl;
+    ALOGV("Regions of interest enabled (QP map control: 0x%x)", mQpMapCtrl);
+}
+
+void V4L2Encoder::applyQpMap(const InputFrame& frame) {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // Controls are persistent, so the map only needs to be set if it changes. A frame without
+    // regions of interest clears the previously set map.
+    if (mQpMapCtrl == 0 || (frame.qpOffsetRects().empty() && !mQpMapActive)) return;
+
+    const uint32_t widthInMbs = (mVisibleSize.width + 15) / 16;
+    const uint32_t heightInMbs = (mVisibleSize.height + 15) / 16;
+    std::fill(mQpMap.begin(), mQpMap.end(), 0);
+    for (const QpOffsetRect& rect : frame.qpOffsetRects()) {
+        const int8_t qpOffset = static_cast<int8_t>(std::clamp(rect.qpOffset, -51, 51));
+        // Include all macroblocks partially covered by the region. The region is specified by the
+        // client, so the bounds are computed in 64-bit to avoid overflows, and clamped to the
+        // frame.
+        const uint64_t left = std::min<uint64_t>(rect.left / 16, widthInMbs);
+        const uint64_t top = std::min<uint64_t>(rect.top / 16, heightInMbs);
+        const uint64_t right = std::min<uint64_t>(
+                (static_cast<uint64_t>(rect.left) + rect.width + 15) / 16, widthInMbs);
+        const uint64_t bottom = std::min<uint64_t>(
+                (static_cast<uint64_t>(rect.top) + rect.height + 15) / 16, heightInMbs);
+        if (right <= left || bottom <= top) continue;
+        for (uint64_t y = top; y < bottom; ++y) {
+            std::fill(mQpMap.begin() + y * widthInMbs + left,
+                      mQpMap.begin() + y * widthInMbs + right, qpOffset);
+        }
+    }
+
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(mQpMapCtrl, mQpMap.data(), mQpMap.size())})) {
+        // The frame is still encoded, only without region of interest QP offsets.
+        ALOGW("Failed to set QP map (index: %" PRIu64 ")", frame.index());
+        return;
+    }
+    mQpMapActive = !frame.qpOffsetRects().empty();
+}
+
+void V4L2Encoder::configureLongTermReferences() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mNumLongTermRefs == 0) return;
+
+    if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_LTR_COUNT) ||
+        !mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_FRAME_LTR_INDEX) ||
+        !mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_USE_LTR_FRAMES)) {
+        ALOGW("Device doesn't support long-term references");
+        mNumLongTermRefs = 0;
+        return;
+    }
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_LTR_COUNT, mNumLongTermRefs)})) {
+        ALOGW("Failed to configure %u long-term references", mNumLongTermRefs);
+        mNumLongTermRefs = 0;
+        return;
+    }
+    ALOGV("Long-term references enabled (%u slots)", mNumLongTermRefs);
+}
+
+bool V4L2Encoder::configureIntraRefresh() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+    ALOG_ASSERT(mIntraRefreshPeriod > 0);
+
+#ifdef V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD
+    // Prefer specifying the refresh period in frames, the type control is optional as cyclic is
+    // the default refresh type.
+    if (mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD)) {
+        mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                             {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE,
+                                          V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC)});
+        if (mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                                 {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD,
+                                              mIntraRefreshPeriod)})) {
+            ALOGV("Intra refresh enabled (period: %u frames)", mIntraRefreshPeriod);
+            return true;
+        }
+    }
+#endif
+
+    // Otherwise specify the number of macroblocks refreshed in each frame.
+    if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB)) return false;
+    const uint32_t numMacroblocks = ((mVisibleSize.width + 15) / 16) *
+                                    ((mVisibleSize.height + 15) / 16);
+    const int32_t macroblocksPerFrame = static_cast<int32_t>(
+            (numMacroblocks + mIntraRefreshPeriod - 1) / mIntraRefreshPeriod);
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB,
+                                           macroblocksPerFrame)})) {
+        return false;
+    }
+    ALOGV("Intra refresh enabled (%d macroblocks per frame)", macroblocksPerFrame);
+    return true;
+}
+
+void V4L2Encoder::configureBFrames() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mNumBFrames == 0) return;
+
+    // Slices of B-frames would be returned before the slices of the frames they reference.
+    if (mSliceOutput) {
+        ALOGW("B-frames are not supported in slice output mode");
+        mNumBFrames = 0;
+        return;
+    }
+    if (!mDevice->isCtrlExposed(V4L2_CID_MPEG_VIDEO_B_FRAMES) ||
+        !mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG,
+                              {V4L2ExtCtrl(V4L2_CID_MPEG_VIDEO_B_FRAMES, mNumBFrames)})) {
+        ALOGW("Device doesn't support %u B-frames", mNumBFrames);
+        mNumBFrames = 0;
+        return;
+    }
+    ALOGV("B-frames enabled (%u consecutive B-frames)", mNumBFrames);
+}
+
+void V4L2Encoder::applyLongTermReferenceRequests(bool keyFrame) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    // A key frame invalidates all references, so a pending request to predict from long-term
+    // references is obsolete. The key frame can still be marked as long-term reference.
+    if (keyFrame) mPendingLongTermRefUse.reset();
+    if (!mPendingLongTermRefMark && !mPendingLongTermRefUse) return;
+
+    std::vector<V4L2ExtCtrl> ctrls;
+    if (mPendingLongTermRefMark) {
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_FRAME_LTR_INDEX, *mPendingLongTermRefMark);
+    }
+    if (mPendingLongTermRefUse) {
+        ctrls.emplace_back(V4L2_CID_MPEG_VIDEO_USE_LTR_FRAMES, *mPendingLongTermRefUse);
+    }
+    mPendingLongTermRefMark.reset();
+    mPendingLongTermRefUse.reset();
+
+    // If this fails the frame is encoded as usual, the client can still fall back to requesting a
+    // key frame.
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_MPEG, std::move(ctrls))) {
+        ALOGW("Failed to apply long-term reference requests");
+    }
+}
+
 bool V4L2Encoder::startDevicePoll() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -720,6 +1377,19 @@ void V4L2Encoder::serviceDeviceTask(bool /*event*/) {
         return;
     }
 
+    // Drain all the ready input and output buffers before polling is scheduled again, instead of
+    // re-arming the poller for every buffer dequeued and queued.
+    V4L2Device::ScopedPollBatch pollBatch(mDevice);
+
+    // In low-latency and slice output mode encoded output is returned to the client before
+    // handling the input buffers, as dequeueing input buffers might trigger encoding the next
+    // frame.
+    if (mLowLatency || mSliceOutput) {
+        while (mOutputQueue->queuedBuffersCount() > 0) {
+            if (!dequeueOutputBuffer()) break;
+        }
+    }
+
     // Dequeue completed input (VIDEO_OUTPUT) buffers, and recycle to the free list.
     while (mInputQueue->queuedBuffersCount() > 0) {
         if (!dequeueInputBuffer()) break;
@@ -750,7 +1420,10 @@ bool V4L2Encoder::enqueueInputBuffer(std::unique_ptr<InputFrame> frame) {
 
     ALOGV("%s(): queuing input buffer (index: %" PRId64 ")", __func__, index);
 
-    auto buffer = mInputQueue->getFreeBuffer();
+    // Queue a buffer we have seen before in the same V4L2 buffer as the previous time, so the
+    // driver doesn't have to import and map the dmabuf again.
+    std::optional<V4L2WritableBufferRef> buffer =
+            mInputQueue->getFreeBufferForDmabuf(frame->dmabufId());
     if (!buffer) {
         ALOGE("Failed to get free buffer from device input queue");
         return false;
@@ -762,15 +1435,17 @@ bool V4L2Encoder::enqueueInputBuffer(std::unique_ptr<InputFrame> frame) {
              .tv_usec = static_cast<time_t>(timestamp % ::base::Time::kMicrosecondsPerSecond)});
     size_t bufferId = buffer->bufferId();
 
+    if (format != mInputPlaneSizes.mFormat) {
+        mInputPlaneSizes = VideoFramePlaneSizes(format, mInputLayout->mCodedSize);
+    }
     for (size_t i = 0; i < planes.size(); ++i) {
         // Single-buffer input format may have multiple color planes, so bytesUsed of the single
         // buffer should be sum of each color planes' size.
         size_t bytesUsed = 0;
         if (planes.size() == 1) {
-            bytesUsed = allocationSize(format, mInputLayout->mCodedSize);
-        } else {
-            bytesUsed = ::base::checked_cast<size_t>(
-                    getArea(planeSize(format, i, mInputLayout->mCodedSize)).value());
+            bytesUsed = mInputPlaneSizes.mAllocationSize;
+        } else if (i < mInputPlaneSizes.mPlaneSizes.size()) {
+            bytesUsed = mInputPlaneSizes.mPlaneSizes[i];
         }
 
         // TODO(crbug.com/901264): The way to pass an offset within a DMA-buf is not defined
@@ -783,6 +1458,9 @@ bool V4L2Encoder::enqueueInputBuffer(std::unique_ptr<InputFrame> frame) {
         buffer->setPlaneBytesUsed(i, bytesUsed);
     }
 
+    // Set the QP offsets of the frame's regions of interest before queueing it.
+    applyQpMap(*frame);
+
     if (!std::move(*buffer).queueDMABuf(frame->fds())) {
         ALOGE("Failed to queue input buffer using QueueDMABuf");
         onError();
@@ -792,6 +1470,8 @@ bool V4L2Encoder::enqueueInputBuffer(std::unique_ptr<InputFrame> frame) {
     ALOGV("Queued buffer in input queue (index: %" PRId64 ", timestamp: %" PRId64
           ", bufferId: %zu)",
           index, timestamp, bufferId);
+    if (mLatencyTracker) mLatencyTracker->mark(index, "enqueue");
+    mEnqueueTimes[timestamp] = ::base::TimeTicks::Now();
 
     ALOG_ASSERT(!mInputBuffers[bufferId]);
     mInputBuffers[bufferId] = std::move(frame);
@@ -811,8 +1491,13 @@ bool V4L2Encoder::enqueueOutputBuffer() {
         return false;
     }
 
+    // If SPS and PPS need to be injected before IDR frames, reserve headroom at the front of the
+    // buffer so they can be written in place. Like on the input queue the data offset is abused
+    // for this, if the driver doesn't honor it we fall back to copying IDR frames.
+    const size_t headroom = getOutputHeadroom();
+
     std::unique_ptr<BitstreamBuffer> bitstreamBuffer;
-    mFetchOutputBufferCb.Run(mOutputBufferSize, &bitstreamBuffer);
+    mFetchOutputBufferCb.Run(mOutputBufferSize + headroom, &bitstreamBuffer);
     if (!bitstreamBuffer) {
         ALOGE("Failed to fetch output block");
         onError();
@@ -820,6 +1505,9 @@ bool V4L2Encoder::enqueueOutputBuffer() {
     }
 
     size_t bufferId = buffer->bufferId();
+    if (headroom > 0) {
+        buffer->setPlaneDataOffset(0, headroom);
+    }
 
     std::vector<int> fds;
     fds.push_back(bitstreamBuffer->dmabuf->handle()->data[0]);
@@ -864,16 +1552,14 @@ bool V4L2Encoder::dequeueInputBuffer() {
     ALOGV("Dequeued buffer from input queue (index: %" PRId64 ", timestamp: %" PRId64
           ", bufferId: %zu)",
           index, timestamp, buffer->bufferId());
+    if (mLatencyTracker) mLatencyTracker->mark(index, "dequeueInput");
 
     mInputBuffers[buffer->bufferId()] = nullptr;
-
     mInputBufferDoneCb.Run(index);
 
     // If we previously used up all input queue buffers we can start encoding again now.
     if ((mState == State::WAITING_FOR_V4L2_BUFFER) && !mEncodeRequests.empty()) {
-        setState(State::ENCODING);
-        mTaskRunner->PostTask(FROM_HERE,
-                              ::base::BindOnce(&V4L2Encoder::handleEncodeRequest, mWeakThis));
+        resumeEncoding();
     }
 
     return true;
@@ -902,7 +1588,8 @@ bool V4L2Encoder::dequeueOutputBuffer() {
         return false;
     }
 
-    size_t encodedDataSize = buffer->getPlaneBytesUsed(0) - buffer->getPlaneDataOffset(0);
+    size_t dataOffset = buffer->getPlaneDataOffset(0);
+    size_t encodedDataSize = buffer->getPlaneBytesUsed(0) - dataOffset;
     ::base::TimeDelta timestamp = ::base::TimeDelta::FromMicroseconds(
             buffer->getTimeStamp().tv_usec +
             buffer->getTimeStamp().tv_sec * ::base::Time::kMicrosecondsPerSecond);
@@ -911,55 +1598,127 @@ bool V4L2Encoder::dequeueOutputBuffer() {
           ", bufferId: %zu, data size: %zu, EOS: %d)",
           timestamp.InMicroseconds(), buffer->bufferId(), encodedDataSize, buffer->isLast());
 
+    // In slice output mode a frame is returned in multiple buffers, of which only the first one
+    // should be treated as the start of an IDR frame when injecting SPS and PPS.
+    const bool firstSlice = !mSliceOutput || mLastOutputTimestamp != timestamp.InMicroseconds();
+    const bool startOfKeyFrame = buffer->isKeyframe() && firstSlice;
+    // A frame is complete once all its slices have been returned. The slices might still be in
+    // flight when the device returns the input buffer, so the number of slices is tracked instead.
+    bool lastSlice = true;
+    if (mSliceOutput && encodedDataSize > 0) {
+        if (firstSlice && mLastOutputTimestamp && mNumSlicesDequeued < mNumSlicesPerFrame) {
+            ALOGE("Device returned %u of %u slices of frame (timestamp: %" PRId64 ")",
+                  mNumSlicesDequeued, mNumSlicesPerFrame, *mLastOutputTimestamp);
+            onError();
+            return false;
+        }
+        mNumSlicesDequeued = firstSlice ? 1 : mNumSlicesDequeued + 1;
+        lastSlice = buffer->isLast() || mNumSlicesDequeued >= mNumSlicesPerFrame;
+    }
+    if (encodedDataSize > 0) mLastOutputTimestamp = timestamp.InMicroseconds();
+
     if (!mOutputBuffers[buffer->bufferId()]) {
         ALOGE("Failed to find output block associated with output buffer");
         onError();
         return false;
     }
 
-    std::unique_ptr<BitstreamBuffer> bitstreamBuffer =
-            std::move(mOutputBuffers[buffer->bufferId()]);
+    // The device flags the buffer as erroneous, or fills it entirely, if the encoded frame didn't
+    // fit. The likely truncated frame is dropped. Use larger blocks for the next frames, up to the
+    // worst-case size, and request a key frame so the stream recovers.
+    const size_t blockSize = mOutputBuffers[buffer->bufferId()]->dmabuf->capacity();
+    const bool truncated = (buffer->isError() && !buffer->isLast()) ||
+                           (encodedDataSize > 0 && buffer->getPlaneBytesUsed(0) >= blockSize);
+    if (truncated) {
+        ALOGW("Output buffer overflow (block size: %zu, bytes used: %zu, error: %d)", blockSize,
+              buffer->getPlaneBytesUsed(0), buffer->isError());
+        growOutputBufferSize(std::min(blockSize * 2, GetMaxOutputBufferSize(mVisibleSize)));
+        requestKeyframe();
+    }
+
+    // The encoded data starts at the data offset reported by the device.
+    std::unique_ptr<BitstreamBuffer> bitstreamBuffer = std::make_unique<BitstreamBuffer>(
+            std::move(mOutputBuffers[buffer->bufferId()]->dmabuf), dataOffset, encodedDataSize);
+    mOutputBuffers[buffer->bufferId()] = nullptr;
+    // Key frames restart the temporal layering pattern. All slices of a frame share its layer.
+    if (encodedDataSize > 0 && firstSlice) {
+        mFramesSinceKeyFrame = buffer->isKeyframe() ? 0 : mFramesSinceKeyFrame + 1;
+        mTemporalLayerId = getTemporalLayerId(mFramesSinceKeyFrame);
+    }
+    bitstreamBuffer->temporalLayerId = mTemporalLayerId;
+    bitstreamBuffer->lastSlice = lastSlice;
     if (encodedDataSize > 0) {
+        // With B-frames frames are not output in the order they were queued, so only the entry of
+        // this frame is removed. All slices of a frame report the time since the frame was queued.
+        auto it = mEnqueueTimes.find(timestamp.InMicroseconds());
+        if (it != mEnqueueTimes.end()) {
+            bitstreamBuffer->encodeTimeUs =
+                    (::base::TimeTicks::Now() - it->second).InMicroseconds();
+            if (lastSlice) mEnqueueTimes.erase(it);
+        }
+        bitstreamBuffer->averageQp = getAverageQp().value_or(-1);
+    }
+    // vb2 doesn't preserve the data offset of CAPTURE buffers, so most drivers write the encoded
+    // data at the start of the buffer. Stop reserving headroom once that's detected, IDR frames
+    // are then always copied to prepend SPS and PPS.
+    if (encodedDataSize > 0 && mInjectParamsBeforeIDR && mOutputHeadroomSupported &&
+        dataOffset < kStreamHeaderHeadroom) {
+        ALOGI("Device ignores the output data offset, SPS and PPS will be prepended by copying");
+        mOutputHeadroomSupported = false;
+    }
+
+    if (truncated) {
+        bitstreamBuffer->dropped = true;
+        mOutputBufferDoneCb.Run(0, timestamp.InMicroseconds(), false, std::move(bitstreamBuffer));
+    } else if (encodedDataSize > 0) {
         if (!mInjectParamsBeforeIDR) {
             // No need to inject SPS or PPS before IDR frames, we can just return the buffer as-is.
             mOutputBufferDoneCb.Run(encodedDataSize, timestamp.InMicroseconds(),
                                     buffer->isKeyframe(), std::move(bitstreamBuffer));
-        } else if (!buffer->isKeyframe()) {
+        } else if (!startOfKeyFrame) {
             // We need to inject SPS and PPS before IDR frames, but this frame is not a key frame.
-            // We can return the buffer as-is, but need to update our SPS and PPS cache if required.
-            C2ConstLinearBlock constBlock = bitstreamBuffer->dmabuf->share(
-                    bitstreamBuffer->dmabuf->offset(), encodedDataSize, C2Fence());
-            C2ReadView readView = constBlock.map().get();
-            extractSPSPPS(readView.data(), encodedDataSize, &mCachedSPS, &mCachedPPS);
+            // We can return the buffer as-is, but need to update our SPS and PPS cache if the
+            // device might have attached new ones. In steady state the frame isn't even mapped.
+            if (mParamsUpdatePending) {
+                C2ConstLinearBlock constBlock = bitstreamBuffer->dmabuf->share(
+                        bitstreamBuffer->dmabuf->offset() + dataOffset, encodedDataSize,
+                        C2Fence());
+                C2ReadView readView = constBlock.map().get();
+                if (extractSPSPPS(readView.data(), encodedDataSize, &mCachedSPS, &mCachedPPS)) {
+                    ALOGV("Updated cached SPS and PPS from non-key frame");
+                    mParamsUpdatePending = false;
+                }
+            }
             mOutputBufferDoneCb.Run(encodedDataSize, timestamp.InMicroseconds(),
                                     buffer->isKeyframe(), std::move(bitstreamBuffer));
         } else {
             // We need to inject our cached SPS and PPS NAL units to the IDR frame. It's possible
             // this frame already has SPS and PPS NAL units attached, in which case we only need to
-            // update our cached SPS and PPS.
-            C2ConstLinearBlock constBlock = bitstreamBuffer->dmabuf->share(
-                    bitstreamBuffer->dmabuf->offset(), encodedDataSize, C2Fence());
-            C2ReadView readView = constBlock.map().get();
-
-            // Allocate a new buffer to copy the data with prepended SPS and PPS into.
-            std::unique_ptr<BitstreamBuffer> prependedBitstreamBuffer;
-            mFetchOutputBufferCb.Run(mOutputBufferSize, &prependedBitstreamBuffer);
-            if (!prependedBitstreamBuffer) {
-                ALOGE("Failed to fetch output block");
-                onError();
-                return false;
+            // update our cached SPS and PPS. If the device honors the headroom we reserved, the
+            // SPS and PPS are written in place in front of the frame. Either way the key frame is
+            // scanned entirely, so the cache is up-to-date afterwards.
+            mParamsUpdatePending = false;
+            std::optional<size_t> headerSize;
+            if (mOutputHeadroomSupported) {
+                C2WriteView writeView = bitstreamBuffer->dmabuf->map().get();
+                headerSize = injectSPSPPSBeforeIDR(writeView.data() + dataOffset, encodedDataSize,
+                                                   dataOffset, &mCachedSPS, &mCachedPPS);
             }
-            C2WriteView writeView = prependedBitstreamBuffer->dmabuf->map().get();
-
-            // If there is not enough space in the output buffer just return the original buffer.
-            size_t newSize = prependSPSPPSToIDR(readView.data(), encodedDataSize, writeView.data(),
-                                                writeView.size(), &mCachedSPS, &mCachedPPS);
-            if (newSize > 0) {
+            if (headerSize) {
+                size_t newOffset = dataOffset - *headerSize;
+                size_t newSize = encodedDataSize + *headerSize;
+                std::unique_ptr<BitstreamBuffer> injectedBitstreamBuffer =
+                        std::make_unique<BitstreamBuffer>(std::move(bitstreamBuffer->dmabuf),
+                                                          newOffset, newSize);
+                injectedBitstreamBuffer->averageQp = bitstreamBuffer->averageQp;
+                injectedBitstreamBuffer->encodeTimeUs = bitstreamBuffer->encodeTimeUs;
+                bitstreamBuffer = std::move(injectedBitstreamBuffer);
                 mOutputBufferDoneCb.Run(newSize, timestamp.InMicroseconds(), buffer->isKeyframe(),
-                                        std::move(prependedBitstreamBuffer));
-            } else {
-                mOutputBufferDoneCb.Run(encodedDataSize, timestamp.InMicroseconds(),
-                                        buffer->isKeyframe(), std::move(bitstreamBuffer));
+                                        std::move(bitstreamBuffer));
+            } else if (!prependSPSPPSByCopy(dataOffset, encodedDataSize,
+                                            timestamp.InMicroseconds(), buffer->isKeyframe(),
+                                            std::move(bitstreamBuffer))) {
+                return false;
             }
         }
     }
@@ -985,6 +1744,67 @@ bool V4L2Encoder::dequeueOutputBuffer() {
     return true;
 }
 
+bool V4L2Encoder::prependSPSPPSByCopy(size_t dataOffset, size_t dataSize, int64_t timestamp,
+                                     bool keyFrame, std::unique_ptr<BitstreamBuffer> buffer) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    C2ConstLinearBlock constBlock =
+            buffer->dmabuf->share(buffer->dmabuf->offset() + dataOffset, dataSize, C2Fence());
+    C2ReadView readView = constBlock.map().get();
+
+    // Allocate a new buffer to copy the data with prepended SPS and PPS into. Use the same size as
+    // the output queue buffers, so the output block pool can recycle the blocks for either use.
+    const size_t headroom = getOutputHeadroom();
+    std::unique_ptr<BitstreamBuffer> prependedBitstreamBuffer;
+    mFetchOutputBufferCb.Run(mOutputBufferSize + headroom, &prependedBitstreamBuffer);
+    if (!prependedBitstreamBuffer) {
+        ALOGE("Failed to fetch output block");
+        onError();
+        return false;
+    }
+    C2WriteView writeView = prependedBitstreamBuffer->dmabuf->map().get();
+
+    // If there is not enough space in the output buffer just return the original buffer.
+    size_t newSize = prependSPSPPSToIDR(readView.data(), dataSize, writeView.data(),
+                                        writeView.size(), &mCachedSPS, &mCachedPPS);
+    if (newSize > 0) {
+        prependedBitstreamBuffer->averageQp = buffer->averageQp;
+        prependedBitstreamBuffer->encodeTimeUs = buffer->encodeTimeUs;
+        mOutputBufferDoneCb.Run(newSize, timestamp, keyFrame, std::move(prependedBitstreamBuffer));
+    } else {
+        mOutputBufferDoneCb.Run(dataSize, timestamp, keyFrame, std::move(buffer));
+    }
+    return true;
+}
+
+size_t V4L2Encoder::getOutputHeadroom() const {
+    return (mInjectParamsBeforeIDR && mOutputHeadroomSupported) ? kStreamHeaderHeadroom : 0;
+}
+
+std::optional<int32_t> V4L2Encoder::getAverageQp() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mAverageQpSupported) return std::nullopt;
+
+#ifdef V4L2_CID_MPEG_VIDEO_AVERAGE_QP
+    // The control reports the QP of the last frame encoded. Frames are output in order, so when
+    // the device encodes ahead this is the QP of a later frame, which is close enough for rate
+    // control statistics.
+    struct v4l2_control ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.id = V4L2_CID_MPEG_VIDEO_AVERAGE_QP;
+    if (mDevice->ioctl(VIDIOC_G_CTRL, &ctrl) != 0) {
+        ALOGW("Failed to get average QP, disabling average QP reporting");
+        mAverageQpSupported = false;
+        return std::nullopt;
+    }
+    return ctrl.value;
+#else
+    return std::nullopt;
+#endif
+}
+
 bool V4L2Encoder::createInputBuffers() {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
@@ -993,7 +1813,7 @@ bool V4L2Encoder::createInputBuffers() {
 
     // No memory is allocated here, we just generate a list of buffers on the input queue, which
     // will hold memory handles to the real buffers.
-    if (mInputQueue->allocateBuffers(kInputBufferCount, V4L2_MEMORY_DMABUF) < kInputBufferCount) {
+    if (mInputQueue->allocateBuffers(mQueueDepth, V4L2_MEMORY_DMABUF) < mQueueDepth) {
         ALOGE("Failed to create V4L2 input buffers.");
         return false;
     }
@@ -1010,8 +1830,7 @@ bool V4L2Encoder::createOutputBuffers() {
 
     // No memory is allocated here, we just generate a list of buffers on the output queue, which
     // will hold memory handles to the real buffers.
-    if (mOutputQueue->allocateBuffers(kOutputBufferCount, V4L2_MEMORY_DMABUF) <
-        kOutputBufferCount) {
+    if (mOutputQueue->allocateBuffers(mQueueDepth, V4L2_MEMORY_DMABUF) < mQueueDepth) {
         ALOGE("Failed to create V4L2 output buffers.");
         return false;
     }
@@ -0,0 +1,1355 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2StatelessDecoder"
+
+#include <v4l2_codec2/components/V4L2StatelessDecoder.h>
+
+#include <linux/v4l2-controls.h>
+#include <linux/videodev2.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <C2Buffer.h>
+#include <base/bind.h>
+#include <base/memory/ptr_util.h>
+#include <log/log.h>
+
+#include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/Fourcc.h>
+#include <v4l2_codec2/common/NalParser.h>
+
+// These flags were added to the stable H.264 stateless API after its initial version.
+#ifndef V4L2_H264_DECODE_PARAM_FLAG_PFRAME
+#define V4L2_H264_DECODE_PARAM_FLAG_PFRAME 0x08
+#endif
+#ifndef V4L2_H264_DECODE_PARAM_FLAG_BFRAME
+#define V4L2_H264_DECODE_PARAM_FLAG_BFRAME 0x10
+#endif
+
+namespace android {
+namespace {
+
+constexpr size_t kNumInputBuffers = 4;
+// Extra buffers for transmitting in the whole video pipeline.
+constexpr size_t kNumExtraOutputBuffers = 4;
+
+constexpr uint8_t kStartCode[] = {0x00, 0x00, 0x01};
+
+// The V4L2 buffer timestamp of the input buffer with |bitstreamId|, in nanoseconds. Reference
+// pictures are identified using the timestamp of the input buffer they were decoded from.
+uint64_t bitstreamIdToTimestampNs(int32_t bitstreamId) {
+    return static_cast<uint64_t>(bitstreamId) * 1000000000ull;
+}
+
+// Fill the V4L2 SPS control from |sps|.
+void fillSpsCtrl(const H264SPS& sps, struct v4l2_ctrl_h264_sps* ctrl) {
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->profile_idc = sps.profileIdc;
+    ctrl->constraint_set_flags = sps.constraintSetFlags;
+    ctrl->level_idc = sps.levelIdc;
+    ctrl->seq_parameter_set_id = sps.seqParameterSetId;
+    ctrl->chroma_format_idc = sps.chromaFormatIdc;
+    ctrl->bit_depth_luma_minus8 = sps.bitDepthLumaMinus8;
+    ctrl->bit_depth_chroma_minus8 = sps.bitDepthChromaMinus8;
+    ctrl->log2_max_frame_num_minus4 = sps.log2MaxFrameNumMinus4;
+    ctrl->pic_order_cnt_type = sps.picOrderCntType;
+    ctrl->log2_max_pic_order_cnt_lsb_minus4 = sps.log2MaxPicOrderCntLsbMinus4;
+    ctrl->max_num_ref_frames = sps.maxNumRefFrames;
+    ctrl->num_ref_frames_in_pic_order_cnt_cycle = sps.numRefFramesInPicOrderCntCycle;
+    std::copy(sps.offsetForRefFrame, sps.offsetForRefFrame + sps.numRefFramesInPicOrderCntCycle,
+              ctrl->offset_for_ref_frame);
+    ctrl->offset_for_non_ref_pic = sps.offsetForNonRefPic;
+    ctrl->offset_for_top_to_bottom_field = sps.offsetForTopToBottomField;
+    ctrl->pic_width_in_mbs_minus1 = sps.picWidthInMbsMinus1;
+    ctrl->pic_height_in_map_units_minus1 = sps.picHeightInMapUnitsMinus1;
+    if (sps.separateColourPlaneFlag) ctrl->flags |= V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE;
+    if (sps.qpprimeYZeroTransformBypassFlag) {
+        ctrl->flags |= V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS;
+    }
+    if (sps.deltaPicOrderAlwaysZeroFlag) {
+        ctrl->flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
+    }
+    if (sps.gapsInFrameNumValueAllowedFlag) {
+        ctrl->flags |= V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED;
+    }
+    if (sps.frameMbsOnlyFlag) ctrl->flags |= V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+    if (sps.mbAdaptiveFrameFieldFlag) ctrl->flags |= V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD;
+    if (sps.direct8x8InferenceFlag) ctrl->flags |= V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<VideoDecoder> V4L2StatelessDecoder::Create(
+        const VideoCodec& codec, const size_t inputBufferSize, bool lowLatency,
+        GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb,
+        scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
+    if (codec != VideoCodec::H264) {
+        ALOGE("Stateless decoding of %s is not supported", VideoCodecToString(codec));
+        return nullptr;
+    }
+
+    std::unique_ptr<V4L2StatelessDecoder> decoder =
+            ::base::WrapUnique<V4L2StatelessDecoder>(new V4L2StatelessDecoder(taskRunner));
+    if (!decoder->start(inputBufferSize, lowLatency, std::move(getPoolCb), std::move(outputCb),
+                        std::move(errorCb))) {
+        return nullptr;
+    }
+    return decoder;
+}
+
+V4L2StatelessDecoder::V4L2StatelessDecoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner)
+      : mTaskRunner(std::move(taskRunner)) {
+    ALOGV("%s()", __func__);
+
+    mWeakThis = mWeakThisFactory.GetWeakPtr();
+}
+
+V4L2StatelessDecoder::~V4L2StatelessDecoder() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    mWeakThisFactory.InvalidateWeakPtrs();
+
+    // Streamoff input and output queue.
+    if (mOutputQueue) {
+        mOutputQueue->streamoff();
+        mOutputQueue->deallocateBuffers();
+        mOutputQueue = nullptr;
+    }
+    if (mInputQueue) {
+        mInputQueue->streamoff();
+        mInputQueue->deallocateBuffers();
+        mInputQueue = nullptr;
+    }
+    mRequestFds.clear();
+    if (mDevice) {
+        mDevice->stopPolling();
+        mDevice = nullptr;
+    }
+}
+
+bool V4L2StatelessDecoder::start(const size_t inputBufferSize, bool lowLatency,
+                                 GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb) {
+    ALOGV("%s(inputBufferSize=%zu, lowLatency=%d)", __func__, inputBufferSize, lowLatency);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    mInputBufferSize = inputBufferSize;
+    mLowLatency = lowLatency;
+    mGetPoolCb = std::move(getPoolCb);
+    mOutputCb = std::move(outputCb);
+    mErrorCb = std::move(errorCb);
+
+    mDevice = V4L2Device::create();
+    if (!mDevice->open(V4L2Device::Type::kDecoder, V4L2_PIX_FMT_H264_SLICE)) {
+        ALOGE("Failed to open stateless device for H264");
+        return false;
+    }
+
+    if (!mDevice->hasCapabilities(V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING)) {
+        ALOGE("Device does not have VIDEO_M2M_MPLANE and STREAMING capabilities.");
+        return false;
+    }
+
+    // The whole frame is submitted at once, keeping the start codes so the slices don't need to be
+    // rewritten.
+    if (!mDevice->setExtCtrls(
+                V4L2_CTRL_CLASS_CODEC_STATELESS,
+                {V4L2ExtCtrl(V4L2_CID_STATELESS_H264_DECODE_MODE,
+                             V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED),
+                 V4L2ExtCtrl(V4L2_CID_STATELESS_H264_START_CODE,
+                             V4L2_STATELESS_H264_START_CODE_ANNEX_B)})) {
+        ALOGE("Device doesn't support frame-based decoding with Annex B start codes");
+        return false;
+    }
+
+    // Check the media requests are supported before accepting any work. The requests used for
+    // decoding are allocated once the input buffers are.
+    if (!mDevice->allocateMediaRequest().is_valid()) {
+        ALOGE("Device doesn't support media requests");
+        return false;
+    }
+
+    mInputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    mOutputQueue = mDevice->getQueue(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    if (!mInputQueue || !mOutputQueue) {
+        ALOGE("Failed to create V4L2 queue.");
+        return false;
+    }
+
+    if (!mDevice->startPolling(
+                ::base::BindRepeating(&V4L2StatelessDecoder::serviceDeviceTask, mWeakThis),
+                ::base::BindRepeating(&V4L2StatelessDecoder::onError, mWeakThis))) {
+        ALOGE("Failed to start polling V4L2 device.");
+        return false;
+    }
+
+    setState(State::Idle);
+    return true;
+}
+
+void V4L2StatelessDecoder::decode(std::unique_ptr<ConstBitstreamBuffer> buffer,
+                                  DecodeCB decodeCb) {
+    ALOGV("%s(id=%d)", __func__, buffer->id);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::Error) {
+        ALOGE("Ignore due to error state.");
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(decodeCb),
+                                                          VideoDecoder::DecodeStatus::kError));
+        return;
+    }
+
+    if (mState == State::Idle) {
+        setState(State::Decoding);
+    }
+
+    mDecodeRequests.push(DecodeRequest(std::move(buffer), std::move(decodeCb)));
+    pumpDecodeRequest();
+}
+
+void V4L2StatelessDecoder::drain(DecodeCB drainCb) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    switch (mState) {
+    case State::Idle:
+        ALOGV("Nothing need to drain, ignore.");
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(std::move(drainCb), VideoDecoder::DecodeStatus::kOk));
+        return;
+
+    case State::Decoding:
+        mDecodeRequests.push(DecodeRequest(nullptr, std::move(drainCb)));
+        pumpDecodeRequest();
+        return;
+
+    case State::Draining:
+    case State::Error:
+        ALOGE("Ignore due to wrong state: %s", StateToString(mState));
+        mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(drainCb),
+                                                          VideoDecoder::DecodeStatus::kError));
+        return;
+    }
+}
+
+void V4L2StatelessDecoder::pumpDecodeRequest() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState != State::Decoding) return;
+
+    while (!mDecodeRequests.empty()) {
+        // Drain the decoder, once all pictures are decoded.
+        if (mDecodeRequests.front().buffer == nullptr) {
+            ALOGV("Get drain request.");
+            auto request = std::move(mDecodeRequests.front());
+            mDecodeRequests.pop();
+
+            mDrainCb = std::move(request.decodeCb);
+            setState(State::Draining);
+            tryFinishDrain();
+            return;
+        }
+
+        // Pause if no free input buffer. We resume decoding after dequeueing input buffers.
+        if (mInputQueue->allocatedBuffersCount() > 0 && mInputQueue->freeBuffersCount() == 0) {
+            ALOGV("There is no free input buffer.");
+            return;
+        }
+
+        const ConstBitstreamBuffer& buffer = *mDecodeRequests.front().buffer;
+        const int32_t bitstreamId = buffer.id;
+        C2ReadView view = buffer.dmabuf.map().get();
+        if (view.error() != C2_OK) {
+            ALOGE("Failed to map input buffer, bitstreamId=%d", bitstreamId);
+            onError();
+            return;
+        }
+
+        H264SliceHeader header;
+        std::vector<std::pair<const uint8_t*, size_t>> slices;
+        if (!parseBitstream(view.data(), view.capacity(), &header, &slices)) {
+            ALOGE("Failed to parse input buffer, bitstreamId=%d", bitstreamId);
+            onError();
+            return;
+        }
+
+        // Buffers only containing parameter sets (e.g. codec config) don't produce a picture.
+        if (slices.empty()) {
+            ALOGV("No picture in input buffer, bitstreamId=%d", bitstreamId);
+            auto request = std::move(mDecodeRequests.front());
+            mDecodeRequests.pop();
+            mTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(std::move(request.decodeCb),
+                                                              VideoDecoder::DecodeStatus::kOk));
+            continue;
+        }
+
+        const H264PPS* pps = mParser.getPPS(header.picParameterSetId);
+        const H264SPS* sps = mParser.getSPS(pps->seqParameterSetId);
+        if (needsReconfiguration(*sps)) {
+            // The pictures already submitted are decoded using the current buffers, wait until all
+            // of them are returned before reconfiguring.
+            if (mInputQueue->queuedBuffersCount() > 0 || !mPicturesAtDevice.empty()) {
+                ALOGV("Wait for all pictures decoded before reconfiguring.");
+                return;
+            }
+            if (!configure(*sps)) {
+                onError();
+                return;
+            }
+        }
+
+        auto request = std::move(mDecodeRequests.front());
+        mDecodeRequests.pop();
+
+        if (!submitPicture(bitstreamId, header, slices)) {
+            std::move(request.decodeCb).Run(VideoDecoder::DecodeStatus::kError);
+            onError();
+            return;
+        }
+        if (mLatencyTracker) mLatencyTracker->mark(bitstreamId, "enqueue");
+
+        mPendingDecodeCbs.insert(std::make_pair(bitstreamId, std::move(request.decodeCb)));
+    }
+}
+
+bool V4L2StatelessDecoder::parseBitstream(const uint8_t* data, size_t size,
+                                          H264SliceHeader* header,
+                                          std::vector<std::pair<const uint8_t*, size_t>>* slices) {
+    ALOGV("%s(size=%zu)", __func__, size);
+
+    NalParser parser(data, size);
+    while (parser.locateNextNal()) {
+        switch (parser.type()) {
+        case NalParser::kSPSType:
+            if (!mParser.parseSPS(parser.data(), parser.length())) return false;
+            break;
+
+        case NalParser::kPPSType:
+            if (!mParser.parsePPS(parser.data(), parser.length())) return false;
+            break;
+
+        case NalParser::kNonIDRType:
+        case NalParser::kIDRType:
+            // All slices of a picture share the fields of the slice header needed by the device.
+            if (slices->empty() &&
+                !mParser.parseSliceHeader(parser.data(), parser.length(), header)) {
+                return false;
+            }
+            slices->emplace_back(parser.data(), parser.length());
+            break;
+
+        default:
+            // Other NAL units (e.g. SEI, access unit delimiters) are not needed for decoding.
+            break;
+        }
+    }
+    return true;
+}
+
+bool V4L2StatelessDecoder::needsReconfiguration(const H264SPS& sps) const {
+    const size_t numOutputBuffers = sps.dpbSize() + 1 + kNumExtraOutputBuffers;
+    return mInputQueue->allocatedBuffersCount() == 0 || sps.codedSize() != mCodedSize ||
+           numOutputBuffers > mOutputQueue->allocatedBuffersCount();
+}
+
+bool V4L2StatelessDecoder::configure(const H264SPS& sps) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (sps.chromaFormatIdc != 1 || sps.bitDepthLumaMinus8 != 0 || sps.bitDepthChromaMinus8 != 0) {
+        ALOGE("Only 8-bit 4:2:0 streams are supported (chroma_format_idc=%u, bit depth=%u)",
+              sps.chromaFormatIdc, sps.bitDepthLumaMinus8 + 8);
+        return false;
+    }
+
+    // The pictures left in the DPB were decoded using the previous configuration, send them to the
+    // client before their buffers are released.
+    outputAllPictures();
+    sendOutputPictures();
+    clearDpb();
+
+    mCodedSize = sps.codedSize();
+    mDpbSize = sps.dpbSize();
+    size_t numOutputBuffers = mDpbSize + 1 + kNumExtraOutputBuffers;
+    ALOGI("Configure for coded size %s, DPB size %zu, decoder needs %zu output buffers",
+          toString(mCodedSize).c_str(), mDpbSize, numOutputBuffers);
+
+    mOutputQueue->streamoff();
+    mOutputQueue->deallocateBuffers();
+    mFrameAtDevice.clear();
+    mPendingOutputFrames.clear();
+    mBlockIdToV4L2Id.clear();
+    mInputQueue->streamoff();
+    mInputQueue->deallocateBuffers();
+    mRequestFds.clear();
+
+    // The input format has to be set first, the output formats supported by the device depend on
+    // it and on the SPS.
+    const auto inputFormat =
+            mInputQueue->setFormat(V4L2_PIX_FMT_H264_SLICE, mCodedSize, mInputBufferSize);
+    if (!inputFormat) {
+        ALOGE("Failed to set input format.");
+        return false;
+    }
+    // Unlike the frames and bitstream buffers, the MMAP input buffers are owned by the queue.
+    mInputQueue->setMemoryTracker(mMemoryTracker);
+    if (mInputQueue->allocateBuffers(kNumInputBuffers, V4L2_MEMORY_MMAP) == 0) {
+        ALOGE("Failed to allocate input buffer.");
+        return false;
+    }
+    if (!allocateRequests()) {
+        return false;
+    }
+    if (!mInputQueue->streamon()) {
+        ALOGE("Failed to streamon input queue.");
+        return false;
+    }
+
+    // Some devices derive the output formats they support from the SPS.
+    struct v4l2_ctrl_h264_sps spsCtrl;
+    fillSpsCtrl(sps, &spsCtrl);
+    if (!mDevice->setExtCtrls(V4L2_CTRL_CLASS_CODEC_STATELESS,
+                              {V4L2ExtCtrl(V4L2_CID_STATELESS_H264_SPS, &spsCtrl,
+                                           sizeof(spsCtrl))})) {
+        ALOGW("Failed to set the SPS before configuring the output format");
+    }
+
+    const auto outputFormat = mOutputQueue->setFormat(Fourcc::NV12, mCodedSize, 0);
+    if (!outputFormat || outputFormat->fmt.pix_mp.pixelformat != Fourcc::NV12) {
+        ALOGE("Failed to set output format.");
+        return false;
+    }
+    const ui::Size bufferSize(outputFormat->fmt.pix_mp.width, outputFormat->fmt.pix_mp.height);
+
+    // Release the previous VideoFramePool before getting a new one to guarantee only one pool
+    // exists at the same time. The pool determines how many buffers are used in total, so it's
+    // requested before allocating the V4L2 buffers.
+    mVideoFramePool.reset();
+    // Always use flexible pixel 420 format YCBCR_420_888 in Android.
+    mVideoFramePool = mGetPoolCb.Run(bufferSize, HalPixelFormat::YCBCR_420_888, &numOutputBuffers);
+    if (!mVideoFramePool) {
+        ALOGE("Failed to get block pool with size: %s", toString(bufferSize).c_str());
+        return false;
+    }
+
+    const size_t adjustedNumOutputBuffers =
+            mOutputQueue->allocateBuffers(numOutputBuffers, V4L2_MEMORY_DMABUF);
+    if (adjustedNumOutputBuffers < numOutputBuffers) {
+        ALOGE("Failed to allocate %zu output buffers (allocated: %zu).", numOutputBuffers,
+              adjustedNumOutputBuffers);
+        return false;
+    }
+    ALOGV("Allocated %zu output buffers.", adjustedNumOutputBuffers);
+    if (!mOutputQueue->streamon()) {
+        ALOGE("Failed to streamon output queue.");
+        return false;
+    }
+
+    tryFetchVideoFrame();
+    return true;
+}
+
+bool V4L2StatelessDecoder::allocateRequests() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    mRequestFds.clear();
+    for (size_t i = 0; i < mInputQueue->allocatedBuffersCount(); ++i) {
+        ::base::ScopedFD requestFd = mDevice->allocateMediaRequest();
+        if (!requestFd.is_valid()) {
+            ALOGE("Failed to allocate media request.");
+            return false;
+        }
+        mRequestFds.push_back(std::move(requestFd));
+    }
+    return true;
+}
+
+bool V4L2StatelessDecoder::submitPicture(
+        int32_t bitstreamId, const H264SliceHeader& header,
+        const std::vector<std::pair<const uint8_t*, size_t>>& slices) {
+    ALOGV("%s(bitstreamId=%d, frameNum=%u)", __func__, bitstreamId, header.frameNum);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    const H264PPS& pps = *mParser.getPPS(header.picParameterSetId);
+    const H264SPS& sps = *mParser.getSPS(pps.seqParameterSetId);
+    if (header.fieldPicFlag) {
+        ALOGE("Field pictures are not supported");
+        return false;
+    }
+
+    auto picture = std::make_shared<Picture>();
+    picture->bitstreamId = bitstreamId;
+    picture->visibleRect = sps.visibleRect();
+    picture->frameNum = header.frameNum;
+    calculatePicOrderCnt(sps, header, picture.get());
+
+    if (header.idrPicFlag) {
+        // All previous pictures are output and removed from the DPB before decoding an IDR
+        // picture. no_output_of_prior_pics_flag is ignored, all pictures are always output.
+        outputAllPictures();
+        clearDpb();
+    } else if (header.frameNum != mPrevRefFrameNum &&
+               header.frameNum != (mPrevRefFrameNum + 1) % sps.maxFrameNum()) {
+        // The missing frames would only be needed to decode corrupted streams, for which the
+        // device conceals the missing references anyway.
+        ALOGW("Gap in frame_num (%u => %u)", mPrevRefFrameNum, header.frameNum);
+    }
+    updatePicNums(sps, header.frameNum);
+
+    // Copy the slices into an input buffer.
+    auto inputBuffer = mInputQueue->getFreeBuffer();
+    ALOG_ASSERT(inputBuffer, "No free input buffer");
+    const size_t inputBufferId = inputBuffer->bufferId();
+    uint8_t* dst = static_cast<uint8_t*>(inputBuffer->getPlaneMapping(0));
+    const size_t planeSize = inputBuffer->getPlaneSize(0);
+    size_t bytesUsed = 0;
+    for (const auto& slice : slices) {
+        if (bytesUsed + sizeof(kStartCode) + slice.second > planeSize) {
+            ALOGE("The input size (%zu) is not enough", planeSize);
+            return false;
+        }
+        memcpy(dst + bytesUsed, kStartCode, sizeof(kStartCode));
+        bytesUsed += sizeof(kStartCode);
+        memcpy(dst + bytesUsed, slice.first, slice.second);
+        bytesUsed += slice.second;
+    }
+
+    const int requestFd = mRequestFds[inputBufferId].get();
+    if (!setPictureControls(requestFd, sps, pps, header, *picture)) {
+        return false;
+    }
+
+    ALOGV("QBUF to input queue, bitstreamId=%d, bytesUsed=%zu", bitstreamId, bytesUsed);
+    inputBuffer->setTimeStamp({.tv_sec = bitstreamId});
+    inputBuffer->setPlaneBytesUsed(0, bytesUsed);
+    inputBuffer->setRequestFd(requestFd);
+    if (!std::move(*inputBuffer).queueMMap()) {
+        ALOGE("%s(): Failed to QBUF to input queue, bitstreamId=%d", __func__, bitstreamId);
+        return false;
+    }
+    if (!V4L2Device::queueMediaRequest(requestFd)) {
+        return false;
+    }
+    mPicturesAtDevice.emplace(bitstreamId, picture);
+
+    // The DPB passed to the device is the one before marking the current picture.
+    markReferences(sps, header, picture.get());
+
+    mPrevFrameNum = picture->hasMemMgmt5 ? 0 : picture->frameNum;
+    mPrevFrameNumOffset = picture->frameNumOffset;
+    mPrevHasMemMgmt5 = picture->hasMemMgmt5;
+    if (header.nalRefIdc != 0) {
+        mPrevRefFrameNum = mPrevFrameNum;
+        mPrevRefPicOrderCntMsb = picture->picOrderCntMsb;
+        mPrevRefPicOrderCntLsb = picture->picOrderCntLsb;
+        mPrevRefTopFieldOrderCnt = picture->topFieldOrderCnt;
+        mPrevRefHasMemMgmt5 = picture->hasMemMgmt5;
+    }
+
+    const size_t maxNumReorderFrames =
+            mLowLatency ? 0
+                        : (sps.bitstreamRestrictionFlag ? sps.maxNumReorderFrames : sps.dpbSize());
+    storePicture(std::move(picture), sps.dpbSize(), maxNumReorderFrames);
+    sendOutputPictures();
+    return true;
+}
+
+bool V4L2StatelessDecoder::setPictureControls(int requestFd, const H264SPS& sps,
+                                              const H264PPS& pps, const H264SliceHeader& header,
+                                              const Picture& picture) {
+    struct v4l2_ctrl_h264_sps spsCtrl;
+    fillSpsCtrl(sps, &spsCtrl);
+
+    struct v4l2_ctrl_h264_pps ppsCtrl;
+    memset(&ppsCtrl, 0, sizeof(ppsCtrl));
+    ppsCtrl.pic_parameter_set_id = pps.picParameterSetId;
+    ppsCtrl.seq_parameter_set_id = pps.seqParameterSetId;
+    ppsCtrl.num_slice_groups_minus1 = pps.numSliceGroupsMinus1;
+    ppsCtrl.num_ref_idx_l0_default_active_minus1 = pps.numRefIdxL0DefaultActiveMinus1;
+    ppsCtrl.num_ref_idx_l1_default_active_minus1 = pps.numRefIdxL1DefaultActiveMinus1;
+    ppsCtrl.weighted_bipred_idc = pps.weightedBipredIdc;
+    ppsCtrl.pic_init_qp_minus26 = pps.picInitQpMinus26;
+    ppsCtrl.pic_init_qs_minus26 = pps.picInitQsMinus26;
+    ppsCtrl.chroma_qp_index_offset = pps.chromaQpIndexOffset;
+    ppsCtrl.second_chroma_qp_index_offset = pps.secondChromaQpIndexOffset;
+    if (pps.entropyCodingModeFlag) ppsCtrl.flags |= V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE;
+    if (pps.bottomFieldPicOrderInFramePresentFlag) {
+        ppsCtrl.flags |= V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT;
+    }
+    if (pps.weightedPredFlag) ppsCtrl.flags |= V4L2_H264_PPS_FLAG_WEIGHTED_PRED;
+    if (pps.deblockingFilterControlPresentFlag) {
+        ppsCtrl.flags |= V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT;
+    }
+    if (pps.constrainedIntraPredFlag) ppsCtrl.flags |= V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED;
+    if (pps.redundantPicCntPresentFlag) {
+        ppsCtrl.flags |= V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT;
+    }
+    if (pps.transform8x8ModeFlag) ppsCtrl.flags |= V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE;
+    // The PPS scaling lists already fall back to the SPS ones, so they are always passed.
+    ppsCtrl.flags |= V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT;
+
+    struct v4l2_ctrl_h264_scaling_matrix scalingMatrixCtrl;
+    static_assert(sizeof(scalingMatrixCtrl.scaling_list_4x4) == sizeof(pps.scalingList4x4));
+    static_assert(sizeof(scalingMatrixCtrl.scaling_list_8x8) == sizeof(pps.scalingList8x8));
+    memcpy(scalingMatrixCtrl.scaling_list_4x4, pps.scalingList4x4, sizeof(pps.scalingList4x4));
+    memcpy(scalingMatrixCtrl.scaling_list_8x8, pps.scalingList8x8, sizeof(pps.scalingList8x8));
+
+    struct v4l2_ctrl_h264_decode_params decodeParamsCtrl;
+    memset(&decodeParamsCtrl, 0, sizeof(decodeParamsCtrl));
+    size_t numEntries = 0;
+    for (const auto& ref : mDpb) {
+        if (numEntries >= V4L2_H264_NUM_DPB_ENTRIES) {
+            ALOGE("Too many pictures in the DPB");
+            return false;
+        }
+        struct v4l2_h264_dpb_entry& entry = decodeParamsCtrl.dpb[numEntries++];
+        entry.reference_ts = bitstreamIdToTimestampNs(ref->bitstreamId);
+        entry.pic_num = ref->longTermRef ? ref->longTermFrameIdx : ref->frameNumWrap;
+        entry.frame_num = ref->longTermRef ? ref->longTermFrameIdx : ref->frameNum;
+        entry.fields = V4L2_H264_FRAME_REF;
+        entry.top_field_order_cnt = ref->topFieldOrderCnt;
+        entry.bottom_field_order_cnt = ref->bottomFieldOrderCnt;
+        entry.flags = V4L2_H264_DPB_ENTRY_FLAG_VALID;
+        if (ref->isRef()) entry.flags |= V4L2_H264_DPB_ENTRY_FLAG_ACTIVE;
+        if (ref->longTermRef) entry.flags |= V4L2_H264_DPB_ENTRY_FLAG_LONG_TERM;
+    }
+    decodeParamsCtrl.nal_ref_idc = header.nalRefIdc;
+    decodeParamsCtrl.frame_num = header.frameNum;
+    decodeParamsCtrl.top_field_order_cnt = picture.topFieldOrderCnt;
+    decodeParamsCtrl.bottom_field_order_cnt = picture.bottomFieldOrderCnt;
+    decodeParamsCtrl.idr_pic_id = header.idrPicId;
+    decodeParamsCtrl.pic_order_cnt_lsb = header.picOrderCntLsb;
+    decodeParamsCtrl.delta_pic_order_cnt_bottom = header.deltaPicOrderCntBottom;
+    decodeParamsCtrl.delta_pic_order_cnt0 = header.deltaPicOrderCnt[0];
+    decodeParamsCtrl.delta_pic_order_cnt1 = header.deltaPicOrderCnt[1];
+    decodeParamsCtrl.dec_ref_pic_marking_bit_size = header.decRefPicMarkingBitSize;
+    decodeParamsCtrl.pic_order_cnt_bit_size = header.picOrderCntBitSize;
+    decodeParamsCtrl.slice_group_change_cycle = header.sliceGroupChangeCycle;
+    if (header.idrPicFlag) decodeParamsCtrl.flags |= V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC;
+    if (header.isPSlice()) decodeParamsCtrl.flags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+    if (header.isBSlice()) decodeParamsCtrl.flags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
+
+    return mDevice->setExtCtrlsForRequest(
+            requestFd,
+            {V4L2ExtCtrl(V4L2_CID_STATELESS_H264_SPS, &spsCtrl, sizeof(spsCtrl)),
+             V4L2ExtCtrl(V4L2_CID_STATELESS_H264_PPS, &ppsCtrl, sizeof(ppsCtrl)),
+             V4L2ExtCtrl(V4L2_CID_STATELESS_H264_SCALING_MATRIX, &scalingMatrixCtrl,
+                         sizeof(scalingMatrixCtrl)),
+             V4L2ExtCtrl(V4L2_CID_STATELESS_H264_DECODE_PARAMS, &decodeParamsCtrl,
+                         sizeof(decodeParamsCtrl))});
+}
+
+void V4L2StatelessDecoder::calculatePicOrderCnt(const H264SPS& sps, const H264SliceHeader& header,
+                                                Picture* picture) {
+    // FrameNumOffset, used by picture order count types 1 and 2.
+    if (header.idrPicFlag) {
+        picture->frameNumOffset = 0;
+    } else {
+        const int32_t prevFrameNumOffset = mPrevHasMemMgmt5 ? 0 : mPrevFrameNumOffset;
+        picture->frameNumOffset = prevFrameNumOffset;
+        if (mPrevFrameNum > header.frameNum) {
+            picture->frameNumOffset += static_cast<int32_t>(sps.maxFrameNum());
+        }
+    }
+
+    switch (sps.picOrderCntType) {
+    case 0: {
+        int32_t prevPicOrderCntMsb = 0;
+        int32_t prevPicOrderCntLsb = 0;
+        if (!header.idrPicFlag) {
+            prevPicOrderCntMsb = mPrevRefHasMemMgmt5 ? 0 : mPrevRefPicOrderCntMsb;
+            prevPicOrderCntLsb = mPrevRefHasMemMgmt5 ? mPrevRefTopFieldOrderCnt
+                                                     : static_cast<int32_t>(mPrevRefPicOrderCntLsb);
+        }
+        const int32_t maxPicOrderCntLsb = 1 << (sps.log2MaxPicOrderCntLsbMinus4 + 4);
+        const int32_t picOrderCntLsb = static_cast<int32_t>(header.picOrderCntLsb);
+        if (picOrderCntLsb < prevPicOrderCntLsb &&
+            prevPicOrderCntLsb - picOrderCntLsb >= maxPicOrderCntLsb / 2) {
+            picture->picOrderCntMsb = prevPicOrderCntMsb + maxPicOrderCntLsb;
+        } else if (picOrderCntLsb > prevPicOrderCntLsb &&
+                   picOrderCntLsb - prevPicOrderCntLsb > maxPicOrderCntLsb / 2) {
+            picture->picOrderCntMsb = prevPicOrderCntMsb - maxPicOrderCntLsb;
+        } else {
+            picture->picOrderCntMsb = prevPicOrderCntMsb;
+        }
+        picture->picOrderCntLsb = header.picOrderCntLsb;
+        picture->topFieldOrderCnt = picture->picOrderCntMsb + picOrderCntLsb;
+        picture->bottomFieldOrderCnt = picture->topFieldOrderCnt + header.deltaPicOrderCntBottom;
+        break;
+    }
+
+    case 1: {
+        int32_t absFrameNum = 0;
+        if (sps.numRefFramesInPicOrderCntCycle != 0) {
+            absFrameNum = picture->frameNumOffset + static_cast<int32_t>(header.frameNum);
+        }
+        if (header.nalRefIdc == 0 && absFrameNum > 0) absFrameNum--;
+
+        int32_t expectedPicOrderCnt = 0;
+        if (absFrameNum > 0) {
+            const int32_t cycleLength = static_cast<int32_t>(sps.numRefFramesInPicOrderCntCycle);
+            const int32_t picOrderCntCycleCnt = (absFrameNum - 1) / cycleLength;
+            const int32_t frameNumInPicOrderCntCycle = (absFrameNum - 1) % cycleLength;
+            expectedPicOrderCnt = picOrderCntCycleCnt * sps.expectedDeltaPerPicOrderCntCycle;
+            for (int32_t i = 0; i <= frameNumInPicOrderCntCycle; ++i) {
+                expectedPicOrderCnt += sps.offsetForRefFrame[i];
+            }
+        }
+        if (header.nalRefIdc == 0) expectedPicOrderCnt += sps.offsetForNonRefPic;
+
+        picture->topFieldOrderCnt = expectedPicOrderCnt + header.deltaPicOrderCnt[0];
+        picture->bottomFieldOrderCnt = picture->topFieldOrderCnt + sps.offsetForTopToBottomField +
+                                       header.deltaPicOrderCnt[1];
+        break;
+    }
+
+    case 2: {
+        int32_t tempPicOrderCnt = 0;
+        if (!header.idrPicFlag) {
+            tempPicOrderCnt =
+                    2 * (picture->frameNumOffset + static_cast<int32_t>(header.frameNum));
+            if (header.nalRefIdc == 0) tempPicOrderCnt--;
+        }
+        picture->topFieldOrderCnt = tempPicOrderCnt;
+        picture->bottomFieldOrderCnt = tempPicOrderCnt;
+        break;
+    }
+    }
+}
+
+void V4L2StatelessDecoder::updatePicNums(const H264SPS& sps, uint32_t frameNum) {
+    for (const auto& picture : mDpb) {
+        if (!picture->shortTermRef) continue;
+        picture->frameNumWrap = static_cast<int32_t>(picture->frameNum);
+        if (picture->frameNum > frameNum) {
+            picture->frameNumWrap -= static_cast<int32_t>(sps.maxFrameNum());
+        }
+    }
+}
+
+void V4L2StatelessDecoder::markReferences(const H264SPS& sps, const H264SliceHeader& header,
+                                          Picture* picture) {
+    if (header.nalRefIdc == 0) return;
+
+    if (header.idrPicFlag) {
+        // The DPB is already emptied before decoding IDR pictures.
+        if (header.longTermReferenceFlag) {
+            picture->longTermRef = true;
+            picture->longTermFrameIdx = 0;
+            mMaxLongTermFrameIdx = 0;
+        } else {
+            picture->shortTermRef = true;
+            mMaxLongTermFrameIdx = -1;
+        }
+        return;
+    }
+
+    if (header.adaptiveRefPicMarkingModeFlag) {
+        for (const auto& op : header.memoryManagementOperations) {
+            applyMemoryManagementOperation(op, header.frameNum, picture);
+        }
+    } else {
+        applySlidingWindow(sps);
+    }
+    if (!picture->longTermRef) picture->shortTermRef = true;
+
+    if (picture->hasMemMgmt5) {
+        // The picture is considered to have frame_num and picture order counts relative to 0
+        // after memory_management_control_operation 5.
+        const int32_t tempPicOrderCnt = picture->picOrderCnt();
+        picture->topFieldOrderCnt -= tempPicOrderCnt;
+        picture->bottomFieldOrderCnt -= tempPicOrderCnt;
+        picture->frameNum = 0;
+    }
+}
+
+void V4L2StatelessDecoder::applyMemoryManagementOperation(
+        const H264SliceHeader::MemoryManagementOperation& op, uint32_t frameNum,
+        Picture* picture) {
+    const int32_t picNumX =
+            static_cast<int32_t>(frameNum) - static_cast<int32_t>(op.differenceOfPicNumsMinus1 + 1);
+    auto findShortTermRef = [this](int32_t picNum) -> Picture* {
+        for (const auto& ref : mDpb) {
+            if (ref->shortTermRef && ref->frameNumWrap == picNum) return ref.get();
+        }
+        return nullptr;
+    };
+    auto unmarkLongTermRefs = [this](auto predicate) {
+        for (const auto& ref : mDpb) {
+            if (ref->longTermRef && predicate(*ref)) ref->longTermRef = false;
+        }
+    };
+
+    switch (op.type) {
+    case 1:  // Mark a short-term reference picture as unused for reference.
+        if (Picture* ref = findShortTermRef(picNumX)) ref->shortTermRef = false;
+        break;
+
+    case 2:  // Mark a long-term reference picture as unused for reference.
+        unmarkLongTermRefs(
+                [&op](const Picture& ref) { return ref.longTermFrameIdx == op.longTermPicNum; });
+        break;
+
+    case 3:  // Convert a short-term reference picture to a long-term one.
+        if (Picture* ref = findShortTermRef(picNumX)) {
+            unmarkLongTermRefs([&op, ref](const Picture& other) {
+                return &other != ref && other.longTermFrameIdx == op.longTermFrameIdx;
+            });
+            ref->shortTermRef = false;
+            ref->longTermRef = true;
+            ref->longTermFrameIdx = op.longTermFrameIdx;
+        }
+        break;
+
+    case 4:  // Update MaxLongTermFrameIdx.
+        mMaxLongTermFrameIdx = static_cast<int32_t>(op.maxLongTermFrameIdxPlus1) - 1;
+        unmarkLongTermRefs([this](const Picture& ref) {
+            return static_cast<int32_t>(ref.longTermFrameIdx) > mMaxLongTermFrameIdx;
+        });
+        break;
+
+    case 5:  // Mark all reference pictures as unused for reference.
+        for (const auto& ref : mDpb) {
+            ref->shortTermRef = false;
+            ref->longTermRef = false;
+        }
+        mMaxLongTermFrameIdx = -1;
+        picture->hasMemMgmt5 = true;
+        break;
+
+    case 6:  // Mark the current picture as a long-term reference picture.
+        unmarkLongTermRefs(
+                [&op](const Picture& ref) { return ref.longTermFrameIdx == op.longTermFrameIdx; });
+        picture->longTermRef = true;
+        picture->longTermFrameIdx = op.longTermFrameIdx;
+        break;
+
+    default:
+        ALOGW("Unknown memory_management_control_operation %u", op.type);
+        break;
+    }
+}
+
+void V4L2StatelessDecoder::applySlidingWindow(const H264SPS& sps) {
+    size_t numShortTermRefs = 0;
+    size_t numLongTermRefs = 0;
+    Picture* oldestShortTermRef = nullptr;
+    for (const auto& ref : mDpb) {
+        if (ref->longTermRef) numLongTermRefs++;
+        if (!ref->shortTermRef) continue;
+        numShortTermRefs++;
+        if (!oldestShortTermRef || ref->frameNumWrap < oldestShortTermRef->frameNumWrap) {
+            oldestShortTermRef = ref.get();
+        }
+    }
+
+    const size_t maxNumRefFrames = std::max<size_t>(sps.maxNumRefFrames, 1);
+    if (numShortTermRefs + numLongTermRefs >= maxNumRefFrames && oldestShortTermRef) {
+        oldestShortTermRef->shortTermRef = false;
+    }
+}
+
+void V4L2StatelessDecoder::storePicture(std::shared_ptr<Picture> picture, size_t dpbSize,
+                                        size_t maxNumReorderFrames) {
+    // All previous pictures are output before the picture following a
+    // memory_management_control_operation 5, like for IDR pictures.
+    if (picture->hasMemMgmt5) outputAllPictures();
+    removeUnusedPictures();
+
+    while (mDpb.size() >= dpbSize) {
+        // A non-reference picture preceding all waiting pictures in output order is output
+        // directly, without being stored.
+        if (!picture->isRef()) {
+            auto first = std::min_element(
+                    mDpb.begin(), mDpb.end(), [](const auto& a, const auto& b) {
+                        if (a->outputNeeded != b->outputNeeded) return a->outputNeeded;
+                        return a->picOrderCnt() < b->picOrderCnt();
+                    });
+            if (!(*first)->outputNeeded || picture->picOrderCnt() < (*first)->picOrderCnt()) {
+                picture->outputNeeded = false;
+                mPicturesToOutput.push_back(std::move(picture));
+                return;
+            }
+        }
+        if (!bumpPicture()) {
+            ALOGW("DPB is full of reference pictures");
+            break;
+        }
+    }
+    mDpb.push_back(std::move(picture));
+
+    while (static_cast<size_t>(std::count_if(mDpb.begin(), mDpb.end(), [](const auto& p) {
+               return p->outputNeeded;
+           })) > maxNumReorderFrames) {
+        bumpPicture();
+    }
+}
+
+bool V4L2StatelessDecoder::bumpPicture() {
+    auto it = mDpb.end();
+    for (auto iter = mDpb.begin(); iter != mDpb.end(); ++iter) {
+        if (!(*iter)->outputNeeded) continue;
+        if (it == mDpb.end() || (*iter)->picOrderCnt() < (*it)->picOrderCnt()) it = iter;
+    }
+    if (it == mDpb.end()) return false;
+
+    std::shared_ptr<Picture> picture = *it;
+    ALOGV("Output picture, bitstreamId=%d, POC=%d", picture->bitstreamId, picture->picOrderCnt());
+    picture->outputNeeded = false;
+    mPicturesToOutput.push_back(picture);
+    if (!picture->isRef()) mDpb.erase(it);
+    return true;
+}
+
+void V4L2StatelessDecoder::outputAllPictures() {
+    while (bumpPicture()) {
+    }
+}
+
+void V4L2StatelessDecoder::removeUnusedPictures() {
+    auto it = mDpb.begin();
+    while (it != mDpb.end()) {
+        std::shared_ptr<Picture> picture = *it;
+        if (picture->isRef() || picture->outputNeeded) {
+            ++it;
+            continue;
+        }
+
+        it = mDpb.erase(it);
+        // Pictures still waiting in |mPicturesToOutput| are released once sent to the client.
+        if (picture->decoded && !picture->frame) releasePicture(*picture);
+    }
+}
+
+void V4L2StatelessDecoder::clearDpb() {
+    for (const auto& picture : mDpb) {
+        picture->shortTermRef = false;
+        picture->longTermRef = false;
+    }
+    removeUnusedPictures();
+}
+
+void V4L2StatelessDecoder::sendOutputPictures() {
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    bool droppedFrame = false;
+    while (!mPicturesToOutput.empty() && mPicturesToOutput.front()->decoded) {
+        std::shared_ptr<Picture> picture = std::move(mPicturesToOutput.front());
+        mPicturesToOutput.pop_front();
+
+        if (picture->corrupted) {
+            // The frame is returned to the pool, its buffer is only decoded into again once the
+            // picture is released, the same way as for frames returned by the client.
+            ALOGW("Dropped corrupted frame, bitstreamId=%d", picture->bitstreamId);
+            picture->frame.reset();
+            droppedFrame = true;
+            mCorruptionCb.Run(picture->bitstreamId);
+        } else {
+            ALOGV("Send output frame(bitstreamId=%d) to client", picture->bitstreamId);
+            picture->frame->setBitstreamId(picture->bitstreamId);
+            picture->frame->setVisibleRect(picture->visibleRect);
+            mOutputCb.Run(std::move(picture->frame));
+        }
+
+        if (std::find(mDpb.begin(), mDpb.end(), picture) == mDpb.end()) releasePicture(*picture);
+    }
+
+    if (droppedFrame) {
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::tryFetchVideoFrame, mWeakThis));
+    }
+}
+
+void V4L2StatelessDecoder::releasePicture(const Picture& picture) {
+    ALOGV("%s(bitstreamId=%d, outputBufferId=%zu)", __func__, picture.bitstreamId,
+          picture.outputBufferId);
+
+    auto it = mPendingOutputFrames.find(picture.outputBufferId);
+    if (it == mPendingOutputFrames.end()) return;
+
+    std::unique_ptr<VideoFrame> frame = std::move(it->second);
+    mPendingOutputFrames.erase(it);
+    if (!queueOutputFrame(picture.outputBufferId, std::move(frame))) {
+        onError();
+    }
+}
+
+bool V4L2StatelessDecoder::isOutputBufferUsed(size_t outputBufferId) const {
+    auto isUsing = [outputBufferId](const std::shared_ptr<Picture>& picture) {
+        return picture->decoded && picture->outputBufferId == outputBufferId;
+    };
+    return std::any_of(mDpb.begin(), mDpb.end(), isUsing) ||
+           std::any_of(mPicturesToOutput.begin(), mPicturesToOutput.end(), isUsing);
+}
+
+void V4L2StatelessDecoder::resetPicOrderCntState() {
+    mPrevFrameNum = 0;
+    mPrevFrameNumOffset = 0;
+    mPrevHasMemMgmt5 = false;
+    mPrevRefFrameNum = 0;
+    mPrevRefPicOrderCntMsb = 0;
+    mPrevRefPicOrderCntLsb = 0;
+    mPrevRefTopFieldOrderCnt = 0;
+    mPrevRefHasMemMgmt5 = false;
+    mMaxLongTermFrameIdx = -1;
+}
+
+void V4L2StatelessDecoder::flush() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::Idle) {
+        ALOGV("Nothing need to flush, ignore.");
+        return;
+    }
+    if (mState == State::Error) {
+        ALOGE("Ignore due to error state.");
+        return;
+    }
+
+    // Call all pending callbacks, including the ones of requests not queued to the device yet.
+    for (auto& item : mPendingDecodeCbs) {
+        std::move(item.second).Run(VideoDecoder::DecodeStatus::kAborted);
+    }
+    mPendingDecodeCbs.clear();
+    while (!mDecodeRequests.empty()) {
+        std::move(mDecodeRequests.front().decodeCb).Run(VideoDecoder::DecodeStatus::kAborted);
+        mDecodeRequests.pop();
+    }
+    if (mDrainCb) {
+        std::move(mDrainCb).Run(VideoDecoder::DecodeStatus::kAborted);
+    }
+
+    // Streamoff both V4L2 queues to drop input and output buffers.
+    mDevice->stopPolling();
+    mOutputQueue->streamoff();
+    mFrameAtDevice.clear();
+    mPendingOutputFrames.clear();
+    mInputQueue->streamoff();
+
+    // Drop all pictures, the stream restarts from an IDR picture after flushing.
+    mPicturesAtDevice.clear();
+    mDpb.clear();
+    mPicturesToOutput.clear();
+    resetPicOrderCntState();
+
+    if (mInputQueue->allocatedBuffersCount() > 0) {
+        // The requests of the dropped input buffers might not be completed, reallocate all of them
+        // instead of reinitializing them.
+        if (!allocateRequests()) {
+            onError();
+            return;
+        }
+        mInputQueue->streamon();
+        mOutputQueue->streamon();
+    }
+
+    // If there is no free buffer at mOutputQueue, tryFetchVideoFrame() should be triggerred after
+    // a buffer is DQBUF from output queue. Now all the buffers are dropped at mOutputQueue, we
+    // have to trigger tryFetchVideoFrame() here.
+    if (mVideoFramePool) {
+        tryFetchVideoFrame();
+    }
+
+    if (!mDevice->startPolling(
+                ::base::BindRepeating(&V4L2StatelessDecoder::serviceDeviceTask, mWeakThis),
+                ::base::BindRepeating(&V4L2StatelessDecoder::onError, mWeakThis))) {
+        ALOGE("Failed to start polling V4L2 device.");
+        onError();
+        return;
+    }
+
+    setState(State::Idle);
+}
+
+void V4L2StatelessDecoder::serviceDeviceTask(bool event) {
+    ALOGV("%s(event=%d) state=%s InputQueue(%s):%zu+%zu/%zu, OutputQueue(%s):%zu+%zu/%zu", __func__,
+          event, StateToString(mState), (mInputQueue->isStreaming() ? "streamon" : "streamoff"),
+          mInputQueue->freeBuffersCount(), mInputQueue->queuedBuffersCount(),
+          mInputQueue->allocatedBuffersCount(),
+          (mOutputQueue->isStreaming() ? "streamon" : "streamoff"),
+          mOutputQueue->freeBuffersCount(), mOutputQueue->queuedBuffersCount(),
+          mOutputQueue->allocatedBuffersCount());
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == State::Error) return;
+
+    // Drain all the ready input and output buffers and events before polling is scheduled again.
+    V4L2Device::ScopedPollBatch pollBatch(mDevice);
+
+    // Dequeue output and input queue.
+    bool inputDequeued = false;
+    while (mInputQueue->queuedBuffersCount() > 0) {
+        bool success;
+        V4L2ReadableBufferRef dequeuedBuffer;
+        std::tie(success, dequeuedBuffer) = mInputQueue->dequeueBuffer();
+        if (!success) {
+            ALOGE("Failed to dequeue buffer from input queue.");
+            onError();
+            return;
+        }
+        if (!dequeuedBuffer) break;
+
+        inputDequeued = true;
+
+        // The request is completed once its input buffer is dequeued, it can be reused with the
+        // next picture submitted using the same input buffer.
+        if (!V4L2Device::reinitMediaRequest(mRequestFds[dequeuedBuffer->bufferId()].get())) {
+            onError();
+            return;
+        }
+
+        // Run the corresponding decode callback.
+        int32_t id = dequeuedBuffer->getTimeStamp().tv_sec;
+        ALOGV("DQBUF from input queue, bitstreamId=%d", id);
+        if (mLatencyTracker) mLatencyTracker->mark(id, "dequeueInput");
+        auto it = mPendingDecodeCbs.find(id);
+        if (it == mPendingDecodeCbs.end()) {
+            ALOGW("Callback is already abandoned.");
+            continue;
+        }
+        std::move(it->second).Run(VideoDecoder::DecodeStatus::kOk);
+        mPendingDecodeCbs.erase(it);
+        if (mCorruptionCb && dequeuedBuffer->isError()) {
+            ALOGW("Failed to decode input buffer, bitstreamId=%d", id);
+            mCorruptionCb.Run(id);
+        }
+    }
+
+    bool outputDequeued = false;
+    while (mOutputQueue->queuedBuffersCount() > 0) {
+        bool success;
+        V4L2ReadableBufferRef dequeuedBuffer;
+        std::tie(success, dequeuedBuffer) = mOutputQueue->dequeueBuffer();
+        if (!success) {
+            ALOGE("Failed to dequeue buffer from output queue.");
+            onError();
+            return;
+        }
+        if (!dequeuedBuffer) break;
+
+        outputDequeued = true;
+
+        const size_t bufferId = dequeuedBuffer->bufferId();
+        const int32_t bitstreamId = static_cast<int32_t>(dequeuedBuffer->getTimeStamp().tv_sec);
+        ALOGV("DQBUF from output queue, bufferId=%zu, bitstreamId=%d", bufferId, bitstreamId);
+
+        // Get the corresponding VideoFrame of the dequeued buffer.
+        auto it = mFrameAtDevice.find(bufferId);
+        ALOG_ASSERT(it != mFrameAtDevice.end(), "buffer %zu is not found at mFrameAtDevice",
+                    bufferId);
+        auto frame = std::move(it->second);
+        mFrameAtDevice.erase(it);
+
+        auto pictureIt = mPicturesAtDevice.find(bitstreamId);
+        if (pictureIt == mPicturesAtDevice.end()) {
+            ALOGW("No picture submitted for bitstreamId=%d, dropping buffer %zu", bitstreamId,
+                  bufferId);
+            continue;
+        }
+        if (mLatencyTracker) mLatencyTracker->mark(bitstreamId, "dequeueOutput");
+        std::shared_ptr<Picture> picture = std::move(pictureIt->second);
+        mPicturesAtDevice.erase(pictureIt);
+        picture->decoded = true;
+        // Corrupted pictures are dropped if the client handles them, see setCorruptionCallback().
+        picture->corrupted = mCorruptionCb && dequeuedBuffer->isError();
+        picture->outputBufferId = bufferId;
+        picture->frame = std::move(frame);
+    }
+
+    if (outputDequeued) sendOutputPictures();
+    if (mState == State::Draining) tryFinishDrain();
+
+    // We freed some input buffers or got decoded pictures, continue handling decode requests.
+    if (inputDequeued || outputDequeued) {
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::pumpDecodeRequest, mWeakThis));
+    }
+    // We free some output buffers, try to get VideoFrame.
+    if (outputDequeued) {
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::tryFetchVideoFrame, mWeakThis));
+    }
+}
+
+void V4L2StatelessDecoder::tryFinishDrain() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mInputQueue->queuedBuffersCount() > 0 || !mPicturesAtDevice.empty()) {
+        ALOGV("Wait for all pictures decoded.");
+        return;
+    }
+
+    ALOGV("All buffers are drained.");
+    outputAllPictures();
+    sendOutputPictures();
+    clearDpb();
+    resetPicOrderCntState();
+    std::move(mDrainCb).Run(VideoDecoder::DecodeStatus::kOk);
+    setState(State::Idle);
+
+    // Resume the requests received while draining.
+    if (!mDecodeRequests.empty()) {
+        setState(State::Decoding);
+        mTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&V4L2StatelessDecoder::pumpDecodeRequest, mWeakThis));
+    }
+}
+
+void V4L2StatelessDecoder::tryFetchVideoFrame() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mVideoFramePool) {
+        ALOGE("mVideoFramePool is null, failed to get the instance after reconfiguration?");
+        onError();
+        return;
+    }
+
+    // The buffers of the pending frames are free at the device, but hold pictures used by the DPB.
+    if (mOutputQueue->freeBuffersCount() <= mPendingOutputFrames.size()) {
+        ALOGV("No free V4L2 output buffers, ignore.");
+        return;
+    }
+
+    if (!mVideoFramePool->getVideoFrame(
+                ::base::BindOnce(&V4L2StatelessDecoder::onVideoFrameReady, mWeakThis))) {
+        ALOGV("%s(): Previous callback is running, ignore.", __func__);
+        return;
+    }
+    mFetchStartTime = std::chrono::steady_clock::now();
+}
+
+void V4L2StatelessDecoder::onVideoFrameReady(
+        std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!frameWithBlockId) {
+        ALOGE("Got nullptr VideoFrame.");
+        onError();
+        return;
+    }
+    if (mLatencyTracker) {
+        mLatencyTracker->recordDuration(
+                "fetchWait", std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - mFetchStartTime));
+    }
+
+    // Unwrap our arguments.
+    std::unique_ptr<VideoFrame> frame;
+    uint32_t blockId;
+    std::tie(frame, blockId) = std::move(*frameWithBlockId);
+
+    // Find the V4L2 buffer that is associated with this block.
+    size_t v4l2Id;
+    auto iter = mBlockIdToV4L2Id.find(blockId);
+    if (iter != mBlockIdToV4L2Id.end()) {
+        // If we have met this block in the past, reuse the same V4L2 buffer.
+        v4l2Id = iter->second;
+    } else if (mBlockIdToV4L2Id.size() < mOutputQueue->allocatedBuffersCount()) {
+        // If this is the first time we see this block, give it the next
+        // available V4L2 buffer.
+        v4l2Id = mBlockIdToV4L2Id.size();
+        mBlockIdToV4L2Id.emplace(blockId, v4l2Id);
+    } else {
+        // If this happens, this is a bug in VideoFramePool. It should never
+        // provide more blocks than we have V4L2 buffers.
+        ALOGE("Got more different blocks than we have V4L2 buffers for.");
+        onError();
+        return;
+    }
+
+    // The client might return a frame while the picture it holds is still used for reference.
+    // Its buffer can only be decoded into once the picture is released.
+    if (isOutputBufferUsed(v4l2Id)) {
+        ALOGV("V4L2 buffer %zu still holds a picture, deferring it", v4l2Id);
+        mPendingOutputFrames.emplace(v4l2Id, std::move(frame));
+    } else if (!queueOutputFrame(v4l2Id, std::move(frame))) {
+        onError();
+        return;
+    }
+
+    tryFetchVideoFrame();
+}
+
+bool V4L2StatelessDecoder::queueOutputFrame(size_t v4l2Id, std::unique_ptr<VideoFrame> frame) {
+    ALOGV("QBUF to output queue, V4L2Id=%zu", v4l2Id);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    std::optional<V4L2WritableBufferRef> outputBuffer = mOutputQueue->getFreeBuffer(v4l2Id);
+    if (!outputBuffer) {
+        ALOGE("V4L2 buffer not available. V4L2Id=%zu", v4l2Id);
+        return false;
+    }
+    if (!std::move(*outputBuffer).queueDMABuf(frame->getFDs())) {
+        ALOGE("%s(): Failed to QBUF to output queue, V4L2Id=%zu", __func__, v4l2Id);
+        return false;
+    }
+    if (mFrameAtDevice.find(v4l2Id) != mFrameAtDevice.end()) {
+        ALOGE("%s(): V4L2 buffer %zu already enqueued.", __func__, v4l2Id);
+        return false;
+    }
+    mFrameAtDevice.insert(std::make_pair(v4l2Id, std::move(frame)));
+    return true;
+}
+
+void V4L2StatelessDecoder::onError() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    setState(State::Error);
+    mErrorCb.Run();
+}
+
+void V4L2StatelessDecoder::setState(State newState) {
+    ALOGV("%s(%s)", __func__, StateToString(newState));
+    ALOG_ASSERT(mTaskRunner->RunsTasksInCurrentSequence());
+
+    if (mState == newState) return;
+    if (mState == State::Error) {
+        ALOGV("Already in Error state.");
+        return;
+    }
+
+    switch (newState) {
+    case State::Idle:
+        break;
+    case State::Decoding:
+        break;
+    case State::Draining:
+        if (mState != State::Decoding) newState = State::Error;
+        break;
+    case State::Error:
+        break;
+    }
+
+    ALOGI("Set state %s => %s", StateToString(mState), StateToString(newState));
+    mState = newState;
+}
+
+// static
+const char* V4L2StatelessDecoder::StateToString(State state) {
+    switch (state) {
+    case State::Idle:
+        return "Idle";
+    case State::Decoding:
+        return "Decoding";
+    case State::Draining:
+        return "Draining";
+    case State::Error:
+        return "Error";
+    }
+}
+
+}  // namespace android
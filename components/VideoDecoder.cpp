@@ -4,6 +4,8 @@
 
 #include <v4l2_codec2/components/VideoDecoder.h>
 
+#include <base/bind.h>
+
 namespace android {
 
 // static
@@ -20,4 +22,25 @@ const char* VideoDecoder::DecodeStatusToString(VideoDecoder::DecodeStatus status
 
 VideoDecoder::~VideoDecoder() = default;
 
+void VideoDecoder::decodeBuffers(std::vector<std::unique_ptr<ConstBitstreamBuffer>> buffers,
+                                 BufferDecodeCB bufferCb) {
+    std::vector<int32_t> bitstreamIds;
+    for (const auto& buffer : buffers) bitstreamIds.push_back(buffer->id);
+
+    std::vector<DecodeCB> decodeCbs = bindBufferDecodeCBs(bitstreamIds, bufferCb);
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        decode(std::move(buffers[i]), std::move(decodeCbs[i]));
+    }
+}
+
+// static
+std::vector<VideoDecoder::DecodeCB> VideoDecoder::bindBufferDecodeCBs(
+        const std::vector<int32_t>& bitstreamIds, const BufferDecodeCB& bufferCb) {
+    std::vector<DecodeCB> decodeCbs;
+    for (int32_t bitstreamId : bitstreamIds) {
+        decodeCbs.push_back(::base::BindOnce(bufferCb, bitstreamId));
+    }
+    return decodeCbs;
+}
+
 }  // namespace android
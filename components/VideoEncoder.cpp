@@ -8,11 +8,12 @@ namespace android {
 
 VideoEncoder::InputFrame::InputFrame(std::vector<int>&& fds, std::vector<VideoFramePlane>&& planes,
                                      VideoPixelFormat pixelFormat, uint64_t index,
-                                     int64_t timestamp)
+                                     int64_t timestamp, std::optional<uint32_t> dmabufId)
       : mFds(std::move(fds)),
         mPlanes(std::move(planes)),
         mPixelFormat(pixelFormat),
         mIndex(index),
-        mTimestamp(timestamp) {}
+        mTimestamp(timestamp),
+        mDmabufId(dmabufId) {}
 
 }  // namespace android
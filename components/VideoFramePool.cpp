@@ -8,14 +8,23 @@
 #include <v4l2_codec2/components/VideoFramePool.h>
 
 #include <stdint.h>
+
+#include <algorithm>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include <android/hardware/graphics/common/1.0/types.h>
 #include <base/bind.h>
 #include <base/memory/ptr_util.h>
+#include <base/synchronization/waitable_event.h>
+#include <base/threading/thread.h>
 #include <base/time/time.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
+#include <v4l2_codec2/common/V4L2PollerService.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 #include <v4l2_codec2/plugin_store/C2VdaBqBlockPool.h>
 #include <v4l2_codec2/plugin_store/C2VdaPooledBlockPool.h>
@@ -24,6 +33,75 @@
 using android::hardware::graphics::common::V1_0::BufferUsage;
 
 namespace android {
+namespace {
+
+// The fetch threads shared by all VideoFramePool instances in the process. Fetching blocks doesn't
+// wait for a block to be available nor for its acquire fence, so a small number of threads can
+// serve many concurrent decoders.
+struct FetchThreads {
+    std::mutex mLock;
+    std::vector<std::unique_ptr<::base::Thread>> mThreads;
+    // The number of pools currently using each thread.
+    std::vector<size_t> mNumUsers;
+};
+
+// Get the process-wide fetch threads. The threads are intentionally leaked, as they might still be
+// used while static objects are destroyed on process exit.
+FetchThreads* getFetchThreads() {
+    static FetchThreads* sFetchThreads = new FetchThreads();
+    return sFetchThreads;
+}
+
+}  // namespace
+
+// static
+int32_t VideoFramePool::getNumFetchThreads() {
+    static const int32_t sNumFetchThreads = std::max(
+            property_get_int32("ro.vendor.v4l2_codec2.fetch_threads", kDefaultNumFetchThreads), 0);
+    return sNumFetchThreads;
+}
+
+// static
+scoped_refptr<::base::SequencedTaskRunner> VideoFramePool::acquireFetchTaskRunner(
+        size_t* threadIndex) {
+    FetchThreads* fetchThreads = getFetchThreads();
+    std::lock_guard<std::mutex> lock(fetchThreads->mLock);
+
+    // Start the threads on first use.
+    if (fetchThreads->mThreads.empty()) {
+        const int32_t numThreads = getNumFetchThreads();
+        for (int32_t i = 0; i < numThreads; ++i) {
+            auto thread = std::make_unique<::base::Thread>("VideoFramePoolFetchThread" +
+                                                           std::to_string(i));
+            if (!thread->Start()) {
+                ALOGE("Fetch thread %d failed to start.", i);
+                break;
+            }
+            fetchThreads->mThreads.push_back(std::move(thread));
+            fetchThreads->mNumUsers.push_back(0);
+        }
+        if (fetchThreads->mThreads.empty()) return nullptr;
+    }
+
+    // Use the thread with the least users.
+    size_t index = 0;
+    for (size_t i = 1; i < fetchThreads->mNumUsers.size(); ++i) {
+        if (fetchThreads->mNumUsers[i] < fetchThreads->mNumUsers[index]) index = i;
+    }
+    fetchThreads->mNumUsers[index]++;
+    *threadIndex = index;
+    return fetchThreads->mThreads[index]->task_runner();
+}
+
+// static
+void VideoFramePool::releaseFetchTaskRunner(size_t threadIndex) {
+    FetchThreads* fetchThreads = getFetchThreads();
+    std::lock_guard<std::mutex> lock(fetchThreads->mLock);
+
+    ALOG_ASSERT(threadIndex < fetchThreads->mNumUsers.size());
+    ALOG_ASSERT(fetchThreads->mNumUsers[threadIndex] > 0);
+    fetchThreads->mNumUsers[threadIndex]--;
+}
 
 // static
 std::optional<uint32_t> VideoFramePool::getBufferIdFromGraphicBlock(C2BlockPool& blockPool,
@@ -31,7 +109,8 @@ std::optional<uint32_t> VideoFramePool::getBufferIdFromGraphicBlock(C2BlockPool&
     ALOGV("%s() blockPool.getAllocatorId() = %u", __func__, blockPool.getAllocatorId());
 
     if (blockPool.getAllocatorId() == android::V4L2AllocatorId::V4L2_BUFFERPOOL) {
-        return C2VdaPooledBlockPool::getBufferIdFromGraphicBlock(block);
+        C2VdaPooledBlockPool* bpPool = static_cast<C2VdaPooledBlockPool*>(&blockPool);
+        return bpPool->getBufferIdFromGraphicBlock(block);
     } else if (blockPool.getAllocatorId() == C2PlatformAllocatorStore::BUFFERQUEUE) {
         C2VdaBqBlockPool* bqPool = static_cast<C2VdaBqBlockPool*>(&blockPool);
         return bqPool->getBufferIdFromGraphicBlock(block);
@@ -41,6 +120,19 @@ std::optional<uint32_t> VideoFramePool::getBufferIdFromGraphicBlock(C2BlockPool&
     return std::nullopt;
 }
 
+// static
+c2_status_t VideoFramePool::fetchGraphicBlock(C2BlockPool& blockPool, const ui::Size& size,
+                                              uint32_t format, C2MemoryUsage usage,
+                                              std::shared_ptr<C2GraphicBlock>* block,
+                                              ::base::ScopedFD* fenceFd) {
+    if (blockPool.getAllocatorId() == C2PlatformAllocatorStore::BUFFERQUEUE) {
+        C2VdaBqBlockPool* bqPool = static_cast<C2VdaBqBlockPool*>(&blockPool);
+        return bqPool->fetchGraphicBlockWithFence(size.width, size.height, format, usage, block,
+                                                  fenceFd);
+    }
+    return blockPool.fetchGraphicBlock(size.width, size.height, format, usage, block);
+}
+
 // static
 c2_status_t VideoFramePool::requestNewBufferSet(C2BlockPool& blockPool, int32_t bufferCount,
                                                 const ui::Size& size, uint32_t format,
@@ -63,7 +155,13 @@ c2_status_t VideoFramePool::requestNewBufferSet(C2BlockPool& blockPool, int32_t
 bool VideoFramePool::setNotifyBlockAvailableCb(C2BlockPool& blockPool, ::base::OnceClosure cb) {
     ALOGV("%s() blockPool.getAllocatorId() = %u", __func__, blockPool.getAllocatorId());
 
-    if (blockPool.getAllocatorId() == C2PlatformAllocatorStore::BUFFERQUEUE) {
+    if (blockPool.getAllocatorId() == android::V4L2AllocatorId::V4L2_BUFFERPOOL) {
+        // Bufferpool doesn't report when the remote client released a buffer, the pool can only
+        // give a hint when a block was released locally.
+        C2VdaPooledBlockPool* bpPool = static_cast<C2VdaPooledBlockPool*>(&blockPool);
+        bpPool->setNotifyBlockAvailableCb(std::move(cb));
+        return false;
+    } else if (blockPool.getAllocatorId() == C2PlatformAllocatorStore::BUFFERQUEUE) {
         C2VdaBqBlockPool* bqPool = static_cast<C2VdaBqBlockPool*>(&blockPool);
         return bqPool->setNotifyBlockAvailableCb(std::move(cb));
     }
@@ -74,7 +172,8 @@ bool VideoFramePool::setNotifyBlockAvailableCb(C2BlockPool& blockPool, ::base::O
 std::unique_ptr<VideoFramePool> VideoFramePool::Create(
         std::shared_ptr<C2BlockPool> blockPool, const size_t numBuffers, const ui::Size& size,
         HalPixelFormat pixelFormat, bool isSecure,
-        scoped_refptr<::base::SequencedTaskRunner> taskRunner) {
+        scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+        std::shared_ptr<MemoryTracker> memoryTracker) {
     ALOG_ASSERT(blockPool != nullptr);
 
     uint64_t usage = static_cast<uint64_t>(BufferUsage::VIDEO_DECODER);
@@ -91,19 +190,32 @@ std::unique_ptr<VideoFramePool> VideoFramePool::Create(
         return nullptr;
     }
 
-    std::unique_ptr<VideoFramePool> pool = ::base::WrapUnique(new VideoFramePool(
-            std::move(blockPool), size, pixelFormat, memoryUsage, std::move(taskRunner)));
-    if (!pool->initialize()) return nullptr;
+    std::unique_ptr<VideoFramePool> pool = ::base::WrapUnique(
+            new VideoFramePool(std::move(blockPool), size, pixelFormat, memoryUsage,
+                               std::move(taskRunner), std::move(memoryTracker)));
+    // Allocating protected buffers is slow, so secure pools use their own fetch thread to not stall
+    // the other pools sharing a fetch thread.
+    if (!pool->initialize(isSecure)) return nullptr;
+
+    // Start allocating the whole buffer set of secure pools in the background, so playback start
+    // and seeking don't stall on allocations when the decoder fetches frames.
+    if (isSecure) {
+        pool->mFetchTaskRunner->PostTask(
+                FROM_HERE, ::base::BindOnce(&VideoFramePool::prefetchTask, pool->mFetchWeakThis,
+                                            numBuffers));
+    }
     return pool;
 }
 
 VideoFramePool::VideoFramePool(std::shared_ptr<C2BlockPool> blockPool, const ui::Size& size,
                                HalPixelFormat pixelFormat, C2MemoryUsage memoryUsage,
-                               scoped_refptr<::base::SequencedTaskRunner> taskRunner)
+                               scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+                               std::shared_ptr<MemoryTracker> memoryTracker)
       : mBlockPool(std::move(blockPool)),
         mSize(size),
         mPixelFormat(pixelFormat),
         mMemoryUsage(memoryUsage),
+        mMemoryTracker(std::move(memoryTracker)),
         mClientTaskRunner(std::move(taskRunner)) {
     ALOGV("%s(size=%dx%d)", __func__, size.width, size.height);
     ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
@@ -111,12 +223,29 @@ VideoFramePool::VideoFramePool(std::shared_ptr<C2BlockPool> blockPool, const ui:
     DCHECK(mClientTaskRunner);
 }
 
-bool VideoFramePool::initialize() {
-    if (!mFetchThread.Start()) {
-        ALOGE("Fetch thread failed to start.");
-        return false;
+bool VideoFramePool::initialize(bool fetchMayBlock) {
+    if (fetchMayBlock) {
+        mFetchThread = std::make_unique<::base::Thread>("VideoFramePoolFetchThread");
+        if (!mFetchThread->Start()) {
+            ALOGE("Fetch thread failed to start.");
+            mFetchThread.reset();
+            return false;
+        }
+        mFetchTaskRunner = mFetchThread->task_runner();
+    } else if (getNumFetchThreads() == 0) {
+        // Fetching doesn't block, so blocks can be fetched on the client's sequence. The decoder,
+        // the device poller callbacks and the pool then all run on a single thread, without any
+        // handoff between threads per frame.
+        ALOGV("Fetching blocks on the client sequence.");
+        mFetchTaskRunner = mClientTaskRunner;
+        mFetchOnClientSequence = true;
+    } else {
+        mFetchTaskRunner = acquireFetchTaskRunner(&mFetchThreadIndex);
+        if (!mFetchTaskRunner) {
+            ALOGE("Failed to get a fetch thread.");
+            return false;
+        }
     }
-    mFetchTaskRunner = mFetchThread.task_runner();
 
     mClientWeakThis = mClientWeakThisFactory.GetWeakPtr();
     mFetchWeakThis = mFetchWeakThisFactory.GetWeakPtr();
@@ -130,18 +259,44 @@ VideoFramePool::~VideoFramePool() {
 
     mClientWeakThisFactory.InvalidateWeakPtrs();
 
-    if (mFetchThread.IsRunning()) {
+    if (mFetchOnClientSequence) {
+        ::base::WaitableEvent done;
+        destroyTask(&done);
+    } else if (mFetchThread) {
+        ::base::WaitableEvent done;
+        mFetchTaskRunner->PostTask(FROM_HERE,
+                                   ::base::BindOnce(&VideoFramePool::destroyTask,
+                                                    ::base::Unretained(this),
+                                                    ::base::Unretained(&done)));
+        mFetchThread->Stop();
+    } else if (mFetchTaskRunner) {
+        // The fetch thread is shared with other pools, so we can't stop it. Instead we wait until
+        // all weak pointers used on the fetch thread are invalidated, so no pending fetch tasks of
+        // this pool will run anymore.
+        ::base::WaitableEvent done;
         mFetchTaskRunner->PostTask(FROM_HERE,
-                                   ::base::BindOnce(&VideoFramePool::destroyTask, mFetchWeakThis));
-        mFetchThread.Stop();
+                                   ::base::BindOnce(&VideoFramePool::destroyTask,
+                                                    ::base::Unretained(this),
+                                                    ::base::Unretained(&done)));
+        done.Wait();
+        releaseFetchTaskRunner(mFetchThreadIndex);
     }
 }
 
-void VideoFramePool::destroyTask() {
+void VideoFramePool::destroyTask(::base::WaitableEvent* done) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
 
+    stopWaitingForAcquireFence();
     mFetchWeakThisFactory.InvalidateWeakPtrs();
+    mPrefetchedBlocks = {};
+    mFencedBlock.reset();
+    if (mMemoryTracker) {
+        mMemoryTracker->add("outputFrames", -static_cast<int64_t>(mTrackedMemoryUsage));
+    }
+    mTrackedBufferIds.clear();
+    mTrackedMemoryUsage = 0;
+    done->Signal();
 }
 
 bool VideoFramePool::getVideoFrame(GetVideoFrameCB cb) {
@@ -161,54 +316,167 @@ bool VideoFramePool::getVideoFrame(GetVideoFrameCB cb) {
 // static
 void VideoFramePool::getVideoFrameTaskThunk(
         scoped_refptr<::base::SequencedTaskRunner> taskRunner,
-        std::optional<::base::WeakPtr<VideoFramePool>> weakPool) {
+        std::optional<::base::WeakPtr<VideoFramePool>> weakPool, uint64_t fetchAttempt) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(weakPool);
 
-    taskRunner->PostTask(FROM_HERE,
-                         ::base::BindOnce(&VideoFramePool::getVideoFrameTask, *weakPool));
+    taskRunner->PostTask(FROM_HERE, ::base::BindOnce(&VideoFramePool::onBlockAvailableTask,
+                                                     *weakPool, fetchAttempt));
 }
 
-void VideoFramePool::getVideoFrameTask() {
+void VideoFramePool::onBlockAvailableTask(uint64_t fetchAttempt) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
 
-    // Variables used to exponential backoff retry when buffer fetching times out.
-    constexpr size_t kFetchRetryDelayInit = 64;    // Initial delay: 64us
-    constexpr size_t kFetchRetryDelayMax = 16384;  // Max delay: 16ms (1 frame at 60fps)
-    static size_t sNumRetries = 0;
-    static size_t sDelay = kFetchRetryDelayInit;
+    // The block was already fetched by a retry, or the notification belongs to a previous request.
+    if (fetchAttempt != mFetchAttempt) return;
+
+    mNotifiedBlockAvailable = true;
+    getVideoFrameTask();
+}
+
+void VideoFramePool::retryFetchTask(uint64_t fetchAttempt) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    // A block-available notification already triggered another fetch attempt.
+    if (fetchAttempt != mFetchAttempt) return;
+
+    getVideoFrameTask();
+}
+
+void VideoFramePool::prefetchTask(size_t numBlocks) {
+    ALOGV("%s(numBlocks=%zu)", __func__, numBlocks);
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    if (numBlocks == 0) return;
 
     std::shared_ptr<C2GraphicBlock> block;
     c2_status_t err = mBlockPool->fetchGraphicBlock(
             mSize.width, mSize.height, static_cast<uint32_t>(mPixelFormat), mMemoryUsage, &block);
+    if (err != C2_OK) {
+        // The remaining blocks are fetched on demand.
+        ALOGV("%s(): stopped prefetching, err=%d", __func__, err);
+        return;
+    }
+    mPrefetchedBlocks.push(std::move(block));
+
+    // Allocate a single block per task, so the shared fetch thread can serve other requests.
+    mFetchTaskRunner->PostTask(FROM_HERE, ::base::BindOnce(&VideoFramePool::prefetchTask,
+                                                           mFetchWeakThis, numBlocks - 1));
+}
+
+void VideoFramePool::getVideoFrameTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    const bool notifiedBlockAvailable = mNotifiedBlockAvailable;
+    mNotifiedBlockAvailable = false;
+    // Invalidate the notification and retry of the previous attempt, only one of them should
+    // trigger the next attempt.
+    mFetchAttempt++;
+
+    std::shared_ptr<C2GraphicBlock> block;
+    ::base::ScopedFD fenceFd;
+    c2_status_t err = C2_OK;
+    if (!mPrefetchedBlocks.empty()) {
+        block = std::move(mPrefetchedBlocks.front());
+        mPrefetchedBlocks.pop();
+    } else {
+        err = fetchGraphicBlock(*mBlockPool, mSize, static_cast<uint32_t>(mPixelFormat),
+                                mMemoryUsage, &block, &fenceFd);
+    }
     if (err == C2_TIMED_OUT || err == C2_BLOCKING) {
-        if (setNotifyBlockAvailableCb(*mBlockPool,
-                                      ::base::BindOnce(&VideoFramePool::getVideoFrameTaskThunk,
-                                                       mFetchTaskRunner, mFetchWeakThis))) {
+        // Only wait for the block-available notification alone if the pool guarantees it. Other
+        // pools only give hints that might never come. A notification might also arrive before the
+        // block was returned to the pool. In both cases the backoff retry keeps running as well,
+        // whichever comes first triggers the next attempt.
+        const bool notificationGuaranteed = setNotifyBlockAvailableCb(
+                *mBlockPool, ::base::BindOnce(&VideoFramePool::getVideoFrameTaskThunk,
+                                              mFetchTaskRunner, mFetchWeakThis, mFetchAttempt));
+        if (notificationGuaranteed && !notifiedBlockAvailable) {
             ALOGV("%s(): fetchGraphicBlock() timeout, waiting for block available.", __func__);
-        } else {
-            ALOGV("%s(): fetchGraphicBlock() timeout, waiting %zuus (%zu retry)", __func__, sDelay,
-                  sNumRetries + 1);
-            mFetchTaskRunner->PostDelayedTask(
-                    FROM_HERE, ::base::BindOnce(&VideoFramePool::getVideoFrameTask, mFetchWeakThis),
-                    ::base::TimeDelta::FromMicroseconds(sDelay));
-
-            sDelay = std::min(sDelay * 2, kFetchRetryDelayMax);  // Exponential backoff
-            sNumRetries++;
+            return;
         }
 
+        ALOGV("%s(): fetchGraphicBlock() timeout, retrying in %zuus (%zu retry)", __func__,
+              mFetchRetryDelay, mNumFetchRetries + 1);
+        mFetchTaskRunner->PostDelayedTask(FROM_HERE,
+                                          ::base::BindOnce(&VideoFramePool::retryFetchTask,
+                                                           mFetchWeakThis, mFetchAttempt),
+                                          ::base::TimeDelta::FromMicroseconds(mFetchRetryDelay));
+
+        // Exponential backoff
+        mFetchRetryDelay = std::min(mFetchRetryDelay * 2, kFetchRetryDelayMax);
+        mNumFetchRetries++;
         return;
     }
 
     // Reset to the default value.
-    sNumRetries = 0;
-    sDelay = kFetchRetryDelayInit;
+    mNumFetchRetries = 0;
+    mFetchRetryDelay = kFetchRetryDelayInit;
+
+    if (err == C2_OK && fenceFd.is_valid()) {
+        // The buffer is still used by the consumer (e.g. being scanned out). Instead of blocking
+        // the shared fetch thread, the acquire fence is waited for on the poller. A sync file
+        // becomes readable once the fence signaled.
+        ALOG_ASSERT(!mAcquireFenceWatchId);
+        mAcquireFenceWatchId = V4L2PollerService::getInstance()->addWatch(
+                fenceFd.get(), mFetchTaskRunner,
+                ::base::BindRepeating(&VideoFramePool::onAcquireFenceSignaledTask,
+                                      mFetchWeakThis),
+                ::base::BindRepeating(&VideoFramePool::onAcquireFenceErrorTask, mFetchWeakThis));
+        if (mAcquireFenceWatchId) {
+            mFencedBlock = std::move(block);
+            mAcquireFenceFd = std::move(fenceFd);
+            return;
+        }
+        ALOGE("%s(): Failed to wait for the acquire fence.", __func__);
+        block.reset();
+        err = C2_CORRUPTED;
+    }
+
+    outputBlock(err, std::move(block));
+}
+
+void VideoFramePool::onAcquireFenceSignaledTask(bool /* event */) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mAcquireFenceWatchId) return;
+
+    stopWaitingForAcquireFence();
+    outputBlock(C2_OK, std::move(mFencedBlock));
+}
+
+void VideoFramePool::onAcquireFenceErrorTask() {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    if (!mAcquireFenceWatchId) return;
+
+    ALOGE("%s(): Failed to poll the acquire fence.", __func__);
+    stopWaitingForAcquireFence();
+    mFencedBlock.reset();
+    outputBlock(C2_CORRUPTED, nullptr);
+}
+
+void VideoFramePool::stopWaitingForAcquireFence() {
+    if (mAcquireFenceWatchId) {
+        V4L2PollerService::getInstance()->removeWatch(*mAcquireFenceWatchId);
+        mAcquireFenceWatchId.reset();
+    }
+    mAcquireFenceFd.reset();
+}
+
+void VideoFramePool::outputBlock(c2_status_t err, std::shared_ptr<C2GraphicBlock> block) {
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
 
     std::optional<FrameWithBlockId> frameWithBlockId;
     if (err == C2_OK) {
         ALOG_ASSERT(block != nullptr);
         std::optional<uint32_t> bufferId = getBufferIdFromGraphicBlock(*mBlockPool, *block);
+        if (bufferId) trackBlockMemory(*bufferId, *block);
         std::unique_ptr<VideoFrame> frame = VideoFrame::Create(std::move(block));
         // Only pass the frame + id pair if both have successfully been obtained.
         // Otherwise exit the loop so a nullopt is passed to the client.
@@ -221,11 +489,27 @@ void VideoFramePool::getVideoFrameTask() {
         ALOGE("%s(): Failed to fetch block, err=%d", __func__, err);
     }
 
+    if (mFetchOnClientSequence) {
+        onVideoFrameReady(std::move(frameWithBlockId));
+        return;
+    }
     mClientTaskRunner->PostTask(
             FROM_HERE, ::base::BindOnce(&VideoFramePool::onVideoFrameReady, mClientWeakThis,
                                         std::move(frameWithBlockId)));
 }
 
+void VideoFramePool::trackBlockMemory(uint32_t bufferId, const C2GraphicBlock& block) {
+    ALOG_ASSERT(mFetchTaskRunner->RunsTasksInCurrentSequence());
+
+    // The pool recycles a fixed set of buffers, so the size only needs to be looked up once per
+    // buffer. The buffers are considered pinned until the pool is destroyed.
+    if (!mMemoryTracker || !mTrackedBufferIds.insert(bufferId).second) return;
+
+    const size_t size = MemoryTracker::getBufferSize(block.handle());
+    mTrackedMemoryUsage += size;
+    mMemoryTracker->add("outputFrames", static_cast<int64_t>(size));
+}
+
 void VideoFramePool::onVideoFrameReady(std::optional<FrameWithBlockId> frameWithBlockId) {
     ALOGV("%s()", __func__);
     ALOG_ASSERT(mClientTaskRunner->RunsTasksInCurrentSequence());
@@ -0,0 +1,351 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "WorkRecorder"
+
+#include <v4l2_codec2/components/WorkRecorder.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include <C2Config.h>
+#include <base/strings/stringprintf.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+// The recording file starts with the magic and version, followed by the component name. Each event
+// then starts with its type and time, followed by the type-specific fields. All values are written
+// in native byte order, as recordings are meant to be replayed on the device they were captured.
+constexpr char kMagic[4] = {'C', '2', 'W', 'R'};
+constexpr uint32_t kVersion = 1;
+
+// The maximum size of a single field accepted by the reader, to reject corrupt recordings early.
+constexpr uint32_t kMaxFieldSize = 256 * 1024 * 1024;
+
+class RecordingReader {
+public:
+    explicit RecordingReader(FILE* file) : mFile(file) {}
+
+    bool eof() {
+        const int c = fgetc(mFile);
+        if (c == EOF) return true;
+        ungetc(c, mFile);
+        return false;
+    }
+
+    bool read(void* data, size_t size) { return fread(data, 1, size, mFile) == size; }
+
+    template <typename T>
+    bool readValue(T* value) {
+        return read(value, sizeof(*value));
+    }
+
+    bool readBytes(std::vector<uint8_t>* data) {
+        uint32_t size;
+        if (!readValue(&size) || size > kMaxFieldSize) return false;
+        data->resize(size);
+        return read(data->data(), size);
+    }
+
+    bool readParams(std::vector<std::unique_ptr<C2Param>>* params) {
+        uint32_t count;
+        if (!readValue(&count)) return false;
+        for (uint32_t i = 0; i < count; ++i) {
+            std::vector<uint8_t> data;
+            if (!readBytes(&data)) return false;
+            C2Param* param = C2Param::From(data.data(), data.size());
+            if (!param) return false;
+            params->push_back(C2Param::Copy(*param));
+        }
+        return true;
+    }
+
+private:
+    FILE* const mFile;
+};
+
+}  // namespace
+
+// static
+std::unique_ptr<WorkRecorder> WorkRecorder::Create(const std::string& name, uint32_t id) {
+    char recordDir[PROPERTY_VALUE_MAX];
+    if (property_get("ro.vendor.v4l2_codec2.record_dir", recordDir, "") <= 0) return nullptr;
+
+    std::string path = base::StringPrintf("%s/%s-%d-%u.c2rec", recordDir, name.c_str(),
+                                          static_cast<int>(getpid()), id);
+    FILE* file = fopen(path.c_str(), "wbe");
+    if (!file) {
+        ALOGE("Failed to create recording %s: %s", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    std::unique_ptr<WorkRecorder> recorder(new WorkRecorder(file, std::move(path)));
+    std::lock_guard<std::mutex> lock(recorder->mLock);
+    recorder->writeLocked(kMagic, sizeof(kMagic));
+    recorder->writeValueLocked(kVersion);
+    recorder->writeValueLocked(static_cast<uint32_t>(name.size()));
+    recorder->writeLocked(name.data(), name.size());
+    return recorder;
+}
+
+WorkRecorder::WorkRecorder(FILE* file, std::string path)
+      : mPath(std::move(path)), mStartTime(std::chrono::steady_clock::now()), mFile(file) {
+    ALOGI("Recording component traffic to %s", mPath.c_str());
+}
+
+WorkRecorder::~WorkRecorder() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mFile) fclose(mFile);
+}
+
+void WorkRecorder::recordStart(C2ComponentInterface& intf, uint64_t paramsGeneration) {
+    std::lock_guard<std::mutex> lock(mLock);
+    recordConfigLocked(static_cast<uint8_t>(WorkRecording::EventType::kStart), intf);
+    mParamsGeneration = paramsGeneration;
+}
+
+void WorkRecorder::recordStop() {
+    std::lock_guard<std::mutex> lock(mLock);
+    writeEventHeaderLocked(static_cast<uint8_t>(WorkRecording::EventType::kStop));
+    if (mFile) fflush(mFile);
+}
+
+void WorkRecorder::recordConfigChange(C2ComponentInterface& intf, uint64_t paramsGeneration) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mParamsGeneration == paramsGeneration) return;
+
+    recordConfigLocked(static_cast<uint8_t>(WorkRecording::EventType::kConfig), intf);
+    mParamsGeneration = paramsGeneration;
+}
+
+void WorkRecorder::recordWork(const C2Work& work) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!mFile) return;
+
+    writeEventHeaderLocked(static_cast<uint8_t>(WorkRecording::EventType::kWork));
+    writeValueLocked(static_cast<uint32_t>(work.input.flags));
+    writeValueLocked(work.input.ordinal.frameIndex.peeku());
+    writeValueLocked(work.input.ordinal.timestamp.peeku());
+
+    const C2Buffer* buffer = work.input.buffers.empty() ? nullptr : work.input.buffers[0].get();
+    if (buffer && buffer->data().type() == C2BufferData::LINEAR &&
+        !buffer->data().linearBlocks().empty()) {
+        const C2ConstLinearBlock& block = buffer->data().linearBlocks().front();
+        C2ReadView view = block.map().get();
+        if (view.error() == C2_OK) {
+            writeValueLocked(static_cast<uint8_t>(WorkRecording::BufferType::kLinear));
+            writeValueLocked(static_cast<uint32_t>(view.capacity()));
+            writeLocked(view.data(), view.capacity());
+        } else {
+            ALOGE("Failed to map the input bitstream of work #%" PRIu64,
+                  work.input.ordinal.frameIndex.peeku());
+            writeValueLocked(static_cast<uint8_t>(WorkRecording::BufferType::kNone));
+        }
+    } else if (buffer && buffer->data().type() == C2BufferData::GRAPHIC &&
+               !buffer->data().graphicBlocks().empty()) {
+        const C2ConstGraphicBlock& block = buffer->data().graphicBlocks().front();
+        const C2GraphicView view = block.map().get();
+        const C2PlanarLayout& layout = view.layout();
+        bool recordable = view.error() == C2_OK;
+        for (uint32_t i = 0; recordable && i < layout.numPlanes; ++i) {
+            recordable = layout.planes[i].allocatedDepth == 8;
+        }
+        if (recordable) {
+            writeValueLocked(static_cast<uint8_t>(WorkRecording::BufferType::kGraphic));
+            writeValueLocked(view.width());
+            writeValueLocked(view.height());
+            writeValueLocked(static_cast<uint32_t>(layout.type));
+            writeValueLocked(static_cast<uint8_t>(layout.numPlanes));
+            for (uint32_t i = 0; i < layout.numPlanes; ++i) {
+                const C2PlaneInfo& plane = layout.planes[i];
+                writeValueLocked(static_cast<uint32_t>(plane.channel));
+                writeValueLocked(plane.colSampling);
+                writeValueLocked(plane.rowSampling);
+
+                // The samples are written tightly packed, row by row.
+                const uint32_t width = (view.width() + plane.colSampling - 1) / plane.colSampling;
+                const uint32_t height = (view.height() + plane.rowSampling - 1) / plane.rowSampling;
+                std::vector<uint8_t> row(width);
+                for (uint32_t y = 0; y < height; ++y) {
+                    const uint8_t* src = view.data()[i] + y * plane.rowInc;
+                    for (uint32_t x = 0; x < width; ++x) row[x] = src[x * plane.colInc];
+                    writeLocked(row.data(), row.size());
+                }
+            }
+        } else {
+            ALOGE("Failed to record the input frame of work #%" PRIu64,
+                  work.input.ordinal.frameIndex.peeku());
+            writeValueLocked(static_cast<uint8_t>(WorkRecording::BufferType::kNone));
+        }
+    } else {
+        writeValueLocked(static_cast<uint8_t>(WorkRecording::BufferType::kNone));
+    }
+
+    std::vector<const C2Param*> configUpdate;
+    for (const std::unique_ptr<C2Param>& param : work.input.configUpdate) {
+        if (param) configUpdate.push_back(param.get());
+    }
+    writeParamsLocked(configUpdate);
+}
+
+void WorkRecorder::recordDrain() {
+    std::lock_guard<std::mutex> lock(mLock);
+    writeEventHeaderLocked(static_cast<uint8_t>(WorkRecording::EventType::kDrain));
+}
+
+void WorkRecorder::recordFlush() {
+    std::lock_guard<std::mutex> lock(mLock);
+    writeEventHeaderLocked(static_cast<uint8_t>(WorkRecording::EventType::kFlush));
+}
+
+void WorkRecorder::recordConfigLocked(uint8_t type, C2ComponentInterface& intf) {
+    if (!mFile) return;
+
+    // Only the parameters the client can configure are recorded.
+    std::vector<std::shared_ptr<C2ParamDescriptor>> descriptors;
+    intf.querySupportedParams_nb(&descriptors);
+    std::vector<C2Param::Index> indices;
+    for (const std::shared_ptr<C2ParamDescriptor>& descriptor : descriptors) {
+        if (descriptor && !descriptor->isReadOnly() && !descriptor->isConst()) {
+            indices.push_back(descriptor->index());
+        }
+    }
+    std::vector<std::unique_ptr<C2Param>> params;
+    intf.query_vb({}, indices, C2_MAY_BLOCK, &params);
+
+    // The block pools refer to the client's pools, which don't exist when replaying.
+    std::vector<const C2Param*> recordedParams;
+    for (const std::unique_ptr<C2Param>& param : params) {
+        if (!param || param->type() == C2PortBlockPoolsTuning::output::PARAM_TYPE) continue;
+        recordedParams.push_back(param.get());
+    }
+
+    writeEventHeaderLocked(type);
+    writeParamsLocked(recordedParams);
+}
+
+void WorkRecorder::writeEventHeaderLocked(uint8_t type) {
+    const auto elapsed = std::chrono::steady_clock::now() - mStartTime;
+    writeValueLocked(type);
+    writeValueLocked(static_cast<int64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+}
+
+void WorkRecorder::writeParamsLocked(const std::vector<const C2Param*>& params) {
+    writeValueLocked(static_cast<uint32_t>(params.size()));
+    for (const C2Param* param : params) {
+        writeValueLocked(static_cast<uint32_t>(param->size()));
+        writeLocked(param, param->size());
+    }
+}
+
+void WorkRecorder::writeLocked(const void* data, size_t size) {
+    if (!mFile || size == 0) return;
+
+    if (fwrite(data, 1, size, mFile) != size) {
+        // Stop recording rather than leaving a corrupt event in the middle of the file.
+        ALOGE("Failed to write recording %s, stopping: %s", mPath.c_str(), strerror(errno));
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+// static
+std::optional<WorkRecording> WorkRecording::Read(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rbe");
+    if (!file) {
+        ALOGE("Failed to open recording %s: %s", path.c_str(), strerror(errno));
+        return std::nullopt;
+    }
+    RecordingReader reader(file);
+
+    WorkRecording recording;
+    bool valid = [&]() {
+        char magic[sizeof(kMagic)];
+        uint32_t version;
+        std::vector<uint8_t> name;
+        if (!reader.read(magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+            !reader.readValue(&version) || version != kVersion || !reader.readBytes(&name)) {
+            return false;
+        }
+        recording.mComponentName.assign(name.begin(), name.end());
+
+        while (!reader.eof()) {
+            Event event;
+            uint8_t type;
+            if (!reader.readValue(&type) || !reader.readValue(&event.mTimeUs)) return false;
+            event.mType = static_cast<EventType>(type);
+
+            switch (event.mType) {
+            case EventType::kStart:
+            case EventType::kConfig:
+                if (!reader.readParams(&event.mParams)) return false;
+                break;
+            case EventType::kStop:
+            case EventType::kDrain:
+            case EventType::kFlush:
+                break;
+            case EventType::kWork: {
+                uint8_t bufferType;
+                if (!reader.readValue(&event.mFlags) || !reader.readValue(&event.mFrameIndex) ||
+                    !reader.readValue(&event.mTimestamp) || !reader.readValue(&bufferType)) {
+                    return false;
+                }
+                event.mBufferType = static_cast<BufferType>(bufferType);
+                if (event.mBufferType == BufferType::kLinear) {
+                    if (!reader.readBytes(&event.mBitstream)) return false;
+                } else if (event.mBufferType == BufferType::kGraphic) {
+                    uint8_t numPlanes;
+                    if (!reader.readValue(&event.mWidth) || !reader.readValue(&event.mHeight) ||
+                        !reader.readValue(&event.mLayoutType) || !reader.readValue(&numPlanes)) {
+                        return false;
+                    }
+                    for (uint8_t i = 0; i < numPlanes; ++i) {
+                        Plane plane;
+                        if (!reader.readValue(&plane.mChannel) ||
+                            !reader.readValue(&plane.mColSampling) ||
+                            !reader.readValue(&plane.mRowSampling) || plane.mColSampling == 0 ||
+                            plane.mRowSampling == 0) {
+                            return false;
+                        }
+                        const uint64_t size =
+                                static_cast<uint64_t>((event.mWidth + plane.mColSampling - 1) /
+                                                      plane.mColSampling) *
+                                ((event.mHeight + plane.mRowSampling - 1) / plane.mRowSampling);
+                        if (size > kMaxFieldSize) return false;
+                        plane.mData.resize(size);
+                        if (!reader.read(plane.mData.data(), size)) return false;
+                        event.mPlanes.push_back(std::move(plane));
+                    }
+                } else if (event.mBufferType != BufferType::kNone) {
+                    return false;
+                }
+                if (!reader.readParams(&event.mParams)) return false;
+                break;
+            }
+            default:
+                return false;
+            }
+            recording.mEvents.push_back(std::move(event));
+        }
+        return true;
+    }();
+    fclose(file);
+
+    if (!valid) {
+        ALOGE("Recording %s is invalid", path.c_str());
+        return std::nullopt;
+    }
+    return recording;
+}
+
+}  // namespace android
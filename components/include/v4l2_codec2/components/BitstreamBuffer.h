@@ -33,6 +33,19 @@ struct BitstreamBuffer {
     std::shared_ptr<C2LinearBlock> dmabuf;
     const size_t offset;
     const size_t size;
+    // The temporal layer of the encoded frame, zero if temporal layering is disabled.
+    uint32_t temporalLayerId = 0;
+    // The average QP of the encoded frame, negative if unknown.
+    int32_t averageQp = -1;
+    // The time the device spent encoding the frame, from queueing the input frame until the output
+    // buffer was dequeued. Negative if unknown.
+    int64_t encodeTimeUs = -1;
+    // Whether the buffer holds the last slice of the frame, always set if frames aren't split into
+    // slices.
+    bool lastSlice = true;
+    // Whether the encoded data was truncated by the device and dropped, the buffer holds no valid
+    // data then.
+    bool dropped = false;
 };
 
 }  // namespace android
@@ -5,10 +5,14 @@
 #ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_COMPONENT_FACTORY_H
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_COMPONENT_FACTORY_H
 
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include <C2ComponentFactory.h>
+#include <android-base/thread_annotations.h>
+#include <base/threading/thread.h>
 #include <util/C2InterfaceHelper.h>
 
 namespace android {
@@ -19,19 +23,43 @@ public:
             const std::string& componentName, std::shared_ptr<C2ReflectorHelper> reflector);
     V4L2ComponentFactory(const std::string& componentName, bool isEncoder,
                          std::shared_ptr<C2ReflectorHelper> reflector);
-    ~V4L2ComponentFactory() override = default;
+    ~V4L2ComponentFactory() override;
 
-    // Implementation of C2ComponentFactory.
+    // Implementation of C2ComponentFactory. Components requested with node id 0 are handed out
+    // from the warm pool if available, these are always created with the default deleter.
     c2_status_t createComponent(c2_node_id_t id, std::shared_ptr<C2Component>* const component,
                                 ComponentDeleter deleter) override;
     c2_status_t createInterface(c2_node_id_t id,
                                 std::shared_ptr<C2ComponentInterface>* const interface,
                                 InterfaceDeleter deleter) override;
 
+    // Get the number of components to keep pre-created for each component name, configured using
+    // the "ro.vendor.v4l2_codec2.warm_pool_size" property. A value of 0 disables the warm pool.
+    static size_t getWarmPoolSize();
+
 private:
+    // Create a new component instance with the specified |id| and |deleter|. |pooled| components
+    // don't reserve hardware capacity until admitted using admitComponent().
+    std::shared_ptr<C2Component> createComponentInstance(c2_node_id_t id, ComponentDeleter deleter,
+                                                         bool pooled);
+    // Reserve hardware capacity for a pooled |component| before handing it out.
+    bool admitComponent(const std::shared_ptr<C2Component>& component);
+    // Create components on the warm-up thread until the warm pool is full.
+    void fillWarmPoolTask();
+
     const std::string mComponentName;
     const bool mIsEncoder;
     std::shared_ptr<C2ReflectorHelper> mReflector;
+
+    // The number of components to keep in the warm pool.
+    const size_t mWarmPoolSize;
+    // Thread on which the warm pool is refilled, so component creation doesn't block the caller.
+    ::base::Thread mWarmUpThread{"V4L2ComponentFactoryWarmUpThread"};
+    std::mutex mWarmPoolLock;
+    // Pre-created components, ready to be handed out on the next createComponent() call. These only
+    // reserve hardware capacity once handed out, so idle components never cause other sessions to
+    // be rejected.
+    std::deque<std::shared_ptr<C2Component>> mWarmPool GUARDED_BY(mWarmPoolLock);
 };
 
 }  // namespace android
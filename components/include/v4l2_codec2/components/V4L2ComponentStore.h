@@ -13,6 +13,8 @@
 #include <android-base/thread_annotations.h>
 #include <util/C2InterfaceHelper.h>
 
+#include <v4l2_codec2/common/MemoryPressureMonitor.h>
+
 namespace android {
 
 class V4L2ComponentStore : public C2ComponentStore {
@@ -40,6 +42,10 @@ public:
     c2_status_t querySupportedValues_sm(
             std::vector<C2FieldSupportedValuesQuery>& fields) const override;
 
+    // Release the memory the components can do without, e.g. when the service is asked to trim its
+    // memory. The components keep using fewer buffers until the pressure is relieved.
+    static void trimMemory();
+
 private:
     V4L2ComponentStore();
 
@@ -47,6 +53,9 @@ private:
     std::shared_ptr<const C2Component::Traits> GetTraits(const C2String& name);
 
     std::shared_ptr<C2ReflectorHelper> mReflector;
+    // The observer freeing the cached graphic allocations under memory pressure, and disabling the
+    // cache until the pressure is relieved.
+    MemoryPressureMonitor::ObserverId mMemoryPressureObserverId;
 
     std::mutex mCachedFactoriesLock;
     std::map<C2String, std::unique_ptr<::C2ComponentFactory>> mCachedFactories
@@ -6,7 +6,12 @@
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_DECODE_COMPONENT_H
 
 #include <atomic>
+#include <list>
 #include <memory>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <vector>
 
 #include <C2Component.h>
 #include <C2ComponentFactory.h>
@@ -16,24 +21,42 @@
 #include <base/sequenced_task_runner.h>
 #include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
+#include <base/time/time.h>
 
+#include <v4l2_codec2/common/LatencyTracker.h>
+#include <v4l2_codec2/common/MemoryTracker.h>
+#include <v4l2_codec2/common/MemoryPressureMonitor.h>
+#include <v4l2_codec2/common/V4L2AdmissionController.h>
+#include <v4l2_codec2/common/V4L2Device.h>
 #include <v4l2_codec2/components/V4L2DecodeInterface.h>
 #include <v4l2_codec2/components/VideoDecoder.h>
 #include <v4l2_codec2/components/VideoFramePool.h>
 
 namespace android {
 
+class C2VdaPooledBlockPool;
+class WorkRecorder;
+
 class V4L2DecodeComponent : public C2Component,
                             public std::enable_shared_from_this<V4L2DecodeComponent> {
 public:
+    // Create a new instance of the V4L2DecodeComponent. A |pooled| component is kept idle in the
+    // warm pool of V4L2ComponentFactory: it doesn't reserve any hardware capacity until admit() is
+    // called, but opens its device in advance.
     static std::shared_ptr<C2Component> create(const std::string& name, c2_node_id_t id,
                                                const std::shared_ptr<C2ReflectorHelper>& helper,
-                                               C2ComponentFactory::ComponentDeleter deleter);
+                                               C2ComponentFactory::ComponentDeleter deleter,
+                                               bool pooled);
     V4L2DecodeComponent(const std::string& name, c2_node_id_t id,
                         const std::shared_ptr<C2ReflectorHelper>& helper,
-                        const std::shared_ptr<V4L2DecodeInterface>& intfImpl);
+                        const std::shared_ptr<V4L2DecodeInterface>& intfImpl,
+                        std::unique_ptr<V4L2AdmissionController::Session> admissionSession);
     ~V4L2DecodeComponent() override;
 
+    // Reserve hardware capacity for a component created for the warm pool, before handing it out.
+    // Returns false if the admission controller rejects the session.
+    bool admit();
+
     // Implementation of C2Component.
     c2_status_t start() override;
     c2_status_t stop() override;
@@ -58,6 +81,10 @@ private:
     };
     static const char* ComponentStateToString(ComponentState state);
 
+    // The bitstream IDs of the buffers used to re-prime the decoder, which don't collide with the
+    // IDs derived from frame indices.
+    static constexpr int32_t kFirstReprimeBitstreamId = 0x40000000;
+
     // Handle C2Component's public methods on |mDecoderTaskRunner|.
     void startTask(c2_status_t* status, ::base::WaitableEvent* done);
     void stopTask();
@@ -67,13 +94,42 @@ private:
     void drainTask();
     void setListenerTask(const std::shared_ptr<Listener>& listener, ::base::WaitableEvent* done);
 
+    // Create |mDecoder| for the configured codec.
+    bool createDecoder();
+    // Create |mDecoder| after starting asynchronously, reporting an error on failure.
+    void createDecoderTask();
     // Try to process pending works at |mPendingWorks|. Paused when |mIsDraining| is set.
     void pumpPendingWorks();
-    // Get the buffer pool.
+
+    // Schedule |idleReleaseTask()| to run after |delay|, unless it's already scheduled.
+    void scheduleIdleRelease(::base::TimeDelta delay);
+    // Release |mDecoder| and its hardware capacity if no input was queued for |mIdleReleaseDelay|.
+    void idleReleaseTask();
+    // Release |mDecoder| of a session without input earlier when under memory pressure.
+    void onMemoryPressure(bool underPressure);
+    // Release |mDecoder| if it doesn't hold any work and can be re-primed. Returns whether the
+    // decoder was released.
+    bool releaseIdleDecoder();
+    // Re-create the decoder released while idle, and re-prime it using |mReprimeBitstream|.
+    bool resumeIdleDecoder();
+    void onReprimeDecodeDone(VideoDecoder::DecodeStatus status);
+    // Keep a copy of the input |block| in |mReprimeBitstream| if it's needed to re-prime the
+    // decoder. |isCSD| is set if the block contains the codec config.
+    void recordReprimeBitstream(const C2ConstLinearBlock& block, bool isCSD);
+    // Drop the frames from |mReprimeBitstream|, keeping the codec config.
+    void dropReprimeFrames();
+    void clearReprimeBitstream();
+    // Get the buffer pool. |numBuffers| is raised to the number of buffers needed by the pipeline,
+    // which depends on whether we're decoding to a surface.
     std::unique_ptr<VideoFramePool> getVideoFramePool(const ui::Size& size,
                                                       HalPixelFormat pixelFormat,
-                                                      size_t numBuffers);
-    // Detect and report works with no-show frame, only used at VP8 and VP9.
+                                                      size_t* numBuffers);
+    // Check whether the output frames can use vendor compressed formats, which is only the case
+    // when decoding to a surface whose consumer doesn't access the buffers with the CPU.
+    bool isCompressedOutputAllowed();
+    // Whether works without output frame might contain a no-show frame, for VP8, VP9 and AV1.
+    bool mayHaveNoShowFrames() const;
+    // Detect and report works with no-show frame, only used at VP8, VP9 and AV1.
     void detectNoShowFrameWorksAndReportIfFinished(const C2WorkOrdinalStruct& currOrdinal);
 
     // Finish callbacks of each method.
@@ -81,6 +137,12 @@ private:
     void onDecodeDone(int32_t bitstreamId, VideoDecoder::DecodeStatus status);
     void onDrainDone(VideoDecoder::DecodeStatus status);
     void onFlushDone();
+    // Callback of VideoDecoder::setCorruptionCallback(), schedules resyncDecoder().
+    void onDecoderCorrupted(int32_t bitstreamId);
+    // Recover from corrupted data without stopping the session: flush |mDecoder|, report the works
+    // at the decoder without output frames as dropped, and drop the input until the next key
+    // frame, which doesn't reference the corrupted frames.
+    void resyncDecoder();
 
     // Try to process decoding works at |mPendingWorks|.
     void pumpReportWork();
@@ -88,11 +150,20 @@ private:
     bool reportWorkIfFinished(int32_t bitstreamId);
     bool reportEOSWork();
     void reportAbandonedWorks();
+    // Queue |work| in |mFinishedWorks|, which are reported together once the current task is done.
     bool reportWork(std::unique_ptr<C2Work> work);
+    // Report all works in |mFinishedWorks| to the listener in a single call.
+    void flushFinishedWorks();
+    void flushFinishedWorksTask();
     // Report error when any error occurs.
     void reportError(c2_status_t error);
 
-    static std::atomic<int32_t> sConcurrentInstances;
+    // The session admitted by the admission controller, used to reserve the hardware capacity
+    // needed while the component is running. Only null while the component is in the warm pool.
+    std::unique_ptr<V4L2AdmissionController::Session> mAdmissionSession;
+    // The device opened in advance while the component was in the warm pool, used by the first
+    // decoder created.
+    scoped_refptr<V4L2Device> mPrewarmedDevice;
 
     // The pointer of component interface implementation.
     std::shared_ptr<V4L2DecodeInterface> mIntfImpl;
@@ -102,19 +173,73 @@ private:
     std::shared_ptr<Listener> mListener;
 
     std::unique_ptr<VideoDecoder> mDecoder;
+    // Records the time works spend in each stage of the decode pipeline, shared with |mDecoder|.
+    const std::shared_ptr<LatencyTracker> mLatencyTracker;
+    // Accounts the buffer memory pinned by this component, shared with |mDecoder| and the frame
+    // pools.
+    const std::shared_ptr<MemoryTracker> mMemoryTracker;
+    // Records the traffic queued by the client if enabled, see WorkRecorder.
+    const std::unique_ptr<WorkRecorder> mRecorder;
     // The queue of works that haven't processed and sent to |mDecoder|.
     std::queue<std::unique_ptr<C2Work>> mPendingWorks;
     // The works whose input buffers are sent to |mDecoder|. The key is the
     // bitstream ID of work's input buffer.
     std::map<int32_t, std::unique_ptr<C2Work>> mWorksAtDecoder;
+    // The timestamp, frame index and bitstream ID of the works in |mWorksAtDecoder| that might
+    // contain a no-show frame, ordered by timestamp. Only used for VP8, VP9 and AV1. Entries of
+    // works that were reported or got their output frame are only removed once an output frame
+    // with a later timestamp is returned.
+    std::set<std::tuple<uint64_t, uint64_t, int32_t>> mNoShowFrameCandidates;
     // The bitstream ID of the works that output frames have been returned from |mDecoder|.
     // The order is display order.
     std::queue<int32_t> mOutputBitstreamIds;
+    // The finished works not reported to the listener yet. Reporting works crosses into the
+    // client's process, so the works finished during a decoder task are reported together by a
+    // task posted after it, unless |kMaxBatchedWorks| works are pending or in low-latency mode.
+    std::list<std::unique_ptr<C2Work>> mFinishedWorks;
+    bool mFlushFinishedWorksScheduled = false;
+    // The block pool output blocks are fetched from, only set when using C2VdaPooledBlockPool. The
+    // pool is notified when the output buffers we created are destroyed.
+    std::weak_ptr<C2VdaPooledBlockPool> mPooledBlockPool;
 
     // Set to true when decoding the protected playback.
     bool mIsSecure = false;
+    // Set to true when the client requested low-latency decoding on start.
+    bool mLowLatencyMode = false;
+    // Whether the decoder is created asynchronously after start() returned.
+    bool mAsyncStart = false;
     // The component state.
     std::atomic<ComponentState> mComponentState{ComponentState::STOPPED};
+    // Whether decode errors flagged by the device are recovered from by resyncing the decoder at
+    // the next key frame instead of reporting an error, enabled using the
+    // "ro.vendor.v4l2_codec2.decode_error_resilience" property (default: false).
+    bool mDecodeErrorResilience = false;
+    // Set when resyncDecoder() is scheduled.
+    bool mResyncScheduled = false;
+    // Set while input is dropped until the next key frame after resyncing the decoder.
+    bool mWaitingForKeyFrame = false;
+    // The time without input after which |mDecoder| is released, zero if idle release is
+    // disabled using the "ro.vendor.v4l2_codec2.idle_release_ms" property (default: 0). Releasing
+    // the decoder frees the device and its buffers, and the hardware capacity of the session. The
+    // decoder is re-created when input is queued again.
+    ::base::TimeDelta mIdleReleaseDelay;
+    // The time the last work was queued.
+    ::base::TimeTicks mLastInputTime;
+    bool mIdleReleaseScheduled = false;
+    // The observer releasing idle decoders under memory pressure, only set if idle release is
+    // enabled.
+    std::optional<MemoryPressureMonitor::ObserverId> mMemoryPressureObserverId;
+    // The codec config followed by the frames since the last key frame, decoded again to restore
+    // the reference frames of a decoder released while idle. Only recorded if idle release is
+    // enabled.
+    std::vector<std::vector<uint8_t>> mReprimeBitstream;
+    size_t mReprimeBitstreamSize = 0;
+    // The number of codec config buffers at the start of |mReprimeBitstream|.
+    size_t mNumReprimeCodecConfigs = 0;
+    // Whether |mReprimeBitstream| starts with a key frame, the decoder is only released if set.
+    bool mReprimeFromKeyFrame = false;
+    // The bitstream ID of the next buffer decoded to re-prime the decoder.
+    int32_t mNextReprimeBitstreamId = kFirstReprimeBitstreamId;
     // Whether we are currently draining the component. This is set when the component is processing
     // the drain request, and unset either after reportEOSWork() (EOS is outputted), or
     // reportAbandonedWorks() (drain is cancelled and works are abandoned).
@@ -134,6 +259,11 @@ private:
     bool mPendingColorAspectsChange = false;
     // The record of frame index to update color aspects. Details as above.
     uint64_t mPendingColorAspectsChangeFrameIndex;
+    // The HDR static metadata attached to decoded output buffers, null if unknown.
+    std::shared_ptr<C2StreamHdrStaticInfo::output> mHdrStaticInfo;
+    // The pixel format change to report with the next output buffer, set when the decoder switches
+    // between 8-bit and 10-bit output frames.
+    std::unique_ptr<C2Param> mPendingPixelFormatUpdate;
 
     // The device task runner and its sequence checker. We should interact with
     // |mDevice| on this.
@@ -12,6 +12,7 @@
 #include <ui/Size.h>
 #include <util/C2InterfaceHelper.h>
 
+#include <v4l2_codec2/common/V4L2ComponentParams.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 
 namespace android {
@@ -27,17 +28,40 @@ public:
     c2_status_t status() const { return mInitStatus; }
     C2BlockPool::local_id_t getBlockPoolId() const { return mOutputBlockPoolIds->m.values[0]; }
     std::optional<VideoCodec> getVideoCodec() const { return mVideoCodec; }
+    // Whether the client requested low-latency decoding, in which case the output frames are
+    // expected not to be reordered.
+    bool isLowLatencyMode() const { return mLowLatencyMode->value; }
+    // Get the size of the video, as configured by the client.
+    ui::Size getVideoSize() const { return ui::Size(mSize->width, mSize->height); }
+    // Get the framerate of the video, as configured by the client.
+    float getFramerate() const { return mFrameRate->value; }
 
     static uint32_t getOutputDelay(VideoCodec codec);
 
     size_t getInputBufferSize() const;
     c2_status_t queryColorAspects(
             std::shared_ptr<C2StreamColorAspectsInfo::output>* targetColorAspects);
+    // Query the HDR static metadata configured by the client, |targetHdrStaticInfo| is reset if
+    // the metadata is unknown.
+    c2_status_t queryHdrStaticInfo(
+            std::shared_ptr<C2StreamHdrStaticInfo::output>* targetHdrStaticInfo);
+    // Get the size the output frames should be scaled to, empty if scaling is disabled.
+    ui::Size getScaledOutputSize() const {
+        return ui::Size(mScaledOutputSize->width, mScaledOutputSize->height);
+    }
+    // Whether only key frames should be decoded, the mode can be changed while decoding.
+    bool isKeyFrameOnlyMode() const { return mKeyFrameOnly->value == C2_TRUE; }
+    // Whether the client requested real-time priority, a positive priority is best-effort.
+    bool isRealTimePriority() const { return mRealTimePriority->value <= 0; }
+    // Get the pixel format of the output frames as reported to the client.
+    uint32_t getPixelFormat() const { return mPixelFormat->value; }
 
 private:
     // Configurable parameter setters.
     static C2R ProfileLevelSetter(bool mayBlock, C2P<C2StreamProfileLevelInfo::input>& info);
     static C2R SizeSetter(bool mayBlock, C2P<C2StreamPictureSizeInfo::output>& videoSize);
+    static C2R ReorderingOutputDelaySetter(bool mayBlock, C2P<C2PortDelayTuning::output>& me,
+                                           const C2P<C2GlobalLowLatencyModeTuning>& lowLatencyMode);
     static C2R MaxInputBufferSizeCalculator(bool mayBlock,
                                             C2P<C2StreamMaxBufferSizeInfo::input>& me,
                                             const C2P<C2StreamPictureSizeInfo::output>& size);
@@ -45,6 +69,8 @@ private:
     template <typename T>
     static C2R DefaultColorAspectsSetter(bool mayBlock, C2P<T>& def);
 
+    static C2R HdrStaticInfoSetter(bool mayBlock, C2P<C2StreamHdrStaticInfo::output>& me);
+
     static C2R MergedColorAspectsSetter(bool mayBlock,
                                         C2P<C2StreamColorAspectsInfo::output>& merged,
                                         const C2P<C2StreamColorAspectsTuning::output>& def,
@@ -58,14 +84,21 @@ private:
     std::shared_ptr<C2StreamUsageTuning::input> mInputMemoryUsage;
     // The output format kind; should be C2FormatVideo.
     std::shared_ptr<C2StreamBufferTypeSetting::output> mOutputFormat;
+    // The pixel format of the output frames, either YCBCR_420_888 or YCBCR_P010 for 10-bit streams.
+    std::shared_ptr<C2StreamPixelFormatInfo::output> mPixelFormat;
     // The MIME type of input port.
     std::shared_ptr<C2PortMediaTypeSetting::input> mInputMediaType;
     // The MIME type of output port; should be MEDIA_MIMETYPE_VIDEO_RAW.
     std::shared_ptr<C2PortMediaTypeSetting::output> mOutputMediaType;
     // The number of additional output frames that might need to be generated before an output
     // buffer can be released by the component; only used for H264 because H264 may reorder the
-    // output frames.
+    // output frames, and set to 0 in low-latency mode.
     std::shared_ptr<C2PortDelayTuning::output> mOutputDelay;
+    // Whether low-latency decoding is requested. The output delay is reduced to 0 in low-latency
+    // mode, as the client guarantees the output frames are not reordered.
+    std::shared_ptr<C2GlobalLowLatencyModeTuning> mLowLatencyMode;
+    // The priority of the session, used to select the scheduling priority of its threads.
+    std::shared_ptr<C2RealTimePriorityTuning> mRealTimePriority;
     // The input codec profile and level. For now configuring this parameter is useless since
     // the component always uses fixed codec profile to initialize accelerator. It is only used
     // for the client to query supported profile and level values.
@@ -73,6 +106,12 @@ private:
     std::shared_ptr<C2StreamProfileLevelInfo::input> mProfileLevel;
     // Decoded video size for output.
     std::shared_ptr<C2StreamPictureSizeInfo::output> mSize;
+    // The size decoded frames are scaled to by the device, zero if scaling is disabled.
+    std::shared_ptr<C2StreamV4L2ScaledOutputSizeTuning::output> mScaledOutputSize;
+    // Whether non-key frames are dropped before they are sent to the device.
+    std::shared_ptr<C2StreamV4L2KeyFrameOnlyTuning::input> mKeyFrameOnly;
+    // The framerate of the coded video, used to estimate the load of the session.
+    std::shared_ptr<C2StreamFrameRateInfo::input> mFrameRate;
     // Maximum size of one input buffer.
     std::shared_ptr<C2StreamMaxBufferSizeInfo::input> mMaxInputSize;
     // The suggested usage of input buffer allocator ID.
@@ -93,6 +132,9 @@ private:
     // former has higher priority. This parameter is used for component to provide color aspects
     // as C2Info in decoded output buffers.
     std::shared_ptr<C2StreamColorAspectsInfo::output> mColorAspects;
+    // The HDR static metadata of the stream, configured by the client and provided as C2Info in
+    // decoded output buffers.
+    std::shared_ptr<C2StreamHdrStaticInfo::output> mHdrStaticInfo;
 
     c2_status_t mInitStatus;
     std::optional<VideoCodec> mVideoCodec;
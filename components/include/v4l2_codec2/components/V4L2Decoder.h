@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 
+#include <chrono>
 #include <memory>
 #include <optional>
 
@@ -20,18 +21,25 @@
 #include <v4l2_codec2/components/VideoDecoder.h>
 #include <v4l2_codec2/components/VideoFrame.h>
 #include <v4l2_codec2/components/VideoFramePool.h>
+#include <v4l2_codec2/plugin_store/DmabufHelpers.h>
 
 namespace android {
 
 class V4L2Decoder : public VideoDecoder {
 public:
     static std::unique_ptr<VideoDecoder> Create(
-            const VideoCodec& codec, const size_t inputBufferSize, const size_t minNumOutputBuffers,
-            GetPoolCB getPoolCB, OutputCB outputCb, ErrorCB errorCb,
-            scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+            const VideoCodec& codec, const size_t inputBufferSize, bool lowLatency,
+            const ui::Size& scaledOutputSize, GetPoolCB getPoolCB,
+            IsCompressedOutputAllowedCB isCompressedOutputAllowedCb, OutputCB outputCb,
+            ErrorCB errorCb, scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+            scoped_refptr<V4L2Device> device);
+    // Open a decoder device for |codec| in advance, which can be passed to Create() later.
+    static scoped_refptr<V4L2Device> OpenDevice(const VideoCodec& codec);
     ~V4L2Decoder() override;
 
     void decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb) override;
+    void decodeBuffers(std::vector<std::unique_ptr<ConstBitstreamBuffer>> buffers,
+                       BufferDecodeCB bufferCb) override;
     void drain(DecodeCB drainCb) override;
     void flush() override;
 
@@ -55,16 +63,31 @@ private:
     };
 
     V4L2Decoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner);
-    bool start(const VideoCodec& codec, const size_t inputBufferSize,
-               const size_t minNumOutputBuffers, GetPoolCB getPoolCb, OutputCB outputCb,
-               ErrorCB errorCb);
+    bool start(const VideoCodec& codec, const size_t inputBufferSize, bool lowLatency,
+               const ui::Size& scaledOutputSize, GetPoolCB getPoolCb,
+               IsCompressedOutputAllowedCB isCompressedOutputAllowedCb, OutputCB outputCb,
+               ErrorCB errorCb, scoped_refptr<V4L2Device> device);
     bool setupInputFormat(const uint32_t inputPixelFormat, const size_t inputBufferSize);
+    // Configure the device to output decoded frames as soon as possible, if supported.
+    void setupLowLatencyMode();
     void pumpDecodeRequest();
 
     void serviceDeviceTask(bool event);
     bool dequeueResolutionChangeEvent();
     bool changeResolution();
-    bool setupOutputFormat(const ui::Size& size);
+    // Check whether the current output buffers can be reused for frames of |codedSize|, which
+    // requires |numOutputBuffers| buffers. On success the output queue still uses the current
+    // buffer layout.
+    bool canReuseOutputBuffers(const ui::Size& codedSize, size_t numOutputBuffers);
+    // Set the output queue's format for frames of |size|, using a format of the same bit depth as
+    // the |streamFourcc| selected by the device. Vendor compressed formats are preferred if
+    // |allowCompressed| is set, the matching gralloc format is stored in |mOutputPixelFormat|.
+    bool setupOutputFormat(const ui::Size& size, uint32_t streamFourcc, bool allowCompressed);
+    // Ask the device to scale frames of |size| to |mScaledOutputSize| and shrink the output
+    // buffers of format |fourcc| accordingly. Only devices with a scaler on the CAPTURE queue
+    // support this. Returns whether the output is scaled, the output queue uses buffers of |size|
+    // otherwise.
+    bool setupScaledOutput(uint32_t fourcc, const ui::Size& size);
 
     void tryFetchVideoFrame();
     void onVideoFrameReady(std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId);
@@ -86,22 +109,42 @@ private:
     std::queue<DecodeRequest> mDecodeRequests;
     std::map<int32_t, DecodeCB> mPendingDecodeCbs;
 
-    size_t mMinNumOutputBuffers = 0;
     GetPoolCB mGetPoolCb;
+    IsCompressedOutputAllowedCB mIsCompressedOutputAllowedCb;
     OutputCB mOutputCb;
     DecodeCB mDrainCb;
     ErrorCB mErrorCb;
 
+    // The size output frames are scaled to, empty if scaling is disabled.
+    ui::Size mScaledOutputSize;
+    // The coded size of the allocated output buffers, which might be larger than the coded size
+    // of the stream if the buffers were reused after a resolution change.
     ui::Size mCodedSize;
     Rect mVisibleRect;
+    // The output queue's format the output buffers were allocated for.
+    std::optional<struct v4l2_format> mOutputFormat;
+    // The pixel format of the graphic buffers matching the output queue's format.
+    HalPixelFormat mOutputPixelFormat = HalPixelFormat::YCBCR_420_888;
 
     std::map<size_t, std::unique_ptr<VideoFrame>> mFrameAtDevice;
+    // The time the last video frame was requested from |mVideoFramePool|.
+    std::chrono::steady_clock::time_point mFetchStartTime;
 
     // Block IDs can be arbitrarily large, but we only have a limited number of
     // buffers. This maintains an association between a block ID and a specific
     // V4L2 buffer index.
     std::map<size_t, size_t> mBlockIdToV4L2Id;
 
+    // Whether the CAPTURE queue keeps streaming when flushing, which can be disabled using the
+    // "ro.vendor.v4l2_codec2.decode_keep_capture_on_flush" property for devices that don't
+    // support this.
+    bool mKeepCaptureOnFlush = true;
+    // The bitstream id of the last input buffer queued to the device.
+    std::optional<int32_t> mLastQueuedBitstreamId;
+    // The last bitstream id queued before the most recent flush that kept the CAPTURE queue
+    // streaming. Output frames up to this id are dropped.
+    std::optional<int32_t> mLastFlushedBitstreamId;
+
     State mState = State::Idle;
 
     scoped_refptr<::base::SequencedTaskRunner> mTaskRunner;
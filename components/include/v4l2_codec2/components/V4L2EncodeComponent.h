@@ -6,9 +6,15 @@
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODE_COMPONENT_H
 
 #include <atomic>
+#include <deque>
+#include <list>
 #include <memory>
 #include <optional>
+#include <queue>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <C2Component.h>
 #include <C2ComponentFactory.h>
@@ -21,25 +27,39 @@
 #include <base/single_thread_task_runner.h>
 #include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
+#include <ui/Size.h>
 #include <util/C2InterfaceHelper.h>
 
+#include <v4l2_codec2/common/V4L2AdmissionController.h>
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/components/VideoEncoder.h>
+
 namespace android {
 
 struct BitstreamBuffer;
 class FormatConverter;
-class VideoEncoder;
+class LatencyTracker;
+class MemoryTracker;
 class V4L2EncodeInterface;
+class WorkRecorder;
 
 class V4L2EncodeComponent : public C2Component,
                             public std::enable_shared_from_this<V4L2EncodeComponent> {
 public:
-    // Create a new instance of the V4L2EncodeComponent.
+    // Create a new instance of the V4L2EncodeComponent. A |pooled| component is kept idle in the
+    // warm pool of V4L2ComponentFactory: it doesn't reserve any hardware capacity until admit() is
+    // called, but opens its device in advance.
     static std::shared_ptr<C2Component> create(C2String name, c2_node_id_t id,
                                                std::shared_ptr<C2ReflectorHelper> helper,
-                                               C2ComponentFactory::ComponentDeleter deleter);
+                                               C2ComponentFactory::ComponentDeleter deleter,
+                                               bool pooled);
 
     virtual ~V4L2EncodeComponent() override;
 
+    // Reserve hardware capacity for a component created for the warm pool, before handing it out.
+    // Returns false if the admission controller rejects the session.
+    bool admit();
+
     // Implementation of the C2Component interface.
     c2_status_t start() override;
     c2_status_t stop() override;
@@ -64,12 +84,14 @@ private:
     };
 
     V4L2EncodeComponent(C2String name, c2_node_id_t id,
-                        std::shared_ptr<V4L2EncodeInterface> interface);
+                        std::shared_ptr<V4L2EncodeInterface> interface,
+                        std::unique_ptr<V4L2AdmissionController::Session> admissionSession);
 
     V4L2EncodeComponent(const V4L2EncodeComponent&) = delete;
     V4L2EncodeComponent& operator=(const V4L2EncodeComponent&) = delete;
 
-    // Initialize the encoder on the encoder thread.
+    // Initialize the encoder on the encoder thread. The result is returned through |success| and
+    // |done| is signaled, unless |done| is null when starting asynchronously.
     void startTask(bool* success, ::base::WaitableEvent* done);
     // Destroy the encoder on the encoder thread.
     void stopTask(::base::WaitableEvent* done);
@@ -90,13 +112,38 @@ private:
     // Initialize the V4L2 device for encoding with the requested configuration.
     bool initializeEncoder();
     // Update the |mBitrate| and |mFramerate| currently configured on the V4L2 device, to match the
-    // values requested by the codec 2.0 framework.
+    // values requested by the codec 2.0 framework. Nothing is done if the interface parameters
+    // didn't change since they were last applied.
     bool updateEncodingParameters();
+    // Start changing the encoder's resolution to the input size requested by the client, draining
+    // the encoder first if frames are still being encoded.
+    void startResolutionChange();
+    // Change the encoder's resolution once it has been drained, and resume queueing work.
+    void completeResolutionChange();
 
     // Schedule the next encode operation on the V4L2 device.
     void scheduleNextEncodeTask();
-    // Encode the specified |block| with corresponding |index| and |timestamp|.
-    bool encode(C2ConstGraphicBlock block, uint64_t index, int64_t timestamp);
+    // Check whether the input frame |block| with specified |timestamp| is unchanged since the last
+    // frame encoded, in which case it can be skipped.
+    bool isStaticFrame(const C2ConstGraphicBlock& block, int64_t timestamp);
+    // Estimate the input rate from the frame |timestamp| and the previous frame timestamps, and
+    // reconfigure the device's framerate if it changed significantly.
+    bool adaptFramerate(int64_t timestamp);
+    // Encode the specified |block| with corresponding |index| and |timestamp|, applying the QP
+    // offsets of the |qpOffsetRects| regions of interest.
+    bool encode(C2ConstGraphicBlock block, uint64_t index, int64_t timestamp,
+                std::vector<VideoEncoder::QpOffsetRect> qpOffsetRects);
+    // Get the regions of interest of the frame of |work|. Regions attached to the work item take
+    // precedence over the regions configured on the interface. The regions are scaled along with
+    // the input frames.
+    std::vector<VideoEncoder::QpOffsetRect> getQpOffsetRects(const C2Work& work);
+    // Get the size frames of |inputSize| are encoded at, which is the scaled output size requested
+    // by the client if it doesn't exceed the input size.
+    ui::Size getEncodedSize(const ui::Size& inputSize) const;
+    // Create an input frame from the specified graphic |block|, using the cached layout if the
+    // block's buffer was seen before.
+    std::unique_ptr<VideoEncoder::InputFrame> createInputFrame(const C2ConstGraphicBlock& block,
+                                                               uint64_t index, int64_t timestamp);
     // Flush the encoder.
     void flush();
 
@@ -111,12 +158,29 @@ private:
 
     // Helper function to find a work item in the output work queue by index.
     C2Work* getWorkByIndex(uint64_t index);
-    // Helper function to find a work item in the output work queue by timestamp.
+    // Helper function to find a work item in the output work queue by timestamp. If multiple work
+    // items share the timestamp, the oldest one without output is returned.
     C2Work* getWorkByTimestamp(int64_t timestamp);
+    // Helper function to find the oldest work item in the output work queue still waiting for its
+    // output buffer.
+    C2Work* getNextWorkWithoutOutput();
+    // Add the specified |work| item to the back of the output work queue and index it.
+    void pushWork(std::unique_ptr<C2Work> work);
+    // Remove the work item at the front of the output work queue and its index entries.
+    std::unique_ptr<C2Work> popFrontWork();
     // Helper function to determine if the specified |work| item is finished.
     bool isWorkDone(const C2Work& work) const;
     // Notify the listener the specified |work| item is finished.
     void reportWork(std::unique_ptr<C2Work> work);
+    // Notify the listener of a part of the output of the specified |work| item. The |buffer| and
+    // optional |configUpdate| are reported in a separate work item flagged as incomplete.
+    void reportPartialWork(const C2Work& work, std::shared_ptr<C2Buffer> buffer,
+                           std::unique_ptr<C2Param> configUpdate);
+    // Queue |work| in |mFinishedWorks|, which are reported together once the current task is done.
+    void queueFinishedWork(std::unique_ptr<C2Work> work);
+    // Report all works in |mFinishedWorks| to the listener in a single call.
+    void flushFinishedWorks();
+    void flushFinishedWorksTask();
 
     // Configure the c2 block pool that will be used to create output buffers.
     bool getBlockPool();
@@ -132,14 +196,27 @@ private:
     // The underlying V4L2 encoder.
     std::unique_ptr<VideoEncoder> mEncoder;
 
-    // The number of concurrent encoder instances currently created.
-    static std::atomic<int32_t> sConcurrentInstances;
     // The component's registered name.
     const C2String mName;
     // The component's id, provided by the C2 framework upon initialization.
     const c2_node_id_t mId = 0;
     // The component's interface implementation.
     const std::shared_ptr<V4L2EncodeInterface> mInterface;
+    // The session admitted by the admission controller, used to reserve the hardware capacity
+    // needed while the component is running. Only null while the component is in the warm pool.
+    std::unique_ptr<V4L2AdmissionController::Session> mAdmissionSession;
+    // The device opened in advance while the component was in the warm pool, used by the first
+    // encoder created.
+    scoped_refptr<V4L2Device> mPrewarmedDevice;
+    // The name of the trace counter used to publish the number of work items in flight.
+    const std::string mInFlightCounterName;
+    // Records the time work items spend in each stage of the encode pipeline, shared with
+    // |mEncoder|.
+    const std::shared_ptr<LatencyTracker> mLatencyTracker;
+    // Accounts the buffer memory pinned by this component, shared with the format convertor.
+    const std::shared_ptr<MemoryTracker> mMemoryTracker;
+    // Records the traffic queued by the client if enabled, see WorkRecorder.
+    const std::unique_ptr<WorkRecorder> mRecorder;
 
     // Mutex used by the component to synchronize start/stop/reset/release calls, as the codec 2.0
     // API can be accessed from any thread.
@@ -147,26 +224,92 @@ private:
 
     // The component's listener to be notified when events occur, only accessed on encoder thread.
     std::shared_ptr<Listener> mListener;
-
-    // The queue of encode work items waiting for free buffers in the input convertor.
+    // The finished (and partial) work items not reported to the listener yet. Reporting work items
+    // crosses into the client's process, so the items finished during an encoder task are reported
+    // together by a task posted after it, unless |kMaxBatchedWorks| items are pending or in
+    // low-latency mode.
+    std::list<std::unique_ptr<C2Work>> mFinishedWorks;
+    bool mFlushFinishedWorksScheduled = false;
+    // Whether low-latency encoding was requested on start.
+    bool mLowLatencyMode = false;
+
+    // The queue of encode work items waiting for free buffers in the input convertor, or for a
+    // resolution change to complete.
     std::queue<std::unique_ptr<C2Work>> mInputConverterQueue;
     // An input format convertor will be used if the device doesn't support the video's format.
     std::unique_ptr<FormatConverter> mInputFormatConverter;
 
+    // The layout of an input buffer, determined the first time the buffer is encoded.
+    struct InputLayout {
+        uint32_t width;
+        uint32_t height;
+        VideoPixelFormat format;
+        std::vector<VideoFramePlane> planes;
+    };
+    // The layouts of the input buffers seen so far, indexed by dmabuf id. Input buffers are
+    // typically recycled by the producer, so this avoids locking each input block to derive its
+    // layout again.
+    std::unordered_map<uint32_t, InputLayout> mInputLayouts;
+
+    // The input size and stride the encoder is currently configured for. Input frames are scaled
+    // to the encoder's visible size, if different.
+    ui::Size mVisibleSize;
+    uint32_t mInputStride = 0;
+    // The number of buffers on each of the encoder's device queues.
+    size_t mQueueDepth = 0;
+    // The input size requested by the client while changing the encoder's resolution.
+    std::optional<ui::Size> mPendingVisibleSize;
+
     // The bitrate currently configured on the v4l2 device.
     uint32_t mBitrate = 0;
     // The bitrate mode currently configured on the v4l2 device.
     C2Config::bitrate_mode_t mBitrateMode = C2Config::BITRATE_CONST;
     // The framerate currently configured on the v4l2 device.
     uint32_t mFramerate = 0;
+    // The number of temporal layers requested when starting the encoder, zero or one if temporal
+    // layering is disabled.
+    uint32_t mNumTemporalLayers = 0;
+    // The number of long-term reference slots requested when starting the encoder.
+    uint32_t mNumLongTermRefs = 0;
+    // The number of consecutive B-frames produced by the encoder, zero if B-frames are disabled.
+    uint32_t mNumBFrames = 0;
+    // The highest timestamp of the frames output so far. Frames output after a frame with a
+    // higher timestamp are B-frames.
+    std::optional<int64_t> mMaxOutputTimestamp;
+    // The bitrate of each temporal layer currently configured on the v4l2 device.
+    std::vector<uint32_t> mTemporalLayerBitrates;
+    // The quality level and QP range last requested from the v4l2 device, in constant quality mode
+    // and when restricting the QPs respectively.
+    std::optional<uint32_t> mQuality;
+    std::optional<std::pair<uint32_t, uint32_t>> mQpRange;
+    // The generation of the interface parameters last applied to the v4l2 device, nullopt if the
+    // parameters need to be applied with the next frame.
+    std::optional<uint64_t> mAppliedParamsGeneration;
     // The timestamp of the last frame encoded, used to dynamically adjust the framerate.
     std::optional<int64_t> mLastFrameTime;
+    // Whether the framerate configured on the v4l2 device follows the input rate estimated from
+    // the frame timestamps, and the smoothed interval between frames the rate is estimated from.
+    bool mAdaptiveFramerate = false;
+    std::optional<double> mFrameIntervalUs;
+    // Whether unchanged input frames are skipped, and the hash and timestamp of the last frame
+    // encoded to detect them.
+    bool mSkipStaticFrames = false;
+    std::optional<uint64_t> mLastFrameHash;
+    std::optional<int64_t> mLastEncodedFrameTime;
 
     // Whether we need to extract and submit CSD (codec-specific data, e.g. H.264 SPS).
     bool mExtractCSD = false;
 
-    // The queue of encode work items currently being processed.
+    // The queue of encode work items currently being processed, in report order. Work items should
+    // only be added and removed using pushWork() and popFrontWork(), to keep the indices below in
+    // sync.
     std::deque<std::unique_ptr<C2Work>> mWorkQueue;
+    // Work items in |mWorkQueue| indexed by frame index and by timestamp, for O(1) lookups. The
+    // client might queue multiple work items with the same timestamp.
+    std::unordered_map<uint64_t, C2Work*> mWorkByIndex;
+    std::unordered_multimap<int64_t, C2Work*> mWorkByTimestamp;
+    // Work items in |mWorkQueue| marked as EOS for which draining hasn't completed yet, in order.
+    std::queue<C2Work*> mEOSWorks;
 
     // The output block pool.
     std::shared_ptr<C2BlockPool> mOutputBlockPool;
@@ -5,7 +5,10 @@
 #ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODE_INTERFACE_H
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODE_INTERFACE_H
 
+#include <atomic>
+#include <memory>
 #include <optional>
+#include <utility>
 #include <vector>
 
 #include <C2.h>
@@ -15,6 +18,8 @@
 #include <util/C2InterfaceHelper.h>
 
 #include <v4l2_codec2/common/EncodeHelpers.h>
+#include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/common/V4L2ComponentParams.h>
 
 namespace media {
 class V4L2Device;
@@ -32,26 +37,70 @@ public:
     // Note: these getters are not thread-safe. For dynamic parameters, component should use
     // formal query API for C2ComponentInterface instead.
     c2_status_t status() const { return mInitStatus; }
+    std::optional<VideoCodec> getVideoCodec() const { return mVideoCodec; }
     const char* getOutputMediaType() const { return mOutputMediaType->m.value; }
     C2Config::profile_t getOutputProfile() const { return mProfileLevel->profile; }
     C2Config::level_t getOutputLevel() const { return mProfileLevel->level; }
     const ui::Size getInputVisibleSize() const {
         return ui::Size(mInputVisibleSize->width, mInputVisibleSize->height);
     }
+    // Get the size input frames are scaled to before they are encoded, zero if no scaling was
+    // requested.
+    ui::Size getScaledOutputSize() const {
+        return ui::Size(mScaledOutputSize->width, mScaledOutputSize->height);
+    }
     C2BlockPool::local_id_t getBlockPoolId() const { return mOutputBlockPoolIds->m.values[0]; }
 
     // Get sync key-frame period in frames.
     uint32_t getKeyFramePeriod() const;
+    // Get the requested intra refresh period in frames, zero if intra refresh is disabled.
+    uint32_t getIntraRefreshPeriod() const;
     // Get the requested bitrate mode.
     C2Config::bitrate_mode_t getBitrateMode() const { return mBitrateMode->value; }
     // Get the requested bitrate.
     uint32_t getBitrate() const { return mBitrate->value; }
+    // Get the requested quality level (0-100), used if the bitrate mode is BITRATE_IGNORE.
+    uint32_t getQuality() const { return mQuality->value; }
+    // Get the range of QPs the rate controller is restricted to, nullopt if not restricted.
+    std::optional<std::pair<uint32_t, uint32_t>> getQpRange() const;
     // Get the requested framerate.
     float getFramerate() const { return mFrameRate->value; }
+    // Whether the client requested low-latency encoding.
+    bool isLowLatencyMode() const { return mLowLatencyMode->value; }
+    // Whether the client requested real-time priority, a positive priority is best-effort.
+    bool isRealTimePriority() const { return mRealTimePriority->value <= 0; }
+    // Get the requested number of temporal layers. Zero or one if temporal layering is disabled.
+    uint32_t getTemporalLayerCount() const {
+        return mTemporalLayering ? mTemporalLayering->m.layerCount : 0;
+    }
+    // Get the requested ratios of the bitrate used by the temporal layers up to and including each
+    // layer. The ratio of the top layer is omitted, as it's always 1.
+    std::vector<float> getTemporalLayerBitrateRatios() const;
+    // Get the requested number of consecutive B-frames, zero if B-frames are disabled.
+    uint32_t getBFrameCount() const;
+    // Get the requested number of long-term reference slots, zero if disabled.
+    uint32_t getLongTermReferenceCount() const {
+        return mLongTermReferenceCount ? mLongTermReferenceCount->value : 0;
+    }
 
     // Request changing the framerate to the specified value.
     void setFramerate(uint32_t framerate) { mFrameRate->value = framerate; }
 
+    // Configure |params| as requested by the client, see C2InterfaceHelper::config(). The
+    // parameter generation is incremented, so the component notices the change.
+    c2_status_t config(const std::vector<C2Param*>& params, c2_blocking_t mayBlock,
+                       std::vector<std::unique_ptr<C2SettingResult>>* const failures,
+                       bool updateParams = true,
+                       std::vector<std::shared_ptr<C2Param>>* changes = nullptr);
+    // Reset the switch-type request |params| (e.g. key frame requests) once the component handled
+    // them. Unlike config() this doesn't increment the parameter generation.
+    c2_status_t resetRequests(const std::vector<C2Param*>& params);
+    // Get the parameter generation, incremented each time the client configures parameters. The
+    // dynamic parameters only need to be queried again when the generation changed. Thread-safe.
+    uint64_t getParamsGeneration() const {
+        return mParamsGeneration.load(std::memory_order_acquire);
+    }
+
 protected:
     void Initialize(const C2String& name);
 
@@ -64,12 +113,19 @@ protected:
                                      const C2P<C2StreamPictureSizeInfo::input>& videosize,
                                      const C2P<C2StreamFrameRateInfo::output>& frameRate,
                                      const C2P<C2StreamBitrateInfo::output>& bitrate);
+    static C2R HEVCProfileLevelSetter(bool mayBlock, C2P<C2StreamProfileLevelInfo::output>& info,
+                                      const C2P<C2StreamPictureSizeInfo::input>& videosize,
+                                      const C2P<C2StreamFrameRateInfo::output>& frameRate,
+                                      const C2P<C2StreamBitrateInfo::output>& bitrate);
 
     static C2R SizeSetter(bool mayBlock, C2P<C2StreamPictureSizeInfo::input>& videoSize);
 
     static C2R IntraRefreshPeriodSetter(bool mayBlock,
                                         C2P<C2StreamIntraRefreshTuning::output>& period);
 
+    static C2R TemporalLayeringSetter(bool mayBlock,
+                                      C2P<C2StreamTemporalLayeringTuning::output>& layering);
+
     // Constant parameters
 
     // The kind of the component; should be C2Component::KIND_ENCODER.
@@ -94,29 +150,65 @@ protected:
 
     // The visible size for input raw video.
     std::shared_ptr<C2StreamPictureSizeInfo::input> mInputVisibleSize;
+    // The size input frames are scaled to before they are encoded, zero to encode frames at the
+    // input size.
+    std::shared_ptr<C2StreamV4L2ScaledOutputSizeTuning::output> mScaledOutputSize;
     // The output codec profile and level.
     std::shared_ptr<C2StreamProfileLevelInfo::output> mProfileLevel;
     // The expected period for key frames in microseconds.
     std::shared_ptr<C2StreamSyncFrameIntervalTuning::output> mKeyFramePeriodUs;
     // Component uses this ID to fetch corresponding output block pool from platform.
     std::shared_ptr<C2PortBlockPoolsTuning::output> mOutputBlockPoolIds;
+    // Whether low-latency encoding is requested. In low-latency mode each frame is submitted to the
+    // device as soon as it's queued and the rate control buffer is kept small.
+    std::shared_ptr<C2GlobalLowLatencyModeTuning> mLowLatencyMode;
+    // The priority of the session, used to select the scheduling priority of its threads.
+    std::shared_ptr<C2RealTimePriorityTuning> mRealTimePriority;
 
     // Dynamic parameters
 
     // The requested bitrate of the encoded output stream, in bits per second.
     std::shared_ptr<C2StreamBitrateInfo::output> mBitrate;
-    // The requested bitrate mode.
+    // The requested bitrate mode. BITRATE_IGNORE selects constant quality mode.
     std::shared_ptr<C2StreamBitrateModeTuning::output> mBitrateMode;
+    // The quality level targeted in constant quality mode.
+    std::shared_ptr<C2StreamQualityTuning::output> mQuality;
+    // The QP range requested for each picture type, used to cap the quality variations with
+    // variable bitrate and constant quality modes.
+    std::shared_ptr<C2StreamPictureQuantizationTuning::output> mPictureQuantization;
     // The requested framerate, in frames per second.
     std::shared_ptr<C2StreamFrameRateInfo::output> mFrameRate;
     // The switch-type parameter that will be set to true while client requests keyframe. It
     // will be reset once encoder gets the request.
     std::shared_ptr<C2StreamRequestSyncFrameTuning::output> mRequestKeyFrame;
-    // The intra-frame refresh period. This is unused for the component now.
-    // TODO: adapt intra refresh period to encoder.
+    // The intra-frame refresh period. When enabled, periodic key frames are replaced by cyclic
+    // intra refresh if the device supports it. Only applied when the encoder is started.
     std::shared_ptr<C2StreamIntraRefreshTuning::output> mIntraRefreshPeriod;
+    // The requested temporal layering, only supported by the H.264 and HEVC encoders. The base
+    // layer is encoded as P-frames referencing only other base layer frames, frames of enhancement
+    // layers reference frames of lower layers only.
+    std::shared_ptr<C2StreamTemporalLayeringTuning::output> mTemporalLayering;
+    // The requested GOP structure, only supported by the H.264 and HEVC encoders. Only the number
+    // of consecutive B-frames is used, the key frame period is configured separately.
+    std::shared_ptr<C2StreamGopTuning::output> mGop;
+    // The number of long-term reference slots, only supported by the H.264 and HEVC encoders.
+    std::shared_ptr<C2StreamV4L2LongTermReferenceCountTuning::output> mLongTermReferenceCount;
+    // The switch-type parameters used to mark the next frame as long-term reference and to only
+    // predict the next frame from the specified long-term references. These will be reset once
+    // the encoder gets the request.
+    std::shared_ptr<C2StreamV4L2MarkLongTermReferenceTuning::output> mMarkLongTermReference;
+    std::shared_ptr<C2StreamV4L2UseLongTermReferencesTuning::output> mUseLongTermReferences;
+    // The regions of interest encoded with a QP offset, explicitly set on the interface rather
+    // than attached to a single work item.
+    std::shared_ptr<C2StreamV4L2RoiRectsInfo::output> mRoiRects;
+
+    // The codec of the component, determined from its name.
+    std::optional<VideoCodec> mVideoCodec;
 
     c2_status_t mInitStatus = C2_NO_INIT;
+
+    // The parameter generation, see getParamsGeneration().
+    std::atomic<uint64_t> mParamsGeneration{0};
 };
 
 }  // namespace android
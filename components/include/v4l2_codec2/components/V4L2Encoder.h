@@ -6,6 +6,8 @@
 #define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_ENCODER_H
 
 #include <stdint.h>
+#include <algorithm>
+#include <map>
 #include <memory>
 #include <optional>
 #include <queue>
@@ -13,6 +15,7 @@
 
 #include <base/memory/weak_ptr.h>
 #include <base/sequenced_task_runner.h>
+#include <base/time/time.h>
 #include <ui/Size.h>
 
 #include <v4l2_codec2/common/Common.h>
@@ -27,17 +30,24 @@ class V4L2Queue;
 
 class V4L2Encoder : public VideoEncoder {
 public:
-    // Number of buffers on V4L2 device queues.
-    static constexpr size_t kInputBufferCount = 2;
-    static constexpr size_t kOutputBufferCount = 2;
+    // Get the number of buffers to use on the V4L2 device queues when encoding a stream with the
+    // specified |visibleSize| and |framerate|. Higher pixel rates require deeper queues to keep the
+    // device busy while the client returns buffers. The depth can be overridden using the
+    // "ro.vendor.v4l2_codec2.encode_queue_depth" property.
+    static size_t getQueueDepth(const ui::Size& visibleSize, float framerate);
 
     static std::unique_ptr<VideoEncoder> create(
             C2Config::profile_t profile, std::optional<uint8_t> level, const ui::Size& visibleSize,
             uint32_t stride, uint32_t keyFramePeriod, C2Config::bitrate_mode_t bitrateMode,
-            uint32_t bitrate, std::optional<uint32_t> peakBitrate,
-            FetchOutputBufferCB fetchOutputBufferCb, InputBufferDoneCB inputBufferDoneCb,
+            uint32_t bitrate, std::optional<uint32_t> peakBitrate, uint32_t numTemporalLayers,
+            uint32_t numLongTermRefs, uint32_t numBFrames, uint32_t intraRefreshPeriod,
+            size_t queueDepth, bool lowLatency, FetchOutputBufferCB fetchOutputBufferCb,
+            InputBufferDoneCB inputBufferDoneCb,
             OutputBufferDoneCB outputBufferDoneCb, DrainDoneCB drainDoneCb, ErrorCB errorCb,
-            scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+            scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+            scoped_refptr<V4L2Device> device);
+    // Open an encoder device for |profile| in advance, which can be passed to create() later.
+    static scoped_refptr<V4L2Device> openDevice(C2Config::profile_t profile);
     ~V4L2Encoder() override;
 
     bool encode(std::unique_ptr<InputFrame> frame) override;
@@ -46,12 +56,20 @@ public:
 
     bool setBitrate(uint32_t bitrate) override;
     bool setPeakBitrate(uint32_t peakBitrate) override;
+    bool setTemporalLayerBitrates(const std::vector<uint32_t>& bitrates) override;
+    bool setConstantQuality(uint32_t quality) override;
+    bool setQpRange(uint32_t minQp, uint32_t maxQp) override;
     bool setFramerate(uint32_t framerate) override;
     void requestKeyframe() override;
+    void markLongTermReference(uint32_t index) override;
+    void useLongTermReferences(uint32_t mask) override;
+    bool changeResolution(const ui::Size& visibleSize, uint32_t stride) override;
 
     VideoPixelFormat inputFormat() const override;
     const ui::Size& visibleSize() const override { return mVisibleSize; }
     const ui::Size& codedSize() const override { return mInputCodedSize; }
+    bool sliceOutput() const override { return mSliceOutput; }
+    uint32_t numBFrames() const override { return mNumBFrames; }
 
 private:
     // Possible encoder states.
@@ -76,18 +94,24 @@ private:
         bool end_of_stream = false;
     };
 
-    V4L2Encoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
-                FetchOutputBufferCB fetchOutputBufferCb, InputBufferDoneCB mInputBufferDoneCb,
+    V4L2Encoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner, size_t queueDepth,
+                bool lowLatency, FetchOutputBufferCB fetchOutputBufferCb,
+                InputBufferDoneCB mInputBufferDoneCb,
                 OutputBufferDoneCB mOutputBufferDoneCb, DrainDoneCB drainDoneCb, ErrorCB errorCb);
 
     // Initialize the V4L2 encoder for specified parameters.
     bool initialize(C2Config::profile_t outputProfile, std::optional<uint8_t> level,
                     const ui::Size& visibleSize, uint32_t stride, uint32_t keyFramePeriod,
                     C2Config::bitrate_mode_t bitrateMode, uint32_t bitrate,
-                    std::optional<uint32_t> peakBitrate);
+                    std::optional<uint32_t> peakBitrate, uint32_t numTemporalLayers,
+                    uint32_t numLongTermRefs, uint32_t numBFrames, uint32_t intraRefreshPeriod,
+                    scoped_refptr<V4L2Device> device);
 
     // Handle the next encode request on the queue.
     void handleEncodeRequest();
+    // Switch to the encoding state and handle the next encode request. In low-latency mode the
+    // request is handled immediately, otherwise a task is posted.
+    void resumeEncoding();
     // Handle a request to flush the encoder.
     void handleFlushRequest();
     // Handle a request to drain the encoder.
@@ -99,14 +123,48 @@ private:
     bool configureInputFormat(VideoPixelFormat inputFormat, uint32_t stride);
     // Configure output format on the V4L2 device.
     bool configureOutputFormat(C2Config::profile_t outputProfile);
+    // Use output blocks of at least |size| bytes from now on.
+    void growOutputBufferSize(size_t size);
+    // Get the highest bitrate configured, which the output buffers are sized for.
+    uint32_t getMaxBitrate() const { return std::max(mConfiguredBitrate, mConfiguredPeakBitrate); }
     // Configure required and optional controls on the V4L2 device.
     bool configureDevice(C2Config::profile_t outputProfile,
-                         std::optional<const uint8_t> outputH264Level);
+                         std::optional<const uint8_t> outputLevel);
+    // Configure the V4L2 device to return each slice as soon as it's encoded, if requested using
+    // the "ro.vendor.v4l2_codec2.encode_slices" property (number of slices per frame, default: 0).
+    void configureSliceOutput();
     // Configure required and optional H.264 controls on the V4L2 device.
     bool configureH264(C2Config::profile_t outputProfile,
                        std::optional<const uint8_t> outputH264Level);
+    // Configure required and optional HEVC controls on the V4L2 device.
+    bool configureHEVC(C2Config::profile_t outputProfile,
+                       std::optional<const uint8_t> outputHEVCLevel);
     // Configure the specified bitrate mode on the V4L2 device.
     bool configureBitrateMode(C2Config::bitrate_mode_t bitrateMode);
+    // Size the rate control buffer of the V4L2 device for the specified |bitrate|, only used in
+    // low-latency mode.
+    void configureRateControlBuffer(uint32_t bitrate);
+    // Configure hierarchical-P coding with the requested number of temporal layers on the V4L2
+    // device. Temporal layering is disabled if the device doesn't support it.
+    void configureTemporalLayers(C2Config::profile_t outputProfile);
+    // Configure the requested number of long-term reference slots on the V4L2 device. Long-term
+    // references are disabled if the device doesn't support them.
+    void configureLongTermReferences();
+    // Configure the requested number of consecutive B-frames on the V4L2 device. B-frames are
+    // disabled if the device doesn't support them, or if frames are split into slices.
+    void configureBFrames();
+    // Configure cyclic intra refresh on the V4L2 device, refreshing all macroblocks once every
+    // intra refresh period. Returns false if the device doesn't support intra refresh.
+    bool configureIntraRefresh();
+    // Apply the pending long-term reference requests to the next frame queued on the device.
+    void applyLongTermReferenceRequests(bool keyFrame);
+    // Configure the QP map control used to encode regions of interest with a QP offset, set using
+    // the "ro.vendor.v4l2_codec2.encode_qp_map_ctrl" property (control id, default: 0).
+    void configureQpMap();
+    // Apply the QP offsets of the regions of interest of |frame| through the QP map control.
+    void applyQpMap(const InputFrame& frame);
+    // Get the temporal layer of the frame |framesSinceKeyFrame| frames after the last key frame.
+    uint32_t getTemporalLayerId(uint32_t framesSinceKeyFrame) const;
 
     // Attempt to start the V4L2 device poller.
     bool startDevicePoll();
@@ -129,6 +187,15 @@ private:
     // Dequeue an output buffer containing the encoded bitstream from the device output queue.
     // Returns whether the operation was successful.
     bool dequeueOutputBuffer();
+    // Prepend the cached SPS and PPS to the IDR frame of |dataSize| bytes at |dataOffset| in
+    // |buffer| by copying the frame into a newly fetched output buffer. This is used if the SPS and
+    // PPS can't be injected in place. Returns whether the operation was successful.
+    bool prependSPSPPSByCopy(size_t dataOffset, size_t dataSize, int64_t timestamp, bool keyFrame,
+                             std::unique_ptr<BitstreamBuffer> buffer);
+    // Get the headroom to reserve at the front of output buffers for injecting SPS and PPS.
+    size_t getOutputHeadroom() const;
+    // Get the average QP of the last frame encoded by the device, if reported by the device.
+    std::optional<int32_t> getAverageQp();
 
     // Create input buffers on the V4L2 device input queue.
     bool createInputBuffers();
@@ -150,25 +217,88 @@ private:
     // The list of currently queued encode requests.
     std::queue<EncodeRequest> mEncodeRequests;
 
+    // The output profile the device was configured for.
+    C2Config::profile_t mOutputProfile = C2Config::PROFILE_UNUSED;
     // The video stream's visible size.
     ui::Size mVisibleSize;
     // The video stream's coded size.
     ui::Size mInputCodedSize;
     // The input layout configured on the V4L2 device.
     std::optional<VideoFrameLayout> mInputLayout;
-    // Required output buffer byte size.
+    // The plane sizes of the input frames, computed when the input format or the format of the
+    // frames changes.
+    VideoFramePlaneSizes mInputPlaneSizes;
+    // Required output buffer byte size. Initially based on the bitrate, it's increased when the
+    // bitrate increases or the device overflows an output buffer.
     uint32_t mOutputBufferSize = 0;
-
-    // How often we want to request the V4L2 device to create a key frame.
+    // Number of buffers on each of the V4L2 device queues.
+    const size_t mQueueDepth;
+    // Whether low-latency encoding is enabled.
+    const bool mLowLatency;
+    // Whether frames are split into slices, each returned in a separate output buffer.
+    bool mSliceOutput = false;
+    // The number of slices each frame is split into in slice output mode.
+    uint32_t mNumSlicesPerFrame = 0;
+    // The number of slices of the current frame returned so far in slice output mode.
+    uint32_t mNumSlicesDequeued = 0;
+    // The timestamp of the last non-empty output buffer, used to detect the first slice of a frame.
+    std::optional<int64_t> mLastOutputTimestamp;
+    // The time each frame currently being encoded was queued on the device, indexed by timestamp.
+    std::map<int64_t, ::base::TimeTicks> mEnqueueTimes;
+    // Whether the device reports the average QP of the encoded frames.
+    bool mAverageQpSupported = false;
+
+    // How often we want to request the V4L2 device to create a key frame, zero to only create key
+    // frames on request. Periodic key frames are disabled when intra refresh is enabled.
     uint32_t mKeyFramePeriod = 0;
+    // The number of frames over which all macroblocks are intra-coded once, zero if intra refresh
+    // is disabled.
+    uint32_t mIntraRefreshPeriod = 0;
     // Key frame counter, a key frame will be requested each time it reaches zero.
     uint32_t mKeyFrameCounter = 0;
 
+    // The number of temporal layers configured on the device, one if temporal layering is
+    // disabled.
+    uint32_t mNumTemporalLayers = 1;
+    // The controls used to set the bitrate of each temporal layer, empty if not supported.
+    std::vector<uint32_t> mTemporalLayerBitrateCtrls;
+    // The number of frames output since the last key frame, and the temporal layer of the frame
+    // currently being output.
+    uint32_t mFramesSinceKeyFrame = 0;
+    uint32_t mTemporalLayerId = 0;
+
+    // The number of long-term reference slots configured on the device, zero if disabled.
+    uint32_t mNumLongTermRefs = 0;
+    // The number of consecutive B-frames configured on the device, zero if disabled.
+    uint32_t mNumBFrames = 0;
+    // The pending requests to mark the next frame as long-term reference in the specified slot, and
+    // to only predict the next frame from the long-term references in the specified slots.
+    std::optional<uint32_t> mPendingLongTermRefMark;
+    std::optional<uint32_t> mPendingLongTermRefUse;
+
+    // The vendor control used to set a QP offset for each 16x16 macroblock, zero if not supported.
+    uint32_t mQpMapCtrl = 0;
+    // The QP offset of each macroblock in raster order, and whether any offset is non-zero.
+    std::vector<int8_t> mQpMap;
+    bool mQpMapActive = false;
+
     // Whether we need to manually cache and prepend SPS and PPS to IDR frames.
     bool mInjectParamsBeforeIDR = false;
+    // Whether the device honors the data offset of output buffers, so SPS and PPS can be injected
+    // in place. Most drivers don't, which is detected on the first output buffer.
+    bool mOutputHeadroomSupported = true;
     // The latest cached SPS and PPS (without H.264 start code).
     std::vector<uint8_t> mCachedSPS;
     std::vector<uint8_t> mCachedPPS;
+    // Whether the device might output new SPS and PPS with a non-key frame, i.e. before the first
+    // key frame or after the stream was reconfigured. Only then non-key frames are mapped and
+    // scanned for parameter sets, key frames are always scanned when injecting them.
+    bool mParamsUpdatePending = true;
+    // The bitrate and framerate last configured on the device, zero if not configured yet.
+    uint32_t mConfiguredBitrate = 0;
+    uint32_t mConfiguredFramerate = 0;
+    // The peak bitrate last configured on the device, zero if not configured.
+    uint32_t mConfiguredPeakBitrate = 0;
 
     // The V4L2 device and associated queues used to interact with the device.
     scoped_refptr<V4L2Device> mDevice;
@@ -0,0 +1,230 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_STATELESS_DECODER_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_STATELESS_DECODER_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/files/scoped_file.h>
+#include <base/memory/weak_ptr.h>
+
+#include <ui/Rect.h>
+#include <ui/Size.h>
+#include <v4l2_codec2/common/H264Parser.h>
+#include <v4l2_codec2/common/V4L2Device.h>
+#include <v4l2_codec2/common/VideoTypes.h>
+#include <v4l2_codec2/components/VideoDecoder.h>
+#include <v4l2_codec2/components/VideoFrame.h>
+#include <v4l2_codec2/components/VideoFramePool.h>
+
+namespace android {
+
+// The V4L2StatelessDecoder drives V4L2 decoders implementing the stateless codec API (e.g. Hantro
+// and Rockchip VPUs), which don't parse the bitstream themselves. The parameter sets and slice
+// headers are parsed in userspace, and each frame is submitted as a media request together with
+// the controls describing it. The decoded picture buffer (DPB), i.e. reference marking and output
+// reordering, is also managed here.
+//
+// Only H.264 is supported, using the frame-based decoding mode with Annex B start codes. All
+// methods should be called on the same sequence.
+class V4L2StatelessDecoder : public VideoDecoder {
+public:
+    static std::unique_ptr<VideoDecoder> Create(
+            const VideoCodec& codec, const size_t inputBufferSize, bool lowLatency,
+            GetPoolCB getPoolCb, OutputCB outputCb, ErrorCB errorCb,
+            scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+    ~V4L2StatelessDecoder() override;
+
+    void decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb) override;
+    void drain(DecodeCB drainCb) override;
+    void flush() override;
+
+private:
+    enum class State {
+        Idle,  // Not received any decode buffer after initialized, flushed, or drained.
+        Decoding,
+        Draining,
+        Error,
+    };
+    static const char* StateToString(State state);
+
+    struct DecodeRequest {
+        DecodeRequest(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb)
+              : buffer(std::move(buffer)), decodeCb(std::move(decodeCb)) {}
+        DecodeRequest(DecodeRequest&&) = default;
+        ~DecodeRequest() = default;
+
+        std::unique_ptr<ConstBitstreamBuffer> buffer;  // nullptr means Drain
+        DecodeCB decodeCb;
+    };
+
+    // A picture submitted to the device. Pictures are kept in the DPB while they are used for
+    // reference or waiting to be output.
+    struct Picture {
+        int32_t bitstreamId = -1;
+        Rect visibleRect;
+
+        uint32_t frameNum = 0;
+        // FrameNumWrap, which is also the PicNum of short-term reference frames.
+        int32_t frameNumWrap = 0;
+        uint32_t longTermFrameIdx = 0;
+        int32_t frameNumOffset = 0;
+        int32_t picOrderCntMsb = 0;
+        uint32_t picOrderCntLsb = 0;
+        int32_t topFieldOrderCnt = 0;
+        int32_t bottomFieldOrderCnt = 0;
+        bool hasMemMgmt5 = false;
+
+        bool shortTermRef = false;
+        bool longTermRef = false;
+        bool outputNeeded = true;
+
+        // Set when the device returned the decoded picture. |frame| is moved out once the picture
+        // is output.
+        bool decoded = false;
+        // Set if the device flagged the decoded picture as corrupted, it's then not output.
+        bool corrupted = false;
+        size_t outputBufferId = 0;
+        std::unique_ptr<VideoFrame> frame;
+
+        bool isRef() const { return shortTermRef || longTermRef; }
+        int32_t picOrderCnt() const { return std::min(topFieldOrderCnt, bottomFieldOrderCnt); }
+    };
+
+    V4L2StatelessDecoder(scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+    bool start(const size_t inputBufferSize, bool lowLatency, GetPoolCB getPoolCb,
+               OutputCB outputCb, ErrorCB errorCb);
+    void pumpDecodeRequest();
+
+    // Parse the parameter sets and the header of the first slice in |data|. The start codes and
+    // data of all slice NAL units are appended to |slices|, which is left empty if |data| doesn't
+    // contain a picture.
+    bool parseBitstream(const uint8_t* data, size_t size, H264SliceHeader* header,
+                        std::vector<std::pair<const uint8_t*, size_t>>* slices);
+    // Whether the device needs to be reconfigured before decoding pictures using |sps|.
+    bool needsReconfiguration(const H264SPS& sps) const;
+    // Configure the device queues and output buffers for decoding pictures using |sps|. All
+    // pictures previously submitted should be decoded.
+    bool configure(const H264SPS& sps);
+    bool allocateRequests();
+    // Submit the picture described by |header|, consisting of the specified |slices|, to the
+    // device.
+    bool submitPicture(int32_t bitstreamId, const H264SliceHeader& header,
+                       const std::vector<std::pair<const uint8_t*, size_t>>& slices);
+    bool setPictureControls(int requestFd, const H264SPS& sps, const H264PPS& pps,
+                            const H264SliceHeader& header, const Picture& picture);
+
+    // Calculate the picture order counts of |picture| (ITU-T H.264 section 8.2.1).
+    void calculatePicOrderCnt(const H264SPS& sps, const H264SliceHeader& header, Picture* picture);
+    // Update the FrameNumWrap of the reference pictures in the DPB, relative to |frameNum|.
+    void updatePicNums(const H264SPS& sps, uint32_t frameNum);
+    // Perform the reference picture marking process for |picture| (ITU-T H.264 section 8.2.5).
+    void markReferences(const H264SPS& sps, const H264SliceHeader& header, Picture* picture);
+    void applyMemoryManagementOperation(const H264SliceHeader::MemoryManagementOperation& op,
+                                        uint32_t frameNum, Picture* picture);
+    void applySlidingWindow(const H264SPS& sps);
+    // Store |picture| in the DPB, outputting pictures as required by the DPB size and the maximum
+    // number of reordered frames (ITU-T H.264 section C.4.5).
+    void storePicture(std::shared_ptr<Picture> picture, size_t dpbSize, size_t maxNumReorderFrames);
+    // Output the picture in the DPB with the lowest picture order count.
+    bool bumpPicture();
+    void outputAllPictures();
+    // Remove the pictures that are neither used for reference nor waiting for output from the DPB.
+    void removeUnusedPictures();
+    void clearDpb();
+    // Send the decoded pictures to the client, in output order.
+    void sendOutputPictures();
+    // Called when a picture was output and removed from the DPB, after which its output buffer can
+    // be reused.
+    void releasePicture(const Picture& picture);
+    bool isOutputBufferUsed(size_t outputBufferId) const;
+    void resetPicOrderCntState();
+
+    void serviceDeviceTask(bool event);
+    void tryFinishDrain();
+
+    void tryFetchVideoFrame();
+    void onVideoFrameReady(std::optional<VideoFramePool::FrameWithBlockId> frameWithBlockId);
+    bool queueOutputFrame(size_t v4l2Id, std::unique_ptr<VideoFrame> frame);
+
+    void setState(State newState);
+    void onError();
+
+    std::unique_ptr<VideoFramePool> mVideoFramePool;
+
+    scoped_refptr<V4L2Device> mDevice;
+    scoped_refptr<V4L2Queue> mInputQueue;
+    scoped_refptr<V4L2Queue> mOutputQueue;
+    // The media requests used to submit pictures, indexed by the id of the input buffer they are
+    // used with.
+    std::vector<::base::ScopedFD> mRequestFds;
+
+    std::queue<DecodeRequest> mDecodeRequests;
+    std::map<int32_t, DecodeCB> mPendingDecodeCbs;
+
+    size_t mInputBufferSize = 0;
+    bool mLowLatency = false;
+    GetPoolCB mGetPoolCb;
+    OutputCB mOutputCb;
+    DecodeCB mDrainCb;
+    ErrorCB mErrorCb;
+
+    H264Parser mParser;
+    // The coded size and DPB size the device is currently configured for.
+    ui::Size mCodedSize;
+    size_t mDpbSize = 0;
+
+    // The pictures submitted to the device and not decoded yet, keyed by bitstream id.
+    std::map<int32_t, std::shared_ptr<Picture>> mPicturesAtDevice;
+    // The decoded picture buffer.
+    std::vector<std::shared_ptr<Picture>> mDpb;
+    // The pictures to send to the client in output order, once decoded.
+    std::deque<std::shared_ptr<Picture>> mPicturesToOutput;
+
+    // The state of the previous (reference) picture, used to calculate picture order counts.
+    uint32_t mPrevFrameNum = 0;
+    int32_t mPrevFrameNumOffset = 0;
+    bool mPrevHasMemMgmt5 = false;
+    uint32_t mPrevRefFrameNum = 0;
+    int32_t mPrevRefPicOrderCntMsb = 0;
+    uint32_t mPrevRefPicOrderCntLsb = 0;
+    int32_t mPrevRefTopFieldOrderCnt = 0;
+    bool mPrevRefHasMemMgmt5 = false;
+    // MaxLongTermFrameIdx, -1 means "no long-term frame indices".
+    int32_t mMaxLongTermFrameIdx = -1;
+
+    std::map<size_t, std::unique_ptr<VideoFrame>> mFrameAtDevice;
+    // Frames fetched from |mVideoFramePool| whose V4L2 buffer still holds a picture used by the
+    // DPB, keyed by V4L2 buffer id. They are queued once the picture is released.
+    std::map<size_t, std::unique_ptr<VideoFrame>> mPendingOutputFrames;
+    // The time the last video frame was requested from |mVideoFramePool|.
+    std::chrono::steady_clock::time_point mFetchStartTime;
+
+    // Block IDs can be arbitrarily large, but we only have a limited number of buffers. This
+    // maintains an association between a block ID and a specific V4L2 buffer index.
+    std::map<size_t, size_t> mBlockIdToV4L2Id;
+
+    State mState = State::Idle;
+
+    scoped_refptr<::base::SequencedTaskRunner> mTaskRunner;
+
+    ::base::WeakPtr<V4L2StatelessDecoder> mWeakThis;
+    ::base::WeakPtrFactory<V4L2StatelessDecoder> mWeakThisFactory{this};
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_V4L2_STATELESS_DECODER_H
@@ -7,9 +7,13 @@
 
 #include <stdint.h>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include <base/callback.h>
 
+#include <v4l2_codec2/common/LatencyTracker.h>
+#include <v4l2_codec2/common/MemoryTracker.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 #include <v4l2_codec2/components/BitstreamBuffer.h>
 #include <v4l2_codec2/components/VideoFrame.h>
@@ -26,17 +30,64 @@ public:
     };
     static const char* DecodeStatusToString(DecodeStatus status);
 
+    // Callback to get the pool output frames are fetched from. |numOutputBuffers| is set to the
+    // number of buffers the decoder needs, and is updated to the number of buffers the pool will
+    // provide, which also accounts for the buffers held further down the pipeline. The decoder
+    // should allocate a device buffer for each of them.
     using GetPoolCB = base::RepeatingCallback<std::unique_ptr<VideoFramePool>(
-            const ui::Size& size, HalPixelFormat pixelFormat, size_t numOutputBuffers)>;
+            const ui::Size& size, HalPixelFormat pixelFormat, size_t* numOutputBuffers)>;
+    // Callback to check whether the consumer of the output frames accepts vendor compressed pixel
+    // formats, which can only be accessed by the hardware.
+    using IsCompressedOutputAllowedCB = base::RepeatingCallback<bool()>;
     using DecodeCB = base::OnceCallback<void(DecodeStatus)>;
     using OutputCB = base::RepeatingCallback<void(std::unique_ptr<VideoFrame>)>;
     using ErrorCB = base::RepeatingCallback<void()>;
+    // Callback run when the device reports that the input buffer or the frame decoded from the
+    // bitstream buffer |bitstreamId| is corrupted. The frame isn't output, but decoding continues.
+    using CorruptionCB = base::RepeatingCallback<void(int32_t bitstreamId)>;
+    // Callback run for each buffer passed to decodeBuffers() as soon as it's processed, with its
+    // bitstream id and decode status.
+    using BufferDecodeCB = base::RepeatingCallback<void(int32_t bitstreamId, DecodeStatus status)>;
 
     virtual ~VideoDecoder();
 
     virtual void decode(std::unique_ptr<ConstBitstreamBuffer> buffer, DecodeCB decodeCb) = 0;
+    // Decode all |buffers|, |bufferCb| is run for each of them once it's processed. There is no
+    // completion callback for the whole set, so no buffer's completion is held back by the others.
+    // The default implementation calls decode() for each buffer, decoders can override this to
+    // queue all buffers in a single pass.
+    virtual void decodeBuffers(std::vector<std::unique_ptr<ConstBitstreamBuffer>> buffers,
+                               BufferDecodeCB bufferCb);
     virtual void drain(DecodeCB drainCb) = 0;
     virtual void flush() = 0;
+
+    // Set the |tracker| used to record the time bitstream buffers spend in each decoder stage. The
+    // buffers are tracked using their bitstream id.
+    void setLatencyTracker(std::shared_ptr<LatencyTracker> tracker) {
+        mLatencyTracker = std::move(tracker);
+    }
+    // Set the |tracker| accounting the buffers allocated by the decoder itself.
+    void setMemoryTracker(std::shared_ptr<MemoryTracker> tracker) {
+        mMemoryTracker = std::move(tracker);
+    }
+    // Set the callback run when corrupted data is detected. Decode errors flagged by the device are
+    // ignored if not set, i.e. corrupted frames are output as usual.
+    void setCorruptionCallback(CorruptionCB corruptionCb) {
+        mCorruptionCb = std::move(corruptionCb);
+    }
+
+protected:
+    // Create a decode callback for each of the specified |bitstreamIds|, each running |bufferCb|
+    // with its bitstream id.
+    static std::vector<DecodeCB> bindBufferDecodeCBs(const std::vector<int32_t>& bitstreamIds,
+                                                     const BufferDecodeCB& bufferCb);
+
+    // The latency tracker shared with the component, might be null.
+    std::shared_ptr<LatencyTracker> mLatencyTracker;
+    // The memory tracker shared with the component, might be null.
+    std::shared_ptr<MemoryTracker> mMemoryTracker;
+    // The callback run on corrupted data, might be null.
+    CorruptionCB mCorruptionCb;
 };
 
 }  // namespace android
@@ -7,12 +7,15 @@
 
 #include <stdint.h>
 #include <memory>
+#include <optional>
+#include <utility>
 #include <vector>
 
 #include <base/callback.h>
 #include <ui/Size.h>
 
 #include <v4l2_codec2/common/Common.h>
+#include <v4l2_codec2/common/LatencyTracker.h>
 #include <v4l2_codec2/common/VideoPixelFormat.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 
@@ -22,6 +25,15 @@ struct BitstreamBuffer;
 
 class VideoEncoder {
 public:
+    // A region of an input frame, and the QP offset applied to the macroblocks it covers.
+    struct QpOffsetRect {
+        uint32_t left;
+        uint32_t top;
+        uint32_t width;
+        uint32_t height;
+        int32_t qpOffset;
+    };
+
     // The InputFrame class can be used to store raw video frames.
     // Note: The InputFrame does not take ownership of the data. The file descriptor is not
     //       duplicated and the caller is responsible for keeping the data alive until the buffer
@@ -29,7 +41,8 @@ public:
     class InputFrame {
     public:
         InputFrame(std::vector<int>&& fds, std::vector<VideoFramePlane>&& planes,
-                   VideoPixelFormat pixelFormat, uint64_t index, int64_t timestamp);
+                   VideoPixelFormat pixelFormat, uint64_t index, int64_t timestamp,
+                   std::optional<uint32_t> dmabufId = std::nullopt);
         ~InputFrame() = default;
 
         const std::vector<int>& fds() const { return mFds; }
@@ -37,6 +50,14 @@ public:
         VideoPixelFormat pixelFormat() const { return mPixelFormat; }
         uint64_t index() const { return mIndex; }
         int64_t timestamp() const { return mTimestamp; }
+        // The unique id of the frame's first dmabuf, used to bind repeated buffers to the same
+        // device buffer. Might be empty if the id couldn't be determined.
+        std::optional<uint32_t> dmabufId() const { return mDmabufId; }
+        // The regions of the frame encoded with a QP offset, later regions take precedence.
+        const std::vector<QpOffsetRect>& qpOffsetRects() const { return mQpOffsetRects; }
+        void setQpOffsetRects(std::vector<QpOffsetRect> rects) {
+            mQpOffsetRects = std::move(rects);
+        }
 
     private:
         const std::vector<int> mFds;
@@ -44,6 +65,8 @@ public:
         VideoPixelFormat mPixelFormat;
         uint64_t mIndex = 0;
         int64_t mTimestamp = 0;
+        std::optional<uint32_t> mDmabufId;
+        std::vector<QpOffsetRect> mQpOffsetRects;
     };
 
     using FetchOutputBufferCB =
@@ -69,15 +92,47 @@ public:
     // Set the peak bitrate to the specified value. The peak bitrate must be larger or equal to the
     // target bitrate and is ignored if the bitrate mode is constant.
     virtual bool setPeakBitrate(uint32_t peakBitrate) = 0;
+    // Set the bitrate of each temporal layer, starting at the base layer. The bitrates are ignored
+    // if temporal layering is disabled.
+    virtual bool setTemporalLayerBitrates(const std::vector<uint32_t>& bitrates) = 0;
+    // Set the quality level (0-100) targeted by the rate controller. This is only used if the
+    // bitrate mode is constant quality.
+    virtual bool setConstantQuality(uint32_t quality) = 0;
+    // Restrict the QPs used by the rate controller to [|minQp|, |maxQp|].
+    virtual bool setQpRange(uint32_t minQp, uint32_t maxQp) = 0;
 
     // Set the framerate to the specified value, will affect all non-processed frames.
     virtual bool setFramerate(uint32_t framerate) = 0;
     // Request the next frame encoded to be a key frame, will affect the next non-processed frame.
     virtual void requestKeyframe() = 0;
+    // Mark the next non-processed frame as long-term reference, stored in slot |index|.
+    virtual void markLongTermReference(uint32_t index) = 0;
+    // Only predict the next non-processed frame from the long-term references in the slots set in
+    // |mask|, invalidating the more recent references.
+    virtual void useLongTermReferences(uint32_t mask) = 0;
+    // Change the resolution of the input frames to |visibleSize|. The encoder should be drained and
+    // have no pending encode requests. The next frame will be a key frame with new parameter sets.
+    virtual bool changeResolution(const ui::Size& visibleSize, uint32_t stride) = 0;
 
     virtual VideoPixelFormat inputFormat() const = 0;
     virtual const ui::Size& visibleSize() const = 0;
     virtual const ui::Size& codedSize() const = 0;
+    // Whether each output buffer contains a single slice rather than a complete frame. When set,
+    // the last slice of each frame is flagged in its BitstreamBuffer.
+    virtual bool sliceOutput() const = 0;
+    // The number of consecutive B-frames the encoder produces. When non-zero, output buffers are
+    // returned in decode order, which differs from the order of the input frames.
+    virtual uint32_t numBFrames() const = 0;
+
+    // Set the |tracker| used to record the time input frames spend in each encoder stage. The
+    // frames are tracked using their index.
+    void setLatencyTracker(std::shared_ptr<LatencyTracker> tracker) {
+        mLatencyTracker = std::move(tracker);
+    }
+
+protected:
+    // The latency tracker shared with the component, might be null.
+    std::shared_ptr<LatencyTracker> mLatencyTracker;
 };
 
 }  // namespace android
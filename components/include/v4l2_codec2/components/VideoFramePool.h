@@ -9,14 +9,19 @@
 #include <memory>
 #include <optional>
 #include <queue>
+#include <set>
 
 #include <C2Buffer.h>
 #include <base/callback.h>
+#include <base/files/scoped_file.h>
 #include <base/memory/weak_ptr.h>
 #include <base/sequenced_task_runner.h>
+#include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
 #include <ui/Size.h>
 
+#include <v4l2_codec2/common/MemoryTracker.h>
+#include <v4l2_codec2/common/V4L2PollerService.h>
 #include <v4l2_codec2/common/VideoTypes.h>
 #include <v4l2_codec2/components/VideoFrame.h>
 
@@ -33,7 +38,8 @@ public:
     static std::unique_ptr<VideoFramePool> Create(
             std::shared_ptr<C2BlockPool> blockPool, const size_t numBuffers, const ui::Size& size,
             HalPixelFormat pixelFormat, bool isSecure,
-            scoped_refptr<::base::SequencedTaskRunner> taskRunner);
+            scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+            std::shared_ptr<MemoryTracker> memoryTracker);
     ~VideoFramePool();
 
     // Get a VideoFrame instance, which will be passed via |cb|.
@@ -48,16 +54,54 @@ private:
     // |pixelFormat| is the pixel format of the required graphic blocks.
     // |isSecure| indicates the video stream is encrypted or not.
     // All public methods and the callbacks should be run on |taskRunner|.
+    // |memoryTracker| accounts the memory of the fetched blocks, it might be null.
     VideoFramePool(std::shared_ptr<C2BlockPool> blockPool, const ui::Size& size,
                    HalPixelFormat pixelFormat, C2MemoryUsage memoryUsage,
-                   scoped_refptr<::base::SequencedTaskRunner> taskRunner);
-    bool initialize();
-    void destroyTask();
+                   scoped_refptr<::base::SequencedTaskRunner> taskRunner,
+                   std::shared_ptr<MemoryTracker> memoryTracker);
+    // Start fetching blocks. If |fetchMayBlock|, the pool gets a fetch thread of its own instead of
+    // sharing one with other pools.
+    bool initialize(bool fetchMayBlock);
+    void destroyTask(::base::WaitableEvent* done);
+
+    // The number of fetch threads shared by all pools, if not configured using the
+    // "ro.vendor.v4l2_codec2.fetch_threads" property. Setting the property to 0 disables the fetch
+    // threads, blocks are then fetched on the client's sequence.
+    static constexpr int32_t kDefaultNumFetchThreads = 2;
+
+    // Get the number of shared fetch threads configured.
+    static int32_t getNumFetchThreads();
+
+    // Get the task runner of the least used shared fetch thread, its index is stored in
+    // |threadIndex|. Returns nullptr if no fetch thread could be started.
+    static scoped_refptr<::base::SequencedTaskRunner> acquireFetchTaskRunner(size_t* threadIndex);
+    // Release the shared fetch thread with specified |threadIndex|.
+    static void releaseFetchTaskRunner(size_t threadIndex);
+
+    // The initial and maximum delay used for the exponential backoff when fetching a block timed
+    // out and the pool doesn't guarantee a block-available notification.
+    static constexpr size_t kFetchRetryDelayInit = 64;    // Initial delay: 64us
+    static constexpr size_t kFetchRetryDelayMax = 16384;  // Max delay: 16ms (1 frame at 60fps)
 
     static void getVideoFrameTaskThunk(scoped_refptr<::base::SequencedTaskRunner> taskRunner,
-                                       std::optional<::base::WeakPtr<VideoFramePool>> weakPool);
+                                       std::optional<::base::WeakPtr<VideoFramePool>> weakPool,
+                                       uint64_t fetchAttempt);
+    // Retry fetching a block after a block-available notification or a backoff delay, unless
+    // another attempt was made since fetch attempt |fetchAttempt| timed out.
+    void onBlockAvailableTask(uint64_t fetchAttempt);
+    void retryFetchTask(uint64_t fetchAttempt);
+    // Fetch |numBlocks| blocks ahead of time into |mPrefetchedBlocks|, one block per task.
+    void prefetchTask(size_t numBlocks);
     void getVideoFrameTask();
+    // Called when the acquire fence of |mFencedBlock| signaled, or polling the fence failed.
+    void onAcquireFenceSignaledTask(bool event);
+    void onAcquireFenceErrorTask();
+    void stopWaitingForAcquireFence();
+    // Wrap |block| into a VideoFrame and pass it to the client, or report |err| if fetching failed.
+    void outputBlock(c2_status_t err, std::shared_ptr<C2GraphicBlock> block);
     void onVideoFrameReady(std::optional<FrameWithBlockId> frameWithBlockId);
+    // Account the memory of the block with specified |bufferId| the first time it's fetched.
+    void trackBlockMemory(uint32_t bufferId, const C2GraphicBlock& block);
 
     // Ask |blockPool| to allocate the specified number of buffers.
     // |bufferCount| is the number of requested buffers.
@@ -65,11 +109,19 @@ private:
                                            const ui::Size& size, uint32_t format,
                                            C2MemoryUsage usage);
 
+    // Fetch a block from |blockPool|. If supported by |blockPool|, the acquire fence of the block
+    // isn't waited for but returned in |fenceFd| when not signaled yet.
+    static c2_status_t fetchGraphicBlock(C2BlockPool& blockPool, const ui::Size& size,
+                                         uint32_t format, C2MemoryUsage usage,
+                                         std::shared_ptr<C2GraphicBlock>* block,
+                                         ::base::ScopedFD* fenceFd);
+
     static std::optional<uint32_t> getBufferIdFromGraphicBlock(C2BlockPool& blockPool,
                                                                const C2Block2D& block);
 
     // Ask |blockPool| to notify when a block is available via |cb|.
-    // Return true if |blockPool| supports notifying buffer available.
+    // Return true if |blockPool| guarantees to notify once a block is available. Pools that can
+    // only give a hint might still run |cb|, but return false, so the caller keeps retrying.
     static bool setNotifyBlockAvailableCb(C2BlockPool& blockPool, ::base::OnceClosure cb);
 
     std::shared_ptr<C2BlockPool> mBlockPool;
@@ -79,9 +131,38 @@ private:
 
     GetVideoFrameCB mOutputCb;
 
+    // The state of the exponential backoff used when fetching a block timed out, only accessed on
+    // the fetch thread.
+    size_t mNumFetchRetries = 0;
+    size_t mFetchRetryDelay = kFetchRetryDelayInit;
+    // Whether the current fetch attempt was triggered by a block-available notification.
+    bool mNotifiedBlockAvailable = false;
+    // The number of fetch attempts made, used to drop the notification or retry of an attempt once
+    // the other one triggered the next attempt.
+    uint64_t mFetchAttempt = 0;
+    // The blocks fetched ahead of time for secure pools, handed out before fetching new blocks.
+    // Only accessed on the fetch thread.
+    std::queue<std::shared_ptr<C2GraphicBlock>> mPrefetchedBlocks;
+    // The block whose acquire fence we're waiting for on the poller, the fence's fd and watch.
+    // Only accessed on the fetch thread.
+    std::shared_ptr<C2GraphicBlock> mFencedBlock;
+    ::base::ScopedFD mAcquireFenceFd;
+    std::optional<V4L2PollerService::WatchId> mAcquireFenceWatchId;
+
+    // The tracker accounting the memory of the fetched blocks, might be null. The ids of the blocks
+    // accounted so far and their total size are only accessed on the fetch thread.
+    const std::shared_ptr<MemoryTracker> mMemoryTracker;
+    std::set<uint32_t> mTrackedBufferIds;
+    size_t mTrackedMemoryUsage = 0;
+
     scoped_refptr<::base::SequencedTaskRunner> mClientTaskRunner;
-    ::base::Thread mFetchThread{"VideoFramePoolFetchThread"};
+    // The task runner of the fetch thread used by this pool, and the thread's index if shared.
     scoped_refptr<::base::SequencedTaskRunner> mFetchTaskRunner;
+    size_t mFetchThreadIndex = 0;
+    // The fetch thread owned by this pool, only used if fetching might block other pools.
+    std::unique_ptr<::base::Thread> mFetchThread;
+    // Whether blocks are fetched on |mClientTaskRunner| instead of a shared fetch thread.
+    bool mFetchOnClientSequence = false;
 
     ::base::WeakPtr<VideoFramePool> mClientWeakThis;
     ::base::WeakPtr<VideoFramePool> mFetchWeakThis;
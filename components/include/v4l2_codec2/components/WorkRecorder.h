@@ -0,0 +1,137 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_COMPONENTS_WORK_RECORDER_H
+#define ANDROID_V4L2_CODEC2_COMPONENTS_WORK_RECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <C2Component.h>
+#include <C2Param.h>
+#include <C2Work.h>
+#include <base/thread_annotations.h>
+
+namespace android {
+
+// The WorkRecorder records the traffic of a component as queued by the client: the input
+// bitstreams or frames of all works with their timestamps, flags and config updates, drain and
+// flush requests, and the interface configuration when the component is started or the encoding
+// parameters change. The recording can be replayed with its original timing using the
+// C2ComponentBenchmark, see tests/c2_benchmark/README.md.
+//
+// Recording is enabled by setting the "ro.vendor.v4l2_codec2.record_dir" property to a directory
+// writable by the codec service, each component instance then records to a new file in it. Input
+// frames are recorded uncompressed, so recordings of encoders grow quickly.
+//
+// All methods are thread-safe.
+class WorkRecorder {
+public:
+    // Create a recorder for the component |name| with specified |id|. Returns nullptr if recording
+    // is disabled or the recording file couldn't be created.
+    static std::unique_ptr<WorkRecorder> Create(const std::string& name, uint32_t id);
+    ~WorkRecorder();
+
+    WorkRecorder(const WorkRecorder&) = delete;
+    WorkRecorder& operator=(const WorkRecorder&) = delete;
+
+    // Record that the component is started, with the configuration of its interface |intf|.
+    // |paramsGeneration| identifies the configuration, see recordConfigChange().
+    void recordStart(C2ComponentInterface& intf, uint64_t paramsGeneration = 0);
+    // Record that the component is stopped.
+    void recordStop();
+    // Record the configuration of |intf| if |paramsGeneration| differs from the generation last
+    // recorded, i.e. the client configured the interface since.
+    void recordConfigChange(C2ComponentInterface& intf, uint64_t paramsGeneration);
+    // Record the input of |work|.
+    void recordWork(const C2Work& work);
+    // Record a drain or flush request.
+    void recordDrain();
+    void recordFlush();
+
+private:
+    WorkRecorder(FILE* file, std::string path);
+
+    void recordConfigLocked(uint8_t type, C2ComponentInterface& intf) REQUIRES(mLock);
+    void writeEventHeaderLocked(uint8_t type) REQUIRES(mLock);
+    void writeParamsLocked(const std::vector<const C2Param*>& params) REQUIRES(mLock);
+    void writeLocked(const void* data, size_t size) REQUIRES(mLock);
+    template <typename T>
+    void writeValueLocked(T value) REQUIRES(mLock) {
+        writeLocked(&value, sizeof(value));
+    }
+
+    const std::string mPath;
+    const std::chrono::steady_clock::time_point mStartTime;
+
+    std::mutex mLock;
+    FILE* mFile GUARDED_BY(mLock);
+    // The parameter generation last recorded.
+    std::optional<uint64_t> mParamsGeneration GUARDED_BY(mLock);
+};
+
+// A recording of a component's traffic, as written by the WorkRecorder.
+struct WorkRecording {
+    enum class EventType : uint8_t {
+        kStart = 1,
+        kStop = 2,
+        kConfig = 3,
+        kWork = 4,
+        kDrain = 5,
+        kFlush = 6,
+    };
+    enum class BufferType : uint8_t {
+        kNone = 0,
+        kLinear = 1,
+        kGraphic = 2,
+    };
+
+    // A plane of a recorded frame, its samples are tightly packed.
+    struct Plane {
+        uint32_t mChannel = 0;
+        uint32_t mColSampling = 1;
+        uint32_t mRowSampling = 1;
+        std::vector<uint8_t> mData;
+    };
+
+    struct Event {
+        EventType mType = EventType::kWork;
+        // The time of the event, relative to the creation of the recorder.
+        int64_t mTimeUs = 0;
+        // The interface configuration for kStart and kConfig events, the config updates of the
+        // work for kWork events.
+        std::vector<std::unique_ptr<C2Param>> mParams;
+
+        // The input of kWork events.
+        uint32_t mFlags = 0;
+        uint64_t mFrameIndex = 0;
+        uint64_t mTimestamp = 0;
+        BufferType mBufferType = BufferType::kNone;
+        // The bitstream of linear buffers.
+        std::vector<uint8_t> mBitstream;
+        // The size, layout type (C2PlanarLayout::type_t) and planes of graphic buffers.
+        uint32_t mWidth = 0;
+        uint32_t mHeight = 0;
+        uint32_t mLayoutType = 0;
+        std::vector<Plane> mPlanes;
+    };
+
+    // Read the recording at |path|, returns nullopt if the file couldn't be read or is invalid.
+    static std::optional<WorkRecording> Read(const std::string& path);
+
+    // The name of the recorded component.
+    std::string mComponentName;
+    std::vector<Event> mEvents;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_COMPONENTS_WORK_RECORDER_H
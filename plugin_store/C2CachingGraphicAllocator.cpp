@@ -0,0 +1,224 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "C2CachingGraphicAllocator"
+
+#include <v4l2_codec2/plugin_store/C2CachingGraphicAllocator.h>
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/threading/thread.h>
+#include <base/time/time.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace {
+
+constexpr int32_t kDefaultCacheSize = 32;
+constexpr int32_t kDefaultCacheTtlMs = 3000;
+
+// The properties an allocation has to match to be recycled.
+struct AllocationKey {
+    C2Allocator::id_t allocatorId;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint64_t usage;
+
+    bool operator==(const AllocationKey& other) const {
+        return std::tie(allocatorId, width, height, format, usage) ==
+               std::tie(other.allocatorId, other.width, other.height, other.format, other.usage);
+    }
+};
+
+// The process-wide cache of released allocations. Expired allocations are freed on a dedicated
+// thread, so they don't linger once no more decoders are created.
+class GraphicAllocationCache {
+public:
+    // Get the process-wide cache. The cache is intentionally leaked, as allocations might still be
+    // released while static objects are destroyed on process exit.
+    static GraphicAllocationCache* getInstance() {
+        static GraphicAllocationCache* sCache = new GraphicAllocationCache();
+        return sCache;
+    }
+
+    bool isEnabled() const { return mMaxSize > 0 && mTtl > ::base::TimeDelta(); }
+    // Free released allocations instead of caching them while |suspended| is set.
+    void setSuspended(bool suspended) { mSuspended.store(suspended); }
+
+    // Take a cached allocation matching |key|, the most recently released one is preferred.
+    // Returns nullptr if there is none.
+    std::shared_ptr<C2GraphicAllocation> take(const AllocationKey& key);
+    // Keep |allocation| in the cache. The oldest allocation is evicted if the cache is full.
+    void put(const AllocationKey& key, std::shared_ptr<C2GraphicAllocation> allocation);
+    // Free all cached allocations.
+    void clear();
+
+private:
+    struct Entry {
+        AllocationKey mKey;
+        std::shared_ptr<C2GraphicAllocation> mAllocation;
+        ::base::TimeTicks mExpiry;
+    };
+
+    GraphicAllocationCache();
+
+    // Free the expired allocations, and schedule the next purge if the cache isn't empty.
+    void purgeTask();
+    void schedulePurgeLocked(::base::TimeDelta delay);
+
+    const size_t mMaxSize;
+    const ::base::TimeDelta mTtl;
+    std::atomic<bool> mSuspended{false};
+
+    std::mutex mLock;
+    // The cached allocations, ordered from the oldest to the most recently released.
+    std::list<Entry> mEntries;
+    // The thread freeing expired allocations, started on first use.
+    std::unique_ptr<::base::Thread> mPurgeThread;
+    bool mPurgeScheduled = false;
+};
+
+GraphicAllocationCache::GraphicAllocationCache()
+      : mMaxSize(std::max(property_get_int32("ro.vendor.v4l2_codec2.allocation_cache_size",
+                                             kDefaultCacheSize),
+                          0)),
+        mTtl(::base::TimeDelta::FromMilliseconds(property_get_int32(
+                "ro.vendor.v4l2_codec2.allocation_cache_ttl_ms", kDefaultCacheTtlMs))) {
+    ALOGV("%s(maxSize=%zu, ttl=%" PRId64 "ms)", __func__, mMaxSize, mTtl.InMilliseconds());
+}
+
+std::shared_ptr<C2GraphicAllocation> GraphicAllocationCache::take(const AllocationKey& key) {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (auto it = mEntries.rbegin(); it != mEntries.rend(); ++it) {
+        if (it->mKey == key) {
+            std::shared_ptr<C2GraphicAllocation> allocation = std::move(it->mAllocation);
+            mEntries.erase(std::next(it).base());
+            ALOGV("%s(): recycled allocation, %zu left", __func__, mEntries.size());
+            return allocation;
+        }
+    }
+    return nullptr;
+}
+
+void GraphicAllocationCache::put(const AllocationKey& key,
+                                 std::shared_ptr<C2GraphicAllocation> allocation) {
+    if (mSuspended.load()) {
+        ALOGV("%s(): cache suspended, freeing allocation", __func__);
+        return;
+    }
+
+    // Free the evicted allocation outside the lock.
+    std::shared_ptr<C2GraphicAllocation> evicted;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mEntries.size() >= mMaxSize) {
+        evicted = std::move(mEntries.front().mAllocation);
+        mEntries.pop_front();
+    }
+    mEntries.push_back({key, std::move(allocation), ::base::TimeTicks::Now() + mTtl});
+    schedulePurgeLocked(mTtl);
+}
+
+void GraphicAllocationCache::clear() {
+    std::list<Entry> entries;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        entries.swap(mEntries);
+    }
+    ALOGV("%s(): freeing %zu cached allocations", __func__, entries.size());
+}
+
+void GraphicAllocationCache::schedulePurgeLocked(::base::TimeDelta delay) {
+    if (mPurgeScheduled) return;
+
+    if (!mPurgeThread) {
+        auto thread = std::make_unique<::base::Thread>("GraphicAllocationCacheThread");
+        if (!thread->Start()) {
+            ALOGE("%s(): failed to start the purge thread, disabling the cache.", __func__);
+            mEntries.clear();
+            return;
+        }
+        mPurgeThread = std::move(thread);
+    }
+
+    mPurgeThread->task_runner()->PostDelayedTask(
+            FROM_HERE,
+            ::base::BindOnce(&GraphicAllocationCache::purgeTask, ::base::Unretained(this)),
+            delay);
+    mPurgeScheduled = true;
+}
+
+void GraphicAllocationCache::purgeTask() {
+    std::vector<std::shared_ptr<C2GraphicAllocation>> expired;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mPurgeScheduled = false;
+
+    const ::base::TimeTicks now = ::base::TimeTicks::Now();
+    while (!mEntries.empty() && mEntries.front().mExpiry <= now) {
+        expired.push_back(std::move(mEntries.front().mAllocation));
+        mEntries.pop_front();
+    }
+    ALOGV("%s(): freeing %zu expired allocations, %zu left", __func__, expired.size(),
+          mEntries.size());
+
+    if (!mEntries.empty()) schedulePurgeLocked(mEntries.front().mExpiry - now);
+}
+
+}  // namespace
+
+// static
+std::shared_ptr<C2Allocator> C2CachingGraphicAllocator::Wrap(
+        std::shared_ptr<C2Allocator> allocator) {
+    if (!allocator || !GraphicAllocationCache::getInstance()->isEnabled()) return allocator;
+    return std::shared_ptr<C2Allocator>(new C2CachingGraphicAllocator(std::move(allocator)));
+}
+
+// static
+void C2CachingGraphicAllocator::Trim() {
+    GraphicAllocationCache::getInstance()->clear();
+}
+
+// static
+void C2CachingGraphicAllocator::SetEnabled(bool enabled) {
+    GraphicAllocationCache::getInstance()->setSuspended(!enabled);
+}
+
+c2_status_t C2CachingGraphicAllocator::newGraphicAllocation(
+        uint32_t width, uint32_t height, uint32_t format, C2MemoryUsage usage,
+        std::shared_ptr<C2GraphicAllocation>* allocation) {
+    ALOGV("%s(%ux%u, format=0x%x, usage=%" PRIx64 ")", __func__, width, height, format,
+          usage.expected);
+
+    const AllocationKey key = {mAllocator->getId(), width, height, format, usage.expected};
+    std::shared_ptr<C2GraphicAllocation> cached = GraphicAllocationCache::getInstance()->take(key);
+    if (!cached) {
+        const c2_status_t status =
+                mAllocator->newGraphicAllocation(width, height, format, usage, &cached);
+        if (status != C2_OK) return status;
+    }
+
+    // Hand out an alias of the allocation, which moves the allocation back into the cache instead
+    // of freeing it once the last reference is dropped.
+    C2GraphicAllocation* rawAllocation = cached.get();
+    *allocation = std::shared_ptr<C2GraphicAllocation>(
+            rawAllocation, [key, holder = std::move(cached)](C2GraphicAllocation*) mutable {
+                GraphicAllocationCache::getInstance()->put(key, std::move(holder));
+            });
+    return C2_OK;
+}
+
+}  // namespace android
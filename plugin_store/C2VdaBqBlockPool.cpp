@@ -11,6 +11,7 @@
 #include <string.h>
 
 #include <chrono>
+#include <list>
 #include <mutex>
 #include <set>
 #include <sstream>
@@ -22,6 +23,7 @@
 #include <android/hardware/graphics/bufferqueue/2.0/IProducerListener.h>
 #include <base/callback.h>
 #include <log/log.h>
+#include <system/window.h>
 #include <ui/BufferQueueDefs.h>
 
 #include <v4l2_codec2/plugin_store/DmabufHelpers.h>
@@ -163,6 +165,7 @@ public:
         mSlotId2PoolData.clear();
         mAllocationsRegistered.clear();
         mAllocationsToBeMigrated.clear();
+        mHandle2UniqueId.clear();
         mMigrateLostBufferCounter = 0;
         mGenerationToBeMigrated = 0;
     }
@@ -171,9 +174,24 @@ public:
         ALOGV("%s(uniqueId=%u)", __func__, uniqueId);
         ALOG_ASSERT(allocation != nullptr);
 
+        mHandle2UniqueId[allocation->handle()] = uniqueId;
         mAllocationsRegistered[uniqueId] = std::move(allocation);
     }
 
+    // Get the unique ID of the tracked allocation with specified |handle|, so the ID of the blocks
+    // created from it is known without a syscall. Returns std::nullopt if the handle is unknown.
+    std::optional<unique_id_t> findUniqueIdByHandle(const C2Handle* handle) {
+        const auto iter = mHandle2UniqueId.find(handle);
+        if (iter == mHandle2UniqueId.end()) return std::nullopt;
+
+        // The handle of a freed allocation might be reused by another one, its entry is dropped.
+        if (!isTrackedAllocationHandle(iter->second, handle)) {
+            mHandle2UniqueId.erase(iter);
+            return std::nullopt;
+        }
+        return iter->second;
+    }
+
     std::shared_ptr<C2GraphicAllocation> getRegisteredAllocation(unique_id_t uniqueId) {
         const auto iter = mAllocationsRegistered.find(uniqueId);
         ALOG_ASSERT(iter != mAllocationsRegistered.end());
@@ -274,6 +292,16 @@ public:
         return true;
     }
 
+    // Returns whether any tracked buffer is owned by the CCodec framework, i.e. its pool data isn't
+    // alive in the component.
+    bool hasRemoteBuffers() const {
+        size_t numLocalBuffers = 0;
+        for (const auto& pair : mSlotId2PoolData) {
+            if (!pair.second.expired()) ++numLocalBuffers;
+        }
+        return numLocalBuffers < size();
+    }
+
     bool needMigrateLostBuffers() const {
         return mMigrateLostBufferCounter == 0 && !mAllocationsToBeMigrated.empty();
     }
@@ -368,6 +396,14 @@ public:
     }
 
 private:
+    bool isTrackedAllocationHandle(unique_id_t uniqueId, const C2Handle* handle) const {
+        for (const auto* allocations : {&mAllocationsRegistered, &mAllocationsToBeMigrated}) {
+            const auto iter = allocations->find(uniqueId);
+            if (iter != allocations->end() && iter->second->handle() == handle) return true;
+        }
+        return false;
+    }
+
     bool moveBufferToRegistered(unique_id_t uniqueId) {
         ALOGV("%s(uniqueId=%u)", __func__, uniqueId);
         auto iter = mAllocationsToBeMigrated.find(uniqueId);
@@ -395,6 +431,9 @@ private:
     // Track the buffers that should be migrated to the current producer.
     std::map<unique_id_t, std::shared_ptr<C2GraphicAllocation>> mAllocationsToBeMigrated;
 
+    // The unique IDs of the allocations registered, indexed by their handle.
+    std::map<const C2Handle*, unique_id_t> mHandle2UniqueId;
+
     // The counter for migrating lost buffers. Count down when a buffer is
     // dequeued from IGBP. When it goes to 0, then we treat the remaining
     // buffers at |mAllocationsToBeMigrated| lost, and migrate them to
@@ -418,15 +457,19 @@ public:
     // EventNotifier::Listener implementation.
     void onEventNotified() override;
 
+    // If |pendingFence| is given, an unsignaled acquire fence is returned instead of waiting for
+    // it. Otherwise |pendingFence| is left untouched.
     c2_status_t fetchGraphicBlock(uint32_t width, uint32_t height, uint32_t format,
                                   C2MemoryUsage usage,
-                                  std::shared_ptr<C2GraphicBlock>* block /* nonnull */);
+                                  std::shared_ptr<C2GraphicBlock>* block /* nonnull */,
+                                  sp<Fence>* pendingFence);
     void setRenderCallback(const C2BufferQueueBlockPool::OnRenderCallback& renderCallback);
     void configureProducer(const sp<HGraphicBufferProducer>& producer);
     c2_status_t requestNewBufferSet(int32_t bufferCount, uint32_t width, uint32_t height,
                                     uint32_t format, C2MemoryUsage usage);
     bool setNotifyBlockAvailableCb(::base::OnceClosure cb);
     std::optional<unique_id_t> getBufferIdFromGraphicBlock(const C2Block2D& block);
+    std::optional<uint64_t> getConsumerUsage();
 
 private:
     // Requested buffer formats.
@@ -451,9 +494,21 @@ private:
                                            C2AndroidMemoryUsage androidUsage, uint32_t* generation,
                                            uint64_t* usage);
 
+    // Migrate the local buffers to the producer configured by the last surface switch. The
+    // generation and usage of the new producer are obtained from a buffer dequeued from it, which
+    // is usually a remote buffer already migrated by the CCodec framework, so no buffer needs to
+    // be allocated. Returns TIMED_OUT if no buffer can be dequeued from the new producer yet.
+    status_t migrateLocalBuffersLocked(uint32_t width, uint32_t height, uint32_t format,
+                                       C2MemoryUsage usage);
+
     // Wait the fence. If any error occurs, cancel the buffer back to the producer.
     status_t waitFence(slot_t slot, sp<Fence> fence);
 
+    // Call |mRenderCallback| with the signal time of the acquire fence of |slot|, if valid.
+    void reportRenderedLocked(uint64_t producerId, slot_t slot, nsecs_t signalTime);
+    // Report the signal times of the fences in |mPendingRenderFences| that have signaled.
+    void reportSignaledFencesLocked();
+
     // Call mProducer's allowAllocation if needed.
     status_t allowAllocation(bool allow);
 
@@ -464,6 +519,14 @@ private:
     bool mAllowAllocation = false;
 
     C2BufferQueueBlockPool::OnRenderCallback mRenderCallback;
+    // The acquire fences returned to the caller unsignaled, whose signal time isn't reported to
+    // |mRenderCallback| yet.
+    struct PendingRenderFence {
+        uint64_t mProducerId;
+        slot_t mSlot;
+        sp<Fence> mFence;
+    };
+    std::list<PendingRenderFence> mPendingRenderFences;
 
     // Function mutex to lock at the start of each API function call for protecting the
     // synchronization of all member variables.
@@ -488,6 +551,9 @@ private:
 
     // Set to true if any error occurs at previous configureProducer().
     bool mConfigureProducerError = false;
+    // Set to true when the producer was switched, until the local buffers are migrated to the new
+    // producer on the next fetch.
+    bool mPendingLocalMigration = false;
 };
 
 C2VdaBqBlockPool::Impl::Impl(const std::shared_ptr<C2Allocator>& allocator)
@@ -495,10 +561,12 @@ C2VdaBqBlockPool::Impl::Impl(const std::shared_ptr<C2Allocator>& allocator)
 
 c2_status_t C2VdaBqBlockPool::Impl::fetchGraphicBlock(
         uint32_t width, uint32_t height, uint32_t format, C2MemoryUsage usage,
-        std::shared_ptr<C2GraphicBlock>* block /* nonnull */) {
+        std::shared_ptr<C2GraphicBlock>* block /* nonnull */, sp<Fence>* pendingFence) {
     ALOGV("%s(%ux%u)", __func__, width, height);
     std::lock_guard<std::mutex> lock(mMutex);
 
+    reportSignaledFencesLocked();
+
     if (width != mBufferFormat.mWidth || height != mBufferFormat.mHeight ||
         format != mBufferFormat.mPixelFormat || usage.expected != mBufferFormat.mUsage.expected) {
         ALOGE("%s(): buffer format (%ux%u, format=%u, usage=%" PRIx64
@@ -577,27 +645,59 @@ c2_status_t C2VdaBqBlockPool::Impl::fetchGraphicBlock(
 
     // Wait for acquire fence at the last point of returning buffer.
     if (fence) {
+        if (pendingFence && fence->wait(0) == -ETIME) {
+            // The caller waits for the fence, its signal time is reported on a later fetch.
+            ALOGV("%s(): returning slot=%d with a pending fence", __func__, slot);
+            mPendingRenderFences.push_back({mProducerId, slot, fence});
+            *pendingFence = std::move(fence);
+            return C2_OK;
+        }
+
         const auto fenceStatus = waitFence(slot, fence);
         if (fenceStatus != OK) {
             return asC2Error(fenceStatus);
         }
-
-        if (mRenderCallback) {
-            nsecs_t signalTime = fence->getSignalTime();
-            if (signalTime >= 0 && signalTime < INT64_MAX) {
-                mRenderCallback(mProducerId, slot, signalTime);
-            } else {
-                ALOGV("got fence signal time of %" PRId64 " nsec", signalTime);
-            }
-        }
+        reportRenderedLocked(mProducerId, slot, fence->getSignalTime());
     }
 
     return C2_OK;
 }
 
+void C2VdaBqBlockPool::Impl::reportRenderedLocked(uint64_t producerId, slot_t slot,
+                                                  nsecs_t signalTime) {
+    if (!mRenderCallback) {
+        return;
+    }
+    if (signalTime >= 0 && signalTime < INT64_MAX) {
+        mRenderCallback(producerId, slot, signalTime);
+    } else {
+        ALOGV("got fence signal time of %" PRId64 " nsec", signalTime);
+    }
+}
+
+void C2VdaBqBlockPool::Impl::reportSignaledFencesLocked() {
+    auto it = mPendingRenderFences.begin();
+    while (it != mPendingRenderFences.end()) {
+        const nsecs_t signalTime = it->mFence->getSignalTime();
+        if (signalTime == Fence::SIGNAL_TIME_PENDING) {
+            ++it;
+            continue;
+        }
+        reportRenderedLocked(it->mProducerId, it->mSlot, signalTime);
+        it = mPendingRenderFences.erase(it);
+    }
+}
+
 status_t C2VdaBqBlockPool::Impl::getFreeSlotLocked(uint32_t width, uint32_t height, uint32_t format,
                                                    C2MemoryUsage usage, slot_t* slot,
                                                    sp<Fence>* fence) {
+    if (mPendingLocalMigration) {
+        const auto migrateStatus = migrateLocalBuffersLocked(width, height, format, usage);
+        if (migrateStatus != OK) {
+            return migrateStatus;
+        }
+    }
+
     if (mTrackedGraphicBuffers.needMigrateLostBuffers()) {
         slot_t newSlot;
         if (mTrackedGraphicBuffers.migrateLostBuffer(mAllocator.get(), mProducer.get(), mProducerId,
@@ -699,6 +799,64 @@ status_t C2VdaBqBlockPool::Impl::queryGenerationAndUsageLocked(uint32_t width, u
     return OK;
 }
 
+status_t C2VdaBqBlockPool::Impl::migrateLocalBuffersLocked(uint32_t width, uint32_t height,
+                                                           uint32_t format, C2MemoryUsage usage) {
+    ALOGV("%s()", __func__);
+    ALOG_ASSERT(mPendingLocalMigration);
+
+    uint32_t newGeneration = 0;
+    uint64_t newUsage = 0;
+    sp<Fence> fence = new Fence();
+    slot_t slot;
+    const auto dequeueStatus =
+            mProducer->dequeueBuffer(width, height, format, usage, &slot, &fence);
+    if (dequeueStatus == OK || dequeueStatus == BUFFER_NEEDS_REALLOCATION) {
+        // The buffer is returned to the producer right away, it is dequeued again by the caller.
+        sp<GraphicBuffer> slotBuffer = new GraphicBuffer();
+        const auto requestStatus = mProducer->requestBuffer(slot, &slotBuffer);
+        const auto cancelStatus = mProducer->cancelBuffer(slot, fence);
+        if (requestStatus != OK) {
+            return requestStatus;
+        }
+        if (cancelStatus != OK) {
+            return cancelStatus;
+        }
+        newGeneration = slotBuffer->getGenerationNumber();
+        newUsage = slotBuffer->getUsage();
+    } else if ((dequeueStatus == TIMED_OUT || dequeueStatus == WOULD_BLOCK) &&
+               mTrackedGraphicBuffers.hasRemoteBuffers()) {
+        // The remote buffers will be released to the new producer once they are rendered.
+        std::lock_guard<std::mutex> lock(mBufferReleaseMutex);
+        mBufferReleasedAfterTimedOut = false;
+        return TIMED_OUT;
+    } else {
+        // All buffers are owned by the component, so no buffer will ever be available at the new
+        // producer until the local buffers are migrated. Fall back to a temporary buffer.
+        ALOGD("%s(): no buffer available at the new producer (%d), query with a temporary buffer",
+              __func__, dequeueStatus);
+        if (allowAllocation(true) != OK) {
+            return UNKNOWN_ERROR;
+        }
+        const status_t err = queryGenerationAndUsageLocked(
+                mBufferFormat.mWidth, mBufferFormat.mHeight, mBufferFormat.mPixelFormat,
+                mBufferFormat.mUsage, &newGeneration, &newUsage);
+        if (err != OK) {
+            ALOGE("failed to query generation and usage: %d", err);
+            return err;
+        }
+    }
+
+    if (!mTrackedGraphicBuffers.migrateLocalBuffers(mProducer.get(), mProducerId, newGeneration,
+                                                    newUsage)) {
+        ALOGE("%s(): failed to migrateLocalBuffers()", __func__);
+        mConfigureProducerError = true;
+        return UNKNOWN_ERROR;
+    }
+    mPendingLocalMigration = false;
+
+    return allowAllocation(mTrackedGraphicBuffers.size() < mBuffersRequested);
+}
+
 status_t C2VdaBqBlockPool::Impl::waitFence(slot_t slot, sp<Fence> fence) {
     const auto fenceStatus = fence->wait(kFenceWaitTimeMs);
     if (fenceStatus == OK) {
@@ -757,6 +915,7 @@ c2_status_t C2VdaBqBlockPool::Impl::requestNewBufferSet(int32_t bufferCount, uin
     // Release all remained slot buffer references here. CCodec should either cancel or queue its
     // owned buffers from this set before the next resolution change.
     mTrackedGraphicBuffers.reset();
+    mPendingLocalMigration = false;
 
     mBuffersRequested = static_cast<size_t>(bufferCount);
 
@@ -776,6 +935,7 @@ void C2VdaBqBlockPool::Impl::configureProducer(const sp<HGraphicBufferProducer>&
         mProducer = nullptr;
         mProducerId = 0;
         mTrackedGraphicBuffers.reset();
+        mPendingLocalMigration = false;
         return;
     }
 
@@ -798,8 +958,12 @@ void C2VdaBqBlockPool::Impl::configureProducer(const sp<HGraphicBufferProducer>&
     mConfigureProducerError = false;
     mAllowAllocation = false;
 
-    // Set allowAllocation to new producer.
-    if (allowAllocation(true) != OK) {
+    // Migrating the local buffers is deferred to the next fetch. Until then, only allow allocation
+    // while the buffer set isn't complete. Buffers migrated by the CCodec framework can be
+    // dequeued without allocating, and provide the generation and usage of the new producer.
+    const bool pendingLocalMigration = mTrackedGraphicBuffers.size() > 0;
+    if (allowAllocation(!pendingLocalMigration ||
+                        mTrackedGraphicBuffers.size() < mBuffersRequested) != OK) {
         ALOGE("%s(): failed to allowAllocation(true)", __func__);
         mConfigureProducerError = true;
         return;
@@ -815,34 +979,7 @@ void C2VdaBqBlockPool::Impl::configureProducer(const sp<HGraphicBufferProducer>&
         return;
     }
 
-    // Migrate existing buffers to the new producer.
-    if (mTrackedGraphicBuffers.size() > 0) {
-        uint32_t newGeneration = 0;
-        uint64_t newUsage = 0;
-        const status_t err = queryGenerationAndUsageLocked(
-                mBufferFormat.mWidth, mBufferFormat.mHeight, mBufferFormat.mPixelFormat,
-                mBufferFormat.mUsage, &newGeneration, &newUsage);
-        if (err != OK) {
-            ALOGE("failed to query generation and usage: %d", err);
-            mConfigureProducerError = true;
-            return;
-        }
-
-        if (!mTrackedGraphicBuffers.migrateLocalBuffers(mProducer.get(), mProducerId, newGeneration,
-                                                        newUsage)) {
-            ALOGE("%s(): failed to migrateLocalBuffers()", __func__);
-            mConfigureProducerError = true;
-            return;
-        }
-
-        if (mTrackedGraphicBuffers.size() == mBuffersRequested) {
-            if (allowAllocation(false) != OK) {
-                ALOGE("%s(): failed to allowAllocation(false)", __func__);
-                mConfigureProducerError = true;
-                return;
-            }
-        }
-    }
+    mPendingLocalMigration = pendingLocalMigration;
 
     // hack(b/146409777): Try to connect ARC-specific listener first.
     sp<BufferReleasedNotifier> listener = new BufferReleasedNotifier(weak_from_this());
@@ -884,9 +1021,35 @@ bool C2VdaBqBlockPool::Impl::setNotifyBlockAvailableCb(::base::OnceClosure cb) {
 
 std::optional<unique_id_t> C2VdaBqBlockPool::Impl::getBufferIdFromGraphicBlock(
         const C2Block2D& block) {
+    // The blocks fetched from the pool share the handle of a tracked allocation, whose ID was
+    // obtained when the buffer was requested from the producer.
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const std::optional<unique_id_t> uniqueId =
+                mTrackedGraphicBuffers.findUniqueIdByHandle(block.handle());
+        if (uniqueId) return uniqueId;
+    }
     return getDmabufId(block.handle()->data[0]);
 }
 
+std::optional<uint64_t> C2VdaBqBlockPool::Impl::getConsumerUsage() {
+    ALOGV("%s()", __func__);
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mProducer) {
+        ALOGW("%s() mProducer is not initiailzed", __func__);
+        return std::nullopt;
+    }
+
+    int usage = 0;
+    const int status = mProducer->query(NATIVE_WINDOW_CONSUMER_USAGE_BITS, &usage);
+    if (status != OK) {
+        ALOGE("%s(): failed to query consumer usage: %d", __func__, status);
+        return std::nullopt;
+    }
+    return static_cast<uint32_t>(usage);
+}
+
 status_t C2VdaBqBlockPool::Impl::allowAllocation(bool allow) {
     ALOGV("%s(%d)", __func__, allow);
 
@@ -913,11 +1076,33 @@ c2_status_t C2VdaBqBlockPool::fetchGraphicBlock(
         uint32_t width, uint32_t height, uint32_t format, C2MemoryUsage usage,
         std::shared_ptr<C2GraphicBlock>* block /* nonnull */) {
     if (mImpl) {
-        return mImpl->fetchGraphicBlock(width, height, format, usage, block);
+        return mImpl->fetchGraphicBlock(width, height, format, usage, block, nullptr);
     }
     return C2_NO_INIT;
 }
 
+c2_status_t C2VdaBqBlockPool::fetchGraphicBlockWithFence(
+        uint32_t width, uint32_t height, uint32_t format, C2MemoryUsage usage,
+        std::shared_ptr<C2GraphicBlock>* block /* nonnull */,
+        ::base::ScopedFD* fenceFd /* nonnull */) {
+    if (!mImpl) {
+        return C2_NO_INIT;
+    }
+
+    sp<Fence> fence;
+    const c2_status_t status =
+            mImpl->fetchGraphicBlock(width, height, format, usage, block, &fence);
+    if (status == C2_OK && fence) {
+        fenceFd->reset(fence->dup());
+        if (!fenceFd->is_valid()) {
+            ALOGE("%s(): failed to duplicate the acquire fence", __func__);
+            block->reset();
+            return C2_CORRUPTED;
+        }
+    }
+    return status;
+}
+
 void C2VdaBqBlockPool::setRenderCallback(
         const C2BufferQueueBlockPool::OnRenderCallback& renderCallback) {
     if (mImpl) {
@@ -955,4 +1140,11 @@ std::optional<unique_id_t> C2VdaBqBlockPool::getBufferIdFromGraphicBlock(const C
     return std::nullopt;
 }
 
+std::optional<uint64_t> C2VdaBqBlockPool::getConsumerUsage() {
+    if (mImpl) {
+        return mImpl->getConsumerUsage();
+    }
+    return std::nullopt;
+}
+
 }  // namespace android
@@ -9,6 +9,9 @@
 
 #include <time.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include <C2BlockInternal.h>
 #include <bufferpool/BufferPoolTypes.h>
 #include <log/log.h>
@@ -17,8 +20,68 @@ namespace android {
 
 using android::hardware::media::bufferpool::BufferPoolData;
 
+// A C2Allocator decorator refusing new allocations while the pool doesn't allow them. Bufferpool
+// calls the allocator synchronously from C2PooledBlockPool::fetchGraphicBlock(), so the state is
+// only changed and checked by fetchGraphicBlock() with the pool's mutex held.
+class C2VdaPooledBlockPool::GatedAllocator : public C2Allocator {
+public:
+    explicit GatedAllocator(std::shared_ptr<C2Allocator> allocator)
+          : mAllocator(std::move(allocator)) {}
+    ~GatedAllocator() override = default;
+
+    // Allow or refuse the next allocations, and reset whether an allocation was refused.
+    void setAllocationAllowed(bool allowed) {
+        mAllocationAllowed = allowed;
+        mAllocationRefused = false;
+    }
+    // Whether an allocation was refused since setAllocationAllowed() was called.
+    bool isAllocationRefused() const { return mAllocationRefused; }
+
+    // C2Allocator implementation.
+    id_t getId() const override { return mAllocator->getId(); }
+    C2String getName() const override { return mAllocator->getName(); }
+    std::shared_ptr<const Traits> getTraits() const override { return mAllocator->getTraits(); }
+    c2_status_t newGraphicAllocation(uint32_t width, uint32_t height, uint32_t format,
+                                     C2MemoryUsage usage,
+                                     std::shared_ptr<C2GraphicAllocation>* allocation) override {
+        if (!mAllocationAllowed) {
+            mAllocationRefused = true;
+            return C2_NO_MEMORY;
+        }
+        return mAllocator->newGraphicAllocation(width, height, format, usage, allocation);
+    }
+    c2_status_t priorGraphicAllocation(const C2Handle* handle,
+                                       std::shared_ptr<C2GraphicAllocation>* allocation) override {
+        return mAllocator->priorGraphicAllocation(handle, allocation);
+    }
+    c2_status_t newLinearAllocation(uint32_t capacity, C2MemoryUsage usage,
+                                    std::shared_ptr<C2LinearAllocation>* allocation) override {
+        return mAllocator->newLinearAllocation(capacity, usage, allocation);
+    }
+    c2_status_t priorLinearAllocation(const C2Handle* handle,
+                                      std::shared_ptr<C2LinearAllocation>* allocation) override {
+        return mAllocator->priorLinearAllocation(handle, allocation);
+    }
+    bool checkHandle(const C2Handle* const handle) const override {
+        return mAllocator->checkHandle(handle);
+    }
+
+private:
+    const std::shared_ptr<C2Allocator> mAllocator;
+    std::atomic<bool> mAllocationAllowed{true};
+    std::atomic<bool> mAllocationRefused{false};
+};
+
+C2VdaPooledBlockPool::C2VdaPooledBlockPool(const std::shared_ptr<C2Allocator>& allocator,
+                                           const local_id_t localId)
+      : C2VdaPooledBlockPool(localId, std::make_shared<GatedAllocator>(allocator)) {}
+
+C2VdaPooledBlockPool::C2VdaPooledBlockPool(const local_id_t localId,
+                                           std::shared_ptr<GatedAllocator> allocator)
+      : C2PooledBlockPool(allocator, localId), mAllocator(std::move(allocator)) {}
+
 // static
-std::optional<uint32_t> C2VdaPooledBlockPool::getBufferIdFromGraphicBlock(const C2Block2D& block) {
+std::optional<uint32_t> C2VdaPooledBlockPool::getBufferPoolId(const C2Block2D& block) {
     std::shared_ptr<_C2BlockPoolData> blockPoolData =
             _C2BlockFactory::GetGraphicBlockPoolData(block);
     if (blockPoolData->getType() != _C2BlockPoolData::TYPE_BUFFERPOOL) {
@@ -33,42 +96,172 @@ std::optional<uint32_t> C2VdaPooledBlockPool::getBufferIdFromGraphicBlock(const
     return bpData->mId;
 }
 
-// Tries to fetch a buffer from bufferpool. When the size of |mBufferIds| is smaller than
-// |mBufferCount|, pass the obtained buffer to caller and record its ID in BufferPoolData to
-// |mBufferIds|. When the size of |mBufferIds| is equal to |mBufferCount|, pass the obtained
-// buffer only if its ID is included in |mBufferIds|. Otherwise, discard the buffer and
-// return C2_TIMED_OUT.
+std::optional<uint32_t> C2VdaPooledBlockPool::getBufferIdFromGraphicBlock(const C2Block2D& block) {
+    std::optional<uint32_t> bufferPoolId = getBufferPoolId(block);
+    if (!bufferPoolId) {
+        return std::nullopt;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mSlotIndices.find(*bufferPoolId);
+    if (it == mSlotIndices.end()) {
+        ALOGE("Block with bufferpool id %u is not tracked by the pool.", *bufferPoolId);
+        return std::nullopt;
+    }
+    return static_cast<uint32_t>(it->second);
+}
+
+// Tries to fetch a buffer from bufferpool. Bufferpool recycles a buffer once all clients released
+// it, including the remote client the block was passed to, and only asks the allocator for a new
+// buffer if none is free. While less than |mBufferCount| buffers are tracked, bufferpool may
+// allocate and every buffer obtained is assigned a slot. Once all slots are taken, allocations are
+// refused, so bufferpool can only return one of the buffers it already has. This way the pool never
+// allocates more than |mBufferCount| buffers, and never drops a buffer it allocated.
 c2_status_t C2VdaPooledBlockPool::fetchGraphicBlock(uint32_t width, uint32_t height,
                                                     uint32_t format, C2MemoryUsage usage,
                                                     std::shared_ptr<C2GraphicBlock>* block) {
     ALOG_ASSERT(block != nullptr);
     std::lock_guard<std::mutex> lock(mMutex);
 
-    std::shared_ptr<C2GraphicBlock> fetchBlock;
-    c2_status_t err =
-            C2PooledBlockPool::fetchGraphicBlock(width, height, format, usage, &fetchBlock);
-    if (err != C2_OK) {
-        ALOGE("Failed at C2PooledBlockPool::fetchGraphicBlock: %d", err);
-        return err;
+    const bool slotsFull = mSlots.size() >= mBufferCount;
+    if (slotsFull) {
+        // Reset the release state before looking for released blocks, so a block released while
+        // fetching times out still triggers the block-available notification.
+        {
+            std::lock_guard<std::mutex> releaseLock(mBufferReleaseMutex);
+            mBufferReleasedAfterTimedOut = false;
+        }
+        // Bufferpool can't recycle a buffer whose block is still used locally, so don't bother
+        // asking it.
+        if (!hasLocallyReleasedSlotLocked()) {
+            ALOGV("No buffer could be recycled now, wait for another try...");
+            return C2_TIMED_OUT;
+        }
     }
 
-    std::optional<uint32_t> bufferId = getBufferIdFromGraphicBlock(*fetchBlock);
-    if (!bufferId) {
-        ALOGE("Failed to getBufferIdFromGraphicBlock");
-        return C2_CORRUPTED;
-    }
+    while (true) {
+        mAllocator->setAllocationAllowed(!slotsFull);
+        std::shared_ptr<C2GraphicBlock> fetchBlock;
+        c2_status_t err =
+                C2PooledBlockPool::fetchGraphicBlock(width, height, format, usage, &fetchBlock);
+        if (err != C2_OK) {
+            if (mAllocator->isAllocationRefused()) {
+                ALOGV("No buffer was released by all clients yet, wait for another try...");
+                return C2_TIMED_OUT;
+            }
+            ALOGE("Failed at C2PooledBlockPool::fetchGraphicBlock: %d", err);
+            return err;
+        }
 
-    if (mBufferIds.size() < mBufferCount) {
-        mBufferIds.insert(*bufferId);
-    }
+        std::optional<uint32_t> bufferPoolId = getBufferPoolId(*fetchBlock);
+        if (!bufferPoolId) {
+            ALOGE("Failed to getBufferPoolId");
+            return C2_CORRUPTED;
+        }
+
+        std::optional<size_t> slot = assignSlotLocked(*bufferPoolId, *fetchBlock);
+        if (!slot) {
+            // Bufferpool recycled a compatible buffer of a previous buffer set. Keep it until the
+            // next buffer set is requested, otherwise bufferpool would keep returning it instead
+            // of the tracked buffers.
+            ALOGV("Buffer id %u isn't tracked, keeping it out of the pool", *bufferPoolId);
+            mUntrackedBlocks.push_back(std::move(fetchBlock));
+            continue;
+        }
 
-    if (mBufferIds.find(*bufferId) != mBufferIds.end()) {
-        ALOGV("Returned buffer id = %u", *bufferId);
+        ALOGV("Returned buffer id = %u (slot %zu)", *bufferPoolId, *slot);
         *block = std::move(fetchBlock);
         return C2_OK;
     }
-    ALOGV("No buffer could be recycled now, wait for another try...");
-    return C2_TIMED_OUT;
+}
+
+bool C2VdaPooledBlockPool::hasLocallyReleasedSlotLocked() const {
+    return std::any_of(mSlots.begin(), mSlots.end(),
+                       [](const Slot& slot) { return slot.poolData.expired(); });
+}
+
+std::optional<size_t> C2VdaPooledBlockPool::assignSlotLocked(uint32_t bufferPoolId,
+                                                            const C2Block2D& block) {
+    size_t index;
+    auto it = mSlotIndices.find(bufferPoolId);
+    if (it != mSlotIndices.end()) {
+        index = it->second;
+    } else if (mSlots.size() < mBufferCount) {
+        index = mSlots.size();
+        mSlots.push_back({bufferPoolId});
+        mSlotIndices.emplace(bufferPoolId, index);
+    } else {
+        return std::nullopt;
+    }
+
+    mSlots[index].poolData = _C2BlockFactory::GetGraphicBlockPoolData(block);
+    return index;
+}
+
+void C2VdaPooledBlockPool::setNotifyBlockAvailableCb(::base::OnceClosure cb) {
+    ALOGV("%s()", __func__);
+
+    ::base::OnceClosure outputCb;
+    {
+        std::lock_guard<std::mutex> lock(mBufferReleaseMutex);
+
+        // If there is any block released after fetching timed out, then we could notify the
+        // caller directly.
+        if (mBufferReleasedAfterTimedOut) {
+            mBufferReleasedAfterTimedOut = false;
+            outputCb = std::move(cb);
+        } else {
+            mNotifyBlockAvailableCb = std::move(cb);
+        }
+    }
+
+    // Calling the callback outside the lock to avoid the deadlock.
+    if (outputCb) {
+        std::move(outputCb).Run();
+    }
+}
+
+// static
+void C2VdaPooledBlockPool::notifyBlockAvailableOnDestroy(
+        const std::shared_ptr<C2VdaPooledBlockPool>& pool, C2Buffer* buffer) {
+    ALOG_ASSERT(pool != nullptr && buffer != nullptr);
+
+    // The pool might be destroyed before the buffer, so only keep a weak reference. The reference
+    // is owned by the notification and deleted when the notification is executed.
+    auto* weakPool = new std::weak_ptr<C2VdaPooledBlockPool>(pool);
+    c2_status_t status = buffer->registerOnDestroyNotify(
+            [](const C2Buffer* /*buf*/, void* arg) {
+                auto* weakPool = static_cast<std::weak_ptr<C2VdaPooledBlockPool>*>(arg);
+                if (std::shared_ptr<C2VdaPooledBlockPool> pool = weakPool->lock()) {
+                    pool->onBlockReleased();
+                }
+                delete weakPool;
+            },
+            weakPool);
+    if (status != C2_OK) {
+        ALOGE("Failed to register on-destroy notification: %d", status);
+        delete weakPool;
+    }
+}
+
+void C2VdaPooledBlockPool::onBlockReleased() {
+    ALOGV("%s()", __func__);
+
+    ::base::OnceClosure outputCb;
+    {
+        std::lock_guard<std::mutex> lock(mBufferReleaseMutex);
+
+        mBufferReleasedAfterTimedOut = true;
+        if (mNotifyBlockAvailableCb) {
+            mBufferReleasedAfterTimedOut = false;
+            outputCb = std::move(mNotifyBlockAvailableCb);
+        }
+    }
+
+    // Calling the callback outside the lock to avoid the deadlock.
+    if (outputCb) {
+        std::move(outputCb).Run();
+    }
 }
 
 c2_status_t C2VdaPooledBlockPool::requestNewBufferSet(int32_t bufferCount) {
@@ -78,7 +271,9 @@ c2_status_t C2VdaPooledBlockPool::requestNewBufferSet(int32_t bufferCount) {
     }
 
     std::lock_guard<std::mutex> lock(mMutex);
-    mBufferIds.clear();
+    mSlots.clear();
+    mSlotIndices.clear();
+    mUntrackedBlocks.clear();
     mBufferCount = bufferCount;
     return C2_OK;
 }
@@ -8,6 +8,7 @@
 #include <v4l2_codec2/plugin_store/H2BGraphicBufferProducer.h>
 
 #include <log/log.h>
+#include <system/window.h>
 #include <types.h>
 #include <ui/BufferQueueDefs.h>
 
@@ -56,6 +57,8 @@ status_t H2BGraphicBufferProducer::requestBuffer(int slot, sp<GraphicBuffer>* bu
 }
 
 status_t H2BGraphicBufferProducer::setMaxDequeuedBufferCount(int maxDequeuedBuffers) {
+    if (mMaxDequeuedBufferCount == maxDequeuedBuffers) return OK;
+
     status_t status = UNKNOWN_ERROR;
     Return<HStatus> transResult =
             mBase->setMaxDequeuedBufferCount(static_cast<int32_t>(maxDequeuedBuffers));
@@ -70,6 +73,8 @@ status_t H2BGraphicBufferProducer::setMaxDequeuedBufferCount(int maxDequeuedBuff
     }
     if (status != OK) {
         ALOGD("%s() failed: %d", __func__, status);
+    } else {
+        mMaxDequeuedBufferCount = maxDequeuedBuffers;
     }
     return status;
 }
@@ -201,6 +206,13 @@ status_t H2BGraphicBufferProducer::cancelBuffer(int slot, const sp<Fence>& fence
 }
 
 int H2BGraphicBufferProducer::query(int what, int* value) {
+    // The consumer usage is set by the consumer when the buffer queue is created, so it's only
+    // queried once.
+    if (what == NATIVE_WINDOW_CONSUMER_USAGE_BITS && mConsumerUsage) {
+        *value = *mConsumerUsage;
+        return OK;
+    }
+
     int result = 0;
     Return<void> transResult =
             mBase->query(static_cast<int32_t>(what), [&result, value](int32_t r, int32_t v) {
@@ -212,6 +224,7 @@ int H2BGraphicBufferProducer::query(int what, int* value) {
         ALOGE("%s(): transaction failed: %s", __func__, transResult.description().c_str());
         return FAILED_TRANSACTION;
     }
+    if (what == NATIVE_WINDOW_CONSUMER_USAGE_BITS && result == OK) mConsumerUsage = *value;
     return result;
 }
 
@@ -270,6 +283,8 @@ status_t H2BGraphicBufferProducer::connect(sp<HProducerListener> const& hListene
 }
 
 status_t H2BGraphicBufferProducer::setDequeueTimeout(nsecs_t timeout) {
+    if (mDequeueTimeout == timeout) return OK;
+
     status_t status = UNKNOWN_ERROR;
     Return<HStatus> transResult = mBase->setDequeueTimeout(static_cast<int64_t>(timeout));
 
@@ -281,6 +296,7 @@ status_t H2BGraphicBufferProducer::setDequeueTimeout(nsecs_t timeout) {
         ALOGE("%s(): corrupted transaction.", __func__);
         return FAILED_TRANSACTION;
     }
+    if (status == OK) mDequeueTimeout = timeout;
     return status;
 }
 
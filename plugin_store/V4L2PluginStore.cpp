@@ -15,6 +15,7 @@
 #include <C2BufferPriv.h>
 #include <log/log.h>
 
+#include <v4l2_codec2/plugin_store/C2CachingGraphicAllocator.h>
 #include <v4l2_codec2/plugin_store/C2VdaBqBlockPool.h>
 #include <v4l2_codec2/plugin_store/C2VdaPooledBlockPool.h>
 #include <v4l2_codec2/plugin_store/V4L2AllocatorId.h>
@@ -53,6 +54,11 @@ std::shared_ptr<C2Allocator> fetchAllocator(C2Allocator::id_t allocatorId) {
     }
 
     allocator.reset(createAllocator(allocatorId));
+    // The buffers of the bufferpool-backed pool are allocated by us, so recycle them across pools.
+    // The buffers of BufferQueue-backed pools are allocated by the producer.
+    if (allocatorId == V4L2AllocatorId::V4L2_BUFFERPOOL) {
+        allocator = C2CachingGraphicAllocator::Wrap(std::move(allocator));
+    }
     sCacheAllocators[allocatorId] = allocator;
     return allocator;
 }
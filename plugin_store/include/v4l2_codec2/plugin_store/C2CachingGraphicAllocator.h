@@ -0,0 +1,66 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ANDROID_V4L2_CODEC2_PLUGIN_STORE_C2_CACHING_GRAPHIC_ALLOCATOR_H
+#define ANDROID_V4L2_CODEC2_PLUGIN_STORE_C2_CACHING_GRAPHIC_ALLOCATOR_H
+
+#include <memory>
+
+#include <C2Buffer.h>
+
+namespace android {
+
+// A C2Allocator decorator recycling the graphic allocations released by its users. Released
+// allocations are kept in a process-wide cache for a short time, and handed out again by the next
+// newGraphicAllocation() call with the same size, format and usage. This avoids reallocating the
+// output buffers when decoders of the same resolution are created back-to-back, e.g. in playlists.
+//
+// The cache size and the time allocations are kept can be configured using the
+// "ro.vendor.v4l2_codec2.allocation_cache_size" (default: 32 allocations) and
+// "ro.vendor.v4l2_codec2.allocation_cache_ttl_ms" (default: 3000ms) properties.
+class C2CachingGraphicAllocator : public C2Allocator {
+public:
+    // Wrap |allocator|, or return |allocator| itself if the cache is disabled by the properties.
+    static std::shared_ptr<C2Allocator> Wrap(std::shared_ptr<C2Allocator> allocator);
+    // Free all allocations currently kept in the cache, e.g. under memory pressure.
+    static void Trim();
+    // Free released allocations instead of caching them while |enabled| is false, e.g. under
+    // memory pressure.
+    static void SetEnabled(bool enabled);
+
+    ~C2CachingGraphicAllocator() override = default;
+
+    // C2Allocator implementation.
+    id_t getId() const override { return mAllocator->getId(); }
+    C2String getName() const override { return mAllocator->getName(); }
+    std::shared_ptr<const Traits> getTraits() const override { return mAllocator->getTraits(); }
+    c2_status_t newGraphicAllocation(uint32_t width, uint32_t height, uint32_t format,
+                                     C2MemoryUsage usage,
+                                     std::shared_ptr<C2GraphicAllocation>* allocation) override;
+    c2_status_t priorGraphicAllocation(const C2Handle* handle,
+                                       std::shared_ptr<C2GraphicAllocation>* allocation) override {
+        return mAllocator->priorGraphicAllocation(handle, allocation);
+    }
+    c2_status_t newLinearAllocation(uint32_t capacity, C2MemoryUsage usage,
+                                    std::shared_ptr<C2LinearAllocation>* allocation) override {
+        return mAllocator->newLinearAllocation(capacity, usage, allocation);
+    }
+    c2_status_t priorLinearAllocation(const C2Handle* handle,
+                                      std::shared_ptr<C2LinearAllocation>* allocation) override {
+        return mAllocator->priorLinearAllocation(handle, allocation);
+    }
+    bool checkHandle(const C2Handle* const handle) const override {
+        return mAllocator->checkHandle(handle);
+    }
+
+private:
+    explicit C2CachingGraphicAllocator(std::shared_ptr<C2Allocator> allocator)
+          : mAllocator(std::move(allocator)) {}
+
+    const std::shared_ptr<C2Allocator> mAllocator;
+};
+
+}  // namespace android
+
+#endif  // ANDROID_V4L2_CODEC2_PLUGIN_STORE_C2_CACHING_GRAPHIC_ALLOCATOR_H
@@ -13,6 +13,7 @@
 #include <C2Buffer.h>
 #include <C2PlatformSupport.h>
 #include <base/callback_forward.h>
+#include <base/files/scoped_file.h>
 
 namespace android {
 
@@ -55,6 +56,19 @@ public:
                                   C2MemoryUsage usage,
                                   std::shared_ptr<C2GraphicBlock>* block /* nonnull */) override;
 
+    /**
+     * Same as fetchGraphicBlock(), but doesn't wait for the acquire fence of the dequeued buffer.
+     * If the fence isn't signaled yet, a duplicate of its fd is returned in |fenceFd|, and the
+     * caller must wait for the fence to signal before the block is written. Otherwise |fenceFd|
+     * is left invalid.
+     *
+     * \note C2VdaBqBlockPool-specific function
+     */
+    c2_status_t fetchGraphicBlockWithFence(uint32_t width, uint32_t height, uint32_t format,
+                                           C2MemoryUsage usage,
+                                           std::shared_ptr<C2GraphicBlock>* block /* nonnull */,
+                                           ::base::ScopedFD* fenceFd /* nonnull */);
+
     void setRenderCallback(const C2BufferQueueBlockPool::OnRenderCallback& renderCallback =
                                    C2BufferQueueBlockPool::OnRenderCallback()) override;
     void configureProducer(const android::sp<HGraphicBufferProducer>& producer) override;
@@ -92,6 +106,15 @@ public:
 
     std::optional<uint32_t> getBufferIdFromGraphicBlock(const C2Block2D& block);
 
+    /**
+     * Get the usage flags requested by the consumer of the configured producer.
+     *
+     * \note C2VdaBqBlockPool-specific function
+     *
+     * Return std::nullopt if no producer is configured, or the usage couldn't be queried.
+     */
+    std::optional<uint64_t> getConsumerUsage();
+
 private:
     friend struct C2VdaBqBlockPoolData;
     class Impl;
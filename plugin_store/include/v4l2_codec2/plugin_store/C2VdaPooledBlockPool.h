@@ -5,48 +5,107 @@
 #ifndef ANDROID_V4L2_CODEC2_PLUGIN_STORE_C2_VDA_POOLED_BLOCK_POOL_H
 #define ANDROID_V4L2_CODEC2_PLUGIN_STORE_C2_VDA_POOLED_BLOCK_POOL_H
 
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
-#include <set>
+#include <vector>
 
+#include <C2BlockInternal.h>
 #include <C2Buffer.h>
 #include <C2BufferPriv.h>
 #include <C2PlatformSupport.h>
 #include <android-base/thread_annotations.h>
+#include <base/callback.h>
 
 namespace android {
 
 class C2VdaPooledBlockPool : public C2PooledBlockPool {
 public:
-    using C2PooledBlockPool::C2PooledBlockPool;
+    C2VdaPooledBlockPool(const std::shared_ptr<C2Allocator>& allocator, const local_id_t localId);
     ~C2VdaPooledBlockPool() override = default;
 
-    // Extracts the buffer ID from BufferPoolData of the graphic block.
-    // |block| is the graphic block allocated by bufferpool block pool.
-    static std::optional<uint32_t> getBufferIdFromGraphicBlock(const C2Block2D& block);
+    // Get the ID of a graphic block fetched from the pool. IDs are in the range of
+    // [0, |bufferCount|) passed to requestNewBufferSet(), each ID identifies a single buffer.
+    std::optional<uint32_t> getBufferIdFromGraphicBlock(const C2Block2D& block);
 
     // Allocate the specified number of buffers.
     // |bufferCount| is the number of requested buffers.
     c2_status_t requestNewBufferSet(int32_t bufferCount);
 
     // Return C2_OK and store a buffer in |block| if a buffer is successfully fetched.
-    // Return C2_TIMED_OUT if the pool already allocated |mBufferCount| buffers but they are all in
-    // use.
+    // Return C2_TIMED_OUT if the pool already allocated |mBufferCount| buffers but none of them
+    // was released by all clients yet, locally and remotely.
     // Return C2_NO_MEMORY if the pool fails to allocate a new buffer.
     c2_status_t fetchGraphicBlock(uint32_t width, uint32_t height, uint32_t format,
                                   C2MemoryUsage usage,
                                   std::shared_ptr<C2GraphicBlock>* block /* nonnull */) override;
 
+    // Ask the pool to notify when a block might be available via |cb|. If a block was released
+    // after the last fetch timed out, |cb| is called immediately. This is only a hint: bufferpool
+    // doesn't report when the remote client released a buffer, so |cb| might run before a block is
+    // available, or never. Callers have to keep retrying with a bounded delay.
+    void setNotifyBlockAvailableCb(::base::OnceClosure cb);
+
+    // Notify |pool| when |buffer|, holding a block fetched from |pool|, is destroyed. The buffer
+    // pool doesn't report released buffers itself, so clients should register all buffers they
+    // pass on to wake up clients waiting for blocks early. As the remote client might still hold
+    // the block, the notification is only a hint that the block might be available.
+    static void notifyBlockAvailableOnDestroy(const std::shared_ptr<C2VdaPooledBlockPool>& pool,
+                                              C2Buffer* buffer);
+
 private:
+    // The allocator of the pool, refusing allocations once all slots are taken.
+    class GatedAllocator;
+
+    C2VdaPooledBlockPool(const local_id_t localId, std::shared_ptr<GatedAllocator> allocator);
+
+    // A block tracked by the pool.
+    struct Slot {
+        // The ID of the buffer in bufferpool.
+        uint32_t bufferPoolId;
+        // The pool data of the block, expires when all local references to the block are dropped.
+        std::weak_ptr<_C2BlockPoolData> poolData;
+    };
+
+    // Extracts the buffer ID from BufferPoolData of the graphic block.
+    // |block| is the graphic block allocated by bufferpool block pool.
+    static std::optional<uint32_t> getBufferPoolId(const C2Block2D& block);
+
+    // Whether the block of any slot was released locally. |mMutex| must be locked.
+    bool hasLocallyReleasedSlotLocked() const;
+    // Assign |block| with bufferpool ID |bufferPoolId| to a slot and return the slot index, or
+    // std::nullopt if the ID isn't tracked and all slots are taken. |mMutex| must be locked.
+    std::optional<size_t> assignSlotLocked(uint32_t bufferPoolId, const C2Block2D& block);
+
+    // Called when a block fetched from the pool was released.
+    void onBlockReleased();
+
+    const std::shared_ptr<GatedAllocator> mAllocator;
+
     // Function mutex to lock at the start of each API function call for protecting the
     // synchronization of all member variables.
     std::mutex mMutex;
 
-    // The ids of all allocated buffers.
-    std::set<uint32_t> mBufferIds GUARDED_BY(mMutex);
+    // The blocks tracked by the pool, at most |mBufferCount|. The slot index is the block ID
+    // reported to clients.
+    std::vector<Slot> mSlots GUARDED_BY(mMutex);
+    // The slot index of each tracked bufferpool ID.
+    std::map<uint32_t, size_t> mSlotIndices GUARDED_BY(mMutex);
     // The maximum count of allocated buffers.
     size_t mBufferCount GUARDED_BY(mMutex){0};
+    // The blocks of previous buffer sets recycled by bufferpool once all slots were taken. They
+    // are kept until the next buffer set is requested, so bufferpool returns the tracked buffers.
+    std::vector<std::shared_ptr<C2GraphicBlock>> mUntrackedBlocks GUARDED_BY(mMutex);
+
+    // Mutex protecting the block release notification state. This is a separate mutex so blocks
+    // can be released while a fetch is in progress.
+    std::mutex mBufferReleaseMutex;
+    // Set to true when a block is released after fetching a block timed out, reset when fetching a
+    // block times out or |mNotifyBlockAvailableCb| is executed.
+    bool mBufferReleasedAfterTimedOut GUARDED_BY(mBufferReleaseMutex) = false;
+    // The callback to notify the caller that a block might be available.
+    ::base::OnceClosure mNotifyBlockAvailableCb GUARDED_BY(mBufferReleaseMutex);
 };
 
 }  // namespace android
@@ -5,6 +5,8 @@
 #ifndef ANDROID_V4L2_CODEC2_PLUGIN_STORE_H2B_GRAPHIC_BUFFER_PRODUCER_H
 #define ANDROID_V4L2_CODEC2_PLUGIN_STORE_H2B_GRAPHIC_BUFFER_PRODUCER_H
 
+#include <optional>
+
 #include <C2Buffer.h>
 #include <android/hardware/graphics/bufferqueue/2.0/IGraphicBufferProducer.h>
 #include <android/hardware/graphics/bufferqueue/2.0/IProducerListener.h>
@@ -14,6 +16,9 @@
 
 namespace android {
 
+// Wrapper of the HIDL IGraphicBufferProducer, each call being a synchronous transaction with the
+// consumer. Settings and query results that don't change for the lifetime of the producer are
+// cached, so repeating them doesn't cost a transaction.
 class H2BGraphicBufferProducer {
 public:
     using HGraphicBufferProducer =
@@ -42,6 +47,12 @@ public:
 
 private:
     const sp<HGraphicBufferProducer> mBase;
+
+    // The last values successfully set with setMaxDequeuedBufferCount() and setDequeueTimeout().
+    std::optional<int> mMaxDequeuedBufferCount;
+    std::optional<nsecs_t> mDequeueTimeout;
+    // The NATIVE_WINDOW_CONSUMER_USAGE_BITS query result.
+    std::optional<int> mConsumerUsage;
 };
 
 }  // namespace android
@@ -11,7 +11,14 @@
 #include <hidl/HidlTransportSupport.h>
 #include <log/log.h>
 #include <minijail.h>
+#include <unistd.h>
 
+#include <string>
+
+#include <v4l2_codec2/common/LatencyTracker.h>
+#include <v4l2_codec2/common/MemoryTracker.h>
+#include <v4l2_codec2/common/V4L2IoctlStats.h>
+#include <v4l2_codec2/common/V4L2Device.h>
 #include <v4l2_codec2/components/V4L2ComponentStore.h>
 
 // Default policy for codec2.0 service.
@@ -22,6 +29,50 @@ static constexpr char kBaseSeccompPolicyPath[] =
 static constexpr char kExtSeccompPolicyPath[] =
         "/vendor/etc/seccomp_policy/codec2.vendor.ext.policy";
 
+namespace {
+
+using namespace ::android::hardware::media::c2::V1_0;
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::Return;
+
+// IComponentStore service, which additionally dumps the per-stage latencies and the buffer memory
+// of all running components, and the device ioctl stats if enabled, when debugged, e.g. using:
+//   lshal debug android.hardware.media.c2@1.0::IComponentStore/v4l2
+// The components are asked to trim their memory if the "--trim-memory" argument is passed, e.g. by
+// a vendor low-memory handler.
+class V4L2ComponentStoreService : public utils::ComponentStore {
+public:
+    using utils::ComponentStore::ComponentStore;
+
+    Return<void> debug(const hidl_handle& handle, const hidl_vec<hidl_string>& args) override {
+        for (const hidl_string& arg : args) {
+            if (arg == "--trim-memory") {
+                ALOGI("Trimming memory on request");
+                android::V4L2ComponentStore::trimMemory();
+                return {};
+            }
+        }
+
+        utils::ComponentStore::debug(handle, args);
+
+        const native_handle_t* nativeHandle = handle.getNativeHandle();
+        if (nativeHandle == nullptr || nativeHandle->numFds < 1) return {};
+
+        const std::string dump =
+                "\nV4L2 component latencies:\n" + android::LatencyTracker::dumpAll() +
+                "\nV4L2 component memory:\n" + android::MemoryTracker::dumpAll() +
+                "\nV4L2 device ioctls:\n" + android::V4L2IoctlStats::dumpAll();
+        if (write(nativeHandle->data[0], dump.c_str(), dump.size()) < 0) {
+            ALOGW("Failed to write component dump");
+        }
+        return {};
+    }
+};
+
+}  // namespace
+
 int main(int /* argc */, char** /* argv */) {
     ALOGD("Service starting...");
 
@@ -37,13 +88,15 @@ int main(int /* argc */, char** /* argv */) {
     logging::SetMinLogLevel(-5);
 #endif
 
+    // Query the capabilities of all V4L2 devices once, so creating component interfaces later on
+    // doesn't require opening and querying the devices again.
+    android::V4L2Device::populateCapabilitiesCache();
+
     // Create IComponentStore service.
     {
-        using namespace ::android::hardware::media::c2::V1_0;
-
         ALOGD("Instantiating Codec2's V4L2 IComponentStore service...");
         android::sp<IComponentStore> store(
-                new utils::ComponentStore(android::V4L2ComponentStore::Create()));
+                new V4L2ComponentStoreService(android::V4L2ComponentStore::Create()));
         if (store == nullptr) {
             ALOGE("Cannot create Codec2's V4L2 IComponentStore service.");
         } else if (store->registerAsService("v4l2") != android::OK) {
@@ -0,0 +1,1244 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "C2ComponentBenchmark"
+
+// Native throughput and latency benchmark of the V4L2 components. The components are created using
+// the V4L2ComponentStore and driven directly with C2Works, without going through MediaCodec. The
+// results of each run are written as a JSON array for regression tracking, e.g.:
+//
+//   C2ComponentBenchmark --component=c2.v4l2.vp9.decoder --input=/data/local/tmp/test.ivf
+//   C2ComponentBenchmark --component=c2.v4l2.avc.encoder --sizes=640x360,1280x720,1920x1080
+//
+// Decoders accept IVF (VP8, VP9, AV1) or Annex-B (H.264, HEVC) input, encoders are fed synthetic
+// NV12 frames.
+//
+// Multiple sessions can also be run concurrently to measure how the components scale, e.g. against
+// the "ro.vendor.v4l2_codec2.decode_concurrent_instances" limit:
+//
+//   C2ComponentBenchmark --instances=4 \
+//       --sessions="c2.v4l2.vp9.decoder@/data/local/tmp/test.ivf;c2.v4l2.avc.encoder@1280x720"
+//
+// An ABR ladder can be produced from a single decode, every decoded frame is queued by reference to
+// one encoder per bitrate:
+//
+//   C2ComponentBenchmark --component=c2.v4l2.avc.decoder --input=/data/local/tmp/test.h264 \
+//       --ladder=c2.v4l2.vp9.encoder@4000000,2000000,1000000
+//
+// Traffic recorded on a device (see "ro.vendor.v4l2_codec2.record_dir") can be replayed with its
+// original timing, or as fast as the component allows:
+//
+//   C2ComponentBenchmark --replay=/data/vendor/c2rec/c2.v4l2.avc.encoder-1234-5.c2rec --rate=max
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <C2AllocatorGralloc.h>
+#include <C2Buffer.h>
+#include <C2Component.h>
+#include <C2Config.h>
+#include <C2PlatformSupport.h>
+#include <C2Work.h>
+#include <log/log.h>
+#include <system/graphics.h>
+
+#include <v4l2_codec2/common/V4L2ComponentCommon.h>
+#include <v4l2_codec2/components/V4L2ComponentStore.h>
+#include <v4l2_codec2/components/WorkRecorder.h>
+
+namespace android {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// The maximum time to wait for the component to return a work.
+constexpr auto kWorkTimeout = std::chrono::seconds(5);
+// The number of distinct synthetic frames cycled through when benchmarking an encoder.
+constexpr size_t kNumSyntheticFrames = 8;
+// The IVF file and frame header sizes.
+constexpr size_t kIvfFileHeaderSize = 32;
+constexpr size_t kIvfFrameHeaderSize = 12;
+
+struct Options {
+    std::string component;
+    std::string input;
+    std::vector<std::pair<uint32_t, uint32_t>> sizes;
+    std::string output;
+    // The "<component>@<input file or size>" specs of the sessions to run concurrently.
+    std::vector<std::string> sessions;
+    uint32_t instances = 1;
+    // The encoder and bitrates of the ladder encoded from the decoded frames, in ladder mode.
+    std::string ladderEncoder;
+    std::vector<uint32_t> ladderBitrates;
+    uint32_t starvationMs = 1000;
+    // The recording to replay, and whether to replay it as fast as possible rather than with its
+    // original timing.
+    std::string replay;
+    bool replayMaxRate = false;
+    uint32_t numFrames = 300;
+    uint32_t framerate = 30;
+    uint32_t bitrate = 0;
+    uint32_t depth = 4;
+};
+
+struct Fragment {
+    std::string data;
+    bool csd = false;
+};
+
+struct Result {
+    std::string component;
+    std::string mode;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    size_t numFrames = 0;
+    double fps = 0.0;
+    std::vector<double> latenciesMs;
+    // The standard deviation of and longest interval between consecutive completed works.
+    double jitterMs = 0.0;
+    double maxGapMs = 0.0;
+    double cpuMsPerFrame = 0.0;
+    long peakRssKb = 0;
+};
+
+uint32_t readLE32(const std::string& data, size_t pos) {
+    return static_cast<uint8_t>(data[pos]) | (static_cast<uint8_t>(data[pos + 1]) << 8) |
+           (static_cast<uint8_t>(data[pos + 2]) << 16) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(data[pos + 3])) << 24);
+}
+
+bool isAnnexB4ByteStartCode(const std::string& data, size_t pos) {
+    return data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 0 && data[pos + 3] == 1;
+}
+
+// Return true if the Annex-B |accessUnit| only contains parameter sets, so it should be queued as
+// codec config data.
+bool isCodecConfig(const std::string& accessUnit, bool isHEVC) {
+    bool hasParameterSets = false;
+    for (size_t pos = 0; pos + 3 < accessUnit.size(); ++pos) {
+        if (accessUnit[pos] != 0 || accessUnit[pos + 1] != 0 || accessUnit[pos + 2] != 1) continue;
+        const uint8_t header = static_cast<uint8_t>(accessUnit[pos + 3]);
+        if (isHEVC) {
+            const uint8_t type = (header >> 1) & 0x3f;
+            // VPS, SPS and PPS are parameter sets, NAL unit types below 32 are slices.
+            if (type >= 32 && type <= 34) hasParameterSets = true;
+            if (type < 32) return false;
+        } else {
+            const uint8_t type = header & 0x1f;
+            // SPS and PPS are parameter sets, NAL unit types 1-5 are slices.
+            if (type == 7 || type == 8) hasParameterSets = true;
+            if (type >= 1 && type <= 5) return false;
+        }
+    }
+    return hasParameterSets;
+}
+
+// Slice the encoded stream in |data| into frames (IVF) or access units (Annex-B). Each access unit
+// is expected to start with a 4-byte start code.
+std::vector<Fragment> sliceStream(const std::string& data, bool isHEVC, uint32_t* width,
+                                  uint32_t* height) {
+    std::vector<Fragment> fragments;
+    if (data.size() >= kIvfFileHeaderSize && data.compare(0, 4, "DKIF") == 0) {
+        *width = readLE32(data, 12) & 0xffff;
+        *height = readLE32(data, 12) >> 16;
+        size_t pos = kIvfFileHeaderSize;
+        while (pos + kIvfFrameHeaderSize <= data.size()) {
+            const size_t frameSize = readLE32(data, pos);
+            pos += kIvfFrameHeaderSize;
+            if (pos + frameSize > data.size()) {
+                ALOGW("Truncated IVF frame at offset %zu", pos);
+                break;
+            }
+            fragments.push_back({data.substr(pos, frameSize), false});
+            pos += frameSize;
+        }
+        return fragments;
+    }
+
+    size_t start = 0;
+    while (start + 4 <= data.size()) {
+        size_t end = start + 4;
+        while (end + 4 <= data.size() && !isAnnexB4ByteStartCode(data, end)) ++end;
+        if (end + 4 > data.size()) end = data.size();
+
+        std::string accessUnit = data.substr(start, end - start);
+        const bool csd = isCodecConfig(accessUnit, isHEVC);
+        fragments.push_back({std::move(accessUnit), csd});
+        start = end;
+    }
+    return fragments;
+}
+
+// Fill the graphic |block| with a synthetic NV12 frame. The luma gradient depends on |seed| so
+// consecutive frames differ.
+bool fillSyntheticFrame(C2GraphicBlock* block, uint32_t seed) {
+    C2GraphicView view = block->map().get();
+    if (view.error() != C2_OK) {
+        ALOGE("Failed to map graphic block (err=%d)", view.error());
+        return false;
+    }
+
+    const C2PlanarLayout& layout = view.layout();
+    for (uint32_t i = 0; i < layout.numPlanes; ++i) {
+        const C2PlaneInfo& plane = layout.planes[i];
+        const uint32_t planeWidth = view.width() / plane.colSampling;
+        const uint32_t planeHeight = view.height() / plane.rowSampling;
+        for (uint32_t y = 0; y < planeHeight; ++y) {
+            uint8_t* row = view.data()[i] + y * plane.rowInc;
+            for (uint32_t x = 0; x < planeWidth; ++x) {
+                row[x * plane.colInc] = (plane.channel == C2PlaneInfo::CHANNEL_Y)
+                                                ? static_cast<uint8_t>(x + y + seed * 4)
+                                                : 128;
+            }
+        }
+    }
+    return true;
+}
+
+// Listener collecting the completion time of all works returned by the component.
+class BenchmarkListener : public C2Component::Listener {
+public:
+    void onWorkDone_nb(std::weak_ptr<C2Component> /*component*/,
+                       std::list<std::unique_ptr<C2Work>> workItems) override {
+        const Clock::time_point now = Clock::now();
+        std::lock_guard<std::mutex> lock(mLock);
+        for (const auto& work : workItems) {
+            // Works abandoned by a flush are completed, but their latency isn't meaningful.
+            if (work->result == C2_NOT_FOUND) {
+                mNumAbandoned++;
+                continue;
+            }
+            mDoneTimes.emplace(work->input.ordinal.frameIndex.peeku(), now);
+            if (work->result != C2_OK) {
+                ALOGE("Work %" PRIu64 " failed (err=%d)", work->input.ordinal.frameIndex.peeku(),
+                      work->result);
+                mError = true;
+            }
+        }
+        mCondition.notify_all();
+    }
+
+    void onTripped_nb(std::weak_ptr<C2Component> /*component*/,
+                      std::vector<std::shared_ptr<C2SettingResult>> /*settingResult*/) override {}
+
+    void onError_nb(std::weak_ptr<C2Component> /*component*/, uint32_t errorCode) override {
+        ALOGE("Component reported error: 0x%x", errorCode);
+        std::lock_guard<std::mutex> lock(mLock);
+        mError = true;
+        mCondition.notify_all();
+    }
+
+    // Wait until at most |maxPending| of the |numQueued| works are still pending. Returns false on
+    // error or timeout.
+    bool waitForPending(size_t numQueued, size_t maxPending) {
+        std::unique_lock<std::mutex> lock(mLock);
+        return mCondition.wait_for(lock, kWorkTimeout, [&]() {
+            return mError || numQueued - mDoneTimes.size() - mNumAbandoned <= maxPending;
+        }) && !mError;
+    }
+
+    std::map<uint64_t, Clock::time_point> doneTimes() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mDoneTimes;
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    std::map<uint64_t, Clock::time_point> mDoneTimes;
+    size_t mNumAbandoned = 0;
+    bool mError = false;
+};
+
+// Listener of the decoder in ladder mode, queueing every decoded frame to all |encoders|. The
+// encoders share the decoded buffers by reference, so a buffer only returns to the decoder's pool
+// once all encoders released it, which throttles the decoder to the slowest encoder.
+class FanOutListener : public BenchmarkListener {
+public:
+    explicit FanOutListener(std::vector<std::shared_ptr<C2Component>> encoders)
+          : mEncoders(std::move(encoders)) {}
+
+    void onWorkDone_nb(std::weak_ptr<C2Component> component,
+                       std::list<std::unique_ptr<C2Work>> workItems) override {
+        for (const auto& work : workItems) {
+            if (work->result != C2_OK || work->worklets.empty()) continue;
+            const C2FrameData& output = work->worklets.front()->output;
+            const bool eos = output.flags & C2FrameData::FLAG_END_OF_STREAM;
+            if (!output.buffers.empty() || eos) forward(output, eos);
+        }
+        BenchmarkListener::onWorkDone_nb(std::move(component), std::move(workItems));
+    }
+
+    // Get the time each frame was queued to the encoders, indexed by the encoders' frame index.
+    std::vector<Clock::time_point> queueTimes() {
+        std::lock_guard<std::mutex> lock(mForwardLock);
+        return mQueueTimes;
+    }
+
+    bool hasForwardError() {
+        std::lock_guard<std::mutex> lock(mForwardLock);
+        return mForwardError;
+    }
+
+private:
+    void forward(const C2FrameData& output, bool eos) {
+        std::lock_guard<std::mutex> lock(mForwardLock);
+        const uint64_t index = mQueueTimes.size();
+        mQueueTimes.push_back(Clock::now());
+        for (const auto& encoder : mEncoders) {
+            auto work = std::make_unique<C2Work>();
+            work->input.flags = eos ? C2FrameData::FLAG_END_OF_STREAM
+                                    : static_cast<C2FrameData::flags_t>(0);
+            work->input.ordinal.timestamp = output.ordinal.timestamp;
+            work->input.ordinal.frameIndex = index;
+            if (!output.buffers.empty()) work->input.buffers.push_back(output.buffers.front());
+            work->worklets.emplace_back(new C2Worklet());
+
+            std::list<std::unique_ptr<C2Work>> items;
+            items.push_back(std::move(work));
+            if (encoder->queue_nb(&items) != C2_OK) {
+                ALOGE("Failed to queue decoded frame %" PRIu64 " to encoder", index);
+                mForwardError = true;
+            }
+        }
+    }
+
+    const std::vector<std::shared_ptr<C2Component>> mEncoders;
+
+    std::mutex mForwardLock;
+    std::vector<Clock::time_point> mQueueTimes;
+    bool mForwardError = false;
+};
+
+double getCpuTimeMs(const struct rusage& usage) {
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    const size_t rank = static_cast<size_t>(p / 100.0 * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+// Compute the throughput, latency and resource usage of |result| from the times each work was
+// queued and completed, indexed by frame index, and the |duration| of the run.
+void computeResult(const std::vector<Clock::time_point>& queueTimes,
+                   const std::map<uint64_t, Clock::time_point>& doneTimesByIndex,
+                   Clock::duration duration, const struct rusage& usageStart,
+                   const struct rusage& usageEnd, Result* result) {
+    std::vector<Clock::time_point> doneTimes;
+    for (const auto& [index, doneTime] : doneTimesByIndex) {
+        if (index >= queueTimes.size()) continue;
+        result->latenciesMs.push_back(
+                std::chrono::duration<double, std::milli>(doneTime - queueTimes[index]).count());
+        doneTimes.push_back(doneTime);
+    }
+    std::sort(doneTimes.begin(), doneTimes.end());
+    std::vector<double> intervalsMs;
+    for (size_t i = 1; i < doneTimes.size(); ++i) {
+        intervalsMs.push_back(
+                std::chrono::duration<double, std::milli>(doneTimes[i] - doneTimes[i - 1]).count());
+    }
+    if (!intervalsMs.empty()) {
+        double sum = 0.0, sumSquares = 0.0;
+        for (double interval : intervalsMs) {
+            sum += interval;
+            sumSquares += interval * interval;
+        }
+        const double mean = sum / intervalsMs.size();
+        result->jitterMs = sqrt(std::max(sumSquares / intervalsMs.size() - mean * mean, 0.0));
+        result->maxGapMs = *std::max_element(intervalsMs.begin(), intervalsMs.end());
+    }
+    const size_t numWorks = queueTimes.size();
+    result->numFrames = numWorks;
+    result->fps = numWorks / std::chrono::duration<double>(duration).count();
+    result->cpuMsPerFrame = (getCpuTimeMs(usageEnd) - getCpuTimeMs(usageStart)) / numWorks;
+    result->peakRssKb = usageEnd.ru_maxrss;
+}
+
+// Queue the works produced by |createWork| for |numWorks| frames on |component|, keeping at most
+// |options.depth| works in flight, and measure the latency of each work.
+template <typename CreateWorkFunc>
+bool runComponent(const std::shared_ptr<C2Component>& component, const Options& options,
+                  size_t numWorks, CreateWorkFunc createWork, Result* result,
+                  std::shared_ptr<BenchmarkListener> listener = nullptr) {
+    if (!listener) listener = std::make_shared<BenchmarkListener>();
+    if (component->setListener_vb(listener, C2_MAY_BLOCK) != C2_OK ||
+        component->start() != C2_OK) {
+        ALOGE("Failed to start component %s", options.component.c_str());
+        return false;
+    }
+
+    std::vector<Clock::time_point> queueTimes(numWorks);
+    struct rusage usageStart;
+    getrusage(RUSAGE_SELF, &usageStart);
+    const Clock::time_point start = Clock::now();
+
+    bool success = true;
+    for (size_t i = 0; i < numWorks && success; ++i) {
+        if (!listener->waitForPending(i, options.depth - 1)) {
+            ALOGE("Timed out waiting for works to complete");
+            success = false;
+            break;
+        }
+
+        std::unique_ptr<C2Work> work = createWork(i);
+        if (!work) {
+            success = false;
+            break;
+        }
+        work->input.ordinal.frameIndex = i;
+        work->input.ordinal.timestamp = i * 1000000ull / options.framerate;
+        if (i == numWorks - 1) {
+            work->input.flags = static_cast<C2FrameData::flags_t>(
+                    work->input.flags | C2FrameData::FLAG_END_OF_STREAM);
+        }
+        work->worklets.emplace_back(new C2Worklet());
+
+        std::list<std::unique_ptr<C2Work>> items;
+        items.push_back(std::move(work));
+        queueTimes[i] = Clock::now();
+        if (component->queue_nb(&items) != C2_OK) {
+            ALOGE("Failed to queue work %zu", i);
+            success = false;
+        }
+    }
+    if (success && !listener->waitForPending(numWorks, 0)) {
+        ALOGE("Timed out waiting for the last works to complete");
+        success = false;
+    }
+
+    const Clock::time_point end = Clock::now();
+    struct rusage usageEnd;
+    getrusage(RUSAGE_SELF, &usageEnd);
+    component->stop();
+    if (!success) return false;
+
+    computeResult(queueTimes, listener->doneTimes(), end - start, usageStart, usageEnd, result);
+    return true;
+}
+
+bool runDecoder(const std::shared_ptr<C2Component>& component, const Options& options,
+                Result* result, std::shared_ptr<BenchmarkListener> listener = nullptr) {
+    std::ifstream file(options.input, std::ios::binary);
+    if (!file.is_open()) {
+        ALOGE("Failed to open input file %s", options.input.c_str());
+        return false;
+    }
+    const std::string data((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+    const bool isHEVC = options.component == V4L2ComponentName::kHEVCDecoder;
+    std::vector<Fragment> fragments = sliceStream(data, isHEVC, &result->width, &result->height);
+    if (fragments.empty()) {
+        ALOGE("No frames found in input file %s", options.input.c_str());
+        return false;
+    }
+    if (fragments.size() > options.numFrames) fragments.resize(options.numFrames);
+
+    std::shared_ptr<C2BlockPool> pool;
+    if (GetCodec2BlockPool(C2BlockPool::BASIC_LINEAR, nullptr, &pool) != C2_OK) {
+        ALOGE("Failed to get basic linear block pool");
+        return false;
+    }
+
+    // Copy the fragments into linear blocks up front, so the copies aren't measured.
+    std::vector<std::shared_ptr<C2Buffer>> buffers;
+    for (const Fragment& fragment : fragments) {
+        std::shared_ptr<C2LinearBlock> block;
+        const C2MemoryUsage usage = {C2MemoryUsage::CPU_READ, C2MemoryUsage::CPU_WRITE};
+        if (pool->fetchLinearBlock(fragment.data.size(), usage, &block) != C2_OK) {
+            ALOGE("Failed to fetch linear block of size %zu", fragment.data.size());
+            return false;
+        }
+        C2WriteView view = block->map().get();
+        memcpy(view.data(), fragment.data.data(), fragment.data.size());
+        buffers.push_back(
+                C2Buffer::CreateLinearBuffer(block->share(0, fragment.data.size(), C2Fence())));
+    }
+
+    result->mode = "decode";
+    return runComponent(
+            component, options, fragments.size(),
+            [&](size_t index) {
+                auto work = std::make_unique<C2Work>();
+                work->input.flags = fragments[index].csd ? C2FrameData::FLAG_CODEC_CONFIG
+                                                         : static_cast<C2FrameData::flags_t>(0);
+                work->input.buffers.push_back(buffers[index]);
+                return work;
+            },
+            result, std::move(listener));
+}
+
+// Configure the encoder |component| to encode frames of |width|x|height| at |bitrate|. Defaults to
+// ~0.1 bits per pixel if |bitrate| is zero.
+bool configureEncoder(const std::shared_ptr<C2Component>& component, const Options& options,
+                      uint32_t width, uint32_t height, uint32_t bitrate) {
+    C2StreamPictureSizeInfo::input size(0u, width, height);
+    C2StreamFrameRateInfo::output framerate(0u, static_cast<float>(options.framerate));
+    C2StreamBitrateInfo::output bitrateInfo(
+            0u, bitrate > 0 ? bitrate : width * height * options.framerate / 10);
+    std::vector<std::unique_ptr<C2SettingResult>> failures;
+    if (component->intf()->config_vb({&size, &framerate, &bitrateInfo}, C2_MAY_BLOCK,
+                                     &failures) != C2_OK) {
+        ALOGE("Failed to configure encoder for %ux%u", width, height);
+        return false;
+    }
+    return true;
+}
+
+bool runEncoder(const std::shared_ptr<C2Component>& component, const Options& options,
+                uint32_t width, uint32_t height, Result* result) {
+    if (!configureEncoder(component, options, width, height, options.bitrate)) return false;
+
+    std::shared_ptr<C2BlockPool> pool;
+    if (GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool) != C2_OK) {
+        ALOGE("Failed to get basic graphic block pool");
+        return false;
+    }
+
+    std::vector<std::shared_ptr<C2GraphicBlock>> blocks;
+    for (size_t i = 0; i < kNumSyntheticFrames; ++i) {
+        std::shared_ptr<C2GraphicBlock> block;
+        const C2MemoryUsage usage = {C2MemoryUsage::CPU_READ, C2MemoryUsage::CPU_WRITE};
+        if (pool->fetchGraphicBlock(width, height, HAL_PIXEL_FORMAT_YCBCR_420_888, usage,
+                                    &block) != C2_OK ||
+            !fillSyntheticFrame(block.get(), i)) {
+            ALOGE("Failed to create synthetic %ux%u frame", width, height);
+            return false;
+        }
+        blocks.push_back(std::move(block));
+    }
+
+    result->mode = "encode";
+    result->width = width;
+    result->height = height;
+    return runComponent(
+            component, options, options.numFrames,
+            [&](size_t index) {
+                auto work = std::make_unique<C2Work>();
+                work->input.flags = static_cast<C2FrameData::flags_t>(0);
+                const auto& block = blocks[index % blocks.size()];
+                work->input.buffers.push_back(C2Buffer::CreateGraphicBuffer(
+                        block->share(C2Rect(width, height), C2Fence())));
+                return work;
+            },
+            result);
+}
+
+// Convert |result| to JSON. The CPU time and memory usage are process-wide, so they are omitted
+// from the results of concurrent sessions if |processStats| is false.
+std::string resultToJson(const Result& result, bool processStats = true) {
+    std::ostringstream json;
+    json << "{\"component\": \"" << result.component << "\", \"mode\": \"" << result.mode
+         << "\", \"width\": " << result.width << ", \"height\": " << result.height
+         << ", \"frames\": " << result.numFrames << ", \"fps\": " << result.fps
+         << ", \"latency_ms\": {\"p50\": " << percentile(result.latenciesMs, 50)
+         << ", \"p90\": " << percentile(result.latenciesMs, 90)
+         << ", \"p99\": " << percentile(result.latenciesMs, 99)
+         << ", \"max\": " << percentile(result.latenciesMs, 100)
+         << "}, \"jitter_ms\": " << result.jitterMs << ", \"max_gap_ms\": " << result.maxGapMs;
+    if (processStats) {
+        json << ", \"cpu_ms_per_frame\": " << result.cpuMsPerFrame
+             << ", \"peak_rss_kb\": " << result.peakRssKb;
+    }
+    json << "}";
+    return json.str();
+}
+
+bool parseSizes(const std::string& arg, std::vector<std::pair<uint32_t, uint32_t>>* sizes) {
+    std::istringstream stream(arg);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        uint32_t width, height;
+        if (sscanf(item.c_str(), "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+            return false;
+        }
+        sizes->emplace_back(width, height);
+    }
+    return !sizes->empty();
+}
+
+// Parse the session |spec| "<component>@<input file or size>" into |session|, replacing the
+// component and its input of the common |options|.
+bool parseSession(const std::string& spec, const Options& options, Options* session) {
+    const size_t separator = spec.find('@');
+    if (separator == std::string::npos) return false;
+
+    *session = options;
+    session->component = spec.substr(0, separator);
+    session->input.clear();
+    session->sizes.clear();
+    if (!V4L2ComponentName::isValid(session->component.c_str())) return false;
+    if (V4L2ComponentName::isEncoder(session->component.c_str())) {
+        return parseSizes(spec.substr(separator + 1), &session->sizes) &&
+               session->sizes.size() == 1;
+    }
+    session->input = spec.substr(separator + 1);
+    return !session->input.empty();
+}
+
+// Run a single benchmark with the component, input and first size of |options|, using the
+// previously created |component|.
+bool runSession(const std::shared_ptr<C2Component>& component, const Options& options,
+                Result* result) {
+    result->component = options.component;
+    if (V4L2ComponentName::isEncoder(options.component.c_str())) {
+        return runEncoder(component, options, options.sizes.front().first,
+                          options.sizes.front().second, result);
+    }
+    return runDecoder(component, options, result);
+}
+
+// Run all |sessions| concurrently. All components are created before any session starts, so the
+// sessions overlap for as long as possible. Sessions whose component couldn't be created, e.g.
+// because the admission limit was reached, are reported as rejected.
+bool runConcurrentSessions(C2ComponentStore* store, const Options& options,
+                           const std::vector<Options>& sessions, std::string* json) {
+    enum class Status { kOk, kRejected, kFailed };
+    std::vector<Status> statuses(sessions.size(), Status::kFailed);
+    std::vector<Result> results(sessions.size());
+
+    std::mutex lock;
+    std::condition_variable condition;
+    size_t numReady = 0;
+    bool started = false;
+
+    struct rusage usageStart;
+    getrusage(RUSAGE_SELF, &usageStart);
+    Clock::time_point start;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        threads.emplace_back([&, i]() {
+            std::shared_ptr<C2Component> component;
+            const bool created =
+                    store->createComponent(sessions[i].component, &component) == C2_OK;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                numReady++;
+                condition.notify_all();
+                condition.wait(guard, [&]() { return started; });
+            }
+            if (!created) {
+                ALOGW("Session %zu (%s) was rejected", i, sessions[i].component.c_str());
+                statuses[i] = Status::kRejected;
+                return;
+            }
+            statuses[i] = runSession(component, sessions[i], &results[i]) ? Status::kOk
+                                                                          : Status::kFailed;
+            component->release();
+        });
+    }
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        condition.wait(guard, [&]() { return numReady == sessions.size(); });
+        start = Clock::now();
+        started = true;
+        condition.notify_all();
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    const Clock::time_point end = Clock::now();
+    struct rusage usageEnd;
+    getrusage(RUSAGE_SELF, &usageEnd);
+
+    size_t totalFrames = 0, numRejected = 0, numFailed = 0, numStarved = 0;
+    std::ostringstream sessionsJson;
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        if (i > 0) sessionsJson << ",\n";
+        if (statuses[i] != Status::kOk) {
+            const bool rejected = statuses[i] == Status::kRejected;
+            (rejected ? numRejected : numFailed)++;
+            sessionsJson << "    {\"component\": \"" << sessions[i].component
+                         << "\", \"status\": \"" << (rejected ? "rejected" : "failed") << "\"}";
+            continue;
+        }
+        // A session is starved if it didn't complete any work for too long while running
+        // concurrently with the others.
+        const bool starved = results[i].maxGapMs > options.starvationMs;
+        if (starved) {
+            fprintf(stderr, "Session %zu (%s) starved for %.1f ms\n", i,
+                    sessions[i].component.c_str(), results[i].maxGapMs);
+            numStarved++;
+        }
+        totalFrames += results[i].numFrames;
+        std::string result = resultToJson(results[i], false);
+        result.insert(result.size() - 1, std::string(", \"status\": \"") +
+                                                 (starved ? "starved" : "ok") + "\"");
+        sessionsJson << "    " << result;
+    }
+
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    std::ostringstream aggregate;
+    aggregate << "{\"sessions\": " << sessions.size() << ", \"frames\": " << totalFrames
+              << ", \"fps\": " << totalFrames / seconds
+              << ", \"cpu_ms_per_frame\": "
+              << (totalFrames > 0
+                          ? (getCpuTimeMs(usageEnd) - getCpuTimeMs(usageStart)) / totalFrames
+                          : 0.0)
+              << ", \"peak_rss_kb\": " << usageEnd.ru_maxrss << ", \"rejected\": " << numRejected
+              << ", \"failed\": " << numFailed << ", \"starved\": " << numStarved << "}";
+
+    *json = "{\n  \"aggregate\": " + aggregate.str() + ",\n  \"sessions\": [\n" +
+            sessionsJson.str() + "\n  ]\n}\n";
+    return numFailed == 0 && numStarved == 0;
+}
+
+// Decode the input of |options| once and encode the decoded frames with one encoder per bitrate
+// of the ladder. The results of the decoder and of each rung of the ladder are stored in |json|.
+bool runLadder(C2ComponentStore* store, const Options& options, std::string* json) {
+    std::shared_ptr<C2Component> decoder;
+    if (store->createComponent(options.component, &decoder) != C2_OK) {
+        ALOGE("Failed to create decoder %s", options.component.c_str());
+        return false;
+    }
+
+    // The size of the decoded frames is parsed from the input, before the encoders are configured.
+    Result decodeResult;
+    decodeResult.component = options.component;
+    {
+        std::ifstream file(options.input, std::ios::binary);
+        const std::string data((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+        sliceStream(data, options.component == V4L2ComponentName::kHEVCDecoder,
+                    &decodeResult.width, &decodeResult.height);
+    }
+    if (decodeResult.width == 0 || decodeResult.height == 0) {
+        ALOGE("Failed to get the video size of %s", options.input.c_str());
+        decoder->release();
+        return false;
+    }
+
+    std::vector<std::shared_ptr<C2Component>> encoders;
+    std::vector<std::shared_ptr<BenchmarkListener>> encoderListeners;
+    bool success = true;
+    for (uint32_t bitrate : options.ladderBitrates) {
+        std::shared_ptr<C2Component> encoder;
+        auto listener = std::make_shared<BenchmarkListener>();
+        if (store->createComponent(options.ladderEncoder, &encoder) != C2_OK ||
+            !configureEncoder(encoder, options, decodeResult.width, decodeResult.height,
+                              bitrate) ||
+            encoder->setListener_vb(listener, C2_MAY_BLOCK) != C2_OK ||
+            encoder->start() != C2_OK) {
+            ALOGE("Failed to start encoder %s at %u bps", options.ladderEncoder.c_str(), bitrate);
+            if (encoder) encoder->release();
+            success = false;
+            break;
+        }
+        encoders.push_back(std::move(encoder));
+        encoderListeners.push_back(std::move(listener));
+    }
+
+    auto fanOutListener = std::make_shared<FanOutListener>(encoders);
+    if (success) {
+        const Clock::time_point start = Clock::now();
+        success = runDecoder(decoder, options, &decodeResult, fanOutListener);
+        const std::vector<Clock::time_point> queueTimes = fanOutListener->queueTimes();
+        for (size_t i = 0; i < encoders.size() && success; ++i) {
+            if (fanOutListener->hasForwardError() ||
+                !encoderListeners[i]->waitForPending(queueTimes.size(), 0)) {
+                ALOGE("Encoder %zu failed to encode the decoded frames", i);
+                success = false;
+            }
+        }
+        const Clock::time_point end = Clock::now();
+        decodeResult.mode = "ladder";
+
+        std::ostringstream rungsJson;
+        for (size_t i = 0; i < encoders.size() && success; ++i) {
+            Result rung;
+            rung.component = options.ladderEncoder;
+            rung.mode = "encode";
+            rung.width = decodeResult.width;
+            rung.height = decodeResult.height;
+            rung.numFrames = queueTimes.size();
+            rung.fps = queueTimes.size() / std::chrono::duration<double>(end - start).count();
+            for (const auto& [index, doneTime] : encoderListeners[i]->doneTimes()) {
+                if (index >= queueTimes.size()) continue;
+                rung.latenciesMs.push_back(
+                        std::chrono::duration<double, std::milli>(doneTime - queueTimes[index])
+                                .count());
+            }
+            std::string result = resultToJson(rung, false);
+            result.insert(result.size() - 1, ", \"bitrate\": " +
+                                                     std::to_string(options.ladderBitrates[i]));
+            rungsJson << (i > 0 ? ",\n" : "") << "    " << result;
+        }
+        *json = "{\n  \"decoder\": " + resultToJson(decodeResult) + ",\n  \"rungs\": [\n" +
+                rungsJson.str() + "\n  ]\n}\n";
+    }
+
+    for (const auto& encoder : encoders) {
+        encoder->stop();
+        encoder->release();
+    }
+    decoder->release();
+    return success;
+}
+
+// Create the input buffer of the recorded work |event| in |buffer|, left empty if the work had no
+// input. Recorded frames are copied into a block allocated from |graphicPool|, plane by plane.
+bool createReplayBuffer(const WorkRecording::Event& event, C2BlockPool* linearPool,
+                        C2BlockPool* graphicPool, std::shared_ptr<C2Buffer>* buffer) {
+    const C2MemoryUsage usage = {C2MemoryUsage::CPU_READ, C2MemoryUsage::CPU_WRITE};
+    if (event.mBufferType == WorkRecording::BufferType::kLinear && !event.mBitstream.empty()) {
+        std::shared_ptr<C2LinearBlock> block;
+        if (linearPool->fetchLinearBlock(event.mBitstream.size(), usage, &block) != C2_OK) {
+            ALOGE("Failed to fetch linear block of size %zu", event.mBitstream.size());
+            return false;
+        }
+        C2WriteView view = block->map().get();
+        memcpy(view.data(), event.mBitstream.data(), event.mBitstream.size());
+        *buffer = C2Buffer::CreateLinearBuffer(
+                block->share(0, event.mBitstream.size(), C2Fence()));
+    } else if (event.mBufferType == WorkRecording::BufferType::kGraphic) {
+        const bool isRGB = event.mLayoutType == C2PlanarLayout::TYPE_RGB ||
+                           event.mLayoutType == C2PlanarLayout::TYPE_RGBA;
+        std::shared_ptr<C2GraphicBlock> block;
+        if (graphicPool->fetchGraphicBlock(
+                    event.mWidth, event.mHeight,
+                    isRGB ? HAL_PIXEL_FORMAT_RGBA_8888 : HAL_PIXEL_FORMAT_YCBCR_420_888, usage,
+                    &block) != C2_OK) {
+            ALOGE("Failed to fetch %ux%u graphic block", event.mWidth, event.mHeight);
+            return false;
+        }
+        C2GraphicView view = block->map().get();
+        if (view.error() != C2_OK) {
+            ALOGE("Failed to map graphic block (err=%d)", view.error());
+            return false;
+        }
+
+        const C2PlanarLayout& layout = view.layout();
+        for (uint32_t i = 0; i < layout.numPlanes; ++i) {
+            const C2PlaneInfo& plane = layout.planes[i];
+            auto recorded = std::find_if(
+                    event.mPlanes.begin(), event.mPlanes.end(),
+                    [&](const WorkRecording::Plane& p) {
+                        return p.mChannel == plane.channel &&
+                               p.mColSampling == plane.colSampling &&
+                               p.mRowSampling == plane.rowSampling;
+                    });
+            if (recorded == event.mPlanes.end()) {
+                ALOGE("The recorded frame doesn't match the layout of the graphic block");
+                return false;
+            }
+            const uint32_t width = (event.mWidth + plane.colSampling - 1) / plane.colSampling;
+            const uint32_t height = (event.mHeight + plane.rowSampling - 1) / plane.rowSampling;
+            for (uint32_t y = 0; y < height; ++y) {
+                uint8_t* row = view.data()[i] + y * plane.rowInc;
+                const uint8_t* src = recorded->mData.data() + y * width;
+                for (uint32_t x = 0; x < width; ++x) row[x * plane.colInc] = src[x];
+            }
+        }
+        *buffer = C2Buffer::CreateGraphicBuffer(
+                block->share(C2Rect(event.mWidth, event.mHeight), C2Fence()));
+    }
+    return true;
+}
+
+// Replay the recording of |options| on a new instance of the recorded component. The works are
+// queued with their original timing, or as fast as the component allows in max rate mode, keeping
+// at most |options.depth| works in flight. The interface configuration recorded at start and on
+// parameter changes is applied before the following works.
+bool runReplay(C2ComponentStore* store, const Options& options, std::string* json) {
+    const std::optional<WorkRecording> recording = WorkRecording::Read(options.replay);
+    if (!recording) {
+        fprintf(stderr, "Failed to read recording %s\n", options.replay.c_str());
+        return false;
+    }
+
+    std::shared_ptr<C2Component> component;
+    if (store->createComponent(recording->mComponentName, &component) != C2_OK) {
+        ALOGE("Failed to create component %s", recording->mComponentName.c_str());
+        return false;
+    }
+    std::shared_ptr<C2BlockPool> linearPool, graphicPool;
+    if (GetCodec2BlockPool(C2BlockPool::BASIC_LINEAR, nullptr, &linearPool) != C2_OK ||
+        GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &graphicPool) != C2_OK) {
+        ALOGE("Failed to get basic block pools");
+        component->release();
+        return false;
+    }
+    auto listener = std::make_shared<BenchmarkListener>();
+    if (component->setListener_vb(listener, C2_MAY_BLOCK) != C2_OK) {
+        ALOGE("Failed to set listener of %s", recording->mComponentName.c_str());
+        component->release();
+        return false;
+    }
+
+    Result result;
+    result.component = recording->mComponentName;
+    result.mode = "replay";
+    std::vector<Clock::time_point> queueTimes;
+    bool running = false;
+    bool drained = false;
+
+    struct rusage usageStart;
+    getrusage(RUSAGE_SELF, &usageStart);
+    const Clock::time_point start = Clock::now();
+    const int64_t firstTimeUs = recording->mEvents.empty() ? 0 : recording->mEvents[0].mTimeUs;
+
+    bool success = true;
+    for (const WorkRecording::Event& event : recording->mEvents) {
+        if (!success) break;
+        if (!options.replayMaxRate) {
+            std::this_thread::sleep_until(start +
+                                          std::chrono::microseconds(event.mTimeUs - firstTimeUs));
+        }
+
+        switch (event.mType) {
+        case WorkRecording::EventType::kStart:
+        case WorkRecording::EventType::kConfig: {
+            if (event.mType == WorkRecording::EventType::kStart && running) break;
+            // Some of the recorded parameters can only be configured while stopped, so failures
+            // are expected and ignored.
+            std::vector<C2Param*> params;
+            for (const std::unique_ptr<C2Param>& param : event.mParams) {
+                params.push_back(param.get());
+            }
+            std::vector<std::unique_ptr<C2SettingResult>> failures;
+            component->intf()->config_vb(params, C2_MAY_BLOCK, &failures);
+            if (event.mType == WorkRecording::EventType::kStart) {
+                if (component->start() != C2_OK) {
+                    ALOGE("Failed to start component %s", recording->mComponentName.c_str());
+                    success = false;
+                }
+                running = success;
+            }
+            break;
+        }
+        case WorkRecording::EventType::kStop:
+            if (!running) break;
+            if (!listener->waitForPending(queueTimes.size(), 0)) {
+                ALOGE("Timed out waiting for works to complete before stopping");
+                success = false;
+            }
+            component->stop();
+            running = false;
+            break;
+        case WorkRecording::EventType::kWork: {
+            if (!running) break;
+            if (options.replayMaxRate && !listener->waitForPending(queueTimes.size(),
+                                                                   options.depth - 1)) {
+                ALOGE("Timed out waiting for works to complete");
+                success = false;
+                break;
+            }
+
+            auto work = std::make_unique<C2Work>();
+            std::shared_ptr<C2Buffer> buffer;
+            if (!createReplayBuffer(event, linearPool.get(), graphicPool.get(), &buffer)) {
+                success = false;
+                break;
+            }
+            if (buffer) work->input.buffers.push_back(std::move(buffer));
+            if (event.mBufferType == WorkRecording::BufferType::kGraphic && result.width == 0) {
+                result.width = event.mWidth;
+                result.height = event.mHeight;
+            }
+            // Works are renumbered, so frame indices stay unique across flushes and restarts.
+            work->input.flags = static_cast<C2FrameData::flags_t>(event.mFlags);
+            work->input.ordinal.frameIndex = queueTimes.size();
+            work->input.ordinal.timestamp = event.mTimestamp;
+            for (const std::unique_ptr<C2Param>& param : event.mParams) {
+                work->input.configUpdate.push_back(C2Param::Copy(*param));
+            }
+            work->worklets.emplace_back(new C2Worklet());
+            drained = event.mFlags & C2FrameData::FLAG_END_OF_STREAM;
+
+            std::list<std::unique_ptr<C2Work>> items;
+            items.push_back(std::move(work));
+            queueTimes.push_back(Clock::now());
+            if (component->queue_nb(&items) != C2_OK) {
+                ALOGE("Failed to queue work %zu", queueTimes.size() - 1);
+                success = false;
+            }
+            break;
+        }
+        case WorkRecording::EventType::kDrain:
+            if (!running) break;
+            drained = true;
+            if (component->drain_nb(C2Component::DRAIN_COMPONENT_WITH_EOS) != C2_OK) {
+                ALOGE("Failed to drain component");
+                success = false;
+            }
+            break;
+        case WorkRecording::EventType::kFlush: {
+            if (!running) break;
+            std::list<std::unique_ptr<C2Work>> flushedWorks;
+            if (component->flush_sm(C2Component::FLUSH_COMPONENT, &flushedWorks) != C2_OK) {
+                ALOGE("Failed to flush component");
+                success = false;
+            }
+            for (const std::unique_ptr<C2Work>& work : flushedWorks) work->result = C2_NOT_FOUND;
+            listener->onWorkDone_nb(component, std::move(flushedWorks));
+            break;
+        }
+        }
+    }
+
+    // The recording might end before the component was drained and stopped, e.g. if the client
+    // was killed. The component is drained then, so all queued works complete.
+    if (running) {
+        if (success && !drained) {
+            success = component->drain_nb(C2Component::DRAIN_COMPONENT_WITH_EOS) == C2_OK;
+        }
+        if (success && !listener->waitForPending(queueTimes.size(), 0)) {
+            ALOGE("Timed out waiting for the last works to complete");
+            success = false;
+        }
+    }
+    const Clock::time_point end = Clock::now();
+    struct rusage usageEnd;
+    getrusage(RUSAGE_SELF, &usageEnd);
+    if (running) component->stop();
+    component->release();
+    if (!success || queueTimes.empty()) return false;
+
+    computeResult(queueTimes, listener->doneTimes(), end - start, usageStart, usageEnd, &result);
+    std::string resultJson = resultToJson(result);
+    resultJson.insert(resultJson.size() - 1, std::string(", \"rate\": \"") +
+                                                     (options.replayMaxRate ? "max" : "original") +
+                                                     "\"");
+    *json = "[\n  " + resultJson + "\n]\n";
+    return true;
+}
+
+bool getOptions(int argc, char** argv, Options* options) {
+    static const struct option opts[] = {
+            {"component", required_argument, nullptr, 'c'},
+            {"input", required_argument, nullptr, 'i'},
+            {"sizes", required_argument, nullptr, 's'},
+            {"frames", required_argument, nullptr, 'n'},
+            {"framerate", required_argument, nullptr, 'f'},
+            {"bitrate", required_argument, nullptr, 'b'},
+            {"depth", required_argument, nullptr, 'd'},
+            {"output", required_argument, nullptr, 'o'},
+            {"sessions", required_argument, nullptr, 'S'},
+            {"instances", required_argument, nullptr, 'I'},
+            {"starvation_ms", required_argument, nullptr, 'T'},
+            {"ladder", required_argument, nullptr, 'L'},
+            {"replay", required_argument, nullptr, 'R'},
+            {"rate", required_argument, nullptr, 'P'},
+            {nullptr, 0, nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:i:s:n:f:b:d:o:", opts, nullptr)) != -1) {
+        switch (opt) {
+        case 'c':
+            options->component = optarg;
+            break;
+        case 'i':
+            options->input = optarg;
+            break;
+        case 's':
+            if (!parseSizes(optarg, &options->sizes)) {
+                fprintf(stderr, "Invalid sizes: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'n':
+            options->numFrames = static_cast<uint32_t>(atoi(optarg));
+            break;
+        case 'f':
+            options->framerate = static_cast<uint32_t>(atoi(optarg));
+            break;
+        case 'b':
+            options->bitrate = static_cast<uint32_t>(atoi(optarg));
+            break;
+        case 'd':
+            options->depth = static_cast<uint32_t>(atoi(optarg));
+            break;
+        case 'o':
+            options->output = optarg;
+            break;
+        case 'S': {
+            std::istringstream stream(optarg);
+            std::string spec;
+            while (std::getline(stream, spec, ';')) {
+                if (!spec.empty()) options->sessions.push_back(spec);
+            }
+            break;
+        }
+        case 'I':
+            options->instances = static_cast<uint32_t>(atoi(optarg));
+            break;
+        case 'T':
+            options->starvationMs = static_cast<uint32_t>(atoi(optarg));
+            break;
+        case 'L': {
+            // "<encoder>@<bitrate>[,<bitrate>...]"
+            const std::string spec = optarg;
+            const size_t separator = spec.find('@');
+            if (separator == std::string::npos) {
+                fprintf(stderr, "Invalid ladder: %s\n", optarg);
+                return false;
+            }
+            options->ladderEncoder = spec.substr(0, separator);
+            std::istringstream stream(spec.substr(separator + 1));
+            std::string bitrate;
+            while (std::getline(stream, bitrate, ',')) {
+                options->ladderBitrates.push_back(static_cast<uint32_t>(atoi(bitrate.c_str())));
+            }
+            if (!V4L2ComponentName::isEncoder(options->ladderEncoder.c_str()) ||
+                options->ladderBitrates.empty()) {
+                fprintf(stderr, "Invalid ladder: %s\n", optarg);
+                return false;
+            }
+            break;
+        }
+        case 'R':
+            options->replay = optarg;
+            break;
+        case 'P':
+            if (strcmp(optarg, "original") != 0 && strcmp(optarg, "max") != 0) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return false;
+            }
+            options->replayMaxRate = strcmp(optarg, "max") == 0;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if (options->numFrames == 0 || options->framerate == 0 || options->depth == 0 ||
+        options->instances == 0) {
+        fprintf(stderr, "Frames, framerate, depth and instances should be positive\n");
+        return false;
+    }
+    if (!options->sessions.empty() || !options->replay.empty()) return true;
+
+    if (!V4L2ComponentName::isValid(options->component.c_str())) {
+        fprintf(stderr, "Invalid component name: %s\n", options->component.c_str());
+        return false;
+    }
+    if (V4L2ComponentName::isEncoder(options->component.c_str())) {
+        if (!options->ladderBitrates.empty()) {
+            fprintf(stderr, "Ladders are encoded from a decoder's output\n");
+            return false;
+        }
+        if (options->sizes.empty()) options->sizes.emplace_back(1280, 720);
+    } else if (options->input.empty()) {
+        fprintf(stderr, "Decoders require an input file (--input)\n");
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+}  // namespace android
+
+int main(int argc, char** argv) {
+    using namespace android;
+
+    Options options;
+    if (!getOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "Usage: %s --component=<name> [--input=<file>] [--sizes=<w>x<h>[,...]]\n"
+                "          [--frames=<n>] [--framerate=<fps>] [--bitrate=<bps>] [--depth=<n>]\n"
+                "          [--output=<json file>]\n"
+                "       %s --sessions=<component>@<file or <w>x<h>>[;...] [--instances=<n>]\n"
+                "          [--starvation_ms=<ms>] [--frames=<n>] [--framerate=<fps>] ...\n"
+                "       %s --component=<decoder> --input=<file>\n"
+                "          --ladder=<encoder>@<bitrate>[,...] [--frames=<n>] ...\n"
+                "       %s --replay=<recording> [--rate=original|max] [--depth=<n>]\n"
+                "          [--output=<json file>]\n",
+                argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    std::shared_ptr<C2ComponentStore> store = V4L2ComponentStore::Create();
+    if (!store) {
+        fprintf(stderr, "Failed to create component store\n");
+        return 1;
+    }
+
+    std::string json;
+    bool success = true;
+    if (!options.replay.empty()) {
+        success = runReplay(store.get(), options, &json);
+        if (!success) {
+            fprintf(stderr, "Replay of %s failed\n", options.replay.c_str());
+            return 1;
+        }
+    } else if (!options.sessions.empty()) {
+        std::vector<Options> sessions;
+        for (uint32_t instance = 0; instance < options.instances; ++instance) {
+            for (const std::string& spec : options.sessions) {
+                Options session;
+                if (!parseSession(spec, options, &session)) {
+                    fprintf(stderr, "Invalid session: %s\n", spec.c_str());
+                    return 1;
+                }
+                sessions.push_back(std::move(session));
+            }
+        }
+        success = runConcurrentSessions(store.get(), options, sessions, &json);
+    } else if (!options.ladderBitrates.empty()) {
+        success = runLadder(store.get(), options, &json);
+        if (!success) {
+            fprintf(stderr, "Ladder benchmark of %s failed\n", options.component.c_str());
+            return 1;
+        }
+    } else {
+        const bool isEncoder = V4L2ComponentName::isEncoder(options.component.c_str());
+        const size_t numRuns = isEncoder ? options.sizes.size() : 1;
+        json = "[\n";
+        for (size_t i = 0; i < numRuns; ++i) {
+            // Use a new component for each run, so runs don't influence each other.
+            std::shared_ptr<C2Component> component;
+            if (store->createComponent(options.component, &component) != C2_OK) {
+                fprintf(stderr, "Failed to create component %s\n", options.component.c_str());
+                return 1;
+            }
+
+            Options run = options;
+            if (isEncoder) run.sizes = {options.sizes[i]};
+            Result result;
+            success = runSession(component, run, &result);
+            component->release();
+            if (!success) {
+                fprintf(stderr, "Benchmark of %s failed\n", options.component.c_str());
+                return 1;
+            }
+            json += "  " + resultToJson(result) + (i + 1 < numRuns ? ",\n" : "\n");
+        }
+        json += "]\n";
+    }
+
+    if (options.output.empty()) {
+        printf("%s", json.c_str());
+    } else {
+        std::ofstream output(options.output);
+        output << json;
+        if (!output.good()) {
+            fprintf(stderr, "Failed to write results to %s\n", options.output.c_str());
+            return 1;
+        }
+    }
+    return success ? 0 : 1;
+}
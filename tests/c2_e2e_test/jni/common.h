@@ -77,19 +77,46 @@ protected:
     std::ifstream file_;
 };
 
-// Wrapper of std::ifstream for reading binary file.
-class CachedInputFileStream : public InputFile {
+// Read-only memory mapping of a whole file. The pages are loaded on demand and
+// can be reclaimed by the kernel, so large input files don't need to fit in
+// memory and aren't copied before being used.
+class MappedFile {
 public:
-    explicit CachedInputFileStream(std::string file_path);
+    explicit MappedFile(const std::string& file_path);
+    ~MappedFile();
 
-    // Read the given number of bytes to the buffer. Return the number of bytes
-    // read or -1 on error.
-    size_t Read(char* buffer, size_t size);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    void Rewind() override;
+    // Check if the file is mapped.
+    bool IsValid() const { return data_ != nullptr; }
+    // Get the mapped content of the file.
+    const char* GetData() const { return data_; }
+    size_t GetLength() const { return length_; }
 
 private:
-    std::vector<char> data_;
+    const char* data_ = nullptr;
+    size_t length_ = 0;
+};
+
+// Sequential reader of a memory-mapped binary file.
+class MappedInputFileStream {
+public:
+    explicit MappedInputFileStream(const std::string& file_path);
+
+    bool IsValid() const { return file_.IsValid(); }
+    size_t GetLength() const { return file_.GetLength(); }
+
+    // Return a pointer to the next |size| bytes of the file and advance the
+    // position past them, without copying. Return nullptr if less than |size|
+    // bytes are left.
+    const char* Read(size_t size);
+
+    // Set position to the beginning of the file.
+    void Rewind() { position_ = 0; }
+
+private:
+    MappedFile file_;
     size_t position_ = 0;
 };
 
@@ -18,13 +18,13 @@ namespace android {
 
 namespace {
 
-bool IsAnnexb3ByteStartCode(const std::string& data, size_t pos) {
+bool IsAnnexb3ByteStartCode(std::string_view data, size_t pos) {
     // The Annex-B 3-byte start code "\0\0\1" will be prefixed by NALUs per AU
     // except for the first one.
     return data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1;
 }
 
-bool IsAnnexb4ByteStartCode(const std::string& data, size_t pos) {
+bool IsAnnexb4ByteStartCode(std::string_view data, size_t pos) {
     // The Annex-B 4-byte start code "\0\0\0\1" will be prefixed by first NALU per
     // AU.
     return data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 0 && data[pos + 3] == 1;
@@ -34,7 +34,7 @@ bool IsAnnexb4ByteStartCode(const std::string& data, size_t pos) {
 // and update to |next_header_pos|. Return true if there is one; false
 // otherwise.
 // Note: this function should be used within an AU.
-bool GetPosForNextNALUHeader(const std::string& data, size_t* next_header_pos) {
+bool GetPosForNextNALUHeader(std::string_view data, size_t* next_header_pos) {
     size_t pos = *next_header_pos;
 
     // Annex-B 4-byte could be also found by IsAnnexb3ByteStartCode().
@@ -50,7 +50,7 @@ bool GetPosForNextNALUHeader(const std::string& data, size_t* next_header_pos) {
 
 // For H264, return data bytes of next AU fragment in |data| from |next_pos|,
 // and update the position to |next_pos|.
-std::string GetBytesForNextAU(const std::string& data, size_t* next_pos) {
+std::string_view GetBytesForNextAU(std::string_view data, size_t* next_pos) {
     // Helpful description:
     // https://en.wikipedia.org/wiki/Network_Abstraction_Layer
     size_t start_pos = *next_pos;
@@ -58,7 +58,7 @@ std::string GetBytesForNextAU(const std::string& data, size_t* next_pos) {
     if (pos + 4 > data.size()) {
         ALOGE("Invalid AU: Start code is less than 4 bytes.\n");
         *next_pos = data.size();
-        return std::string();
+        return std::string_view();
     }
 
     assert(IsAnnexb4ByteStartCode(data, pos));
@@ -77,14 +77,24 @@ std::string GetBytesForNextAU(const std::string& data, size_t* next_pos) {
 
 // For VP8/9, return data bytes of next frame in |data| from |next_pos|, and
 // update the position to |next_pos|.
-std::string GetBytesForNextFrame(const std::string& data, size_t* next_pos) {
+std::string_view GetBytesForNextFrame(std::string_view data, size_t* next_pos) {
     // Helpful description: http://wiki.multimedia.cx/index.php?title=IVF
     size_t pos = *next_pos;
-    std::string bytes;
     if (pos == 0) pos = 32;  // Skip IVF header.
+    if (pos + 12 > data.size()) {
+        ALOGE("Invalid IVF frame: Frame header is truncated.");
+        *next_pos = data.size();
+        return std::string_view();
+    }
 
-    const uint32_t frame_size = *reinterpret_cast<const uint32_t*>(&data[pos]);
+    uint32_t frame_size;
+    memcpy(&frame_size, &data[pos], sizeof(frame_size));
     pos += 12;  // Skip frame header.
+    if (frame_size > data.size() - pos) {
+        ALOGE("Invalid IVF frame: Frame is truncated.");
+        *next_pos = data.size();
+        return std::string_view();
+    }
 
     // Update next_pos.
     *next_pos = pos + frame_size;
@@ -94,32 +104,13 @@ std::string GetBytesForNextFrame(const std::string& data, size_t* next_pos) {
 }  // namespace
 
 EncodedDataHelper::EncodedDataHelper(const std::string& file_path, VideoCodecType type)
-      : type_(type) {
-    CachedInputFileStream input(file_path);
-    if (!input.IsValid()) {
+      : type_(type), file_(file_path) {
+    if (!file_.IsValid()) {
         ALOGE("Failed to open file: %s", file_path.c_str());
         return;
     }
 
-    int file_size = input.GetLength();
-    if (file_size <= 0) {
-        ALOGE("Stream byte size (=%d) is invalid", file_size);
-        return;
-    }
-    input.Rewind();
-
-    char* read_bytes = new char[file_size];
-    if (input.Read(read_bytes, file_size) != file_size) {
-        ALOGE("Failed to read input stream from file to buffer.");
-        return;
-    }
-
-    // Note: must assign |file_size| here otherwise the constructor will terminate
-    // copting at the first '\0' in |read_bytes|.
-    std::string data(read_bytes, file_size);
-    delete[] read_bytes;
-
-    SliceToFragments(data);
+    SliceToFragments(std::string_view(file_.GetData(), file_.GetLength()));
 }
 
 EncodedDataHelper::~EncodedDataHelper() {}
@@ -137,7 +128,7 @@ bool EncodedDataHelper::ReachEndOfStream() const {
     return next_fragment_iter_ == fragments_.end();
 }
 
-void EncodedDataHelper::SliceToFragments(const std::string& data) {
+void EncodedDataHelper::SliceToFragments(std::string_view data) {
     size_t next_pos = 0;
     bool seen_csd = false;
     while (next_pos < data.size()) {
@@ -154,6 +145,7 @@ void EncodedDataHelper::SliceToFragments(const std::string& data) {
         case VideoCodecType::VP8:
         case VideoCodecType::VP9:
             fragment->data = GetBytesForNextFrame(data, &next_pos);
+            if (fragment->data.empty()) continue;
             break;
         default:
             ALOGE("Unknown video codec type.");
@@ -7,6 +7,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "common.h"
@@ -15,7 +16,8 @@ namespace android {
 
 // Helper class for MediaCodecDecoder to read encoded stream from input file,
 // and slice it into fragments. MediaCodecDecoder could call GetNextFragment()
-// to obtain fragment data sequentially.
+// to obtain fragment data sequentially. The input file is memory-mapped and the
+// fragments refer to the mapping, so the stream is never copied.
 class EncodedDataHelper {
 public:
     EncodedDataHelper(const std::string& file_path, VideoCodecType type);
@@ -23,8 +25,9 @@ public:
 
     // A fragment will contain the bytes of one AU (H264) or frame (VP8/9) in
     // |data|, and |csd_flag| indicator for input buffer flag CODEC_CONFIG.
+    // |data| is only valid as long as the helper is alive.
     struct Fragment {
-        std::string data;
+        std::string_view data;
         bool csd_flag = false;
     };
 
@@ -49,7 +52,7 @@ private:
     };
 
     // Slice input stream into fragments. This should be done in constructor.
-    void SliceToFragments(const std::string& data);
+    void SliceToFragments(std::string_view data);
 
     // For H264, parse csd_flag from |fragment| data and store inside. Return true
     // if this fragment is in interest; false otherwise (fragment will be
@@ -57,6 +60,7 @@ private:
     bool ParseAUFragmentType(Fragment* fragment);
 
     VideoCodecType type_;
+    MappedFile file_;
     std::vector<std::unique_ptr<Fragment>> fragments_;
     std::vector<std::unique_ptr<Fragment>>::iterator next_fragment_iter_;
 };
@@ -7,6 +7,8 @@
 
 #include "mediacodec_encoder.h"
 
+#include <string.h>
+
 #include <memory>
 #include <string>
 #include <utility>
@@ -95,7 +97,7 @@ std::unique_ptr<MediaCodecEncoder> MediaCodecEncoder::Create(std::string input_p
     }
     size_t buffer_size = visible_size.width * visible_size.height * 3 / 2;
 
-    std::unique_ptr<CachedInputFileStream> input_file(new CachedInputFileStream(input_path));
+    std::unique_ptr<MappedInputFileStream> input_file(new MappedInputFileStream(input_path));
     if (!input_file->IsValid()) {
         ALOGE("Failed to open file: %s", input_path.c_str());
         return nullptr;
@@ -128,7 +130,7 @@ std::unique_ptr<MediaCodecEncoder> MediaCodecEncoder::Create(std::string input_p
 }
 
 MediaCodecEncoder::MediaCodecEncoder(AMediaCodec* codec, VideoCodecType type,
-                                     std::unique_ptr<CachedInputFileStream> input_file, Size size,
+                                     std::unique_ptr<MappedInputFileStream> input_file, Size size,
                                      size_t buffer_size, size_t num_total_frames)
       : kVisibleSize(size),
         kBufferSize(buffer_size),
@@ -157,8 +159,9 @@ void MediaCodecEncoder::Rewind() {
     input_file_->Rewind();
 }
 
-bool MediaCodecEncoder::Configure(int32_t bitrate, int32_t framerate) {
-    ALOGV("Configure encoder bitrate=%d, framerate=%d", bitrate, framerate);
+bool MediaCodecEncoder::Configure(int32_t bitrate, int32_t framerate, bool low_latency) {
+    ALOGV("Configure encoder bitrate=%d, framerate=%d, low_latency=%d", bitrate, framerate,
+          low_latency);
     AMediaFormat* format = AMediaFormat_new();
     AMediaFormat_setString(format, AMEDIAFORMAT_KEY_MIME, GetMimeType(type_));
     AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_PROFILE, GetProfile(type_));
@@ -169,6 +172,7 @@ bool MediaCodecEncoder::Configure(int32_t bitrate, int32_t framerate) {
     AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_HEIGHT, kVisibleSize.height);
     AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_BIT_RATE, bitrate);
     AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_FRAME_RATE, framerate);
+    if (low_latency) AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_LOW_LATENCY, 1);
     bool ret = AMediaCodec_configure(codec_, format, nullptr /* surface */, nullptr /* crtpto */,
                                      AMEDIACODEC_CONFIGURE_FLAG_ENCODE) == AMEDIA_OK;
     AMediaFormat_delete(format);
@@ -260,10 +264,13 @@ bool MediaCodecEncoder::FeedInputBuffer(size_t index) {
         return false;
     }
 
-    if (input_file_->Read(reinterpret_cast<char*>(buf), kBufferSize) != kBufferSize) {
+    // The frame is copied straight from the mapped input file into the codec's buffer.
+    const char* frame = input_file_->Read(kBufferSize);
+    if (!frame) {
         ALOGE("Failed to read buffer from file.");
         return false;
     }
+    memcpy(buf, frame, kBufferSize);
 
     // We circularly encode the video stream if the frame number is not enough.
     ++input_frame_index_;
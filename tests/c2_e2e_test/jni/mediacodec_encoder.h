@@ -34,8 +34,9 @@ public:
     // Rewind the frame index to the beginning of the input stream.
     void Rewind();
 
-    // Wrapper of AMediaCodec_configure.
-    bool Configure(int32_t bitrate, int32_t framerate);
+    // Wrapper of AMediaCodec_configure. If |low_latency| is set the encoder is configured to
+    // output each frame as soon as possible.
+    bool Configure(int32_t bitrate, int32_t framerate, bool low_latency = false);
 
     // Wrapper of AMediaCodec_start.
     bool Start();
@@ -55,7 +56,7 @@ public:
 
 private:
     MediaCodecEncoder(AMediaCodec* codec, VideoCodecType type,
-                      std::unique_ptr<CachedInputFileStream> inputFile, Size size,
+                      std::unique_ptr<MappedInputFileStream> inputFile, Size size,
                       size_t bufferSize, size_t numTotalFrames);
 
     // Read the content from the |input_file_| and feed into the input buffer.
@@ -87,7 +88,7 @@ private:
     size_t num_encoded_frames_;
     // The input video raw stream file. The file size must be the multiple of
     // |kBufferSize|.
-    std::unique_ptr<CachedInputFileStream> input_file_;
+    std::unique_ptr<MappedInputFileStream> input_file_;
     // The target output bitrate.
     int bitrate_ = 192000;
     // The target output framerate.
@@ -7,10 +7,14 @@
 
 #include <getopt.h>
 
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -34,11 +38,13 @@ C2VideoDecoderTestEnvironment* g_env;
 class C2VideoDecoderTestEnvironment : public testing::Environment {
 public:
     C2VideoDecoderTestEnvironment(bool loop, bool use_sw_decoder, bool use_fake_renderer,
-                                  const std::string& data, const std::string& output_frames_path,
-                                  ANativeWindow* surface, ConfigureCallback* cb)
+                                  bool no_verify, const std::string& data,
+                                  const std::string& output_frames_path, ANativeWindow* surface,
+                                  ConfigureCallback* cb)
           : loop_(loop),
             use_sw_decoder_(use_sw_decoder),
             use_fake_renderer_(use_fake_renderer),
+            no_verify_(no_verify),
             test_video_data_(data),
             output_frames_path_(output_frames_path),
             surface_(surface),
@@ -105,6 +111,7 @@ public:
     bool loop() const { return loop_; }
     bool use_sw_decoder() const { return use_sw_decoder_; }
     bool use_fake_renderer() const { return use_fake_renderer_; }
+    bool no_verify() const { return no_verify_; }
 
     ANativeWindow* surface() const { return surface_; }
 
@@ -112,6 +119,7 @@ protected:
     bool loop_;
     bool use_sw_decoder_;
     bool use_fake_renderer_;
+    bool no_verify_;
     std::string test_video_data_;
     std::string output_frames_path_;
 
@@ -134,11 +142,15 @@ struct OutputFormat {
 };
 
 // The helper class to validate video frame by MD5 and output to I420 raw stream
-// if needed.
+// if needed. The MD5 of the frames is computed on a worker thread, so the
+// output buffers are returned to the decoder without waiting for it.
 class VideoFrameValidator {
 public:
     VideoFrameValidator() = default;
-    ~VideoFrameValidator() { output_file_.close(); }
+    ~VideoFrameValidator() {
+        StopVerifier();
+        output_file_.close();
+    }
 
     // Set |md5_golden_path| as the path of golden frame-wise MD5 file. Return
     // false if the file is failed to read.
@@ -178,10 +190,33 @@ public:
         ASSERT_TRUE(video_frame) << "Failed to create video frame on VerifyMD5 at frame#"
                                  << output_index;
 
-        ASSERT_TRUE(video_frame->VerifyMD5(golden)) << "MD5 mismatched at frame#" << output_index;
+        // The HAL format of flexible frames is matched by their MD5, which the
+        // following frames depend on, and the frame isn't copied until matched.
+        // So this is verified synchronously, at most once per format change.
+        if (output_format_.color_format == VideoFrame::YUV_420_FLEXIBLE) {
+            ASSERT_TRUE(video_frame->VerifyMD5(golden))
+                    << "MD5 mismatched at frame#" << output_index;
+
+            // Update color_format.
+            output_format_.color_format = video_frame->color_format();
+            return;
+        }
+
+        // Other frames were copied out of the output buffer on creation.
+        std::lock_guard<std::mutex> lock(verify_mutex_);
+        if (!verifier_.joinable()) {
+            verifier_ = std::thread(&VideoFrameValidator::VerifierLoop, this);
+        }
+        pending_frames_.push_back({std::move(video_frame), std::move(golden), output_index});
+        verify_cv_.notify_all();
+    }
 
-        // Update color_format.
-        output_format_.color_format = video_frame->color_format();
+    // Wait until the MD5 of all frames passed to VerifyMD5() was verified.
+    // Return the number of mismatched frames.
+    int WaitForVerification() {
+        std::unique_lock<std::mutex> lock(verify_mutex_);
+        verify_cv_.wait(lock, [this]() { return pending_frames_.empty() && !verifying_; });
+        return num_mismatched_frames_;
     }
 
     // Callback function of output buffer ready to validate frame data by
@@ -212,6 +247,40 @@ public:
     }
 
 private:
+    struct PendingFrame {
+        std::unique_ptr<VideoFrame> frame;
+        std::string golden;
+        int output_index;
+    };
+
+    void VerifierLoop() {
+        std::unique_lock<std::mutex> lock(verify_mutex_);
+        while (true) {
+            verify_cv_.wait(lock, [this]() { return stop_verifier_ || !pending_frames_.empty(); });
+            if (pending_frames_.empty()) return;
+
+            PendingFrame pending = std::move(pending_frames_.front());
+            pending_frames_.pop_front();
+            verifying_ = true;
+            lock.unlock();
+            const bool matched = pending.frame->VerifyMD5(pending.golden);
+            if (!matched) printf("[ERR] MD5 mismatched at frame#%d\n", pending.output_index);
+            lock.lock();
+            verifying_ = false;
+            if (!matched) num_mismatched_frames_++;
+            verify_cv_.notify_all();
+        }
+    }
+
+    void StopVerifier() {
+        {
+            std::lock_guard<std::mutex> lock(verify_mutex_);
+            stop_verifier_ = true;
+            verify_cv_.notify_all();
+        }
+        if (verifier_.joinable()) verifier_.join();
+    }
+
     // The wrapper of input MD5 golden file.
     std::unique_ptr<InputFileASCII> golden_md5_file_;
     // The output file to write the decoded raw video.
@@ -222,6 +291,15 @@ private:
     // This records output format, color_format might be revised in flexible
     // format case.
     OutputFormat output_format_;
+
+    // The worker thread verifying the MD5 of |pending_frames_|.
+    std::thread verifier_;
+    std::mutex verify_mutex_;
+    std::condition_variable verify_cv_;
+    std::deque<PendingFrame> pending_frames_;
+    bool verifying_ = false;
+    bool stop_verifier_ = false;
+    int num_mismatched_frames_ = 0;
 };
 
 class C2VideoDecoderE2ETest : public testing::Test {
@@ -325,12 +403,16 @@ private:
 TEST_F(C2VideoDecoderByteBufferE2ETest, TestSimpleDecode) {
     VideoFrameValidator video_frame_validator;
 
-    ASSERT_TRUE(video_frame_validator.SetGoldenMD5File(g_env->GoldenMD5FilePath()))
-            << "Failed to open MD5 file: " << g_env->GoldenMD5FilePath();
+    // In no-verify mode the decoded frames are only counted, so the measured FPS
+    // reflects the decoder's throughput.
+    if (!g_env->no_verify()) {
+        ASSERT_TRUE(video_frame_validator.SetGoldenMD5File(g_env->GoldenMD5FilePath()))
+                << "Failed to open MD5 file: " << g_env->GoldenMD5FilePath();
 
-    decoder_->AddOutputBufferReadyCb(std::bind(&VideoFrameValidator::VerifyMD5,
-                                               &video_frame_validator, std::placeholders::_1,
-                                               std::placeholders::_2, std::placeholders::_3));
+        decoder_->AddOutputBufferReadyCb(std::bind(&VideoFrameValidator::VerifyMD5,
+                                                   &video_frame_validator, std::placeholders::_1,
+                                                   std::placeholders::_2, std::placeholders::_3));
+    }
 
     if (video_frame_validator.SetOutputFile(g_env->output_frames_path())) {
         decoder_->AddOutputBufferReadyCb(std::bind(&VideoFrameValidator::OutputToFile,
@@ -342,7 +424,17 @@ TEST_F(C2VideoDecoderByteBufferE2ETest, TestSimpleDecode) {
                                                  &video_frame_validator, std::placeholders::_1,
                                                  std::placeholders::_2, std::placeholders::_3));
 
+    FPSCalculator fps_calculator;
+    decoder_->AddOutputBufferReadyCb([&fps_calculator](const uint8_t* /* data */,
+                                                       size_t /* buffer_size */,
+                                                       int /* output_index */) {
+        ASSERT_TRUE(fps_calculator.RecordFrameTimeDiff());
+    });
+
     EXPECT_TRUE(decoder_->Decode());
+    printf("[LOG] Measured decoder FPS: %.4f\n", fps_calculator.CalculateFPS());
+
+    EXPECT_EQ(video_frame_validator.WaitForVerification(), 0) << "MD5 mismatched";
 }
 
 void C2VideoDecoderE2ETest::TestFPSBody() {
@@ -373,7 +465,7 @@ TEST_F(C2VideoDecoderSurfaceNoRenderE2ETest, TestFPS) {
 }  // namespace android
 
 bool GetOption(int argc, char** argv, std::string* test_video_data, std::string* output_frames_path,
-               bool* loop, bool* use_sw_decoder, bool* use_fake_renderer) {
+               bool* loop, bool* use_sw_decoder, bool* use_fake_renderer, bool* no_verify) {
     const char* const optstring = "t:o:";
     static const struct option opts[] = {
             {"test_video_data", required_argument, nullptr, 't'},
@@ -381,6 +473,7 @@ bool GetOption(int argc, char** argv, std::string* test_video_data, std::string*
             {"loop", no_argument, nullptr, 'l'},
             {"use_sw_decoder", no_argument, nullptr, 's'},
             {"fake_renderer", no_argument, nullptr, 'f'},
+            {"no_verify", no_argument, nullptr, 'n'},
             {nullptr, 0, nullptr, 0},
     };
 
@@ -403,6 +496,9 @@ bool GetOption(int argc, char** argv, std::string* test_video_data, std::string*
         case 'f':
             *use_fake_renderer = true;
             break;
+        case 'n':
+            *no_verify = true;
+            break;
         default:
             printf("[WARN] Unknown option: getopt_long() returned code 0x%x.\n", opt);
             break;
@@ -423,8 +519,9 @@ int RunDecoderTests(char** test_args, int test_args_count, ANativeWindow* surfac
     bool loop = false;
     bool use_sw_decoder = false;
     bool use_fake_renderer = false;
+    bool no_verify = false;
     if (!GetOption(test_args_count, test_args, &test_video_data, &output_frames_path, &loop,
-                   &use_sw_decoder, &use_fake_renderer)) {
+                   &use_sw_decoder, &use_fake_renderer, &no_verify)) {
         ALOGE("GetOption failed");
         return EXIT_FAILURE;
     }
@@ -432,7 +529,7 @@ int RunDecoderTests(char** test_args, int test_args_count, ANativeWindow* surfac
     if (android::g_env == nullptr) {
         android::g_env = reinterpret_cast<android::C2VideoDecoderTestEnvironment*>(
                 testing::AddGlobalTestEnvironment(new android::C2VideoDecoderTestEnvironment(
-                        loop, use_sw_decoder, use_fake_renderer, test_video_data,
+                        loop, use_sw_decoder, use_fake_renderer, no_verify, test_video_data,
                         output_frames_path, surface, cb)));
     } else {
         ALOGE("Trying to reuse test process");
@@ -344,6 +344,27 @@ TEST_F(C2VideoEncoderE2ETest, PerfLatency) {
     recorder.PrintResult();
 }
 
+TEST_F(C2VideoEncoderE2ETest, PerfLowLatency) {
+    // Reconfigure the encoder in low-latency mode.
+    ASSERT_TRUE(encoder_->Stop());
+    ASSERT_TRUE(encoder_->Configure(static_cast<int32_t>(g_env->requested_bitrate()),
+                                    static_cast<int32_t>(g_env->requested_framerate()),
+                                    true /* low_latency */));
+    ASSERT_TRUE(encoder_->Start());
+
+    // Measure the time between queueing each input frame and receiving its bitstream.
+    LatencyRecorder recorder;
+    encoder_->SetEncodeInputBufferCb(
+            std::bind(&LatencyRecorder::OnEncodeInputBuffer, &recorder, std::placeholders::_1));
+    encoder_->SetOutputBufferReadyCb(std::bind(&LatencyRecorder::OnOutputBufferReady, &recorder,
+                                               std::placeholders::_1, std::placeholders::_2));
+    encoder_->set_run_at_fps(true);
+
+    EXPECT_TRUE(encoder_->Encode());
+
+    recorder.PrintResult();
+}
+
 }  // namespace android
 
 bool GetOption(int argc, char** argv, android::CmdlineArgs* args) {
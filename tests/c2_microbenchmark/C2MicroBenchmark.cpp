@@ -0,0 +1,212 @@
+// Copyright 2023 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "C2MicroBenchmark"
+
+// Microbenchmarks of the CPU hot paths of the components: the input format conversion of the
+// encoder and the H.264 NAL unit parsing and rewriting done on every encoded frame. Besides the
+// time per iteration, the time per processed byte (bitstreams) or pixel (frames) is reported in
+// nanoseconds. Use --benchmark_format=json for machine-readable output.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <iterator>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <C2AllocatorGralloc.h>
+#include <C2Buffer.h>
+#include <C2PlatformSupport.h>
+#include <benchmark/benchmark.h>
+#include <log/log.h>
+#include <system/graphics.h>
+#include <ui/Size.h>
+
+#include <v4l2_codec2/common/EncodeHelpers.h>
+#include <v4l2_codec2/common/FormatConverter.h>
+#include <v4l2_codec2/common/NalParser.h>
+#include <v4l2_codec2/common/VideoPixelFormat.h>
+
+namespace android {
+namespace {
+
+// The number of non-IDR frames following the IDR frame in the generated bitstreams.
+constexpr size_t kNumNonIDRFrames = 29;
+
+// Set the ns/byte (or ns/pixel) |name| counter of |state| for |count| units per iteration. Counters
+// flagged with kIsRate | kInvert report seconds per unit, the count is scaled to get nanoseconds.
+void setTimePerUnitCounter(benchmark::State& state, const char* name, size_t count) {
+    state.counters[name] =
+            benchmark::Counter(static_cast<double>(count) * state.iterations() * 1e-9,
+                               benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+// Append a NAL unit of specified |type| with |size| bytes of random payload to |stream|, preceded
+// by a 4-byte start code. Emulation prevention bytes are inserted so the payload doesn't contain
+// start codes, as in a real bitstream.
+void appendNalUnit(uint8_t type, size_t size, std::mt19937* random, std::vector<uint8_t>* stream) {
+    static constexpr uint8_t kStartCode[] = {0x00, 0x00, 0x00, 0x01};
+    stream->insert(stream->end(), std::begin(kStartCode), std::end(kStartCode));
+    // nal_ref_idc = 3 for parameter sets and IDR slices, 2 for non-IDR slices.
+    stream->push_back(((type == NalParser::kNonIDRType) ? 0x40 : 0x60) | type);
+
+    std::uniform_int_distribution<int> byte(0, 255);
+    size_t zeros = 0;
+    for (size_t i = 1; i < size; ++i) {
+        uint8_t value = static_cast<uint8_t>(byte(*random));
+        if (zeros >= 2 && value <= 0x03) {
+            stream->push_back(0x03);
+            zeros = 0;
+        }
+        stream->push_back(value);
+        zeros = (value == 0) ? zeros + 1 : 0;
+    }
+    // The last byte of a NAL unit contains the RBSP stop bit, so it's never zero.
+    stream->push_back(0x80);
+}
+
+// Create an H.264 access unit of |frameSize| bytes. IDR access units are preceded by an SPS and
+// PPS if |withParameterSets| is set.
+std::vector<uint8_t> createAccessUnit(bool idr, size_t frameSize, bool withParameterSets) {
+    std::mt19937 random(frameSize);
+    std::vector<uint8_t> accessUnit;
+    if (idr && withParameterSets) {
+        appendNalUnit(NalParser::kSPSType, 12, &random, &accessUnit);
+        appendNalUnit(NalParser::kPPSType, 4, &random, &accessUnit);
+    }
+    appendNalUnit(idr ? NalParser::kIDRType : NalParser::kNonIDRType, frameSize, &random,
+                  &accessUnit);
+    return accessUnit;
+}
+
+// Create a GOP of an IDR frame of |idrSize| bytes followed by non-IDR frames of a tenth that size,
+// a typical ratio for camera content.
+std::vector<uint8_t> createGop(size_t idrSize) {
+    std::vector<uint8_t> stream = createAccessUnit(true, idrSize, true);
+    for (size_t i = 0; i < kNumNonIDRFrames; ++i) {
+        std::vector<uint8_t> frame = createAccessUnit(false, idrSize / 10, false);
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    return stream;
+}
+
+void BM_NalParserLocateNextNal(benchmark::State& state) {
+    const std::vector<uint8_t> stream = createGop(state.range(0));
+    for (auto _ : state) {
+        NalParser parser(stream.data(), stream.size());
+        size_t numNalUnits = 0;
+        while (parser.locateNextNal()) numNalUnits++;
+        benchmark::DoNotOptimize(numNalUnits);
+    }
+    state.SetBytesProcessed(state.iterations() * stream.size());
+    setTimePerUnitCounter(state, "ns_per_byte", stream.size());
+}
+
+// Extracting the SPS and PPS from an IDR frame stops after the PPS, while a non-IDR frame without
+// parameter sets is scanned entirely.
+void BM_ExtractSPSPPS(benchmark::State& state) {
+    const bool idr = state.range(1);
+    const std::vector<uint8_t> accessUnit = createAccessUnit(idr, state.range(0), true);
+    std::vector<uint8_t> sps, pps;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(extractSPSPPS(accessUnit.data(), accessUnit.size(), &sps, &pps));
+    }
+    state.SetBytesProcessed(state.iterations() * accessUnit.size());
+    setTimePerUnitCounter(state, "ns_per_byte", accessUnit.size());
+}
+
+// Prepend the cached SPS and PPS to a large IDR frame, as done when encoding with
+// C2PrependHeaderModeSetting::PREPEND_HEADER_TO_ALL_SYNC.
+void BM_PrependSPSPPSToIDR(benchmark::State& state) {
+    const std::vector<uint8_t> accessUnit = createAccessUnit(true, state.range(0), false);
+    std::vector<uint8_t> sps(12, 0x42), pps(4, 0xce);
+    std::vector<uint8_t> dst(accessUnit.size() + 64);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(prependSPSPPSToIDR(accessUnit.data(), accessUnit.size(),
+                                                    dst.data(), dst.size(), &sps, &pps));
+    }
+    state.SetBytesProcessed(state.iterations() * accessUnit.size());
+    setTimePerUnitCounter(state, "ns_per_byte", accessUnit.size());
+}
+
+// Convert frames of the HAL format |state.range(2)| to NV12 using the FormatConverter. The block
+// is returned after each conversion, so the same output block is used by every iteration.
+void BM_FormatConverterConvertBlock(benchmark::State& state) {
+    const ui::Size size(state.range(0), state.range(1));
+    const uint32_t halFormat = static_cast<uint32_t>(state.range(2));
+
+    std::shared_ptr<C2BlockPool> pool;
+    std::shared_ptr<C2GraphicBlock> block;
+    const C2MemoryUsage usage = {C2MemoryUsage::CPU_READ, C2MemoryUsage::CPU_WRITE};
+    if (GetCodec2BlockPool(C2BlockPool::BASIC_GRAPHIC, nullptr, &pool) != C2_OK ||
+        pool->fetchGraphicBlock(size.width, size.height, halFormat, usage, &block) != C2_OK) {
+        state.SkipWithError("Failed to allocate input block");
+        return;
+    }
+    {
+        // Fill the frame with noise, so the conversion doesn't operate on zero pages.
+        C2GraphicView view = block->map().get();
+        std::mt19937 random(size.width * size.height);
+        std::uniform_int_distribution<int> byte(0, 255);
+        const C2PlanarLayout& layout = view.layout();
+        for (uint32_t i = 0; i < layout.rootPlanes; ++i) {
+            const C2PlaneInfo& plane = layout.planes[i];
+            const uint32_t rowBytes =
+                    view.width() / plane.colSampling * plane.colInc - (plane.colInc - 1);
+            for (uint32_t y = 0; y < view.height() / plane.rowSampling; ++y) {
+                uint8_t* row = view.data()[i] + y * plane.rowInc;
+                for (uint32_t x = 0; x < rowBytes; ++x) row[x] = static_cast<uint8_t>(byte(random));
+            }
+        }
+    }
+
+    std::unique_ptr<FormatConverter> converter =
+            FormatConverter::Create(VideoPixelFormat::NV12, size, size, 1, size);
+    if (!converter) {
+        state.SkipWithError("Failed to create format converter");
+        return;
+    }
+
+    const C2ConstGraphicBlock inputBlock = block->share(C2Rect(size.width, size.height), C2Fence());
+    uint64_t frameIndex = 0;
+    for (auto _ : state) {
+        c2_status_t status = C2_CORRUPTED;
+        benchmark::DoNotOptimize(converter->convertBlock(frameIndex, inputBlock, &status));
+        if (status != C2_OK) {
+            state.SkipWithError("Failed to convert block");
+            return;
+        }
+        converter->returnBlock(frameIndex++);
+    }
+
+    const size_t numPixels = static_cast<size_t>(size.width) * size.height;
+    state.SetItemsProcessed(state.iterations());
+    setTimePerUnitCounter(state, "ns_per_pixel", numPixels);
+}
+
+void formatConverterArgs(benchmark::internal::Benchmark* benchmark) {
+    constexpr int kSizes[][2] = {{640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+    constexpr int kFormats[] = {HAL_PIXEL_FORMAT_YV12, HAL_PIXEL_FORMAT_YCrCb_420_SP,
+                                HAL_PIXEL_FORMAT_RGBA_8888};
+    benchmark->ArgNames({"width", "height", "hal_format"});
+    for (const auto& size : kSizes) {
+        for (int format : kFormats) benchmark->Args({size[0], size[1], format});
+    }
+}
+
+// IDR frame sizes range from small (480p) to large (4K intra) frames.
+BENCHMARK(BM_NalParserLocateNextNal)->ArgName("idr_size")->Range(16 << 10, 2 << 20);
+BENCHMARK(BM_ExtractSPSPPS)
+        ->ArgNames({"frame_size", "idr"})
+        ->Ranges({{16 << 10, 2 << 20}, {0, 1}});
+BENCHMARK(BM_PrependSPSPPSToIDR)->ArgName("idr_size")->Range(16 << 10, 2 << 20);
+BENCHMARK(BM_FormatConverterConvertBlock)->Apply(formatConverterArgs)->UseRealTime();
+
+}  // namespace
+}  // namespace android
+
+BENCHMARK_MAIN();